@@ -8,16 +8,41 @@
 #include <lib/ddk/debug.h>
 #include <lib/ddk/device.h>
 #include <lib/ddk/driver.h>
+#include <lib/ddk/metadata.h>
 #include <lib/ddk/platform-defs.h>
 #include <lib/device-protocol/pdev.h>
+#include <lib/inspect/cpp/inspect.h>
 #include <lib/mmio/mmio.h>
+#include <lib/zx/bti.h>
+#include <lib/zx/clock.h>
+#include <lib/zx/interrupt.h>
+#include <lib/zx/pmt.h>
+#include <lib/zx/port.h>
+#include <lib/zx/time.h>
 #include <lib/zx/vmo.h>
+#include <threads.h>
+#include <zircon/status.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <map>
+#include <optional>
+#include <vector>
 
 #include <ddktl/device.h>
 #include <ddktl/fidl.h>
 #include <fbl/alloc_checker.h>
+#include <fbl/auto_lock.h>
+#include <fbl/mutex.h>
 
+#include <fidl/fuchsia.sysmem/cpp/wire.h>
 #include <fuchsia/hardware/display/controller/cpp/banjo.h>
+#include <fuchsia/hardware/sysmem/cpp/banjo.h>
+
+#include "../../../../drivers/common/soliloquy_hal/clock_reset.h"
+#include "../../../../drivers/common/soliloquy_hal/metrics.h"
+#include "../dts/sun55i-a527-ccu.h"
 
 namespace soliloquy_display {
 
@@ -25,22 +50,369 @@ namespace soliloquy_display {
 constexpr uint32_t kDE3_BASE = 0x01000000;
 constexpr uint32_t kTCON_BASE = 0x05461000;
 
+// Mixer 0, relative to the DE MMIO region. Channel 0 is a VI (video)
+// channel, channels 1-3 are UI channels; each feeds one blender pipe.
+constexpr uint32_t kMixer0 = 0x100000;
+constexpr uint32_t kGLB_CTL = kMixer0 + 0x0000;     // Global Control
+constexpr uint32_t kGLB_DBUFFER = kMixer0 + 0x0008; // Double Buffer Latch
+constexpr uint32_t kGLB_SIZE = kMixer0 + 0x000C;    // Output Size
+constexpr uint32_t kGLB_CTL_RT_EN = 1u << 0;
+// Writing 1 copies the shadow registers at the next vblank; self-clears.
+constexpr uint32_t kGLB_DBUFFER_LOAD = 1u << 0;
+
+constexpr uint32_t kBLD = kMixer0 + 0x0800;
+constexpr uint32_t kBLD_PIPE_CTL = kBLD + 0x00;     // Pipe Enable / Fill
+constexpr uint32_t kBLD_ROUTE = kBLD + 0x80;        // Pipe -> Channel
+constexpr uint32_t kBLD_PREMULTIPLY = kBLD + 0x84;  // Premultiplied Pipes
+constexpr uint32_t kBLD_BK_COLOR = kBLD + 0x88;     // Background
+constexpr uint32_t kBLD_SIZE = kBLD + 0x8C;         // Output Size
+constexpr uint32_t kBLD_PIPE_EN_SHIFT = 8;
+constexpr uint32_t kBLD_MODE_SRC_OVER = 0x03010301;
+constexpr uint32_t BldInputSize(uint32_t pipe) { return kBLD + 0x08 + pipe * 0x10; }
+constexpr uint32_t BldInputOffset(uint32_t pipe) { return kBLD + 0x0C + pipe * 0x10; }
+constexpr uint32_t BldMode(uint32_t pipe) { return kBLD + 0x90 + pipe * 0x04; }
+
+constexpr uint32_t kChannelCount = 4;
+constexpr uint32_t kViChannel = 0;
+constexpr uint32_t ChannelBase(uint32_t channel) { return kMixer0 + 0x1000 + channel * 0x800; }
+
+// Layer 0 of a channel. The VI and UI register layouts differ past PITCH.
+constexpr uint32_t kCH_ATTR = 0x00;
+constexpr uint32_t kCH_SIZE = 0x04;
+constexpr uint32_t kCH_COORD = 0x08;
+constexpr uint32_t kCH_PITCH = 0x0C;
+constexpr uint32_t kUI_TOP_LADDR = 0x10;
+constexpr uint32_t kUI_TOP_HADDR = 0x80;
+constexpr uint32_t kUI_OVL_SIZE = 0x88;
+constexpr uint32_t kVI_TOP_LADDR = 0x18;
+constexpr uint32_t kVI_TOP_HADDR = 0x80;
+constexpr uint32_t kVI_OVL_SIZE = 0xE8;
+
+constexpr uint32_t kATTR_EN = 1u << 0;
+constexpr uint32_t kATTR_ALPHA_PIXEL = 0u << 1;
+constexpr uint32_t kATTR_ALPHA_GLOBAL = 1u << 1;
+constexpr uint32_t kATTR_ALPHA_MIXED = 2u << 1;
+constexpr uint32_t kATTR_ALPHA_MASK = 3u << 1;
+constexpr uint32_t kATTR_FORMAT_SHIFT = 8;
+constexpr uint32_t kATTR_VI_RGB_MODE = 1u << 15;
+constexpr uint32_t kATTR_GLOBAL_ALPHA_SHIFT = 24;
+
+constexpr uint32_t kFORMAT_ARGB8888 = 0x00;
+constexpr uint32_t kFORMAT_XRGB8888 = 0x04;
+
+// TCON global interrupt register. HDMI is driven by TCON1 (TV); its
+// vblank flag is cleared by writing 0.
+constexpr uint32_t kTCON_GINT0 = 0x04;
+constexpr uint32_t kTCON_GINT0_TCON1_VB_INT_EN = 1u << 30;
+constexpr uint32_t kTCON_GINT0_TCON1_VB_INT_FLAG = 1u << 14;
+
+// TCON1 timing generator. Totals and porches are programmed minus one,
+// except the vertical total, which counts fields (twice the lines).
+constexpr uint32_t kTCON1_CTL = 0x90;
+constexpr uint32_t kTCON1_BASIC0 = 0x94;  // Input Size
+constexpr uint32_t kTCON1_BASIC1 = 0x98;  // Upscale Size
+constexpr uint32_t kTCON1_BASIC2 = 0x9C;  // Output Size
+constexpr uint32_t kTCON1_BASIC3 = 0xA0;  // H Total / H Back Porch
+constexpr uint32_t kTCON1_BASIC4 = 0xA4;  // V Total / V Back Porch
+constexpr uint32_t kTCON1_BASIC5 = 0xA8;  // H Sync / V Sync Width
+constexpr uint32_t kTCON1_CTL_EN = 1u << 31;
+constexpr uint32_t kTCON1_CTL_START_DELAY_SHIFT = 4;
+constexpr uint32_t kTCON1_CTL_START_DELAY_MASK = 0x1Fu << 4;
+
+// DesignWare HDMI TX, byte-wide registers. The frame composer has to match
+// the TCON timing; the I2C master reads the sink's EDID over DDC.
+constexpr uint32_t kHDMI_IH_I2CM_STAT0 = 0x0105;
+constexpr uint32_t kHDMI_IH_MUTE_I2CM_STAT0 = 0x0185;
+constexpr uint8_t kHDMI_I2CM_STAT0_ERROR = 1u << 0;
+constexpr uint8_t kHDMI_I2CM_STAT0_DONE = 1u << 1;
+
+constexpr uint32_t kHDMI_FC_INVIDCONF = 0x1000;
+constexpr uint32_t kHDMI_FC_INHACTV0 = 0x1001;
+constexpr uint32_t kHDMI_FC_INHBLANK0 = 0x1003;
+constexpr uint32_t kHDMI_FC_INVACTV0 = 0x1005;
+constexpr uint32_t kHDMI_FC_INVBLANK = 0x1007;
+constexpr uint32_t kHDMI_FC_HSYNCINDELAY0 = 0x1008;
+constexpr uint32_t kHDMI_FC_HSYNCINWIDTH0 = 0x100A;
+constexpr uint32_t kHDMI_FC_VSYNCINDELAY = 0x100C;
+constexpr uint32_t kHDMI_FC_VSYNCINWIDTH = 0x100D;
+constexpr uint8_t kHDMI_FC_INVIDCONF_VSYNC_HIGH = 1u << 6;
+constexpr uint8_t kHDMI_FC_INVIDCONF_HSYNC_HIGH = 1u << 5;
+constexpr uint8_t kHDMI_FC_INVIDCONF_DE_HIGH = 1u << 4;
+constexpr uint8_t kHDMI_FC_INVIDCONF_HDMI_MODE = 1u << 3;
+
+constexpr uint32_t kHDMI_I2CM_SLAVE = 0x7E00;
+constexpr uint32_t kHDMI_I2CM_ADDRESS = 0x7E01;
+constexpr uint32_t kHDMI_I2CM_OPERATION = 0x7E04;
+constexpr uint32_t kHDMI_I2CM_INT = 0x7E05;
+constexpr uint32_t kHDMI_I2CM_CTLINT = 0x7E06;
+constexpr uint32_t kHDMI_I2CM_DIV = 0x7E07;
+constexpr uint32_t kHDMI_I2CM_SEGADDR = 0x7E08;
+constexpr uint32_t kHDMI_I2CM_SOFTRSTZ = 0x7E09;
+constexpr uint32_t kHDMI_I2CM_SEGPTR = 0x7E0A;
+constexpr uint32_t kHDMI_I2CM_READ_BUFF0 = 0x7E20;
+constexpr uint8_t kHDMI_I2CM_OPERATION_RD8 = 1u << 2;
+constexpr uint8_t kHDMI_I2CM_OPERATION_RD8_EXT = 1u << 3;
+constexpr uint8_t kHDMI_I2CM_INT_DONE_POL = 1u << 3;
+constexpr uint8_t kHDMI_I2CM_CTLINT_ARB_POL = 1u << 7;
+constexpr uint8_t kHDMI_I2CM_CTLINT_NAC_POL = 1u << 3;
+constexpr uint32_t kI2CM_BURST = 8;
+
+// DDC addresses of the EDID EEPROM and the E-DDC segment pointer.
+constexpr uint8_t kDdcEdidAddr = 0x50;
+constexpr uint8_t kDdcSegmentAddr = 0x30;
+constexpr size_t kEdidBlockSize = 128;
+constexpr size_t kMaxEdidBlocks = 4;
+// Manufacturer, product code, serial number and date: enough to tell
+// whether the sink is the one a cached timing was parsed from.
+constexpr size_t kEdidIdOffset = 8;
+constexpr size_t kEdidIdSize = 10;
+
+constexpr uint32_t PackSize(uint32_t width, uint32_t height) {
+  return ((height - 1) << 16) | (width - 1);
+}
+
+constexpr uint32_t kModeHsyncHigh = 1u << 0;
+constexpr uint32_t kModeVsyncHigh = 1u << 1;
+
 // Display mode configuration
 struct DisplayMode {
   uint32_t width;
   uint32_t height;
   uint32_t refresh_hz;
   uint32_t pixel_clock_khz;
+  uint32_t h_front_porch;
+  uint32_t h_sync;
+  uint32_t h_back_porch;
+  uint32_t v_front_porch;
+  uint32_t v_sync;
+  uint32_t v_back_porch;
+  uint32_t flags;  // kMode*
 };
 
-// Default 720p mode for development
+// Default 720p mode for development (CEA-861 VIC 4)
 constexpr DisplayMode kDefaultMode = {
     .width = 1280,
     .height = 720,
     .refresh_hz = 60,
     .pixel_clock_khz = 74250,
+    .h_front_porch = 110,
+    .h_sync = 40,
+    .h_back_porch = 220,
+    .v_front_porch = 5,
+    .v_sync = 5,
+    .v_back_porch = 20,
+    .flags = kModeHsyncHigh | kModeVsyncHigh,
+};
+
+// Pixel clock used when the board does not give one: 1080p at 120Hz or 4K
+// at 30Hz, the HDMI 1.4 TMDS limit.
+constexpr uint32_t kDefaultMaxPixelClockKhz = 297000;
+
+// The TCON divides the video PLL by 2^N * M, N up to 3 and M up to 16.
+constexpr uint32_t kTconMaxN = 3;
+constexpr uint32_t kTconMaxM = 16;
+constexpr uint64_t kVideoPllMaxHz = 2'400'000'000;
+// Sinks accept a pixel clock up to 0.5% off the mode's.
+constexpr uint64_t kPixelClockToleranceDiv = 200;
+
+// The mode picked on an earlier boot, saved by the bootloader, so a known
+// sink can be brought up without reading and parsing its whole EDID.
+struct CachedMode {
+  uint8_t edid_id[kEdidIdSize];
+  uint8_t edid_checksum;  // Last byte of EDID block 0.
+  uint8_t valid;
+  DisplayMode mode;
+};
+
+// DEVICE_METADATA_PRIVATE payload the board may attach to the display.
+// Older, shorter payloads leave the trailing fields zero.
+struct DisplayMetadata {
+  // Configs that may wait behind the one being latched for the next vblank:
+  // 1 is double buffering (a newer config replaces a waiting one, lowest
+  // latency), 2 is triple buffering (every config is shown, smoother).
+  uint32_t flip_queue_depth;
+  // Highest pixel clock the HDMI PHY and video PLL may be asked for; 0 uses
+  // kDefaultMaxPixelClockKhz.
+  uint32_t max_pixel_clock_khz;
+  // Non-zero prefers CVT reduced-blanking timing for the native resolution
+  // whenever the sink supports it, cutting the pixel clock by about 10%.
+  uint32_t prefer_reduced_blanking;
+  CachedMode cached_mode;
+};
+
+constexpr uint32_t HTotal(const DisplayMode& mode) {
+  return mode.width + mode.h_front_porch + mode.h_sync + mode.h_back_porch;
+}
+constexpr uint32_t VTotal(const DisplayMode& mode) {
+  return mode.height + mode.v_front_porch + mode.v_sync + mode.v_back_porch;
+}
+constexpr uint32_t RefreshE2(const DisplayMode& mode) {
+  return static_cast<uint32_t>(uint64_t{mode.pixel_clock_khz} * 100000 /
+                               (uint64_t{HTotal(mode)} * VTotal(mode)));
+}
+
+// What the sink's EDID says it can show.
+struct EdidInfo {
+  // Detailed timings in EDID order; the first is the preferred (native) one.
+  std::vector<DisplayMode> modes;
+  bool reduced_blanking = false;
+  uint32_t max_pixel_clock_khz = 0;  // 0 if the EDID gives no limit.
 };
 
+namespace {
+
+bool EdidChecksumOk(const uint8_t* block) {
+  uint8_t sum = 0;
+  for (size_t i = 0; i < kEdidBlockSize; i++) {
+    sum = static_cast<uint8_t>(sum + block[i]);
+  }
+  return sum == 0;
+}
+
+// Parses an 18-byte detailed timing descriptor. Interlaced and analog-sync
+// timings are rejected, as are display descriptors (zero pixel clock).
+bool ParseDetailedTiming(const uint8_t* d, DisplayMode* out) {
+  uint32_t pixel_clock_khz = (d[0] | (d[1] << 8)) * 10u;
+  if (pixel_clock_khz == 0 || (d[17] & 0x80)) {
+    return false;
+  }
+  DisplayMode mode = {};
+  mode.pixel_clock_khz = pixel_clock_khz;
+  mode.width = d[2] | ((d[4] & 0xF0) << 4);
+  uint32_t h_blank = d[3] | ((d[4] & 0x0F) << 8);
+  mode.height = d[5] | ((d[7] & 0xF0) << 4);
+  uint32_t v_blank = d[6] | ((d[7] & 0x0F) << 8);
+  mode.h_front_porch = d[8] | ((d[11] & 0xC0) << 2);
+  mode.h_sync = d[9] | ((d[11] & 0x30) << 4);
+  mode.v_front_porch = (d[10] >> 4) | ((d[11] & 0x0C) << 2);
+  mode.v_sync = (d[10] & 0x0F) | ((d[11] & 0x03) << 4);
+  if (mode.width == 0 || mode.height == 0 || mode.h_sync == 0 || mode.v_sync == 0 ||
+      mode.h_front_porch + mode.h_sync >= h_blank || mode.v_front_porch + mode.v_sync >= v_blank) {
+    return false;
+  }
+  mode.h_back_porch = h_blank - mode.h_front_porch - mode.h_sync;
+  mode.v_back_porch = v_blank - mode.v_front_porch - mode.v_sync;
+  // Digital separate sync carries the polarities; anything else is driven
+  // with the CEA default of active-high.
+  if ((d[17] & 0x18) == 0x18) {
+    mode.flags |= (d[17] & 0x02) ? kModeHsyncHigh : 0;
+    mode.flags |= (d[17] & 0x04) ? kModeVsyncHigh : 0;
+  } else {
+    mode.flags = kModeHsyncHigh | kModeVsyncHigh;
+  }
+  mode.refresh_hz = (RefreshE2(mode) + 50) / 100;
+  *out = mode;
+  return true;
+}
+
+// Monitor range limits descriptor: the maximum pixel clock and, for EDID
+// 1.4 CVT support information, whether reduced blanking is accepted.
+void ParseRangeLimits(const uint8_t* d, EdidInfo* info) {
+  info->max_pixel_clock_khz = d[9] * 10000u;
+  if (d[10] == 0x04) {
+    info->reduced_blanking = d[15] & 0x10;
+  }
+}
+
+void ParseDescriptors(const uint8_t* start, size_t count, EdidInfo* info) {
+  for (size_t i = 0; i < count; i++) {
+    const uint8_t* d = start + i * 18;
+    DisplayMode mode;
+    if (ParseDetailedTiming(d, &mode)) {
+      info->modes.push_back(mode);
+    } else if (d[0] == 0 && d[1] == 0 && d[3] == 0xFD) {
+      ParseRangeLimits(d, info);
+    }
+  }
+}
+
+// Collects the detailed timings of the base block and any CEA-861
+// extensions. Blocks with a bad checksum are skipped.
+bool ParseEdid(const uint8_t* edid, size_t block_count, EdidInfo* info) {
+  static constexpr uint8_t kHeader[] = {0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x00};
+  if (block_count == 0 || memcmp(edid, kHeader, sizeof(kHeader)) != 0 ||
+      !EdidChecksumOk(edid)) {
+    return false;
+  }
+  ParseDescriptors(edid + 54, 4, info);
+
+  for (size_t b = 1; b < block_count; b++) {
+    const uint8_t* block = edid + b * kEdidBlockSize;
+    if (block[0] != 0x02 || !EdidChecksumOk(block)) {
+      continue;
+    }
+    // Byte 2 is where the detailed timings start, after the data blocks.
+    size_t offset = block[2];
+    if (offset < 4 || offset >= kEdidBlockSize - 1) {
+      continue;
+    }
+    ParseDescriptors(block + offset, (kEdidBlockSize - 1 - offset) / 18, info);
+  }
+  return !info->modes.empty();
+}
+
+// CVT reduced blanking v2 timing for |width|x|height| at |refresh_hz|: a
+// fixed 80-pixel horizontal blank and the shortest vertical blank that
+// still lasts 460us.
+DisplayMode CvtReducedBlanking(uint32_t width, uint32_t height, uint32_t refresh_hz) {
+  constexpr uint32_t kMinVblankUs = 460;
+  constexpr uint32_t kVsync = 8;
+  constexpr uint32_t kMinVBackPorch = 6;
+  constexpr uint32_t kMinVFrontPorch = 1;
+
+  double h_period_us = (1000000.0 / refresh_hz - kMinVblankUs) / height;
+  uint32_t v_blank = static_cast<uint32_t>(kMinVblankUs / h_period_us) + 1;
+  v_blank = std::max(v_blank, kMinVFrontPorch + kVsync + kMinVBackPorch);
+
+  DisplayMode mode = {};
+  mode.width = width;
+  mode.height = height;
+  mode.refresh_hz = refresh_hz;
+  mode.h_front_porch = 8;
+  mode.h_sync = 32;
+  mode.h_back_porch = 40;
+  mode.v_sync = kVsync;
+  mode.v_back_porch = kMinVBackPorch;
+  mode.v_front_porch = v_blank - kVsync - kMinVBackPorch;
+  mode.pixel_clock_khz = static_cast<uint32_t>(uint64_t{HTotal(mode)} * VTotal(mode) *
+                                               refresh_hz / 1000);
+  mode.flags = kModeHsyncHigh;
+  return mode;
+}
+
+bool SameRect(const rect_u_t& a, const rect_u_t& b) {
+  return a.x_pos == b.x_pos && a.y_pos == b.y_pos && a.width == b.width && a.height == b.height;
+}
+
+bool SameAlpha(float a, float b) { return a == b || (std::isnan(a) && std::isnan(b)); }
+
+// Everything about a primary layer but where its destination frame sits.
+bool SamePrimarySource(const primary_layer_t& a, const primary_layer_t& b) {
+  return a.image_handle == b.image_handle && SameRect(a.src_frame, b.src_frame) &&
+         a.dest_frame.width == b.dest_frame.width && a.dest_frame.height == b.dest_frame.height &&
+         a.alpha_mode == b.alpha_mode && SameAlpha(a.alpha_layer_val, b.alpha_layer_val) &&
+         a.transform_mode == b.transform_mode;
+}
+
+bool SameLayer(const layer_t& a, const layer_t& b) {
+  if (a.type != b.type || a.z_index != b.z_index) {
+    return false;
+  }
+  switch (a.type) {
+    case LAYER_TYPE_PRIMARY:
+      return SamePrimarySource(a.cfg.primary, b.cfg.primary) &&
+             SameRect(a.cfg.primary.dest_frame, b.cfg.primary.dest_frame);
+    case LAYER_TYPE_COLOR:
+      return a.cfg.color.format == b.cfg.color.format && a.cfg.color.color_count == 4 &&
+             b.cfg.color.color_count == 4 &&
+             memcmp(a.cfg.color.color_list, b.cfg.color.color_list, 4) == 0;
+    default:
+      return false;
+  }
+}
+
+}  // namespace
+
 class SoliloquyDisplay;
 using DeviceType = ddk::Device<SoliloquyDisplay, ddk::Unbindable>;
 
@@ -53,8 +425,14 @@ class SoliloquyDisplay : public DeviceType,
   static zx_status_t Create(void* ctx, zx_device_t* parent);
 
   // Device protocol implementation
-  void DdkRelease() { delete this; }
-  void DdkUnbind(ddk::UnbindTxn txn) { txn.Reply(); }
+  void DdkRelease() {
+    StopVsyncThread();
+    delete this;
+  }
+  void DdkUnbind(ddk::UnbindTxn txn) {
+    StopVsyncThread();
+    txn.Reply();
+  }
 
   // DisplayControllerImpl protocol implementation
   void DisplayControllerImplSetDisplayControllerInterface(
@@ -71,7 +449,7 @@ class SoliloquyDisplay : public DeviceType,
       // Report panel type
       args.panel.params.height = mode_.height;
       args.panel.params.width = mode_.width;
-      args.panel.params.refresh_rate_e2 = mode_.refresh_hz * 100;
+      args.panel.params.refresh_rate_e2 = RefreshE2(mode_);
       
       // Supported pixel formats
       static const zx_pixel_format_t kPixelFormats[] = {
@@ -87,55 +465,36 @@ class SoliloquyDisplay : public DeviceType,
   }
 
   zx_status_t DisplayControllerImplImportBufferCollection(
-      uint64_t banjo_driver_buffer_collection_id, zx::channel collection_token) {
-    return ZX_OK;
-  }
+      uint64_t banjo_driver_buffer_collection_id, zx::channel collection_token);
 
   zx_status_t DisplayControllerImplReleaseBufferCollection(
-      uint64_t banjo_driver_buffer_collection_id) {
-    return ZX_OK;
-  }
+      uint64_t banjo_driver_buffer_collection_id);
 
   zx_status_t DisplayControllerImplImportImage(const image_metadata_t* image_metadata,
                                                  uint64_t banjo_driver_buffer_collection_id,
-                                                 uint32_t index, uint64_t* out_image_handle) {
-    *out_image_handle = next_image_handle_++;
-    return ZX_OK;
-  }
+                                                 uint32_t index, uint64_t* out_image_handle);
 
   zx_status_t DisplayControllerImplImportImageForCapture(
       uint64_t banjo_driver_buffer_collection_id, uint32_t index, uint64_t* out_capture_handle) {
     return ZX_ERR_NOT_SUPPORTED;
   }
 
-  void DisplayControllerImplReleaseImage(uint64_t image_handle) {}
+  void DisplayControllerImplReleaseImage(uint64_t image_handle);
 
   config_check_result_t DisplayControllerImplCheckConfiguration(
       const display_config_t** display_configs, size_t display_count,
       client_composition_opcode_t* out_client_composition_opcodes_list,
-      size_t client_composition_opcodes_count, size_t* out_client_composition_opcodes_actual) {
-    *out_client_composition_opcodes_actual = 0;
-    return CONFIG_CHECK_RESULT_OK;
-  }
+      size_t client_composition_opcodes_count, size_t* out_client_composition_opcodes_actual);
 
   void DisplayControllerImplApplyConfiguration(const display_config_t** display_configs,
                                                  size_t display_count,
-                                                 const config_stamp_t* banjo_config_stamp) {
-    // Apply the display configuration
-    if (display_count > 0 && display_configs[0]->layer_count > 0) {
-      // In a real driver, we'd program the hardware here
-      zxlogf(DEBUG, "Applying display config with %zu layers",
-             display_configs[0]->layer_count);
-    }
-  }
+                                                 const config_stamp_t* banjo_config_stamp);
 
   void DisplayControllerImplSetEld(uint64_t display_id, const uint8_t* raw_eld_list,
                                     size_t raw_eld_count) {}
 
   zx_status_t DisplayControllerImplSetBufferCollectionConstraints(
-      const image_buffer_usage_t* usage, uint64_t banjo_driver_buffer_collection_id) {
-    return ZX_OK;
-  }
+      const image_buffer_usage_t* usage, uint64_t banjo_driver_buffer_collection_id);
 
   zx_status_t DisplayControllerImplSetDisplayPower(uint64_t display_id, bool power_on) {
     display_powered_ = power_on;
@@ -158,20 +517,223 @@ class SoliloquyDisplay : public DeviceType,
 
  private:
   static constexpr uint64_t kDisplayId = 1;
+  // Layers accepted in one config, hardware and client composited.
+  static constexpr size_t kMaxLayers = 16;
+  static constexpr uint32_t kMaxFlipQueueDepth = 3;
+  static constexpr uint32_t kMaxImageSize = 4096;
+  // DE fetch alignment for line starts.
+  static constexpr uint32_t kStrideAlign = 32;
+  // Largest top layer that is treated as a pointer cursor.
+  static constexpr uint32_t kMaxCursorSize = 256;
+
+  // An imported image, scanned out straight from its sysmem buffer.
+  struct Image {
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride_bytes;
+    uint32_t format;  // kFORMAT_*
+    zx_paddr_t paddr;
+    uint64_t collection_id;
+  };
+
+  // A sysmem buffer, pinned the first time an image is imported from it and
+  // kept pinned while the collection lives, so re-importing the same index
+  // costs a map lookup.
+  struct Buffer {
+    zx::vmo vmo;
+    uint64_t offset;
+    zx::pmt pmt;
+    zx_paddr_t paddr = 0;
+  };
+
+  struct Collection {
+    ~Collection() {
+      for (Buffer& buffer : buffers) {
+        if (buffer.pmt.is_valid()) {
+          buffer.pmt.unpin();
+        }
+      }
+    }
+
+    fidl::WireSyncClient<fuchsia_sysmem::BufferCollection> client;
+    // Filled in by the first import, once sysmem has allocated.
+    bool allocated = false;
+    uint32_t stride_bytes = 0;
+    uint32_t format = 0;
+    std::vector<Buffer> buffers;
+    // Imported images still referring to the buffers; the collection is
+    // dropped once it has been released and this reaches zero.
+    size_t image_count = 0;
+    bool released = false;
+  };
+
+  // One blender pipe. Pipe 0 is the bottom of the stack and pipe N is fed
+  // by channel N.
+  struct Plane {
+    uint32_t attr;
+    uint32_t width;
+    uint32_t height;
+    uint32_t x;
+    uint32_t y;
+    uint32_t stride_bytes;
+    zx_paddr_t addr;  // First pixel of the source frame.
+    bool premultiplied;
+
+    bool operator==(const Plane& other) const {
+      return attr == other.attr && width == other.width && height == other.height &&
+             x == other.x && y == other.y && stride_bytes == other.stride_bytes &&
+             addr == other.addr && premultiplied == other.premultiplied;
+    }
+    bool operator!=(const Plane& other) const { return !(*this == other); }
+    // Every covered pixel comes from this plane; nothing below shows.
+    bool Opaque() const {
+      return (attr & kATTR_ALPHA_MASK) == kATTR_ALPHA_GLOBAL &&
+             (attr >> kATTR_GLOBAL_ALPHA_SHIFT) == 0xFF;
+    }
+  };
+
+  struct ScanoutPlan {
+    Plane planes[kChannelCount];
+    uint32_t plane_count;
+    uint32_t background;  // ARGB8888
+  };
+
+  // The top plane of the last applied config, when it qualifies as a
+  // cursor. A config that only moves it skips planning; see
+  // CursorMoveLocked().
+  struct Cursor {
+    size_t layer;    // Index in the config's layer_list.
+    uint32_t pipe;   // The top used pipe.
+    Plane source;    // Unclipped, at 0,0.
+  };
+
+  // A config waiting for its vblank.
+  struct Flip {
+    ScanoutPlan plan;
+    config_stamp_t stamp;
+  };
 
   zx_status_t Init();
   zx_status_t InitHardware();
 
+  // Picks |mode_| from the sink's EDID, or from |metadata|'s cached mode if
+  // the same sink is attached. Keeps kDefaultMode if DDC cannot be read.
+  void DiscoverMode(const DisplayMetadata& metadata);
+  zx_status_t ReadEdid(uint32_t offset, uint8_t* buf, size_t len);
+  DisplayMode SelectMode(const EdidInfo& edid, const DisplayMetadata& metadata);
+  // True if the TCON can be clocked at |pixel_clock_khz|, with |pll_hz| the
+  // video PLL rate to ask for. Without the CCU the clock stays where the
+  // bootloader set it for kDefaultMode, and only that mode's clock is
+  // reachable.
+  bool SolvePixelClock(uint32_t pixel_clock_khz, uint64_t* pll_hz);
+  // Moves the video PLL and TCON clock to |mode_|'s pixel clock.
+  zx_status_t SetPixelClock();
+  // Programs the TCON1 timing generator and HDMI frame composer for |mode_|.
+  void ProgramTiming();
+
+  zx_status_t WaitForAllocationLocked(Collection& collection) __TA_REQUIRES(lock_);
+  zx_status_t PinBufferLocked(Buffer& buffer) __TA_REQUIRES(lock_);
+  void MaybeDropCollectionLocked(uint64_t collection_id) __TA_REQUIRES(lock_);
+
+  zx_status_t StartVsyncThread(ddk::PDevProtocolClient& pdev);
+  void StopVsyncThread();
+  int VsyncThread();
+  void HandleVsync(zx::time timestamp);
+  // Programs |flip| and marks it as waiting for the next vblank latch.
+  void StartFlipLocked(const Flip& flip) __TA_REQUIRES(lock_);
+
+  // Maps |config| onto the mixer. Returns false if any layer needs client
+  // composition, setting the reason in its entry of |opcodes| when given.
+  // The top layer is placed as a cursor, clipped at the screen edges,
+  // when it qualifies; |cursor| receives it if given.
+  bool PlanLayersLocked(const display_config_t* config, ScanoutPlan* plan,
+                        client_composition_opcode_t* opcodes, std::optional<Cursor>* cursor)
+      __TA_REQUIRES(lock_);
+  Plane PlaceCursor(const Plane& source, uint32_t x, uint32_t y) const;
+  // Drops or crops the parts of planes hidden under opaque planes above
+  // them, so the DE does not fetch pixels that never reach the screen.
+  static void CullOccludedPlanes(ScanoutPlan* plan);
+  // Writes the channels of |plan| that differ from what is already in the
+  // shadow registers and latches them at the next vblank. A plan identical
+  // to the programmed one touches no registers.
+  void ProgramPlanLocked(const ScanoutPlan& plan) __TA_REQUIRES(lock_);
+
+  // Remembers |config| as the last applied one, for CursorMoveLocked().
+  void SaveAppliedLocked(const display_config_t* config, const std::optional<Cursor>& cursor)
+      __TA_REQUIRES(lock_);
+  // True if |config| is the last applied config with nothing changed but
+  // the cursor position, and the cursor is still on screen. |out| is the
+  // cursor plane at its new position.
+  bool CursorMoveLocked(const display_config_t* config, Plane* out) __TA_REQUIRES(lock_);
+  // Applies a cursor move to the newest pending config, which then stands
+  // for the config stamped |stamp|. Writes only the cursor's position, and
+  // its size when clipping changes, when that config is the one in the
+  // shadow registers.
+  void MoveCursorLocked(const Plane& plane, const config_stamp_t& stamp) __TA_REQUIRES(lock_);
+
   ddk::DisplayControllerInterfaceProtocolClient intf_;
   std::optional<fdf::MmioBuffer> de_mmio_;
   std::optional<fdf::MmioBuffer> tcon_mmio_;
+  std::optional<fdf::MmioBuffer> hdmi_mmio_;
+  std::optional<fdf::MmioBuffer> ccu_mmio_;
+  std::optional<soliloquy_hal::ClockResetHelper> clocks_;
+  zx::bti bti_;
+  fidl::WireSyncClient<fuchsia_sysmem::Allocator> sysmem_;
   
   DisplayMode mode_ = kDefaultMode;
   bool has_display_ = false;
   bool display_powered_ = true;
-  uint64_t next_image_handle_ = 1;
+
+  fbl::Mutex lock_;
+  std::map<uint64_t, Image> images_ __TA_GUARDED(lock_);
+  std::map<uint64_t, Collection> collections_ __TA_GUARDED(lock_);
+  uint64_t next_image_handle_ __TA_GUARDED(lock_) = 1;
+  // What the mixer shadow registers hold.
+  ScanoutPlan programmed_ __TA_GUARDED(lock_) = {};
+  bool programmed_valid_ __TA_GUARDED(lock_) = false;
+
+  // The last applied config, copied; color layers point at |applied_colors_|.
+  layer_t applied_layers_[kMaxLayers] __TA_GUARDED(lock_);
+  uint8_t applied_colors_[kMaxLayers][4] __TA_GUARDED(lock_);
+  size_t applied_layer_count_ __TA_GUARDED(lock_) = 0;
+  uint32_t applied_cc_flags_ __TA_GUARDED(lock_) = 0;
+  std::optional<Cursor> cursor_ __TA_GUARDED(lock_);
+
+  // Flip pipeline: |latching| is in the shadow registers waiting for
+  // GLB_DBUFFER to latch it, |queue| waits behind it, |shown_stamp| is on
+  // screen.
+  Flip latching_ __TA_GUARDED(lock_) = {};
+  bool latch_pending_ __TA_GUARDED(lock_) = false;
+  Flip queue_[kMaxFlipQueueDepth] __TA_GUARDED(lock_);
+  uint32_t queue_head_ __TA_GUARDED(lock_) = 0;
+  uint32_t queue_count_ __TA_GUARDED(lock_) = 0;
+  uint32_t flip_queue_depth_ = kDefaultFlipQueueDepth;
+  config_stamp_t shown_stamp_ __TA_GUARDED(lock_) = {.value = INVALID_CONFIG_STAMP_VALUE};
+
+  zx::interrupt vsync_irq_;
+  zx::port vsync_port_;
+  thrd_t vsync_thread_;
+  bool vsync_thread_started_ = false;
+
+  inspect::Inspector inspector_;
+
+  static constexpr uint32_t kDefaultFlipQueueDepth = 1;
+  static constexpr uint64_t kPortKeyVsync = 0;
+  static constexpr uint64_t kPortKeyStop = 1;
 };
 
+namespace {
+soliloquy_hal::Histogram init_us("soliloquy-display.init_us");
+soliloquy_hal::Counter flips_shown("soliloquy-display.flips_shown");
+soliloquy_hal::Counter flips_dropped("soliloquy-display.flips_dropped");
+soliloquy_hal::Counter edid_cache_hits("soliloquy-display.edid_cache_hits");
+soliloquy_hal::Counter planes_culled("soliloquy-display.planes_culled");
+soliloquy_hal::Counter flips_unchanged("soliloquy-display.flips_unchanged");
+soliloquy_hal::Counter cursor_moves("soliloquy-display.cursor_moves");
+// Bytes the DE fetches per frame for each applied plan.
+soliloquy_hal::Histogram scanout_bytes("soliloquy-display.scanout_bytes");
+}  // namespace
+
 zx_status_t SoliloquyDisplay::Create(void* ctx, zx_device_t* parent) {
   fbl::AllocChecker ac;
   auto dev = fbl::make_unique_checked<SoliloquyDisplay>(&ac, parent);
@@ -189,16 +751,20 @@ zx_status_t SoliloquyDisplay::Create(void* ctx, zx_device_t* parent) {
   return ZX_OK;
 }
 
+
 zx_status_t SoliloquyDisplay::Init() {
+  SOLILOQUY_TIMED_SCOPE(init_us, "display_init");
   auto status = InitHardware();
   if (status != ZX_OK) {
     zxlogf(ERROR, "Failed to init display hardware: %s", zx_status_get_string(status));
     // Continue anyway - we can operate in software rendering mode
   }
 
+  soliloquy_hal::PublishMetrics(inspector_);
   status = DdkAdd(ddk::DeviceAddArgs("soliloquy-display")
                       .set_flags(DEVICE_ADD_ALLOW_MULTI_COMPOSITE)
-                      .set_proto_id(ZX_PROTOCOL_DISPLAY_CONTROLLER_IMPL));
+                      .set_proto_id(ZX_PROTOCOL_DISPLAY_CONTROLLER_IMPL)
+                      .set_inspect_vmo(inspector_.DuplicateVmo()));
   if (status != ZX_OK) {
     zxlogf(ERROR, "Failed to add device: %s", zx_status_get_string(status));
     return status;
@@ -216,9 +782,24 @@ zx_status_t SoliloquyDisplay::InitHardware() {
     return ZX_OK;
   }
 
+  zx_status_t status = pdev.GetBti(0, &bti_);
+  if (status != ZX_OK) {
+    zxlogf(WARNING, "Failed to get BTI: %s", zx_status_get_string(status));
+  }
+
+  ddk::SysmemProtocolClient sysmem(parent());
+  auto endpoints = fidl::CreateEndpoints<fuchsia_sysmem::Allocator>();
+  if (sysmem.is_valid() && endpoints.is_ok() &&
+      sysmem.Connect(endpoints->server.TakeChannel()) == ZX_OK) {
+    sysmem_ = fidl::WireSyncClient(std::move(endpoints->client));
+    sysmem_->SetDebugClientInfo("soliloquy-display", 0);
+  } else {
+    zxlogf(WARNING, "No sysmem - buffer import disabled");
+  }
+
   // Map DE3.0 registers
   std::optional<fdf::MmioBuffer> de_mmio;
-  auto status = pdev.MapMmio(0, &de_mmio);
+  status = pdev.MapMmio(0, &de_mmio);
   if (status != ZX_OK) {
     zxlogf(WARNING, "Failed to map DE MMIO: %s", zx_status_get_string(status));
   } else {
@@ -234,15 +815,1111 @@ zx_status_t SoliloquyDisplay::InitHardware() {
     tcon_mmio_ = std::move(tcon_mmio);
   }
 
-  // TODO: Full hardware initialization
-  // - Configure display engine clocks
-  // - Set up framebuffer
-  // - Configure TCON timing generator
-  // - Enable display output
+  // Map HDMI controller registers
+  std::optional<fdf::MmioBuffer> hdmi_mmio;
+  status = pdev.MapMmio(2, &hdmi_mmio);
+  if (status != ZX_OK) {
+    zxlogf(WARNING, "Failed to map HDMI MMIO: %s", zx_status_get_string(status));
+  } else {
+    hdmi_mmio_ = std::move(hdmi_mmio);
+  }
+
+  // Map the CCU, for the video PLL and TCON clock
+  std::optional<fdf::MmioBuffer> ccu_mmio;
+  status = pdev.MapMmio(3, &ccu_mmio);
+  if (status != ZX_OK) {
+    zxlogf(WARNING, "Failed to map CCU MMIO, keeping the boot pixel clock: %s",
+           zx_status_get_string(status));
+  } else {
+    ccu_mmio_ = std::move(ccu_mmio);
+    clocks_.emplace(&*ccu_mmio_);
+  }
+
+  DisplayMetadata metadata = {};
+  size_t actual;
+  status = device_get_metadata(parent(), DEVICE_METADATA_PRIVATE, &metadata,
+                               sizeof(metadata), &actual);
+  if (status != ZX_OK || actual < sizeof(metadata.flip_queue_depth)) {
+    metadata = {};
+  }
+  if (metadata.flip_queue_depth >= 1 && metadata.flip_queue_depth <= kMaxFlipQueueDepth) {
+    flip_queue_depth_ = metadata.flip_queue_depth;
+  }
+
+  DiscoverMode(metadata);
+  status = SetPixelClock();
+  if (status != ZX_OK && mode_.pixel_clock_khz != kDefaultMode.pixel_clock_khz) {
+    zxlogf(WARNING, "Cannot clock %ux%u@%uHz, falling back to %ux%u: %s", mode_.width,
+           mode_.height, mode_.refresh_hz, kDefaultMode.width, kDefaultMode.height,
+           zx_status_get_string(status));
+    mode_ = kDefaultMode;
+    status = SetPixelClock();
+  }
+  if (status != ZX_OK) {
+    zxlogf(WARNING, "Failed to set the pixel clock: %s", zx_status_get_string(status));
+  }
+  ProgramTiming();
+
+  // Scan out the background color until the first config is applied.
+  if (de_mmio_) {
+    fbl::AutoLock lock(&lock_);
+    uint32_t size = PackSize(mode_.width, mode_.height);
+    de_mmio_->Write32(kGLB_CTL_RT_EN, kGLB_CTL);
+    de_mmio_->Write32(size, kGLB_SIZE);
+    de_mmio_->Write32(size, kBLD_SIZE);
+    ScanoutPlan blank = {};
+    blank.background = 0xFF000000;
+    ProgramPlanLocked(blank);
+  }
+
+  // Without vsync, configs are applied as they arrive and never paced.
+  status = StartVsyncThread(pdev);
+  if (status != ZX_OK) {
+    zxlogf(WARNING, "No vsync, page flips are unpaced: %s", zx_status_get_string(status));
+  }
+
+  return ZX_OK;
+}
+
+void SoliloquyDisplay::DiscoverMode(const DisplayMetadata& metadata) {
+  if (!hdmi_mmio_) {
+    return;
+  }
+
+  hdmi_mmio_->Write8(0, kHDMI_I2CM_SOFTRSTZ);
+  hdmi_mmio_->Write8(0, kHDMI_I2CM_DIV);  // Standard mode, 100kHz
+  hdmi_mmio_->Write8(kHDMI_I2CM_INT_DONE_POL, kHDMI_I2CM_INT);
+  hdmi_mmio_->Write8(kHDMI_I2CM_CTLINT_ARB_POL | kHDMI_I2CM_CTLINT_NAC_POL, kHDMI_I2CM_CTLINT);
+  // Polled; keep the status bits off the interrupt line.
+  hdmi_mmio_->Write8(kHDMI_I2CM_STAT0_ERROR | kHDMI_I2CM_STAT0_DONE, kHDMI_IH_MUTE_I2CM_STAT0);
+
+  uint8_t id[16];
+  uint8_t tail[kI2CM_BURST];
+  zx_status_t status = ReadEdid(kEdidIdOffset, id, sizeof(id));
+  if (status == ZX_OK) {
+    status = ReadEdid(kEdidBlockSize - kI2CM_BURST, tail, sizeof(tail));
+  }
+  if (status != ZX_OK) {
+    zxlogf(WARNING, "No EDID, keeping %ux%u: %s", mode_.width, mode_.height,
+           zx_status_get_string(status));
+    return;
+  }
+
+  const CachedMode& cached = metadata.cached_mode;
+  uint64_t pll_hz;
+  if (cached.valid && memcmp(cached.edid_id, id, kEdidIdSize) == 0 &&
+      cached.edid_checksum == tail[kI2CM_BURST - 1] && cached.mode.width != 0 &&
+      cached.mode.height != 0 && HTotal(cached.mode) != 0 &&
+      SolvePixelClock(cached.mode.pixel_clock_khz, &pll_hz)) {
+    mode_ = cached.mode;
+    edid_cache_hits.Add();
+    zxlogf(INFO, "Using cached mode %ux%u@%uHz", mode_.width, mode_.height, mode_.refresh_hz);
+    return;
+  }
+
+  uint8_t edid[kMaxEdidBlocks * kEdidBlockSize];
+  status = ReadEdid(0, edid, kEdidBlockSize);
+  size_t block_count = 1;
+  if (status == ZX_OK) {
+    block_count += std::min<size_t>(edid[126], kMaxEdidBlocks - 1);
+    status = ReadEdid(kEdidBlockSize, edid + kEdidBlockSize, (block_count - 1) * kEdidBlockSize);
+  }
+  EdidInfo info;
+  if (status != ZX_OK || !ParseEdid(edid, block_count, &info)) {
+    zxlogf(WARNING, "Unusable EDID, keeping %ux%u", mode_.width, mode_.height);
+    return;
+  }
+
+  mode_ = SelectMode(info, metadata);
+  zxlogf(INFO, "EDID native %ux%u@%uHz, using %ux%u@%uHz (%u kHz)", info.modes[0].width,
+         info.modes[0].height, info.modes[0].refresh_hz, mode_.width, mode_.height,
+         mode_.refresh_hz, mode_.pixel_clock_khz);
+}
+
+zx_status_t SoliloquyDisplay::ReadEdid(uint32_t offset, uint8_t* buf, size_t len) {
+  constexpr zx::duration kBurstTimeout = zx::msec(10);
+
+  // Bursts are eight bytes and never cross a 256-byte segment.
+  hdmi_mmio_->Write8(kDdcEdidAddr, kHDMI_I2CM_SLAVE);
+  hdmi_mmio_->Write8(kDdcSegmentAddr, kHDMI_I2CM_SEGADDR);
+  for (size_t done = 0; done < len; done += kI2CM_BURST) {
+    uint32_t addr = offset + static_cast<uint32_t>(done);
+    uint8_t segment = static_cast<uint8_t>(addr >> 8);
+    hdmi_mmio_->Write8(kHDMI_I2CM_STAT0_ERROR | kHDMI_I2CM_STAT0_DONE, kHDMI_IH_I2CM_STAT0);
+    hdmi_mmio_->Write8(segment, kHDMI_I2CM_SEGPTR);
+    hdmi_mmio_->Write8(static_cast<uint8_t>(addr), kHDMI_I2CM_ADDRESS);
+    hdmi_mmio_->Write8(segment ? kHDMI_I2CM_OPERATION_RD8_EXT : kHDMI_I2CM_OPERATION_RD8,
+                       kHDMI_I2CM_OPERATION);
+
+    zx::time deadline = zx::deadline_after(kBurstTimeout);
+    uint8_t stat;
+    while (!((stat = hdmi_mmio_->Read8(kHDMI_IH_I2CM_STAT0)) &
+             (kHDMI_I2CM_STAT0_ERROR | kHDMI_I2CM_STAT0_DONE))) {
+      if (zx::clock::get_monotonic() > deadline) {
+        return ZX_ERR_TIMED_OUT;
+      }
+      zx::nanosleep(zx::deadline_after(zx::usec(100)));
+    }
+    if (stat & kHDMI_I2CM_STAT0_ERROR) {
+      // No sink answering: nothing plugged or a DVI adapter without DDC.
+      return ZX_ERR_IO_NOT_PRESENT;
+    }
+
+    size_t count = std::min<size_t>(kI2CM_BURST, len - done);
+    for (size_t i = 0; i < count; i++) {
+      buf[done + i] = hdmi_mmio_->Read8(kHDMI_I2CM_READ_BUFF0 + static_cast<uint32_t>(i));
+    }
+  }
+  return ZX_OK;
+}
+
+DisplayMode SoliloquyDisplay::SelectMode(const EdidInfo& edid, const DisplayMetadata& metadata) {
+  uint32_t limit = metadata.max_pixel_clock_khz ? metadata.max_pixel_clock_khz
+                                                : kDefaultMaxPixelClockKhz;
+  if (edid.max_pixel_clock_khz) {
+    limit = std::min(limit, edid.max_pixel_clock_khz);
+  }
+  auto fits = [this, limit](const DisplayMode& mode) {
+    uint64_t pll_hz;
+    return mode.pixel_clock_khz <= limit && SolvePixelClock(mode.pixel_clock_khz, &pll_hz);
+  };
+
+  // Reduced blanking only pays off at high resolutions; below 1080p the
+  // standard timings are already cheap and some TVs reject anything else.
+  const DisplayMode& native = edid.modes[0];
+  bool rb_candidate = edid.reduced_blanking && native.width >= 1920;
+  if (rb_candidate && metadata.prefer_reduced_blanking) {
+    DisplayMode rb = CvtReducedBlanking(native.width, native.height, native.refresh_hz);
+    if (fits(rb)) {
+      return rb;
+    }
+  }
+  if (fits(native)) {
+    return native;
+  }
+  // The native timing is too fast for the PHY; reduced blanking may still
+  // get the panel its own resolution.
+  if (rb_candidate) {
+    DisplayMode rb = CvtReducedBlanking(native.width, native.height, native.refresh_hz);
+    if (fits(rb)) {
+      return rb;
+    }
+  }
+
+  // Otherwise the largest mode that fits, the faster one on a tie.
+  const DisplayMode* best = nullptr;
+  for (const DisplayMode& mode : edid.modes) {
+    if (!fits(mode)) {
+      continue;
+    }
+    uint64_t area = uint64_t{mode.width} * mode.height;
+    if (!best || area > uint64_t{best->width} * best->height ||
+        (area == uint64_t{best->width} * best->height && mode.refresh_hz > best->refresh_hz)) {
+      best = &mode;
+    }
+  }
+  return best ? *best : kDefaultMode;
+}
+
+bool SoliloquyDisplay::SolvePixelClock(uint32_t pixel_clock_khz, uint64_t* pll_hz) {
+  if (!clocks_) {
+    *pll_hz = 0;
+    return pixel_clock_khz == kDefaultMode.pixel_clock_khz;
+  }
+
+  // The smallest divider, so the lowest PLL rate, that gets closest.
+  uint64_t target = uint64_t{pixel_clock_khz} * 1000;
+  uint64_t best_error = target / kPixelClockToleranceDiv + 1;
+  bool found = false;
+  for (uint32_t n = 0; n <= kTconMaxN; n++) {
+    for (uint32_t m = 1; m <= kTconMaxM; m++) {
+      uint64_t div = uint64_t{m} << n;
+      uint64_t want = target * div;
+      if (want > kVideoPllMaxHz) {
+        break;
+      }
+      uint64_t rate;
+      if (clocks_->RoundClockRate(CLK_PLL_VIDEO0_4X, want, &rate) != ZX_OK) {
+        continue;
+      }
+      // Rounding is from below, so the error is never negative.
+      uint64_t error = target - rate / div;
+      if (error < best_error) {
+        best_error = error;
+        *pll_hz = want;
+        found = true;
+      }
+    }
+  }
+  return found;
+}
+
+zx_status_t SoliloquyDisplay::SetPixelClock() {
+  uint64_t pll_hz;
+  if (!SolvePixelClock(mode_.pixel_clock_khz, &pll_hz)) {
+    return ZX_ERR_NOT_SUPPORTED;
+  }
+  if (!clocks_) {
+    return ZX_OK;
+  }
 
+  // The TCON keeps its divider setting across a PLL change, so its rate is
+  // only right once both are set.
+  zx_status_t status = clocks_->SetClockRate(CLK_PLL_VIDEO0_4X, pll_hz);
+  if (status != ZX_OK) {
+    return status;
+  }
+  uint64_t target = uint64_t{mode_.pixel_clock_khz} * 1000;
+  status = clocks_->SetClockRate(CLK_TCON_LCD0, target);
+  if (status != ZX_OK) {
+    return status;
+  }
+  uint64_t rate;
+  status = clocks_->GetClockRate(CLK_TCON_LCD0, &rate);
+  if (status != ZX_OK) {
+    return status;
+  }
+  if (target - rate > target / kPixelClockToleranceDiv) {
+    return ZX_ERR_OUT_OF_RANGE;
+  }
+  zxlogf(INFO, "Pixel clock %lu Hz from a %lu Hz video PLL", rate, pll_hz);
   return ZX_OK;
 }
 
+void SoliloquyDisplay::ProgramTiming() {
+  const DisplayMode& m = mode_;
+  uint32_t h_total = HTotal(m);
+  uint32_t v_total = VTotal(m);
+
+  if (tcon_mmio_) {
+    // Back porch here runs from the start of sync to the active area.
+    uint32_t h_bp = m.h_sync + m.h_back_porch;
+    uint32_t v_bp = m.v_sync + m.v_back_porch;
+    uint32_t start_delay = std::min<uint32_t>(v_total - m.height - 2, 30);
+
+    tcon_mmio_->ClearBits32(kTCON1_CTL_EN, kTCON1_CTL);
+    tcon_mmio_->Write32(PackSize(m.width, m.height), kTCON1_BASIC0);
+    tcon_mmio_->Write32(PackSize(m.width, m.height), kTCON1_BASIC1);
+    tcon_mmio_->Write32(PackSize(m.width, m.height), kTCON1_BASIC2);
+    tcon_mmio_->Write32(((h_total - 1) << 16) | (h_bp - 1), kTCON1_BASIC3);
+    tcon_mmio_->Write32(((v_total * 2) << 16) | (v_bp - 1), kTCON1_BASIC4);
+    tcon_mmio_->Write32(((m.h_sync - 1) << 16) | (m.v_sync - 1), kTCON1_BASIC5);
+    tcon_mmio_->ModifyBits32(start_delay << kTCON1_CTL_START_DELAY_SHIFT,
+                             kTCON1_CTL_START_DELAY_MASK, kTCON1_CTL);
+    tcon_mmio_->SetBits32(kTCON1_CTL_EN, kTCON1_CTL);
+  }
+
+  if (hdmi_mmio_) {
+    uint32_t h_blank = h_total - m.width;
+    uint32_t v_blank = v_total - m.height;
+    uint8_t conf = kHDMI_FC_INVIDCONF_DE_HIGH | kHDMI_FC_INVIDCONF_HDMI_MODE;
+    conf |= (m.flags & kModeHsyncHigh) ? kHDMI_FC_INVIDCONF_HSYNC_HIGH : 0;
+    conf |= (m.flags & kModeVsyncHigh) ? kHDMI_FC_INVIDCONF_VSYNC_HIGH : 0;
+    hdmi_mmio_->Write8(conf, kHDMI_FC_INVIDCONF);
+    hdmi_mmio_->Write8(static_cast<uint8_t>(m.width), kHDMI_FC_INHACTV0);
+    hdmi_mmio_->Write8(static_cast<uint8_t>(m.width >> 8), kHDMI_FC_INHACTV0 + 1);
+    hdmi_mmio_->Write8(static_cast<uint8_t>(h_blank), kHDMI_FC_INHBLANK0);
+    hdmi_mmio_->Write8(static_cast<uint8_t>(h_blank >> 8), kHDMI_FC_INHBLANK0 + 1);
+    hdmi_mmio_->Write8(static_cast<uint8_t>(m.height), kHDMI_FC_INVACTV0);
+    hdmi_mmio_->Write8(static_cast<uint8_t>(m.height >> 8), kHDMI_FC_INVACTV0 + 1);
+    hdmi_mmio_->Write8(static_cast<uint8_t>(v_blank), kHDMI_FC_INVBLANK);
+    hdmi_mmio_->Write8(static_cast<uint8_t>(m.h_front_porch), kHDMI_FC_HSYNCINDELAY0);
+    hdmi_mmio_->Write8(static_cast<uint8_t>(m.h_front_porch >> 8), kHDMI_FC_HSYNCINDELAY0 + 1);
+    hdmi_mmio_->Write8(static_cast<uint8_t>(m.h_sync), kHDMI_FC_HSYNCINWIDTH0);
+    hdmi_mmio_->Write8(static_cast<uint8_t>(m.h_sync >> 8), kHDMI_FC_HSYNCINWIDTH0 + 1);
+    hdmi_mmio_->Write8(static_cast<uint8_t>(m.v_front_porch), kHDMI_FC_VSYNCINDELAY);
+    hdmi_mmio_->Write8(static_cast<uint8_t>(m.v_sync), kHDMI_FC_VSYNCINWIDTH);
+  }
+}
+
+zx_status_t SoliloquyDisplay::DisplayControllerImplImportBufferCollection(
+    uint64_t banjo_driver_buffer_collection_id, zx::channel collection_token) {
+  if (!sysmem_.is_valid()) {
+    return ZX_ERR_NOT_SUPPORTED;
+  }
+
+  fbl::AutoLock lock(&lock_);
+  if (collections_.count(banjo_driver_buffer_collection_id)) {
+    return ZX_ERR_ALREADY_EXISTS;
+  }
+
+  auto endpoints = fidl::CreateEndpoints<fuchsia_sysmem::BufferCollection>();
+  if (endpoints.is_error()) {
+    return endpoints.status_value();
+  }
+  auto result = sysmem_->BindSharedCollection(
+      fidl::ClientEnd<fuchsia_sysmem::BufferCollectionToken>(std::move(collection_token)),
+      std::move(endpoints->server));
+  if (!result.ok()) {
+    zxlogf(ERROR, "Failed to bind buffer collection: %s", result.FormatDescription().c_str());
+    return result.status();
+  }
+
+  Collection& collection = collections_[banjo_driver_buffer_collection_id];
+  collection.client = fidl::WireSyncClient(std::move(endpoints->client));
+  return ZX_OK;
+}
+
+zx_status_t SoliloquyDisplay::DisplayControllerImplReleaseBufferCollection(
+    uint64_t banjo_driver_buffer_collection_id) {
+  fbl::AutoLock lock(&lock_);
+  auto it = collections_.find(banjo_driver_buffer_collection_id);
+  if (it == collections_.end()) {
+    return ZX_ERR_NOT_FOUND;
+  }
+  it->second.released = true;
+  MaybeDropCollectionLocked(banjo_driver_buffer_collection_id);
+  return ZX_OK;
+}
+
+zx_status_t SoliloquyDisplay::DisplayControllerImplSetBufferCollectionConstraints(
+    const image_buffer_usage_t* usage, uint64_t banjo_driver_buffer_collection_id) {
+  if (usage->tiling_type != IMAGE_TILING_TYPE_LINEAR) {
+    return ZX_ERR_NOT_SUPPORTED;
+  }
+
+  fbl::AutoLock lock(&lock_);
+  auto it = collections_.find(banjo_driver_buffer_collection_id);
+  if (it == collections_.end()) {
+    return ZX_ERR_NOT_FOUND;
+  }
+
+  // Scanout needs one physically contiguous linear buffer per image. ARGB
+  // and xRGB both map to BGRA32; the layer's alpha mode decides whether
+  // the alpha byte is used.
+  fuchsia_sysmem::wire::BufferCollectionConstraints constraints = {};
+  constraints.usage.display = fuchsia_sysmem::wire::kDisplayUsageLayer;
+  constraints.has_buffer_memory_constraints = true;
+  auto& memory = constraints.buffer_memory_constraints;
+  memory.physically_contiguous_required = true;
+  memory.secure_required = false;
+  memory.ram_domain_supported = true;
+  memory.cpu_domain_supported = false;
+  memory.inaccessible_domain_supported = true;
+  constraints.image_format_constraints_count = 1;
+  auto& image = constraints.image_format_constraints[0];
+  image.pixel_format.type = fuchsia_sysmem::wire::PixelFormatType::kBgra32;
+  image.pixel_format.has_format_modifier = true;
+  image.pixel_format.format_modifier.value = fuchsia_sysmem::wire::kFormatModifierLinear;
+  image.color_spaces_count = 1;
+  image.color_space[0].type = fuchsia_sysmem::wire::ColorSpaceType::kSrgb;
+  image.max_coded_width = kMaxImageSize;
+  image.max_coded_height = kMaxImageSize;
+  image.max_bytes_per_row = kMaxImageSize * 4;
+  image.bytes_per_row_divisor = kStrideAlign;
+  image.start_offset_divisor = kStrideAlign;
+
+  auto result = it->second.client->SetConstraints(true, constraints);
+  if (!result.ok()) {
+    zxlogf(ERROR, "Failed to set buffer collection constraints: %s",
+           result.FormatDescription().c_str());
+    return result.status();
+  }
+  return ZX_OK;
+}
+
+zx_status_t SoliloquyDisplay::WaitForAllocationLocked(Collection& collection) {
+  if (collection.allocated) {
+    return ZX_OK;
+  }
+
+  auto result = collection.client->WaitForBuffersAllocated();
+  if (!result.ok()) {
+    return result.status();
+  }
+  if (result.value().status != ZX_OK) {
+    return result.value().status;
+  }
+
+  auto& info = result.value().buffer_collection_info;
+  if (!info.settings.has_image_format_constraints ||
+      !info.settings.buffer_settings.is_physically_contiguous ||
+      info.settings.image_format_constraints.pixel_format.type !=
+          fuchsia_sysmem::wire::PixelFormatType::kBgra32) {
+    return ZX_ERR_NOT_SUPPORTED;
+  }
+
+  const auto& image = info.settings.image_format_constraints;
+  uint32_t stride = std::max(image.min_bytes_per_row, image.min_coded_width * 4);
+  uint32_t divisor = std::max(image.bytes_per_row_divisor, 1u);
+  collection.stride_bytes = (stride + divisor - 1) / divisor * divisor;
+  collection.format = kFORMAT_ARGB8888;
+  collection.buffers.resize(info.buffer_count);
+  for (uint32_t i = 0; i < info.buffer_count; i++) {
+    collection.buffers[i].vmo = std::move(info.buffers[i].vmo);
+    collection.buffers[i].offset = info.buffers[i].vmo_usable_start;
+  }
+  collection.allocated = true;
+  return ZX_OK;
+}
+
+zx_status_t SoliloquyDisplay::PinBufferLocked(Buffer& buffer) {
+  if (buffer.paddr != 0) {
+    return ZX_OK;
+  }
+
+  uint64_t size;
+  zx_status_t status = buffer.vmo.get_size(&size);
+  if (status != ZX_OK) {
+    return status;
+  }
+  // Contiguous, so one address covers the whole buffer.
+  zx_paddr_t paddr;
+  status = bti_.pin(ZX_BTI_PERM_READ | ZX_BTI_CONTIGUOUS, buffer.vmo, 0, size, &paddr, 1,
+                    &buffer.pmt);
+  if (status != ZX_OK) {
+    zxlogf(ERROR, "Failed to pin scanout buffer: %s", zx_status_get_string(status));
+    return status;
+  }
+  buffer.paddr = paddr + buffer.offset;
+  return ZX_OK;
+}
+
+void SoliloquyDisplay::MaybeDropCollectionLocked(uint64_t collection_id) {
+  auto it = collections_.find(collection_id);
+  if (it != collections_.end() && it->second.released && it->second.image_count == 0) {
+    collections_.erase(it);
+  }
+}
+
+zx_status_t SoliloquyDisplay::DisplayControllerImplImportImage(
+    const image_metadata_t* image_metadata, uint64_t banjo_driver_buffer_collection_id,
+    uint32_t index, uint64_t* out_image_handle) {
+  if (image_metadata->tiling_type != IMAGE_TILING_TYPE_LINEAR ||
+      image_metadata->width == 0 || image_metadata->height == 0) {
+    return ZX_ERR_INVALID_ARGS;
+  }
+
+  fbl::AutoLock lock(&lock_);
+  auto it = collections_.find(banjo_driver_buffer_collection_id);
+  if (it == collections_.end() || it->second.released) {
+    return ZX_ERR_NOT_FOUND;
+  }
+  Collection& collection = it->second;
+
+  zx_status_t status = WaitForAllocationLocked(collection);
+  if (status != ZX_OK) {
+    zxlogf(ERROR, "Buffer collection not allocated: %s", zx_status_get_string(status));
+    return status;
+  }
+  if (index >= collection.buffers.size() ||
+      image_metadata->width * 4 > collection.stride_bytes) {
+    return ZX_ERR_OUT_OF_RANGE;
+  }
+
+  Buffer& buffer = collection.buffers[index];
+  status = PinBufferLocked(buffer);
+  if (status != ZX_OK) {
+    return status;
+  }
+
+  Image image = {};
+  image.width = image_metadata->width;
+  image.height = image_metadata->height;
+  image.stride_bytes = collection.stride_bytes;
+  image.format = collection.format;
+  image.paddr = buffer.paddr;
+  image.collection_id = banjo_driver_buffer_collection_id;
+
+  *out_image_handle = next_image_handle_++;
+  images_[*out_image_handle] = image;
+  collection.image_count++;
+  return ZX_OK;
+}
+
+void SoliloquyDisplay::DisplayControllerImplReleaseImage(uint64_t image_handle) {
+  fbl::AutoLock lock(&lock_);
+  auto it = images_.find(image_handle);
+  if (it == images_.end()) {
+    return;
+  }
+  uint64_t collection_id = it->second.collection_id;
+  images_.erase(it);
+
+  auto collection = collections_.find(collection_id);
+  if (collection != collections_.end()) {
+    collection->second.image_count--;
+    MaybeDropCollectionLocked(collection_id);
+  }
+}
+
+bool SoliloquyDisplay::PlanLayersLocked(const display_config_t* config, ScanoutPlan* plan,
+                                        client_composition_opcode_t* opcodes,
+                                        std::optional<Cursor>* cursor) {
+  *plan = {};
+  if (cursor) {
+    cursor->reset();
+  }
+  plan->background = 0xFF000000;
+  const size_t count = config->layer_count;
+  bool ok = true;
+  auto reject = [&](size_t i, client_composition_opcode_t op) {
+    if (opcodes) {
+      opcodes[i] |= op;
+    }
+    ok = false;
+  };
+
+  // Work bottom-up through the stack.
+  size_t order[kMaxLayers];
+  for (size_t i = 0; i < count; i++) {
+    order[i] = i;
+  }
+  std::sort(order, order + count, [config](size_t a, size_t b) {
+    return config->layer_list[a]->z_index < config->layer_list[b]->z_index;
+  });
+
+  if (config->cc_flags != 0) {
+    // The mixer's color space converter is not used.
+    for (size_t i = 0; i < count; i++) {
+      reject(i, CLIENT_COMPOSITION_OPCODE_COLOR_CONVERSION);
+    }
+  }
+
+  // More image layers than pipes: the client merges the bottom ones into
+  // one, keeping the top of the stack (cursor, video) in hardware.
+  size_t base = 0;
+  size_t first = 0;
+  size_t images = 0;
+  for (size_t n = 0; n < count; n++) {
+    const layer_t* layer = config->layer_list[order[n]];
+    bool background = n == 0 && layer->type == LAYER_TYPE_COLOR;
+    if (!background) {
+      images++;
+    }
+  }
+  if (images > kChannelCount) {
+    size_t merged = images - kChannelCount + 1;
+    base = config->layer_list[order[0]]->type == LAYER_TYPE_COLOR ? 1 : 0;
+    reject(order[base], CLIENT_COMPOSITION_OPCODE_MERGE_BASE);
+    for (size_t n = base + 1; n < base + merged; n++) {
+      reject(order[n], CLIENT_COMPOSITION_OPCODE_MERGE_SRC);
+    }
+    first = base + merged;
+  }
+
+  for (size_t n = 0; n < count; n++) {
+    size_t i = order[n];
+    const layer_t* layer = config->layer_list[i];
+
+    if (layer->type == LAYER_TYPE_COLOR) {
+      // Only a bottom fill can be done, by the blender background.
+      const color_layer_t& color = layer->cfg.color;
+      if (n != 0 || color.color_count != 4 ||
+          (color.format != ZX_PIXEL_FORMAT_ARGB_8888 &&
+           color.format != ZX_PIXEL_FORMAT_RGB_x888)) {
+        reject(i, CLIENT_COMPOSITION_OPCODE_USE_PRIMARY);
+        continue;
+      }
+      uint32_t argb;
+      memcpy(&argb, color.color_list, sizeof(argb));
+      plan->background = argb | 0xFF000000;
+      continue;
+    }
+    if (layer->type != LAYER_TYPE_PRIMARY) {
+      reject(i, CLIENT_COMPOSITION_OPCODE_USE_PRIMARY);
+      continue;
+    }
+    if (n > base && n < first) {
+      continue;  // Merged into the base layer by the client.
+    }
+
+    const primary_layer_t& primary = layer->cfg.primary;
+    auto it = images_.find(primary.image_handle);
+    if (it == images_.end()) {
+      reject(i, CLIENT_COMPOSITION_OPCODE_USE_PRIMARY);
+      continue;
+    }
+    const Image& image = it->second;
+    const rect_u_t& src = primary.src_frame;
+    const rect_u_t& dest = primary.dest_frame;
+
+    uint32_t global_alpha = 0xFF;
+    if (!std::isnan(primary.alpha_layer_val)) {
+      global_alpha = static_cast<uint32_t>(
+          std::clamp(primary.alpha_layer_val, 0.0f, 1.0f) * 255.0f + 0.5f);
+    }
+    // A small blended layer on top of others is taken to be the pointer. It
+    // may hang off the right and bottom edges, and nothing below is culled
+    // against it, so moving it never changes the rest of the plan.
+    bool is_cursor = n + 1 == count && images >= 2 && primary.alpha_mode != ALPHA_DISABLE &&
+                     global_alpha != 0 && src.width <= kMaxCursorSize &&
+                     src.height <= kMaxCursorSize;
+
+    if (primary.transform_mode != FRAME_TRANSFORM_IDENTITY) {
+      reject(i, CLIENT_COMPOSITION_OPCODE_TRANSFORM);
+    }
+    if (src.width == 0 || src.height == 0 || src.x_pos + src.width > image.width ||
+        src.y_pos + src.height > image.height) {
+      reject(i, CLIENT_COMPOSITION_OPCODE_SRC_FRAME);
+    }
+    // The channel scalers are not used, so frames are copied 1:1.
+    bool on_screen = is_cursor ? dest.x_pos < mode_.width && dest.y_pos < mode_.height
+                               : dest.x_pos + dest.width <= mode_.width &&
+                                     dest.y_pos + dest.height <= mode_.height;
+    if (src.width != dest.width || src.height != dest.height || !on_screen) {
+      reject(i, CLIENT_COMPOSITION_OPCODE_FRAME_SCALE);
+    }
+    if (!ok) {
+      continue;
+    }
+
+    uint32_t attr = kATTR_EN | (image.format << kATTR_FORMAT_SHIFT) |
+                    (global_alpha << kATTR_GLOBAL_ALPHA_SHIFT);
+    if (primary.alpha_mode == ALPHA_DISABLE) {
+      attr |= kATTR_ALPHA_GLOBAL;
+    } else if (global_alpha == 0xFF) {
+      attr |= kATTR_ALPHA_PIXEL;
+    } else {
+      attr |= kATTR_ALPHA_MIXED;
+    }
+
+    Plane plane = {};
+    plane.attr = attr;
+    plane.width = dest.width;
+    plane.height = dest.height;
+    plane.stride_bytes = image.stride_bytes;
+    plane.addr = image.paddr + static_cast<uint64_t>(src.y_pos) * image.stride_bytes +
+                 src.x_pos * 4u;
+    plane.premultiplied = primary.alpha_mode == ALPHA_PREMULTIPLIED;
+    if (is_cursor) {
+      if (cursor) {
+        *cursor = Cursor{i, 0, plane};
+      }
+      plane = PlaceCursor(plane, dest.x_pos, dest.y_pos);
+    } else {
+      plane.x = dest.x_pos;
+      plane.y = dest.y_pos;
+    }
+    plan->planes[plan->plane_count++] = plane;
+  }
+  if (ok) {
+    CullOccludedPlanes(plan);
+    if (cursor && cursor->has_value()) {
+      // Culling only drops planes below it: nothing is stacked above.
+      (*cursor)->pipe = plan->plane_count - 1;
+    }
+  } else if (cursor) {
+    cursor->reset();
+  }
+  return ok;
+}
+
+SoliloquyDisplay::Plane SoliloquyDisplay::PlaceCursor(const Plane& source, uint32_t x,
+                                                      uint32_t y) const {
+  // Clipping the right or bottom edge keeps the first pixel where it is.
+  Plane plane = source;
+  plane.x = x;
+  plane.y = y;
+  plane.width = std::min(source.width, mode_.width - x);
+  plane.height = std::min(source.height, mode_.height - y);
+  return plane;
+}
+
+void SoliloquyDisplay::CullOccludedPlanes(ScanoutPlan* plan) {
+  uint32_t kept = 0;
+  for (uint32_t i = 0; i < plan->plane_count; i++) {
+    Plane plane = plan->planes[i];
+    uint32_t global_alpha = plane.attr >> kATTR_GLOBAL_ALPHA_SHIFT;
+    bool visible = global_alpha != 0 || (plane.attr & kATTR_ALPHA_MASK) == kATTR_ALPHA_PIXEL;
+
+    for (uint32_t j = i + 1; visible && j < plan->plane_count; j++) {
+      const Plane& top = plan->planes[j];
+      if (!top.Opaque()) {
+        continue;
+      }
+      uint32_t top_right = top.x + top.width;
+      uint32_t top_bottom = top.y + top.height;
+      bool spans_x = top.x <= plane.x && top_right >= plane.x + plane.width;
+      bool spans_y = top.y <= plane.y && top_bottom >= plane.y + plane.height;
+
+      // Only whole rows or columns at an edge can be cut: the DE fetches a
+      // rectangle.
+      if (spans_x && top.y <= plane.y && top_bottom > plane.y) {
+        if (top_bottom >= plane.y + plane.height) {
+          visible = false;
+          break;
+        }
+        uint32_t cut = top_bottom - plane.y;
+        plane.y += cut;
+        plane.height -= cut;
+        plane.addr += static_cast<uint64_t>(cut) * plane.stride_bytes;
+      } else if (spans_x && top.y > plane.y && top.y < plane.y + plane.height &&
+                 top_bottom >= plane.y + plane.height) {
+        plane.height = top.y - plane.y;
+      } else if (spans_y && top.x <= plane.x && top_right > plane.x) {
+        if (top_right >= plane.x + plane.width) {
+          visible = false;
+          break;
+        }
+        uint32_t cut = top_right - plane.x;
+        plane.x += cut;
+        plane.width -= cut;
+        plane.addr += cut * 4u;
+      } else if (spans_y && top.x > plane.x && top.x < plane.x + plane.width &&
+                 top_right >= plane.x + plane.width) {
+        plane.width = top.x - plane.x;
+      }
+    }
+
+    if (visible) {
+      plan->planes[kept++] = plane;
+    } else {
+      planes_culled.Add();
+    }
+  }
+  plan->plane_count = kept;
+}
+
+void SoliloquyDisplay::ProgramPlanLocked(const ScanoutPlan& plan) {
+  if (!de_mmio_) {
+    return;
+  }
+
+  uint64_t bytes = 0;
+  uint32_t pipe_ctl = 0;
+  uint32_t route = 0;
+  uint32_t premultiply = 0;
+  bool dirty = !programmed_valid_ || plan.background != programmed_.background ||
+               plan.plane_count != programmed_.plane_count;
+  for (uint32_t pipe = 0; pipe < kChannelCount; pipe++) {
+    uint32_t base = ChannelBase(pipe);
+    bool used = pipe < plan.plane_count;
+    bool was_used = programmed_valid_ && pipe < programmed_.plane_count;
+    if (!used) {
+      if (was_used || !programmed_valid_) {
+        de_mmio_->Write32(0, base + kCH_ATTR);
+      }
+      continue;
+    }
+
+    const Plane& plane = plan.planes[pipe];
+    pipe_ctl |= 1u << (kBLD_PIPE_EN_SHIFT + pipe);
+    route |= pipe << (pipe * 4);
+    if (plane.premultiplied) {
+      premultiply |= 1u << pipe;
+    }
+    bytes += static_cast<uint64_t>(plane.width) * plane.height * 4;
+    if (was_used && plane == programmed_.planes[pipe]) {
+      continue;  // Unchanged since the last flip; the shadow copy is current.
+    }
+    dirty = true;
+
+    bool vi = pipe == kViChannel;
+    uint32_t size = PackSize(plane.width, plane.height);
+    de_mmio_->Write32(vi ? plane.attr | kATTR_VI_RGB_MODE : plane.attr, base + kCH_ATTR);
+    de_mmio_->Write32(size, base + kCH_SIZE);
+    de_mmio_->Write32(0, base + kCH_COORD);
+    de_mmio_->Write32(plane.stride_bytes, base + kCH_PITCH);
+    de_mmio_->Write32(static_cast<uint32_t>(plane.addr),
+                      base + (vi ? kVI_TOP_LADDR : kUI_TOP_LADDR));
+    de_mmio_->Write32(static_cast<uint32_t>(plane.addr >> 32) & 0xFF,
+                      base + (vi ? kVI_TOP_HADDR : kUI_TOP_HADDR));
+    de_mmio_->Write32(size, base + (vi ? kVI_OVL_SIZE : kUI_OVL_SIZE));
+
+    de_mmio_->Write32(size, BldInputSize(pipe));
+    de_mmio_->Write32((plane.y << 16) | plane.x, BldInputOffset(pipe));
+    de_mmio_->Write32(kBLD_MODE_SRC_OVER, BldMode(pipe));
+  }
+  scanout_bytes.Record(bytes);
+
+  if (!dirty) {
+    // Nothing to latch: the load bit stays clear, so the next vblank
+    // reports the config as shown without the DE doing anything.
+    flips_unchanged.Add();
+    return;
+  }
+
+  de_mmio_->Write32(route, kBLD_ROUTE);
+  de_mmio_->Write32(premultiply, kBLD_PREMULTIPLY);
+  de_mmio_->Write32(plan.background, kBLD_BK_COLOR);
+  de_mmio_->Write32(pipe_ctl, kBLD_PIPE_CTL);
+  de_mmio_->Write32(kGLB_DBUFFER_LOAD, kGLB_DBUFFER);
+  programmed_ = plan;
+  programmed_valid_ = true;
+}
+
+void SoliloquyDisplay::SaveAppliedLocked(const display_config_t* config,
+                                         const std::optional<Cursor>& cursor) {
+  applied_layer_count_ = config->layer_count;
+  applied_cc_flags_ = config->cc_flags;
+  for (size_t i = 0; i < config->layer_count; i++) {
+    layer_t& layer = applied_layers_[i];
+    layer = *config->layer_list[i];
+    if (layer.type == LAYER_TYPE_COLOR) {
+      // Planning only accepts four-byte colors.
+      memcpy(applied_colors_[i], layer.cfg.color.color_list, sizeof(applied_colors_[i]));
+      layer.cfg.color.color_list = applied_colors_[i];
+    }
+  }
+  cursor_ = cursor;
+}
+
+bool SoliloquyDisplay::CursorMoveLocked(const display_config_t* config, Plane* out) {
+  if (!cursor_ || config->display_id != kDisplayId ||
+      config->layer_count != applied_layer_count_ || config->cc_flags != applied_cc_flags_) {
+    return false;
+  }
+  for (size_t i = 0; i < config->layer_count; i++) {
+    const layer_t& layer = *config->layer_list[i];
+    const layer_t& applied = applied_layers_[i];
+    if (i != cursor_->layer) {
+      if (!SameLayer(layer, applied)) {
+        return false;
+      }
+    } else if (layer.type != LAYER_TYPE_PRIMARY || layer.z_index != applied.z_index ||
+               !SamePrimarySource(layer.cfg.primary, applied.cfg.primary)) {
+      return false;
+    }
+  }
+
+  const rect_u_t& dest = config->layer_list[cursor_->layer]->cfg.primary.dest_frame;
+  if (dest.x_pos >= mode_.width || dest.y_pos >= mode_.height) {
+    return false;  // Fully off screen; the full check rejects it.
+  }
+  *out = PlaceCursor(cursor_->source, dest.x_pos, dest.y_pos);
+  return true;
+}
+
+void SoliloquyDisplay::MoveCursorLocked(const Plane& plane, const config_stamp_t& stamp) {
+  uint32_t pipe = cursor_->pipe;
+  applied_layers_[cursor_->layer].cfg.primary.dest_frame.x_pos = plane.x;
+  applied_layers_[cursor_->layer].cfg.primary.dest_frame.y_pos = plane.y;
+  cursor_moves.Add();
+
+  // The new config is the newest pending one with the cursor moved, so it
+  // takes that config's place; the stamp it replaces counts as superseded.
+  if (queue_count_ > 0) {
+    Flip& newest = queue_[(queue_head_ + queue_count_ - 1) % kMaxFlipQueueDepth];
+    newest.plan.planes[pipe] = plane;
+    newest.stamp = stamp;
+    return;
+  }
+
+  // Otherwise the newest config is the one in the shadow registers.
+  if (de_mmio_ && programmed_valid_) {
+    const Plane& old = programmed_.planes[pipe];
+    uint32_t base = ChannelBase(pipe);
+    if (plane.width != old.width || plane.height != old.height) {
+      uint32_t size = PackSize(plane.width, plane.height);
+      de_mmio_->Write32(size, base + kCH_SIZE);
+      de_mmio_->Write32(size, base + (pipe == kViChannel ? kVI_OVL_SIZE : kUI_OVL_SIZE));
+      de_mmio_->Write32(size, BldInputSize(pipe));
+    }
+    de_mmio_->Write32((plane.y << 16) | plane.x, BldInputOffset(pipe));
+    // If a latch happened but its vblank has not been handled yet, this
+    // re-arms it and that stamp is reported one vblank late, together with
+    // this one.
+    de_mmio_->Write32(kGLB_DBUFFER_LOAD, kGLB_DBUFFER);
+    programmed_.planes[pipe] = plane;
+  }
+
+  if (!vsync_thread_started_) {
+    shown_stamp_ = stamp;
+    return;
+  }
+  if (!latch_pending_) {
+    latching_.plan = programmed_;
+    latch_pending_ = true;
+  } else {
+    latching_.plan.planes[pipe] = plane;
+  }
+  latching_.stamp = stamp;
+}
+
+config_check_result_t SoliloquyDisplay::DisplayControllerImplCheckConfiguration(
+    const display_config_t** display_configs, size_t display_count,
+    client_composition_opcode_t* out_client_composition_opcodes_list,
+    size_t client_composition_opcodes_count, size_t* out_client_composition_opcodes_actual) {
+  *out_client_composition_opcodes_actual = 0;
+  if (display_count != 1) {
+    return display_count == 0 ? CONFIG_CHECK_RESULT_OK
+                              : CONFIG_CHECK_RESULT_TOO_MANY;
+  }
+
+  const display_config_t* config = display_configs[0];
+  if (config->display_id != kDisplayId) {
+    return CONFIG_CHECK_RESULT_INVALID_CONFIG;
+  }
+  if (config->layer_count > kMaxLayers) {
+    return CONFIG_CHECK_RESULT_UNSUPPORTED_CONFIG;
+  }
+  if (client_composition_opcodes_count < config->layer_count) {
+    return CONFIG_CHECK_RESULT_INVALID_CONFIG;
+  }
+
+  std::fill(out_client_composition_opcodes_list,
+            out_client_composition_opcodes_list + config->layer_count, 0);
+  ScanoutPlan plan;
+  fbl::AutoLock lock(&lock_);
+  Plane cursor;
+  if (CursorMoveLocked(config, &cursor)) {
+    return CONFIG_CHECK_RESULT_OK;
+  }
+  if (!PlanLayersLocked(config, &plan, out_client_composition_opcodes_list, nullptr)) {
+    *out_client_composition_opcodes_actual = config->layer_count;
+  }
+  return CONFIG_CHECK_RESULT_OK;
+}
+
+void SoliloquyDisplay::DisplayControllerImplApplyConfiguration(
+    const display_config_t** display_configs, size_t display_count,
+    const config_stamp_t* banjo_config_stamp) {
+  ScanoutPlan plan = {};
+  plan.background = 0xFF000000;
+
+  fbl::AutoLock lock(&lock_);
+  Plane moved;
+  if (display_count > 0 && CursorMoveLocked(display_configs[0], &moved)) {
+    // Pointer motion: no planning, no flip queue slot, a register write or
+    // two.
+    MoveCursorLocked(moved, *banjo_config_stamp);
+    return;
+  }
+
+  std::optional<Cursor> cursor;
+  cursor_.reset();
+  if (display_count > 0 && display_configs[0]->layer_count <= kMaxLayers) {
+    if (PlanLayersLocked(display_configs[0], &plan, nullptr, &cursor)) {
+      SaveAppliedLocked(display_configs[0], cursor);
+    } else {
+      // The coordinator only applies checked configs; blank rather than
+      // scan out a partial stack.
+      zxlogf(WARNING, "Applying a config that needs client composition");
+      plan = {};
+      plan.background = 0xFF000000;
+    }
+  }
+
+  Flip flip = {plan, *banjo_config_stamp};
+  if (!vsync_thread_started_) {
+    // No vblank to wait for; the config is live once latched.
+    ProgramPlanLocked(plan);
+    shown_stamp_ = flip.stamp;
+    return;
+  }
+  if (!latch_pending_) {
+    StartFlipLocked(flip);
+    return;
+  }
+  if (queue_count_ == flip_queue_depth_) {
+    // Full: the newest waiting config is superseded before it was shown.
+    queue_[(queue_head_ + queue_count_ - 1) % kMaxFlipQueueDepth] = flip;
+    flips_dropped.Add();
+    return;
+  }
+  queue_[(queue_head_ + queue_count_) % kMaxFlipQueueDepth] = flip;
+  queue_count_++;
+}
+
+void SoliloquyDisplay::StartFlipLocked(const Flip& flip) {
+  ProgramPlanLocked(flip.plan);
+  latching_ = flip;
+  latch_pending_ = true;
+}
+
+void SoliloquyDisplay::HandleVsync(zx::time timestamp) {
+  config_stamp_t stamp;
+  {
+    fbl::AutoLock lock(&lock_);
+    tcon_mmio_->ClearBits32(kTCON_GINT0_TCON1_VB_INT_FLAG, kTCON_GINT0);
+
+    // The load bit self-clears when the shadow registers are copied.
+    if (latch_pending_ && !(de_mmio_->Read32(kGLB_DBUFFER) & kGLB_DBUFFER_LOAD)) {
+      shown_stamp_ = latching_.stamp;
+      latch_pending_ = false;
+      flips_shown.Add();
+    }
+    // Writing the next config right after a latch leaves it a whole frame
+    // to land before the following vblank.
+    if (!latch_pending_ && queue_count_ > 0) {
+      StartFlipLocked(queue_[queue_head_]);
+      queue_head_ = (queue_head_ + 1) % kMaxFlipQueueDepth;
+      queue_count_--;
+    }
+    stamp = shown_stamp_;
+  }
+
+  if (has_display_ && intf_.is_valid()) {
+    intf_.OnDisplayVsync(kDisplayId, timestamp.get(), &stamp);
+  }
+}
+
+zx_status_t SoliloquyDisplay::StartVsyncThread(ddk::PDevProtocolClient& pdev) {
+  if (!de_mmio_ || !tcon_mmio_) {
+    return ZX_ERR_BAD_STATE;
+  }
+
+  zx_status_t status = pdev.GetInterrupt(0, 0, &vsync_irq_);
+  if (status != ZX_OK) {
+    zxlogf(WARNING, "Failed to get TCON interrupt: %s", zx_status_get_string(status));
+    return status;
+  }
+  status = zx::port::create(ZX_PORT_BIND_TO_INTERRUPT, &vsync_port_);
+  if (status != ZX_OK) {
+    zxlogf(WARNING, "Failed to create vsync port: %s", zx_status_get_string(status));
+    return status;
+  }
+  status = vsync_irq_.bind(vsync_port_, kPortKeyVsync, 0);
+  if (status != ZX_OK) {
+    zxlogf(WARNING, "Failed to bind TCON interrupt: %s", zx_status_get_string(status));
+    return status;
+  }
+
+  tcon_mmio_->ClearBits32(kTCON_GINT0_TCON1_VB_INT_FLAG, kTCON_GINT0);
+  tcon_mmio_->SetBits32(kTCON_GINT0_TCON1_VB_INT_EN, kTCON_GINT0);
+
+  int rc = thrd_create_with_name(
+      &vsync_thread_,
+      [](void* arg) { return static_cast<SoliloquyDisplay*>(arg)->VsyncThread(); }, this,
+      "soliloquy-display-vsync");
+  if (rc != thrd_success) {
+    tcon_mmio_->ClearBits32(kTCON_GINT0_TCON1_VB_INT_EN, kTCON_GINT0);
+    return ZX_ERR_NO_RESOURCES;
+  }
+  fbl::AutoLock lock(&lock_);
+  vsync_thread_started_ = true;
+  return ZX_OK;
+}
+
+void SoliloquyDisplay::StopVsyncThread() {
+  {
+    fbl::AutoLock lock(&lock_);
+    if (!vsync_thread_started_) {
+      return;
+    }
+    vsync_thread_started_ = false;
+  }
+
+  tcon_mmio_->ClearBits32(kTCON_GINT0_TCON1_VB_INT_EN, kTCON_GINT0);
+  zx_port_packet_t packet = {};
+  packet.key = kPortKeyStop;
+  packet.type = ZX_PKT_TYPE_USER;
+  vsync_port_.queue(&packet);
+  thrd_join(vsync_thread_, nullptr);
+  vsync_irq_.destroy();
+}
+
+int SoliloquyDisplay::VsyncThread() {
+  while (true) {
+    zx_port_packet_t packet;
+    zx_status_t status = vsync_port_.wait(zx::time::infinite(), &packet);
+    if (status != ZX_OK) {
+      zxlogf(ERROR, "Vsync port wait failed: %s", zx_status_get_string(status));
+      return status;
+    }
+
+    switch (packet.key) {
+      case kPortKeyStop:
+        return 0;
+      case kPortKeyVsync:
+        HandleVsync(zx::time(packet.interrupt.timestamp));
+        vsync_irq_.ack();
+        break;
+    }
+  }
+}
+
 static constexpr zx_driver_ops_t driver_ops = []() {
   zx_driver_ops_t ops = {};
   ops.version = DRIVER_OPS_VERSION;
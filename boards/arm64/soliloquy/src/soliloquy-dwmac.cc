@@ -0,0 +1,694 @@
+// Copyright 2024 Soliloquy Authors
+// SPDX-License-Identifier: Apache-2.0
+//
+// Soliloquy Ethernet Driver
+// Synopsys DesignWare Ethernet QoS (DWMAC 4.x) MAC on the Allwinner A527
+
+#include "soliloquy-dwmac.h"
+
+#include <lib/ddk/binding.h>
+#include <lib/ddk/debug.h>
+#include <lib/ddk/device.h>
+#include <lib/ddk/driver.h>
+#include <lib/ddk/metadata.h>
+#include <lib/ddk/platform-defs.h>
+#include <lib/device-protocol/pdev.h>
+#include <lib/zx/vmar.h>
+#include <zircon/status.h>
+#include <zircon/syscalls.h>
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+
+#include <fbl/alloc_checker.h>
+#include <fbl/auto_lock.h>
+
+#include "../../../../drivers/common/soliloquy_hal/metrics.h"
+#include "../../../../drivers/common/soliloquy_hal/mmio.h"
+
+namespace soliloquy_dwmac {
+
+namespace {
+soliloquy_hal::Histogram init_us("soliloquy-dwmac.init_us");
+soliloquy_hal::Counter rx_frames("soliloquy-dwmac.rx_frames");
+soliloquy_hal::Counter rx_errors("soliloquy-dwmac.rx_errors");
+soliloquy_hal::Counter tx_frames("soliloquy-dwmac.tx_frames");
+soliloquy_hal::Counter tx_ring_full("soliloquy-dwmac.tx_ring_full");
+soliloquy_hal::Counter irqs("soliloquy-dwmac.irqs");
+soliloquy_hal::Counter polls("soliloquy-dwmac.polls");
+}  // namespace
+
+zx_status_t SoliloquyDwmac::Create(void* ctx, zx_device_t* parent) {
+  fbl::AllocChecker ac;
+  auto dev = fbl::make_unique_checked<SoliloquyDwmac>(&ac, parent);
+  if (!ac.check()) {
+    return ZX_ERR_NO_MEMORY;
+  }
+
+  auto status = dev->Init();
+  if (status != ZX_OK) {
+    return status;
+  }
+
+  [[maybe_unused]] auto* dummy = dev.release();
+  return ZX_OK;
+}
+
+zx_status_t SoliloquyDwmac::Init() {
+  SOLILOQUY_TIMED_SCOPE(init_us, "dwmac_init");
+  auto status = InitHardware();
+  if (status != ZX_OK) {
+    zxlogf(ERROR, "Hardware init failed: %s", zx_status_get_string(status));
+    Shutdown();
+    return status;
+  }
+
+  soliloquy_hal::PublishMetrics(inspector_);
+  status = DdkAdd(ddk::DeviceAddArgs("soliloquy-dwmac")
+                      .set_proto_id(ZX_PROTOCOL_ETHERNET_IMPL)
+                      .set_inspect_vmo(inspector_.DuplicateVmo()));
+  if (status != ZX_OK) {
+    zxlogf(ERROR, "Failed to add device: %s", zx_status_get_string(status));
+    Shutdown();
+    return status;
+  }
+
+  zxlogf(INFO, "Soliloquy Ethernet driver initialized, MAC %02x:%02x:%02x:%02x:%02x:%02x",
+         mac_[0], mac_[1], mac_[2], mac_[3], mac_[4], mac_[5]);
+  return ZX_OK;
+}
+
+zx_status_t SoliloquyDwmac::InitHardware() {
+  ddk::PDevProtocolClient pdev(parent());
+  if (!pdev.is_valid()) {
+    zxlogf(ERROR, "No platform device");
+    return ZX_ERR_NOT_SUPPORTED;
+  }
+
+  std::optional<fdf::MmioBuffer> mmio;
+  auto status = pdev.MapMmio(0, &mmio);
+  if (status != ZX_OK) {
+    zxlogf(ERROR, "Failed to map MMIO: %s", zx_status_get_string(status));
+    return status;
+  }
+  mmio_ = std::move(mmio);
+
+  status = pdev.GetBti(0, &bti_);
+  if (status != ZX_OK) {
+    zxlogf(ERROR, "Failed to get BTI: %s", zx_status_get_string(status));
+    return status;
+  }
+  status = pdev.GetInterrupt(0, 0, &irq_);
+  if (status != ZX_OK) {
+    zxlogf(ERROR, "Failed to get interrupt: %s", zx_status_get_string(status));
+    return status;
+  }
+
+  // The MAC address has to be read before the reset clears it.
+  ReadMacAddress();
+
+  status = InitBuffers();
+  if (status != ZX_OK) {
+    return status;
+  }
+
+  status = FindPhy();
+  if (status != ZX_OK) {
+    return status;
+  }
+
+  status = InitMac();
+  if (status != ZX_OK) {
+    return status;
+  }
+  return StartIrqThread();
+}
+
+void SoliloquyDwmac::ReadMacAddress() {
+  size_t actual;
+  zx_status_t status = device_get_metadata(parent(), DEVICE_METADATA_MAC_ADDRESS, mac_,
+                                           sizeof(mac_), &actual);
+  if (status == ZX_OK && actual == sizeof(mac_)) {
+    return;
+  }
+
+  // Left by the bootloader, which takes it from the SID efuses.
+  uint32_t high = mmio_->Read32(kMAC_ADDR0_HIGH);
+  uint32_t low = mmio_->Read32(kMAC_ADDR0_LOW);
+  uint8_t mac[ETH_MAC_SIZE] = {
+      static_cast<uint8_t>(low),        static_cast<uint8_t>(low >> 8),
+      static_cast<uint8_t>(low >> 16),  static_cast<uint8_t>(low >> 24),
+      static_cast<uint8_t>(high),       static_cast<uint8_t>(high >> 8),
+  };
+  bool all_ones = (low == 0xFFFFFFFF) && ((high & 0xFFFF) == 0xFFFF);
+  bool all_zero = low == 0 && (high & 0xFFFF) == 0;
+  if (!all_ones && !all_zero && !(mac[0] & 0x01)) {
+    memcpy(mac_, mac, sizeof(mac_));
+    return;
+  }
+
+  // Random, unicast and locally administered.
+  zx_cprng_draw(mac_, sizeof(mac_));
+  mac_[0] = (mac_[0] & ~0x01) | 0x02;
+  zxlogf(WARNING, "No MAC address provisioned, using a random one");
+}
+
+zx_status_t SoliloquyDwmac::InitBuffers() {
+  // Descriptors are uncached so the CPU and DMA see each other's updates
+  // in order without cache maintenance.
+  const size_t desc_size = (kTxRingSize + kRxRingSize) * sizeof(DmaDescriptor);
+  auto status = zx::vmo::create_contiguous(bti_, desc_size, 0, &desc_vmo_);
+  if (status != ZX_OK) {
+    return status;
+  }
+  status = desc_vmo_.set_cache_policy(ZX_CACHE_POLICY_UNCACHED_DEVICE);
+  if (status != ZX_OK) {
+    return status;
+  }
+  zx_vaddr_t vaddr;
+  status = zx::vmar::root_self()->map(ZX_VM_PERM_READ | ZX_VM_PERM_WRITE, 0, desc_vmo_, 0,
+                                      desc_size, &vaddr);
+  if (status != ZX_OK) {
+    return status;
+  }
+  descs_ = reinterpret_cast<DmaDescriptor*>(vaddr);
+  status = bti_.pin(ZX_BTI_PERM_READ | ZX_BTI_PERM_WRITE | ZX_BTI_CONTIGUOUS, desc_vmo_, 0,
+                    desc_size, &descs_paddr_, 1, &desc_pmt_);
+  if (status != ZX_OK) {
+    zxlogf(ERROR, "Failed to pin descriptors: %s", zx_status_get_string(status));
+    return status;
+  }
+  // The DMA runs without EAME, so descriptors and buffers carry 32-bit
+  // addresses only.
+  if (descs_paddr_ + desc_size - 1 > UINT32_MAX) {
+    zxlogf(ERROR, "Descriptor ring at 0x%lx is above the DMA's 4 GiB reach", descs_paddr_);
+    return ZX_ERR_OUT_OF_RANGE;
+  }
+  tx_ring_ = descs_;
+  rx_ring_ = descs_ + kTxRingSize;
+
+  const size_t buffer_size = (kTxRingSize + kRxRingSize) * kBufferSize;
+  status = zx::vmo::create(buffer_size, 0, &buffer_vmo_);
+  if (status != ZX_OK) {
+    return status;
+  }
+  status = zx::vmar::root_self()->map(ZX_VM_PERM_READ | ZX_VM_PERM_WRITE, 0, buffer_vmo_, 0,
+                                      buffer_size, &vaddr);
+  if (status != ZX_OK) {
+    return status;
+  }
+  buffers_ = reinterpret_cast<uint8_t*>(vaddr);
+  buffer_pages_.resize(buffer_size / ZX_PAGE_SIZE);
+  status = bti_.pin(ZX_BTI_PERM_READ | ZX_BTI_PERM_WRITE, buffer_vmo_, 0, buffer_size,
+                    buffer_pages_.data(), buffer_pages_.size(), &buffer_pmt_);
+  if (status != ZX_OK) {
+    zxlogf(ERROR, "Failed to pin frame buffers: %s", zx_status_get_string(status));
+    return status;
+  }
+  for (zx_paddr_t page : buffer_pages_) {
+    if (page + ZX_PAGE_SIZE - 1 > UINT32_MAX) {
+      zxlogf(ERROR, "Frame buffer page at 0x%lx is above the DMA's 4 GiB reach", page);
+      return ZX_ERR_OUT_OF_RANGE;
+    }
+  }
+
+  memset(tx_ring_, 0, kTxRingSize * sizeof(DmaDescriptor));
+  for (size_t i = 0; i < kRxRingSize; i++) {
+    zx_paddr_t paddr = BufferPaddr(kTxRingSize + i);
+    rx_ring_[i].des0 = static_cast<uint32_t>(paddr);
+    rx_ring_[i].des1 = 0;
+    rx_ring_[i].des2 = 0;
+    rx_ring_[i].des3 = kDES3_OWN | kDES3_RX_BUF1V |
+                       ((i + 1) % kRxCoalesceFrames == 0 ? kDES3_RX_IOC : 0);
+  }
+  buffer_vmo_.op_range(ZX_VMO_OP_CACHE_CLEAN_INVALIDATE, kTxRingSize * kBufferSize,
+                       kRxRingSize * kBufferSize, nullptr, 0);
+  return ZX_OK;
+}
+
+zx_paddr_t SoliloquyDwmac::BufferPaddr(size_t index) const {
+  size_t offset = index * kBufferSize;
+  return buffer_pages_[offset / ZX_PAGE_SIZE] + offset % ZX_PAGE_SIZE;
+}
+
+zx_status_t SoliloquyDwmac::InitMac() {
+  soliloquy_hal::MmioHelper helper(&*mmio_);
+
+  // Needs the PHY's receive clock running, so the PHY is up by now.
+  mmio_->SetBits32(kDMA_MODE_SWR, kDMA_MODE);
+  if (!helper.WaitForMask32(kDMA_MODE, kDMA_MODE_SWR, 0, zx::msec(100))) {
+    zxlogf(ERROR, "DMA reset timed out; is the PHY clock running?");
+    return ZX_ERR_TIMED_OUT;
+  }
+
+  mmio_->Write32(kDMA_SYSBUS_MODE_BURSTS, kDMA_SYSBUS_MODE);
+  mmio_->Write32(0, kDMA_CH0_CONTROL);
+  mmio_->Write32(kDMA_CH_PBL_32 | kDMA_CH_TX_CONTROL_OSP, kDMA_CH0_TX_CONTROL);
+  mmio_->Write32(kDMA_CH_PBL_32 | (kBufferSize << kDMA_CH_RX_CONTROL_RBSZ_SHIFT),
+                 kDMA_CH0_RX_CONTROL);
+
+  zx_paddr_t tx_base = DescPaddr(tx_ring_, 0);
+  zx_paddr_t rx_base = DescPaddr(rx_ring_, 0);
+  // InitBuffers() kept everything below 4 GiB.
+  mmio_->Write32(0, kDMA_CH0_TXDESC_LIST_HADDR);
+  mmio_->Write32(static_cast<uint32_t>(tx_base), kDMA_CH0_TXDESC_LIST_ADDR);
+  mmio_->Write32(0, kDMA_CH0_RXDESC_LIST_HADDR);
+  mmio_->Write32(static_cast<uint32_t>(rx_base), kDMA_CH0_RXDESC_LIST_ADDR);
+  mmio_->Write32(kTxRingSize - 1, kDMA_CH0_TXDESC_RING_LEN);
+  mmio_->Write32(kRxRingSize - 1, kDMA_CH0_RXDESC_RING_LEN);
+  mmio_->Write32(static_cast<uint32_t>(tx_base), kDMA_CH0_TXDESC_TAIL);
+  mmio_->Write32(static_cast<uint32_t>(DescPaddr(rx_ring_, kRxRingSize)), kDMA_CH0_RXDESC_TAIL);
+  mmio_->Write32(kRxWatchdog, kDMA_CH0_RX_WATCHDOG);
+
+  // Give queue 0 the whole FIFO in each direction.
+  uint32_t feature1 = mmio_->Read32(kMAC_HW_FEATURE1);
+  uint32_t tx_fifo = 128u << ((feature1 >> 6) & 0x1F);
+  uint32_t rx_fifo = 128u << (feature1 & 0x1F);
+  mmio_->Write32(kMTL_TXQ_OP_MODE_TSF | kMTL_TXQ_OP_MODE_TXQEN |
+                     ((tx_fifo / 256 - 1) << kMTL_TXQ_OP_MODE_TQS_SHIFT),
+                 kMTL_TXQ0_OP_MODE);
+  mmio_->Write32(kMTL_RXQ_OP_MODE_RSF | ((rx_fifo / 256 - 1) << kMTL_RXQ_OP_MODE_RQS_SHIFT),
+                 kMTL_RXQ0_OP_MODE);
+
+  uint32_t feature0 = mmio_->Read32(kMAC_HW_FEATURE0);
+  tx_checksum_ = feature0 & kMAC_HW_FEATURE0_TXCOESEL;
+  rx_checksum_ = feature0 & kMAC_HW_FEATURE0_RXCOESEL;
+
+  mmio_->Write32(static_cast<uint32_t>(mac_[5]) << 8 | mac_[4] | kMAC_ADDR_HIGH_AE,
+                 kMAC_ADDR0_HIGH);
+  mmio_->Write32(static_cast<uint32_t>(mac_[3]) << 24 | static_cast<uint32_t>(mac_[2]) << 16 |
+                     static_cast<uint32_t>(mac_[1]) << 8 | mac_[0],
+                 kMAC_ADDR0_LOW);
+  mmio_->Write32(0, kMAC_PACKET_FILTER);
+  mmio_->Write32(kMAC_RXQ_CTRL0_Q0_DCB, kMAC_RXQ_CTRL0);
+  // Link changes come from polling the PHY.
+  mmio_->Write32(0, kMAC_INT_EN);
+  mmio_->Write32(kMAC_CONFIG_DM | kMAC_CONFIG_ACS | kMAC_CONFIG_CST |
+                     (rx_checksum_ ? kMAC_CONFIG_IPC : 0) | kMAC_CONFIG_TE | kMAC_CONFIG_RE,
+                 kMAC_CONFIG);
+
+  mmio_->Write32(0xFFFFFFFF, kDMA_CH0_STATUS);
+  mmio_->Write32(kDMA_CH_IRQS, kDMA_CH0_INT_EN);
+  mmio_->SetBits32(kDMA_CH_TX_CONTROL_ST, kDMA_CH0_TX_CONTROL);
+  mmio_->SetBits32(kDMA_CH_RX_CONTROL_SR, kDMA_CH0_RX_CONTROL);
+  return ZX_OK;
+}
+
+zx_status_t SoliloquyDwmac::MdioRead(uint32_t reg, uint16_t* out_value) {
+  soliloquy_hal::MmioHelper helper(&*mmio_);
+  mmio_->Write32(phy_addr_ << kMAC_MDIO_ADDR_PHY_SHIFT | reg << kMAC_MDIO_ADDR_REG_SHIFT |
+                     kMAC_MDIO_ADDR_CR | kMAC_MDIO_ADDR_GOC_READ | kMAC_MDIO_ADDR_GB,
+                 kMAC_MDIO_ADDR);
+  if (!helper.WaitForMask32(kMAC_MDIO_ADDR, kMAC_MDIO_ADDR_GB, 0, kMdioTimeout)) {
+    return ZX_ERR_TIMED_OUT;
+  }
+  *out_value = static_cast<uint16_t>(mmio_->Read32(kMAC_MDIO_DATA));
+  return ZX_OK;
+}
+
+zx_status_t SoliloquyDwmac::MdioWrite(uint32_t reg, uint16_t value) {
+  soliloquy_hal::MmioHelper helper(&*mmio_);
+  mmio_->Write32(value, kMAC_MDIO_DATA);
+  mmio_->Write32(phy_addr_ << kMAC_MDIO_ADDR_PHY_SHIFT | reg << kMAC_MDIO_ADDR_REG_SHIFT |
+                     kMAC_MDIO_ADDR_CR | kMAC_MDIO_ADDR_GOC_WRITE | kMAC_MDIO_ADDR_GB,
+                 kMAC_MDIO_ADDR);
+  if (!helper.WaitForMask32(kMAC_MDIO_ADDR, kMAC_MDIO_ADDR_GB, 0, kMdioTimeout)) {
+    return ZX_ERR_TIMED_OUT;
+  }
+  return ZX_OK;
+}
+
+zx_status_t SoliloquyDwmac::FindPhy() {
+  for (phy_addr_ = 0; phy_addr_ < 32; phy_addr_++) {
+    uint16_t id;
+    if (MdioRead(kMII_PHYID1, &id) == ZX_OK && id != 0 && id != 0xFFFF) {
+      break;
+    }
+  }
+  if (phy_addr_ == 32) {
+    zxlogf(ERROR, "No PHY on the MDIO bus");
+    return ZX_ERR_NOT_FOUND;
+  }
+
+  uint16_t bmsr;
+  zx_status_t status = MdioRead(kMII_BMSR, &bmsr);
+  if (status != ZX_OK) {
+    return status;
+  }
+  uint16_t anar;
+  status = MdioRead(kMII_ANAR, &anar);
+  if (status != ZX_OK) {
+    return status;
+  }
+  anar |= kADVERTISE_10HALF | kADVERTISE_10FULL | kADVERTISE_100HALF | kADVERTISE_100FULL;
+  MdioWrite(kMII_ANAR, anar);
+  if (bmsr & kBMSR_ESTATEN) {
+    // Half-duplex gigabit is not supported by the MAC.
+    MdioWrite(kMII_CTRL1000, kADVERTISE_1000FULL);
+  }
+  MdioWrite(kMII_BMCR, kBMCR_ANENABLE | kBMCR_ANRESTART);
+  zxlogf(DEBUG, "PHY at MDIO address %u", phy_addr_);
+  return ZX_OK;
+}
+
+void SoliloquyDwmac::UpdateLink() {
+  // The link bit latches low; the second read is the current state.
+  uint16_t bmsr;
+  if (MdioRead(kMII_BMSR, &bmsr) != ZX_OK || MdioRead(kMII_BMSR, &bmsr) != ZX_OK) {
+    return;
+  }
+  bool up = bmsr & kBMSR_LSTATUS;
+  if (up == link_up_) {
+    return;
+  }
+  link_up_ = up;
+
+  if (up) {
+    uint16_t anar = 0, anlpar = 0, ctrl1000 = 0, stat1000 = 0;
+    MdioRead(kMII_ANAR, &anar);
+    MdioRead(kMII_ANLPAR, &anlpar);
+    if (bmsr & kBMSR_ESTATEN) {
+      MdioRead(kMII_CTRL1000, &ctrl1000);
+      MdioRead(kMII_STAT1000, &stat1000);
+    }
+    uint16_t common = anar & anlpar;
+    uint32_t speed;
+    bool full;
+    if ((ctrl1000 & kADVERTISE_1000FULL) && (stat1000 & kLPA_1000FULL)) {
+      speed = 1000;
+      full = true;
+    } else if (common & (kADVERTISE_100FULL | kADVERTISE_100HALF)) {
+      speed = 100;
+      full = common & kADVERTISE_100FULL;
+    } else {
+      speed = 10;
+      full = common & kADVERTISE_10FULL;
+    }
+
+    uint32_t config = mmio_->Read32(kMAC_CONFIG) & ~kMAC_CONFIG_SPEED_MASK;
+    if (speed != 1000) {
+      config |= kMAC_CONFIG_PS | (speed == 100 ? kMAC_CONFIG_FES : 0);
+    }
+    config |= full ? kMAC_CONFIG_DM : 0;
+    mmio_->Write32(config, kMAC_CONFIG);
+    zxlogf(INFO, "Link up, %u Mb/s %s duplex", speed, full ? "full" : "half");
+  } else {
+    zxlogf(INFO, "Link down");
+  }
+
+  fbl::AutoLock lock(&ifc_lock_);
+  if (started_) {
+    ifc_.Status(up ? ETHERNET_STATUS_ONLINE : 0);
+  }
+}
+
+zx_status_t SoliloquyDwmac::StartIrqThread() {
+  auto status = zx::port::create(ZX_PORT_BIND_TO_INTERRUPT, &port_);
+  if (status != ZX_OK) {
+    return status;
+  }
+  status = irq_.bind(port_, kPortKeyIrq, 0);
+  if (status != ZX_OK) {
+    return status;
+  }
+  status = zx::timer::create(0, ZX_CLOCK_MONOTONIC, &link_timer_);
+  if (status != ZX_OK) {
+    return status;
+  }
+  link_timer_.set(zx::deadline_after(kLinkPollInterval), zx::msec(10));
+  link_timer_.wait_async(port_, kPortKeyLinkTimer, ZX_TIMER_SIGNALED, 0);
+
+  int rc = thrd_create_with_name(
+      &irq_thread_, [](void* arg) { return static_cast<SoliloquyDwmac*>(arg)->IrqThread(); },
+      this, "soliloquy-dwmac-irq");
+  if (rc != thrd_success) {
+    return ZX_ERR_INTERNAL;
+  }
+  irq_thread_started_ = true;
+  return ZX_OK;
+}
+
+void SoliloquyDwmac::StopIrqThread() {
+  if (!irq_thread_started_) {
+    return;
+  }
+  stopping_ = true;
+  zx_port_packet_t packet = {};
+  packet.key = kPortKeyStop;
+  packet.type = ZX_PKT_TYPE_USER;
+  port_.queue(&packet);
+  thrd_join(irq_thread_, nullptr);
+  irq_thread_started_ = false;
+}
+
+void SoliloquyDwmac::Shutdown() {
+  StopIrqThread();
+  if (mmio_) {
+    mmio_->Write32(0, kDMA_CH0_INT_EN);
+    mmio_->ClearBits32(kDMA_CH_TX_CONTROL_ST, kDMA_CH0_TX_CONTROL);
+    mmio_->ClearBits32(kDMA_CH_RX_CONTROL_SR, kDMA_CH0_RX_CONTROL);
+    mmio_->ClearBits32(kMAC_CONFIG_TE | kMAC_CONFIG_RE, kMAC_CONFIG);
+  }
+  if (desc_pmt_) {
+    desc_pmt_.unpin();
+  }
+  if (buffer_pmt_) {
+    buffer_pmt_.unpin();
+  }
+}
+
+int SoliloquyDwmac::IrqThread() {
+  while (true) {
+    zx_port_packet_t packet;
+    auto status = port_.wait(zx::time::infinite(), &packet);
+    if (status != ZX_OK) {
+      zxlogf(ERROR, "IRQ port wait failed: %s", zx_status_get_string(status));
+      return status;
+    }
+    if (packet.key == kPortKeyStop) {
+      return 0;
+    }
+    if (packet.key == kPortKeyLinkTimer) {
+      UpdateLink();
+      link_timer_.set(zx::deadline_after(kLinkPollInterval), zx::msec(10));
+      link_timer_.wait_async(port_, kPortKeyLinkTimer, ZX_TIMER_SIGNALED, 0);
+      continue;
+    }
+
+    irqs.Add();
+    uint32_t pending = mmio_->Read32(kDMA_CH0_STATUS);
+    mmio_->Write32(pending, kDMA_CH0_STATUS);
+    if (pending & kDMA_CH_FBE) {
+      zxlogf(ERROR, "DMA bus error, status 0x%08x", pending);
+    }
+
+    // Polling: the channel interrupts stay masked while passes keep
+    // filling the budget, so a busy link costs no interrupt per batch.
+    // Anything arriving after the last pass leaves its status bit set and
+    // interrupts again as soon as they are unmasked.
+    mmio_->Write32(0, kDMA_CH0_INT_EN);
+    irq_.ack();
+    while (!stopping_) {
+      size_t received = PollRx(kPollBudget);
+      {
+        fbl::AutoLock lock(&tx_lock_);
+        ReclaimTxLocked();
+      }
+      if (received < kPollBudget) {
+        break;
+      }
+      polls.Add();
+    }
+    mmio_->Write32(kDMA_CH_IRQS, kDMA_CH0_INT_EN);
+  }
+}
+
+size_t SoliloquyDwmac::PollRx(size_t budget) {
+  size_t count = 0;
+  fbl::AutoLock lock(&ifc_lock_);
+  while (count < budget) {
+    DmaDescriptor& desc = rx_ring_[rx_head_];
+    uint32_t des3 = desc.des3;
+    if (des3 & kDES3_OWN) {
+      break;
+    }
+
+    const size_t slot = kTxRingSize + rx_head_;
+    const bool whole = (des3 & (kDES3_FD | kDES3_LD)) == (kDES3_FD | kDES3_LD);
+    const bool bad_checksum = rx_checksum_ && (desc.des1 & (kDES1_RX_IPHE | kDES1_RX_IPCE));
+    size_t len = des3 & kDES3_RX_PL_MASK;
+    if (!whole || (des3 & kDES3_ES) || bad_checksum || len > kBufferSize) {
+      rx_errors.Add();
+    } else if (started_) {
+      buffer_vmo_.op_range(ZX_VMO_OP_CACHE_INVALIDATE, slot * kBufferSize, len, nullptr, 0);
+      ifc_.Recv(Buffer(slot), len, 0);
+      rx_frames.Add();
+    }
+
+    desc.des0 = static_cast<uint32_t>(BufferPaddr(slot));
+    desc.des1 = 0;
+    desc.des2 = 0;
+    desc.des3 = kDES3_OWN | kDES3_RX_BUF1V |
+                ((rx_head_ + 1) % kRxCoalesceFrames == 0 ? kDES3_RX_IOC : 0);
+    rx_head_ = (rx_head_ + 1) % kRxRingSize;
+    count++;
+  }
+  if (count > 0) {
+    mmio_->Write32(static_cast<uint32_t>(DescPaddr(rx_ring_, rx_head_)), kDMA_CH0_RXDESC_TAIL);
+  }
+  return count;
+}
+
+void SoliloquyDwmac::ReclaimTxLocked() {
+  while (tx_tail_ != tx_head_ && !(tx_ring_[tx_tail_].des3 & kDES3_OWN)) {
+    tx_tail_ = (tx_tail_ + 1) % kTxRingSize;
+  }
+}
+
+zx_status_t SoliloquyDwmac::EthernetImplQuery(uint32_t options, ethernet_info_t* out_info) {
+  if (options) {
+    return ZX_ERR_INVALID_ARGS;
+  }
+  *out_info = {};
+  out_info->mtu = kMtu;
+  memcpy(out_info->mac, mac_, sizeof(mac_));
+  out_info->netbuf_size = sizeof(ethernet_netbuf_t);
+  return ZX_OK;
+}
+
+void SoliloquyDwmac::EthernetImplStop() {
+  fbl::AutoLock lock(&ifc_lock_);
+  started_ = false;
+  ifc_.clear();
+}
+
+zx_status_t SoliloquyDwmac::EthernetImplStart(const ethernet_ifc_protocol_t* ifc) {
+  fbl::AutoLock lock(&ifc_lock_);
+  if (started_) {
+    return ZX_ERR_ALREADY_BOUND;
+  }
+  ifc_ = ddk::EthernetIfcProtocolClient(ifc);
+  started_ = true;
+  ifc_.Status(link_up_ ? ETHERNET_STATUS_ONLINE : 0);
+  return ZX_OK;
+}
+
+void SoliloquyDwmac::EthernetImplQueueTx(uint32_t options, ethernet_netbuf_t* netbuf,
+                                         ethernet_impl_queue_tx_callback completion_cb,
+                                         void* cookie) {
+  if (netbuf->data_size > kBufferSize || netbuf->data_size == 0) {
+    completion_cb(cookie, ZX_ERR_INVALID_ARGS, netbuf);
+    return;
+  }
+
+  {
+    fbl::AutoLock lock(&tx_lock_);
+    size_t next = (tx_head_ + 1) % kTxRingSize;
+    if (next == tx_tail_) {
+      ReclaimTxLocked();
+    }
+    if (next == tx_tail_) {
+      tx_ring_full.Add();
+      // Hand what is queued to the DMA so the ring drains.
+      if (tx_unkicked_ > 0) {
+        mmio_->Write32(static_cast<uint32_t>(DescPaddr(tx_ring_, tx_head_)),
+                       kDMA_CH0_TXDESC_TAIL);
+        tx_unkicked_ = 0;
+      }
+      completion_cb(cookie, ZX_ERR_NO_RESOURCES, netbuf);
+      return;
+    }
+
+    const size_t slot = tx_head_;
+    memcpy(Buffer(slot), netbuf->data_buffer, netbuf->data_size);
+    buffer_vmo_.op_range(ZX_VMO_OP_CACHE_CLEAN, slot * kBufferSize, netbuf->data_size, nullptr,
+                         0);
+
+    const uint32_t len = static_cast<uint32_t>(netbuf->data_size);
+    DmaDescriptor& desc = tx_ring_[slot];
+    desc.des0 = static_cast<uint32_t>(BufferPaddr(slot));
+    desc.des1 = 0;
+    desc.des2 = len | ((slot + 1) % kTxCoalesceFrames == 0 ? kDES2_TX_IOC : 0);
+    desc.des3 = kDES3_OWN | kDES3_FD | kDES3_LD | (tx_checksum_ ? kDES3_TX_CIC_FULL : 0) | len;
+    tx_head_ = next;
+    tx_unkicked_++;
+
+    // The ethernet core sets MORE while it has further frames queued;
+    // one tail pointer write then covers the whole burst.
+    if (!(options & ETHERNET_TX_OPT_MORE) || tx_unkicked_ >= kTxCoalesceFrames) {
+      mmio_->Write32(static_cast<uint32_t>(DescPaddr(tx_ring_, tx_head_)), kDMA_CH0_TXDESC_TAIL);
+      tx_unkicked_ = 0;
+    }
+  }
+  tx_frames.Add();
+  completion_cb(cookie, ZX_OK, netbuf);
+}
+
+zx_status_t SoliloquyDwmac::EthernetImplSetParam(uint32_t param, int32_t value,
+                                                 const uint8_t* data_buffer, size_t data_size) {
+  switch (param) {
+    case ETHERNET_SETPARAM_PROMISC:
+      if (value) {
+        mmio_->SetBits32(kMAC_PACKET_FILTER_PR, kMAC_PACKET_FILTER);
+      } else {
+        mmio_->ClearBits32(kMAC_PACKET_FILTER_PR, kMAC_PACKET_FILTER);
+      }
+      return ZX_OK;
+    case ETHERNET_SETPARAM_MULTICAST_PROMISC:
+      if (value) {
+        mmio_->SetBits32(kMAC_PACKET_FILTER_PM, kMAC_PACKET_FILTER);
+      } else {
+        mmio_->ClearBits32(kMAC_PACKET_FILTER_PM, kMAC_PACKET_FILTER);
+      }
+      return ZX_OK;
+    case ETHERNET_SETPARAM_MULTICAST_FILTER: {
+      if (value == ETHERNET_MULTICAST_FILTER_OVERFLOW) {
+        mmio_->SetBits32(kMAC_PACKET_FILTER_PM, kMAC_PACKET_FILTER);
+        return ZX_OK;
+      }
+      if (value < 0 || data_size < static_cast<size_t>(value) * ETH_MAC_SIZE) {
+        return ZX_ERR_INVALID_ARGS;
+      }
+      // 256-bin hash: the low byte of the inverted CRC-32, bit-reversed.
+      uint32_t hash[8] = {};
+      for (int32_t i = 0; i < value; i++) {
+        uint32_t crc = 0xFFFFFFFF;
+        for (size_t j = 0; j < ETH_MAC_SIZE; j++) {
+          crc ^= data_buffer[i * ETH_MAC_SIZE + j];
+          for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ ((crc & 1) ? 0xEDB88320 : 0);
+          }
+        }
+        uint32_t bin = 0;
+        for (int bit = 0; bit < 8; bit++) {
+          bin = (bin << 1) | ((~crc >> bit) & 1);
+        }
+        hash[bin >> 5] |= 1u << (bin & 0x1F);
+      }
+      for (size_t i = 0; i < 8; i++) {
+        mmio_->Write32(hash[i], kMAC_HASH_TABLE0 + i * 4);
+      }
+      uint32_t filter = mmio_->Read32(kMAC_PACKET_FILTER) & ~kMAC_PACKET_FILTER_PM;
+      mmio_->Write32(filter | kMAC_PACKET_FILTER_HMC, kMAC_PACKET_FILTER);
+      return ZX_OK;
+    }
+    default:
+      return ZX_ERR_NOT_SUPPORTED;
+  }
+}
+
+void SoliloquyDwmac::EthernetImplGetBti(zx::bti* out_bti) {
+  bti_.duplicate(ZX_RIGHT_SAME_RIGHTS, out_bti);
+}
+
+static constexpr zx_driver_ops_t driver_ops = []() {
+  zx_driver_ops_t ops = {};
+  ops.version = DRIVER_OPS_VERSION;
+  ops.bind = SoliloquyDwmac::Create;
+  return ops;
+}();
+
+}  // namespace soliloquy_dwmac
+
+ZIRCON_DRIVER(soliloquy_dwmac, soliloquy_dwmac::driver_ops, "soliloquy", "0.1");
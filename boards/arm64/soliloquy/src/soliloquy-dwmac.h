@@ -0,0 +1,303 @@
+// Copyright 2024 Soliloquy Authors
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef BOARDS_ARM64_SOLILOQUY_SRC_SOLILOQUY_DWMAC_H_
+#define BOARDS_ARM64_SOLILOQUY_SRC_SOLILOQUY_DWMAC_H_
+
+#include <lib/inspect/cpp/inspect.h>
+#include <lib/mmio/mmio.h>
+#include <lib/zx/bti.h>
+#include <lib/zx/interrupt.h>
+#include <lib/zx/pmt.h>
+#include <lib/zx/port.h>
+#include <lib/zx/timer.h>
+#include <lib/zx/vmo.h>
+#include <threads.h>
+
+#include <atomic>
+#include <optional>
+#include <vector>
+
+#include <ddktl/device.h>
+#include <fbl/mutex.h>
+
+#include <fuchsia/hardware/ethernet/cpp/banjo.h>
+
+namespace soliloquy_dwmac {
+
+// MAC registers
+constexpr uint32_t kMAC_CONFIG = 0x0000;
+constexpr uint32_t kMAC_PACKET_FILTER = 0x0008;
+constexpr uint32_t kMAC_HASH_TABLE0 = 0x0010;  // Eight registers, 256 bins
+constexpr uint32_t kMAC_RXQ_CTRL0 = 0x00A0;
+constexpr uint32_t kMAC_INT_EN = 0x00B4;
+constexpr uint32_t kMAC_HW_FEATURE0 = 0x011C;
+constexpr uint32_t kMAC_HW_FEATURE1 = 0x0120;
+constexpr uint32_t kMAC_MDIO_ADDR = 0x0200;
+constexpr uint32_t kMAC_MDIO_DATA = 0x0204;
+constexpr uint32_t kMAC_ADDR0_HIGH = 0x0300;
+constexpr uint32_t kMAC_ADDR0_LOW = 0x0304;
+
+constexpr uint32_t kMAC_CONFIG_RE = 1u << 0;
+constexpr uint32_t kMAC_CONFIG_TE = 1u << 1;
+constexpr uint32_t kMAC_CONFIG_DM = 1u << 13;   // Full duplex
+constexpr uint32_t kMAC_CONFIG_FES = 1u << 14;  // 100Mb/s when PS is set
+constexpr uint32_t kMAC_CONFIG_PS = 1u << 15;   // 10/100 port
+constexpr uint32_t kMAC_CONFIG_ACS = 1u << 20;  // Strip pad/FCS
+constexpr uint32_t kMAC_CONFIG_CST = 1u << 21;  // Strip FCS of typed frames
+constexpr uint32_t kMAC_CONFIG_IPC = 1u << 27;  // Receive checksum offload
+constexpr uint32_t kMAC_CONFIG_SPEED_MASK = kMAC_CONFIG_FES | kMAC_CONFIG_PS | kMAC_CONFIG_DM;
+
+constexpr uint32_t kMAC_PACKET_FILTER_PR = 1u << 0;   // Promiscuous
+constexpr uint32_t kMAC_PACKET_FILTER_HMC = 1u << 2;  // Hash multicast
+constexpr uint32_t kMAC_PACKET_FILTER_PM = 1u << 4;   // Pass all multicast
+
+constexpr uint32_t kMAC_RXQ_CTRL0_Q0_DCB = 2;
+
+constexpr uint32_t kMAC_HW_FEATURE0_TXCOESEL = 1u << 14;
+constexpr uint32_t kMAC_HW_FEATURE0_RXCOESEL = 1u << 16;
+
+constexpr uint32_t kMAC_MDIO_ADDR_GB = 1u << 0;
+constexpr uint32_t kMAC_MDIO_ADDR_GOC_WRITE = 1u << 2;
+constexpr uint32_t kMAC_MDIO_ADDR_GOC_READ = 3u << 2;
+// MDC = CSR clock / 102, for the 150-250MHz AHB clock.
+constexpr uint32_t kMAC_MDIO_ADDR_CR = 4u << 8;
+constexpr uint32_t kMAC_MDIO_ADDR_REG_SHIFT = 16;
+constexpr uint32_t kMAC_MDIO_ADDR_PHY_SHIFT = 21;
+
+constexpr uint32_t kMAC_ADDR_HIGH_AE = 1u << 31;
+
+// MTL registers, queue 0
+constexpr uint32_t kMTL_TXQ0_OP_MODE = 0x0D00;
+constexpr uint32_t kMTL_RXQ0_OP_MODE = 0x0D30;
+
+constexpr uint32_t kMTL_TXQ_OP_MODE_TSF = 1u << 1;  // Store and forward
+constexpr uint32_t kMTL_TXQ_OP_MODE_TXQEN = 2u << 2;
+constexpr uint32_t kMTL_TXQ_OP_MODE_TQS_SHIFT = 16;
+constexpr uint32_t kMTL_RXQ_OP_MODE_RSF = 1u << 5;
+constexpr uint32_t kMTL_RXQ_OP_MODE_RQS_SHIFT = 20;
+
+// DMA registers, channel 0
+constexpr uint32_t kDMA_MODE = 0x1000;
+constexpr uint32_t kDMA_SYSBUS_MODE = 0x1004;
+constexpr uint32_t kDMA_CH0_CONTROL = 0x1100;
+constexpr uint32_t kDMA_CH0_TX_CONTROL = 0x1104;
+constexpr uint32_t kDMA_CH0_RX_CONTROL = 0x1108;
+constexpr uint32_t kDMA_CH0_TXDESC_LIST_HADDR = 0x1110;
+constexpr uint32_t kDMA_CH0_TXDESC_LIST_ADDR = 0x1114;
+constexpr uint32_t kDMA_CH0_RXDESC_LIST_HADDR = 0x1118;
+constexpr uint32_t kDMA_CH0_RXDESC_LIST_ADDR = 0x111C;
+constexpr uint32_t kDMA_CH0_TXDESC_TAIL = 0x1120;
+constexpr uint32_t kDMA_CH0_RXDESC_TAIL = 0x1128;
+constexpr uint32_t kDMA_CH0_TXDESC_RING_LEN = 0x112C;
+constexpr uint32_t kDMA_CH0_RXDESC_RING_LEN = 0x1130;
+constexpr uint32_t kDMA_CH0_INT_EN = 0x1134;
+constexpr uint32_t kDMA_CH0_RX_WATCHDOG = 0x1138;
+constexpr uint32_t kDMA_CH0_STATUS = 0x1160;
+
+constexpr uint32_t kDMA_MODE_SWR = 1u << 0;
+constexpr uint32_t kDMA_SYSBUS_MODE_BURSTS = (1u << 12) | (1u << 3) | (1u << 2) | (1u << 1);
+constexpr uint32_t kDMA_CH_TX_CONTROL_ST = 1u << 0;
+constexpr uint32_t kDMA_CH_TX_CONTROL_OSP = 1u << 4;
+constexpr uint32_t kDMA_CH_RX_CONTROL_SR = 1u << 0;
+constexpr uint32_t kDMA_CH_RX_CONTROL_RBSZ_SHIFT = 1;
+constexpr uint32_t kDMA_CH_PBL_32 = 32u << 16;
+
+// Channel interrupt enable and status bits
+constexpr uint32_t kDMA_CH_TI = 1u << 0;
+constexpr uint32_t kDMA_CH_RI = 1u << 6;
+constexpr uint32_t kDMA_CH_RBU = 1u << 7;
+constexpr uint32_t kDMA_CH_FBE = 1u << 12;
+constexpr uint32_t kDMA_CH_AI = 1u << 14;
+constexpr uint32_t kDMA_CH_NI = 1u << 15;
+constexpr uint32_t kDMA_CH_IRQS =
+    kDMA_CH_TI | kDMA_CH_RI | kDMA_CH_RBU | kDMA_CH_FBE | kDMA_CH_AI | kDMA_CH_NI;
+
+// Normal descriptor, shared by both rings. The DMA rewrites it on
+// completion ("write-back" format).
+struct DmaDescriptor {
+  uint32_t des0;
+  uint32_t des1;
+  uint32_t des2;
+  uint32_t des3;
+};
+static_assert(sizeof(DmaDescriptor) == 16);
+
+constexpr uint32_t kDES2_TX_IOC = 1u << 31;
+constexpr uint32_t kDES3_TX_CIC_FULL = 3u << 16;  // IP header and payload checksums
+constexpr uint32_t kDES3_RX_BUF1V = 1u << 24;
+constexpr uint32_t kDES3_RX_IOC = 1u << 30;
+constexpr uint32_t kDES3_LD = 1u << 28;
+constexpr uint32_t kDES3_FD = 1u << 29;
+constexpr uint32_t kDES3_OWN = 1u << 31;
+constexpr uint32_t kDES3_ES = 1u << 15;
+constexpr uint32_t kDES3_RX_PL_MASK = 0x7FFF;
+constexpr uint32_t kDES1_RX_IPHE = 1u << 3;
+constexpr uint32_t kDES1_RX_IPCE = 1u << 7;
+
+// Clause 22 PHY registers
+constexpr uint32_t kMII_BMCR = 0;
+constexpr uint32_t kMII_BMSR = 1;
+constexpr uint32_t kMII_PHYID1 = 2;
+constexpr uint32_t kMII_ANAR = 4;
+constexpr uint32_t kMII_ANLPAR = 5;
+constexpr uint32_t kMII_CTRL1000 = 9;
+constexpr uint32_t kMII_STAT1000 = 10;
+
+constexpr uint16_t kBMCR_ANRESTART = 1u << 9;
+constexpr uint16_t kBMCR_ANENABLE = 1u << 12;
+constexpr uint16_t kBMSR_LSTATUS = 1u << 2;
+constexpr uint16_t kBMSR_ESTATEN = 1u << 8;
+constexpr uint16_t kADVERTISE_10HALF = 1u << 5;
+constexpr uint16_t kADVERTISE_10FULL = 1u << 6;
+constexpr uint16_t kADVERTISE_100HALF = 1u << 7;
+constexpr uint16_t kADVERTISE_100FULL = 1u << 8;
+constexpr uint16_t kADVERTISE_1000FULL = 1u << 9;
+constexpr uint16_t kLPA_1000FULL = 1u << 11;
+
+constexpr uint32_t kMtu = 1500;
+// One buffer per descriptor, two per page, big enough for a VLAN-tagged
+// frame.
+constexpr size_t kBufferSize = 2048;
+constexpr size_t kTxRingSize = 512;
+constexpr size_t kRxRingSize = 512;
+
+// Coalescing. A receive interrupt fires every kRxCoalesceFrames frames, or
+// kRxWatchdog x 256 CSR clocks (about 80us at 200MHz) after a frame when
+// fewer arrive. Transmitted frames are copied into ring buffers and
+// completed at once, so the transmit interrupt only reclaims slots and is
+// requested every kTxCoalesceFrames frames.
+constexpr size_t kRxCoalesceFrames = 16;
+constexpr uint32_t kRxWatchdog = 0x40;
+constexpr size_t kTxCoalesceFrames = 32;
+
+// Frames handled per pass before the IRQ thread goes back to polling with
+// the channel interrupts still masked.
+constexpr size_t kPollBudget = 64;
+
+static_assert(ZX_PAGE_SIZE % kBufferSize == 0);
+static_assert(kTxRingSize % kTxCoalesceFrames == 0);
+static_assert(kRxRingSize % kRxCoalesceFrames == 0);
+
+class SoliloquyDwmac;
+using DeviceType = ddk::Device<SoliloquyDwmac, ddk::Unbindable>;
+
+class SoliloquyDwmac
+    : public DeviceType,
+      public ddk::EthernetImplProtocol<SoliloquyDwmac, ddk::base_protocol> {
+ public:
+  explicit SoliloquyDwmac(zx_device_t* parent) : DeviceType(parent) {}
+  // For tests: uses |mmio| and |bti| instead of the platform device's.
+  SoliloquyDwmac(zx_device_t* parent, fdf::MmioBuffer mmio, zx::bti bti)
+      : DeviceType(parent), mmio_(std::move(mmio)), bti_(std::move(bti)) {}
+
+  static zx_status_t Create(void* ctx, zx_device_t* parent);
+
+  // For tests: sets up the rings and starts the MAC and DMA as
+  // InitHardware() does, without probing the PHY or starting the IRQ thread.
+  zx_status_t StartDmaForTest() {
+    zx_status_t status = InitBuffers();
+    return status == ZX_OK ? InitMac() : status;
+  }
+  // For tests: the transmit ring, as the DMA sees it.
+  DmaDescriptor* tx_ring_for_test() const { return tx_ring_; }
+
+  void DdkRelease() {
+    Shutdown();
+    delete this;
+  }
+  void DdkUnbind(ddk::UnbindTxn txn) {
+    Shutdown();
+    txn.Reply();
+  }
+
+  // Ethernet protocol implementation
+  zx_status_t EthernetImplQuery(uint32_t options, ethernet_info_t* out_info);
+  void EthernetImplStop();
+  zx_status_t EthernetImplStart(const ethernet_ifc_protocol_t* ifc);
+  void EthernetImplQueueTx(uint32_t options, ethernet_netbuf_t* netbuf,
+                           ethernet_impl_queue_tx_callback completion_cb, void* cookie);
+  zx_status_t EthernetImplSetParam(uint32_t param, int32_t value, const uint8_t* data_buffer,
+                                   size_t data_size);
+  void EthernetImplGetBti(zx::bti* out_bti);
+
+ private:
+  zx_status_t Init();
+  zx_status_t InitHardware();
+  zx_status_t InitBuffers();
+  zx_status_t InitMac();
+  void Shutdown();
+  void ReadMacAddress();
+
+  zx_status_t MdioRead(uint32_t reg, uint16_t* out_value);
+  zx_status_t MdioWrite(uint32_t reg, uint16_t value);
+  zx_status_t FindPhy();
+  void UpdateLink();
+
+  zx_status_t StartIrqThread();
+  void StopIrqThread();
+  int IrqThread();
+  // Receives up to |budget| frames and hands the descriptors back to the
+  // DMA. Returns the number of descriptors processed.
+  size_t PollRx(size_t budget);
+  void ReclaimTxLocked() __TA_REQUIRES(tx_lock_);
+
+  zx_paddr_t BufferPaddr(size_t index) const;
+  uint8_t* Buffer(size_t index) const { return buffers_ + index * kBufferSize; }
+  zx_paddr_t DescPaddr(const DmaDescriptor* ring, size_t index) const {
+    return descs_paddr_ + (ring - descs_ + index) * sizeof(DmaDescriptor);
+  }
+
+  std::optional<fdf::MmioBuffer> mmio_;
+  zx::bti bti_;
+  zx::interrupt irq_;
+  zx::port port_;
+  zx::timer link_timer_;
+  thrd_t irq_thread_;
+  bool irq_thread_started_ = false;
+  std::atomic<bool> stopping_ = false;
+
+  uint8_t mac_[ETH_MAC_SIZE] = {};
+  uint32_t phy_addr_ = 0;
+  std::atomic<bool> link_up_ = false;  // Written by the IRQ thread
+  bool tx_checksum_ = false;
+  bool rx_checksum_ = false;
+
+  // Both rings, TX first, in one physically contiguous uncached VMO.
+  zx::vmo desc_vmo_;
+  zx::pmt desc_pmt_;
+  DmaDescriptor* descs_ = nullptr;
+  zx_paddr_t descs_paddr_ = 0;
+  DmaDescriptor* tx_ring_ = nullptr;
+  DmaDescriptor* rx_ring_ = nullptr;
+
+  // Frame buffers, TX slots then RX slots, pinned for the driver's life.
+  zx::vmo buffer_vmo_;
+  zx::pmt buffer_pmt_;
+  uint8_t* buffers_ = nullptr;
+  std::vector<zx_paddr_t> buffer_pages_;
+
+  fbl::Mutex tx_lock_;
+  size_t tx_head_ __TA_GUARDED(tx_lock_) = 0;  // Next slot to fill
+  size_t tx_tail_ __TA_GUARDED(tx_lock_) = 0;  // Oldest slot the DMA may own
+  // Frames queued since the tail pointer was last written.
+  size_t tx_unkicked_ __TA_GUARDED(tx_lock_) = 0;
+
+  size_t rx_head_ = 0;  // IRQ thread only
+
+  fbl::Mutex ifc_lock_;
+  ddk::EthernetIfcProtocolClient ifc_ __TA_GUARDED(ifc_lock_);
+  bool started_ __TA_GUARDED(ifc_lock_) = false;
+
+  inspect::Inspector inspector_;
+
+  static constexpr zx::duration kLinkPollInterval = zx::sec(1);
+  static constexpr zx::duration kMdioTimeout = zx::msec(10);
+  static constexpr uint64_t kPortKeyIrq = 0;
+  static constexpr uint64_t kPortKeyStop = 1;
+  static constexpr uint64_t kPortKeyLinkTimer = 2;
+};
+
+}  // namespace soliloquy_dwmac
+
+#endif  // BOARDS_ARM64_SOLILOQUY_SRC_SOLILOQUY_DWMAC_H_
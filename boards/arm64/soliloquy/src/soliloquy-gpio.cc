@@ -13,6 +13,18 @@ static const pbus_mmio_t gpio_mmios[] = {
     },
 };
 
+// One shared interrupt per PIO bank (GIC SPI 85, 87, ... 99), in bank order.
+static const pbus_irq_t gpio_irqs[] = {
+    {.irq = 117, .mode = ZX_INTERRUPT_MODE_LEVEL_HIGH},
+    {.irq = 119, .mode = ZX_INTERRUPT_MODE_LEVEL_HIGH},
+    {.irq = 121, .mode = ZX_INTERRUPT_MODE_LEVEL_HIGH},
+    {.irq = 123, .mode = ZX_INTERRUPT_MODE_LEVEL_HIGH},
+    {.irq = 125, .mode = ZX_INTERRUPT_MODE_LEVEL_HIGH},
+    {.irq = 127, .mode = ZX_INTERRUPT_MODE_LEVEL_HIGH},
+    {.irq = 129, .mode = ZX_INTERRUPT_MODE_LEVEL_HIGH},
+    {.irq = 131, .mode = ZX_INTERRUPT_MODE_LEVEL_HIGH},
+};
+
 static const pbus_dev_t gpio_dev = []() {
   pbus_dev_t dev = {};
   dev.name = "gpio";
@@ -21,6 +33,8 @@ static const pbus_dev_t gpio_dev = []() {
   dev.did = PDEV_DID_ALLWINNER_GPIO;
   dev.mmio_list = gpio_mmios;
   dev.mmio_count = countof(gpio_mmios);
+  dev.irq_list = gpio_irqs;
+  dev.irq_count = countof(gpio_irqs);
   return dev;
 }();
 
@@ -9,60 +9,136 @@
 #include <lib/ddk/device.h>
 #include <lib/ddk/driver.h>
 #include <lib/ddk/platform-defs.h>
+#include <lib/device-protocol/i2c-channel.h>
 #include <lib/device-protocol/pdev.h>
+#include <lib/inspect/cpp/inspect.h>
+#include <lib/zx/clock.h>
+#include <lib/zx/interrupt.h>
+#include <lib/zx/port.h>
+#include <lib/zx/time.h>
+#include <threads.h>
+#include <zircon/compiler.h>
+#include <zircon/status.h>
+
+#include <algorithm>
+#include <cstring>
 
 #include <ddktl/device.h>
 #include <fbl/alloc_checker.h>
+#include <fbl/auto_lock.h>
+#include <fbl/mutex.h>
 
+#include <fuchsia/hardware/gpio/cpp/banjo.h>
 #include <fuchsia/hardware/hidbus/cpp/banjo.h>
 #include <hid/descriptor.h>
 
+#include "../../../../drivers/common/soliloquy_hal/metrics.h"
+
 namespace soliloquy_hid {
 
-// Touchscreen HID report descriptor
+constexpr uint8_t kTouchReportId = 1;
+// Contacts the Goodix GT911 tracks at once.
+constexpr size_t kMaxContacts = 5;
+// Logical coordinate range; the controller's resolution is scaled to it.
+constexpr uint16_t kLogicalMax = 4095;
+
+#define FINGER_COLLECTION                                          \
+  HID_USAGE(0x22), /* Finger */                                    \
+      HID_COLLECTION_LOGICAL,                                      \
+                                                                   \
+      /* Tip switch */                                             \
+      HID_USAGE(0x42), HID_LOGICAL_MIN(0), HID_LOGICAL_MAX(1),     \
+      HID_REPORT_SIZE(1), HID_REPORT_COUNT(1),                     \
+      HID_INPUT(HID_IOF_DATA | HID_IOF_VARIABLE | HID_IOF_ABSOLUTE), \
+                                                                   \
+      /* Padding */                                                \
+      HID_REPORT_SIZE(7), HID_REPORT_COUNT(1),                     \
+      HID_INPUT(HID_IOF_CONSTANT),                                 \
+                                                                   \
+      /* Contact identifier */                                     \
+      HID_USAGE(0x51), HID_LOGICAL_MAX_N(255, 2),                  \
+      HID_REPORT_SIZE(8), HID_REPORT_COUNT(1),                     \
+      HID_INPUT(HID_IOF_DATA | HID_IOF_VARIABLE | HID_IOF_ABSOLUTE), \
+                                                                   \
+      /* X coordinate */                                           \
+      HID_USAGE_PAGE(0x01), /* Generic Desktop */                  \
+      HID_USAGE(0x30),      /* X */                                \
+      HID_LOGICAL_MAX_N(kLogicalMax, 2),                           \
+      HID_REPORT_SIZE(16), HID_REPORT_COUNT(1),                    \
+      HID_INPUT(HID_IOF_DATA | HID_IOF_VARIABLE | HID_IOF_ABSOLUTE), \
+                                                                   \
+      /* Y coordinate */                                           \
+      HID_USAGE(0x31), /* Y */                                     \
+      HID_LOGICAL_MAX_N(kLogicalMax, 2),                           \
+      HID_REPORT_SIZE(16), HID_REPORT_COUNT(1),                    \
+      HID_INPUT(HID_IOF_DATA | HID_IOF_VARIABLE | HID_IOF_ABSOLUTE), \
+                                                                   \
+      HID_USAGE_PAGE(0x0D), /* Back to Digitizer */                \
+      HID_END_COLLECTION
+
+// Multi-touch touchscreen HID report descriptor
 constexpr uint8_t kTouchReportDesc[] = {
     HID_USAGE_PAGE(0x0D),  // Digitizer
     HID_USAGE(0x04),       // Touch Screen
     HID_COLLECTION_APPLICATION,
-    
-    // Finger
-    HID_USAGE(0x22),  // Finger
-    HID_COLLECTION_LOGICAL,
-    
-    // Tip switch
-    HID_USAGE(0x42),
-    HID_LOGICAL_MIN(0),
-    HID_LOGICAL_MAX(1),
-    HID_REPORT_SIZE(1),
-    HID_REPORT_COUNT(1),
-    HID_INPUT(HID_IOF_DATA | HID_IOF_VARIABLE | HID_IOF_ABSOLUTE),
-    
-    // Padding
-    HID_REPORT_SIZE(7),
-    HID_REPORT_COUNT(1),
-    HID_INPUT(HID_IOF_CONSTANT),
-    
-    // X coordinate
-    HID_USAGE_PAGE(0x01),  // Generic Desktop
-    HID_USAGE(0x30),       // X
-    HID_LOGICAL_MIN(0),
-    HID_LOGICAL_MAX_N(4095, 2),
-    HID_REPORT_SIZE(16),
+    HID_REPORT_ID(kTouchReportId),
+
+    FINGER_COLLECTION,
+    FINGER_COLLECTION,
+    FINGER_COLLECTION,
+    FINGER_COLLECTION,
+    FINGER_COLLECTION,
+
+    // Contact count
+    HID_USAGE(0x54),
+    HID_LOGICAL_MAX(kMaxContacts),
+    HID_REPORT_SIZE(8),
     HID_REPORT_COUNT(1),
     HID_INPUT(HID_IOF_DATA | HID_IOF_VARIABLE | HID_IOF_ABSOLUTE),
-    
-    // Y coordinate
-    HID_USAGE(0x31),  // Y
-    HID_LOGICAL_MIN(0),
-    HID_LOGICAL_MAX_N(4095, 2),
+
+    // Scan time, in 100us units
+    HID_USAGE(0x56),
+    HID_LOGICAL_MAX_N(0xFFFF, 2),
     HID_REPORT_SIZE(16),
     HID_REPORT_COUNT(1),
     HID_INPUT(HID_IOF_DATA | HID_IOF_VARIABLE | HID_IOF_ABSOLUTE),
-    
-    HID_END_COLLECTION,
+
     HID_END_COLLECTION,
 };
 
+#undef FINGER_COLLECTION
+
+struct __PACKED TouchContact {
+  uint8_t tip_switch;
+  uint8_t contact_id;
+  uint16_t x;
+  uint16_t y;
+};
+
+struct __PACKED TouchReport {
+  uint8_t report_id;
+  TouchContact contacts[kMaxContacts];
+  uint8_t contact_count;
+  uint16_t scan_time;
+};
+
+// Goodix GT911 registers; 16-bit big-endian addresses.
+constexpr uint16_t kGT911_CONFIG_X_MAX = 0x8048;  // LE16; Y max follows
+constexpr uint16_t kGT911_CONFIG_MODULE_SWITCH1 = 0x804D;
+constexpr uint8_t kGT911_MODULE_SWITCH1_INT_MASK = 0x03;
+constexpr uint16_t kGT911_PRODUCT_ID = 0x8140;
+constexpr uint16_t kGT911_STATUS = 0x814E;
+constexpr uint8_t kGT911_STATUS_READY = 1u << 7;
+constexpr uint8_t kGT911_STATUS_COUNT_MASK = 0x0F;
+constexpr size_t kGT911_POINT_SIZE = 8;
+
+namespace {
+soliloquy_hal::Counter touch_reports("soliloquy-hid.touch_reports");
+soliloquy_hal::Counter touch_coalesced("soliloquy-hid.touch_coalesced");
+// IRQ timestamp to report queued, in microseconds.
+soliloquy_hal::Histogram touch_latency_us("soliloquy-hid.touch_latency_us");
+}  // namespace
+
 class SoliloquyHid;
 using DeviceType = ddk::Device<SoliloquyHid, ddk::Unbindable>;
 
@@ -74,8 +150,14 @@ class SoliloquyHid : public DeviceType,
   static zx_status_t Create(void* ctx, zx_device_t* parent);
 
   // Device protocol implementation
-  void DdkRelease() { delete this; }
-  void DdkUnbind(ddk::UnbindTxn txn) { txn.Reply(); }
+  void DdkRelease() {
+    StopTouchThread();
+    delete this;
+  }
+  void DdkUnbind(ddk::UnbindTxn txn) {
+    StopTouchThread();
+    txn.Reply();
+  }
 
   // Hidbus protocol implementation
   zx_status_t HidbusQuery(uint32_t options, hid_info_t* out_info) {
@@ -86,11 +168,16 @@ class SoliloquyHid : public DeviceType,
   }
 
   zx_status_t HidbusStart(const hidbus_ifc_protocol_t* ifc) {
+    fbl::AutoLock lock(&lock_);
+    if (ifc_.is_valid()) {
+      return ZX_ERR_ALREADY_BOUND;
+    }
     ifc_ = ddk::HidbusIfcProtocolClient(ifc);
     return ZX_OK;
   }
 
   void HidbusStop() {
+    fbl::AutoLock lock(&lock_);
     ifc_.clear();
   }
 
@@ -110,7 +197,16 @@ class SoliloquyHid : public DeviceType,
   zx_status_t HidbusGetReport(hid_report_type_t rpt_type, uint8_t rpt_id,
                                uint8_t* out_data_buffer, size_t data_size,
                                size_t* out_data_actual) {
-    return ZX_ERR_NOT_SUPPORTED;
+    if (rpt_type != HID_REPORT_TYPE_INPUT || rpt_id != kTouchReportId) {
+      return ZX_ERR_NOT_SUPPORTED;
+    }
+    if (data_size < sizeof(TouchReport)) {
+      return ZX_ERR_BUFFER_TOO_SMALL;
+    }
+    fbl::AutoLock lock(&lock_);
+    memcpy(out_data_buffer, &last_report_, sizeof(last_report_));
+    *out_data_actual = sizeof(last_report_);
+    return ZX_OK;
   }
 
   zx_status_t HidbusSetReport(hid_report_type_t rpt_type, uint8_t rpt_id,
@@ -119,10 +215,17 @@ class SoliloquyHid : public DeviceType,
   }
 
   zx_status_t HidbusGetIdle(uint8_t rpt_id, uint8_t* out_duration) {
-    return ZX_ERR_NOT_SUPPORTED;
+    fbl::AutoLock lock(&lock_);
+    *out_duration = idle_duration_;
+    return ZX_OK;
   }
 
+  // |duration| is in 4ms units. 0, the default, sends a report only when
+  // the contacts change; otherwise an unchanged report is repeated at most
+  // that often while a finger is down.
   zx_status_t HidbusSetIdle(uint8_t rpt_id, uint8_t duration) {
+    fbl::AutoLock lock(&lock_);
+    idle_duration_ = duration;
     return ZX_OK;
   }
 
@@ -137,8 +240,37 @@ class SoliloquyHid : public DeviceType,
 
  private:
   zx_status_t Init();
+  zx_status_t InitTouch();
+
+  zx_status_t StartTouchThread();
+  void StopTouchThread();
+  int TouchThread();
+  // Reads every contact the controller latched for the scan that raised
+  // the interrupt at |timestamp| and queues one report for all of them.
+  void HandleTouchIrq(zx::time timestamp);
+
+  zx_status_t ReadReg(uint16_t reg, uint8_t* buf, size_t len);
+  zx_status_t WriteReg(uint16_t reg, uint8_t value);
 
-  ddk::HidbusIfcProtocolClient ifc_;
+  ddk::I2cChannel i2c_;
+  ddk::GpioProtocolClient gpio_int_;
+  zx::interrupt irq_;
+  zx::port port_;
+  thrd_t touch_thread_;
+  bool touch_thread_started_ = false;
+  uint16_t x_max_ = kLogicalMax;
+  uint16_t y_max_ = kLogicalMax;
+
+  fbl::Mutex lock_;
+  ddk::HidbusIfcProtocolClient ifc_ __TA_GUARDED(lock_);
+  TouchReport last_report_ __TA_GUARDED(lock_) = {.report_id = kTouchReportId};
+  zx::time last_sent_ __TA_GUARDED(lock_);
+  uint8_t idle_duration_ __TA_GUARDED(lock_) = 0;
+
+  inspect::Inspector inspector_;
+
+  static constexpr uint64_t kPortKeyIrq = 0;
+  static constexpr uint64_t kPortKeyStop = 1;
 };
 
 zx_status_t SoliloquyHid::Create(void* ctx, zx_device_t* parent) {
@@ -158,9 +290,18 @@ zx_status_t SoliloquyHid::Create(void* ctx, zx_device_t* parent) {
 }
 
 zx_status_t SoliloquyHid::Init() {
-  auto status = DdkAdd("soliloquy-hid");
+  auto status = InitTouch();
+  if (status != ZX_OK) {
+    zxlogf(WARNING, "No touch controller, serving descriptor only: %s",
+           zx_status_get_string(status));
+  }
+
+  soliloquy_hal::PublishMetrics(inspector_);
+  status =
+      DdkAdd(ddk::DeviceAddArgs("soliloquy-hid").set_inspect_vmo(inspector_.DuplicateVmo()));
   if (status != ZX_OK) {
     zxlogf(ERROR, "Failed to add HID device: %s", zx_status_get_string(status));
+    StopTouchThread();
     return status;
   }
 
@@ -168,6 +309,175 @@ zx_status_t SoliloquyHid::Init() {
   return ZX_OK;
 }
 
+zx_status_t SoliloquyHid::InitTouch() {
+  i2c_ = ddk::I2cChannel(parent(), "i2c");
+  gpio_int_ = ddk::GpioProtocolClient(parent(), "gpio-int");
+  if (!i2c_.is_valid() || !gpio_int_.is_valid()) {
+    return ZX_ERR_NOT_SUPPORTED;
+  }
+
+  uint8_t product[4];
+  auto status = ReadReg(kGT911_PRODUCT_ID, product, sizeof(product));
+  if (status != ZX_OK) {
+    zxlogf(ERROR, "Failed to read touch controller ID: %s", zx_status_get_string(status));
+    return status;
+  }
+
+  uint8_t config[4];
+  status = ReadReg(kGT911_CONFIG_X_MAX, config, sizeof(config));
+  if (status != ZX_OK) {
+    return status;
+  }
+  x_max_ = static_cast<uint16_t>(config[0] | (config[1] << 8));
+  y_max_ = static_cast<uint16_t>(config[2] | (config[3] << 8));
+  if (x_max_ == 0 || y_max_ == 0) {
+    x_max_ = y_max_ = kLogicalMax;
+  }
+
+  // Follow the polarity the controller's config asks for (0 rising,
+  // 1 falling, 2 low level, 3 high level). Level modes would retrigger
+  // until the status register is cleared, so take the matching edge.
+  uint8_t switch1;
+  status = ReadReg(kGT911_CONFIG_MODULE_SWITCH1, &switch1, 1);
+  if (status != ZX_OK) {
+    return status;
+  }
+  uint8_t trigger = switch1 & kGT911_MODULE_SWITCH1_INT_MASK;
+  uint32_t mode = (trigger == 0 || trigger == 3) ? ZX_INTERRUPT_MODE_EDGE_HIGH
+                                                 : ZX_INTERRUPT_MODE_EDGE_LOW;
+  status = gpio_int_.GetInterrupt(mode, &irq_);
+  if (status != ZX_OK) {
+    zxlogf(ERROR, "Failed to get touch interrupt: %s", zx_status_get_string(status));
+    return status;
+  }
+
+  // Drop anything latched before we were listening.
+  WriteReg(kGT911_STATUS, 0);
+
+  status = StartTouchThread();
+  if (status != ZX_OK) {
+    irq_.reset();
+    gpio_int_.ReleaseInterrupt();
+    return status;
+  }
+
+  zxlogf(INFO, "GT%.4s touch controller, %ux%u", reinterpret_cast<const char*>(product),
+         x_max_, y_max_);
+  return ZX_OK;
+}
+
+zx_status_t SoliloquyHid::StartTouchThread() {
+  auto status = zx::port::create(ZX_PORT_BIND_TO_INTERRUPT, &port_);
+  if (status != ZX_OK) {
+    return status;
+  }
+  status = irq_.bind(port_, kPortKeyIrq, 0);
+  if (status != ZX_OK) {
+    return status;
+  }
+
+  int rc = thrd_create_with_name(
+      &touch_thread_,
+      [](void* arg) { return static_cast<SoliloquyHid*>(arg)->TouchThread(); }, this,
+      "soliloquy-hid-touch");
+  if (rc != thrd_success) {
+    return ZX_ERR_INTERNAL;
+  }
+  touch_thread_started_ = true;
+  return ZX_OK;
+}
+
+void SoliloquyHid::StopTouchThread() {
+  if (!touch_thread_started_) {
+    return;
+  }
+  zx_port_packet_t packet = {};
+  packet.key = kPortKeyStop;
+  packet.type = ZX_PKT_TYPE_USER;
+  port_.queue(&packet);
+  thrd_join(touch_thread_, nullptr);
+  touch_thread_started_ = false;
+  gpio_int_.ReleaseInterrupt();
+}
+
+int SoliloquyHid::TouchThread() {
+  // Nothing runs while no finger is down: the controller only interrupts
+  // after a scan that saw a contact, plus once on lift-off.
+  while (true) {
+    zx_port_packet_t packet;
+    auto status = port_.wait(zx::time::infinite(), &packet);
+    if (status != ZX_OK) {
+      zxlogf(ERROR, "Touch port wait failed: %s", zx_status_get_string(status));
+      return status;
+    }
+    if (packet.key == kPortKeyStop) {
+      return 0;
+    }
+
+    HandleTouchIrq(zx::time(packet.interrupt.timestamp));
+    irq_.ack();
+  }
+}
+
+void SoliloquyHid::HandleTouchIrq(zx::time timestamp) {
+  // The points follow the status register, so one transfer reads the
+  // whole scan.
+  uint8_t buf[1 + kMaxContacts * kGT911_POINT_SIZE];
+  if (ReadReg(kGT911_STATUS, buf, sizeof(buf)) != ZX_OK) {
+    return;
+  }
+  uint8_t status = buf[0];
+  if (!(status & kGT911_STATUS_READY)) {
+    return;  // A spurious edge; nothing latched.
+  }
+  WriteReg(kGT911_STATUS, 0);
+
+  TouchReport report = {};
+  report.report_id = kTouchReportId;
+  size_t count = std::min<size_t>(status & kGT911_STATUS_COUNT_MASK, kMaxContacts);
+  for (size_t i = 0; i < count; i++) {
+    const uint8_t* point = buf + 1 + i * kGT911_POINT_SIZE;
+    uint32_t x = point[1] | (point[2] << 8);
+    uint32_t y = point[3] | (point[4] << 8);
+    TouchContact& contact = report.contacts[i];
+    contact.tip_switch = 1;
+    contact.contact_id = point[0];
+    contact.x = static_cast<uint16_t>(std::min<uint32_t>(x * kLogicalMax / x_max_, kLogicalMax));
+    contact.y = static_cast<uint16_t>(std::min<uint32_t>(y * kLogicalMax / y_max_, kLogicalMax));
+  }
+  report.contact_count = static_cast<uint8_t>(count);
+  report.scan_time = static_cast<uint16_t>(timestamp.get() / ZX_USEC(100));
+
+  fbl::AutoLock lock(&lock_);
+  // The controller interrupts every scan while a finger rests; only
+  // changes go up unless the host asked for a repeat rate.
+  bool same = memcmp(report.contacts, last_report_.contacts, sizeof(report.contacts)) == 0 &&
+              report.contact_count == last_report_.contact_count;
+  zx::duration idle = zx::msec(4) * idle_duration_;
+  if (same && (idle_duration_ == 0 || timestamp - last_sent_ < idle)) {
+    touch_coalesced.Add();
+    return;
+  }
+
+  last_report_ = report;
+  last_sent_ = timestamp;
+  if (ifc_.is_valid()) {
+    ifc_.IoQueue(reinterpret_cast<const uint8_t*>(&report), sizeof(report), timestamp.get());
+    touch_reports.Add();
+    touch_latency_us.Record((zx::clock::get_monotonic() - timestamp).to_usecs());
+  }
+}
+
+zx_status_t SoliloquyHid::ReadReg(uint16_t reg, uint8_t* buf, size_t len) {
+  const uint8_t addr[] = {static_cast<uint8_t>(reg >> 8), static_cast<uint8_t>(reg)};
+  return i2c_.WriteReadSync(addr, sizeof(addr), buf, len);
+}
+
+zx_status_t SoliloquyHid::WriteReg(uint16_t reg, uint8_t value) {
+  const uint8_t buf[] = {static_cast<uint8_t>(reg >> 8), static_cast<uint8_t>(reg), value};
+  return i2c_.WriteSync(buf, sizeof(buf));
+}
+
 static constexpr zx_driver_ops_t driver_ops = []() {
   zx_driver_ops_t ops = {};
   ops.version = DRIVER_OPS_VERSION;
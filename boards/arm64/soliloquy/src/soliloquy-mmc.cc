@@ -8,12 +8,40 @@
 #include <lib/ddk/debug.h>
 #include <lib/ddk/device.h>
 #include <lib/ddk/driver.h>
+#include <lib/ddk/metadata.h>
 #include <lib/ddk/platform-defs.h>
 #include <lib/device-protocol/pdev.h>
+#include <lib/inspect/cpp/inspect.h>
 #include <lib/mmio/mmio.h>
+#include <lib/zx/bti.h>
+#include <lib/zx/interrupt.h>
+#include <lib/zx/pmt.h>
+#include <lib/zx/port.h>
+#include <lib/zx/vmar.h>
+#include <lib/zx/vmo.h>
+#include <threads.h>
+#include <zircon/status.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <memory>
+#include <utility>
+#include <vector>
 
 #include <ddktl/device.h>
 #include <fbl/alloc_checker.h>
+#include <fbl/auto_lock.h>
+#include <fbl/condition_variable.h>
+#include <fbl/mutex.h>
+
+#include <fuchsia/hardware/sdmmc/cpp/banjo.h>
+
+#include "../../../../drivers/common/soliloquy_hal/metrics.h"
+#include "../../../../drivers/common/soliloquy_hal/mmio.h"
 
 namespace soliloquy_mmc {
 
@@ -34,27 +62,345 @@ constexpr uint32_t kMMC_IMASK = 0x30;       // Interrupt Mask Register
 constexpr uint32_t kMMC_MINT = 0x34;        // Masked Interrupt Status
 constexpr uint32_t kMMC_RINT = 0x38;        // Raw Interrupt Status
 constexpr uint32_t kMMC_STATUS = 0x3C;      // Status Register
+constexpr uint32_t kMMC_FTRGL = 0x40;       // FIFO Water Level Register
+constexpr uint32_t kMMC_NTSR = 0x5C;        // New Timing Set Register
+constexpr uint32_t kMMC_HWRST = 0x78;       // Hardware Reset Register
+constexpr uint32_t kMMC_DMAC = 0x80;        // IDMAC Control Register
+constexpr uint32_t kMMC_DLBA = 0x84;        // Descriptor List Base Address
+constexpr uint32_t kMMC_IDST = 0x88;        // IDMAC Status Register
+constexpr uint32_t kMMC_IDIE = 0x8C;        // IDMAC Interrupt Enable
+constexpr uint32_t kMMC_EDSD = 0x10C;       // Enhance Data Strobe Control
+constexpr uint32_t kMMC_SAMP_DL = 0x144;    // Sample Delay Control
+constexpr uint32_t kMMC_DS_DL = 0x148;      // Data Strobe Delay Control
+
+// GCTRL soft/FIFO/DMA reset bits; all self-clear when the reset completes
+constexpr uint32_t kMMC_GCTRL_RESET = 0x7;
+constexpr uint32_t kMMC_GCTRL_FIFO_RESET = 1u << 1;
+constexpr uint32_t kMMC_GCTRL_DMA_RESET = 1u << 2;
+constexpr uint32_t kMMC_GCTRL_INT_ENABLE = 1u << 4;
+constexpr uint32_t kMMC_GCTRL_DMA_ENABLE = 1u << 5;
+constexpr uint32_t kMMC_GCTRL_DDR_MODE = 1u << 10;
+constexpr uint32_t kMMC_GCTRL_ACCESS_BY_AHB = 1u << 31;
+
+constexpr uint32_t kMMC_CLKCR_DIV_MASK = 0xFF;
+constexpr uint32_t kMMC_CLKCR_CARD_CLK_ON = 1u << 16;
+constexpr uint32_t kMMC_CLKCR_MASK_DATA0 = 1u << 31;
+
+// Data timeout in bits 31:8 and response timeout in bits 7:0, both in card
+// clock cycles.
+constexpr uint32_t kMMC_TIMEOUT_DEFAULT = 0xFFFFFF40;
+
+// Sample on the delay chain rather than the fixed clock phases; needed for
+// tuned modes.
+constexpr uint32_t kMMC_NTSR_MODE_SELECT = 1u << 31;
+constexpr uint32_t kMMC_EDSD_HS400_ENABLE = 1u << 31;
+constexpr uint32_t kMMC_DL_SW_ENABLE = 1u << 7;
+constexpr uint32_t kMMC_DL_MASK = 0x3F;
+
+constexpr uint32_t kMMC_WIDTH_1BIT = 0;
+constexpr uint32_t kMMC_WIDTH_4BIT = 1;
+constexpr uint32_t kMMC_WIDTH_8BIT = 2;
+
+constexpr uint32_t kMMC_CMD_RESP_EXPIRE = 1u << 6;
+constexpr uint32_t kMMC_CMD_LONG_RESP = 1u << 7;
+constexpr uint32_t kMMC_CMD_CHECK_RESP_CRC = 1u << 8;
+constexpr uint32_t kMMC_CMD_DATA_EXPIRE = 1u << 9;
+constexpr uint32_t kMMC_CMD_WRITE = 1u << 10;
+constexpr uint32_t kMMC_CMD_AUTO_STOP = 1u << 12;
+constexpr uint32_t kMMC_CMD_WAIT_PRE_OVER = 1u << 13;
+constexpr uint32_t kMMC_CMD_STOP_ABORT = 1u << 14;
+constexpr uint32_t kMMC_CMD_SEND_INIT_SEQ = 1u << 15;
+constexpr uint32_t kMMC_CMD_UPCLK_ONLY = 1u << 21;
+constexpr uint32_t kMMC_CMD_START = 1u << 31;
+
+// RINT/MINT/IMASK bits
+constexpr uint32_t kMMC_INT_RESP_ERROR = 1u << 1;
+constexpr uint32_t kMMC_INT_CMD_DONE = 1u << 2;
+constexpr uint32_t kMMC_INT_DATA_OVER = 1u << 3;
+constexpr uint32_t kMMC_INT_RESP_CRC_ERROR = 1u << 6;
+constexpr uint32_t kMMC_INT_DATA_CRC_ERROR = 1u << 7;
+constexpr uint32_t kMMC_INT_RESP_TIMEOUT = 1u << 8;
+constexpr uint32_t kMMC_INT_DATA_TIMEOUT = 1u << 9;
+constexpr uint32_t kMMC_INT_FIFO_RUN_ERROR = 1u << 11;
+constexpr uint32_t kMMC_INT_HW_LOCKED = 1u << 12;
+constexpr uint32_t kMMC_INT_START_BIT_ERROR = 1u << 13;
+constexpr uint32_t kMMC_INT_AUTO_CMD_DONE = 1u << 14;
+constexpr uint32_t kMMC_INT_END_BIT_ERROR = 1u << 15;
+constexpr uint32_t kMMC_INT_SDIO = 1u << 16;
+constexpr uint32_t kMMC_INT_ERRORS =
+    kMMC_INT_RESP_ERROR | kMMC_INT_RESP_CRC_ERROR | kMMC_INT_DATA_CRC_ERROR |
+    kMMC_INT_RESP_TIMEOUT | kMMC_INT_DATA_TIMEOUT | kMMC_INT_FIFO_RUN_ERROR |
+    kMMC_INT_HW_LOCKED | kMMC_INT_START_BIT_ERROR | kMMC_INT_END_BIT_ERROR;
+constexpr uint32_t kMMC_INT_DONE = kMMC_INT_CMD_DONE | kMMC_INT_DATA_OVER |
+                                   kMMC_INT_AUTO_CMD_DONE;
+
+constexpr uint32_t kMMC_STATUS_CARD_BUSY = 1u << 9;
+
+// Block transfer commands the request queue can merge.
+constexpr uint32_t kCmdReadSingleBlock = 17;
+constexpr uint32_t kCmdReadMultipleBlock = 18;
+constexpr uint32_t kCmdWriteBlock = 24;
+constexpr uint32_t kCmdWriteMultipleBlock = 25;
+// Commands whose R3 response carries the card's addressing mode.
+constexpr uint32_t kCmdGoIdleState = 0;
+constexpr uint32_t kCmdAllSendCid = 2;
+constexpr uint32_t kCmdMmcSendOpCond = 1;
+constexpr uint32_t kCmdSdSendOpCond = 41;
+constexpr uint32_t kOcrBusy = 1u << 31;  // Set once power-up is done
+constexpr uint32_t kOcrSectorMode = 1u << 30;
+
+// Burst of 8 words, RX threshold 7, TX threshold 8
+constexpr uint32_t kMMC_FTRGL_DEFAULT = 0x20070008;
+
+constexpr uint32_t kMMC_DMAC_SOFT_RESET = 1u << 0;
+constexpr uint32_t kMMC_DMAC_FIX_BURST = 1u << 1;
+constexpr uint32_t kMMC_DMAC_IDMAC_ON = 1u << 7;
+
+// Internal DMA descriptor. Buffer and next-descriptor addresses are stored
+// in 4-byte units, which lets the 32-bit fields reach 16GB.
+struct IdmaDescriptor {
+  uint32_t config;
+  uint32_t buf_size;  // 0 means kIdmaMaxSegment bytes
+  uint32_t buf_addr;
+  uint32_t next_desc;
+};
+static_assert(sizeof(IdmaDescriptor) == 16);
+
+constexpr uint32_t kIDMA_DIC = 1u << 1;  // No interrupt on completion
+constexpr uint32_t kIDMA_LAST = 1u << 2;
+constexpr uint32_t kIDMA_FIRST = 1u << 3;
+constexpr uint32_t kIDMA_CHAIN = 1u << 4;
+constexpr uint32_t kIDMA_OWN = 1u << 31;
+constexpr uint32_t kIdmaAddrShift = 2;
+constexpr uint64_t kIdmaMaxSegment = 1u << 16;
+
+// Tuning blocks returned by CMD19/CMD21 (SD 3.0 and JEDEC eMMC 5.1).
+constexpr uint8_t kTuningBlock4Bit[64] = {
+    0xff, 0x0f, 0xff, 0x00, 0xff, 0xcc, 0xc3, 0xcc, 0xc3, 0x3c, 0xcc, 0xff, 0xfe, 0xff, 0xfe, 0xef,
+    0xff, 0xdf, 0xff, 0xdd, 0xff, 0xfb, 0xff, 0xfb, 0xbf, 0xff, 0x7f, 0xff, 0x77, 0xf7, 0xbd, 0xef,
+    0xff, 0xf0, 0xff, 0xf0, 0x0f, 0xfc, 0xcc, 0x3c, 0xcc, 0x33, 0xcc, 0xcf, 0xff, 0xef, 0xff, 0xee,
+    0xff, 0xfd, 0xff, 0xfd, 0xdf, 0xff, 0xbf, 0xff, 0xbb, 0xff, 0xf7, 0xff, 0xf7, 0x7f, 0x7b, 0xde,
+};
+constexpr uint8_t kTuningBlock8Bit[128] = {
+    0xff, 0xff, 0x00, 0xff, 0xff, 0xff, 0x00, 0x00, 0xff, 0xff, 0xcc, 0xcc, 0xcc, 0x33, 0xcc, 0xcc,
+    0xcc, 0x33, 0x33, 0xcc, 0xcc, 0xcc, 0xff, 0xff, 0xff, 0xee, 0xff, 0xff, 0xff, 0xee, 0xee, 0xff,
+    0xff, 0xff, 0xdd, 0xff, 0xff, 0xff, 0xdd, 0xdd, 0xff, 0xff, 0xff, 0xbb, 0xff, 0xff, 0xff, 0xbb,
+    0xbb, 0xff, 0xff, 0xff, 0x77, 0xff, 0xff, 0xff, 0x77, 0x77, 0xff, 0x77, 0xbb, 0xdd, 0xee, 0xff,
+    0xff, 0xff, 0xff, 0x00, 0xff, 0xff, 0xff, 0x00, 0x00, 0xff, 0xff, 0xcc, 0xcc, 0xcc, 0x33, 0xcc,
+    0xcc, 0xcc, 0x33, 0x33, 0xcc, 0xcc, 0xcc, 0xff, 0xff, 0xff, 0xee, 0xff, 0xff, 0xff, 0xee, 0xee,
+    0xff, 0xff, 0xff, 0xdd, 0xff, 0xff, 0xff, 0xdd, 0xdd, 0xff, 0xff, 0xff, 0xbb, 0xff, 0xff, 0xff,
+    0xbb, 0xbb, 0xff, 0xff, 0xff, 0x77, 0xff, 0xff, 0xff, 0x77, 0x77, 0xff, 0x77, 0xbb, 0xdd, 0xee,
+};
+
+// A tuning result from an earlier boot, saved by the bootloader from the
+// driver's log, so a known card skips the sample-point sweep.
+struct CachedTuning {
+  uint32_t cid[4];  // RESP0-3 of the card's CMD2 response
+  uint32_t timing;  // sdmmc_timing_t the result was found for
+  uint8_t sample_delay;
+  uint8_t valid;
+  uint8_t reserved[2];
+};
+
+// DEVICE_METADATA_PRIVATE payload describing how the board wired the slot.
+// Older, shorter payloads leave the trailing fields zero.
+struct MmcMetadata {
+  // Module clock the bootloader set up for this controller; the card clock
+  // is divided down from it.
+  uint32_t source_clock_hz;
+  // Data lines wired to the slot: 1, 4 or 8.
+  uint32_t max_bus_width;
+  // Non-zero if the slot's I/O rail is a fixed 1.8V, which HS200 and HS400
+  // need.
+  uint32_t fixed_vccq_180;
+  // Data strobe delay chain setting for HS400; 0 leaves HS400 off.
+  uint32_t hs400_strobe_delay;
+  CachedTuning cached_tuning;
+};
+
+constexpr MmcMetadata kDefaultMetadata = {
+    .source_clock_hz = 24000000,  // OSC24M, the reset default
+    .max_bus_width = 4,
+};
 
 class SoliloquyMmc;
 using DeviceType = ddk::Device<SoliloquyMmc, ddk::Unbindable>;
 
-class SoliloquyMmc : public DeviceType {
+class SoliloquyMmc : public DeviceType,
+                     public ddk::SdmmcProtocol<SoliloquyMmc, ddk::base_protocol> {
  public:
   explicit SoliloquyMmc(zx_device_t* parent) : DeviceType(parent) {}
 
   static zx_status_t Create(void* ctx, zx_device_t* parent);
 
-  void DdkRelease() { delete this; }
-  void DdkUnbind(ddk::UnbindTxn txn) { txn.Reply(); }
+  void DdkRelease() {
+    StopIrqThread();
+    delete this;
+  }
+  void DdkUnbind(ddk::UnbindTxn txn) {
+    StopIrqThread();
+    txn.Reply();
+  }
+
+  // SDMMC protocol implementation
+  zx_status_t SdmmcHostInfo(sdmmc_host_info_t* out_info);
+  zx_status_t SdmmcSetSignalVoltage(sdmmc_voltage_t voltage);
+  zx_status_t SdmmcSetBusWidth(sdmmc_bus_width_t bus_width);
+  zx_status_t SdmmcSetBusFreq(uint32_t bus_freq);
+  zx_status_t SdmmcSetTiming(sdmmc_timing_t timing);
+  zx_status_t SdmmcHwReset();
+  zx_status_t SdmmcPerformTuning(uint32_t cmd_idx);
+  zx_status_t SdmmcRegisterInBandInterrupt(const in_band_interrupt_protocol_t* interrupt_cb);
+  void SdmmcAckInBandInterrupt();
+  zx_status_t SdmmcRegisterVmo(uint32_t vmo_id, uint8_t client_id, zx::vmo vmo,
+                               uint64_t offset, uint64_t size, uint32_t vmo_rights);
+  zx_status_t SdmmcUnregisterVmo(uint32_t vmo_id, uint8_t client_id, zx::vmo* out_vmo);
+  zx_status_t SdmmcRequest(const sdmmc_req_t* req, uint32_t out_response[4]);
 
  private:
+  // A VMO registered by the SDMMC core, pinned for as long as it stays
+  // registered so requests only have to look up page addresses.
+  struct RegisteredVmo {
+    zx::vmo vmo;
+    uint64_t offset;
+    uint64_t size;
+    uint32_t rights;
+    zx::pmt pmt;
+    // Physical address of each page, starting at the page holding |offset|.
+    std::vector<zx_paddr_t> pages;
+  };
+
+  // Pins of VMO-handle buffers that last only for one request.
+  struct TransientPin {
+    zx::pmt pmt;
+  };
+
+  // A caller of SdmmcRequest() waiting for its command to be issued.
+  struct QueuedRequest {
+    const sdmmc_req_t* req;
+    uint32_t* response;
+    // Card block range, for block transfers that may be merged.
+    uint32_t block = 0;
+    uint32_t blocks = 0;
+    zx_status_t status = ZX_OK;
+    bool done = false;
+  };
+
+  enum class Addressing {
+    kUnknown,
+    kByte,
+    kSector,
+  };
+
   zx_status_t Init();
   zx_status_t InitHardware();
   void ResetController();
 
+  zx_status_t StartIrqThread();
+  void StopIrqThread();
+  int IrqThread();
+
+  // Sends a clock-update-only command so the controller picks up CLKCR.
+  zx_status_t UpdateClockLocked() __TA_REQUIRES(lock_);
+  // Points the descriptor chain at |req|'s buffers. Pins VMO-handle
+  // buffers into |pins|, which the caller releases once the transfer ends.
+  zx_status_t BuildDescriptorsLocked(const sdmmc_req_t* req, uint64_t* out_bytes,
+                                     std::vector<TransientPin>* pins) __TA_REQUIRES(lock_);
+  // Appends descriptors covering |size| bytes of |pages| from |offset|,
+  // merging physically contiguous pages.
+  zx_status_t AppendPagesLocked(const zx_paddr_t* pages, uint64_t offset, uint64_t size)
+      __TA_REQUIRES(lock_);
+  void CacheOpLocked(const sdmmc_req_t* req, uint32_t op) __TA_REQUIRES(lock_);
+  // Fills in the block range of a read or write the queue may merge.
+  bool Mergeable(QueuedRequest* queued) const;
+  // Takes the next request off the queues plus any queued requests
+  // adjacent to it on the card.
+  void PickBatchLocked(std::vector<QueuedRequest*>* batch) __TA_REQUIRES(queue_lock_);
+  // Issues |batch| as one multi-block transfer, falling back to one
+  // command per request if that fails.
+  void IssueBatchLocked(const std::vector<QueuedRequest*>& batch) __TA_REQUIRES(lock_);
+  zx_status_t IssueLocked(const sdmmc_req_t* req, uint32_t out_response[4]) __TA_REQUIRES(lock_);
+
+  void SetSampleDelayLocked(uint32_t delay) __TA_REQUIRES(lock_);
+  // Sends one tuning command and checks the block against |pattern|.
+  bool TuningPassesLocked(uint32_t cmd_idx, const uint8_t* pattern, size_t size)
+      __TA_REQUIRES(lock_);
+  // Waits for the interrupt bits in |done| or any error.
+  zx_status_t WaitForIrqLocked(uint32_t done, uint32_t* out_status) __TA_REQUIRES(lock_);
+
   std::optional<fdf::MmioBuffer> mmio_;
+  zx::bti bti_;
+  zx::interrupt irq_;
+  zx::port port_;
+  thrd_t irq_thread_;
+  bool irq_thread_started_ = false;
+  MmcMetadata metadata_ = kDefaultMetadata;
+
+  fbl::Mutex lock_;
+  fbl::ConditionVariable irq_cv_;
+  uint32_t irq_status_ __TA_GUARDED(lock_) = 0;
+  std::map<std::pair<uint8_t, uint32_t>, RegisteredVmo> vmos_ __TA_GUARDED(lock_);
+
+  zx::vmo desc_vmo_;
+  zx::pmt desc_pmt_;
+  IdmaDescriptor* descs_ = nullptr;
+  zx_paddr_t descs_paddr_ = 0;
+  size_t desc_count_ __TA_GUARDED(lock_) = 0;
+
+  zx::vmo tuning_vmo_;
+  uint32_t bus_width_ __TA_GUARDED(lock_) = kMMC_WIDTH_1BIT;
+  sdmmc_timing_t timing_ __TA_GUARDED(lock_) = SDMMC_TIMING_LEGACY;
+  // The card's CID, snooped from its CMD2 response, keys the tuning cache.
+  uint32_t cid_[4] __TA_GUARDED(lock_) = {};
+  bool cid_valid_ __TA_GUARDED(lock_) = false;
+  // Seeded from metadata and replaced after every sweep, so retuning the
+  // same card in this boot is quick too.
+  CachedTuning tuning_cache_ __TA_GUARDED(lock_) = {};
+
+  // Requests are queued by class: commands without block data go first and
+  // in order, then reads, then writes. Whichever caller finds the
+  // controller idle issues the next batch on behalf of the others.
+  fbl::Mutex queue_lock_;
+  fbl::ConditionVariable queue_cv_;
+  std::deque<QueuedRequest*> control_queue_ __TA_GUARDED(queue_lock_);
+  std::deque<QueuedRequest*> read_queue_ __TA_GUARDED(queue_lock_);
+  std::deque<QueuedRequest*> write_queue_ __TA_GUARDED(queue_lock_);
+  bool issuing_ __TA_GUARDED(queue_lock_) = false;
+  // Read batches issued in a row while writes were waiting.
+  uint32_t writes_deferred_ __TA_GUARDED(queue_lock_) = 0;
+  // Learned from the card's OCR during initialization. Merging needs it to
+  // turn command arguments into block numbers.
+  std::atomic<Addressing> addressing_ = Addressing::kUnknown;
+
+  fbl::Mutex sdio_lock_;
+  ddk::InBandInterruptProtocolClient sdio_irq_ __TA_GUARDED(sdio_lock_);
+
+  inspect::Inspector inspector_;
+
+  static constexpr size_t kMaxDescriptors = ZX_PAGE_SIZE / sizeof(IdmaDescriptor);
+  static constexpr zx::duration kCommandTimeout = zx::sec(1);
+  static constexpr uint32_t kMergeBlockSize = 512;
+  static constexpr uint64_t kMaxMergeBytes = kMaxDescriptors * ZX_PAGE_SIZE;
+  // Reads may overtake waiting writes this many times before a write batch
+  // is forced out.
+  static constexpr uint32_t kMaxWritesDeferred = 4;
+  // Tuning commands a cached sample delay has to pass before it is reused.
+  static constexpr uint32_t kTuningVerifyPasses = 4;
+  static constexpr uint64_t kPortKeyIrq = 0;
+  static constexpr uint64_t kPortKeyStop = 1;
 };
 
+namespace {
+soliloquy_hal::Histogram init_us("soliloquy-mmc.init_us");
+soliloquy_hal::Histogram request_us("soliloquy-mmc.request_us");
+soliloquy_hal::Counter request_bytes("soliloquy-mmc.request_bytes");
+soliloquy_hal::Counter request_errors("soliloquy-mmc.request_errors");
+soliloquy_hal::Counter requests_merged("soliloquy-mmc.requests_merged");
+soliloquy_hal::Histogram batch_blocks("soliloquy-mmc.batch_blocks");
+soliloquy_hal::Histogram tuning_us("soliloquy-mmc.tuning_us");
+soliloquy_hal::Counter tuning_cache_hits("soliloquy-mmc.tuning_cache_hits");
+}  // namespace
+
 zx_status_t SoliloquyMmc::Create(void* ctx, zx_device_t* parent) {
   fbl::AllocChecker ac;
   auto dev = fbl::make_unique_checked<SoliloquyMmc>(&ac, parent);
@@ -72,15 +418,20 @@ zx_status_t SoliloquyMmc::Create(void* ctx, zx_device_t* parent) {
 }
 
 zx_status_t SoliloquyMmc::Init() {
+  SOLILOQUY_TIMED_SCOPE(init_us, "mmc_init");
   auto status = InitHardware();
   if (status != ZX_OK) {
     zxlogf(WARNING, "Hardware init failed: %s", zx_status_get_string(status));
     // Continue - we can probe for SD/eMMC later
   }
 
-  status = DdkAdd("soliloquy-mmc");
+  soliloquy_hal::PublishMetrics(inspector_);
+  status = DdkAdd(ddk::DeviceAddArgs("soliloquy-mmc")
+                      .set_proto_id(ZX_PROTOCOL_SDMMC)
+                      .set_inspect_vmo(inspector_.DuplicateVmo()));
   if (status != ZX_OK) {
     zxlogf(ERROR, "Failed to add device: %s", zx_status_get_string(status));
+    StopIrqThread();
     return status;
   }
 
@@ -103,8 +454,64 @@ zx_status_t SoliloquyMmc::InitHardware() {
   }
   mmio_ = std::move(mmio);
 
+  size_t actual;
+  MmcMetadata metadata = {};
+  status = device_get_metadata(parent(), DEVICE_METADATA_PRIVATE, &metadata, sizeof(metadata),
+                               &actual);
+  if (status == ZX_OK && actual >= offsetof(MmcMetadata, fixed_vccq_180) &&
+      metadata.source_clock_hz != 0) {
+    metadata_ = metadata;
+  }
+  {
+    fbl::AutoLock lock(&lock_);
+    tuning_cache_ = metadata_.cached_tuning;
+  }
+
+  status = pdev.GetBti(0, &bti_);
+  if (status != ZX_OK) {
+    zxlogf(ERROR, "Failed to get BTI: %s", zx_status_get_string(status));
+    return status;
+  }
+
+  // One page of descriptors, uncached so the IDMAC sees every update
+  // without cache maintenance.
+  const size_t desc_size = ZX_PAGE_SIZE;
+  status = zx::vmo::create_contiguous(bti_, desc_size, 0, &desc_vmo_);
+  if (status != ZX_OK) {
+    return status;
+  }
+  status = desc_vmo_.set_cache_policy(ZX_CACHE_POLICY_UNCACHED_DEVICE);
+  if (status != ZX_OK) {
+    return status;
+  }
+  zx_vaddr_t vaddr;
+  status = zx::vmar::root_self()->map(ZX_VM_PERM_READ | ZX_VM_PERM_WRITE, 0, desc_vmo_, 0,
+                                      desc_size, &vaddr);
+  if (status != ZX_OK) {
+    return status;
+  }
+  descs_ = reinterpret_cast<IdmaDescriptor*>(vaddr);
+  // The IDMAC writes descriptors back to clear OWN, so it needs write access.
+  status = bti_.pin(ZX_BTI_PERM_READ | ZX_BTI_PERM_WRITE | ZX_BTI_CONTIGUOUS, desc_vmo_, 0,
+                    desc_size, &descs_paddr_, 1, &desc_pmt_);
+  if (status != ZX_OK) {
+    zxlogf(ERROR, "Failed to pin DMA descriptors: %s", zx_status_get_string(status));
+    return status;
+  }
+
+  status = zx::vmo::create(ZX_PAGE_SIZE, 0, &tuning_vmo_);
+  if (status != ZX_OK) {
+    return status;
+  }
+
+  status = pdev.GetInterrupt(0, 0, &irq_);
+  if (status != ZX_OK) {
+    zxlogf(ERROR, "Failed to get interrupt: %s", zx_status_get_string(status));
+    return status;
+  }
+
   ResetController();
-  return ZX_OK;
+  return StartIrqThread();
 }
 
 void SoliloquyMmc::ResetController() {
@@ -112,21 +519,861 @@ void SoliloquyMmc::ResetController() {
     return;
   }
 
+  soliloquy_hal::MmioHelper helper(&*mmio_);
+
   // Soft reset
-  mmio_->Write32(0x7, kMMC_GCTRL);
-  
+  helper.Write32(kMMC_GCTRL, kMMC_GCTRL_RESET);
+
   // Wait for reset to complete
-  zx_nanosleep(zx_deadline_after(ZX_MSEC(10)));
-  
+  if (!helper.WaitForMask32(kMMC_GCTRL, kMMC_GCTRL_RESET, 0, zx::msec(10))) {
+    zxlogf(WARNING, "MMC controller reset did not complete");
+  }
+
   // Clear interrupts
   mmio_->Write32(0xFFFFFFFF, kMMC_RINT);
-  
+
   // Set default timeout
-  mmio_->Write32(0xFFFFFF00, kMMC_TIMEOUT);
-  
+  mmio_->Write32(kMMC_TIMEOUT_DEFAULT, kMMC_TIMEOUT);
+
+  // Data moves through the IDMAC, never by CPU FIFO access.
+  mmio_->Write32(kMMC_FTRGL_DEFAULT, kMMC_FTRGL);
+  mmio_->Write32(kMMC_DMAC_SOFT_RESET, kMMC_DMAC);
+  mmio_->Write32(0, kMMC_IDIE);
+  mmio_->Write32(0xFFFFFFFF, kMMC_IDST);
+  mmio_->Write32(kMMC_INT_ERRORS | kMMC_INT_DONE, kMMC_IMASK);
+  mmio_->Write32(kMMC_GCTRL_INT_ENABLE | kMMC_GCTRL_DMA_ENABLE, kMMC_GCTRL);
+
   zxlogf(DEBUG, "MMC controller reset complete");
 }
 
+zx_status_t SoliloquyMmc::StartIrqThread() {
+  auto status = zx::port::create(ZX_PORT_BIND_TO_INTERRUPT, &port_);
+  if (status != ZX_OK) {
+    return status;
+  }
+  status = irq_.bind(port_, kPortKeyIrq, 0);
+  if (status != ZX_OK) {
+    return status;
+  }
+
+  int rc = thrd_create_with_name(
+      &irq_thread_, [](void* arg) { return static_cast<SoliloquyMmc*>(arg)->IrqThread(); },
+      this, "soliloquy-mmc-irq");
+  if (rc != thrd_success) {
+    return ZX_ERR_INTERNAL;
+  }
+  irq_thread_started_ = true;
+  return ZX_OK;
+}
+
+void SoliloquyMmc::StopIrqThread() {
+  if (!irq_thread_started_) {
+    return;
+  }
+  zx_port_packet_t packet = {};
+  packet.key = kPortKeyStop;
+  packet.type = ZX_PKT_TYPE_USER;
+  port_.queue(&packet);
+  thrd_join(irq_thread_, nullptr);
+  irq_thread_started_ = false;
+}
+
+int SoliloquyMmc::IrqThread() {
+  while (true) {
+    zx_port_packet_t packet;
+    auto status = port_.wait(zx::time::infinite(), &packet);
+    if (status != ZX_OK) {
+      zxlogf(ERROR, "IRQ port wait failed: %s", zx_status_get_string(status));
+      return status;
+    }
+    if (packet.key == kPortKeyStop) {
+      return 0;
+    }
+
+    uint32_t pending = mmio_->Read32(kMMC_MINT);
+    mmio_->Write32(pending, kMMC_RINT);
+    mmio_->Write32(mmio_->Read32(kMMC_IDST), kMMC_IDST);
+
+    if (pending & kMMC_INT_SDIO) {
+      // Masked until the function driver acks, so a level-held card
+      // interrupt does not storm.
+      mmio_->ClearBits32(kMMC_INT_SDIO, kMMC_IMASK);
+      fbl::AutoLock lock(&sdio_lock_);
+      if (sdio_irq_.is_valid()) {
+        sdio_irq_.Callback();
+      }
+    }
+    if (pending & ~kMMC_INT_SDIO) {
+      fbl::AutoLock lock(&lock_);
+      irq_status_ |= pending & ~kMMC_INT_SDIO;
+      irq_cv_.Broadcast();
+    }
+    irq_.ack();
+  }
+}
+
+zx_status_t SoliloquyMmc::SdmmcHostInfo(sdmmc_host_info_t* out_info) {
+  *out_info = {};
+  out_info->caps = SDMMC_HOST_CAP_DMA | SDMMC_HOST_CAP_AUTO_CMD12;
+  if (!metadata_.fixed_vccq_180) {
+    out_info->caps |= SDMMC_HOST_CAP_VOLTAGE_330;
+  }
+  if (metadata_.max_bus_width == 8) {
+    out_info->caps |= SDMMC_HOST_CAP_BUS_WIDTH_8;
+  }
+  // Worst case, every page of a transfer needs its own descriptor.
+  out_info->max_transfer_size = kMaxDescriptors * ZX_PAGE_SIZE;
+  out_info->max_transfer_size_non_dma = 0;
+  out_info->max_buffer_regions = kMaxDescriptors;
+  out_info->prefs = 0;
+  if (!metadata_.fixed_vccq_180) {
+    out_info->prefs |= SDMMC_HOST_PREFS_DISABLE_HS400 | SDMMC_HOST_PREFS_DISABLE_HS200;
+  } else if (metadata_.hs400_strobe_delay == 0) {
+    out_info->prefs |= SDMMC_HOST_PREFS_DISABLE_HS400;
+  }
+  return ZX_OK;
+}
+
+zx_status_t SoliloquyMmc::SdmmcSetSignalVoltage(sdmmc_voltage_t voltage) {
+  // I/O voltage is fixed by the board's regulator.
+  sdmmc_voltage_t fixed = metadata_.fixed_vccq_180 ? SDMMC_VOLTAGE_V180 : SDMMC_VOLTAGE_V330;
+  return voltage == fixed ? ZX_OK : ZX_ERR_NOT_SUPPORTED;
+}
+
+zx_status_t SoliloquyMmc::SdmmcSetBusWidth(sdmmc_bus_width_t bus_width) {
+  if (!mmio_) {
+    return ZX_ERR_BAD_STATE;
+  }
+  uint32_t width;
+  switch (bus_width) {
+    case SDMMC_BUS_WIDTH_ONE:
+      width = kMMC_WIDTH_1BIT;
+      break;
+    case SDMMC_BUS_WIDTH_FOUR:
+      width = kMMC_WIDTH_4BIT;
+      break;
+    case SDMMC_BUS_WIDTH_EIGHT:
+      if (metadata_.max_bus_width != 8) {
+        return ZX_ERR_NOT_SUPPORTED;
+      }
+      width = kMMC_WIDTH_8BIT;
+      break;
+    default:
+      return ZX_ERR_INVALID_ARGS;
+  }
+  fbl::AutoLock lock(&lock_);
+  mmio_->Write32(width, kMMC_WIDTH);
+  bus_width_ = width;
+  return ZX_OK;
+}
+
+zx_status_t SoliloquyMmc::SdmmcSetBusFreq(uint32_t bus_freq) {
+  if (!mmio_) {
+    return ZX_ERR_BAD_STATE;
+  }
+
+  fbl::AutoLock lock(&lock_);
+  uint32_t clkcr = mmio_->Read32(kMMC_CLKCR);
+  // Gate the card clock while the divider changes.
+  clkcr &= ~(kMMC_CLKCR_CARD_CLK_ON | kMMC_CLKCR_MASK_DATA0);
+  mmio_->Write32(clkcr, kMMC_CLKCR);
+  zx_status_t status = UpdateClockLocked();
+  if (status != ZX_OK || bus_freq == 0) {
+    return status;
+  }
+
+  // card clock = source / (2 * div), div 0 passes the source through.
+  uint32_t source = metadata_.source_clock_hz;
+  uint32_t div = 0;
+  if (bus_freq < source) {
+    div = (source + 2 * bus_freq - 1) / (2 * bus_freq);
+    div = std::min(div, kMMC_CLKCR_DIV_MASK);
+  }
+  clkcr = (clkcr & ~kMMC_CLKCR_DIV_MASK) | div | kMMC_CLKCR_CARD_CLK_ON;
+  mmio_->Write32(clkcr, kMMC_CLKCR);
+  return UpdateClockLocked();
+}
+
+zx_status_t SoliloquyMmc::UpdateClockLocked() {
+  soliloquy_hal::MmioHelper helper(&*mmio_);
+  mmio_->Write32(kMMC_CMD_START | kMMC_CMD_UPCLK_ONLY | kMMC_CMD_WAIT_PRE_OVER, kMMC_CMD);
+  if (!helper.WaitForMask32(kMMC_CMD, kMMC_CMD_START, 0, zx::msec(10))) {
+    zxlogf(ERROR, "Clock update timed out");
+    return ZX_ERR_TIMED_OUT;
+  }
+  // The update-only command raises no completion but may leave a stale
+  // error bit.
+  mmio_->Write32(mmio_->Read32(kMMC_RINT), kMMC_RINT);
+  return ZX_OK;
+}
+
+zx_status_t SoliloquyMmc::SdmmcSetTiming(sdmmc_timing_t timing) {
+  if (!mmio_) {
+    return ZX_ERR_BAD_STATE;
+  }
+
+  bool ddr = false;
+  bool tuned = false;
+  bool hs400 = false;
+  switch (timing) {
+    case SDMMC_TIMING_LEGACY:
+    case SDMMC_TIMING_HS:
+    case SDMMC_TIMING_SDR12:
+    case SDMMC_TIMING_SDR25:
+      break;
+    case SDMMC_TIMING_HSDDR:
+    case SDMMC_TIMING_DDR50:
+      ddr = true;
+      break;
+    case SDMMC_TIMING_HS200:
+      if (!metadata_.fixed_vccq_180) {
+        return ZX_ERR_NOT_SUPPORTED;
+      }
+      tuned = true;
+      break;
+    case SDMMC_TIMING_HS400:
+      if (!metadata_.fixed_vccq_180 || metadata_.hs400_strobe_delay == 0) {
+        return ZX_ERR_NOT_SUPPORTED;
+      }
+      ddr = tuned = hs400 = true;
+      break;
+    default:
+      return ZX_ERR_NOT_SUPPORTED;
+  }
+
+  fbl::AutoLock lock(&lock_);
+  uint32_t gctrl = mmio_->Read32(kMMC_GCTRL) & ~kMMC_GCTRL_DDR_MODE;
+  mmio_->Write32(gctrl | (ddr ? kMMC_GCTRL_DDR_MODE : 0), kMMC_GCTRL);
+  mmio_->Write32(tuned ? kMMC_NTSR_MODE_SELECT : 0, kMMC_NTSR);
+  if (!tuned) {
+    mmio_->Write32(0, kMMC_SAMP_DL);
+  }
+  // HS400 samples data on the card's strobe; commands keep the sample
+  // point found by HS200 tuning.
+  mmio_->Write32(hs400 ? kMMC_EDSD_HS400_ENABLE : 0, kMMC_EDSD);
+  mmio_->Write32(
+      hs400 ? kMMC_DL_SW_ENABLE | (metadata_.hs400_strobe_delay & kMMC_DL_MASK) : 0,
+      kMMC_DS_DL);
+  timing_ = timing;
+  return ZX_OK;
+}
+
+zx_status_t SoliloquyMmc::SdmmcHwReset() {
+  if (!mmio_) {
+    return ZX_ERR_BAD_STATE;
+  }
+  // Pulse the eMMC RST_n line, then reinitialize the controller.
+  mmio_->Write32(0, kMMC_HWRST);
+  zx::nanosleep(zx::deadline_after(zx::usec(10)));
+  mmio_->Write32(1, kMMC_HWRST);
+  zx::nanosleep(zx::deadline_after(zx::usec(300)));
+  fbl::AutoLock lock(&lock_);
+  ResetController();
+  bus_width_ = kMMC_WIDTH_1BIT;
+  timing_ = SDMMC_TIMING_LEGACY;
+  return ZX_OK;
+}
+
+zx_status_t SoliloquyMmc::SdmmcPerformTuning(uint32_t cmd_idx) {
+  if (!mmio_ || !irq_thread_started_) {
+    return ZX_ERR_BAD_STATE;
+  }
+  SOLILOQUY_TIMED_SCOPE(tuning_us, "mmc_tuning");
+
+  fbl::AutoLock lock(&lock_);
+  const uint8_t* pattern;
+  size_t size;
+  if (bus_width_ == kMMC_WIDTH_8BIT) {
+    pattern = kTuningBlock8Bit;
+    size = sizeof(kTuningBlock8Bit);
+  } else if (bus_width_ == kMMC_WIDTH_4BIT) {
+    pattern = kTuningBlock4Bit;
+    size = sizeof(kTuningBlock4Bit);
+  } else {
+    return ZX_ERR_NOT_SUPPORTED;
+  }
+
+  if (cid_valid_ && tuning_cache_.valid && tuning_cache_.timing == timing_ &&
+      memcmp(tuning_cache_.cid, cid_, sizeof(cid_)) == 0) {
+    SetSampleDelayLocked(tuning_cache_.sample_delay);
+    bool passed = true;
+    for (uint32_t i = 0; i < kTuningVerifyPasses && passed; i++) {
+      passed = TuningPassesLocked(cmd_idx, pattern, size);
+    }
+    if (passed) {
+      tuning_cache_hits.Add();
+      zxlogf(DEBUG, "Reusing sample delay %u", tuning_cache_.sample_delay);
+      return ZX_OK;
+    }
+    zxlogf(INFO, "Cached sample delay %u failed, retuning", tuning_cache_.sample_delay);
+  }
+
+  // Sweep the whole delay chain and sample in the middle of the widest
+  // passing window, the point with the most margin either way.
+  uint32_t best_start = 0;
+  uint32_t best_len = 0;
+  uint32_t start = 0;
+  uint32_t len = 0;
+  for (uint32_t delay = 0; delay <= kMMC_DL_MASK; delay++) {
+    SetSampleDelayLocked(delay);
+    if (!TuningPassesLocked(cmd_idx, pattern, size)) {
+      len = 0;
+      continue;
+    }
+    if (len++ == 0) {
+      start = delay;
+    }
+    if (len > best_len) {
+      best_start = start;
+      best_len = len;
+    }
+  }
+  if (best_len == 0) {
+    zxlogf(ERROR, "CMD%u tuning found no working sample point", cmd_idx);
+    SetSampleDelayLocked(0);
+    return ZX_ERR_IO;
+  }
+
+  uint32_t delay = best_start + best_len / 2;
+  SetSampleDelayLocked(delay);
+  tuning_cache_ = {};
+  memcpy(tuning_cache_.cid, cid_, sizeof(cid_));
+  tuning_cache_.timing = timing_;
+  tuning_cache_.sample_delay = static_cast<uint8_t>(delay);
+  tuning_cache_.valid = cid_valid_;
+  zxlogf(INFO, "Tuned sample delay %u (window %u-%u) for CID %08x %08x %08x %08x", delay,
+         best_start, best_start + best_len - 1, cid_[0], cid_[1], cid_[2], cid_[3]);
+  return ZX_OK;
+}
+
+void SoliloquyMmc::SetSampleDelayLocked(uint32_t delay) {
+  mmio_->Write32(kMMC_DL_SW_ENABLE | (delay & kMMC_DL_MASK), kMMC_SAMP_DL);
+}
+
+bool SoliloquyMmc::TuningPassesLocked(uint32_t cmd_idx, const uint8_t* pattern, size_t size) {
+  sdmmc_buffer_region_t region = {};
+  region.buffer.vmo = tuning_vmo_.get();
+  region.type = SDMMC_BUFFER_TYPE_VMO_HANDLE;
+  region.offset = 0;
+  region.size = size;
+
+  sdmmc_req_t req = {};
+  req.cmd_idx = cmd_idx;
+  req.cmd_flags = SDMMC_RESP_LEN_48 | SDMMC_RESP_CRC_CHECK | SDMMC_RESP_CMD_IDX_CHECK |
+                  SDMMC_RESP_DATA_PRESENT | SDMMC_CMD_READ;
+  req.blocksize = static_cast<uint32_t>(size);
+  // Most of the sweep is expected to fail.
+  req.suppress_error_messages = true;
+  req.buffers_list = &region;
+  req.buffers_count = 1;
+
+  uint32_t response[4];
+  if (IssueLocked(&req, response) != ZX_OK) {
+    return false;
+  }
+  uint8_t block[sizeof(kTuningBlock8Bit)];
+  if (tuning_vmo_.read(block, 0, size) != ZX_OK) {
+    return false;
+  }
+  return memcmp(block, pattern, size) == 0;
+}
+
+zx_status_t SoliloquyMmc::SdmmcRegisterInBandInterrupt(
+    const in_band_interrupt_protocol_t* interrupt_cb) {
+  {
+    fbl::AutoLock lock(&sdio_lock_);
+    sdio_irq_ = ddk::InBandInterruptProtocolClient(interrupt_cb);
+  }
+  if (mmio_) {
+    mmio_->SetBits32(kMMC_INT_SDIO, kMMC_IMASK);
+  }
+  return ZX_OK;
+}
+
+void SoliloquyMmc::SdmmcAckInBandInterrupt() {
+  if (mmio_) {
+    mmio_->Write32(kMMC_INT_SDIO, kMMC_RINT);
+    mmio_->SetBits32(kMMC_INT_SDIO, kMMC_IMASK);
+  }
+}
+
+zx_status_t SoliloquyMmc::SdmmcRegisterVmo(uint32_t vmo_id, uint8_t client_id, zx::vmo vmo,
+                                           uint64_t offset, uint64_t size,
+                                           uint32_t vmo_rights) {
+  if (size == 0 || !(vmo_rights & (SDMMC_VMO_RIGHT_READ | SDMMC_VMO_RIGHT_WRITE))) {
+    return ZX_ERR_INVALID_ARGS;
+  }
+
+  fbl::AutoLock lock(&lock_);
+  auto key = std::make_pair(client_id, vmo_id);
+  if (vmos_.count(key)) {
+    return ZX_ERR_ALREADY_EXISTS;
+  }
+
+  const uint64_t page_size = ZX_PAGE_SIZE;
+  uint64_t pin_start = offset & ~(page_size - 1);
+  uint64_t pin_size = ((offset + size + page_size - 1) & ~(page_size - 1)) - pin_start;
+
+  RegisteredVmo entry;
+  entry.offset = offset;
+  entry.size = size;
+  entry.rights = vmo_rights;
+  entry.pages.resize(pin_size / page_size);
+  // SDMMC rights are from the device's point of view: READ lets the card
+  // be written from this memory.
+  uint32_t perms = 0;
+  perms |= (vmo_rights & SDMMC_VMO_RIGHT_READ) ? ZX_BTI_PERM_READ : 0;
+  perms |= (vmo_rights & SDMMC_VMO_RIGHT_WRITE) ? ZX_BTI_PERM_WRITE : 0;
+  zx_status_t status = bti_.pin(perms, vmo, pin_start, pin_size, entry.pages.data(),
+                                entry.pages.size(), &entry.pmt);
+  if (status != ZX_OK) {
+    zxlogf(ERROR, "Failed to pin VMO %u: %s", vmo_id, zx_status_get_string(status));
+    return status;
+  }
+  entry.vmo = std::move(vmo);
+  vmos_.emplace(key, std::move(entry));
+  return ZX_OK;
+}
+
+zx_status_t SoliloquyMmc::SdmmcUnregisterVmo(uint32_t vmo_id, uint8_t client_id,
+                                             zx::vmo* out_vmo) {
+  fbl::AutoLock lock(&lock_);
+  auto it = vmos_.find(std::make_pair(client_id, vmo_id));
+  if (it == vmos_.end()) {
+    return ZX_ERR_NOT_FOUND;
+  }
+  it->second.pmt.unpin();
+  *out_vmo = std::move(it->second.vmo);
+  vmos_.erase(it);
+  return ZX_OK;
+}
+
+zx_status_t SoliloquyMmc::AppendPagesLocked(const zx_paddr_t* pages, uint64_t offset,
+                                            uint64_t size) {
+  const uint64_t page_size = ZX_PAGE_SIZE;
+  while (size > 0) {
+    size_t page = offset / page_size;
+    zx_paddr_t addr = pages[page] + offset % page_size;
+    if (addr & ((1u << kIdmaAddrShift) - 1)) {
+      return ZX_ERR_INVALID_ARGS;
+    }
+    // Extend the run while the next page follows physically.
+    uint64_t run = std::min(size, page_size - offset % page_size);
+    while (run < size && run < kIdmaMaxSegment && pages[page + 1] == pages[page] + page_size) {
+      page++;
+      run = std::min(size, run + page_size);
+    }
+    run = std::min(run, kIdmaMaxSegment);
+
+    if (desc_count_ == kMaxDescriptors) {
+      return ZX_ERR_OUT_OF_RANGE;
+    }
+    IdmaDescriptor& desc = descs_[desc_count_++];
+    desc.config = kIDMA_OWN | kIDMA_CHAIN | kIDMA_DIC;
+    desc.buf_size = run == kIdmaMaxSegment ? 0 : static_cast<uint32_t>(run);
+    desc.buf_addr = static_cast<uint32_t>(addr >> kIdmaAddrShift);
+    offset += run;
+    size -= run;
+  }
+  return ZX_OK;
+}
+
+zx_status_t SoliloquyMmc::BuildDescriptorsLocked(const sdmmc_req_t* req, uint64_t* out_bytes,
+                                                 std::vector<TransientPin>* pins) {
+  const uint64_t page_size = ZX_PAGE_SIZE;
+  const bool read = req->cmd_flags & SDMMC_CMD_READ;
+  desc_count_ = 0;
+  uint64_t bytes = 0;
+
+  for (size_t i = 0; i < req->buffers_count; i++) {
+    const sdmmc_buffer_region_t& region = req->buffers_list[i];
+    if (region.size == 0) {
+      continue;
+    }
+    zx_status_t status;
+    if (region.type == SDMMC_BUFFER_TYPE_VMO_ID) {
+      auto it = vmos_.find(std::make_pair(req->client_id, region.buffer.vmo_id));
+      if (it == vmos_.end()) {
+        return ZX_ERR_NOT_FOUND;
+      }
+      const RegisteredVmo& vmo = it->second;
+      uint32_t needed = read ? SDMMC_VMO_RIGHT_WRITE : SDMMC_VMO_RIGHT_READ;
+      if (!(vmo.rights & needed) || region.offset + region.size > vmo.size) {
+        return ZX_ERR_ACCESS_DENIED;
+      }
+      status = AppendPagesLocked(vmo.pages.data(), (vmo.offset % page_size) + region.offset,
+                                 region.size);
+    } else {
+      // Pinned for this request only.
+      zx::unowned_vmo vmo(region.buffer.vmo);
+      uint64_t pin_start = region.offset & ~(page_size - 1);
+      uint64_t pin_size =
+          ((region.offset + region.size + page_size - 1) & ~(page_size - 1)) - pin_start;
+      std::vector<zx_paddr_t> pages(pin_size / page_size);
+      TransientPin pin;
+      status = bti_.pin(read ? ZX_BTI_PERM_WRITE : ZX_BTI_PERM_READ, *vmo, pin_start, pin_size,
+                        pages.data(), pages.size(), &pin.pmt);
+      if (status != ZX_OK) {
+        return status;
+      }
+      pins->push_back(std::move(pin));
+      status = AppendPagesLocked(pages.data(), region.offset - pin_start, region.size);
+    }
+    if (status != ZX_OK) {
+      return status;
+    }
+    bytes += region.size;
+  }
+  if (desc_count_ == 0) {
+    return ZX_ERR_INVALID_ARGS;
+  }
+
+  for (size_t i = 0; i < desc_count_; i++) {
+    descs_[i].next_desc =
+        static_cast<uint32_t>((descs_paddr_ + (i + 1) * sizeof(IdmaDescriptor)) >> kIdmaAddrShift);
+  }
+  descs_[0].config |= kIDMA_FIRST;
+  descs_[desc_count_ - 1].config |= kIDMA_LAST;
+  descs_[desc_count_ - 1].config &= ~kIDMA_DIC;
+  descs_[desc_count_ - 1].next_desc = 0;
+  *out_bytes = bytes;
+  return ZX_OK;
+}
+
+void SoliloquyMmc::CacheOpLocked(const sdmmc_req_t* req, uint32_t op) {
+  for (size_t i = 0; i < req->buffers_count; i++) {
+    const sdmmc_buffer_region_t& region = req->buffers_list[i];
+    if (region.type == SDMMC_BUFFER_TYPE_VMO_ID) {
+      auto it = vmos_.find(std::make_pair(req->client_id, region.buffer.vmo_id));
+      if (it != vmos_.end()) {
+        it->second.vmo.op_range(op, it->second.offset + region.offset, region.size, nullptr, 0);
+      }
+    } else {
+      zx::unowned_vmo(region.buffer.vmo)->op_range(op, region.offset, region.size, nullptr, 0);
+    }
+  }
+}
+
+zx_status_t SoliloquyMmc::WaitForIrqLocked(uint32_t done, uint32_t* out_status) {
+  zx::time deadline = zx::deadline_after(kCommandTimeout);
+  while ((irq_status_ & done) != done && !(irq_status_ & kMMC_INT_ERRORS)) {
+    zx::duration left = deadline - zx::clock::get_monotonic();
+    if (left <= zx::duration(0)) {
+      *out_status = irq_status_;
+      return ZX_ERR_TIMED_OUT;
+    }
+    irq_cv_.Timedwait(&lock_, left.get());
+  }
+  *out_status = irq_status_;
+  if (irq_status_ & (kMMC_INT_RESP_TIMEOUT | kMMC_INT_DATA_TIMEOUT)) {
+    return ZX_ERR_TIMED_OUT;
+  }
+  return (irq_status_ & kMMC_INT_ERRORS) ? ZX_ERR_IO : ZX_OK;
+}
+
+bool SoliloquyMmc::Mergeable(QueuedRequest* queued) const {
+  const sdmmc_req_t* req = queued->req;
+  switch (req->cmd_idx) {
+    case kCmdReadMultipleBlock:
+    case kCmdWriteMultipleBlock:
+      // Without auto-CMD12 the caller sends its own stop after this
+      // command, so the transfer cannot grow.
+      if (!(req->cmd_flags & SDMMC_CMD_AUTO12)) {
+        return false;
+      }
+      break;
+    case kCmdReadSingleBlock:
+    case kCmdWriteBlock:
+      break;
+    default:
+      return false;
+  }
+  Addressing addressing = addressing_.load();
+  if (addressing == Addressing::kUnknown || req->blocksize != kMergeBlockSize) {
+    return false;
+  }
+
+  uint64_t bytes = 0;
+  for (size_t i = 0; i < req->buffers_count; i++) {
+    bytes += req->buffers_list[i].size;
+  }
+  if (bytes == 0 || bytes % kMergeBlockSize != 0 || bytes > kMaxMergeBytes) {
+    return false;
+  }
+  if (addressing == Addressing::kByte) {
+    if (req->arg % kMergeBlockSize != 0) {
+      return false;
+    }
+    queued->block = req->arg / kMergeBlockSize;
+  } else {
+    queued->block = req->arg;
+  }
+  queued->blocks = static_cast<uint32_t>(bytes / kMergeBlockSize);
+  return true;
+}
+
+void SoliloquyMmc::PickBatchLocked(std::vector<QueuedRequest*>* batch) {
+  if (!control_queue_.empty()) {
+    batch->push_back(control_queue_.front());
+    control_queue_.pop_front();
+    return;
+  }
+
+  bool read = !read_queue_.empty() &&
+              (write_queue_.empty() || writes_deferred_ < kMaxWritesDeferred);
+  if (read && !write_queue_.empty()) {
+    writes_deferred_++;
+  } else if (!read) {
+    writes_deferred_ = 0;
+  }
+  std::deque<QueuedRequest*>& queue = read ? read_queue_ : write_queue_;
+  if (queue.empty()) {
+    return;
+  }
+
+  QueuedRequest* head = queue.front();
+  queue.pop_front();
+  batch->push_back(head);
+  uint32_t start = head->block;
+  uint32_t end = head->block + head->blocks;
+
+  // Grow the range at either end until no queued request touches it.
+  bool grew = true;
+  while (grew) {
+    grew = false;
+    for (auto it = queue.begin(); it != queue.end(); ++it) {
+      QueuedRequest* next = *it;
+      if (next->req->client_id != head->req->client_id ||
+          uint64_t{end - start + next->blocks} * kMergeBlockSize > kMaxMergeBytes) {
+        continue;
+      }
+      if (next->block == end) {
+        end += next->blocks;
+      } else if (next->block + next->blocks == start) {
+        start = next->block;
+      } else {
+        continue;
+      }
+      batch->push_back(next);
+      queue.erase(it);
+      grew = true;
+      break;
+    }
+  }
+  std::sort(batch->begin(), batch->end(),
+            [](const QueuedRequest* a, const QueuedRequest* b) { return a->block < b->block; });
+}
+
+void SoliloquyMmc::IssueBatchLocked(const std::vector<QueuedRequest*>& batch) {
+  if (batch.size() == 1) {
+    batch[0]->status = IssueLocked(batch[0]->req, batch[0]->response);
+    return;
+  }
+
+  const sdmmc_req_t* first = batch[0]->req;
+  const bool read = first->cmd_flags & SDMMC_CMD_READ;
+  std::vector<sdmmc_buffer_region_t> regions;
+  uint32_t blocks = 0;
+  for (const QueuedRequest* queued : batch) {
+    regions.insert(regions.end(), queued->req->buffers_list,
+                   queued->req->buffers_list + queued->req->buffers_count);
+    blocks += queued->blocks;
+  }
+
+  sdmmc_req_t merged = *first;
+  merged.cmd_idx = read ? kCmdReadMultipleBlock : kCmdWriteMultipleBlock;
+  merged.cmd_flags |= SDMMC_CMD_MULTI_BLK | SDMMC_CMD_AUTO12;
+  merged.buffers_list = regions.data();
+  merged.buffers_count = regions.size();
+  // Failures are retried per request below, which reports them.
+  merged.suppress_error_messages = true;
+
+  uint32_t response[4] = {};
+  if (IssueLocked(&merged, response) == ZX_OK) {
+    for (QueuedRequest* queued : batch) {
+      std::copy(response, response + 4, queued->response);
+      queued->status = ZX_OK;
+    }
+    requests_merged.Add(batch.size() - 1);
+    batch_blocks.Record(blocks);
+    return;
+  }
+
+  for (QueuedRequest* queued : batch) {
+    queued->status = IssueLocked(queued->req, queued->response);
+  }
+}
+
+zx_status_t SoliloquyMmc::SdmmcRequest(const sdmmc_req_t* req, uint32_t out_response[4]) {
+  if (!mmio_ || !irq_thread_started_) {
+    return ZX_ERR_BAD_STATE;
+  }
+  SOLILOQUY_TIMED_SCOPE(request_us, "mmc_request");
+
+  QueuedRequest queued = {.req = req, .response = out_response};
+  bool mergeable = Mergeable(&queued);
+  {
+    fbl::AutoLock lock(&queue_lock_);
+    if (!mergeable) {
+      control_queue_.push_back(&queued);
+    } else if (req->cmd_flags & SDMMC_CMD_READ) {
+      read_queue_.push_back(&queued);
+    } else {
+      write_queue_.push_back(&queued);
+    }
+  }
+
+  while (true) {
+    std::vector<QueuedRequest*> batch;
+    {
+      fbl::AutoLock lock(&queue_lock_);
+      while (!queued.done && issuing_) {
+        queue_cv_.Wait(&queue_lock_);
+      }
+      if (queued.done) {
+        return queued.status;
+      }
+      issuing_ = true;
+      PickBatchLocked(&batch);
+    }
+
+    {
+      fbl::AutoLock lock(&lock_);
+      IssueBatchLocked(batch);
+    }
+
+    fbl::AutoLock lock(&queue_lock_);
+    for (QueuedRequest* done : batch) {
+      done->done = true;
+    }
+    issuing_ = false;
+    queue_cv_.Broadcast();
+  }
+}
+
+zx_status_t SoliloquyMmc::IssueLocked(const sdmmc_req_t* req, uint32_t out_response[4]) {
+  const bool data = req->cmd_flags & SDMMC_RESP_DATA_PRESENT;
+  const bool read = req->cmd_flags & SDMMC_CMD_READ;
+  std::vector<TransientPin> pins;
+
+  uint32_t cmd = kMMC_CMD_START | kMMC_CMD_WAIT_PRE_OVER | (req->cmd_idx & 0x3F);
+  if (req->cmd_idx == 0) {
+    cmd |= kMMC_CMD_SEND_INIT_SEQ;
+  }
+  if (req->cmd_flags & (SDMMC_RESP_LEN_48 | SDMMC_RESP_LEN_48B | SDMMC_RESP_LEN_136)) {
+    cmd |= kMMC_CMD_RESP_EXPIRE;
+  }
+  if (req->cmd_flags & SDMMC_RESP_LEN_136) {
+    cmd |= kMMC_CMD_LONG_RESP;
+  }
+  if (req->cmd_flags & SDMMC_RESP_CRC_CHECK) {
+    cmd |= kMMC_CMD_CHECK_RESP_CRC;
+  }
+  if (req->cmd_flags & SDMMC_CMD_TYPE_ABORT) {
+    cmd |= kMMC_CMD_STOP_ABORT;
+  }
+
+  uint32_t done = kMMC_INT_CMD_DONE;
+  uint64_t bytes = 0;
+  if (data) {
+    if (req->blocksize == 0) {
+      return ZX_ERR_INVALID_ARGS;
+    }
+    zx_status_t status = BuildDescriptorsLocked(req, &bytes, &pins);
+    if (status == ZX_OK && bytes % req->blocksize != 0) {
+      status = ZX_ERR_INVALID_ARGS;
+    }
+    if (status != ZX_OK) {
+      zxlogf(ERROR, "Failed to map CMD%u buffers: %s", req->cmd_idx,
+             zx_status_get_string(status));
+      for (TransientPin& pin : pins) {
+        pin.pmt.unpin();
+      }
+      return status;
+    }
+    // Writes are cleaned so the card sees the data; reads are cleaned and
+    // invalidated so no dirty line lands on top of the DMA.
+    CacheOpLocked(req, read ? ZX_VMO_OP_CACHE_CLEAN_INVALIDATE : ZX_VMO_OP_CACHE_CLEAN);
+
+    mmio_->SetBits32(kMMC_GCTRL_FIFO_RESET | kMMC_GCTRL_DMA_RESET, kMMC_GCTRL);
+    mmio_->Write32(kMMC_DMAC_SOFT_RESET, kMMC_DMAC);
+    mmio_->ClearBits32(kMMC_GCTRL_ACCESS_BY_AHB, kMMC_GCTRL);
+    mmio_->SetBits32(kMMC_GCTRL_DMA_ENABLE, kMMC_GCTRL);
+    mmio_->Write32(kMMC_DMAC_FIX_BURST | kMMC_DMAC_IDMAC_ON, kMMC_DMAC);
+    mmio_->Write32(static_cast<uint32_t>(descs_paddr_ >> kIdmaAddrShift), kMMC_DLBA);
+    mmio_->Write32(req->blocksize, kMMC_BLKSZ);
+    mmio_->Write32(static_cast<uint32_t>(bytes), kMMC_BYTECNT);
+
+    cmd |= kMMC_CMD_DATA_EXPIRE;
+    if (!read) {
+      cmd |= kMMC_CMD_WRITE;
+    }
+    done |= kMMC_INT_DATA_OVER;
+    // CMD18/CMD25 stop on their own: the controller sends CMD12 after the
+    // last block.
+    if ((req->cmd_flags & SDMMC_CMD_MULTI_BLK) && (req->cmd_flags & SDMMC_CMD_AUTO12)) {
+      cmd |= kMMC_CMD_AUTO_STOP;
+      done |= kMMC_INT_AUTO_CMD_DONE;
+    }
+  }
+
+  irq_status_ = 0;
+  mmio_->Write32(req->arg, kMMC_CMDARG);
+  mmio_->Write32(cmd, kMMC_CMD);
+
+  uint32_t int_status;
+  zx_status_t status = WaitForIrqLocked(done, &int_status);
+  if (status == ZX_OK && (req->cmd_flags & SDMMC_RESP_LEN_48B)) {
+    // R1b: the card holds DAT0 low while busy.
+    soliloquy_hal::MmioHelper helper(&*mmio_);
+    if (!helper.WaitForMask32(kMMC_STATUS, kMMC_STATUS_CARD_BUSY, 0, kCommandTimeout)) {
+      status = ZX_ERR_TIMED_OUT;
+    }
+  }
+
+  if (data) {
+    mmio_->Write32(0, kMMC_DMAC);
+    if (read) {
+      CacheOpLocked(req, ZX_VMO_OP_CACHE_CLEAN_INVALIDATE);
+    }
+    for (TransientPin& pin : pins) {
+      pin.pmt.unpin();
+    }
+  }
+
+  if (status != ZX_OK) {
+    request_errors.Add();
+    if (!req->suppress_error_messages) {
+      zxlogf(ERROR, "CMD%u failed: %s (RINT 0x%08x)", req->cmd_idx,
+             zx_status_get_string(status), int_status);
+    }
+    // Leave the FIFO and DMA engine clean for the next command.
+    mmio_->SetBits32(kMMC_GCTRL_FIFO_RESET | kMMC_GCTRL_DMA_RESET, kMMC_GCTRL);
+    return status;
+  }
+
+  if (req->cmd_flags & SDMMC_RESP_LEN_136) {
+    out_response[0] = mmio_->Read32(kMMC_RESP0);
+    out_response[1] = mmio_->Read32(kMMC_RESP1);
+    out_response[2] = mmio_->Read32(kMMC_RESP2);
+    out_response[3] = mmio_->Read32(kMMC_RESP3);
+  } else {
+    out_response[0] = mmio_->Read32(kMMC_RESP0);
+  }
+  if (req->cmd_idx == kCmdGoIdleState) {
+    addressing_ = Addressing::kUnknown;
+    cid_valid_ = false;
+  } else if (req->cmd_idx == kCmdAllSendCid) {
+    std::copy(out_response, out_response + 4, cid_);
+    cid_valid_ = true;
+  } else if ((req->cmd_idx == kCmdMmcSendOpCond || req->cmd_idx == kCmdSdSendOpCond) &&
+             (out_response[0] & kOcrBusy)) {
+    addressing_ = (out_response[0] & kOcrSectorMode) ? Addressing::kSector : Addressing::kByte;
+  }
+  request_bytes.Add(bytes);
+  return ZX_OK;
+}
+
 static constexpr zx_driver_ops_t driver_ops = []() {
   zx_driver_ops_t ops = {};
   ops.version = DRIVER_OPS_VERSION;
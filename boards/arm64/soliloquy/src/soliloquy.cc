@@ -5,11 +5,32 @@
 #include <ddk/driver.h>
 #include <ddk/platform-defs.h>
 #include <fbl/alloc_checker.h>
+#include <lib/zx/clock.h>
 #include <zircon/status.h>
 #include <zircon/types.h>
 
 namespace soliloquy {
 
+namespace {
+
+constexpr uint32_t StepBit(uint32_t step) { return 1u << step; }
+
+soliloquy_hal::Histogram gpio_step_us("soliloquy.step_gpio_us");
+soliloquy_hal::Histogram sdio_step_us("soliloquy.step_sdio_us");
+soliloquy_hal::Histogram eth_step_us("soliloquy.step_eth_us");
+
+} // namespace
+
+// WiFi and the Ethernet PHY have their power and reset lines on GPIO, so both
+// wait for the GPIO controller. SDIO is listed first among those so the
+// AIC8800 starts its firmware download as early as possible. Steps may only
+// depend on steps listed before them.
+const Soliloquy::StepInfo Soliloquy::kSteps[kStepCount] = {
+    {"gpio", &Soliloquy::GpioInit, 0, &gpio_step_us},
+    {"sdio", &Soliloquy::SdioInit, StepBit(kStepGpio), &sdio_step_us},
+    {"eth", &Soliloquy::EthInit, StepBit(kStepGpio), &eth_step_us},
+};
+
 zx_status_t Soliloquy::Create(void *ctx, zx_device_t *parent) {
   ddk::PBusProtocolClient pbus(parent);
   if (!pbus.is_valid()) {
@@ -23,45 +44,126 @@ zx_status_t Soliloquy::Create(void *ctx, zx_device_t *parent) {
     return ZX_ERR_NO_MEMORY;
   }
 
-  zx_status_t status = board->DdkAdd("soliloquy", DEVICE_ADD_NON_BINDABLE);
+  soliloquy_hal::PublishMetrics(board->inspector_);
+  zx_status_t status =
+      board->DdkAdd(ddk::DeviceAddArgs("soliloquy")
+                        .set_flags(DEVICE_ADD_NON_BINDABLE)
+                        .set_inspect_vmo(board->inspector_.DuplicateVmo()));
   if (status != ZX_OK) {
     zxlogf(ERROR, "Soliloquy: DdkAdd failed: %d", status);
     return status;
   }
 
-  status = board->Start();
+  // board is now owned by DDK
+  auto *ptr = board.release();
+
+  status = ptr->Start();
   if (status != ZX_OK) {
     zxlogf(ERROR, "Soliloquy: Start failed: %d", status);
+    // The DDK frees the device through DdkRelease once it is removed.
+    ptr->DdkAsyncRemove();
     return status;
   }
-
-  // board is now owned by DDK
-  [[maybe_unused]] auto ptr = board.release();
   return ZX_OK;
 }
 
 zx_status_t Soliloquy::Start() {
-  zx_status_t status;
+  int rc = thrd_create_with_name(
+      &start_thread_,
+      [](void *arg) { return static_cast<Soliloquy *>(arg)->StartThread(); },
+      this, "soliloquy-start-thread");
+  if (rc != thrd_success) {
+    return ZX_ERR_INTERNAL;
+  }
+  start_thread_started_ = true;
+  return ZX_OK;
+}
 
-  // Initialize GPIO
-  status = GpioInit();
-  if (status != ZX_OK) {
-    zxlogf(ERROR, "Soliloquy: GpioInit failed: %d", status);
+void Soliloquy::DdkRelease() {
+  // StartThread joins every step thread before it returns.
+  if (start_thread_started_) {
+    thrd_join(start_thread_, nullptr);
   }
+  delete this;
+}
 
-  // Initialize Ethernet
-  status = EthInit();
-  if (status != ZX_OK) {
-    zxlogf(ERROR, "Soliloquy: EthInit failed: %d", status);
+int Soliloquy::StartThread() {
+  struct StepRunner {
+    Soliloquy *board;
+    Step step;
+    thrd_t thread;
+    bool started;
+  };
+  StepRunner runners[kStepCount];
+
+  zx::time start = zx::clock::get_monotonic();
+
+  for (uint32_t i = 0; i < kStepCount; i++) {
+    runners[i] = {this, static_cast<Step>(i), {}, false};
+    int rc = thrd_create_with_name(
+        &runners[i].thread,
+        [](void *arg) {
+          auto *runner = static_cast<StepRunner *>(arg);
+          runner->board->RunStep(runner->step);
+          return 0;
+        },
+        &runners[i], kSteps[i].name);
+    if (rc == thrd_success) {
+      runners[i].started = true;
+    } else {
+      // Fall back to running inline; dependents still get released.
+      zxlogf(WARNING, "Soliloquy: No thread for %s, running inline",
+             kSteps[i].name);
+      RunStep(static_cast<Step>(i));
+    }
   }
 
-  // Initialize SDIO
-  status = SdioInit();
-  if (status != ZX_OK) {
-    zxlogf(ERROR, "Soliloquy: SdioInit failed: %d", status);
+  for (auto &runner : runners) {
+    if (runner.started) {
+      thrd_join(runner.thread, nullptr);
+    }
   }
 
-  return ZX_OK;
+  uint32_t failed;
+  {
+    fbl::AutoLock lock(&step_lock_);
+    failed = steps_failed_;
+  }
+  zxlogf(INFO, "Soliloquy: Bring-up finished in %ld ms (failed mask 0x%x)",
+         (zx::clock::get_monotonic() - start).to_msecs(), failed);
+  return 0;
+}
+
+void Soliloquy::RunStep(Step step) {
+  const StepInfo &info = kSteps[step];
+
+  bool deps_ok;
+  {
+    fbl::AutoLock lock(&step_lock_);
+    while ((steps_done_ & info.deps) != info.deps) {
+      step_cv_.Wait(&step_lock_);
+    }
+    deps_ok = (steps_failed_ & info.deps) == 0;
+  }
+
+  zx_status_t status = ZX_ERR_UNAVAILABLE;
+  if (deps_ok) {
+    TRACE_DURATION("soliloquy", "board_step", "step", info.name);
+    soliloquy_hal::ScopedTimer timer(info.duration_us);
+    status = (this->*info.init)();
+    if (status != ZX_OK) {
+      zxlogf(ERROR, "Soliloquy: %s init failed: %d", info.name, status);
+    }
+  } else {
+    zxlogf(ERROR, "Soliloquy: Skipping %s, a dependency failed", info.name);
+  }
+
+  fbl::AutoLock lock(&step_lock_);
+  steps_done_ |= StepBit(step);
+  if (status != ZX_OK) {
+    steps_failed_ |= StepBit(step);
+  }
+  step_cv_.Broadcast();
 }
 
 static constexpr zx_driver_ops_t soliloquy_driver_ops = []() {
@@ -3,9 +3,15 @@
 
 #include <ddktl/device.h>
 #include <ddktl/protocol/platform/bus.h>
+#include <fbl/condition_variable.h>
+#include <fbl/mutex.h>
+#include <lib/inspect/cpp/inspect.h>
+#include <threads.h>
 #include <zircon/status.h>
 #include <zircon/types.h>
 
+#include "../../../../drivers/common/soliloquy_hal/metrics.h"
+
 namespace soliloquy {
 
 // BTI IDs
@@ -22,16 +28,48 @@ public:
 
   static zx_status_t Create(void *ctx, zx_device_t *parent);
 
-  void DdkRelease() { delete this; }
+  // Waits for bring-up to finish, so no step outlives the board.
+  void DdkRelease();
 
+  // Kicks off bring-up on a background thread and returns immediately.
   zx_status_t Start();
 
 private:
+  // Each step runs on its own thread as soon as every step in |deps| has
+  // completed, so independent devices are added (and begin their own init)
+  // in parallel.
+  enum Step : uint32_t {
+    kStepGpio,
+    kStepSdio,
+    kStepEth,
+    kStepCount,
+  };
+
+  struct StepInfo {
+    const char *name;
+    zx_status_t (Soliloquy::*init)();
+    uint32_t deps;
+    soliloquy_hal::Histogram *duration_us;
+  };
+
+  static const StepInfo kSteps[kStepCount];
+
+  int StartThread();
+  void RunStep(Step step);
+
   zx_status_t EthInit();
   zx_status_t GpioInit();
   zx_status_t SdioInit();
 
   ddk::PBusProtocolClient pbus_;
+  inspect::Inspector inspector_;
+
+  thrd_t start_thread_;
+  bool start_thread_started_ = false;
+  fbl::Mutex step_lock_;
+  fbl::ConditionVariable step_cv_;
+  uint32_t steps_done_ __TA_GUARDED(step_lock_) = 0;
+  uint32_t steps_failed_ __TA_GUARDED(step_lock_) = 0;
 };
 
 // TODO: Move these to a shared header
@@ -0,0 +1,156 @@
+#include "../src/soliloquy-dwmac.h"
+
+#include <lib/fake-bti/bti.h>
+#include <zxtest/zxtest.h>
+
+#include <vector>
+
+#include "../../../../drivers/common/soliloquy_hal/testing/fake_mmio_region.h"
+#include "src/devices/testing/mock-ddk/mock-device.h"
+
+namespace soliloquy_dwmac {
+namespace {
+
+using soliloquy_hal::testing::FakeMmioRegion;
+using soliloquy_hal::testing::MmioTiming;
+
+constexpr size_t kRegCount = 0x1200 / 4;
+
+class DwmacTest : public zxtest::Test {
+ protected:
+  void SetUp() override {
+    fake_root_ = MockDevice::FakeRootParent();
+    region_ = std::make_unique<FakeMmioRegion>(kRegCount, MmioTiming::Instant());
+    // The DMA reset completes at once.
+    region_->SetWriteHook(kDMA_MODE,
+                          [](uint32_t value, uint32_t written) { return written & ~kDMA_MODE_SWR; });
+    // 4KB FIFOs in each direction.
+    region_->set_value(kMAC_HW_FEATURE1, (5u << 6) | 5u);
+
+    zx::bti bti;
+    ASSERT_OK(fake_bti_create(bti.reset_and_get_address()));
+    dev_ = new SoliloquyDwmac(fake_root_.get(), region_->GetMmioBuffer(), std::move(bti));
+    ASSERT_OK(dev_->StartDmaForTest());
+  }
+
+  void TearDown() override { dev_->DdkRelease(); }
+
+  // Queues one frame, returning the status its completion reported.
+  zx_status_t QueueTx(uint32_t options = 0) {
+    uint8_t frame[64] = {};
+    ethernet_netbuf_t netbuf = {};
+    netbuf.data_buffer = frame;
+    netbuf.data_size = sizeof(frame);
+    zx_status_t result = ZX_ERR_INTERNAL;
+    dev_->EthernetImplQueueTx(
+        options, &netbuf,
+        [](void* cookie, zx_status_t status, ethernet_netbuf_t* netbuf) {
+          *static_cast<zx_status_t*>(cookie) = status;
+        },
+        &result);
+    return result;
+  }
+
+  // What the driver last handed the DMA, as a transmit ring index.
+  size_t TxTail() const {
+    uint32_t base = region_->value(kDMA_CH0_TXDESC_LIST_ADDR);
+    return (region_->value(kDMA_CH0_TXDESC_TAIL) - base) / sizeof(DmaDescriptor);
+  }
+
+  // Hands |count| transmit descriptors from |first| on back as if sent.
+  void CompleteTx(size_t first, size_t count) {
+    DmaDescriptor* ring = dev_->tx_ring_for_test();
+    for (size_t i = 0; i < count; i++) {
+      ring[(first + i) % kTxRingSize].des3 &= ~kDES3_OWN;
+    }
+  }
+
+  std::shared_ptr<MockDevice> fake_root_;
+  std::unique_ptr<FakeMmioRegion> region_;
+  SoliloquyDwmac* dev_ = nullptr;
+};
+
+TEST_F(DwmacTest, TxRingFillsAndWraps) {
+  // One slot always stays empty to tell a full ring from an empty one.
+  for (size_t i = 0; i < kTxRingSize - 1; i++) {
+    ASSERT_OK(QueueTx(ETHERNET_TX_OPT_MORE));
+  }
+  EXPECT_EQ(QueueTx(), ZX_ERR_NO_RESOURCES);
+  // A full ring kicks whatever was still waiting for a tail write.
+  EXPECT_EQ(TxTail(), kTxRingSize - 1);
+
+  // The DMA finishes the first eight; the ring wraps into their slots.
+  CompleteTx(0, 8);
+  for (size_t i = 0; i < 8; i++) {
+    ASSERT_OK(QueueTx());
+  }
+  EXPECT_EQ(QueueTx(), ZX_ERR_NO_RESOURCES);
+  EXPECT_EQ(TxTail(), 7u);
+
+  DmaDescriptor* ring = dev_->tx_ring_for_test();
+  EXPECT_TRUE(ring[kTxRingSize - 1].des3 & kDES3_OWN);
+  EXPECT_TRUE(ring[6].des3 & kDES3_OWN);
+  EXPECT_FALSE(ring[7].des3 & kDES3_OWN);
+}
+
+TEST_F(DwmacTest, TxReclaimStopsAtFirstOwnedDescriptor) {
+  for (size_t i = 0; i < kTxRingSize - 1; i++) {
+    ASSERT_OK(QueueTx(ETHERNET_TX_OPT_MORE));
+  }
+  // Completion out of order: slot 0 is still the DMA's, so nothing after it
+  // can be reused yet.
+  CompleteTx(1, 16);
+  EXPECT_EQ(QueueTx(), ZX_ERR_NO_RESOURCES);
+
+  CompleteTx(0, 1);
+  for (size_t i = 0; i < 17; i++) {
+    ASSERT_OK(QueueTx());
+  }
+  EXPECT_EQ(QueueTx(), ZX_ERR_NO_RESOURCES);
+}
+
+TEST_F(DwmacTest, TxTailWrittenOncePerBurst) {
+  uint64_t before = region_->writes(kDMA_CH0_TXDESC_TAIL);
+  for (size_t i = 0; i < 4; i++) {
+    ASSERT_OK(QueueTx(ETHERNET_TX_OPT_MORE));
+  }
+  EXPECT_EQ(region_->writes(kDMA_CH0_TXDESC_TAIL), before);
+  ASSERT_OK(QueueTx());
+  EXPECT_EQ(region_->writes(kDMA_CH0_TXDESC_TAIL), before + 1);
+  EXPECT_EQ(TxTail(), 5u);
+}
+
+TEST_F(DwmacTest, MulticastHashFilter) {
+  // Bins are the bit-reversed low byte of the Ethernet CRC-32.
+  const uint8_t macs[] = {
+      0x01, 0x00, 0x5e, 0x00, 0x00, 0x01,  // 224.0.0.1, bin 128
+      0x33, 0x33, 0x00, 0x00, 0x00, 0x01,  // ff02::1, bin 6
+      0x01, 0x00, 0x5e, 0x7f, 0xff, 0xfa,  // 239.255.255.250, bin 81
+  };
+  region_->set_value(kMAC_PACKET_FILTER, kMAC_PACKET_FILTER_PM);
+  ASSERT_OK(dev_->EthernetImplSetParam(ETHERNET_SETPARAM_MULTICAST_FILTER, 3, macs,
+                                       sizeof(macs)));
+
+  const uint32_t expected[8] = {1u << 6, 0, 1u << 17, 0, 1u << 0, 0, 0, 0};
+  for (uint32_t i = 0; i < 8; i++) {
+    EXPECT_EQ(region_->value(kMAC_HASH_TABLE0 + i * 4), expected[i], "hash register %u", i);
+  }
+  uint32_t filter = region_->value(kMAC_PACKET_FILTER);
+  EXPECT_TRUE(filter & kMAC_PACKET_FILTER_HMC);
+  EXPECT_FALSE(filter & kMAC_PACKET_FILTER_PM);
+}
+
+TEST_F(DwmacTest, MulticastFilterOverflowPassesAll) {
+  ASSERT_OK(dev_->EthernetImplSetParam(ETHERNET_SETPARAM_MULTICAST_FILTER,
+                                       ETHERNET_MULTICAST_FILTER_OVERFLOW, nullptr, 0));
+  EXPECT_TRUE(region_->value(kMAC_PACKET_FILTER) & kMAC_PACKET_FILTER_PM);
+}
+
+TEST_F(DwmacTest, MulticastFilterRejectsShortList) {
+  const uint8_t mac[ETH_MAC_SIZE] = {0x01, 0x00, 0x5e, 0x00, 0x00, 0x01};
+  EXPECT_EQ(dev_->EthernetImplSetParam(ETHERNET_SETPARAM_MULTICAST_FILTER, 2, mac, sizeof(mac)),
+            ZX_ERR_INVALID_ARGS);
+}
+
+}  // namespace
+}  // namespace soliloquy_dwmac
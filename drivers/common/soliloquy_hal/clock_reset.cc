@@ -1,10 +1,133 @@
 #include "clock_reset.h"
 
+#include <fbl/auto_lock.h>
 #include <lib/ddk/debug.h>
 #include <zircon/status.h>
 
+#include <iterator>
+
+#include "../../../boards/arm64/soliloquy/dts/sun55i-a527-ccu.h"
+#include "metrics.h"
+
 namespace soliloquy_hal {
 
+namespace {
+
+Counter clk_solve_hits("clk.solve_cache_hits");
+Counter clk_solve_misses("clk.solve_cache_misses");
+
+constexpr uint64_t kHoscHz = 24'000'000;
+constexpr uint32_t kParentHosc = UINT32_MAX;
+
+enum class ClockKind : uint8_t {
+  kFixed,   // Set up by the boot firmware and never changed.
+  kDivided, // Fixed post-divider of parents[0].
+  kPll,     // 24MHz * N / M1 / M0.
+  kModule,  // parents[mux] / 2^N / M / div.
+};
+
+struct ClockDesc {
+  uint32_t id;
+  ClockKind kind;
+  uint32_t reg;
+  uint64_t fixed_hz;
+  uint32_t parents[3];
+  uint8_t parent_count;
+  uint8_t div;
+  uint8_t m_width;
+  bool has_n;
+  uint64_t min_hz;
+  uint64_t max_hz;
+};
+
+// PLL control register: N multiplier in [15:8] (N+1), input divider M1 in
+// bit 1 and output divider M0 in bit 0, lock status in bit 28.
+constexpr uint32_t kPllEnable = 1u << 31;
+constexpr uint32_t kPllLockEnable = 1u << 29;
+constexpr uint32_t kPllLockBit = 28;
+constexpr uint32_t kPllNShift = 8;
+constexpr uint32_t kPllNMask = 0xFFu << kPllNShift;
+constexpr uint32_t kPllM1 = 1u << 1;
+constexpr uint32_t kPllM0 = 1u << 0;
+constexpr uint32_t kPllMinMult = 12;
+constexpr uint32_t kPllMaxMult = 256;
+constexpr uint64_t kPllVcoMinHz = 288'000'000;
+constexpr uint64_t kPllVcoMaxHz = 2'400'000'000;
+constexpr zx::duration kPllLockTimeout = zx::msec(1);
+
+// Module clock register: source mux in [26:24], 2^N pre-divider in [9:8]
+// and M divider in the low m_width bits (M+1).
+constexpr uint32_t kModMuxShift = 24;
+constexpr uint32_t kModMuxMask = 0x7u << kModMuxShift;
+constexpr uint32_t kModNShift = 8;
+constexpr uint32_t kModNMask = 0x3u << kModNShift;
+
+constexpr ClockDesc kClocks[] = {
+    {.id = CLK_PLL_PERIPH0_4X, .kind = ClockKind::kFixed,
+     .fixed_hz = 2'400'000'000},
+    {.id = CLK_PLL_PERIPH0_2X, .kind = ClockKind::kDivided,
+     .parents = {CLK_PLL_PERIPH0_4X}, .parent_count = 1, .div = 2},
+    {.id = CLK_PLL_PERIPH0, .kind = ClockKind::kDivided,
+     .parents = {CLK_PLL_PERIPH0_4X}, .parent_count = 1, .div = 4},
+    {.id = CLK_PLL_PERIPH1_4X, .kind = ClockKind::kFixed,
+     .fixed_hz = 2'400'000'000},
+    {.id = CLK_PLL_PERIPH1_2X, .kind = ClockKind::kDivided,
+     .parents = {CLK_PLL_PERIPH1_4X}, .parent_count = 1, .div = 2},
+    {.id = CLK_PLL_PERIPH1, .kind = ClockKind::kDivided,
+     .parents = {CLK_PLL_PERIPH1_4X}, .parent_count = 1, .div = 4},
+    {.id = CLK_PLL_GPU0, .kind = ClockKind::kPll, .reg = 0x030,
+     .min_hz = 288'000'000, .max_hz = 1'200'000'000},
+    {.id = CLK_PLL_VIDEO0_4X, .kind = ClockKind::kPll, .reg = 0x040,
+     .min_hz = 288'000'000, .max_hz = 2'400'000'000},
+    {.id = CLK_PLL_VIDEO0, .kind = ClockKind::kDivided,
+     .parents = {CLK_PLL_VIDEO0_4X}, .parent_count = 1, .div = 4},
+    {.id = CLK_DE, .kind = ClockKind::kModule, .reg = 0x600,
+     .parents = {CLK_PLL_PERIPH0_2X, CLK_PLL_VIDEO0_4X}, .parent_count = 2,
+     .div = 1, .m_width = 5, .max_hz = 600'000'000},
+    {.id = CLK_GPU0, .kind = ClockKind::kModule, .reg = 0x670,
+     .parents = {CLK_PLL_GPU0, CLK_PLL_PERIPH0_2X}, .parent_count = 2,
+     .div = 1, .m_width = 4, .max_hz = 800'000'000},
+    // SMHC module clocks feed an internal /2 in the controller.
+    {.id = CLK_MMC0, .kind = ClockKind::kModule, .reg = 0x830,
+     .parents = {kParentHosc, CLK_PLL_PERIPH0_2X, CLK_PLL_PERIPH1_2X},
+     .parent_count = 3, .div = 2, .m_width = 4, .has_n = true,
+     .max_hz = 150'000'000},
+    {.id = CLK_MMC1, .kind = ClockKind::kModule, .reg = 0x834,
+     .parents = {kParentHosc, CLK_PLL_PERIPH0_2X, CLK_PLL_PERIPH1_2X},
+     .parent_count = 3, .div = 2, .m_width = 4, .has_n = true,
+     .max_hz = 150'000'000},
+    {.id = CLK_MMC2, .kind = ClockKind::kModule, .reg = 0x838,
+     .parents = {kParentHosc, CLK_PLL_PERIPH0_2X, CLK_PLL_PERIPH1_2X},
+     .parent_count = 3, .div = 2, .m_width = 4, .has_n = true,
+     .max_hz = 200'000'000},
+    {.id = CLK_TCON_LCD0, .kind = ClockKind::kModule, .reg = 0xB60,
+     .parents = {CLK_PLL_VIDEO0_4X, CLK_PLL_VIDEO0, CLK_PLL_PERIPH0_2X},
+     .parent_count = 3, .div = 1, .m_width = 4, .has_n = true,
+     .max_hz = 600'000'000},
+};
+
+static_assert(std::size(kClocks) <= ClockResetHelper::kMaxClocks);
+
+constexpr size_t kNoClock = SIZE_MAX;
+
+size_t FindClock(uint32_t id) {
+  for (size_t i = 0; i < std::size(kClocks); i++) {
+    if (kClocks[i].id == id) {
+      return i;
+    }
+  }
+  return kNoClock;
+}
+
+uint32_t FieldMask(const ClockDesc &clk) {
+  if (clk.kind == ClockKind::kPll) {
+    return kPllNMask | kPllM1 | kPllM0;
+  }
+  return kModMuxMask | (clk.has_n ? kModNMask : 0) | ((1u << clk.m_width) - 1);
+}
+
+} // namespace
+
 zx_status_t ClockResetHelper::EnableClock(uint32_t clock_id) {
   if (!ccu_mmio_) {
     return ZX_ERR_BAD_STATE;
@@ -69,15 +192,185 @@ zx_status_t ClockResetHelper::DeassertReset(uint32_t reset_id) {
   return ZX_OK;
 }
 
+zx_status_t ClockResetHelper::RateLocked(size_t index, uint64_t *out_rate_hz) {
+  ClockState &state = clocks_[index];
+  if (state.rate_valid && state.rate_generation == generation_) {
+    *out_rate_hz = state.rate_hz;
+    return ZX_OK;
+  }
+
+  const ClockDesc &clk = kClocks[index];
+  uint64_t rate = 0;
+  switch (clk.kind) {
+  case ClockKind::kFixed:
+    rate = clk.fixed_hz;
+    break;
+  case ClockKind::kDivided: {
+    zx_status_t status = RateLocked(FindClock(clk.parents[0]), &rate);
+    if (status != ZX_OK) {
+      return status;
+    }
+    rate /= clk.div;
+    break;
+  }
+  case ClockKind::kPll: {
+    uint32_t val = mmio_.Read32(clk.reg);
+    if (val & kPllEnable) {
+      uint64_t mult = ((val & kPllNMask) >> kPllNShift) + 1;
+      uint64_t m1 = (val & kPllM1) ? 2 : 1;
+      uint64_t m0 = (val & kPllM0) ? 2 : 1;
+      rate = kHoscHz * mult / m1 / m0;
+    }
+    break;
+  }
+  case ClockKind::kModule: {
+    uint32_t val = mmio_.Read32(clk.reg);
+    uint32_t mux = (val & kModMuxMask) >> kModMuxShift;
+    if (mux >= clk.parent_count) {
+      return ZX_ERR_BAD_STATE;
+    }
+    uint64_t parent_rate = kHoscHz;
+    if (clk.parents[mux] != kParentHosc) {
+      zx_status_t status = RateLocked(FindClock(clk.parents[mux]), &parent_rate);
+      if (status != ZX_OK) {
+        return status;
+      }
+    }
+    uint32_t n = clk.has_n ? (val & kModNMask) >> kModNShift : 0;
+    uint32_t m = (val & ((1u << clk.m_width) - 1)) + 1;
+    rate = (parent_rate >> n) / m / clk.div;
+    break;
+  }
+  }
+
+  state.rate_hz = rate;
+  state.rate_generation = generation_;
+  state.rate_valid = true;
+  *out_rate_hz = rate;
+  return ZX_OK;
+}
+
+// Finds the register setting that gets closest to |rate_hz| from below.
+// PLLs search every multiplier/divider combination that keeps the VCO in
+// range; module clocks search every parent at its current rate. Results are
+// remembered per clock until a parent PLL changes.
+zx_status_t ClockResetHelper::SolveLocked(size_t index, uint64_t rate_hz,
+                                          Solution *out) {
+  ClockState &state = clocks_[index];
+  for (const Solution &sol : state.solutions) {
+    if (sol.valid && sol.generation == generation_ &&
+        sol.request_hz == rate_hz) {
+      clk_solve_hits.Add();
+      *out = sol;
+      return ZX_OK;
+    }
+  }
+  clk_solve_misses.Add();
+
+  const ClockDesc &clk = kClocks[index];
+  uint64_t limit = rate_hz < clk.max_hz ? rate_hz : clk.max_hz;
+  Solution best = {};
+
+  if (clk.kind == ClockKind::kPll) {
+    for (uint32_t m1 = 1; m1 <= 2; m1++) {
+      for (uint32_t m0 = 1; m0 <= 2; m0++) {
+        for (uint32_t mult = kPllMinMult; mult <= kPllMaxMult; mult++) {
+          uint64_t vco = kHoscHz * mult / m1;
+          if (vco < kPllVcoMinHz || vco > kPllVcoMaxHz) {
+            continue;
+          }
+          uint64_t rate = vco / m0;
+          if (rate > limit || rate < clk.min_hz || rate <= best.rate_hz) {
+            continue;
+          }
+          best.rate_hz = rate;
+          best.value = ((mult - 1) << kPllNShift) | (m1 == 2 ? kPllM1 : 0) |
+                       (m0 == 2 ? kPllM0 : 0);
+          best.valid = true;
+        }
+      }
+    }
+  } else if (clk.kind == ClockKind::kModule) {
+    for (uint32_t mux = 0; mux < clk.parent_count; mux++) {
+      uint64_t parent_rate = kHoscHz;
+      if (clk.parents[mux] != kParentHosc &&
+          RateLocked(FindClock(clk.parents[mux]), &parent_rate) != ZX_OK) {
+        continue;
+      }
+      for (uint32_t n = 0; n <= (clk.has_n ? 3u : 0u); n++) {
+        for (uint32_t m = 1; m <= (1u << clk.m_width); m++) {
+          uint64_t rate = (parent_rate >> n) / m / clk.div;
+          if (rate > limit) {
+            continue;
+          }
+          // Rates only fall as M grows, so the first fit is the best for
+          // this parent and N.
+          if (rate > best.rate_hz) {
+            best.rate_hz = rate;
+            best.value = (mux << kModMuxShift) | (n << kModNShift) | (m - 1);
+            best.valid = true;
+          }
+          break;
+        }
+      }
+    }
+  } else {
+    return ZX_ERR_NOT_SUPPORTED;
+  }
+
+  if (!best.valid) {
+    return ZX_ERR_OUT_OF_RANGE;
+  }
+
+  best.request_hz = rate_hz;
+  best.generation = generation_;
+  state.solutions[state.next_way] = best;
+  state.next_way = (state.next_way + 1) % kSolutionCacheWays;
+  *out = best;
+  return ZX_OK;
+}
+
 zx_status_t ClockResetHelper::SetClockRate(uint32_t clock_id,
                                            uint64_t rate_hz) {
   if (!ccu_mmio_) {
     return ZX_ERR_BAD_STATE;
   }
+  size_t index = FindClock(clock_id);
+  if (index == kNoClock) {
+    return ZX_ERR_NOT_SUPPORTED;
+  }
+
+  fbl::AutoLock lock(&lock_);
+  Solution sol;
+  zx_status_t status = SolveLocked(index, rate_hz, &sol);
+  if (status != ZX_OK) {
+    zxlogf(ERROR, "soliloquy_hal: No setting for clock %u at %lu Hz: %s",
+           clock_id, rate_hz, zx_status_get_string(status));
+    return status;
+  }
 
-  zxlogf(INFO, "soliloquy_hal: Setting clock %u rate to %lu Hz", clock_id,
-         rate_hz);
-  return ZX_ERR_NOT_SUPPORTED;
+  const ClockDesc &clk = kClocks[index];
+  if (clk.kind == ClockKind::kPll) {
+    mmio_.ModifyBits32(clk.reg, FieldMask(clk) | kPllEnable | kPllLockEnable,
+                       sol.value | kPllEnable | kPllLockEnable);
+    // Everything downstream of the PLL now has a different rate.
+    generation_++;
+    if (!mmio_.WaitForBit32(clk.reg, kPllLockBit, true, kPllLockTimeout)) {
+      zxlogf(ERROR, "soliloquy_hal: Clock %u PLL failed to lock", clock_id);
+      return ZX_ERR_TIMED_OUT;
+    }
+  } else {
+    mmio_.ModifyBits32(clk.reg, FieldMask(clk), sol.value);
+  }
+
+  ClockState &state = clocks_[index];
+  state.rate_hz = sol.rate_hz;
+  state.rate_generation = generation_;
+  state.rate_valid = true;
+
+  zxlogf(DEBUG, "soliloquy_hal: Clock %u set to %lu Hz (requested %lu)",
+         clock_id, sol.rate_hz, rate_hz);
+  return ZX_OK;
 }
 
 zx_status_t ClockResetHelper::GetClockRate(uint32_t clock_id,
@@ -85,9 +378,34 @@ zx_status_t ClockResetHelper::GetClockRate(uint32_t clock_id,
   if (!ccu_mmio_ || !out_rate_hz) {
     return ZX_ERR_INVALID_ARGS;
   }
+  size_t index = FindClock(clock_id);
+  if (index == kNoClock) {
+    return ZX_ERR_NOT_SUPPORTED;
+  }
+
+  fbl::AutoLock lock(&lock_);
+  return RateLocked(index, out_rate_hz);
+}
+
+zx_status_t ClockResetHelper::RoundClockRate(uint32_t clock_id,
+                                             uint64_t rate_hz,
+                                             uint64_t *out_rate_hz) {
+  if (!ccu_mmio_ || !out_rate_hz) {
+    return ZX_ERR_INVALID_ARGS;
+  }
+  size_t index = FindClock(clock_id);
+  if (index == kNoClock) {
+    return ZX_ERR_NOT_SUPPORTED;
+  }
 
-  *out_rate_hz = 0;
-  return ZX_ERR_NOT_SUPPORTED;
+  fbl::AutoLock lock(&lock_);
+  Solution sol;
+  zx_status_t status = SolveLocked(index, rate_hz, &sol);
+  if (status != ZX_OK) {
+    return status;
+  }
+  *out_rate_hz = sol.rate_hz;
+  return ZX_OK;
 }
 
 } // namespace soliloquy_hal
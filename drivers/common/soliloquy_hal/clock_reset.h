@@ -1,14 +1,21 @@
 #ifndef DRIVERS_COMMON_SOLILOQUY_HAL_CLOCK_RESET_H_
 #define DRIVERS_COMMON_SOLILOQUY_HAL_CLOCK_RESET_H_
 
+#include <fbl/mutex.h>
 #include <lib/mmio/mmio.h>
+#include <zircon/compiler.h>
 #include <zircon/types.h>
 
+#include "mmio.h"
+
 namespace soliloquy_hal {
 
+// Clock IDs for the rate functions are the CLK_* values from
+// boards/arm64/soliloquy/dts/sun55i-a527-ccu.h.
 class ClockResetHelper {
 public:
-  explicit ClockResetHelper(ddk::MmioBuffer *ccu_mmio) : ccu_mmio_(ccu_mmio) {}
+  explicit ClockResetHelper(ddk::MmioBuffer *ccu_mmio)
+      : ccu_mmio_(ccu_mmio), mmio_(ccu_mmio) {}
 
   zx_status_t EnableClock(uint32_t clock_id);
   zx_status_t DisableClock(uint32_t clock_id);
@@ -16,12 +23,54 @@ public:
   zx_status_t AssertReset(uint32_t reset_id);
   zx_status_t DeassertReset(uint32_t reset_id);
 
+  // Programs the fastest rate the clock can produce that does not exceed
+  // |rate_hz| (nor the clock's rated maximum). Module clocks keep their
+  // current parent rates; set a PLL first to move the whole subtree.
+  // Returns ZX_ERR_OUT_OF_RANGE if even the slowest setting is too fast.
   zx_status_t SetClockRate(uint32_t clock_id, uint64_t rate_hz);
   zx_status_t GetClockRate(uint32_t clock_id, uint64_t *out_rate_hz);
 
+  // Reports the rate SetClockRate(|clock_id|, |rate_hz|) would produce
+  // without touching the hardware.
+  zx_status_t RoundClockRate(uint32_t clock_id, uint64_t rate_hz,
+                             uint64_t *out_rate_hz);
+
+  // Solved settings are cached per clock, so repeated requests for the same
+  // few rates (bus speed modes, DVFS operating points) skip the search.
+  static constexpr size_t kSolutionCacheWays = 4;
+  static constexpr size_t kMaxClocks = 24;
+
 private:
+  struct Solution {
+    uint64_t request_hz;
+    uint64_t rate_hz;
+    uint32_t value; // Register field values, already shifted into place.
+    uint32_t generation;
+    bool valid;
+  };
+
+  struct ClockState {
+    Solution solutions[kSolutionCacheWays];
+    size_t next_way;
+    uint64_t rate_hz;
+    uint32_t rate_generation;
+    bool rate_valid;
+  };
+
+  zx_status_t SolveLocked(size_t index, uint64_t rate_hz, Solution *out)
+      __TA_REQUIRES(lock_);
+  zx_status_t RateLocked(size_t index, uint64_t *out_rate_hz)
+      __TA_REQUIRES(lock_);
+
   ddk::MmioBuffer *ccu_mmio_;
 
+  fbl::Mutex lock_;
+  MmioHelper mmio_ __TA_GUARDED(lock_);
+  ClockState clocks_[kMaxClocks] __TA_GUARDED(lock_) = {};
+  // Bumped whenever a PLL changes, which invalidates every cached rate and
+  // solution that was derived from the old parent rates.
+  uint32_t generation_ __TA_GUARDED(lock_) = 1;
+
   static constexpr uint32_t kClockGateReg = 0x0000;
   static constexpr uint32_t kResetReg = 0x0100;
   static constexpr uint32_t kClockConfigReg = 0x0200;
@@ -0,0 +1,202 @@
+#include "dvfs.h"
+
+#include <fbl/auto_lock.h>
+#include <lib/ddk/debug.h>
+#include <lib/zx/clock.h>
+#include <zircon/status.h>
+
+#include "metrics.h"
+
+namespace soliloquy_hal {
+
+namespace {
+
+Counter dvfs_transitions("dvfs.transitions");
+Counter dvfs_thermal_steps("dvfs.thermal_steps");
+
+} // namespace
+
+zx_status_t DvfsGovernor::AddDomain(const DvfsDomainConfig &config) {
+  if (!config.opp_hz || config.opp_count == 0 ||
+      !config.utilization.busy_time) {
+    return ZX_ERR_INVALID_ARGS;
+  }
+  for (size_t i = 1; i < config.opp_count; i++) {
+    if (config.opp_hz[i] <= config.opp_hz[i - 1]) {
+      return ZX_ERR_INVALID_ARGS;
+    }
+  }
+
+  fbl::AutoLock lock(&lock_);
+  if (started_) {
+    return ZX_ERR_BAD_STATE;
+  }
+  if (domain_count_ == kMaxDomains) {
+    return ZX_ERR_NO_RESOURCES;
+  }
+
+  size_t top = config.opp_count - 1;
+  zx_status_t status = clocks_->SetClockRate(config.clock_id, config.opp_hz[top]);
+  if (status != ZX_OK) {
+    zxlogf(ERROR, "soliloquy_hal: DVFS domain %s failed to start: %s",
+           config.name, zx_status_get_string(status));
+    return status;
+  }
+
+  Domain &d = domains_[domain_count_++];
+  d.config = config;
+  d.cur = top;
+  d.ceiling = top;
+  d.last_busy = config.utilization.busy_time(config.utilization.ctx);
+  last_sample_ = zx::clock::get_monotonic();
+  return ZX_OK;
+}
+
+void DvfsGovernor::SetTemperatureSource(TemperatureSource source) {
+  fbl::AutoLock lock(&lock_);
+  temperature_ = source;
+}
+
+zx_status_t DvfsGovernor::Start(zx::duration period) {
+  if (started_) {
+    return ZX_ERR_BAD_STATE;
+  }
+
+  {
+    fbl::AutoLock lock(&lock_);
+    stopping_ = false;
+    last_sample_ = zx::clock::get_monotonic();
+  }
+  period_ = period;
+
+  int rc = thrd_create_with_name(
+      &thread_,
+      [](void *arg) { return static_cast<DvfsGovernor *>(arg)->Thread(); },
+      this, "soliloquy-dvfs");
+  if (rc != thrd_success) {
+    zxlogf(ERROR, "soliloquy_hal: Failed to start DVFS thread");
+    return ZX_ERR_NO_RESOURCES;
+  }
+  started_ = true;
+  return ZX_OK;
+}
+
+void DvfsGovernor::Stop() {
+  if (!started_) {
+    return;
+  }
+
+  {
+    fbl::AutoLock lock(&lock_);
+    stopping_ = true;
+    cv_.Signal();
+  }
+  thrd_join(thread_, nullptr);
+  started_ = false;
+}
+
+int DvfsGovernor::Thread() {
+  while (true) {
+    {
+      fbl::AutoLock lock(&lock_);
+      if (!stopping_) {
+        cv_.Timedwait(&lock_, period_.get());
+      }
+      if (stopping_) {
+        return 0;
+      }
+    }
+    Sample();
+  }
+}
+
+size_t DvfsGovernor::NextOpp(const DvfsPolicy &policy, const uint64_t *opp_hz,
+                             size_t cur, size_t ceiling, uint32_t util_pct) {
+  size_t next;
+  if (util_pct >= policy.up_pct) {
+    next = ceiling;
+  } else {
+    // The slowest point that would bring utilization down to the target.
+    uint64_t needed = opp_hz[cur] * util_pct / policy.target_pct;
+    size_t want = 0;
+    while (want < ceiling && opp_hz[want] < needed) {
+      want++;
+    }
+    // Ramp up at once, but only ease down a step at a time so a bursty
+    // load does not bounce between the extremes.
+    if (want > cur) {
+      next = want;
+    } else if (want < cur) {
+      next = cur - 1;
+    } else {
+      next = cur;
+    }
+  }
+  return next < ceiling ? next : ceiling;
+}
+
+void DvfsGovernor::UpdateCeilingsLocked() {
+  if (!temperature_.read_mc) {
+    return;
+  }
+
+  int32_t temp_mc;
+  if (temperature_.read_mc(temperature_.ctx, &temp_mc) != ZX_OK) {
+    return;
+  }
+
+  bool hot = temp_mc >= policy_.trip_mc;
+  bool cool = temp_mc <= policy_.trip_mc - policy_.hysteresis_mc;
+  for (size_t i = 0; i < domain_count_; i++) {
+    Domain &d = domains_[i];
+    if (hot && d.ceiling > 0) {
+      d.ceiling--;
+      dvfs_thermal_steps.Add();
+    } else if (cool && d.ceiling + 1 < d.config.opp_count) {
+      d.ceiling++;
+    }
+  }
+}
+
+void DvfsGovernor::Sample() {
+  fbl::AutoLock lock(&lock_);
+
+  zx::time now = zx::clock::get_monotonic();
+  zx::duration elapsed = now - last_sample_;
+  last_sample_ = now;
+  if (elapsed <= zx::duration(0)) {
+    return;
+  }
+
+  UpdateCeilingsLocked();
+
+  for (size_t i = 0; i < domain_count_; i++) {
+    Domain &d = domains_[i];
+    zx::duration busy = d.config.utilization.busy_time(d.config.utilization.ctx);
+    zx::duration delta = busy - d.last_busy;
+    d.last_busy = busy;
+
+    int64_t util = delta.get() * 100 / elapsed.get();
+    util = util < 0 ? 0 : (util > 100 ? 100 : util);
+
+    size_t next = NextOpp(policy_, d.config.opp_hz, d.cur, d.ceiling,
+                          static_cast<uint32_t>(util));
+    if (next == d.cur) {
+      continue;
+    }
+
+    zx_status_t status =
+        clocks_->SetClockRate(d.config.clock_id, d.config.opp_hz[next]);
+    if (status != ZX_OK) {
+      zxlogf(WARNING, "soliloquy_hal: DVFS %s transition failed: %s",
+             d.config.name, zx_status_get_string(status));
+      continue;
+    }
+    zxlogf(DEBUG, "soliloquy_hal: DVFS %s %lu -> %lu Hz (util %ld%%)",
+           d.config.name, d.config.opp_hz[d.cur], d.config.opp_hz[next], util);
+    d.cur = next;
+    dvfs_transitions.Add();
+  }
+}
+
+} // namespace soliloquy_hal
@@ -0,0 +1,116 @@
+#ifndef DRIVERS_COMMON_SOLILOQUY_HAL_DVFS_H_
+#define DRIVERS_COMMON_SOLILOQUY_HAL_DVFS_H_
+
+#include <fbl/condition_variable.h>
+#include <fbl/mutex.h>
+#include <lib/zx/time.h>
+#include <threads.h>
+#include <zircon/compiler.h>
+#include <zircon/types.h>
+
+#include "clock_reset.h"
+
+namespace soliloquy_hal {
+
+// Reports the cumulative time a block has been busy, e.g.
+// SdioHelper::busy_time() or the GPU job manager's active time. Only the
+// difference between samples matters.
+struct UtilizationSource {
+  zx::duration (*busy_time)(void *ctx);
+  void *ctx;
+};
+
+// Reads the SoC temperature in millidegrees Celsius.
+struct TemperatureSource {
+  zx_status_t (*read_mc)(void *ctx, int32_t *out_mc);
+  void *ctx;
+};
+
+struct DvfsDomainConfig {
+  const char *name;
+  // CLK_* ID passed to ClockResetHelper::SetClockRate.
+  uint32_t clock_id;
+  // Operating points in ascending order.
+  const uint64_t *opp_hz;
+  size_t opp_count;
+  UtilizationSource utilization;
+};
+
+struct DvfsPolicy {
+  // At or above this utilization the domain jumps straight to its ceiling.
+  uint32_t up_pct = 85;
+  // Below it, the domain steps down to the slowest point that would keep
+  // utilization under this target, at most one point per sample.
+  uint32_t target_pct = 70;
+  // The ceiling drops one point per sample while the SoC is at or above
+  // |trip_mc| and recovers one point per sample once it is |hysteresis_mc|
+  // below that.
+  int32_t trip_mc = 85000;
+  int32_t hysteresis_mc = 5000;
+};
+
+// Load-driven clock governor. Every period it samples each domain's busy
+// time, picks an operating point and programs it through ClockResetHelper.
+// A soft thermal ceiling backs the whole governor off a step at a time
+// before the SoC reaches its hardware throttling point, which keeps
+// sustained throughput higher than running flat out and being throttled.
+class DvfsGovernor {
+public:
+  explicit DvfsGovernor(ClockResetHelper *clocks,
+                        DvfsPolicy policy = DvfsPolicy())
+      : clocks_(clocks), policy_(policy) {}
+  ~DvfsGovernor() { Stop(); }
+
+  DvfsGovernor(const DvfsGovernor &) = delete;
+  DvfsGovernor &operator=(const DvfsGovernor &) = delete;
+
+  // Domains start at their highest operating point. Must be called before
+  // Start().
+  zx_status_t AddDomain(const DvfsDomainConfig &config);
+  void SetTemperatureSource(TemperatureSource source);
+
+  zx_status_t Start(zx::duration period = kDefaultPeriod);
+  void Stop();
+
+  // Runs one governor step over the interval since the previous one. Start()
+  // calls this from its thread; it is public so it can be driven by hand.
+  void Sample();
+
+  // Picks the next operating point for a domain at |cur| with |util_pct|
+  // utilization, never above |ceiling|.
+  static size_t NextOpp(const DvfsPolicy &policy, const uint64_t *opp_hz,
+                        size_t cur, size_t ceiling, uint32_t util_pct);
+
+  static constexpr size_t kMaxDomains = 4;
+  static constexpr zx::duration kDefaultPeriod = zx::msec(50);
+
+private:
+  struct Domain {
+    DvfsDomainConfig config;
+    size_t cur;
+    size_t ceiling;
+    zx::duration last_busy;
+  };
+
+  int Thread();
+  void UpdateCeilingsLocked() __TA_REQUIRES(lock_);
+
+  ClockResetHelper *clocks_;
+  const DvfsPolicy policy_;
+
+  fbl::Mutex lock_;
+  fbl::ConditionVariable cv_;
+  Domain domains_[kMaxDomains] __TA_GUARDED(lock_);
+  size_t domain_count_ __TA_GUARDED(lock_) = 0;
+  TemperatureSource temperature_ __TA_GUARDED(lock_) = {};
+  zx::time last_sample_ __TA_GUARDED(lock_);
+  bool stopping_ __TA_GUARDED(lock_) = false;
+
+  zx::duration period_;
+  thrd_t thread_;
+  bool started_ = false;
+};
+
+} // namespace soliloquy_hal
+
+#endif // DRIVERS_COMMON_SOLILOQUY_HAL_DVFS_H_
@@ -1,30 +1,256 @@
 #include "firmware.h"
 
+#include <fbl/alloc_checker.h>
+#include <fbl/auto_lock.h>
+#include <fbl/condition_variable.h>
+#include <fbl/mutex.h>
 #include <lib/ddk/debug.h>
 #include <lib/ddk/device.h>
+#include <string.h>
+#include <threads.h>
 #include <zircon/status.h>
 
+#include <memory>
+
+#include "metrics.h"
+
 namespace soliloquy_hal {
 
-zx_status_t FirmwareLoader::LoadFirmware(zx_device_t *parent, const char *name,
-                                         zx::vmo *out_vmo, size_t *out_size) {
-  if (!parent || !name || !out_vmo || !out_size) {
-    return ZX_ERR_INVALID_ARGS;
+namespace {
+
+Counter fw_cache_hits("firmware.cache_hits");
+Counter fw_cache_misses("firmware.cache_misses");
+
+enum class EntryState { kEmpty, kLoading, kReady };
+
+struct CacheEntry {
+  EntryState state = EntryState::kEmpty;
+  char name[FirmwareLoader::kMaxNameLen];
+  zx::vmo vmo;
+  size_t size = 0;
+  // Bumped on every use; the least recently used ready entry is evicted
+  // when the cache is full.
+  uint64_t last_use = 0;
+};
+
+struct FirmwareCache {
+  fbl::Mutex lock;
+  fbl::ConditionVariable loaded;
+  CacheEntry entries[FirmwareLoader::kMaxCachedImages] __TA_GUARDED(lock);
+  uint64_t use_clock __TA_GUARDED(lock) = 0;
+};
+
+FirmwareCache &Cache() {
+  static FirmwareCache cache;
+  return cache;
+}
+
+CacheEntry *FindLocked(FirmwareCache &cache, const char *name)
+    __TA_REQUIRES(cache.lock) {
+  for (auto &entry : cache.entries) {
+    if (entry.state != EntryState::kEmpty &&
+        strncmp(entry.name, name, sizeof(entry.name)) == 0) {
+      return &entry;
+    }
+  }
+  return nullptr;
+}
+
+// Claims a slot for |name| in the loading state, evicting the least recently
+// used ready image if needed. Returns null if every slot is mid-load.
+CacheEntry *ClaimLocked(FirmwareCache &cache, const char *name)
+    __TA_REQUIRES(cache.lock) {
+  CacheEntry *victim = nullptr;
+  for (auto &entry : cache.entries) {
+    if (entry.state == EntryState::kEmpty) {
+      victim = &entry;
+      break;
+    }
+    if (entry.state == EntryState::kReady &&
+        (!victim || entry.last_use < victim->last_use)) {
+      victim = &entry;
+    }
+  }
+  if (!victim) {
+    return nullptr;
+  }
+
+  victim->vmo.reset();
+  victim->size = 0;
+  victim->state = EntryState::kLoading;
+  strncpy(victim->name, name, sizeof(victim->name) - 1);
+  victim->name[sizeof(victim->name) - 1] = '\0';
+  return victim;
+}
+
+zx_status_t ShareLocked(FirmwareCache &cache, CacheEntry *entry,
+                        zx::vmo *out_vmo, size_t *out_size)
+    __TA_REQUIRES(cache.lock) {
+  zx_status_t status = entry->vmo.create_child(
+      ZX_VMO_CHILD_SNAPSHOT_AT_LEAST_ON_WRITE | ZX_VMO_CHILD_NO_WRITE, 0,
+      entry->size, out_vmo);
+  if (status != ZX_OK) {
+    zxlogf(ERROR, "soliloquy_hal: Failed to share firmware '%s': %s",
+           entry->name, zx_status_get_string(status));
+    return status;
   }
+  entry->last_use = ++cache.use_clock;
+  *out_size = entry->size;
+  return ZX_OK;
+}
 
+// Loads |name| into the slot claimed by the caller and wakes any waiters.
+zx_status_t FillEntry(zx_device_t *parent, const char *name) {
+  zx::vmo vmo;
+  size_t size = 0;
   zx_status_t status =
-      load_firmware(parent, name, out_vmo->reset_and_get_address(), out_size);
+      load_firmware(parent, name, vmo.reset_and_get_address(), &size);
+
+  FirmwareCache &cache = Cache();
+  fbl::AutoLock lock(&cache.lock);
+  CacheEntry *entry = FindLocked(cache, name);
+  if (entry && entry->state == EntryState::kLoading) {
+    if (status == ZX_OK) {
+      entry->vmo = std::move(vmo);
+      entry->size = size;
+      entry->state = EntryState::kReady;
+    } else {
+      entry->state = EntryState::kEmpty;
+    }
+  }
+  cache.loaded.Broadcast();
+
+  if (status == ZX_ERR_NOT_FOUND) {
+    // Callers probe for optional images, e.g. a compressed variant.
+    zxlogf(INFO, "soliloquy_hal: No firmware '%s'", name);
+    return status;
+  }
   if (status != ZX_OK) {
     zxlogf(ERROR, "soliloquy_hal: Failed to load firmware '%s': %s", name,
            zx_status_get_string(status));
     return status;
   }
+  zxlogf(INFO, "soliloquy_hal: Loaded firmware '%s' (%zu bytes)", name, size);
+  return ZX_OK;
+}
+
+struct PrefetchArgs {
+  zx_device_t *parent;
+  char name[FirmwareLoader::kMaxNameLen];
+};
+
+} // namespace
+
+zx_status_t FirmwareLoader::LoadFirmware(zx_device_t *parent, const char *name,
+                                         zx::vmo *out_vmo, size_t *out_size) {
+  if (!parent || !name || !out_vmo || !out_size ||
+      strlen(name) >= kMaxNameLen) {
+    return ZX_ERR_INVALID_ARGS;
+  }
+
+  FirmwareCache &cache = Cache();
+  fbl::AutoLock lock(&cache.lock);
+  // Set once this call has loaded the entry itself, so that the pass which
+  // hands it out is not counted as a hit on top of the miss.
+  bool filled = false;
+  while (true) {
+    CacheEntry *entry = FindLocked(cache, name);
+    if (entry && entry->state == EntryState::kReady) {
+      if (!filled) {
+        fw_cache_hits.Add();
+      }
+      return ShareLocked(cache, entry, out_vmo, out_size);
+    }
+    if (entry && entry->state == EntryState::kLoading) {
+      cache.loaded.Wait(&cache.lock);
+      continue;
+    }
+
+    fw_cache_misses.Add();
+    if (!ClaimLocked(cache, name)) {
+      // Every slot is mid-load; fall back to an uncached load.
+      cache.lock.Release();
+      zx_status_t status =
+          load_firmware(parent, name, out_vmo->reset_and_get_address(),
+                        out_size);
+      cache.lock.Acquire();
+      return status;
+    }
+
+    cache.lock.Release();
+    zx_status_t status = FillEntry(parent, name);
+    cache.lock.Acquire();
+    if (status != ZX_OK) {
+      return status;
+    }
+    filled = true;
+    // Loop back round: the entry may have been evicted in the meantime, in
+    // which case the next pass loads it again.
+  }
+}
+
+zx_status_t FirmwareLoader::PrefetchFirmware(zx_device_t *parent,
+                                             const char *name) {
+  if (!parent || !name || strlen(name) >= kMaxNameLen) {
+    return ZX_ERR_INVALID_ARGS;
+  }
+
+  {
+    FirmwareCache &cache = Cache();
+    fbl::AutoLock lock(&cache.lock);
+    if (FindLocked(cache, name)) {
+      return ZX_OK;
+    }
+    if (!ClaimLocked(cache, name)) {
+      return ZX_ERR_NO_RESOURCES;
+    }
+  }
+
+  fbl::AllocChecker ac;
+  std::unique_ptr<PrefetchArgs> args(new (&ac) PrefetchArgs{parent, {}});
+  if (!ac.check()) {
+    EvictFirmware(name);
+    return ZX_ERR_NO_MEMORY;
+  }
+  strncpy(args->name, name, sizeof(args->name) - 1);
 
-  zxlogf(INFO, "soliloquy_hal: Loaded firmware '%s' (%zu bytes)", name,
-         *out_size);
+  thrd_t thread;
+  int rc = thrd_create_with_name(
+      &thread,
+      [](void *arg) {
+        std::unique_ptr<PrefetchArgs> args(static_cast<PrefetchArgs *>(arg));
+        FillEntry(args->parent, args->name);
+        return 0;
+      },
+      args.get(), "soliloquy-fw-prefetch");
+  if (rc != thrd_success) {
+    zxlogf(WARNING, "soliloquy_hal: No thread to prefetch '%s'", name);
+    EvictFirmware(name);
+    return ZX_ERR_NO_RESOURCES;
+  }
+  args.release();
+  thrd_detach(thread);
   return ZX_OK;
 }
 
+void FirmwareLoader::EvictFirmware(const char *name) {
+  if (!name) {
+    return;
+  }
+
+  FirmwareCache &cache = Cache();
+  fbl::AutoLock lock(&cache.lock);
+  CacheEntry *entry = FindLocked(cache, name);
+  if (!entry) {
+    return;
+  }
+  entry->vmo.reset();
+  entry->size = 0;
+  entry->state = EntryState::kEmpty;
+  // Waiters on an in-flight load retry on their own.
+  cache.loaded.Broadcast();
+}
+
 zx_status_t FirmwareLoader::MapFirmware(const zx::vmo &vmo, size_t size,
                                         uint8_t **out_data) {
   if (!out_data || size == 0) {
@@ -6,13 +6,29 @@
 
 namespace soliloquy_hal {
 
+// Firmware images are cached per driver host, keyed by name. Every caller
+// gets its own read-only child of the cached VMO, so a driver restart or a
+// resume re-uses the resident pages instead of going back to the package.
 class FirmwareLoader {
 public:
+  // Returns a read-only VMO holding |name|. If a prefetch of the same image
+  // is in flight, waits for it rather than starting a second load.
   static zx_status_t LoadFirmware(zx_device_t *parent, const char *name,
                                   zx::vmo *out_vmo, size_t *out_size);
 
+  // Starts loading |name| into the cache on a background thread and returns
+  // immediately. A failed prefetch is not cached; the next LoadFirmware()
+  // retries and reports the error.
+  static zx_status_t PrefetchFirmware(zx_device_t *parent, const char *name);
+
+  // Drops |name| from the cache. VMOs already handed out stay valid.
+  static void EvictFirmware(const char *name);
+
   static zx_status_t MapFirmware(const zx::vmo &vmo, size_t size,
                                  uint8_t **out_data);
+
+  static constexpr size_t kMaxCachedImages = 8;
+  static constexpr size_t kMaxNameLen = 64;
 };
 
 } // namespace soliloquy_hal
@@ -0,0 +1,324 @@
+#include "lz4_frame.h"
+
+#include <lib/ddk/debug.h>
+
+#include <cstring>
+
+namespace soliloquy_hal {
+
+namespace {
+
+constexpr uint32_t kPrime1 = 2654435761u;
+constexpr uint32_t kPrime2 = 2246822519u;
+constexpr uint32_t kPrime3 = 3266489917u;
+constexpr uint32_t kPrime4 = 668265263u;
+constexpr uint32_t kPrime5 = 374761393u;
+
+// Frame descriptor flag bits.
+constexpr uint8_t kFlgVersionMask = 0xC0;
+constexpr uint8_t kFlgVersion = 0x40;
+constexpr uint8_t kFlgBlockIndep = 1u << 5;
+constexpr uint8_t kFlgBlockChecksum = 1u << 4;
+constexpr uint8_t kFlgContentSize = 1u << 3;
+constexpr uint8_t kFlgContentChecksum = 1u << 2;
+constexpr uint8_t kFlgDictId = 1u << 0;
+
+// Set in a block size word when the block is stored uncompressed.
+constexpr uint32_t kBlockUncompressed = 1u << 31;
+
+constexpr size_t kMinMatch = 4;
+
+uint32_t Rotl(uint32_t v, int r) { return (v << r) | (v >> (32 - r)); }
+
+uint32_t Load32(const uint8_t *p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+uint32_t Round(uint32_t acc, uint32_t input) {
+  return Rotl(acc + input * kPrime2, 13) * kPrime1;
+}
+
+// Reads an LZ4 length extension: bytes of 255 continue, anything else ends.
+bool ReadLength(const uint8_t *&ip, const uint8_t *iend, size_t *len) {
+  uint8_t b;
+  do {
+    if (ip == iend) {
+      return false;
+    }
+    b = *ip++;
+    *len += b;
+  } while (b == 255);
+  return true;
+}
+
+} // namespace
+
+Xxh32::Xxh32(uint32_t seed) : seed_(seed) {
+  acc_[0] = seed + kPrime1 + kPrime2;
+  acc_[1] = seed + kPrime2;
+  acc_[2] = seed;
+  acc_[3] = seed - kPrime1;
+}
+
+void Xxh32::Update(const uint8_t *data, size_t len) {
+  if (len == 0) {
+    return;
+  }
+  total_len_ += len;
+  if (buf_len_ + len < sizeof(buf_)) {
+    memcpy(buf_ + buf_len_, data, len);
+    buf_len_ += len;
+    return;
+  }
+  if (buf_len_) {
+    size_t fill = sizeof(buf_) - buf_len_;
+    memcpy(buf_ + buf_len_, data, fill);
+    for (int i = 0; i < 4; i++) {
+      acc_[i] = Round(acc_[i], Load32(buf_ + i * 4));
+    }
+    data += fill;
+    len -= fill;
+    buf_len_ = 0;
+  }
+  while (len >= sizeof(buf_)) {
+    for (int i = 0; i < 4; i++) {
+      acc_[i] = Round(acc_[i], Load32(data + i * 4));
+    }
+    data += sizeof(buf_);
+    len -= sizeof(buf_);
+  }
+  memcpy(buf_, data, len);
+  buf_len_ = len;
+}
+
+uint32_t Xxh32::Digest() const {
+  uint32_t h;
+  if (total_len_ >= sizeof(buf_)) {
+    h = Rotl(acc_[0], 1) + Rotl(acc_[1], 7) + Rotl(acc_[2], 12) +
+        Rotl(acc_[3], 18);
+  } else {
+    h = seed_ + kPrime5;
+  }
+  h += static_cast<uint32_t>(total_len_);
+
+  const uint8_t *p = buf_;
+  size_t left = buf_len_;
+  while (left >= 4) {
+    h = Rotl(h + Load32(p) * kPrime3, 17) * kPrime4;
+    p += 4;
+    left -= 4;
+  }
+  while (left--) {
+    h = Rotl(h + *p++ * kPrime5, 11) * kPrime1;
+  }
+
+  h ^= h >> 15;
+  h *= kPrime2;
+  h ^= h >> 13;
+  h *= kPrime3;
+  h ^= h >> 16;
+  return h;
+}
+
+uint32_t Xxh32::Hash(const uint8_t *data, size_t len, uint32_t seed) {
+  Xxh32 hash(seed);
+  hash.Update(data, len);
+  return hash.Digest();
+}
+
+bool Lz4FrameDecoder::IsLz4Frame(const uint8_t *data, size_t size) {
+  return data && size >= 4 && Load32(data) == kMagic;
+}
+
+zx_status_t Lz4FrameDecoder::Init(const uint8_t *data, size_t size) {
+  if (!data) {
+    return ZX_ERR_INVALID_ARGS;
+  }
+  // Magic, FLG, BD and the header checksum at minimum.
+  if (size < 7 || Load32(data) != kMagic) {
+    return ZX_ERR_NOT_SUPPORTED;
+  }
+
+  const uint8_t *desc = data + 4;
+  uint8_t flg = desc[0];
+  uint8_t bd = desc[1];
+  if ((flg & kFlgVersionMask) != kFlgVersion) {
+    return ZX_ERR_NOT_SUPPORTED;
+  }
+  if (!(flg & kFlgBlockIndep)) {
+    zxlogf(ERROR, "soliloquy_hal: LZ4 frame uses linked blocks");
+    return ZX_ERR_NOT_SUPPORTED;
+  }
+  if (flg & kFlgDictId) {
+    zxlogf(ERROR, "soliloquy_hal: LZ4 frame needs a dictionary");
+    return ZX_ERR_NOT_SUPPORTED;
+  }
+
+  // BD bits 6:4 select a 64KB, 256KB, 1MB or 4MB maximum block size.
+  uint32_t size_code = (bd >> 4) & 0x7;
+  if (size_code < 4) {
+    return ZX_ERR_IO_DATA_INTEGRITY;
+  }
+  block_max_ = size_t{1} << (2 * size_code + 8);
+
+  size_t desc_len = 2;
+  if (flg & kFlgContentSize) {
+    if (size < 4 + desc_len + 8 + 1) {
+      return ZX_ERR_IO_DATA_INTEGRITY;
+    }
+    content_size_ = 0;
+    for (int i = 7; i >= 0; i--) {
+      content_size_ = (content_size_ << 8) | desc[desc_len + i];
+    }
+    desc_len += 8;
+  }
+
+  if (size < 4 + desc_len + 1) {
+    return ZX_ERR_IO_DATA_INTEGRITY;
+  }
+  uint8_t hc = desc[desc_len];
+  if (((Xxh32::Hash(desc, desc_len) >> 8) & 0xFF) != hc) {
+    zxlogf(ERROR, "soliloquy_hal: LZ4 frame header checksum mismatch");
+    return ZX_ERR_IO_DATA_INTEGRITY;
+  }
+
+  block_checksums_ = flg & kFlgBlockChecksum;
+  content_checksum_ = flg & kFlgContentChecksum;
+  pos_ = desc + desc_len + 1;
+  end_ = data + size;
+  produced_ = 0;
+  done_ = false;
+  content_hash_ = Xxh32();
+  return ZX_OK;
+}
+
+zx_status_t Lz4FrameDecoder::NextBlock(uint8_t *out, size_t cap,
+                                       size_t *out_len) {
+  if (!pos_) {
+    return ZX_ERR_BAD_STATE;
+  }
+  if (done_) {
+    return ZX_ERR_STOP;
+  }
+  if (end_ - pos_ < 4) {
+    return ZX_ERR_IO_DATA_INTEGRITY;
+  }
+
+  uint32_t word = Load32(pos_);
+  pos_ += 4;
+
+  if (word == 0) {
+    // End mark, then the optional content checksum.
+    if (content_checksum_) {
+      if (end_ - pos_ < 4 || Load32(pos_) != content_hash_.Digest()) {
+        zxlogf(ERROR, "soliloquy_hal: LZ4 content checksum mismatch");
+        return ZX_ERR_IO_DATA_INTEGRITY;
+      }
+      pos_ += 4;
+    }
+    if (content_size_ && produced_ != content_size_) {
+      return ZX_ERR_IO_DATA_INTEGRITY;
+    }
+    done_ = true;
+    return ZX_ERR_STOP;
+  }
+
+  size_t len = word & ~kBlockUncompressed;
+  size_t trailer = block_checksums_ ? 4 : 0;
+  if (len > block_max_ || static_cast<size_t>(end_ - pos_) < len + trailer) {
+    return ZX_ERR_IO_DATA_INTEGRITY;
+  }
+  if (block_checksums_ && Xxh32::Hash(pos_, len) != Load32(pos_ + len)) {
+    zxlogf(ERROR, "soliloquy_hal: LZ4 block checksum mismatch");
+    return ZX_ERR_IO_DATA_INTEGRITY;
+  }
+
+  size_t decoded;
+  if (word & kBlockUncompressed) {
+    if (len > cap) {
+      return ZX_ERR_BUFFER_TOO_SMALL;
+    }
+    memcpy(out, pos_, len);
+    decoded = len;
+  } else {
+    zx_status_t status = DecodeBlock(pos_, len, out, cap, &decoded);
+    if (status != ZX_OK) {
+      return status;
+    }
+  }
+  pos_ += len + trailer;
+
+  if (content_checksum_) {
+    content_hash_.Update(out, decoded);
+  }
+  produced_ += decoded;
+  *out_len = decoded;
+  return ZX_OK;
+}
+
+zx_status_t Lz4FrameDecoder::DecodeBlock(const uint8_t *src, size_t src_len,
+                                         uint8_t *dst, size_t dst_cap,
+                                         size_t *out_len) {
+  const uint8_t *ip = src;
+  const uint8_t *iend = src + src_len;
+  uint8_t *op = dst;
+  uint8_t *oend = dst + dst_cap;
+
+  while (ip < iend) {
+    uint8_t token = *ip++;
+
+    size_t lit = token >> 4;
+    if (lit == 15 && !ReadLength(ip, iend, &lit)) {
+      return ZX_ERR_IO_DATA_INTEGRITY;
+    }
+    if (lit > static_cast<size_t>(iend - ip)) {
+      return ZX_ERR_IO_DATA_INTEGRITY;
+    }
+    if (lit > static_cast<size_t>(oend - op)) {
+      return ZX_ERR_BUFFER_TOO_SMALL;
+    }
+    memcpy(op, ip, lit);
+    ip += lit;
+    op += lit;
+
+    // The last sequence carries literals only.
+    if (ip == iend) {
+      break;
+    }
+
+    if (iend - ip < 2) {
+      return ZX_ERR_IO_DATA_INTEGRITY;
+    }
+    size_t offset = ip[0] | (ip[1] << 8);
+    ip += 2;
+    if (offset == 0 || offset > static_cast<size_t>(op - dst)) {
+      return ZX_ERR_IO_DATA_INTEGRITY;
+    }
+
+    size_t match = token & 0xF;
+    if (match == 15 && !ReadLength(ip, iend, &match)) {
+      return ZX_ERR_IO_DATA_INTEGRITY;
+    }
+    match += kMinMatch;
+    if (match > static_cast<size_t>(oend - op)) {
+      return ZX_ERR_BUFFER_TOO_SMALL;
+    }
+
+    // Matches may overlap their own output, so copy forwards bytewise
+    // unless the source is far enough back.
+    const uint8_t *from = op - offset;
+    if (offset >= match) {
+      memcpy(op, from, match);
+      op += match;
+    } else {
+      for (size_t i = 0; i < match; i++) {
+        *op++ = *from++;
+      }
+    }
+  }
+
+  *out_len = op - dst;
+  return ZX_OK;
+}
+
+} // namespace soliloquy_hal
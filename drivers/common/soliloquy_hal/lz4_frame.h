@@ -0,0 +1,78 @@
+#ifndef DRIVERS_COMMON_SOLILOQUY_HAL_LZ4_FRAME_H_
+#define DRIVERS_COMMON_SOLILOQUY_HAL_LZ4_FRAME_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <zircon/types.h>
+
+namespace soliloquy_hal {
+
+// Streaming xxHash32, as used by the LZ4 frame checksums.
+class Xxh32 {
+public:
+  explicit Xxh32(uint32_t seed = 0);
+
+  void Update(const uint8_t *data, size_t len);
+  uint32_t Digest() const;
+
+  static uint32_t Hash(const uint8_t *data, size_t len, uint32_t seed = 0);
+
+private:
+  uint32_t seed_;
+  uint32_t acc_[4];
+  uint8_t buf_[16];
+  size_t buf_len_ = 0;
+  uint64_t total_len_ = 0;
+};
+
+// Decodes an LZ4 frame (the `lz4` command-line format) one block at a time,
+// so a caller only ever holds a single decompressed block. Only frames with
+// independent blocks are accepted; linked blocks would need the previous
+// 64KB of output kept around. All header, block and content checksums
+// present in the frame are verified.
+class Lz4FrameDecoder {
+public:
+  // |data| must stay valid until decoding finishes.
+  zx_status_t Init(const uint8_t *data, size_t size);
+
+  // Largest block the frame may contain; NextBlock() output buffers must be
+  // at least this big.
+  size_t block_max_size() const { return block_max_; }
+  // Uncompressed size from the frame header, or 0 if it was not recorded.
+  uint64_t content_size() const { return content_size_; }
+
+  // Decodes the next block into |out|. Returns ZX_ERR_STOP after the last
+  // block once the content checksum (if any) has been checked, and
+  // ZX_ERR_IO_DATA_INTEGRITY for corrupt input.
+  zx_status_t NextBlock(uint8_t *out, size_t cap, size_t *out_len);
+
+  // FirmwareChunkSource::next adapter; |ctx| is the decoder.
+  static zx_status_t NextChunk(void *ctx, uint8_t *buf, size_t cap,
+                               size_t *out_len) {
+    return static_cast<Lz4FrameDecoder *>(ctx)->NextBlock(buf, cap, out_len);
+  }
+
+  static bool IsLz4Frame(const uint8_t *data, size_t size);
+
+  static constexpr uint32_t kMagic = 0x184D2204;
+
+  // Decodes one raw LZ4 block with no history.
+  static zx_status_t DecodeBlock(const uint8_t *src, size_t src_len,
+                                 uint8_t *dst, size_t dst_cap,
+                                 size_t *out_len);
+
+private:
+  const uint8_t *pos_ = nullptr;
+  const uint8_t *end_ = nullptr;
+  size_t block_max_ = 0;
+  uint64_t content_size_ = 0;
+  uint64_t produced_ = 0;
+  bool block_checksums_ = false;
+  bool content_checksum_ = false;
+  bool done_ = false;
+  Xxh32 content_hash_;
+};
+
+} // namespace soliloquy_hal
+
+#endif // DRIVERS_COMMON_SOLILOQUY_HAL_LZ4_FRAME_H_
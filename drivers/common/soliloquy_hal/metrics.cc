@@ -0,0 +1,86 @@
+#include "metrics.h"
+
+#include <lib/fpromise/promise.h>
+
+namespace soliloquy_hal {
+
+namespace {
+
+std::atomic<Counter *> counter_head{nullptr};
+std::atomic<Histogram *> histogram_head{nullptr};
+
+template <typename T>
+void Push(std::atomic<T *> *head, T *metric, T **next) {
+  T *old_head = head->load(std::memory_order_relaxed);
+  do {
+    *next = old_head;
+  } while (!head->compare_exchange_weak(old_head, metric,
+                                        std::memory_order_release,
+                                        std::memory_order_relaxed));
+}
+
+size_t BucketFor(uint64_t value) {
+  if (value == 0) {
+    return 0;
+  }
+  size_t bucket = 64 - __builtin_clzll(value);
+  return bucket < Histogram::kBuckets ? bucket : Histogram::kBuckets - 1;
+}
+
+} // namespace
+
+Counter::Counter(const char *name) : name_(name) {
+  Push(&counter_head, this, &next_);
+}
+
+Counter *Counter::Head() {
+  return counter_head.load(std::memory_order_acquire);
+}
+
+Histogram::Histogram(const char *name) : name_(name) {
+  Push(&histogram_head, this, &next_);
+}
+
+Histogram *Histogram::Head() {
+  return histogram_head.load(std::memory_order_acquire);
+}
+
+void Histogram::Record(uint64_t value) {
+  count_.fetch_add(1, std::memory_order_relaxed);
+  sum_.fetch_add(value, std::memory_order_relaxed);
+  buckets_[BucketFor(value)].fetch_add(1, std::memory_order_relaxed);
+
+  uint64_t cur = max_.load(std::memory_order_relaxed);
+  while (value > cur &&
+         !max_.compare_exchange_weak(cur, value, std::memory_order_relaxed)) {
+  }
+}
+
+void PublishMetrics(inspect::Inspector &inspector) {
+  inspector.GetRoot().RecordLazyNode("soliloquy_hal", [] {
+    inspect::Inspector snapshot;
+    inspect::Node &root = snapshot.GetRoot();
+
+    for (Counter *c = Counter::Head(); c; c = c->next()) {
+      root.RecordUint(c->name(), c->value());
+    }
+
+    for (Histogram *h = Histogram::Head(); h; h = h->next()) {
+      inspect::Node node = root.CreateChild(h->name());
+      node.RecordUint("count", h->count());
+      node.RecordUint("sum", h->sum());
+      node.RecordUint("max", h->max());
+      inspect::UintArray buckets =
+          node.CreateUintArray("log2_buckets", Histogram::kBuckets);
+      for (size_t i = 0; i < Histogram::kBuckets; i++) {
+        buckets.Set(i, h->bucket(i));
+      }
+      node.Record(std::move(buckets));
+      root.Record(std::move(node));
+    }
+
+    return fpromise::make_ok_promise(std::move(snapshot));
+  });
+}
+
+} // namespace soliloquy_hal
@@ -0,0 +1,97 @@
+#ifndef DRIVERS_COMMON_SOLILOQUY_HAL_METRICS_H_
+#define DRIVERS_COMMON_SOLILOQUY_HAL_METRICS_H_
+
+#include <lib/ddk/trace/event.h>
+#include <lib/inspect/cpp/inspect.h>
+#include <lib/zx/clock.h>
+#include <lib/zx/time.h>
+#include <zircon/types.h>
+
+#include <atomic>
+
+namespace soliloquy_hal {
+
+// Counters and histograms register themselves on construction in a
+// per-process list and are never unregistered, so they must have static
+// storage duration. Updates are relaxed atomics and safe from any thread.
+
+class Counter {
+public:
+  explicit Counter(const char *name);
+
+  void Add(uint64_t n = 1) { value_.fetch_add(n, std::memory_order_relaxed); }
+  uint64_t value() const { return value_.load(std::memory_order_relaxed); }
+  const char *name() const { return name_; }
+
+  static Counter *Head();
+  Counter *next() const { return next_; }
+
+private:
+  const char *name_;
+  std::atomic<uint64_t> value_{0};
+  Counter *next_ = nullptr;
+};
+
+// Log2-bucketed: bucket 0 holds zero, bucket i holds [2^(i-1), 2^i).
+class Histogram {
+public:
+  static constexpr size_t kBuckets = 33;
+
+  explicit Histogram(const char *name);
+
+  void Record(uint64_t value);
+
+  const char *name() const { return name_; }
+  uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+  uint64_t sum() const { return sum_.load(std::memory_order_relaxed); }
+  uint64_t max() const { return max_.load(std::memory_order_relaxed); }
+  uint64_t bucket(size_t i) const {
+    return buckets_[i].load(std::memory_order_relaxed);
+  }
+
+  static Histogram *Head();
+  Histogram *next() const { return next_; }
+
+private:
+  const char *name_;
+  std::atomic<uint64_t> count_{0};
+  std::atomic<uint64_t> sum_{0};
+  std::atomic<uint64_t> max_{0};
+  std::atomic<uint64_t> buckets_[kBuckets] = {};
+  Histogram *next_ = nullptr;
+};
+
+// Records the lifetime of the scope, in microseconds, into |histogram|.
+class ScopedTimer {
+public:
+  explicit ScopedTimer(Histogram *histogram)
+      : histogram_(histogram), start_(zx::clock::get_monotonic()) {}
+  ~ScopedTimer() { histogram_->Record(elapsed().to_usecs()); }
+
+  ScopedTimer(const ScopedTimer &) = delete;
+  ScopedTimer &operator=(const ScopedTimer &) = delete;
+
+  zx::duration elapsed() const { return zx::clock::get_monotonic() - start_; }
+
+private:
+  Histogram *histogram_;
+  zx::time start_;
+};
+
+// Adds a lazy "soliloquy_hal" node to |inspector| that snapshots every
+// metric registered in this process when inspect data is read.
+void PublishMetrics(inspect::Inspector &inspector);
+
+} // namespace soliloquy_hal
+
+#define SOLILOQUY_METRICS_CONCAT_(a, b) a##b
+#define SOLILOQUY_METRICS_CONCAT(a, b) SOLILOQUY_METRICS_CONCAT_(a, b)
+
+// Emits a trace duration named |name| (a string literal) and records the
+// scope's length into |histogram|.
+#define SOLILOQUY_TIMED_SCOPE(histogram, name)                                 \
+  TRACE_DURATION("soliloquy", name);                                           \
+  ::soliloquy_hal::ScopedTimer SOLILOQUY_METRICS_CONCAT(_soliloquy_timer_,     \
+                                                        __LINE__)(&(histogram))
+
+#endif // DRIVERS_COMMON_SOLILOQUY_HAL_METRICS_H_
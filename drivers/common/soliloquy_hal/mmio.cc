@@ -1,17 +1,154 @@
 #include "mmio.h"
 
+#include <fbl/alloc_checker.h>
 #include <lib/ddk/debug.h>
-#include <zircon/time.h>
+#include <lib/zx/clock.h>
+#include <lib/zx/time.h>
+
+#include "metrics.h"
 
 namespace soliloquy_hal {
 
-uint32_t MmioHelper::Read32(uint32_t offset) { return mmio_->Read32(offset); }
+namespace {
+
+Histogram mmio_wait_polls("mmio.wait_polls");
+Counter mmio_wait_timeouts("mmio.wait_timeouts");
+Counter mmio_shadow_hits("mmio.shadow_hits");
+
+const char *PolicyName(RegPolicy policy) {
+  switch (policy) {
+  case RegPolicy::kVolatile:
+    return "volatile";
+  case RegPolicy::kShadowed:
+    return "shadowed";
+  case RegPolicy::kWriteOnly:
+    return "write-only";
+  }
+  return "unknown";
+}
+
+} // namespace
+
+zx_status_t MmioHelper::SetRegPolicy(uint32_t offset, uint32_t size,
+                                     RegPolicy policy, uint32_t reset_value) {
+  if (size == 0 || (offset % sizeof(uint32_t)) != 0 ||
+      (size % sizeof(uint32_t)) != 0 || offset + size < offset) {
+    return ZX_ERR_INVALID_ARGS;
+  }
+  for (size_t i = 0; i < shadow_count_; i++) {
+    const ShadowRange &r = shadow_[i];
+    uint32_t r_end = r.base + r.count * sizeof(uint32_t);
+    if (offset < r_end && r.base < offset + size) {
+      return ZX_ERR_ALREADY_EXISTS;
+    }
+  }
+  if (shadow_count_ == kMaxShadowRanges) {
+    return ZX_ERR_NO_RESOURCES;
+  }
+
+  ShadowRange &range = shadow_[shadow_count_];
+  range.base = offset;
+  range.count = size / sizeof(uint32_t);
+  range.policy = policy;
+  range.reset_value = reset_value;
+  if (policy != RegPolicy::kVolatile) {
+    fbl::AllocChecker ac;
+    range.entries.reset(new (&ac) ShadowEntry[range.count]);
+    if (!ac.check()) {
+      range = ShadowRange();
+      return ZX_ERR_NO_MEMORY;
+    }
+    ResetRange(range);
+  }
+  shadow_count_++;
+  return ZX_OK;
+}
+
+void MmioHelper::ResetRange(ShadowRange &range) {
+  bool valid = range.policy == RegPolicy::kWriteOnly;
+  for (uint32_t i = 0; i < range.count; i++) {
+    range.entries[i] = {range.reset_value, valid};
+  }
+}
+
+void MmioHelper::InvalidateShadow() {
+  for (size_t i = 0; i < shadow_count_; i++) {
+    if (shadow_[i].entries) {
+      ResetRange(shadow_[i]);
+    }
+  }
+}
+
+void MmioHelper::DumpShadow() const {
+  for (size_t i = 0; i < shadow_count_; i++) {
+    const ShadowRange &r = shadow_[i];
+    zxlogf(INFO, "soliloquy_hal: Range 0x%x-0x%x %s", r.base,
+           r.base + r.count * static_cast<uint32_t>(sizeof(uint32_t)),
+           PolicyName(r.policy));
+    if (!r.entries) {
+      continue;
+    }
+    for (uint32_t j = 0; j < r.count; j++) {
+      if (r.entries[j].valid) {
+        zxlogf(INFO, "soliloquy_hal:   [0x%x] = 0x%08x",
+               r.base + j * static_cast<uint32_t>(sizeof(uint32_t)),
+               r.entries[j].value);
+      }
+    }
+  }
+}
+
+bool MmioHelper::GetShadow(uint32_t offset, uint32_t *out_value) const {
+  const ShadowEntry *entry = FindShadow(offset);
+  if (!entry || !entry->valid || !out_value) {
+    return false;
+  }
+  *out_value = entry->value;
+  return true;
+}
+
+// Returns the shadow slot for |offset|, or nullptr if it is volatile.
+MmioHelper::ShadowEntry *MmioHelper::FindShadow(uint32_t offset) {
+  for (size_t i = 0; i < shadow_count_; i++) {
+    ShadowRange &r = shadow_[i];
+    if (offset >= r.base && offset - r.base < r.count * sizeof(uint32_t)) {
+      if (!r.entries) {
+        return nullptr;
+      }
+      return &r.entries[(offset - r.base) / sizeof(uint32_t)];
+    }
+  }
+  return nullptr;
+}
+
+const MmioHelper::ShadowEntry *MmioHelper::FindShadow(uint32_t offset) const {
+  return const_cast<MmioHelper *>(this)->FindShadow(offset);
+}
+
+// Reads a register, served from the shadow when its policy allows.
+uint32_t MmioHelper::Read32(uint32_t offset) {
+  ShadowEntry *entry = FindShadow(offset);
+  if (!entry) {
+    return mmio_->Read32(offset);
+  }
+  if (!entry->valid) {
+    entry->value = mmio_->Read32(offset);
+    entry->valid = true;
+    return entry->value;
+  }
+  mmio_shadow_hits.Add();
+  return entry->value;
+}
 
 // Writes a 32-bit value to a memory-mapped hardware register.
 // Assumes: 32-bit aligned access, write-through semantics (no buffering
-// required).
+// required). The shadow, if any, is updated to match.
 void MmioHelper::Write32(uint32_t offset, uint32_t value) {
   mmio_->Write32(value, offset);
+  ShadowEntry *entry = FindShadow(offset);
+  if (entry) {
+    *entry = {value, true};
+  }
 }
 
 // Sets specific bits in a register using bitwise OR (read-modify-write).
@@ -60,32 +197,165 @@ void MmioHelper::WriteMasked32(uint32_t offset, uint32_t mask, uint32_t shift,
   Write32(offset, val);
 }
 
+// Merges into an existing op for |offset| in the current segment, so a later
+// op only overrides the bits it covers. Ops that end up covering the whole
+// register are applied as plain writes.
+RegisterProgram &RegisterProgram::Add(uint32_t offset, uint32_t mask,
+                                      uint32_t value) {
+  for (size_t i = segment_start_; i < count_; i++) {
+    Op &op = ops_[i];
+    if (op.offset == offset) {
+      op.value = (op.value & ~mask) | (value & mask);
+      op.mask |= mask;
+      return *this;
+    }
+  }
+
+  if (count_ == kMaxOps) {
+    overflowed_ = true;
+    return *this;
+  }
+  ops_[count_++] = {offset, mask, value & mask};
+  return *this;
+}
+
+zx_status_t MmioHelper::Apply(const RegisterProgram &program) {
+  if (program.overflowed()) {
+    zxlogf(ERROR, "soliloquy_hal: Register program exceeds %zu ops",
+           RegisterProgram::kMaxOps);
+    return ZX_ERR_NO_RESOURCES;
+  }
+
+  for (size_t i = 0; i < program.count_; i++) {
+    const RegisterProgram::Op &op = program.ops_[i];
+    if (op.mask == ~0u) {
+      Write32(op.offset, op.value);
+    } else if (op.mask != 0) {
+      uint32_t val = Read32(op.offset);
+      Write32(op.offset, (val & ~op.mask) | op.value);
+    }
+  }
+  return ZX_OK;
+}
+
 // Polls a register bit until it reaches the expected state or timeout expires.
-// Polling interval: 10 microseconds (hardware assumption: status updates at
-// ~1kHz or faster). Use case: Wait for hardware initialization, DMA completion,
-// or status flags. Returns: true if bit reached expected state, false on
-// timeout (warning logged). Hardware assumptions:
-// - Register reads are idempotent (no side effects from repeated reads)
-// - Status updates occur within microseconds to milliseconds
-// - 10µs polling granularity is sufficient for most hardware state machines
+// Use case: Wait for hardware initialization, DMA completion, or status flags.
+// Returns: true if bit reached expected state, false on timeout (warning
+// logged). See WaitForMask32 for the polling schedule.
 bool MmioHelper::WaitForBit32(uint32_t offset, uint32_t bit, bool set,
                               zx::duration timeout) {
-  zx_time_t deadline = zx_deadline_after(timeout.get());
+  uint32_t mask = 1u << bit;
+  return WaitForMask32(offset, mask, set ? mask : 0, timeout);
+}
 
-  while (zx_clock_get_monotonic() < deadline) {
-    uint32_t val = Read32(offset);
-    bool bit_set = (val & (1 << bit)) != 0;
+// Polls until the masked register equals |value|. Reads always go to the
+// device regardless of the register's shadow policy.
+// Most status bits settle within a few hundred nanoseconds, so the first
+// kWaitSpinPolls reads are issued back-to-back without yielding. After that
+// the sleep between reads doubles from kWaitMinBackoff to kWaitMaxBackoff,
+// which bounds the added latency to about 2x the actual completion time while
+// keeping slow (millisecond-scale) waits down to ~1k wakeups per second.
+// The register is read once more at the deadline so a long final sleep does
+// not report a completed operation as a timeout.
+// Hardware assumptions:
+// - Register reads are idempotent (no side effects from repeated reads)
+bool MmioHelper::WaitForMask32(uint32_t offset, uint32_t mask, uint32_t value,
+                               zx::duration timeout) {
+  zx::time deadline = zx::deadline_after(timeout);
+  zx::duration backoff = kWaitMinBackoff;
+  uint64_t polls = 0;
+  uint32_t val;
 
-    if (bit_set == set) {
+  for (;;) {
+    val = mmio_->Read32(offset);
+    polls++;
+    if ((val & mask) == value) {
+      mmio_wait_polls.Record(polls);
       return true;
     }
 
-    zx_nanosleep(zx_deadline_after(ZX_USEC(10)));
+    zx::time now = zx::clock::get_monotonic();
+    if (now >= deadline) {
+      break;
+    }
+    if (polls < kWaitSpinPolls) {
+      continue;
+    }
+
+    zx::time wake = now + backoff;
+    zx::nanosleep(wake < deadline ? wake : deadline);
+    if (backoff < kWaitMaxBackoff) {
+      backoff = backoff * 2 < kWaitMaxBackoff ? backoff * 2 : kWaitMaxBackoff;
+    }
   }
 
-  zxlogf(WARNING, "soliloquy_hal: Timeout waiting for bit %u at offset 0x%x",
-         bit, offset);
+  mmio_wait_polls.Record(polls);
+  mmio_wait_timeouts.Add();
+  zxlogf(WARNING,
+         "soliloquy_hal: Timeout waiting for 0x%x & 0x%08x == 0x%08x "
+         "(last 0x%08x)",
+         offset, mask, value, val);
   return false;
 }
 
+// Interrupt-driven variant of WaitForMask32.
+// The register is checked before blocking so an operation that already
+// completed (or whose interrupt fired before the caller got here) returns
+// without waiting. Packets are treated as hints only: a spurious or shared
+// interrupt just re-checks the register and waits again. The port belongs to
+// this wait, so a packet under another key is a caller bug; it is logged and
+// dropped.
+zx_status_t MmioHelper::WaitForMask32Irq(const zx::interrupt &irq,
+                                         const zx::port &port, uint64_t key,
+                                         uint32_t offset, uint32_t mask,
+                                         uint32_t value,
+                                         zx::duration timeout) {
+  zx::time deadline = zx::deadline_after(timeout);
+  uint64_t polls = 0;
+  uint32_t val;
+
+  for (;;) {
+    val = mmio_->Read32(offset);
+    polls++;
+    if ((val & mask) == value) {
+      mmio_wait_polls.Record(polls);
+      return ZX_OK;
+    }
+
+    zx_port_packet_t packet;
+    zx_status_t status = port.wait(deadline, &packet);
+    if (status == ZX_ERR_TIMED_OUT) {
+      // One last look in case the update raced the deadline.
+      val = mmio_->Read32(offset);
+      polls++;
+      if ((val & mask) == value) {
+        mmio_wait_polls.Record(polls);
+        return ZX_OK;
+      }
+      break;
+    }
+    if (status != ZX_OK) {
+      mmio_wait_polls.Record(polls);
+      zxlogf(ERROR, "soliloquy_hal: Port wait failed: %d", status);
+      return status;
+    }
+    if (packet.type == ZX_PKT_TYPE_INTERRUPT && packet.key == key) {
+      irq.ack();
+    } else {
+      zxlogf(WARNING,
+             "soliloquy_hal: Dropped packet (type %u, key %lu) on an IRQ "
+             "wait port",
+             packet.type, packet.key);
+    }
+  }
+
+  mmio_wait_polls.Record(polls);
+  mmio_wait_timeouts.Add();
+  zxlogf(WARNING,
+         "soliloquy_hal: Timeout waiting for IRQ with 0x%x & 0x%08x == 0x%08x "
+         "(last 0x%08x)",
+         offset, mask, value, val);
+  return ZX_ERR_TIMED_OUT;
+}
+
 } // namespace soliloquy_hal
@@ -2,14 +2,108 @@
 #define DRIVERS_COMMON_SOLILOQUY_HAL_MMIO_H_
 
 #include <lib/mmio/mmio.h>
+#include <lib/zx/interrupt.h>
+#include <lib/zx/port.h>
 #include <zircon/types.h>
 
+#include <memory>
+
 namespace soliloquy_hal {
 
+// A sequence of register read-modify-write operations that is coalesced per
+// register as it is built: however many ops touch a register, applying the
+// program costs at most one read and one write for it, and none of the reads
+// are needed for registers that end up fully overwritten.
+//
+// Within a segment, each register is written once, in the order it was first
+// touched. Barrier() starts a new segment for hardware that cares about the
+// ordering between writes to different registers. Programs are plain values
+// and can be built once and applied repeatedly (e.g. on every mode set).
+class RegisterProgram {
+public:
+  static constexpr size_t kMaxOps = 32;
+
+  RegisterProgram &Write32(uint32_t offset, uint32_t value) {
+    return Add(offset, ~0u, value);
+  }
+  RegisterProgram &SetBits32(uint32_t offset, uint32_t mask) {
+    return Add(offset, mask, mask);
+  }
+  RegisterProgram &ClearBits32(uint32_t offset, uint32_t mask) {
+    return Add(offset, mask, 0);
+  }
+  RegisterProgram &ModifyBits32(uint32_t offset, uint32_t mask,
+                                uint32_t value) {
+    return Add(offset, mask, value);
+  }
+  RegisterProgram &WriteMasked32(uint32_t offset, uint32_t mask,
+                                 uint32_t shift, uint32_t value) {
+    return Add(offset, mask, value << shift);
+  }
+  RegisterProgram &Barrier() {
+    segment_start_ = count_;
+    return *this;
+  }
+
+  void Clear() { *this = RegisterProgram(); }
+
+  // Number of coalesced register writes the program performs.
+  size_t size() const { return count_; }
+  // Set when more than kMaxOps distinct register writes were added.
+  bool overflowed() const { return overflowed_; }
+
+private:
+  friend class MmioHelper;
+
+  struct Op {
+    uint32_t offset;
+    uint32_t mask;
+    uint32_t value;
+  };
+
+  RegisterProgram &Add(uint32_t offset, uint32_t mask, uint32_t value);
+
+  Op ops_[kMaxOps] = {};
+  size_t count_ = 0;
+  size_t segment_start_ = 0;
+  bool overflowed_ = false;
+};
+
+// How MmioHelper treats reads of a register range.
+enum class RegPolicy {
+  // Every read goes to the device (status, FIFO and W1C registers).
+  kVolatile,
+  // The first read goes to the device; later reads and every RMW are served
+  // from the shadow, so an RMW costs a single write. Only valid for registers
+  // the hardware never changes on its own.
+  kShadowed,
+  // Never read from the device; reads return the last value written (or the
+  // reset value given to SetRegPolicy).
+  kWriteOnly,
+};
+
 class MmioHelper {
 public:
   explicit MmioHelper(ddk::MmioBuffer *mmio) : mmio_(mmio) {}
 
+  // Applies |policy| to the |size| bytes of registers starting at |offset|.
+  // Ranges must be 32-bit aligned and must not overlap an existing range.
+  // Registers outside every range are kVolatile. The shadow is not
+  // synchronized: callers serialize access as they already must for RMW.
+  zx_status_t SetRegPolicy(uint32_t offset, uint32_t size, RegPolicy policy,
+                           uint32_t reset_value = 0);
+
+  // Forgets cached kShadowed values (e.g. after a block reset) so the next
+  // read of each register goes to the device again. kWriteOnly registers
+  // revert to their reset value.
+  void InvalidateShadow();
+
+  // Logs every register that currently has a shadow value.
+  void DumpShadow() const;
+
+  // Returns the shadow value of |offset| without touching the device.
+  bool GetShadow(uint32_t offset, uint32_t *out_value) const;
+
   uint32_t Read32(uint32_t offset);
   void Write32(uint32_t offset, uint32_t value);
 
@@ -24,8 +118,55 @@ public:
   bool WaitForBit32(uint32_t offset, uint32_t bit, bool set,
                     zx::duration timeout);
 
+  // Waits until (reg[offset] & mask) == value. The register is re-read
+  // back-to-back kWaitSpinPolls times, then between reads of exponentially
+  // growing sleeps from kWaitMinBackoff up to kWaitMaxBackoff.
+  bool WaitForMask32(uint32_t offset, uint32_t mask, uint32_t value,
+                     zx::duration timeout);
+
+  // Like WaitForMask32, but sleeps on |irq| (bound to |port| under |key|)
+  // rather than polling, and confirms the register state after each packet.
+  // The interrupt is acked after each of its packets. Returns
+  // ZX_ERR_TIMED_OUT if the register does not match by |timeout|.
+  //
+  // |port| must be dedicated to this wait: any other packet on it is
+  // consumed and dropped. Interrupt and signal packets cannot be queued
+  // back as they were, so callers that multiplex a port need their own
+  // loop.
+  zx_status_t WaitForMask32Irq(const zx::interrupt &irq, const zx::port &port,
+                               uint64_t key, uint32_t offset, uint32_t mask,
+                               uint32_t value, zx::duration timeout);
+
+  // Applies |program| to the registers. Returns ZX_ERR_NO_RESOURCES without
+  // touching the hardware if the program overflowed while being built.
+  zx_status_t Apply(const RegisterProgram &program);
+
+  static constexpr uint32_t kWaitSpinPolls = 16;
+  static constexpr zx::duration kWaitMinBackoff = zx::usec(1);
+  static constexpr zx::duration kWaitMaxBackoff = zx::msec(1);
+  static constexpr size_t kMaxShadowRanges = 16;
+
 private:
+  struct ShadowEntry {
+    uint32_t value;
+    bool valid;
+  };
+
+  struct ShadowRange {
+    uint32_t base = 0;
+    uint32_t count = 0;
+    RegPolicy policy = RegPolicy::kVolatile;
+    uint32_t reset_value = 0;
+    std::unique_ptr<ShadowEntry[]> entries;
+  };
+
+  ShadowEntry *FindShadow(uint32_t offset);
+  const ShadowEntry *FindShadow(uint32_t offset) const;
+  void ResetRange(ShadowRange &range);
+
   ddk::MmioBuffer *mmio_;
+  ShadowRange shadow_[kMaxShadowRanges];
+  size_t shadow_count_ = 0;
 };
 
 } // namespace soliloquy_hal
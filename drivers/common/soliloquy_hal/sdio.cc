@@ -1,10 +1,184 @@
 #include "sdio.h"
 
+#include <fbl/auto_lock.h>
+#include <fbl/condition_variable.h>
+#include <fbl/mutex.h>
 #include <lib/ddk/debug.h>
+#include <lib/zx/vmar.h>
+#include <threads.h>
 #include <zircon/status.h>
 
+#include "metrics.h"
+
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
 namespace soliloquy_hal {
 
+namespace {
+
+Histogram sdio_txn_us("sdio.txn_us");
+Counter sdio_txn_bytes("sdio.txn_bytes");
+Counter sdio_txn_errors("sdio.txn_errors");
+Histogram fw_download_kbps("sdio.fw_download_kbps");
+
+void RecordDownload(size_t size, zx::duration elapsed) {
+  // bytes per microsecond * 1000000 / 1024 = KiB/s
+  uint64_t usecs = elapsed.to_usecs() > 0 ? elapsed.to_usecs() : 1;
+  uint64_t kbps = size * 1000000 / 1024 / usecs;
+  fw_download_kbps.Record(kbps);
+  zxlogf(INFO,
+         "soliloquy_hal: Firmware download complete (%zu bytes, %lu ms, "
+         "%lu.%02lu MB/s)",
+         size, elapsed.to_msecs(), kbps / 1024, (kbps % 1024) * 100 / 1024);
+}
+
+// Staging ring for DownloadFirmwareStream. Slots are filled in order by the
+// producer and drained in the same order by the bus side; |filled| and
+// |drained| count slots over the whole download.
+class StreamRing {
+public:
+  StreamRing(const FirmwareChunkSource &source, const zx::vmo &vmo,
+             uint8_t *base, size_t slot_size, size_t max_size)
+      : source_(source), vmo_(vmo), base_(base), slot_size_(slot_size),
+        max_size_(max_size) {}
+
+  // Produces one chunk into the next free slot, waiting for one to drain if
+  // the ring is full. Returns false once the source is finished or the
+  // download was abandoned.
+  bool ProduceOne() {
+    size_t slot;
+    {
+      fbl::AutoLock lock(&lock_);
+      while (filled_ - drained_ == SdioHelper::kStreamSlots && !aborted_ &&
+             !finished_) {
+        cv_.Wait(&lock_);
+      }
+      if (aborted_ || finished_) {
+        return false;
+      }
+      slot = filled_ % SdioHelper::kStreamSlots;
+    }
+
+    size_t len = 0;
+    zx_status_t status = source_.next(source_.ctx, base_ + slot * slot_size_,
+                                      slot_size_, &len);
+    if (status == ZX_OK) {
+      produced_ += len;
+      if (len > slot_size_) {
+        status = ZX_ERR_INTERNAL;
+      } else if (produced_ > max_size_) {
+        zxlogf(ERROR, "soliloquy_hal: Streamed firmware exceeds %zu bytes",
+               max_size_);
+        status = ZX_ERR_BUFFER_TOO_SMALL;
+      } else if (len > 0) {
+        // The CPU wrote this slot; push it out before the controller DMAs it.
+        status = vmo_.op_range(ZX_VMO_OP_CACHE_CLEAN, slot * slot_size_, len,
+                               nullptr, 0);
+      }
+    }
+
+    fbl::AutoLock lock(&lock_);
+    if (status == ZX_OK) {
+      if (len > 0) {
+        lens_[slot] = len;
+        filled_++;
+      }
+    } else {
+      finished_ = true;
+      producer_status_ = status == ZX_ERR_STOP ? ZX_OK : status;
+    }
+    cv_.Broadcast();
+    return status == ZX_OK;
+  }
+
+  // Waits for the oldest undrained slot. Returns false once every produced
+  // chunk has been drained and the producer is done.
+  bool WaitFilled(size_t *out_slot, size_t *out_len) {
+    fbl::AutoLock lock(&lock_);
+    while (filled_ == drained_ && !finished_) {
+      cv_.Wait(&lock_);
+    }
+    if (filled_ == drained_) {
+      return false;
+    }
+    *out_slot = drained_ % SdioHelper::kStreamSlots;
+    *out_len = lens_[*out_slot];
+    return true;
+  }
+
+  // Releases the slot returned by WaitFilled. On failure the producer is
+  // told to stop.
+  void Drain(bool ok) {
+    fbl::AutoLock lock(&lock_);
+    drained_++;
+    if (!ok) {
+      aborted_ = true;
+    }
+    cv_.Broadcast();
+  }
+
+  zx_status_t producer_status() {
+    fbl::AutoLock lock(&lock_);
+    return producer_status_;
+  }
+
+private:
+  const FirmwareChunkSource &source_;
+  const zx::vmo &vmo_;
+  uint8_t *const base_;
+  const size_t slot_size_;
+  const size_t max_size_;
+  // Only touched by the producer.
+  size_t produced_ = 0;
+
+  fbl::Mutex lock_;
+  fbl::ConditionVariable cv_;
+  size_t lens_[SdioHelper::kStreamSlots] __TA_GUARDED(lock_) = {};
+  size_t filled_ __TA_GUARDED(lock_) = 0;
+  size_t drained_ __TA_GUARDED(lock_) = 0;
+  bool finished_ __TA_GUARDED(lock_) = false;
+  bool aborted_ __TA_GUARDED(lock_) = false;
+  zx_status_t producer_status_ __TA_GUARDED(lock_) = ZX_OK;
+};
+
+// Returns the number of bytes to move straight from/to the caller's buffer:
+// as many whole blocks as one CMD53 can carry, or the final byte-mode tail.
+size_t DirectChunk(size_t left, size_t block_size, size_t max_blocks) {
+  if (left < block_size) {
+    return left;
+  }
+  size_t blocks = left / block_size;
+  if (blocks > max_blocks) {
+    blocks = max_blocks;
+  }
+  return blocks * block_size;
+}
+
+zx_status_t SegmentsLength(const SdioSegment *segs, size_t count,
+                           size_t *out_len) {
+  if (!segs || count == 0) {
+    return ZX_ERR_INVALID_ARGS;
+  }
+
+  size_t total = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (!segs[i].data && segs[i].len != 0) {
+      return ZX_ERR_INVALID_ARGS;
+    }
+    total += segs[i].len;
+  }
+  if (total == 0) {
+    return ZX_ERR_INVALID_ARGS;
+  }
+
+  *out_len = total;
+  return ZX_OK;
+}
+
+} // namespace
+
 zx_status_t SdioHelper::ReadByte(uint32_t addr, uint8_t *out_val) {
   if (!out_val) {
     return ZX_ERR_INVALID_ARGS;
@@ -16,54 +190,315 @@ zx_status_t SdioHelper::WriteByte(uint32_t addr, uint8_t val) {
   return sdio_->DoRwByte(true, addr, val, nullptr);
 }
 
-zx_status_t SdioHelper::ReadMultiBlock(uint32_t addr, uint8_t *buf,
-                                       size_t len) {
-  if (!buf || len == 0) {
+zx_status_t SdioHelper::Read32(uint32_t addr, uint32_t *out_val) {
+  return ReadRegs(addr, out_val, 1);
+}
+
+zx_status_t SdioHelper::Write32(uint32_t addr, uint32_t val) {
+  SdioReg reg = {addr, val};
+  return WriteRegs(&reg, 1);
+}
+
+zx_status_t SdioHelper::WriteRegs(const SdioReg *regs, size_t count) {
+  if (!regs || count == 0) {
     return ZX_ERR_INVALID_ARGS;
   }
 
-  size_t blocks = (len + kBlockSize - 1) / kBlockSize;
-  zx_status_t status = ZX_OK;
+  // A byte-mode CMD53 carries at most one block.
+  constexpr size_t kMaxRunRegs = kBlockSize / sizeof(uint32_t);
+  uint8_t buf[kBlockSize];
 
-  for (size_t i = 0; i < blocks; i++) {
-    size_t chunk_size = (i == blocks - 1) ? (len % kBlockSize) : kBlockSize;
-    if (chunk_size == 0)
-      chunk_size = kBlockSize;
+  size_t i = 0;
+  while (i < count) {
+    uint32_t start = regs[i].addr;
+    size_t run = 0;
+    while (i + run < count && run < kMaxRunRegs &&
+           regs[i + run].addr == start + run * sizeof(uint32_t)) {
+      uint32_t val = regs[i + run].value;
+      uint8_t *dst = buf + run * sizeof(uint32_t);
+      dst[0] = val & 0xFF;
+      dst[1] = (val >> 8) & 0xFF;
+      dst[2] = (val >> 16) & 0xFF;
+      dst[3] = (val >> 24) & 0xFF;
+      run++;
+    }
 
-    status = sdio_->DoRwTxn(addr + (i * kBlockSize), buf + (i * kBlockSize),
-                            chunk_size, false, false);
+    zx_status_t status =
+        DoTxn(start, buf, run * sizeof(uint32_t), true, true);
     if (status != ZX_OK) {
-      zxlogf(ERROR, "soliloquy_hal: SDIO read block %zu failed: %s", i,
-             zx_status_get_string(status));
       return status;
     }
+    i += run;
+  }
+
+  return ZX_OK;
+}
+
+zx_status_t SdioHelper::ReadRegs(uint32_t addr, uint32_t *out_vals,
+                                 size_t count) {
+  if (!out_vals || count == 0) {
+    return ZX_ERR_INVALID_ARGS;
+  }
+
+  constexpr size_t kMaxRunRegs = kBlockSize / sizeof(uint32_t);
+  uint8_t buf[kBlockSize];
+
+  for (size_t i = 0; i < count;) {
+    size_t run = std::min(count - i, kMaxRunRegs);
+    uint32_t start = addr + static_cast<uint32_t>(i * sizeof(uint32_t));
+    zx_status_t status =
+        DoTxn(start, buf, run * sizeof(uint32_t), false, true);
+    if (status != ZX_OK) {
+      return status;
+    }
+    for (size_t j = 0; j < run; j++) {
+      const uint8_t *src = buf + j * sizeof(uint32_t);
+      out_vals[i + j] = src[0] | (src[1] << 8) | (src[2] << 16) |
+                        (static_cast<uint32_t>(src[3]) << 24);
+    }
+    i += run;
   }
 
   return ZX_OK;
 }
 
+zx_status_t SdioHelper::ReadMultiBlock(uint32_t addr, uint8_t *buf,
+                                       size_t len) {
+  if (!buf || len == 0) {
+    return ZX_ERR_INVALID_ARGS;
+  }
+
+  SdioSegment seg = {buf, len};
+  return ReadScatter(addr, &seg, 1);
+}
+
 zx_status_t SdioHelper::WriteMultiBlock(uint32_t addr, const uint8_t *buf,
                                         size_t len) {
   if (!buf || len == 0) {
     return ZX_ERR_INVALID_ARGS;
   }
 
-  size_t blocks = (len + kBlockSize - 1) / kBlockSize;
-  zx_status_t status = ZX_OK;
+  SdioSegment seg = {const_cast<uint8_t *>(buf), len};
+  return WriteScatter(addr, &seg, 1);
+}
 
-  for (size_t i = 0; i < blocks; i++) {
-    size_t chunk_size = (i == blocks - 1) ? (len % kBlockSize) : kBlockSize;
-    if (chunk_size == 0)
-      chunk_size = kBlockSize;
+// Issues a single CMD53. The SDIO core sends block-multiple lengths in block
+// mode and anything shorter than a block in byte mode.
+zx_status_t SdioHelper::DoTxn(uint32_t addr, uint8_t *buf, size_t len,
+                              bool write, bool incr) {
+  zx_status_t status;
+  {
+    SOLILOQUY_TIMED_SCOPE(sdio_txn_us, "sdio_txn");
+    zx::time start = zx::clock::get_monotonic();
+    status = sdio_->DoRwTxn(addr, buf, len, write, incr);
+    busy_ns_.fetch_add((zx::clock::get_monotonic() - start).get(),
+                       std::memory_order_relaxed);
+  }
+  sdio_txn_bytes.Add(len);
+  if (status != ZX_OK) {
+    sdio_txn_errors.Add();
+    zxlogf(ERROR, "soliloquy_hal: SDIO %s of %zu bytes at 0x%x failed: %s",
+           write ? "write" : "read", len, addr,
+           zx_status_get_string(status));
+  }
+  return status;
+}
+
+// Same as DoTxn, but the controller DMAs from a region of a registered VMO
+// instead of a CPU buffer.
+zx_status_t SdioHelper::DoVmoTxn(uint32_t addr, uint32_t vmo_id,
+                                 uint64_t offset, uint64_t len, bool write) {
+  sdmmc_buffer_region_t region = {};
+  region.buffer.vmo_id = vmo_id;
+  region.type = SDMMC_BUFFER_TYPE_VMO_ID;
+  region.offset = offset;
+  region.size = len;
+
+  sdio_rw_txn_t txn = {};
+  txn.addr = addr;
+  txn.incr = false;
+  txn.write = write;
+  txn.buffers_list = &region;
+  txn.buffers_count = 1;
 
-    status = sdio_->DoRwTxn(addr + (i * kBlockSize),
-                            const_cast<uint8_t *>(buf + (i * kBlockSize)),
-                            chunk_size, true, false);
+  zx_status_t status;
+  {
+    SOLILOQUY_TIMED_SCOPE(sdio_txn_us, "sdio_vmo_txn");
+    zx::time start = zx::clock::get_monotonic();
+    status = sdio_->DoRwTxn(&txn);
+    busy_ns_.fetch_add((zx::clock::get_monotonic() - start).get(),
+                       std::memory_order_relaxed);
+  }
+  sdio_txn_bytes.Add(len);
+  if (status != ZX_OK) {
+    sdio_txn_errors.Add();
+    zxlogf(ERROR,
+           "soliloquy_hal: SDIO %s of %lu bytes at 0x%x (vmo %u+0x%lx) "
+           "failed: %s",
+           write ? "write" : "read", len, addr, vmo_id, offset,
+           zx_status_get_string(status));
+  }
+  return status;
+}
+
+// Reads a device range into a list of segments. Whole blocks land directly in
+// the segments; pieces that straddle a segment boundary are read a block at a
+// time into the bounce buffer and copied out.
+zx_status_t SdioHelper::ReadScatter(uint32_t addr, const SdioSegment *segs,
+                                    size_t count) {
+  size_t remaining = 0;
+  zx_status_t status = SegmentsLength(segs, count, &remaining);
+  if (status != ZX_OK) {
+    return status;
+  }
+
+  uint32_t cur = addr;
+  size_t avail = 0;
+  size_t pos = 0;
+
+  for (size_t i = 0; i < count; i++) {
+    uint8_t *p = segs[i].data;
+    size_t left = segs[i].len;
+
+    while (left > 0) {
+      if (avail == 0 && (left >= kBlockSize || left == remaining)) {
+        size_t n = DirectChunk(left, kBlockSize, kMaxBlocksPerTxn);
+        status = DoTxn(cur, p, n, false);
+        if (status != ZX_OK) {
+          return status;
+        }
+        cur += static_cast<uint32_t>(n);
+        p += n;
+        left -= n;
+        remaining -= n;
+        continue;
+      }
+
+      if (avail == 0) {
+        size_t n = remaining < kBlockSize ? remaining : kBlockSize;
+        status = DoTxn(cur, bounce_, n, false);
+        if (status != ZX_OK) {
+          return status;
+        }
+        cur += static_cast<uint32_t>(n);
+        avail = n;
+        pos = 0;
+      }
+
+      size_t n = avail < left ? avail : left;
+      memcpy(p, bounce_ + pos, n);
+      pos += n;
+      avail -= n;
+      p += n;
+      left -= n;
+      remaining -= n;
+    }
+  }
+
+  return ZX_OK;
+}
+
+// Writes a list of segments to a device range. Whole blocks go out directly
+// from the segments; pieces that straddle a segment boundary are packed into
+// the bounce buffer so the bus only ever sees full blocks plus one tail.
+zx_status_t SdioHelper::WriteScatter(uint32_t addr, const SdioSegment *segs,
+                                     size_t count) {
+  size_t remaining = 0;
+  zx_status_t status = SegmentsLength(segs, count, &remaining);
+  if (status != ZX_OK) {
+    return status;
+  }
+
+  uint32_t cur = addr;
+  size_t staged = 0;
+
+  for (size_t i = 0; i < count; i++) {
+    uint8_t *p = segs[i].data;
+    size_t left = segs[i].len;
+
+    while (left > 0) {
+      if (staged == 0 && (left >= kBlockSize || left == remaining)) {
+        size_t n = DirectChunk(left, kBlockSize, kMaxBlocksPerTxn);
+        status = DoTxn(cur, p, n, true);
+        if (status != ZX_OK) {
+          return status;
+        }
+        cur += static_cast<uint32_t>(n);
+        p += n;
+        left -= n;
+        remaining -= n;
+        continue;
+      }
+
+      size_t n = kBlockSize - staged;
+      if (n > left) {
+        n = left;
+      }
+      memcpy(bounce_ + staged, p, n);
+      staged += n;
+      p += n;
+      left -= n;
+      remaining -= n;
+
+      if (staged == kBlockSize || remaining == 0) {
+        status = DoTxn(cur, bounce_, staged, true);
+        if (status != ZX_OK) {
+          return status;
+        }
+        cur += static_cast<uint32_t>(staged);
+        staged = 0;
+      }
+    }
+  }
+
+  return ZX_OK;
+}
+
+zx_status_t SdioHelper::RegisterVmo(uint32_t vmo_id, zx::vmo vmo,
+                                    uint64_t offset, uint64_t size,
+                                    uint32_t rights) {
+  if (!vmo.is_valid() || size == 0) {
+    return ZX_ERR_INVALID_ARGS;
+  }
+
+  zx_status_t status =
+      sdio_->RegisterVmo(vmo_id, std::move(vmo), offset, size, rights);
+  if (status != ZX_OK) {
+    zxlogf(ERROR, "soliloquy_hal: Failed to register VMO %u (%lu bytes): %s",
+           vmo_id, size, zx_status_get_string(status));
+  }
+  return status;
+}
+
+zx_status_t SdioHelper::UnregisterVmo(uint32_t vmo_id) {
+  // The controller hands the VMO back; dropping it here releases the pin.
+  zx::vmo vmo;
+  zx_status_t status = sdio_->UnregisterVmo(vmo_id, &vmo);
+  if (status != ZX_OK) {
+    zxlogf(ERROR, "soliloquy_hal: Failed to unregister VMO %u: %s", vmo_id,
+           zx_status_get_string(status));
+  }
+  return status;
+}
+
+// Splits the region the same way as the pointer-based path: up to
+// kMaxBlocksPerTxn blocks per CMD53, with any sub-block tail in byte mode.
+zx_status_t SdioHelper::TransferVmo(uint32_t addr, uint32_t vmo_id,
+                                    uint64_t offset, uint64_t len,
+                                    bool write) {
+  if (len == 0) {
+    return ZX_ERR_INVALID_ARGS;
+  }
+
+  while (len > 0) {
+    size_t chunk = DirectChunk(len, kBlockSize, kMaxBlocksPerTxn);
+    zx_status_t status = DoVmoTxn(addr, vmo_id, offset, chunk, write);
     if (status != ZX_OK) {
-      zxlogf(ERROR, "soliloquy_hal: SDIO write block %zu failed: %s", i,
-             zx_status_get_string(status));
       return status;
     }
+    addr += static_cast<uint32_t>(chunk);
+    offset += chunk;
+    len -= chunk;
   }
 
   return ZX_OK;
@@ -79,19 +514,30 @@ zx_status_t SdioHelper::DownloadFirmware(const zx::vmo &fw_vmo, size_t size,
          "soliloquy_hal: Downloading firmware via SDIO (%zu bytes to 0x%x)",
          size, base_addr);
 
-  zx_vaddr_t mapped_addr;
-  zx_status_t status = zx_vmar_map(zx_vmar_root_self(), ZX_VM_PERM_READ, 0,
-                                   fw_vmo.get(), 0, size, &mapped_addr);
+  // Register a duplicate so the caller keeps its handle. The controller pins
+  // the image once and every chunk is DMA'd straight out of the VMO.
+  zx::vmo dma_vmo;
+  zx_status_t status = fw_vmo.duplicate(ZX_RIGHT_SAME_RIGHTS, &dma_vmo);
   if (status != ZX_OK) {
-    zxlogf(ERROR, "soliloquy_hal: Failed to map firmware VMO: %s",
+    zxlogf(ERROR, "soliloquy_hal: Failed to duplicate firmware VMO: %s",
            zx_status_get_string(status));
     return status;
   }
 
-  uint8_t *fw_data = reinterpret_cast<uint8_t *>(mapped_addr);
-  status = WriteMultiBlock(base_addr, fw_data, size);
+  status = RegisterVmo(kFirmwareVmoId, std::move(dma_vmo), 0, size,
+                       SDMMC_VMO_RIGHT_READ);
+  if (status != ZX_OK) {
+    return status;
+  }
 
-  zx_vmar_unmap(zx_vmar_root_self(), mapped_addr, size);
+  zx::time start = zx::clock::get_monotonic();
+  {
+    TRACE_DURATION("soliloquy", "fw_download", "bytes", size);
+    status = TransferVmo(base_addr, kFirmwareVmoId, 0, size, true);
+  }
+  zx::duration elapsed = zx::clock::get_monotonic() - start;
+
+  UnregisterVmo(kFirmwareVmoId);
 
   if (status != ZX_OK) {
     zxlogf(ERROR, "soliloquy_hal: Firmware download failed: %s",
@@ -99,7 +545,111 @@ zx_status_t SdioHelper::DownloadFirmware(const zx::vmo &fw_vmo, size_t size,
     return status;
   }
 
-  zxlogf(INFO, "soliloquy_hal: Firmware download complete");
+  RecordDownload(size, elapsed);
+  return ZX_OK;
+}
+
+zx_status_t SdioHelper::DownloadFirmwareStream(
+    const FirmwareChunkSource &source, uint32_t base_addr, size_t max_size,
+    size_t *out_size) {
+  if (!source.next || source.max_chunk == 0 ||
+      source.max_chunk > kMaxStreamChunk || !out_size) {
+    return ZX_ERR_INVALID_ARGS;
+  }
+
+  size_t slot_size = (source.max_chunk + ZX_PAGE_SIZE - 1) &
+                     ~static_cast<size_t>(ZX_PAGE_SIZE - 1);
+  size_t ring_size = slot_size * kStreamSlots;
+
+  zx::vmo vmo;
+  zx_status_t status = zx::vmo::create(ring_size, 0, &vmo);
+  if (status != ZX_OK) {
+    zxlogf(ERROR, "soliloquy_hal: Failed to create firmware staging VMO: %s",
+           zx_status_get_string(status));
+    return status;
+  }
+  zx_vaddr_t mapped;
+  status = zx::vmar::root_self()->map(ZX_VM_PERM_READ | ZX_VM_PERM_WRITE, 0,
+                                      vmo, 0, ring_size, &mapped);
+  if (status != ZX_OK) {
+    zxlogf(ERROR, "soliloquy_hal: Failed to map firmware staging VMO: %s",
+           zx_status_get_string(status));
+    return status;
+  }
+
+  zx::vmo dma_vmo;
+  status = vmo.duplicate(ZX_RIGHT_SAME_RIGHTS, &dma_vmo);
+  if (status == ZX_OK) {
+    status = RegisterVmo(kFirmwareStreamVmoId, std::move(dma_vmo), 0,
+                         ring_size, SDMMC_VMO_RIGHT_READ);
+  }
+  if (status != ZX_OK) {
+    zx::vmar::root_self()->unmap(mapped, ring_size);
+    return status;
+  }
+
+  zxlogf(INFO, "soliloquy_hal: Streaming firmware via SDIO to 0x%x",
+         base_addr);
+
+  StreamRing ring(source, vmo, reinterpret_cast<uint8_t *>(mapped),
+                  slot_size, max_size);
+  thrd_t producer;
+  bool threaded =
+      thrd_create_with_name(
+          &producer,
+          [](void *arg) {
+            auto *ring = static_cast<StreamRing *>(arg);
+            while (ring->ProduceOne()) {
+            }
+            return 0;
+          },
+          &ring, "soliloquy-fw-stream") == thrd_success;
+
+  zx::time start = zx::clock::get_monotonic();
+  uint32_t addr = base_addr;
+  size_t total = 0;
+  zx_status_t xfer_status = ZX_OK;
+  {
+    TRACE_DURATION("soliloquy", "fw_download_stream");
+    while (true) {
+      if (!threaded) {
+        // No producer thread, so decode and transfer take turns.
+        ring.ProduceOne();
+      }
+      size_t slot, len;
+      if (!ring.WaitFilled(&slot, &len)) {
+        break;
+      }
+      xfer_status = TransferVmo(addr, kFirmwareStreamVmoId, slot * slot_size,
+                                len, true);
+      ring.Drain(xfer_status == ZX_OK);
+      if (xfer_status != ZX_OK) {
+        break;
+      }
+      addr += static_cast<uint32_t>(len);
+      total += len;
+    }
+  }
+  zx::duration elapsed = zx::clock::get_monotonic() - start;
+
+  if (threaded) {
+    thrd_join(producer, nullptr);
+  }
+  UnregisterVmo(kFirmwareStreamVmoId);
+  zx::vmar::root_self()->unmap(mapped, ring_size);
+
+  status = xfer_status != ZX_OK ? xfer_status : ring.producer_status();
+  if (status == ZX_OK && total == 0) {
+    status = ZX_ERR_IO_DATA_INTEGRITY;
+  }
+  if (status != ZX_OK) {
+    zxlogf(ERROR, "soliloquy_hal: Streamed firmware download failed: %s",
+           zx_status_get_string(status));
+    return status;
+  }
+
+  *out_size = total;
+  RecordDownload(total, elapsed);
   return ZX_OK;
 }
 
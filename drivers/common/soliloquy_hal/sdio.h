@@ -6,8 +6,33 @@
 #include <lib/zx/vmo.h>
 #include <zircon/types.h>
 
+#include <atomic>
+
 namespace soliloquy_hal {
 
+// One piece of a scatter-gather transfer. Segments are laid out back-to-back
+// in device address space, starting at the address passed to the transfer.
+struct SdioSegment {
+  uint8_t *data;
+  size_t len;
+};
+
+// Produces a firmware image a chunk at a time, e.g. from a decompressor.
+struct FirmwareChunkSource {
+  // Writes the next chunk, at most |cap| bytes, to |buf|. Returns ZX_ERR_STOP
+  // once the image is complete.
+  zx_status_t (*next)(void *ctx, uint8_t *buf, size_t cap, size_t *out_len);
+  void *ctx;
+  // Largest chunk |next| will produce.
+  size_t max_chunk;
+};
+
+// One 32-bit register write for SdioHelper::WriteRegs.
+struct SdioReg {
+  uint32_t addr;
+  uint32_t value;
+};
+
 class SdioHelper {
 public:
   explicit SdioHelper(ddk::SdioProtocolClient *sdio) : sdio_(sdio) {}
@@ -15,15 +40,81 @@ public:
   zx_status_t ReadByte(uint32_t addr, uint8_t *out_val);
   zx_status_t WriteByte(uint32_t addr, uint8_t val);
 
+  // Little-endian 32-bit register access, one incrementing-address CMD53
+  // each instead of four CMD52s.
+  zx_status_t Read32(uint32_t addr, uint32_t *out_val);
+  zx_status_t Write32(uint32_t addr, uint32_t val);
+
+  // Writes |count| registers in order. Runs of consecutive addresses are
+  // merged into a single incrementing-address CMD53.
+  zx_status_t WriteRegs(const SdioReg *regs, size_t count);
+  // Reads |count| consecutive registers starting at |addr|, the counterpart
+  // of a merged WriteRegs run.
+  zx_status_t ReadRegs(uint32_t addr, uint32_t *out_vals, size_t count);
+
   zx_status_t ReadMultiBlock(uint32_t addr, uint8_t *buf, size_t len);
   zx_status_t WriteMultiBlock(uint32_t addr, const uint8_t *buf, size_t len);
 
+  zx_status_t ReadScatter(uint32_t addr, const SdioSegment *segs,
+                          size_t count);
+  zx_status_t WriteScatter(uint32_t addr, const SdioSegment *segs,
+                           size_t count);
+
+  // Hands |vmo| to the SDIO controller, which pins it against its BTI once
+  // so later TransferVmo calls DMA straight to/from its pages. |rights| is a
+  // mask of SDMMC_VMO_RIGHT_READ/WRITE from the device's point of view.
+  zx_status_t RegisterVmo(uint32_t vmo_id, zx::vmo vmo, uint64_t offset,
+                          uint64_t size, uint32_t rights);
+  zx_status_t UnregisterVmo(uint32_t vmo_id);
+
+  // Moves |len| bytes between device address |addr| and a registered VMO,
+  // starting |offset| bytes into the registered region. No CPU mapping or
+  // copy is involved.
+  zx_status_t TransferVmo(uint32_t addr, uint32_t vmo_id, uint64_t offset,
+                          uint64_t len, bool write);
+
   zx_status_t DownloadFirmware(const zx::vmo &fw_vmo, size_t size,
                                uint32_t base_addr);
 
+  // Downloads an image that |source| produces on the fly. Chunks are staged
+  // in a ring of kStreamSlots pinned buffers: a producer thread fills the
+  // next slot while the previous one is on the bus, and the whole image is
+  // never held in memory. Fails with ZX_ERR_BUFFER_TOO_SMALL once more than
+  // |max_size| bytes have been produced.
+  zx_status_t DownloadFirmwareStream(const FirmwareChunkSource &source,
+                                     uint32_t base_addr, size_t max_size,
+                                     size_t *out_size);
+
+  // Total time spent inside bus transactions since construction. Sampled by
+  // the DVFS governor as the bus utilization source.
+  zx::duration busy_time() const {
+    return zx::duration(busy_ns_.load(std::memory_order_relaxed));
+  }
+
+  // VMO IDs from this value up are used by the helper itself; drivers
+  // registering their own buffers should stay below it.
+  static constexpr uint32_t kReservedVmoIdBase = 0xFFFF0000;
+
+  static constexpr size_t kStreamSlots = 3;
+  static constexpr size_t kMaxStreamChunk = 256 * 1024;
+
 private:
-  ddk::SdioProtocolClient *sdio_;
+  zx_status_t DoTxn(uint32_t addr, uint8_t *buf, size_t len, bool write,
+                    bool incr = false);
+  zx_status_t DoVmoTxn(uint32_t addr, uint32_t vmo_id, uint64_t offset,
+                       uint64_t len, bool write);
+
+  static constexpr uint32_t kFirmwareVmoId = kReservedVmoIdBase;
+  static constexpr uint32_t kFirmwareStreamVmoId = kReservedVmoIdBase + 1;
+
   static constexpr size_t kBlockSize = 512;
+  // CMD53 carries the block count in a 9-bit field.
+  static constexpr size_t kMaxBlocksPerTxn = 511;
+
+  ddk::SdioProtocolClient *sdio_;
+  std::atomic<zx_duration_t> busy_ns_{0};
+  // Staging for sub-block pieces that straddle segment boundaries.
+  uint8_t bounce_[kBlockSize];
 };
 
 } // namespace soliloquy_hal
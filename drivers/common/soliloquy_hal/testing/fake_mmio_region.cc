@@ -0,0 +1,91 @@
+#include "fake_mmio_region.h"
+
+#include <lib/zx/clock.h>
+#include <zircon/assert.h>
+
+namespace soliloquy_hal {
+namespace testing {
+
+FakeMmioRegion::FakeMmioRegion(size_t reg_count, MmioTiming timing)
+    : reg_count_(reg_count), timing_(timing),
+      regs_(std::make_unique<Reg[]>(reg_count)),
+      fake_regs_(std::make_unique<ddk_fake::FakeMmioReg[]>(reg_count)) {
+  for (size_t i = 0; i < reg_count; i++) {
+    Reg *reg = &regs_[i];
+    fake_regs_[i].SetReadCallback([this, reg]() -> uint64_t {
+      reg->reads.fetch_add(1, std::memory_order_relaxed);
+      total_reads_.fetch_add(1, std::memory_order_relaxed);
+      Stall(timing_.read);
+      uint32_t value = reg->value.load(std::memory_order_relaxed);
+      return reg->read_hook ? reg->read_hook(value) : value;
+    });
+    fake_regs_[i].SetWriteCallback([this, reg](uint64_t written) {
+      reg->writes.fetch_add(1, std::memory_order_relaxed);
+      total_writes_.fetch_add(1, std::memory_order_relaxed);
+      Stall(timing_.write);
+      uint32_t value = static_cast<uint32_t>(written);
+      if (reg->write_hook) {
+        value = reg->write_hook(reg->value.load(std::memory_order_relaxed),
+                                value);
+      }
+      reg->value.store(value, std::memory_order_relaxed);
+    });
+  }
+  region_ = std::make_unique<ddk_fake::FakeMmioRegRegion>(
+      fake_regs_.get(), sizeof(uint32_t), reg_count);
+}
+
+FakeMmioRegion::Reg &FakeMmioRegion::At(uint32_t offset) const {
+  ZX_ASSERT(offset % sizeof(uint32_t) == 0);
+  ZX_ASSERT(offset / sizeof(uint32_t) < reg_count_);
+  return regs_[offset / sizeof(uint32_t)];
+}
+
+uint32_t FakeMmioRegion::value(uint32_t offset) const {
+  return At(offset).value.load(std::memory_order_relaxed);
+}
+
+void FakeMmioRegion::set_value(uint32_t offset, uint32_t value) {
+  At(offset).value.store(value, std::memory_order_relaxed);
+}
+
+// Hooks are installed before the region is handed to the code under test;
+// they are not synchronized against concurrent accesses.
+void FakeMmioRegion::SetReadHook(uint32_t offset, ReadHook hook) {
+  At(offset).read_hook = std::move(hook);
+}
+
+void FakeMmioRegion::SetWriteHook(uint32_t offset, WriteHook hook) {
+  At(offset).write_hook = std::move(hook);
+}
+
+uint64_t FakeMmioRegion::reads(uint32_t offset) const {
+  return At(offset).reads.load(std::memory_order_relaxed);
+}
+
+uint64_t FakeMmioRegion::writes(uint32_t offset) const {
+  return At(offset).writes.load(std::memory_order_relaxed);
+}
+
+void FakeMmioRegion::ResetStats() {
+  for (size_t i = 0; i < reg_count_; i++) {
+    regs_[i].reads.store(0, std::memory_order_relaxed);
+    regs_[i].writes.store(0, std::memory_order_relaxed);
+  }
+  total_reads_.store(0);
+  total_writes_.store(0);
+  bus_time_ns_.store(0);
+}
+
+void FakeMmioRegion::Stall(zx::duration cost) {
+  if (cost <= zx::duration(0)) {
+    return;
+  }
+  bus_time_ns_.fetch_add(cost.get(), std::memory_order_relaxed);
+  zx::time deadline = zx::clock::get_monotonic() + cost;
+  while (zx::clock::get_monotonic() < deadline) {
+  }
+}
+
+} // namespace testing
+} // namespace soliloquy_hal
@@ -0,0 +1,81 @@
+#ifndef DRIVERS_COMMON_SOLILOQUY_HAL_TESTING_FAKE_MMIO_REGION_H_
+#define DRIVERS_COMMON_SOLILOQUY_HAL_TESTING_FAKE_MMIO_REGION_H_
+
+#include <lib/fake-mmio-reg/fake-mmio-reg.h>
+#include <lib/fit/function.h>
+#include <lib/mmio/mmio.h>
+#include <lib/zx/time.h>
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+namespace soliloquy_hal {
+namespace testing {
+
+// Per-access cost of the modeled interconnect. Device reads stall the CPU
+// for a round trip; writes are posted.
+struct MmioTiming {
+  zx::duration read = zx::nsec(150);
+  zx::duration write = zx::nsec(30);
+
+  static MmioTiming Instant() { return {zx::duration(0), zx::duration(0)}; }
+};
+
+// A bank of 32-bit registers behind a ddk::MmioBuffer, built on
+// ddk_fake::FakeMmioRegRegion. Registers hold what was last written unless
+// a hook says otherwise, every access is counted per register, and each one
+// spins for its modeled latency, so code on top of MmioHelper can be
+// benchmarked for the accesses it saves as well as tested.
+class FakeMmioRegion {
+public:
+  using ReadHook = fit::function<uint32_t(uint32_t value)>;
+  // Returns what the register holds after |written| lands on |value|, so
+  // write-1-to-clear and read-only bits can be modeled.
+  using WriteHook = fit::function<uint32_t(uint32_t value, uint32_t written)>;
+
+  FakeMmioRegion(size_t reg_count, MmioTiming timing = {});
+
+  ddk::MmioBuffer GetMmioBuffer() { return region_->GetMmioBuffer(); }
+
+  size_t reg_count() const { return reg_count_; }
+  uint32_t value(uint32_t offset) const;
+  void set_value(uint32_t offset, uint32_t value);
+
+  void SetReadHook(uint32_t offset, ReadHook hook);
+  void SetWriteHook(uint32_t offset, WriteHook hook);
+
+  uint64_t reads(uint32_t offset) const;
+  uint64_t writes(uint32_t offset) const;
+  uint64_t total_reads() const { return total_reads_.load(); }
+  uint64_t total_writes() const { return total_writes_.load(); }
+  // Sum of the modeled latency of every access.
+  zx::duration bus_time() const { return zx::nsec(bus_time_ns_.load()); }
+  void ResetStats();
+
+private:
+  struct Reg {
+    std::atomic<uint32_t> value{0};
+    std::atomic<uint64_t> reads{0};
+    std::atomic<uint64_t> writes{0};
+    ReadHook read_hook;
+    WriteHook write_hook;
+  };
+
+  Reg &At(uint32_t offset) const;
+  void Stall(zx::duration cost);
+
+  const size_t reg_count_;
+  const MmioTiming timing_;
+  std::unique_ptr<Reg[]> regs_;
+  std::unique_ptr<ddk_fake::FakeMmioReg[]> fake_regs_;
+  std::unique_ptr<ddk_fake::FakeMmioRegRegion> region_;
+  std::atomic<uint64_t> total_reads_{0};
+  std::atomic<uint64_t> total_writes_{0};
+  std::atomic<int64_t> bus_time_ns_{0};
+};
+
+} // namespace testing
+} // namespace soliloquy_hal
+
+#endif // DRIVERS_COMMON_SOLILOQUY_HAL_TESTING_FAKE_MMIO_REGION_H_
@@ -0,0 +1,409 @@
+#include "fake_sdio_bus.h"
+
+#include <lib/zx/clock.h>
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+namespace soliloquy_hal {
+namespace testing {
+
+zx_status_t SdioDevice::Read(uint32_t addr, uint8_t *buf, size_t len,
+                             bool incr) {
+  for (size_t i = 0; i < len; i++) {
+    zx_status_t status =
+        ReadByte(incr ? addr + static_cast<uint32_t>(i) : addr, &buf[i]);
+    if (status != ZX_OK) {
+      return status;
+    }
+  }
+  return ZX_OK;
+}
+
+zx_status_t SdioDevice::Write(uint32_t addr, const uint8_t *buf, size_t len,
+                              bool incr) {
+  for (size_t i = 0; i < len; i++) {
+    zx_status_t status =
+        WriteByte(incr ? addr + static_cast<uint32_t>(i) : addr, buf[i]);
+    if (status != ZX_OK) {
+      return status;
+    }
+  }
+  return ZX_OK;
+}
+
+uint8_t *SdioMemory::Page(uint32_t addr, bool create) {
+  uint32_t index = addr / kPageSize;
+  auto it = pages_.find(index);
+  if (it != pages_.end()) {
+    return it->second.get();
+  }
+  if (!create) {
+    return nullptr;
+  }
+  auto page = std::make_unique<uint8_t[]>(kPageSize);
+  memset(page.get(), 0, kPageSize);
+  uint8_t *ret = page.get();
+  pages_.emplace(index, std::move(page));
+  return ret;
+}
+
+zx_status_t SdioMemory::ReadByte(uint32_t addr, uint8_t *out_val) {
+  const uint8_t *page = Page(addr, false);
+  *out_val = page ? page[addr % kPageSize] : 0;
+  return ZX_OK;
+}
+
+zx_status_t SdioMemory::WriteByte(uint32_t addr, uint8_t val) {
+  Page(addr, true)[addr % kPageSize] = val;
+  return ZX_OK;
+}
+
+// Bulk windows advance inside the card, so a fixed-address transfer fills
+// memory the same way an incrementing one does.
+zx_status_t SdioMemory::Read(uint32_t addr, uint8_t *buf, size_t len,
+                             bool incr) {
+  while (len > 0) {
+    size_t in_page = std::min(len, kPageSize - addr % kPageSize);
+    const uint8_t *page = Page(addr, false);
+    if (page) {
+      memcpy(buf, page + addr % kPageSize, in_page);
+    } else {
+      memset(buf, 0, in_page);
+    }
+    addr += static_cast<uint32_t>(in_page);
+    buf += in_page;
+    len -= in_page;
+  }
+  return ZX_OK;
+}
+
+zx_status_t SdioMemory::Write(uint32_t addr, const uint8_t *buf, size_t len,
+                              bool incr) {
+  while (len > 0) {
+    size_t in_page = std::min(len, kPageSize - addr % kPageSize);
+    memcpy(Page(addr, true) + addr % kPageSize, buf, in_page);
+    addr += static_cast<uint32_t>(in_page);
+    buf += in_page;
+    len -= in_page;
+  }
+  return ZX_OK;
+}
+
+FakeSdioBus::FakeSdioBus(SdioDevice *device)
+    : proto_{&sdio_protocol_ops_, this},
+      device_(device ? device : &memory_) {}
+
+void FakeSdioBus::set_device(SdioDevice *device) {
+  fbl::AutoLock lock(&lock_);
+  device_ = device ? device : &memory_;
+}
+
+void FakeSdioBus::set_timing(const SdioTiming &timing) {
+  fbl::AutoLock lock(&lock_);
+  timing_ = timing;
+}
+
+SdioBusStats FakeSdioBus::stats() const {
+  fbl::AutoLock lock(&lock_);
+  return stats_;
+}
+
+void FakeSdioBus::ResetStats() {
+  fbl::AutoLock lock(&lock_);
+  stats_ = {};
+}
+
+void FakeSdioBus::InjectError(zx_status_t status, uint64_t after) {
+  fbl::AutoLock lock(&lock_);
+  error_status_ = status;
+  error_after_ = after;
+}
+
+void FakeSdioBus::TriggerInterrupt() {
+  fbl::AutoLock lock(&irq_lock_);
+  if (irq_enabled_ && irq_.is_valid()) {
+    irq_.trigger(0, zx::clock::get_monotonic());
+  }
+}
+
+void FakeSdioBus::Stall(zx::time start, zx::duration cost) {
+  stats_.bus_time += cost;
+  if (cost <= zx::duration(0)) {
+    return;
+  }
+  // Spin rather than sleep: a CMD52 costs less than the timer slack.
+  zx::time deadline = start + cost;
+  while (zx::clock::get_monotonic() < deadline) {
+  }
+}
+
+zx_status_t FakeSdioBus::CheckError() {
+  if (error_status_ == ZX_OK) {
+    return ZX_OK;
+  }
+  if (error_after_ > 0) {
+    error_after_--;
+    return ZX_OK;
+  }
+  return error_status_;
+}
+
+zx_status_t FakeSdioBus::SdioGetDevHwInfo(sdio_hw_info_t *out_hw_info) {
+  *out_hw_info = {};
+  out_hw_info->dev_hw_info.num_funcs = 2;
+  out_hw_info->func_hw_info.max_blk_size = kDefaultBlockSize;
+  out_hw_info->host_max_transfer_size =
+      static_cast<uint32_t>(kMaxBlocksPerCmd * kDefaultBlockSize);
+  return ZX_OK;
+}
+
+zx_status_t FakeSdioBus::SdioEnableFn() { return ZX_OK; }
+
+zx_status_t FakeSdioBus::SdioDisableFn() { return ZX_OK; }
+
+zx_status_t FakeSdioBus::SdioEnableFnIntr() {
+  fbl::AutoLock lock(&irq_lock_);
+  irq_enabled_ = true;
+  return ZX_OK;
+}
+
+zx_status_t FakeSdioBus::SdioDisableFnIntr() {
+  fbl::AutoLock lock(&irq_lock_);
+  irq_enabled_ = false;
+  return ZX_OK;
+}
+
+zx_status_t FakeSdioBus::SdioUpdateBlockSize(uint16_t blk_sz, bool deflt) {
+  fbl::AutoLock lock(&lock_);
+  if (deflt) {
+    block_size_ = kDefaultBlockSize;
+    return ZX_OK;
+  }
+  if (blk_sz == 0 || blk_sz > kDefaultBlockSize) {
+    return ZX_ERR_INVALID_ARGS;
+  }
+  block_size_ = blk_sz;
+  return ZX_OK;
+}
+
+zx_status_t FakeSdioBus::SdioGetBlockSize(uint16_t *out_cur_blk_size) {
+  fbl::AutoLock lock(&lock_);
+  *out_cur_blk_size = block_size_;
+  return ZX_OK;
+}
+
+zx_status_t FakeSdioBus::SdioDoRwByte(bool write, uint32_t addr,
+                                      uint8_t write_byte,
+                                      uint8_t *out_read_byte) {
+  fbl::AutoLock lock(&lock_);
+  zx::time start = zx::clock::get_monotonic();
+  zx_status_t status = CheckError();
+  if (status == ZX_OK) {
+    if (write) {
+      status = device_->WriteByte(addr, write_byte);
+    } else {
+      uint8_t val = 0;
+      status = device_->ReadByte(addr, &val);
+      if (out_read_byte) {
+        *out_read_byte = val;
+      }
+    }
+  }
+  if (write) {
+    stats_.cmd52_writes++;
+  } else {
+    stats_.cmd52_reads++;
+  }
+  Stall(start, timing_.cmd52);
+  return status;
+}
+
+zx_status_t FakeSdioBus::SdioGetInBandIntr(zx::interrupt *out_irq) {
+  // Each caller gets a fresh interrupt, so a rebound driver can bind it to
+  // its own port while the previous instance's binding goes away with it.
+  zx::interrupt irq;
+  zx_status_t status =
+      zx::interrupt::create(zx::resource(), 0, ZX_INTERRUPT_VIRTUAL, &irq);
+  if (status == ZX_OK) {
+    status = irq.duplicate(ZX_RIGHT_SAME_RIGHTS, out_irq);
+  }
+  if (status != ZX_OK) {
+    return status;
+  }
+  fbl::AutoLock lock(&irq_lock_);
+  irq_ = std::move(irq);
+  // Asking for the interrupt enables it, as the sdmmc core does.
+  irq_enabled_ = true;
+  return ZX_OK;
+}
+
+void FakeSdioBus::SdioAckInBandIntr() {
+  bool asserted;
+  {
+    fbl::AutoLock lock(&lock_);
+    asserted = device_->InterruptAsserted();
+  }
+  if (asserted) {
+    TriggerInterrupt();
+  }
+}
+
+zx_status_t FakeSdioBus::SdioIoAbort() { return ZX_OK; }
+
+zx_status_t FakeSdioBus::SdioIntrPending(bool *out_pending) {
+  *out_pending = false;
+  return ZX_OK;
+}
+
+zx_status_t FakeSdioBus::SdioDoVendorControlRwByte(bool write, uint8_t addr,
+                                                   uint8_t write_byte,
+                                                   uint8_t *out_read_byte) {
+  return ZX_ERR_NOT_SUPPORTED;
+}
+
+zx_status_t FakeSdioBus::SdioRegisterVmo(uint32_t vmo_id, zx::vmo vmo,
+                                         uint64_t offset, uint64_t size,
+                                         uint32_t vmo_rights) {
+  fbl::AutoLock lock(&lock_);
+  if (!vmo.is_valid() || offset + size < offset) {
+    return ZX_ERR_INVALID_ARGS;
+  }
+  if (vmos_.count(vmo_id) != 0) {
+    return ZX_ERR_ALREADY_EXISTS;
+  }
+  vmos_.emplace(vmo_id, RegisteredVmo{std::move(vmo), offset, size,
+                                      vmo_rights});
+  return ZX_OK;
+}
+
+zx_status_t FakeSdioBus::SdioUnregisterVmo(uint32_t vmo_id, zx::vmo *out_vmo) {
+  fbl::AutoLock lock(&lock_);
+  auto it = vmos_.find(vmo_id);
+  if (it == vmos_.end()) {
+    return ZX_ERR_NOT_FOUND;
+  }
+  if (out_vmo) {
+    *out_vmo = std::move(it->second.vmo);
+  }
+  vmos_.erase(it);
+  return ZX_OK;
+}
+
+zx_status_t FakeSdioBus::RegionVmo(const sdmmc_buffer_region_t &region,
+                                   bool write, zx::unowned_vmo *out_vmo,
+                                   uint64_t *out_offset) {
+  if (region.type == SDMMC_BUFFER_TYPE_VMO_HANDLE) {
+    *out_vmo = zx::unowned_vmo(region.buffer.vmo);
+    *out_offset = region.offset;
+    return ZX_OK;
+  }
+  if (region.type != SDMMC_BUFFER_TYPE_VMO_ID) {
+    return ZX_ERR_INVALID_ARGS;
+  }
+  auto it = vmos_.find(region.buffer.vmo_id);
+  if (it == vmos_.end()) {
+    return ZX_ERR_NOT_FOUND;
+  }
+  const RegisteredVmo &reg = it->second;
+  // A card write reads the VMO and a card read fills it.
+  uint32_t needed = write ? SDMMC_VMO_RIGHT_READ : SDMMC_VMO_RIGHT_WRITE;
+  if ((reg.rights & needed) == 0) {
+    return ZX_ERR_ACCESS_DENIED;
+  }
+  if (region.offset + region.size < region.offset ||
+      region.offset + region.size > reg.size) {
+    return ZX_ERR_OUT_OF_RANGE;
+  }
+  *out_vmo = zx::unowned_vmo(reg.vmo);
+  *out_offset = reg.offset + region.offset;
+  return ZX_OK;
+}
+
+zx::duration FakeSdioBus::AccountCmd53(bool write, size_t total) {
+  // The sdmmc core sends whole blocks in block mode, at most 511 per
+  // command, and a remainder up to one block in byte mode.
+  size_t blocks = total / block_size_;
+  size_t tail = total % block_size_;
+  uint64_t block_cmds = (blocks + kMaxBlocksPerCmd - 1) / kMaxBlocksPerCmd;
+  uint64_t cmds = block_cmds + (tail ? 1 : 0);
+
+  if (write) {
+    stats_.cmd53_writes += cmds;
+    stats_.bytes_written += total;
+  } else {
+    stats_.cmd53_reads += cmds;
+    stats_.bytes_read += total;
+  }
+  stats_.cmd53_block_mode += block_cmds;
+  stats_.blocks += blocks;
+  return timing_.cmd53_setup * static_cast<int64_t>(cmds) +
+         timing_.per_block * static_cast<int64_t>(blocks) +
+         timing_.per_byte * static_cast<int64_t>(tail);
+}
+
+zx_status_t FakeSdioBus::SdioDoRwTxn(uint32_t addr, uint8_t *buf, size_t len,
+                                     bool write, bool incr) {
+  if (buf == nullptr || len == 0) {
+    return ZX_ERR_INVALID_ARGS;
+  }
+  fbl::AutoLock lock(&lock_);
+  zx::time start = zx::clock::get_monotonic();
+  zx_status_t status = CheckError();
+  if (status == ZX_OK) {
+    status = write ? device_->Write(addr, buf, len, incr)
+                   : device_->Read(addr, buf, len, incr);
+  }
+  Stall(start, AccountCmd53(write, len));
+  return status;
+}
+
+zx_status_t FakeSdioBus::SdioDoRwTxn(const sdio_rw_txn_t *txn) {
+  size_t total = 0;
+  for (size_t i = 0; i < txn->buffers_count; i++) {
+    total += txn->buffers_list[i].size;
+  }
+  if (total == 0) {
+    return ZX_ERR_INVALID_ARGS;
+  }
+
+  fbl::AutoLock lock(&lock_);
+  zx::time start = zx::clock::get_monotonic();
+  zx_status_t status = CheckError();
+  std::vector<uint8_t> data;
+  uint32_t addr = txn->addr;
+  for (size_t i = 0; status == ZX_OK && i < txn->buffers_count; i++) {
+    const sdmmc_buffer_region_t &region = txn->buffers_list[i];
+    zx::unowned_vmo vmo;
+    uint64_t offset = 0;
+    status = RegionVmo(region, txn->write, &vmo, &offset);
+    if (status != ZX_OK) {
+      break;
+    }
+    data.resize(region.size);
+    if (txn->write) {
+      status = vmo->read(data.data(), offset, region.size);
+      if (status == ZX_OK) {
+        status = device_->Write(addr, data.data(), region.size, txn->incr);
+      }
+    } else {
+      status = device_->Read(addr, data.data(), region.size, txn->incr);
+      if (status == ZX_OK) {
+        status = vmo->write(data.data(), offset, region.size);
+      }
+    }
+    if (txn->incr) {
+      addr += static_cast<uint32_t>(region.size);
+    }
+  }
+  Stall(start, AccountCmd53(txn->write, total));
+  return status;
+}
+
+zx_status_t FakeSdioBus::SdioRequestCardReset() { return ZX_OK; }
+
+zx_status_t FakeSdioBus::SdioPerformTuning() { return ZX_OK; }
+
+} // namespace testing
+} // namespace soliloquy_hal
@@ -0,0 +1,195 @@
+#ifndef DRIVERS_COMMON_SOLILOQUY_HAL_TESTING_FAKE_SDIO_BUS_H_
+#define DRIVERS_COMMON_SOLILOQUY_HAL_TESTING_FAKE_SDIO_BUS_H_
+
+#include <ddktl/protocol/sdio.h>
+#include <fbl/mutex.h>
+#include <fuchsia/hardware/sdio/cpp/banjo.h>
+#include <lib/zx/interrupt.h>
+#include <lib/zx/time.h>
+#include <lib/zx/vmo.h>
+#include <zircon/types.h>
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <unordered_map>
+
+namespace soliloquy_hal {
+namespace testing {
+
+// What sits behind a FakeSdioBus. CMD52 reaches ReadByte/WriteByte; CMD53
+// reaches Read/Write, with |incr| false for a FIFO port at |addr|. The bus
+// serializes every call, as a real card's single command line does.
+class SdioDevice {
+public:
+  virtual ~SdioDevice() = default;
+
+  virtual zx_status_t ReadByte(uint32_t addr, uint8_t *out_val) = 0;
+  virtual zx_status_t WriteByte(uint32_t addr, uint8_t val) = 0;
+
+  // Default to one byte access per byte.
+  virtual zx_status_t Read(uint32_t addr, uint8_t *buf, size_t len, bool incr);
+  virtual zx_status_t Write(uint32_t addr, const uint8_t *buf, size_t len,
+                            bool incr);
+
+  // Level-triggered devices return true while their interrupt line is
+  // still asserted, so the bus raises it again when the driver acks.
+  virtual bool InterruptAsserted() { return false; }
+};
+
+// Sparse byte-addressed memory: the whole 32-bit space reads as zero until
+// written, and only touched pages are allocated. CMD53 transfers cover
+// consecutive addresses whether or not they increment, since SdioHelper
+// moves bulk data through fixed-address windows whose pointer the card
+// advances itself.
+class SdioMemory : public SdioDevice {
+public:
+  zx_status_t ReadByte(uint32_t addr, uint8_t *out_val) override;
+  zx_status_t WriteByte(uint32_t addr, uint8_t val) override;
+  zx_status_t Read(uint32_t addr, uint8_t *buf, size_t len,
+                   bool incr) override;
+  zx_status_t Write(uint32_t addr, const uint8_t *buf, size_t len,
+                    bool incr) override;
+
+  void Clear() { pages_.clear(); }
+
+private:
+  static constexpr size_t kPageSize = 4096;
+  uint8_t *Page(uint32_t addr, bool create);
+
+  std::unordered_map<uint32_t, std::unique_ptr<uint8_t[]>> pages_;
+};
+
+// Per-command cost of the modeled bus. The defaults approximate a 4-bit bus
+// at 50 MHz (25 MB/s) behind a host controller with ~20 us of command
+// overhead, which is where small transfers spend most of their time.
+struct SdioTiming {
+  zx::duration cmd52 = zx::usec(20);
+  zx::duration cmd53_setup = zx::usec(25);
+  // Data phase of a block-mode CMD53, per block.
+  zx::duration per_block = zx::nsec(20480);
+  // Data phase of a byte-mode CMD53, per byte.
+  zx::duration per_byte = zx::nsec(40);
+
+  // No modeled latency; transactions only cost host CPU time.
+  static SdioTiming Instant() { return {zx::duration(0), zx::duration(0),
+                                        zx::duration(0), zx::duration(0)}; }
+};
+
+struct SdioBusStats {
+  uint64_t cmd52_reads = 0;
+  uint64_t cmd52_writes = 0;
+  uint64_t cmd53_reads = 0;
+  uint64_t cmd53_writes = 0;
+  // Block-mode CMD53s and the blocks they carried; the rest were byte mode.
+  uint64_t cmd53_block_mode = 0;
+  uint64_t blocks = 0;
+  uint64_t bytes_read = 0;
+  uint64_t bytes_written = 0;
+  // Sum of the modeled latency of every transaction.
+  zx::duration bus_time;
+
+  uint64_t cmd52() const { return cmd52_reads + cmd52_writes; }
+  uint64_t cmd53() const { return cmd53_reads + cmd53_writes; }
+};
+
+// A host-side SDIO card that drivers reach through the sdio banjo protocol,
+// either with ddk::SdioProtocolClient(bus.GetProto()) or by adding GetProto()
+// to a mock-ddk parent. Each transaction holds the caller for its modeled
+// latency (spinning, so short commands stay accurate) and is tallied in
+// stats(), so a benchmark on top sees what batching saves on real hardware.
+//
+// Registered VMOs are read and written with zx_vmo_read/write; the card's
+// interrupt is a virtual interrupt that the device model raises with
+// TriggerInterrupt().
+class FakeSdioBus : public ddk::SdioProtocol<FakeSdioBus> {
+public:
+  // |device| defaults to an SdioMemory owned by the bus.
+  explicit FakeSdioBus(SdioDevice *device = nullptr);
+
+  const sdio_protocol_t *GetProto() const { return &proto_; }
+
+  void set_device(SdioDevice *device);
+  SdioMemory &memory() { return memory_; }
+
+  void set_timing(const SdioTiming &timing);
+  SdioBusStats stats() const;
+  void ResetStats();
+
+  // Fails every following transaction with |status| once |after| more have
+  // succeeded.
+  void InjectError(zx_status_t status, uint64_t after = 0);
+
+  // Raises the card interrupt, if the driver has asked for it.
+  void TriggerInterrupt();
+
+  // The sdio banjo protocol.
+  zx_status_t SdioGetDevHwInfo(sdio_hw_info_t *out_hw_info);
+  zx_status_t SdioEnableFn();
+  zx_status_t SdioDisableFn();
+  zx_status_t SdioEnableFnIntr();
+  zx_status_t SdioDisableFnIntr();
+  zx_status_t SdioUpdateBlockSize(uint16_t blk_sz, bool deflt);
+  zx_status_t SdioGetBlockSize(uint16_t *out_cur_blk_size);
+  zx_status_t SdioDoRwByte(bool write, uint32_t addr, uint8_t write_byte,
+                           uint8_t *out_read_byte);
+  zx_status_t SdioGetInBandIntr(zx::interrupt *out_irq);
+  void SdioAckInBandIntr();
+  zx_status_t SdioIoAbort();
+  zx_status_t SdioIntrPending(bool *out_pending);
+  zx_status_t SdioDoVendorControlRwByte(bool write, uint8_t addr,
+                                        uint8_t write_byte,
+                                        uint8_t *out_read_byte);
+  zx_status_t SdioRegisterVmo(uint32_t vmo_id, zx::vmo vmo, uint64_t offset,
+                              uint64_t size, uint32_t vmo_rights);
+  zx_status_t SdioUnregisterVmo(uint32_t vmo_id, zx::vmo *out_vmo);
+  zx_status_t SdioDoRwTxn(uint32_t addr, uint8_t *buf, size_t len, bool write,
+                          bool incr);
+  zx_status_t SdioDoRwTxn(const sdio_rw_txn_t *txn);
+  zx_status_t SdioRequestCardReset();
+  zx_status_t SdioPerformTuning();
+
+  static constexpr uint16_t kDefaultBlockSize = 512;
+  // CMD53 carries the block count in a 9-bit field.
+  static constexpr size_t kMaxBlocksPerCmd = 511;
+
+private:
+  struct RegisteredVmo {
+    zx::vmo vmo;
+    uint64_t offset;
+    uint64_t size;
+    uint32_t rights;
+  };
+
+  // Charges |cost| to the bus and holds the caller until it has passed.
+  void Stall(zx::time start, zx::duration cost) __TA_REQUIRES(lock_);
+  zx_status_t CheckError() __TA_REQUIRES(lock_);
+  // Tallies a CMD53 transfer of |total| bytes and returns its modeled cost.
+  zx::duration AccountCmd53(bool write, size_t total) __TA_REQUIRES(lock_);
+  zx_status_t RegionVmo(const sdmmc_buffer_region_t &region, bool write,
+                        zx::unowned_vmo *out_vmo, uint64_t *out_offset)
+      __TA_REQUIRES(lock_);
+
+  sdio_protocol_t proto_;
+  SdioMemory memory_;
+
+  mutable fbl::Mutex lock_;
+  SdioDevice *device_ __TA_GUARDED(lock_);
+  SdioTiming timing_ __TA_GUARDED(lock_);
+  SdioBusStats stats_ __TA_GUARDED(lock_);
+  uint16_t block_size_ __TA_GUARDED(lock_) = kDefaultBlockSize;
+  std::map<uint32_t, RegisteredVmo> vmos_ __TA_GUARDED(lock_);
+  zx_status_t error_status_ __TA_GUARDED(lock_) = ZX_OK;
+  uint64_t error_after_ __TA_GUARDED(lock_) = 0;
+
+  // Separate from lock_ so a device model can raise the interrupt from
+  // inside a transaction.
+  fbl::Mutex irq_lock_;
+  zx::interrupt irq_ __TA_GUARDED(irq_lock_);
+  bool irq_enabled_ __TA_GUARDED(irq_lock_) = false;
+};
+
+} // namespace testing
+} // namespace soliloquy_hal
+
+#endif // DRIVERS_COMMON_SOLILOQUY_HAL_TESTING_FAKE_SDIO_BUS_H_
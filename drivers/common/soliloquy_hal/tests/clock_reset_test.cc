@@ -0,0 +1,123 @@
+#include "../clock_reset.h"
+
+#include <lib/fake-mmio-reg/fake-mmio-reg.h>
+#include <lib/mmio/mmio.h>
+#include <zxtest/zxtest.h>
+
+#include <cstring>
+
+#include "../../../../boards/arm64/soliloquy/dts/sun55i-a527-ccu.h"
+#include "../metrics.h"
+
+namespace soliloquy_hal {
+namespace {
+
+constexpr size_t kRegisterCount = 0xC00 / sizeof(uint32_t);
+constexpr size_t kRegisterSize = sizeof(uint32_t);
+
+constexpr size_t kPllGpuReg = 0x030 / 4;
+constexpr size_t kGpuReg = 0x670 / 4;
+constexpr size_t kMmc1Reg = 0x834 / 4;
+
+constexpr uint32_t kPllEnable = 1u << 31;
+constexpr uint32_t kPllLockEnable = 1u << 29;
+constexpr uint32_t kPllLock = 1u << 28;
+
+uint64_t CounterValue(const char *name) {
+  for (Counter *c = Counter::Head(); c; c = c->next()) {
+    if (strcmp(c->name(), name) == 0) {
+      return c->value();
+    }
+  }
+  return 0;
+}
+
+class ClockResetTest : public zxtest::Test {
+protected:
+  void SetUp() override {
+    fake_mmio_regs_ = std::make_unique<ddk_fake::FakeMmioReg[]>(kRegisterCount);
+    fake_mmio_ = std::make_unique<ddk_fake::FakeMmioRegRegion>(
+        fake_mmio_regs_.get(), kRegisterSize, kRegisterCount);
+    mmio_buffer_ = fake_mmio_->GetMmioBuffer();
+    helper_ = std::make_unique<ClockResetHelper>(&mmio_buffer_);
+  }
+
+  std::unique_ptr<ddk_fake::FakeMmioReg[]> fake_mmio_regs_;
+  std::unique_ptr<ddk_fake::FakeMmioRegRegion> fake_mmio_;
+  ddk::MmioBuffer mmio_buffer_;
+  std::unique_ptr<ClockResetHelper> helper_;
+};
+
+TEST_F(ClockResetTest, MmcRateCappedAtMaximum) {
+  uint32_t written_value = 0;
+  fake_mmio_regs_[kMmc1Reg].SetReadCallback([]() { return 0u; });
+  fake_mmio_regs_[kMmc1Reg].SetWriteCallback(
+      [&](uint64_t value) { written_value = static_cast<uint32_t>(value); });
+
+  // 200MHz exceeds the controller limit; PERIPH0_2X (1.2GHz) / 4 / 2 wins.
+  EXPECT_OK(helper_->SetClockRate(CLK_MMC1, 200'000'000));
+  EXPECT_EQ(written_value, (1u << 24) | 3u);
+
+  uint64_t rate = 0;
+  EXPECT_OK(helper_->GetClockRate(CLK_MMC1, &rate));
+  EXPECT_EQ(rate, 150'000'000u);
+}
+
+TEST_F(ClockResetTest, MmcIdentificationRate) {
+  uint64_t rate = 0;
+  // HOSC / 2 / 15 / 2 hits the 400kHz identification rate exactly.
+  EXPECT_OK(helper_->RoundClockRate(CLK_MMC1, 400'000, &rate));
+  EXPECT_EQ(rate, 400'000u);
+  EXPECT_OK(helper_->RoundClockRate(CLK_MMC1, 390'000, &rate));
+  EXPECT_EQ(rate, 375'000u);
+
+  EXPECT_STATUS(helper_->RoundClockRate(CLK_MMC1, 1000, &rate),
+                ZX_ERR_OUT_OF_RANGE);
+}
+
+TEST_F(ClockResetTest, PllProgramsAndLocks) {
+  uint32_t pll_value = 0;
+  fake_mmio_regs_[kPllGpuReg].SetReadCallback(
+      [&]() { return pll_value | kPllLock; });
+  fake_mmio_regs_[kPllGpuReg].SetWriteCallback(
+      [&](uint64_t value) { pll_value = static_cast<uint32_t>(value); });
+  fake_mmio_regs_[kGpuReg].SetReadCallback([]() { return 0u; });
+
+  EXPECT_OK(helper_->SetClockRate(CLK_PLL_GPU0, 696'000'000));
+  EXPECT_EQ(pll_value & ~kPllLock, kPllEnable | kPllLockEnable | (28u << 8));
+
+  // The GPU clock runs straight off the PLL with M = 1.
+  uint64_t rate = 0;
+  EXPECT_OK(helper_->GetClockRate(CLK_GPU0, &rate));
+  EXPECT_EQ(rate, 696'000'000u);
+}
+
+TEST_F(ClockResetTest, PllLockTimeout) {
+  fake_mmio_regs_[kPllGpuReg].SetReadCallback([]() { return 0u; });
+  fake_mmio_regs_[kPllGpuReg].SetWriteCallback([](uint64_t) {});
+
+  EXPECT_STATUS(helper_->SetClockRate(CLK_PLL_GPU0, 600'000'000),
+                ZX_ERR_TIMED_OUT);
+}
+
+TEST_F(ClockResetTest, SolutionsAreCached) {
+  uint64_t rate = 0;
+  uint64_t misses = CounterValue("clk.solve_cache_misses");
+  uint64_t hits = CounterValue("clk.solve_cache_hits");
+
+  EXPECT_OK(helper_->RoundClockRate(CLK_MMC2, 52'000'000, &rate));
+  EXPECT_OK(helper_->RoundClockRate(CLK_MMC2, 52'000'000, &rate));
+
+  EXPECT_EQ(CounterValue("clk.solve_cache_misses"), misses + 1);
+  EXPECT_EQ(CounterValue("clk.solve_cache_hits"), hits + 1);
+}
+
+TEST_F(ClockResetTest, UnknownClock) {
+  uint64_t rate = 0;
+  EXPECT_STATUS(helper_->SetClockRate(CLK_BUS_UART0, 1), ZX_ERR_NOT_SUPPORTED);
+  EXPECT_STATUS(helper_->GetClockRate(CLK_BUS_UART0, &rate),
+                ZX_ERR_NOT_SUPPORTED);
+}
+
+} // namespace
+} // namespace soliloquy_hal
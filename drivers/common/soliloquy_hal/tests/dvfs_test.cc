@@ -0,0 +1,146 @@
+#include "../dvfs.h"
+
+#include <lib/fake-mmio-reg/fake-mmio-reg.h>
+#include <lib/mmio/mmio.h>
+#include <zxtest/zxtest.h>
+
+#include <iterator>
+
+#include "../../../../boards/arm64/soliloquy/dts/sun55i-a527-ccu.h"
+
+namespace soliloquy_hal {
+namespace {
+
+constexpr uint64_t kOpps[] = {25'000'000, 50'000'000, 100'000'000,
+                              150'000'000};
+constexpr size_t kTop = std::size(kOpps) - 1;
+
+TEST(DvfsPolicyTest, BusyJumpsToCeiling) {
+  DvfsPolicy policy;
+  EXPECT_EQ(DvfsGovernor::NextOpp(policy, kOpps, 0, kTop, 90), kTop);
+  EXPECT_EQ(DvfsGovernor::NextOpp(policy, kOpps, 0, 1, 90), 1u);
+}
+
+TEST(DvfsPolicyTest, ModerateLoadPicksTargetPoint) {
+  DvfsPolicy policy;
+  // 60% of 50MHz needs ~43MHz at a 70% target: stay put.
+  EXPECT_EQ(DvfsGovernor::NextOpp(policy, kOpps, 1, kTop, 60), 1u);
+  // 80% of 100MHz needs ~114MHz: climb one point.
+  EXPECT_EQ(DvfsGovernor::NextOpp(policy, kOpps, 2, kTop, 80), 3u);
+}
+
+TEST(DvfsPolicyTest, IdleStepsDownOnePoint) {
+  DvfsPolicy policy;
+  EXPECT_EQ(DvfsGovernor::NextOpp(policy, kOpps, kTop, kTop, 0), kTop - 1);
+  EXPECT_EQ(DvfsGovernor::NextOpp(policy, kOpps, 0, kTop, 0), 0u);
+}
+
+TEST(DvfsPolicyTest, CeilingClampsCurrentPoint) {
+  DvfsPolicy policy;
+  EXPECT_EQ(DvfsGovernor::NextOpp(policy, kOpps, kTop, 1, 50), 1u);
+}
+
+class DvfsGovernorTest : public zxtest::Test {
+protected:
+  static constexpr size_t kRegisterCount = 0xC00 / sizeof(uint32_t);
+  static constexpr size_t kMmc1Reg = 0x834 / 4;
+
+  void SetUp() override {
+    fake_mmio_regs_ = std::make_unique<ddk_fake::FakeMmioReg[]>(kRegisterCount);
+    fake_mmio_ = std::make_unique<ddk_fake::FakeMmioRegRegion>(
+        fake_mmio_regs_.get(), sizeof(uint32_t), kRegisterCount);
+    mmio_buffer_ = fake_mmio_->GetMmioBuffer();
+    clocks_ = std::make_unique<ClockResetHelper>(&mmio_buffer_);
+
+    fake_mmio_regs_[kMmc1Reg].SetReadCallback([this]() { return mmc1_; });
+    fake_mmio_regs_[kMmc1Reg].SetWriteCallback(
+        [this](uint64_t value) { mmc1_ = static_cast<uint32_t>(value); });
+  }
+
+  uint64_t Mmc1Rate() {
+    uint64_t rate = 0;
+    EXPECT_OK(clocks_->GetClockRate(CLK_MMC1, &rate));
+    return rate;
+  }
+
+  static zx::duration BusyTime(void *ctx) {
+    return static_cast<DvfsGovernorTest *>(ctx)->busy_;
+  }
+
+  static zx_status_t Temperature(void *ctx, int32_t *out_mc) {
+    *out_mc = static_cast<DvfsGovernorTest *>(ctx)->temp_mc_;
+    return ZX_OK;
+  }
+
+  DvfsDomainConfig Config() {
+    return {
+        .name = "mmc1",
+        .clock_id = CLK_MMC1,
+        .opp_hz = kOpps,
+        .opp_count = std::size(kOpps),
+        .utilization = {BusyTime, this},
+    };
+  }
+
+  std::unique_ptr<ddk_fake::FakeMmioReg[]> fake_mmio_regs_;
+  std::unique_ptr<ddk_fake::FakeMmioRegRegion> fake_mmio_;
+  ddk::MmioBuffer mmio_buffer_;
+  std::unique_ptr<ClockResetHelper> clocks_;
+  uint32_t mmc1_ = 0;
+  zx::duration busy_;
+  int32_t temp_mc_ = 40000;
+};
+
+TEST_F(DvfsGovernorTest, FollowsLoad) {
+  DvfsGovernor governor(clocks_.get());
+  ASSERT_OK(governor.AddDomain(Config()));
+  EXPECT_EQ(Mmc1Rate(), 150'000'000u);
+
+  // Idle: ease down one point per sample.
+  governor.Sample();
+  governor.Sample();
+  EXPECT_EQ(Mmc1Rate(), 50'000'000u);
+
+  // Saturated: straight back to the top.
+  busy_ += zx::hour(1);
+  governor.Sample();
+  EXPECT_EQ(Mmc1Rate(), 150'000'000u);
+}
+
+TEST_F(DvfsGovernorTest, ThermalCeiling) {
+  DvfsGovernor governor(clocks_.get());
+  ASSERT_OK(governor.AddDomain(Config()));
+  governor.SetTemperatureSource({Temperature, this});
+
+  temp_mc_ = 90000;
+  busy_ += zx::hour(1);
+  governor.Sample();
+  EXPECT_EQ(Mmc1Rate(), 100'000'000u);
+
+  // Still too hot: the saturated domain keeps backing off.
+  busy_ += zx::hour(1);
+  governor.Sample();
+  EXPECT_EQ(Mmc1Rate(), 50'000'000u);
+
+  // Cooled below the hysteresis band: the ceiling recovers a step.
+  temp_mc_ = 70000;
+  busy_ += zx::hour(1);
+  governor.Sample();
+  EXPECT_EQ(Mmc1Rate(), 100'000'000u);
+}
+
+TEST_F(DvfsGovernorTest, AddDomainInvalidArgs) {
+  DvfsGovernor governor(clocks_.get());
+  DvfsDomainConfig config = Config();
+  config.opp_count = 0;
+  EXPECT_STATUS(governor.AddDomain(config), ZX_ERR_INVALID_ARGS);
+
+  constexpr uint64_t kUnsorted[] = {50'000'000, 25'000'000};
+  config = Config();
+  config.opp_hz = kUnsorted;
+  config.opp_count = std::size(kUnsorted);
+  EXPECT_STATUS(governor.AddDomain(config), ZX_ERR_INVALID_ARGS);
+}
+
+} // namespace
+} // namespace soliloquy_hal
@@ -0,0 +1,65 @@
+#include "../testing/fake_mmio_region.h"
+
+#include <zxtest/zxtest.h>
+
+#include "../mmio.h"
+
+namespace soliloquy_hal {
+namespace {
+
+using testing::FakeMmioRegion;
+using testing::MmioTiming;
+
+TEST(FakeMmioRegionTest, RegistersHoldWrittenValues) {
+  FakeMmioRegion region(16, MmioTiming::Instant());
+  ddk::MmioBuffer mmio = region.GetMmioBuffer();
+  MmioHelper helper(&mmio);
+
+  helper.Write32(0x8, 0x1234);
+  EXPECT_EQ(helper.Read32(0x8), 0x1234u);
+  EXPECT_EQ(region.value(0x8), 0x1234u);
+  EXPECT_EQ(region.reads(0x8), 1u);
+  EXPECT_EQ(region.writes(0x8), 1u);
+  EXPECT_EQ(region.total_reads(), 1u);
+}
+
+TEST(FakeMmioRegionTest, WriteHookModelsWriteOneToClear) {
+  FakeMmioRegion region(4, MmioTiming::Instant());
+  region.set_value(0x4, 0xF);
+  region.SetWriteHook(0x4, [](uint32_t value, uint32_t written) {
+    return value & ~written;
+  });
+  ddk::MmioBuffer mmio = region.GetMmioBuffer();
+  MmioHelper helper(&mmio);
+
+  helper.Write32(0x4, 0x5);
+  EXPECT_EQ(helper.Read32(0x4), 0xAu);
+}
+
+TEST(FakeMmioRegionTest, ProgramSavesAccesses) {
+  FakeMmioRegion region(4, MmioTiming::Instant());
+  ddk::MmioBuffer mmio = region.GetMmioBuffer();
+  MmioHelper helper(&mmio);
+
+  RegisterProgram program;
+  program.SetBits32(0x0, 0x1).SetBits32(0x0, 0x2).ModifyBits32(0x0, 0xF0, 0x30);
+  ASSERT_OK(helper.Apply(program));
+
+  EXPECT_EQ(region.value(0x0), 0x33u);
+  EXPECT_EQ(region.reads(0x0), 1u);
+  EXPECT_EQ(region.writes(0x0), 1u);
+}
+
+TEST(FakeMmioRegionTest, ModeledLatencyIsCharged) {
+  FakeMmioRegion region(4, {zx::nsec(500), zx::nsec(100)});
+  ddk::MmioBuffer mmio = region.GetMmioBuffer();
+  mmio.Read32(0x0);
+  mmio.Write32(0, 0x0);
+  EXPECT_EQ(region.bus_time().get(), 600);
+  region.ResetStats();
+  EXPECT_EQ(region.total_reads(), 0u);
+  EXPECT_EQ(region.bus_time().get(), 0);
+}
+
+} // namespace
+} // namespace soliloquy_hal
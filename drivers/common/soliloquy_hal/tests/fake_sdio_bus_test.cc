@@ -0,0 +1,115 @@
+#include "../testing/fake_sdio_bus.h"
+
+#include <lib/zx/vmo.h>
+#include <zxtest/zxtest.h>
+
+#include <iterator>
+#include <vector>
+
+#include "../sdio.h"
+
+namespace soliloquy_hal {
+namespace {
+
+using testing::FakeSdioBus;
+using testing::SdioTiming;
+
+class FakeSdioBusTest : public zxtest::Test {
+protected:
+  void SetUp() override {
+    bus_.set_timing(SdioTiming::Instant());
+    client_ = ddk::SdioProtocolClient(bus_.GetProto());
+    helper_ = std::make_unique<SdioHelper>(&client_);
+  }
+
+  FakeSdioBus bus_;
+  ddk::SdioProtocolClient client_;
+  std::unique_ptr<SdioHelper> helper_;
+};
+
+TEST_F(FakeSdioBusTest, ByteAccessesAreCmd52) {
+  EXPECT_OK(helper_->WriteByte(0x10, 0x5A));
+  uint8_t val = 0;
+  EXPECT_OK(helper_->ReadByte(0x10, &val));
+  EXPECT_EQ(val, 0x5A);
+
+  testing::SdioBusStats stats = bus_.stats();
+  EXPECT_EQ(stats.cmd52_writes, 1u);
+  EXPECT_EQ(stats.cmd52_reads, 1u);
+  EXPECT_EQ(stats.cmd53(), 0u);
+}
+
+TEST_F(FakeSdioBusTest, BlockTransfersRoundTrip) {
+  std::vector<uint8_t> out(3 * 512 + 100);
+  for (size_t i = 0; i < out.size(); i++) {
+    out[i] = static_cast<uint8_t>(i * 7);
+  }
+  ASSERT_OK(helper_->WriteMultiBlock(0x20000, out.data(), out.size()));
+
+  testing::SdioBusStats stats = bus_.stats();
+  EXPECT_EQ(stats.blocks, 3u);
+  EXPECT_EQ(stats.cmd53_block_mode, 1u);
+  EXPECT_EQ(stats.bytes_written, out.size());
+
+  std::vector<uint8_t> in(out.size());
+  ASSERT_OK(helper_->ReadMultiBlock(0x20000, in.data(), in.size()));
+  EXPECT_BYTES_EQ(in.data(), out.data(), out.size());
+}
+
+TEST_F(FakeSdioBusTest, WriteRegsCoalescesContiguousRuns) {
+  const SdioReg regs[] = {
+      {0x100, 1}, {0x104, 2}, {0x108, 3}, {0x10C, 4}, {0x200, 5},
+  };
+  ASSERT_OK(helper_->WriteRegs(regs, std::size(regs)));
+
+  EXPECT_EQ(bus_.stats().cmd53_writes, 2u);
+  EXPECT_EQ(bus_.stats().cmd52(), 0u);
+  uint32_t val = 0;
+  ASSERT_OK(helper_->Read32(0x108, &val));
+  EXPECT_EQ(val, 3u);
+  ASSERT_OK(helper_->Read32(0x200, &val));
+  EXPECT_EQ(val, 5u);
+}
+
+TEST_F(FakeSdioBusTest, FirmwareDownloadLandsInCardMemory) {
+  constexpr size_t kSize = 300 * 1024 + 4;
+  std::vector<uint8_t> image(kSize);
+  for (size_t i = 0; i < kSize; i++) {
+    image[i] = static_cast<uint8_t>(i ^ (i >> 8));
+  }
+  zx::vmo vmo;
+  ASSERT_OK(zx::vmo::create(kSize, 0, &vmo));
+  ASSERT_OK(vmo.write(image.data(), 0, kSize));
+
+  ASSERT_OK(helper_->DownloadFirmware(vmo, kSize, 0x120000));
+
+  std::vector<uint8_t> landed(kSize);
+  ASSERT_OK(bus_.memory().Read(0x120000, landed.data(), kSize, true));
+  EXPECT_BYTES_EQ(landed.data(), image.data(), kSize);
+  // 600 whole blocks take two block-mode commands, the tail one more.
+  EXPECT_EQ(bus_.stats().cmd53_block_mode, 2u);
+  EXPECT_EQ(bus_.stats().cmd53_writes, 3u);
+}
+
+TEST_F(FakeSdioBusTest, ModeledLatencyIsCharged) {
+  SdioTiming timing;
+  timing.cmd52 = zx::usec(50);
+  bus_.set_timing(timing);
+
+  for (int i = 0; i < 4; i++) {
+    ASSERT_OK(helper_->WriteByte(0x10, 0));
+  }
+  EXPECT_EQ(bus_.stats().bus_time.get(), zx::usec(200).get());
+  EXPECT_GE(helper_->busy_time().get(), zx::usec(200).get());
+}
+
+TEST_F(FakeSdioBusTest, InjectedErrorFailsLaterTransactions) {
+  bus_.InjectError(ZX_ERR_IO, 1);
+  EXPECT_OK(helper_->WriteByte(0x10, 0));
+  EXPECT_STATUS(helper_->WriteByte(0x10, 0), ZX_ERR_IO);
+  bus_.InjectError(ZX_OK);
+  EXPECT_OK(helper_->WriteByte(0x10, 0));
+}
+
+} // namespace
+} // namespace soliloquy_hal
@@ -0,0 +1,142 @@
+#include "../lz4_frame.h"
+
+#include <zxtest/zxtest.h>
+
+#include <cstdio>
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+#include <string>
+#include <vector>
+
+namespace soliloquy_hal {
+namespace {
+
+// 800 bytes of "soliloquy block NNN " packed with `lz4 -B4 -BX --content-size`,
+// so it carries block and content checksums and the content size.
+const uint8_t kFrame[] = {
+    0x04, 0x22, 0x4d, 0x18, 0x7c, 0x40, 0x20, 0x03, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x2f, 0x42, 0x00, 0x00, 0x00, 0xfe, 0x05, 0x73, 0x6f, 0x6c,
+    0x69, 0x6c, 0x6f, 0x71, 0x75, 0x79, 0x20, 0x62, 0x6c, 0x6f, 0x63, 0x6b,
+    0x20, 0x30, 0x30, 0x30, 0x20, 0x14, 0x00, 0x1f, 0x31, 0x14, 0x00, 0x00,
+    0x1f, 0x32, 0x14, 0x00, 0x00, 0x1f, 0x33, 0x14, 0x00, 0x00, 0x1f, 0x34,
+    0x14, 0x00, 0x00, 0x1f, 0x35, 0x14, 0x00, 0x00, 0x1f, 0x36, 0x14, 0x00,
+    0x00, 0x0f, 0x8c, 0x00, 0xff, 0xff, 0x6c, 0x50, 0x20, 0x30, 0x30, 0x34,
+    0x20, 0xa7, 0x67, 0xca, 0xeb, 0x00, 0x00, 0x00, 0x00, 0x3b, 0xe1, 0xa5,
+    0x0d,
+};
+
+std::string ExpectedContent() {
+  std::string out;
+  char word[32];
+  for (int i = 0; i < 40; i++) {
+    snprintf(word, sizeof(word), "soliloquy block %03d ", i % 7);
+    out += word;
+  }
+  return out;
+}
+
+zx_status_t DecodeAll(const uint8_t *data, size_t size, std::string *out) {
+  Lz4FrameDecoder decoder;
+  zx_status_t status = decoder.Init(data, size);
+  if (status != ZX_OK) {
+    return status;
+  }
+  std::vector<uint8_t> block(decoder.block_max_size());
+  size_t len;
+  while ((status = decoder.NextBlock(block.data(), block.size(), &len)) ==
+         ZX_OK) {
+    out->append(reinterpret_cast<char *>(block.data()), len);
+  }
+  return status == ZX_ERR_STOP ? ZX_OK : status;
+}
+
+TEST(Lz4FrameTest, Xxh32KnownValues) {
+  EXPECT_EQ(Xxh32::Hash(nullptr, 0), 0x02cc5d05u);
+  EXPECT_EQ(Xxh32::Hash(reinterpret_cast<const uint8_t *>("a"), 1),
+            0x550d7456u);
+  EXPECT_EQ(Xxh32::Hash(reinterpret_cast<const uint8_t *>("abc"), 3),
+            0x32d153ffu);
+
+  // Feeding the input in odd-sized pieces must match the one-shot hash.
+  std::string text = ExpectedContent();
+  const auto *bytes = reinterpret_cast<const uint8_t *>(text.data());
+  Xxh32 hash;
+  for (size_t off = 0; off < text.size(); off += 7) {
+    hash.Update(bytes + off, std::min<size_t>(7, text.size() - off));
+  }
+  EXPECT_EQ(hash.Digest(), Xxh32::Hash(bytes, text.size()));
+}
+
+TEST(Lz4FrameTest, DecodesFrame) {
+  Lz4FrameDecoder decoder;
+  ASSERT_OK(decoder.Init(kFrame, sizeof(kFrame)));
+  EXPECT_EQ(decoder.block_max_size(), 64u * 1024);
+  EXPECT_EQ(decoder.content_size(), 800u);
+
+  std::string out;
+  ASSERT_OK(DecodeAll(kFrame, sizeof(kFrame), &out));
+  EXPECT_EQ(out, ExpectedContent());
+}
+
+TEST(Lz4FrameTest, RejectsCorruptBlock) {
+  std::vector<uint8_t> frame(std::begin(kFrame), std::end(kFrame));
+  frame[30] ^= 0x01;
+  std::string out;
+  EXPECT_EQ(DecodeAll(frame.data(), frame.size(), &out),
+            ZX_ERR_IO_DATA_INTEGRITY);
+}
+
+TEST(Lz4FrameTest, RejectsBadHeader) {
+  std::vector<uint8_t> frame(std::begin(kFrame), std::end(kFrame));
+  Lz4FrameDecoder decoder;
+
+  frame[0] ^= 0x01;
+  EXPECT_EQ(decoder.Init(frame.data(), frame.size()), ZX_ERR_NOT_SUPPORTED);
+  frame[0] ^= 0x01;
+
+  // Linked blocks are refused before the header checksum is looked at.
+  frame[4] &= ~(1u << 5);
+  EXPECT_EQ(decoder.Init(frame.data(), frame.size()), ZX_ERR_NOT_SUPPORTED);
+  frame[4] |= 1u << 5;
+
+  frame[14] ^= 0xFF;
+  EXPECT_EQ(decoder.Init(frame.data(), frame.size()),
+            ZX_ERR_IO_DATA_INTEGRITY);
+}
+
+TEST(Lz4FrameTest, RejectsTruncatedFrame) {
+  std::string out;
+  EXPECT_EQ(DecodeAll(kFrame, sizeof(kFrame) - 4, &out),
+            ZX_ERR_IO_DATA_INTEGRITY);
+}
+
+TEST(Lz4FrameTest, DecodeBlockOverlappingMatch) {
+  // "ab" as literals, then a 10-byte match at offset 2.
+  const uint8_t block[] = {0x26, 'a', 'b', 0x02, 0x00, 0x10, 'c'};
+  uint8_t out[16];
+  size_t len;
+  ASSERT_OK(Lz4FrameDecoder::DecodeBlock(block, sizeof(block), out,
+                                         sizeof(out), &len));
+  EXPECT_EQ(std::string(reinterpret_cast<char *>(out), len), "ababababababc");
+}
+
+TEST(Lz4FrameTest, DecodeBlockBounds) {
+  uint8_t out[8];
+  size_t len;
+
+  // Match reaching back before the start of the block.
+  const uint8_t bad_offset[] = {0x10, 'a', 0x02, 0x00, 0x00};
+  EXPECT_EQ(Lz4FrameDecoder::DecodeBlock(bad_offset, sizeof(bad_offset), out,
+                                         sizeof(out), &len),
+            ZX_ERR_IO_DATA_INTEGRITY);
+
+  // Output larger than the destination.
+  const uint8_t too_long[] = {0x1F, 'a', 0x01, 0x00, 0x10};
+  EXPECT_EQ(Lz4FrameDecoder::DecodeBlock(too_long, sizeof(too_long), out,
+                                         sizeof(out), &len),
+            ZX_ERR_BUFFER_TOO_SMALL);
+}
+
+} // namespace
+} // namespace soliloquy_hal
@@ -4,8 +4,13 @@
 
 #include <lib/fake-mmio-reg/fake-mmio-reg.h>
 #include <lib/mmio/mmio.h>
+#include <lib/zx/interrupt.h>
+#include <lib/zx/port.h>
+#include <lib/zx/resource.h>
 #include <zxtest/zxtest.h>
 
+#include <vector>
+
 namespace soliloquy_hal {
 namespace {
 
@@ -169,5 +174,243 @@ TEST_F(MmioHelperTest, WaitForBit32ClearSuccess) {
   EXPECT_GE(read_count, 2u);
 }
 
+TEST_F(MmioHelperTest, WaitForMask32Success) {
+  constexpr uint32_t kMask = 0x00F0;
+  constexpr uint32_t kValue = 0x0050;
+
+  // Run past the spin phase so the backoff path is exercised.
+  size_t read_count = 0;
+  fake_mmio_regs_[0].SetReadCallback([&]() {
+    read_count++;
+    if (read_count >= MmioHelper::kWaitSpinPolls + 4) {
+      return kValue | 0xFF00;
+    }
+    return 0x0030u;
+  });
+
+  bool result = helper_->WaitForMask32(0, kMask, kValue, zx::msec(100));
+  EXPECT_TRUE(result);
+  EXPECT_EQ(read_count, MmioHelper::kWaitSpinPolls + 4);
+}
+
+TEST_F(MmioHelperTest, WaitForMask32Timeout) {
+  constexpr uint32_t kMask = 0x3;
+
+  size_t read_count = 0;
+  fake_mmio_regs_[0].SetReadCallback([&]() {
+    read_count++;
+    return 0x1u;
+  });
+
+  bool result = helper_->WaitForMask32(0, kMask, 0x3, zx::msec(10));
+  EXPECT_FALSE(result);
+  // Backoff keeps a 10ms wait far below one read per microsecond.
+  EXPECT_LT(read_count, 1000u);
+}
+
+TEST_F(MmioHelperTest, WaitForMask32IrqConfirmsRegister) {
+  constexpr uint64_t kKey = 1;
+  constexpr uint32_t kMask = 0x1;
+
+  zx::port port;
+  ASSERT_OK(zx::port::create(ZX_PORT_BIND_TO_INTERRUPT, &port));
+  zx::interrupt irq;
+  ASSERT_OK(zx::interrupt::create(zx::resource(), 0, ZX_INTERRUPT_VIRTUAL,
+                                  &irq));
+  ASSERT_OK(irq.bind(port, kKey, 0));
+  ASSERT_OK(irq.trigger(0, zx::time()));
+
+  // The first read happens before the wait; the interrupt then wakes the
+  // helper and the second read confirms completion.
+  size_t read_count = 0;
+  fake_mmio_regs_[0].SetReadCallback([&]() {
+    read_count++;
+    return read_count >= 2 ? kMask : 0u;
+  });
+
+  EXPECT_OK(helper_->WaitForMask32Irq(irq, port, kKey, 0, kMask, kMask,
+                                      zx::sec(5)));
+  EXPECT_EQ(read_count, 2u);
+}
+
+TEST_F(MmioHelperTest, WaitForMask32IrqTimeout) {
+  constexpr uint64_t kKey = 1;
+
+  zx::port port;
+  ASSERT_OK(zx::port::create(ZX_PORT_BIND_TO_INTERRUPT, &port));
+  zx::interrupt irq;
+  ASSERT_OK(zx::interrupt::create(zx::resource(), 0, ZX_INTERRUPT_VIRTUAL,
+                                  &irq));
+  ASSERT_OK(irq.bind(port, kKey, 0));
+
+  fake_mmio_regs_[0].SetReadCallback([&]() { return 0u; });
+
+  EXPECT_STATUS(
+      helper_->WaitForMask32Irq(irq, port, kKey, 0, 0x1, 0x1, zx::msec(10)),
+      ZX_ERR_TIMED_OUT);
+}
+
+TEST_F(MmioHelperTest, RegisterProgramCoalescesPerRegister) {
+  size_t reads = 0;
+  size_t writes = 0;
+  uint32_t written_value = 0;
+  fake_mmio_regs_[1].SetReadCallback([&]() {
+    reads++;
+    return 0xF0F0F0F0u;
+  });
+  fake_mmio_regs_[1].SetWriteCallback([&](uint64_t value) {
+    writes++;
+    written_value = static_cast<uint32_t>(value);
+  });
+
+  RegisterProgram program;
+  program.SetBits32(4, 0x0000000F)
+      .ClearBits32(4, 0x000000F0)
+      .ModifyBits32(4, 0x0000FF00, 0x00004200)
+      .WriteMasked32(4, 0x000F0000, 16, 0x3);
+  EXPECT_EQ(program.size(), 1u);
+
+  EXPECT_OK(helper_->Apply(program));
+  EXPECT_EQ(reads, 1u);
+  EXPECT_EQ(writes, 1u);
+  EXPECT_EQ(written_value, 0xF0F3420Fu);
+}
+
+TEST_F(MmioHelperTest, RegisterProgramFullWriteSkipsRead) {
+  size_t reads = 0;
+  uint32_t written_value = 0;
+  fake_mmio_regs_[2].SetReadCallback([&]() {
+    reads++;
+    return 0u;
+  });
+  fake_mmio_regs_[2].SetWriteCallback(
+      [&](uint64_t value) { written_value = static_cast<uint32_t>(value); });
+
+  RegisterProgram program;
+  program.Write32(8, 0x12345678).ClearBits32(8, 0x000000FF);
+
+  EXPECT_OK(helper_->Apply(program));
+  EXPECT_EQ(reads, 0u);
+  EXPECT_EQ(written_value, 0x12345600u);
+}
+
+TEST_F(MmioHelperTest, RegisterProgramBarrierPreservesOrder) {
+  std::vector<uint32_t> order;
+  fake_mmio_regs_[0].SetWriteCallback([&](uint64_t) { order.push_back(0); });
+  fake_mmio_regs_[1].SetWriteCallback([&](uint64_t) { order.push_back(4); });
+
+  RegisterProgram program;
+  program.Write32(0, 1).Write32(4, 2).Barrier().Write32(0, 3);
+  EXPECT_EQ(program.size(), 3u);
+
+  EXPECT_OK(helper_->Apply(program));
+  ASSERT_EQ(order.size(), 3u);
+  EXPECT_EQ(order[0], 0u);
+  EXPECT_EQ(order[1], 4u);
+  EXPECT_EQ(order[2], 0u);
+
+  // Replaying the same program repeats the same writes.
+  EXPECT_OK(helper_->Apply(program));
+  EXPECT_EQ(order.size(), 6u);
+}
+
+TEST_F(MmioHelperTest, RegisterProgramOverflow) {
+  size_t writes = 0;
+  for (size_t i = 0; i < kRegisterCount; i++) {
+    fake_mmio_regs_[i].SetWriteCallback([&](uint64_t) { writes++; });
+  }
+
+  RegisterProgram program;
+  for (size_t i = 0; i <= RegisterProgram::kMaxOps; i++) {
+    program.Write32(0, static_cast<uint32_t>(i)).Barrier();
+  }
+  EXPECT_TRUE(program.overflowed());
+
+  EXPECT_STATUS(helper_->Apply(program), ZX_ERR_NO_RESOURCES);
+  EXPECT_EQ(writes, 0u);
+}
+
+TEST_F(MmioHelperTest, ShadowedRegisterReadsOnce) {
+  size_t reads = 0;
+  size_t writes = 0;
+  uint32_t written_value = 0;
+  fake_mmio_regs_[2].SetReadCallback([&]() {
+    reads++;
+    return 0x00FF0000u;
+  });
+  fake_mmio_regs_[2].SetWriteCallback([&](uint64_t value) {
+    writes++;
+    written_value = static_cast<uint32_t>(value);
+  });
+
+  ASSERT_OK(helper_->SetRegPolicy(8, 8, RegPolicy::kShadowed));
+
+  helper_->SetBits32(8, 0x1);
+  helper_->ClearBits32(8, 0x00F00000);
+  helper_->ModifyBits32(8, 0xF0, 0x50);
+  EXPECT_EQ(reads, 1u);
+  EXPECT_EQ(writes, 3u);
+  EXPECT_EQ(written_value, 0x000F0051u);
+  EXPECT_EQ(helper_->Read32(8), 0x000F0051u);
+  EXPECT_EQ(reads, 1u);
+
+  helper_->InvalidateShadow();
+  EXPECT_EQ(helper_->Read32(8), 0x00FF0000u);
+  EXPECT_EQ(reads, 2u);
+}
+
+TEST_F(MmioHelperTest, WriteOnlyRegisterNeverRead) {
+  size_t reads = 0;
+  uint32_t written_value = 0;
+  fake_mmio_regs_[4].SetReadCallback([&]() {
+    reads++;
+    return 0xFFFFFFFFu;
+  });
+  fake_mmio_regs_[4].SetWriteCallback(
+      [&](uint64_t value) { written_value = static_cast<uint32_t>(value); });
+
+  ASSERT_OK(helper_->SetRegPolicy(16, 4, RegPolicy::kWriteOnly, 0x100));
+
+  helper_->SetBits32(16, 0x1);
+  EXPECT_EQ(written_value, 0x101u);
+  helper_->WriteMasked32(16, 0xF0, 4, 0x3);
+  EXPECT_EQ(written_value, 0x131u);
+  EXPECT_EQ(reads, 0u);
+
+  uint32_t shadow = 0;
+  EXPECT_TRUE(helper_->GetShadow(16, &shadow));
+  EXPECT_EQ(shadow, 0x131u);
+  EXPECT_FALSE(helper_->GetShadow(0, &shadow));
+}
+
+TEST_F(MmioHelperTest, VolatileAndWaitsBypassShadow) {
+  size_t reads = 0;
+  fake_mmio_regs_[0].SetReadCallback([&]() {
+    reads++;
+    return reads >= 2 ? 0x1u : 0u;
+  });
+
+  ASSERT_OK(helper_->SetRegPolicy(0, 4, RegPolicy::kShadowed));
+  EXPECT_EQ(helper_->Read32(0), 0u);
+
+  // The shadow holds 0, but the wait must observe the device.
+  EXPECT_TRUE(helper_->WaitForMask32(0, 0x1, 0x1, zx::msec(100)));
+  EXPECT_EQ(reads, 2u);
+}
+
+TEST_F(MmioHelperTest, SetRegPolicyInvalidArgs) {
+  EXPECT_STATUS(helper_->SetRegPolicy(0, 0, RegPolicy::kShadowed),
+                ZX_ERR_INVALID_ARGS);
+  EXPECT_STATUS(helper_->SetRegPolicy(2, 4, RegPolicy::kShadowed),
+                ZX_ERR_INVALID_ARGS);
+  EXPECT_STATUS(helper_->SetRegPolicy(0, 6, RegPolicy::kShadowed),
+                ZX_ERR_INVALID_ARGS);
+
+  ASSERT_OK(helper_->SetRegPolicy(0, 16, RegPolicy::kShadowed));
+  EXPECT_STATUS(helper_->SetRegPolicy(12, 8, RegPolicy::kWriteOnly),
+                ZX_ERR_ALREADY_EXISTS);
+  EXPECT_OK(helper_->SetRegPolicy(16, 8, RegPolicy::kWriteOnly));
+}
+
 } // namespace
 } // namespace soliloquy_hal
@@ -1,8 +1,13 @@
 #include "../sdio.h"
 
+#include <iterator>
+#include <vector>
+
 #include <fuchsia/hardware/sdio/cpp/banjo-mock.h>
 #include <zxtest/zxtest.h>
 
+#include "../testing/fake_sdio_bus.h"
+
 namespace soliloquy_hal {
 namespace {
 
@@ -78,6 +83,178 @@ TEST_F(SdioHelperTest, WriteByteFailure) {
   mock_sdio_.VerifyAndClear();
 }
 
+TEST_F(SdioHelperTest, Read32NullPointer) {
+  zx_status_t status = helper_->Read32(0x1000, nullptr);
+  EXPECT_EQ(status, ZX_ERR_INVALID_ARGS);
+}
+
+TEST_F(SdioHelperTest, WriteRegsInvalidArgs) {
+  SdioReg reg = {0x1000, 0};
+  EXPECT_EQ(helper_->WriteRegs(nullptr, 1), ZX_ERR_INVALID_ARGS);
+  EXPECT_EQ(helper_->WriteRegs(&reg, 0), ZX_ERR_INVALID_ARGS);
+}
+
+// Card memory that logs every CMD53 it serves, so register tests can check
+// the exact commands SdioHelper issued rather than only the end state.
+class RecordingSdioMemory : public testing::SdioMemory {
+public:
+  struct Cmd53 {
+    bool write;
+    uint32_t addr;
+    size_t len;
+    bool incr;
+    std::vector<uint8_t> data;
+  };
+
+  zx_status_t Read(uint32_t addr, uint8_t *buf, size_t len,
+                   bool incr) override {
+    zx_status_t status = SdioMemory::Read(addr, buf, len, incr);
+    log_.push_back(
+        {false, addr, len, incr, std::vector<uint8_t>(buf, buf + len)});
+    return status;
+  }
+  zx_status_t Write(uint32_t addr, const uint8_t *buf, size_t len,
+                    bool incr) override {
+    log_.push_back(
+        {true, addr, len, incr, std::vector<uint8_t>(buf, buf + len)});
+    return SdioMemory::Write(addr, buf, len, incr);
+  }
+
+  const std::vector<Cmd53> &log() const { return log_; }
+
+private:
+  std::vector<Cmd53> log_;
+};
+
+class SdioRegsTest : public zxtest::Test {
+protected:
+  void SetUp() override {
+    bus_.set_device(&card_);
+    bus_.set_timing(testing::SdioTiming::Instant());
+    client_ = ddk::SdioProtocolClient(bus_.GetProto());
+    helper_ = std::make_unique<SdioHelper>(&client_);
+  }
+
+  RecordingSdioMemory card_;
+  testing::FakeSdioBus bus_;
+  ddk::SdioProtocolClient client_;
+  std::unique_ptr<SdioHelper> helper_;
+};
+
+TEST_F(SdioRegsTest, AdjacentWritesAreOneIncrementingCmd53) {
+  const SdioReg regs[] = {
+      {0x100, 0x11223344}, {0x104, 0x55667788},
+      {0x108, 0x99AABBCC}, {0x10C, 0xDDEEFF00},
+  };
+  ASSERT_OK(helper_->WriteRegs(regs, std::size(regs)));
+
+  ASSERT_EQ(card_.log().size(), 1u);
+  const auto &cmd = card_.log()[0];
+  EXPECT_TRUE(cmd.write);
+  EXPECT_TRUE(cmd.incr);
+  EXPECT_EQ(cmd.addr, 0x100u);
+  EXPECT_EQ(cmd.len, 16u);
+  const uint8_t expected[] = {0x44, 0x33, 0x22, 0x11, 0x88, 0x77, 0x66, 0x55,
+                              0xCC, 0xBB, 0xAA, 0x99, 0x00, 0xFF, 0xEE, 0xDD};
+  EXPECT_BYTES_EQ(cmd.data.data(), expected, sizeof(expected));
+
+  // Shorter than a block, so byte mode and no CMD52s.
+  testing::SdioBusStats stats = bus_.stats();
+  EXPECT_EQ(stats.cmd53_writes, 1u);
+  EXPECT_EQ(stats.cmd53_block_mode, 0u);
+  EXPECT_EQ(stats.cmd52(), 0u);
+}
+
+TEST_F(SdioRegsTest, FullBlockRunIsOneBlockModeCmd53) {
+  // 128 adjacent registers fill exactly one block; the 129th starts a new
+  // command.
+  constexpr size_t kCount = 129;
+  std::vector<SdioReg> regs(kCount);
+  for (size_t i = 0; i < kCount; i++) {
+    regs[i] = {static_cast<uint32_t>(0x1000 + i * 4),
+               static_cast<uint32_t>(i)};
+  }
+  ASSERT_OK(helper_->WriteRegs(regs.data(), regs.size()));
+
+  ASSERT_EQ(card_.log().size(), 2u);
+  EXPECT_EQ(card_.log()[0].addr, 0x1000u);
+  EXPECT_EQ(card_.log()[0].len, 512u);
+  EXPECT_TRUE(card_.log()[0].incr);
+  EXPECT_EQ(card_.log()[1].addr, 0x1200u);
+  EXPECT_EQ(card_.log()[1].len, 4u);
+  EXPECT_TRUE(card_.log()[1].incr);
+
+  testing::SdioBusStats stats = bus_.stats();
+  EXPECT_EQ(stats.cmd53_writes, 2u);
+  EXPECT_EQ(stats.cmd53_block_mode, 1u);
+  EXPECT_EQ(stats.blocks, 1u);
+}
+
+TEST_F(SdioRegsTest, NonAdjacentWritesAreSeparateTransfers) {
+  // A gap, a backwards step and a repeat each end a run.
+  const SdioReg regs[] = {
+      {0x200, 1}, {0x204, 2}, {0x20C, 3}, {0x208, 4}, {0x208, 5},
+  };
+  ASSERT_OK(helper_->WriteRegs(regs, std::size(regs)));
+
+  struct {
+    uint32_t addr;
+    size_t len;
+    uint8_t first;
+  } const expected[] = {
+      {0x200, 8, 1}, {0x20C, 4, 3}, {0x208, 4, 4}, {0x208, 4, 5},
+  };
+  ASSERT_EQ(card_.log().size(), std::size(expected));
+  for (size_t i = 0; i < std::size(expected); i++) {
+    const auto &cmd = card_.log()[i];
+    EXPECT_TRUE(cmd.write, "command %zu", i);
+    EXPECT_TRUE(cmd.incr, "command %zu", i);
+    EXPECT_EQ(cmd.addr, expected[i].addr, "command %zu", i);
+    EXPECT_EQ(cmd.len, expected[i].len, "command %zu", i);
+    EXPECT_EQ(cmd.data[0], expected[i].first, "command %zu", i);
+  }
+
+  uint32_t val = 0;
+  ASSERT_OK(helper_->Read32(0x208, &val));
+  EXPECT_EQ(val, 5u);
+}
+
+TEST_F(SdioRegsTest, ReadsUseIncrementingCmd53) {
+  const SdioReg regs[] = {
+      {0x300, 0xA0A1A2A3}, {0x304, 0xB0B1B2B3}, {0x308, 0xC0C1C2C3},
+  };
+  ASSERT_OK(helper_->WriteRegs(regs, std::size(regs)));
+
+  uint32_t vals[3] = {};
+  ASSERT_OK(helper_->ReadRegs(0x300, vals, std::size(vals)));
+  EXPECT_EQ(vals[0], 0xA0A1A2A3u);
+  EXPECT_EQ(vals[1], 0xB0B1B2B3u);
+  EXPECT_EQ(vals[2], 0xC0C1C2C3u);
+
+  uint32_t val = 0;
+  ASSERT_OK(helper_->Read32(0x304, &val));
+  EXPECT_EQ(val, 0xB0B1B2B3u);
+
+  ASSERT_EQ(card_.log().size(), 3u);
+  EXPECT_FALSE(card_.log()[1].write);
+  EXPECT_TRUE(card_.log()[1].incr);
+  EXPECT_EQ(card_.log()[1].addr, 0x300u);
+  EXPECT_EQ(card_.log()[1].len, 12u);
+  EXPECT_FALSE(card_.log()[2].write);
+  EXPECT_TRUE(card_.log()[2].incr);
+  EXPECT_EQ(card_.log()[2].addr, 0x304u);
+  EXPECT_EQ(card_.log()[2].len, 4u);
+  EXPECT_EQ(bus_.stats().cmd52(), 0u);
+}
+
+TEST_F(SdioRegsTest, WriteRegsStopsAtFirstFailedRun) {
+  const SdioReg regs[] = {{0x400, 1}, {0x404, 2}, {0x500, 3}};
+  bus_.InjectError(ZX_ERR_IO, 1);
+  EXPECT_EQ(helper_->WriteRegs(regs, std::size(regs)), ZX_ERR_IO);
+  ASSERT_EQ(card_.log().size(), 1u);
+  EXPECT_EQ(card_.log()[0].addr, 0x400u);
+}
+
 TEST_F(SdioHelperTest, ReadMultiBlockNullBuffer) {
   uint8_t* null_buf = nullptr;
   zx_status_t status = helper_->ReadMultiBlock(0x5000, null_buf, 100);
@@ -106,14 +283,10 @@ TEST_F(SdioHelperTest, ReadMultiBlockSingleBlock) {
 
 TEST_F(SdioHelperTest, ReadMultiBlockMultipleBlocks) {
   constexpr uint32_t kAddress = 0x7000;
-  constexpr size_t kBlockSize = 512;
   constexpr size_t kLength = 1024;
   uint8_t buffer[kLength];
   
-  mock_sdio_.ExpectDoRwTxn(kAddress, buffer, kBlockSize, false, false)
-      .Return(ZX_OK);
-  mock_sdio_.ExpectDoRwTxn(kAddress + kBlockSize, buffer + kBlockSize, 
-                           kBlockSize, false, false)
+  mock_sdio_.ExpectDoRwTxn(kAddress, buffer, kLength, false, false)
       .Return(ZX_OK);
   
   zx_status_t status = helper_->ReadMultiBlock(kAddress, buffer, kLength);
@@ -136,12 +309,30 @@ TEST_F(SdioHelperTest, ReadMultiBlockPartialBlock) {
   mock_sdio_.VerifyAndClear();
 }
 
+TEST_F(SdioHelperTest, ReadMultiBlockBodyAndTail) {
+  constexpr uint32_t kAddress = 0x8800;
+  constexpr size_t kBody = 1024;
+  constexpr size_t kLength = kBody + 76;
+  uint8_t buffer[kLength];
+  
+  mock_sdio_.ExpectDoRwTxn(kAddress, buffer, kBody, false, false)
+      .Return(ZX_OK);
+  mock_sdio_.ExpectDoRwTxn(kAddress + kBody, buffer + kBody, kLength - kBody,
+                           false, false)
+      .Return(ZX_OK);
+  
+  zx_status_t status = helper_->ReadMultiBlock(kAddress, buffer, kLength);
+  
+  EXPECT_OK(status);
+  mock_sdio_.VerifyAndClear();
+}
+
 TEST_F(SdioHelperTest, ReadMultiBlockFailureFirstBlock) {
   constexpr uint32_t kAddress = 0x9000;
   constexpr size_t kLength = 1024;
   uint8_t buffer[kLength];
   
-  mock_sdio_.ExpectDoRwTxn(kAddress, buffer, 512, false, false)
+  mock_sdio_.ExpectDoRwTxn(kAddress, buffer, kLength, false, false)
       .Return(ZX_ERR_IO);
   
   zx_status_t status = helper_->ReadMultiBlock(kAddress, buffer, kLength);
@@ -150,16 +341,16 @@ TEST_F(SdioHelperTest, ReadMultiBlockFailureFirstBlock) {
   mock_sdio_.VerifyAndClear();
 }
 
-TEST_F(SdioHelperTest, ReadMultiBlockFailureSecondBlock) {
+TEST_F(SdioHelperTest, ReadMultiBlockFailureTail) {
   constexpr uint32_t kAddress = 0xA000;
-  constexpr size_t kBlockSize = 512;
-  constexpr size_t kLength = 1024;
+  constexpr size_t kBody = 1024;
+  constexpr size_t kLength = kBody + 100;
   uint8_t buffer[kLength];
   
-  mock_sdio_.ExpectDoRwTxn(kAddress, buffer, kBlockSize, false, false)
+  mock_sdio_.ExpectDoRwTxn(kAddress, buffer, kBody, false, false)
       .Return(ZX_OK);
-  mock_sdio_.ExpectDoRwTxn(kAddress + kBlockSize, buffer + kBlockSize, 
-                           kBlockSize, false, false)
+  mock_sdio_.ExpectDoRwTxn(kAddress + kBody, buffer + kBody, 
+                           kLength - kBody, false, false)
       .Return(ZX_ERR_INTERNAL);
   
   zx_status_t status = helper_->ReadMultiBlock(kAddress, buffer, kLength);
@@ -197,7 +388,6 @@ TEST_F(SdioHelperTest, WriteMultiBlockSingleBlock) {
 
 TEST_F(SdioHelperTest, WriteMultiBlockMultipleBlocks) {
   constexpr uint32_t kAddress = 0xD000;
-  constexpr size_t kBlockSize = 512;
   constexpr size_t kLength = 1024;
   uint8_t buffer[kLength] = {0};
   
@@ -206,11 +396,7 @@ TEST_F(SdioHelperTest, WriteMultiBlockMultipleBlocks) {
   }
   
   mock_sdio_.ExpectDoRwTxn(kAddress, const_cast<uint8_t*>(buffer), 
-                           kBlockSize, true, false)
-      .Return(ZX_OK);
-  mock_sdio_.ExpectDoRwTxn(kAddress + kBlockSize, 
-                           const_cast<uint8_t*>(buffer + kBlockSize), 
-                           kBlockSize, true, false)
+                           kLength, true, false)
       .Return(ZX_OK);
   
   zx_status_t status = helper_->WriteMultiBlock(kAddress, buffer, kLength);
@@ -221,16 +407,16 @@ TEST_F(SdioHelperTest, WriteMultiBlockMultipleBlocks) {
 
 TEST_F(SdioHelperTest, WriteMultiBlockFailurePropagation) {
   constexpr uint32_t kAddress = 0xE000;
-  constexpr size_t kBlockSize = 512;
-  constexpr size_t kLength = 1536;
+  constexpr size_t kBody = 1536;
+  constexpr size_t kLength = kBody + 64;
   uint8_t buffer[kLength] = {0};
   
   mock_sdio_.ExpectDoRwTxn(kAddress, const_cast<uint8_t*>(buffer), 
-                           kBlockSize, true, false)
+                           kBody, true, false)
       .Return(ZX_OK);
-  mock_sdio_.ExpectDoRwTxn(kAddress + kBlockSize, 
-                           const_cast<uint8_t*>(buffer + kBlockSize), 
-                           kBlockSize, true, false)
+  mock_sdio_.ExpectDoRwTxn(kAddress + kBody, 
+                           const_cast<uint8_t*>(buffer + kBody), 
+                           kLength - kBody, true, false)
       .Return(ZX_ERR_NOT_SUPPORTED);
   
   zx_status_t status = helper_->WriteMultiBlock(kAddress, buffer, kLength);
@@ -264,18 +450,123 @@ TEST_F(SdioHelperTest, WriteMultiBlockWiFiDriverPattern) {
   }
   
   mock_sdio_.ExpectDoRwTxn(kRegAddr, const_cast<uint8_t*>(tx_buffer), 
-                           512, true, false).Return(ZX_OK);
-  mock_sdio_.ExpectDoRwTxn(kRegAddr + 512, const_cast<uint8_t*>(tx_buffer + 512), 
-                           512, true, false).Return(ZX_OK);
-  mock_sdio_.ExpectDoRwTxn(kRegAddr + 1024, const_cast<uint8_t*>(tx_buffer + 1024), 
-                           512, true, false).Return(ZX_OK);
-  mock_sdio_.ExpectDoRwTxn(kRegAddr + 1536, const_cast<uint8_t*>(tx_buffer + 1536), 
-                           512, true, false).Return(ZX_OK);
+                           kDataLength, true, false).Return(ZX_OK);
   
   zx_status_t status = helper_->WriteMultiBlock(kRegAddr, tx_buffer, kDataLength);
   EXPECT_OK(status);
   mock_sdio_.VerifyAndClear();
 }
 
+TEST_F(SdioHelperTest, WriteMultiBlockSplitsAtMaxBlockCount) {
+  constexpr uint32_t kAddress = 0x00200000;
+  constexpr size_t kMaxTxnBytes = 511 * 512;
+  constexpr size_t kLength = kMaxTxnBytes + 512;
+  static uint8_t buffer[kLength];
+  
+  mock_sdio_.ExpectDoRwTxn(kAddress, buffer, kMaxTxnBytes, true, false)
+      .Return(ZX_OK);
+  mock_sdio_.ExpectDoRwTxn(kAddress + kMaxTxnBytes, buffer + kMaxTxnBytes,
+                           512, true, false)
+      .Return(ZX_OK);
+  
+  zx_status_t status = helper_->WriteMultiBlock(kAddress, buffer, kLength);
+  EXPECT_OK(status);
+  mock_sdio_.VerifyAndClear();
+}
+
+TEST_F(SdioHelperTest, ScatterInvalidArgs) {
+  uint8_t buffer[16];
+  SdioSegment empty = {buffer, 0};
+  SdioSegment null_data = {nullptr, 16};
+  
+  EXPECT_EQ(helper_->WriteScatter(0x1000, nullptr, 1), ZX_ERR_INVALID_ARGS);
+  EXPECT_EQ(helper_->ReadScatter(0x1000, &empty, 0), ZX_ERR_INVALID_ARGS);
+  EXPECT_EQ(helper_->WriteScatter(0x1000, &empty, 1), ZX_ERR_INVALID_ARGS);
+  EXPECT_EQ(helper_->ReadScatter(0x1000, &null_data, 1), ZX_ERR_INVALID_ARGS);
+}
+
+TEST_F(SdioHelperTest, WriteScatterBlockAlignedSegments) {
+  constexpr uint32_t kAddress = 0x3000;
+  uint8_t header[512] = {0};
+  uint8_t payload[1024] = {0};
+  uint8_t trailer[100] = {0};
+  const SdioSegment segs[] = {
+      {header, sizeof(header)},
+      {payload, sizeof(payload)},
+      {trailer, sizeof(trailer)},
+  };
+  
+  mock_sdio_.ExpectDoRwTxn(kAddress, header, sizeof(header), true, false)
+      .Return(ZX_OK);
+  mock_sdio_.ExpectDoRwTxn(kAddress + 512, payload, sizeof(payload), true,
+                           false)
+      .Return(ZX_OK);
+  mock_sdio_.ExpectDoRwTxn(kAddress + 1536, trailer, sizeof(trailer), true,
+                           false)
+      .Return(ZX_OK);
+  
+  zx_status_t status = helper_->WriteScatter(kAddress, segs, std::size(segs));
+  EXPECT_OK(status);
+  mock_sdio_.VerifyAndClear();
+}
+
+TEST_F(SdioHelperTest, ReadScatterBlockAlignedSegments) {
+  constexpr uint32_t kAddress = 0x4000;
+  uint8_t first[1024];
+  uint8_t second[512];
+  const SdioSegment segs[] = {
+      {first, sizeof(first)},
+      {second, sizeof(second)},
+  };
+  
+  mock_sdio_.ExpectDoRwTxn(kAddress, first, sizeof(first), false, false)
+      .Return(ZX_OK);
+  mock_sdio_.ExpectDoRwTxn(kAddress + 1024, second, sizeof(second), false,
+                           false)
+      .Return(ZX_OK);
+  
+  zx_status_t status = helper_->ReadScatter(kAddress, segs, std::size(segs));
+  EXPECT_OK(status);
+  mock_sdio_.VerifyAndClear();
+}
+
+TEST_F(SdioHelperTest, RegisterVmoInvalidArgs) {
+  zx::vmo vmo;
+  ASSERT_OK(zx::vmo::create(4096, 0, &vmo));
+  
+  EXPECT_EQ(helper_->RegisterVmo(1, zx::vmo(), 0, 4096, SDMMC_VMO_RIGHT_READ),
+            ZX_ERR_INVALID_ARGS);
+  EXPECT_EQ(helper_->RegisterVmo(1, std::move(vmo), 0, 0, SDMMC_VMO_RIGHT_READ),
+            ZX_ERR_INVALID_ARGS);
+}
+
+TEST_F(SdioHelperTest, TransferVmoZeroLength) {
+  EXPECT_EQ(helper_->TransferVmo(0x1000, 1, 0, 0, true), ZX_ERR_INVALID_ARGS);
+}
+
+TEST_F(SdioHelperTest, DownloadFirmwareStreamInvalidArgs) {
+  auto next = [](void *, uint8_t *, size_t, size_t *) -> zx_status_t {
+    return ZX_ERR_STOP;
+  };
+  size_t written;
+
+  FirmwareChunkSource no_fn = {nullptr, nullptr, 4096};
+  EXPECT_EQ(helper_->DownloadFirmwareStream(no_fn, 0, 4096, &written),
+            ZX_ERR_INVALID_ARGS);
+
+  FirmwareChunkSource no_chunk = {next, nullptr, 0};
+  EXPECT_EQ(helper_->DownloadFirmwareStream(no_chunk, 0, 4096, &written),
+            ZX_ERR_INVALID_ARGS);
+
+  FirmwareChunkSource huge_chunk = {next, nullptr,
+                                    SdioHelper::kMaxStreamChunk + 1};
+  EXPECT_EQ(helper_->DownloadFirmwareStream(huge_chunk, 0, 4096, &written),
+            ZX_ERR_INVALID_ARGS);
+
+  FirmwareChunkSource ok = {next, nullptr, 4096};
+  EXPECT_EQ(helper_->DownloadFirmwareStream(ok, 0, 4096, nullptr),
+            ZX_ERR_INVALID_ARGS);
+}
+
 } // namespace
 } // namespace soliloquy_hal
@@ -1,23 +1,40 @@
 #include "gpio.h"
 
+#include <fbl/auto_lock.h>
 #include <lib/ddk/debug.h>
 #include <lib/ddk/device.h>
 #include <lib/ddk/driver.h>
 #include <lib/ddk/platform-defs.h>
+#include <lib/device-protocol/pdev.h>
 #include <zircon/status.h>
 #include <zircon/types.h>
 
 #include <memory>
+#include <utility>
 
 namespace soliloquy_gpio {
 
+namespace {
+
+soliloquy_hal::Histogram init_us("soliloquy-gpio.init_us");
+soliloquy_hal::Counter irq_events("soliloquy-gpio.irq_events");
+soliloquy_hal::Counter irq_spurious("soliloquy-gpio.irq_spurious");
+
+} // namespace
+
 SoliloquyGpio::SoliloquyGpio(zx_device_t *parent) : SoliloquyGpioType(parent) {}
 
+SoliloquyGpio::SoliloquyGpio(zx_device_t *parent, ddk::MmioBuffer mmio)
+    : SoliloquyGpioType(parent), gpio_mmio_(std::move(mmio)) {}
+
 SoliloquyGpio::~SoliloquyGpio() {}
 
 zx_status_t SoliloquyGpio::Bind(void *ctx, zx_device_t *device) {
   auto dev = std::make_unique<SoliloquyGpio>(device);
-  zx_status_t status = dev->DdkAdd("soliloquy-gpio");
+  soliloquy_hal::PublishMetrics(dev->inspector_);
+  zx_status_t status = dev->DdkAdd(ddk::DeviceAddArgs("soliloquy-gpio")
+                                       .set_inspect_vmo(
+                                           dev->inspector_.DuplicateVmo()));
   if (status != ZX_OK) {
     zxlogf(ERROR, "soliloquy-gpio: Could not create device: %s",
            zx_status_get_string(status));
@@ -29,113 +46,601 @@ zx_status_t SoliloquyGpio::Bind(void *ctx, zx_device_t *device) {
 
 void SoliloquyGpio::DdkInit(ddk::InitTxn txn) {
   zx_status_t status = InitHw();
+  if (status == ZX_OK && StartIrqThread() != ZX_OK) {
+    // Pin I/O still works without the bank interrupts.
+    zxlogf(WARNING, "soliloquy-gpio: GPIO interrupts unavailable");
+  }
   txn.Reply(status);
 }
 
-void SoliloquyGpio::DdkUnbind(ddk::UnbindTxn txn) { txn.Reply(); }
+void SoliloquyGpio::DdkUnbind(ddk::UnbindTxn txn) {
+  StopIrqThread();
+  txn.Reply();
+}
 
 void SoliloquyGpio::DdkRelease() { delete this; }
 
 zx_status_t SoliloquyGpio::InitHw() {
+  SOLILOQUY_TIMED_SCOPE(init_us, "gpio_init");
   zxlogf(INFO, "soliloquy-gpio: Initializing GPIO controller...");
 
-  zx_status_t status =
-      ddk::MmioBuffer::Create(kGpioBaseAddr, kGpioMmioSize, zx::resource(),
-                              ZX_CACHE_POLICY_UNCACHED_DEVICE, &gpio_mmio_);
-
-  if (status != ZX_OK) {
-    zxlogf(ERROR, "soliloquy-gpio: Failed to map GPIO MMIO: %s",
-           zx_status_get_string(status));
-    return status;
+  zx_status_t status;
+  if (!gpio_mmio_) {
+    status =
+        ddk::MmioBuffer::Create(kGpioBaseAddr, kGpioMmioSize, zx::resource(),
+                                ZX_CACHE_POLICY_UNCACHED_DEVICE, &gpio_mmio_);
+    if (status != ZX_OK) {
+      zxlogf(ERROR, "soliloquy-gpio: Failed to map GPIO MMIO: %s",
+             zx_status_get_string(status));
+      return status;
+    }
   }
 
+  fbl::AutoLock lock(&lock_);
   mmio_helper_ =
       std::make_unique<soliloquy_hal::MmioHelper>(&gpio_mmio_.value());
 
+  // Config, drive and pull registers only change when we write them, so
+  // their RMWs can skip the device read. Data stays volatile for inputs.
+  for (uint32_t bank = 0; bank < kBankCount; bank++) {
+    status = mmio_helper_->SetRegPolicy(BankBase(bank) + kGpioCfgReg,
+                                        kGpioDataReg - kGpioCfgReg,
+                                        soliloquy_hal::RegPolicy::kShadowed);
+    if (status == ZX_OK) {
+      status = mmio_helper_->SetRegPolicy(BankBase(bank) + kGpioDrvReg,
+                                          kBankStride - kGpioDrvReg,
+                                          soliloquy_hal::RegPolicy::kShadowed);
+    }
+    if (status != ZX_OK) {
+      zxlogf(ERROR, "soliloquy-gpio: Failed to set up register shadow: %s",
+             zx_status_get_string(status));
+      return status;
+    }
+  }
+
   zxlogf(INFO, "soliloquy-gpio: GPIO controller initialized");
   return ZX_OK;
 }
 
-zx_status_t SoliloquyGpio::GpioConfigIn(uint32_t flags) {
+zx_status_t SoliloquyGpio::PinLocation(uint32_t index, uint32_t *out_bank,
+                                       uint32_t *out_pin) {
+  if (index >= kBankCount * kPinsPerBank) {
+    return ZX_ERR_OUT_OF_RANGE;
+  }
+  *out_bank = index / kPinsPerBank;
+  *out_pin = index % kPinsPerBank;
+  return ZX_OK;
+}
+
+void SoliloquyGpio::AddFunction(soliloquy_hal::RegisterProgram &program,
+                                uint32_t bank, uint32_t mask,
+                                uint32_t function) {
+  for (uint32_t pin = 0; pin < kPinsPerBank; pin++) {
+    if (mask & (1u << pin)) {
+      uint32_t shift = (pin % 8) * 4;
+      program.ModifyBits32(CfgReg(bank, pin), 0xFu << shift,
+                           function << shift);
+    }
+  }
+}
+
+zx_status_t SoliloquyGpio::GpioImplConfigIn(uint32_t index, uint32_t flags) {
+  uint32_t bank, pin;
+  zx_status_t status = PinLocation(index, &bank, &pin);
+  if (status != ZX_OK) {
+    return status;
+  }
+
+  uint32_t pull;
+  switch (flags & GPIO_PULL_MASK) {
+  case GPIO_PULL_UP:
+    pull = kPullUp;
+    break;
+  case GPIO_PULL_DOWN:
+    pull = kPullDown;
+    break;
+  default:
+    pull = kPullNone;
+    break;
+  }
+
+  fbl::AutoLock lock(&lock_);
   if (!mmio_helper_) {
     return ZX_ERR_BAD_STATE;
   }
 
-  mmio_helper_->ClearBits32(kGpioDirReg, 1);
+  uint32_t pull_shift = (pin % 16) * 2;
+  soliloquy_hal::RegisterProgram program;
+  AddFunction(program, bank, 1u << pin, kFuncInput);
+  program.ModifyBits32(PullReg(bank, pin), 0x3u << pull_shift,
+                       pull << pull_shift);
+  status = mmio_helper_->Apply(program);
+  if (status != ZX_OK) {
+    return status;
+  }
+
+  zxlogf(DEBUG, "soliloquy-gpio: Configured pin %u as input", index);
+  return ZX_OK;
+}
 
-  constexpr uint32_t GPIO_PULL_UP = 0x1;
-  constexpr uint32_t GPIO_PULL_DOWN = 0x2;
+zx_status_t SoliloquyGpio::GpioImplConfigOut(uint32_t index,
+                                             uint8_t initial_value) {
+  uint32_t bank, pin;
+  zx_status_t status = PinLocation(index, &bank, &pin);
+  if (status != ZX_OK) {
+    return status;
+  }
 
-  if (flags & GPIO_PULL_UP) {
-    mmio_helper_->SetBits32(kGpioPullReg, 0x1);
-  } else if (flags & GPIO_PULL_DOWN) {
-    mmio_helper_->SetBits32(kGpioPullReg, 0x2);
-  } else {
-    mmio_helper_->ClearBits32(kGpioPullReg, 0x3);
+  status = ConfigOutPins(bank, 1u << pin, initial_value ? 1u << pin : 0);
+  if (status != ZX_OK) {
+    return status;
   }
 
-  zxlogf(DEBUG, "soliloquy-gpio: Configured pin as input");
+  zxlogf(DEBUG, "soliloquy-gpio: Configured pin %u as output", index);
   return ZX_OK;
 }
 
-zx_status_t SoliloquyGpio::GpioConfigOut(uint8_t initial_value) {
+zx_status_t SoliloquyGpio::GpioImplSetAltFunction(uint32_t index,
+                                                  uint64_t function) {
+  uint32_t bank, pin;
+  zx_status_t status = PinLocation(index, &bank, &pin);
+  if (status != ZX_OK) {
+    return status;
+  }
+  if (function > kFuncMax) {
+    return ZX_ERR_OUT_OF_RANGE;
+  }
+
+  fbl::AutoLock lock(&lock_);
   if (!mmio_helper_) {
     return ZX_ERR_BAD_STATE;
   }
 
-  mmio_helper_->SetBits32(kGpioDirReg, 1);
+  soliloquy_hal::RegisterProgram program;
+  AddFunction(program, bank, 1u << pin, static_cast<uint32_t>(function));
+  status = mmio_helper_->Apply(program);
+  if (status != ZX_OK) {
+    return status;
+  }
+
+  zxlogf(DEBUG, "soliloquy-gpio: Setting pin %u alt function %lu", index,
+         function);
+  return ZX_OK;
+}
+
+zx_status_t SoliloquyGpio::GpioImplSetDriveStrength(uint32_t index,
+                                                    uint64_t ua,
+                                                    uint64_t *out_actual_ua) {
+  uint32_t bank, pin;
+  zx_status_t status = PinLocation(index, &bank, &pin);
+  if (status != ZX_OK) {
+    return status;
+  }
+
+  // Use the strongest level that does not exceed the request, or the
+  // weakest level for requests below it.
+  uint64_t level = ua / kDriveStepUa;
+  level = level == 0 ? 0 : level - 1;
+  if (level > kDriveMaxLevel) {
+    level = kDriveMaxLevel;
+  }
 
-  if (initial_value) {
-    mmio_helper_->SetBits32(kGpioDataReg, 1);
-  } else {
-    mmio_helper_->ClearBits32(kGpioDataReg, 1);
+  fbl::AutoLock lock(&lock_);
+  if (!mmio_helper_) {
+    return ZX_ERR_BAD_STATE;
   }
 
-  zxlogf(DEBUG, "soliloquy-gpio: Configured pin as output");
+  uint32_t shift = (pin % 16) * 2;
+  mmio_helper_->ModifyBits32(DrvReg(bank, pin), 0x3u << shift,
+                             static_cast<uint32_t>(level) << shift);
+  if (out_actual_ua) {
+    *out_actual_ua = (level + 1) * kDriveStepUa;
+  }
   return ZX_OK;
 }
 
-zx_status_t SoliloquyGpio::GpioSetAltFunction(uint64_t function) {
-  zxlogf(DEBUG, "soliloquy-gpio: Setting alt function %lu", function);
+zx_status_t SoliloquyGpio::GpioImplGetDriveStrength(uint32_t index,
+                                                    uint64_t *out_value) {
+  uint32_t bank, pin;
+  zx_status_t status = PinLocation(index, &bank, &pin);
+  if (status != ZX_OK) {
+    return status;
+  }
+  if (!out_value) {
+    return ZX_ERR_INVALID_ARGS;
+  }
+
+  fbl::AutoLock lock(&lock_);
+  if (!mmio_helper_) {
+    return ZX_ERR_BAD_STATE;
+  }
+
+  uint32_t shift = (pin % 16) * 2;
+  uint32_t level =
+      mmio_helper_->ReadMasked32(DrvReg(bank, pin), 0x3u << shift, shift);
+  *out_value = (level + 1) * kDriveStepUa;
   return ZX_OK;
 }
 
-zx_status_t SoliloquyGpio::GpioRead(uint8_t *out_value) {
-  if (!mmio_helper_ || !out_value) {
+zx_status_t SoliloquyGpio::GpioImplRead(uint32_t index, uint8_t *out_value) {
+  uint32_t bank, pin;
+  zx_status_t status = PinLocation(index, &bank, &pin);
+  if (status != ZX_OK) {
+    return status;
+  }
+  if (!out_value) {
     return ZX_ERR_INVALID_ARGS;
   }
 
-  uint32_t val = mmio_helper_->Read32(kGpioDataReg);
-  *out_value = (val & 1) ? 1 : 0;
+  uint32_t value;
+  status = ReadPins(bank, 1u << pin, &value);
+  if (status != ZX_OK) {
+    return status;
+  }
+  *out_value = value ? 1 : 0;
+  return ZX_OK;
+}
+
+zx_status_t SoliloquyGpio::GpioImplWrite(uint32_t index, uint8_t value) {
+  uint32_t bank, pin;
+  zx_status_t status = PinLocation(index, &bank, &pin);
+  if (status != ZX_OK) {
+    return status;
+  }
+  return WritePins(bank, 1u << pin, value ? 1u << pin : 0);
+}
+
+zx_status_t SoliloquyGpio::StartIrqThread() {
+  ddk::PDevProtocolClient pdev(parent());
+  if (!pdev.is_valid()) {
+    return ZX_ERR_NOT_SUPPORTED;
+  }
+
+  zx_status_t status = zx::port::create(ZX_PORT_BIND_TO_INTERRUPT, &irq_port_);
+  if (status != ZX_OK) {
+    zxlogf(ERROR, "soliloquy-gpio: Failed to create IRQ port: %s",
+           zx_status_get_string(status));
+    return status;
+  }
+
+  // The board lists one interrupt per bank, in bank order; banks past the
+  // end of the list simply cannot deliver pin interrupts.
+  uint32_t bound = 0;
+  for (uint32_t bank = 0; bank < kBankCount; bank++) {
+    if (pdev.GetInterrupt(bank, 0, &bank_irqs_[bank]) != ZX_OK) {
+      break;
+    }
+    status = bank_irqs_[bank].bind(irq_port_, bank, 0);
+    if (status != ZX_OK) {
+      zxlogf(ERROR, "soliloquy-gpio: Failed to bind bank %u interrupt: %s",
+             bank, zx_status_get_string(status));
+      return status;
+    }
+    bound++;
+  }
+  if (bound == 0) {
+    return ZX_ERR_NOT_SUPPORTED;
+  }
 
+  int rc = thrd_create_with_name(
+      &irq_thread_,
+      [](void *arg) { return static_cast<SoliloquyGpio *>(arg)->IrqThread(); },
+      this, "soliloquy-gpio-irq");
+  if (rc != thrd_success) {
+    zxlogf(ERROR, "soliloquy-gpio: Failed to start IRQ thread");
+    return ZX_ERR_NO_RESOURCES;
+  }
+  irq_thread_started_ = true;
+  {
+    fbl::AutoLock lock(&lock_);
+    irq_banks_ = (1u << bound) - 1;
+  }
+  zxlogf(INFO, "soliloquy-gpio: %u bank interrupts ready", bound);
   return ZX_OK;
 }
 
-zx_status_t SoliloquyGpio::GpioWrite(uint8_t value) {
+void SoliloquyGpio::StopIrqThread() {
+  if (!irq_thread_started_) {
+    return;
+  }
+
+  {
+    fbl::AutoLock lock(&lock_);
+    irq_banks_ = 0;
+  }
+
+  zx_port_packet_t packet = {};
+  packet.key = kPortKeyStop;
+  packet.type = ZX_PKT_TYPE_USER;
+  irq_port_.queue(&packet);
+  thrd_join(irq_thread_, nullptr);
+  irq_thread_started_ = false;
+
+  for (zx::interrupt &irq : bank_irqs_) {
+    irq.destroy();
+  }
+
+  fbl::AutoLock lock(&lock_);
+  for (PinIrq &pin : pin_irqs_) {
+    if (pin.virq.is_valid()) {
+      pin.virq.destroy();
+      pin.virq.reset();
+    }
+  }
+}
+
+int SoliloquyGpio::IrqThread() {
+  while (true) {
+    zx_port_packet_t packet;
+    zx_status_t status = irq_port_.wait(zx::time::infinite(), &packet);
+    if (status != ZX_OK) {
+      zxlogf(ERROR, "soliloquy-gpio: IRQ port wait failed: %s",
+             zx_status_get_string(status));
+      return status;
+    }
+    if (packet.key == kPortKeyStop) {
+      return 0;
+    }
+
+    if (packet.key < kBankCount) {
+      uint32_t bank = static_cast<uint32_t>(packet.key);
+      HandleBankIrq(bank, zx::time(packet.interrupt.timestamp));
+      bank_irqs_[bank].ack();
+    }
+  }
+}
+
+// Demultiplexes one bank interrupt into the per-pin virtual interrupts.
+// Status is cleared before the consumers are woken so an edge that arrives
+// while they run latches again and raises a fresh bank interrupt.
+void SoliloquyGpio::HandleBankIrq(uint32_t bank, zx::time timestamp) {
+  fbl::AutoLock lock(&lock_);
+  if (!mmio_helper_) {
+    return;
+  }
+
+  uint32_t status_reg = EintBase(bank) + kEintStatusReg;
+  uint32_t pending = mmio_helper_->Read32(status_reg) & eint_enabled_[bank];
+  if (pending == 0) {
+    irq_spurious.Add();
+    return;
+  }
+  mmio_helper_->Write32(status_reg, pending);
+
+  while (pending) {
+    uint32_t pin = __builtin_ctz(pending);
+    pending &= pending - 1;
+    pin_irqs_[bank * kPinsPerBank + pin].virq.trigger(0, timestamp);
+    irq_events.Add();
+  }
+}
+
+zx_status_t SoliloquyGpio::EintMode(uint32_t flags, uint32_t *out_mode) {
+  switch (flags & ZX_INTERRUPT_MODE_MASK) {
+  case ZX_INTERRUPT_MODE_DEFAULT:
+  case ZX_INTERRUPT_MODE_EDGE_HIGH:
+    *out_mode = kEintPosEdge;
+    return ZX_OK;
+  case ZX_INTERRUPT_MODE_EDGE_LOW:
+    *out_mode = kEintNegEdge;
+    return ZX_OK;
+  case ZX_INTERRUPT_MODE_EDGE_BOTH:
+    *out_mode = kEintDoubleEdge;
+    return ZX_OK;
+  case ZX_INTERRUPT_MODE_LEVEL_HIGH:
+  case ZX_INTERRUPT_MODE_LEVEL_LOW:
+    // A level pin re-latches its status as soon as it is cleared, and a
+    // virtual interrupt gives no hook on the consumer's ack to unmask it
+    // from, so the demux thread would spin for as long as the line is held.
+    return ZX_ERR_NOT_SUPPORTED;
+  default:
+    return ZX_ERR_INVALID_ARGS;
+  }
+}
+
+zx_status_t SoliloquyGpio::GpioImplGetInterrupt(uint32_t index,
+                                                uint32_t flags,
+                                                zx::interrupt *out_irq) {
+  uint32_t bank, pin;
+  zx_status_t status = PinLocation(index, &bank, &pin);
+  if (status != ZX_OK) {
+    return status;
+  }
+  uint32_t mode;
+  status = EintMode(flags, &mode);
+  if (status != ZX_OK) {
+    return status;
+  }
+  if (!out_irq) {
+    return ZX_ERR_INVALID_ARGS;
+  }
+
+  fbl::AutoLock lock(&lock_);
   if (!mmio_helper_) {
     return ZX_ERR_BAD_STATE;
   }
+  if (!(irq_banks_ & (1u << bank))) {
+    return ZX_ERR_NOT_SUPPORTED;
+  }
+  PinIrq &pin_irq = pin_irqs_[index];
+  if (pin_irq.virq.is_valid()) {
+    return ZX_ERR_ALREADY_BOUND;
+  }
+
+  zx::interrupt virq;
+  status = zx::interrupt::create(zx::resource(), 0, ZX_INTERRUPT_VIRTUAL, &virq);
+  if (status != ZX_OK) {
+    return status;
+  }
+  status = virq.duplicate(ZX_RIGHT_SAME_RIGHTS, out_irq);
+  if (status != ZX_OK) {
+    return status;
+  }
 
-  if (value) {
-    mmio_helper_->SetBits32(kGpioDataReg, 1);
-  } else {
-    mmio_helper_->ClearBits32(kGpioDataReg, 1);
+  // Select the trigger and the EINT mux, drop any stale status, then enable.
+  uint32_t bit = 1u << pin;
+  uint32_t shift = (pin % 8) * 4;
+  soliloquy_hal::RegisterProgram program;
+  program.ModifyBits32(EintCfgReg(bank, pin), 0xFu << shift, mode << shift);
+  AddFunction(program, bank, bit, kFuncEint);
+  program.Barrier()
+      .Write32(EintBase(bank) + kEintStatusReg, bit)
+      .Barrier()
+      .Write32(EintBase(bank) + kEintCtlReg, eint_enabled_[bank] | bit);
+  status = mmio_helper_->Apply(program);
+  if (status != ZX_OK) {
+    out_irq->reset();
+    return status;
   }
 
+  eint_enabled_[bank] |= bit;
+  pin_irq.virq = std::move(virq);
+  pin_irq.mode = mode;
+  zxlogf(DEBUG, "soliloquy-gpio: Enabled interrupt on pin %u (mode %u)",
+         index, mode);
   return ZX_OK;
 }
 
-zx_status_t SoliloquyGpio::GpioGetInterrupt(uint32_t flags,
-                                            zx::interrupt *out_irq) {
-  return ZX_ERR_NOT_SUPPORTED;
+zx_status_t SoliloquyGpio::GpioImplReleaseInterrupt(uint32_t index) {
+  uint32_t bank, pin;
+  zx_status_t status = PinLocation(index, &bank, &pin);
+  if (status != ZX_OK) {
+    return status;
+  }
+
+  fbl::AutoLock lock(&lock_);
+  PinIrq &pin_irq = pin_irqs_[index];
+  if (!pin_irq.virq.is_valid()) {
+    return ZX_ERR_NOT_FOUND;
+  }
+
+  uint32_t bit = 1u << pin;
+  eint_enabled_[bank] &= ~bit;
+  if (mmio_helper_) {
+    mmio_helper_->Write32(EintBase(bank) + kEintCtlReg, eint_enabled_[bank]);
+    mmio_helper_->Write32(EintBase(bank) + kEintStatusReg, bit);
+  }
+
+  pin_irq.virq.destroy();
+  pin_irq.virq.reset();
+  return ZX_OK;
+}
+
+zx_status_t SoliloquyGpio::GpioImplSetPolarity(uint32_t index,
+                                               gpio_polarity_t polarity) {
+  uint32_t bank, pin;
+  zx_status_t status = PinLocation(index, &bank, &pin);
+  if (status != ZX_OK) {
+    return status;
+  }
+
+  fbl::AutoLock lock(&lock_);
+  PinIrq &pin_irq = pin_irqs_[index];
+  if (!mmio_helper_ || !pin_irq.virq.is_valid()) {
+    return ZX_ERR_BAD_STATE;
+  }
+
+  bool high = polarity == GPIO_POLARITY_HIGH;
+  uint32_t mode = pin_irq.mode;
+  switch (mode) {
+  case kEintPosEdge:
+  case kEintNegEdge:
+    mode = high ? kEintPosEdge : kEintNegEdge;
+    break;
+  default:
+    // Double-edge triggers fire on both polarities already.
+    return ZX_OK;
+  }
+
+  uint32_t shift = (pin % 8) * 4;
+  mmio_helper_->ModifyBits32(EintCfgReg(bank, pin), 0xFu << shift,
+                             mode << shift);
+  pin_irq.mode = mode;
+  return ZX_OK;
 }
 
-zx_status_t SoliloquyGpio::GpioReleaseInterrupt() {
-  return ZX_ERR_NOT_SUPPORTED;
+zx_status_t SoliloquyGpio::SetBankDebounce(uint32_t bank,
+                                           zx::duration period) {
+  if (bank >= kBankCount) {
+    return ZX_ERR_OUT_OF_RANGE;
+  }
+
+  // HOSC with no pre-scale filters ~42ns, which is as close to off as the
+  // hardware gets. Otherwise use the fastest clock setting whose sample
+  // period covers the request, falling back to the slowest (LOSC / 128).
+  uint32_t deb = kDebHosc;
+  if (period > zx::duration(0)) {
+    uint64_t ns = period.get();
+    deb = kDebMaxPrescale << kDebPrescaleShift;
+    bool found = false;
+    for (uint64_t hz : {kHoscHz, kLoscHz}) {
+      for (uint32_t n = 0; n <= kDebMaxPrescale && !found; n++) {
+        if ((ZX_SEC(1) << n) / hz >= ns) {
+          deb = (hz == kHoscHz ? kDebHosc : 0) | (n << kDebPrescaleShift);
+          found = true;
+        }
+      }
+    }
+  }
+
+  fbl::AutoLock lock(&lock_);
+  if (!mmio_helper_) {
+    return ZX_ERR_BAD_STATE;
+  }
+  mmio_helper_->Write32(EintBase(bank) + kEintDebReg, deb);
+  return ZX_OK;
 }
 
-zx_status_t SoliloquyGpio::GpioSetPolarity(gpio_polarity_t polarity) {
-  return ZX_ERR_NOT_SUPPORTED;
+zx_status_t SoliloquyGpio::WritePins(uint32_t bank, uint32_t mask,
+                                     uint32_t value) {
+  if (bank >= kBankCount) {
+    return ZX_ERR_OUT_OF_RANGE;
+  }
+
+  fbl::AutoLock lock(&lock_);
+  if (!mmio_helper_) {
+    return ZX_ERR_BAD_STATE;
+  }
+
+  mmio_helper_->ModifyBits32(DataReg(bank), mask, value);
+  return ZX_OK;
+}
+
+zx_status_t SoliloquyGpio::ReadPins(uint32_t bank, uint32_t mask,
+                                    uint32_t *out_value) {
+  if (bank >= kBankCount) {
+    return ZX_ERR_OUT_OF_RANGE;
+  }
+  if (!out_value) {
+    return ZX_ERR_INVALID_ARGS;
+  }
+
+  fbl::AutoLock lock(&lock_);
+  if (!mmio_helper_) {
+    return ZX_ERR_BAD_STATE;
+  }
+
+  *out_value = mmio_helper_->Read32(DataReg(bank)) & mask;
+  return ZX_OK;
+}
+
+zx_status_t SoliloquyGpio::ConfigOutPins(uint32_t bank, uint32_t mask,
+                                         uint32_t value) {
+  if (bank >= kBankCount) {
+    return ZX_ERR_OUT_OF_RANGE;
+  }
+
+  fbl::AutoLock lock(&lock_);
+  if (!mmio_helper_) {
+    return ZX_ERR_BAD_STATE;
+  }
+
+  // Latch the level before switching direction so the pins never drive a
+  // stale value.
+  soliloquy_hal::RegisterProgram program;
+  program.ModifyBits32(DataReg(bank), mask, value).Barrier();
+  AddFunction(program, bank, mask, kFuncOutput);
+  return mmio_helper_->Apply(program);
 }
 
 static constexpr zx_driver_ops_t soliloquy_gpio_driver_ops = []() {
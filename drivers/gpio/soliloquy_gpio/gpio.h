@@ -2,11 +2,21 @@
 #define DRIVERS_GPIO_SOLILOQUY_GPIO_GPIO_H_
 
 #include <ddktl/device.h>
-#include <fuchsia/hardware/gpio/cpp/banjo.h>
+#include <fbl/auto_lock.h>
+#include <fbl/mutex.h>
+#include <fuchsia/hardware/gpioimpl/cpp/banjo.h>
 #include <lib/ddk/device.h>
 #include <lib/ddk/driver.h>
+#include <lib/inspect/cpp/inspect.h>
 #include <lib/mmio/mmio.h>
+#include <lib/zx/interrupt.h>
+#include <lib/zx/port.h>
+#include <threads.h>
 
+#include <memory>
+#include <optional>
+
+#include "../../common/soliloquy_hal/metrics.h"
 #include "../../common/soliloquy_hal/mmio.h"
 
 namespace soliloquy_gpio {
@@ -15,11 +25,15 @@ class SoliloquyGpio;
 using SoliloquyGpioType =
     ddk::Device<SoliloquyGpio, ddk::Initializable, ddk::Unbindable>;
 
+// Allwinner PIO controller. Pins are addressed as bank * kPinsPerBank + pin,
+// so PB3 is index 35.
 class SoliloquyGpio
     : public SoliloquyGpioType,
-      public ddk::GpioProtocol<SoliloquyGpio, ddk::base_protocol> {
+      public ddk::GpioImplProtocol<SoliloquyGpio, ddk::base_protocol> {
 public:
   explicit SoliloquyGpio(zx_device_t *parent);
+  // For tests: uses |mmio| instead of mapping the PIO block.
+  SoliloquyGpio(zx_device_t *parent, ddk::MmioBuffer mmio);
   virtual ~SoliloquyGpio();
 
   static zx_status_t Bind(void *ctx, zx_device_t *device);
@@ -28,27 +42,163 @@ public:
   void DdkUnbind(ddk::UnbindTxn txn);
   void DdkRelease();
 
-  zx_status_t GpioConfigIn(uint32_t flags);
-  zx_status_t GpioConfigOut(uint8_t initial_value);
-  zx_status_t GpioSetAltFunction(uint64_t function);
-  zx_status_t GpioRead(uint8_t *out_value);
-  zx_status_t GpioWrite(uint8_t value);
-  zx_status_t GpioGetInterrupt(uint32_t flags, zx::interrupt *out_irq);
-  zx_status_t GpioReleaseInterrupt();
-  zx_status_t GpioSetPolarity(gpio_polarity_t polarity);
+  zx_status_t GpioImplConfigIn(uint32_t index, uint32_t flags);
+  zx_status_t GpioImplConfigOut(uint32_t index, uint8_t initial_value);
+  zx_status_t GpioImplSetAltFunction(uint32_t index, uint64_t function);
+  zx_status_t GpioImplSetDriveStrength(uint32_t index, uint64_t ua,
+                                       uint64_t *out_actual_ua);
+  zx_status_t GpioImplGetDriveStrength(uint32_t index, uint64_t *out_value);
+  zx_status_t GpioImplRead(uint32_t index, uint8_t *out_value);
+  zx_status_t GpioImplWrite(uint32_t index, uint8_t value);
+  zx_status_t GpioImplGetInterrupt(uint32_t index, uint32_t flags,
+                                   zx::interrupt *out_irq);
+  zx_status_t GpioImplReleaseInterrupt(uint32_t index);
+  zx_status_t GpioImplSetPolarity(uint32_t index, gpio_polarity_t polarity);
+
+  // Bulk operations on the pins of one bank selected by |mask|. Each costs a
+  // single access to the bank's data register, so toggling a whole LED array
+  // or a bit-banged bus lane set is one RMW instead of one per pin.
+  zx_status_t WritePins(uint32_t bank, uint32_t mask, uint32_t value);
+  zx_status_t SetPins(uint32_t bank, uint32_t mask) {
+    return WritePins(bank, mask, mask);
+  }
+  zx_status_t ClearPins(uint32_t bank, uint32_t mask) {
+    return WritePins(bank, mask, 0);
+  }
+  zx_status_t ReadPins(uint32_t bank, uint32_t mask, uint32_t *out_value);
+  // Latches |value| on the |mask| pins and then switches them to outputs.
+  zx_status_t ConfigOutPins(uint32_t bank, uint32_t mask, uint32_t value);
+
+  // Enables the bank's hardware debounce filter, which ignores pulses
+  // shorter than about |period| (rounded up, max ~3.9ms) on every
+  // interrupt pin of |bank|. A zero period disables filtering.
+  zx_status_t SetBankDebounce(uint32_t bank, zx::duration period);
+
+  // For tests: sets up the register shadow as DdkInit() does, without
+  // starting the IRQ thread.
+  zx_status_t InitHwForTest() { return InitHw(); }
+  // For tests: lets the pins of |bank| hand out interrupts as if the IRQ
+  // thread served the bank. HandleBankIrqForTest() then does the thread's
+  // work for one bank interrupt.
+  void ServeBankIrqForTest(uint32_t bank) {
+    fbl::AutoLock lock(&lock_);
+    irq_banks_ |= 1u << bank;
+  }
+  void HandleBankIrqForTest(uint32_t bank) { HandleBankIrq(bank, zx::time(0)); }
+
+  static constexpr uint32_t kBankCount = 8;
+  static constexpr uint32_t kPinsPerBank = 32;
 
 private:
+  // Per-pin interrupt state. |virq| is the virtual interrupt handed to the
+  // consumer; the demux thread triggers it when the pin's EINT status bit is
+  // set. A trigger that arrives while the previous one is still pending is
+  // absorbed by the kernel, so a burst of edges wakes the consumer once.
+  struct PinIrq {
+    zx::interrupt virq;
+    uint32_t mode = 0;
+  };
+
   zx_status_t InitHw();
+  zx_status_t StartIrqThread();
+  void StopIrqThread();
+  int IrqThread();
+  void HandleBankIrq(uint32_t bank, zx::time timestamp);
+
+  // Splits |index| into bank and pin; fails for pins past the last bank.
+  static zx_status_t PinLocation(uint32_t index, uint32_t *out_bank,
+                                 uint32_t *out_pin);
+  static uint32_t BankBase(uint32_t bank) { return bank * kBankStride; }
+  static uint32_t CfgReg(uint32_t bank, uint32_t pin) {
+    return BankBase(bank) + kGpioCfgReg + (pin / 8) * 4;
+  }
+  static uint32_t DataReg(uint32_t bank) {
+    return BankBase(bank) + kGpioDataReg;
+  }
+  static uint32_t DrvReg(uint32_t bank, uint32_t pin) {
+    return BankBase(bank) + kGpioDrvReg + (pin / 16) * 4;
+  }
+  static uint32_t PullReg(uint32_t bank, uint32_t pin) {
+    return BankBase(bank) + kGpioPullReg + (pin / 16) * 4;
+  }
+
+  static uint32_t EintBase(uint32_t bank) {
+    return kEintBase + bank * kEintStride;
+  }
+  static uint32_t EintCfgReg(uint32_t bank, uint32_t pin) {
+    return EintBase(bank) + kEintCfgReg + (pin / 8) * 4;
+  }
+  // Maps ZX_INTERRUPT_MODE_* to the EINT trigger field encoding. Only edge
+  // modes are supported.
+  static zx_status_t EintMode(uint32_t flags, uint32_t *out_mode);
+
+  // Adds the config-register writes that select |function| for every pin in
+  // |mask| to |program|.
+  static void AddFunction(soliloquy_hal::RegisterProgram &program,
+                          uint32_t bank, uint32_t mask, uint32_t function);
 
   std::optional<ddk::MmioBuffer> gpio_mmio_;
+  // Serializes register access; the helper's shadow is not thread-safe.
+  fbl::Mutex lock_;
   std::unique_ptr<soliloquy_hal::MmioHelper> mmio_helper_;
 
+  PinIrq pin_irqs_[kBankCount * kPinsPerBank] __TA_GUARDED(lock_);
+  // Software copy of each bank's EINT enable register.
+  uint32_t eint_enabled_[kBankCount] __TA_GUARDED(lock_) = {};
+  // Banks whose interrupt the IRQ thread is demultiplexing.
+  uint32_t irq_banks_ __TA_GUARDED(lock_) = 0;
+  zx::interrupt bank_irqs_[kBankCount];
+  zx::port irq_port_;
+  thrd_t irq_thread_;
+  bool irq_thread_started_ = false;
+
+  inspect::Inspector inspector_;
+
   static constexpr uint32_t kGpioBaseAddr = 0x01C20800;
   static constexpr size_t kGpioMmioSize = 0x400;
 
-  static constexpr uint32_t kGpioDataReg = 0x10;
-  static constexpr uint32_t kGpioDirReg = 0x00;
-  static constexpr uint32_t kGpioPullReg = 0x1C;
+  // Per-bank register layout.
+  static constexpr uint32_t kBankStride = 0x24;
+  static constexpr uint32_t kGpioCfgReg = 0x00;  // 4 bits/pin, 4 regs
+  static constexpr uint32_t kGpioDataReg = 0x10; // 1 bit/pin
+  static constexpr uint32_t kGpioDrvReg = 0x14;  // 2 bits/pin, 2 regs
+  static constexpr uint32_t kGpioPullReg = 0x1C; // 2 bits/pin, 2 regs
+
+  static constexpr uint32_t kFuncInput = 0;
+  static constexpr uint32_t kFuncOutput = 1;
+  static constexpr uint32_t kFuncEint = 6;
+  static constexpr uint32_t kFuncMax = 7;
+
+  // External interrupt block, one per bank.
+  static constexpr uint32_t kEintBase = 0x200;
+  static constexpr uint32_t kEintStride = 0x20;
+  static constexpr uint32_t kEintCfgReg = 0x00;    // 4 bits/pin, 4 regs
+  static constexpr uint32_t kEintCtlReg = 0x10;    // 1 enable bit/pin
+  static constexpr uint32_t kEintStatusReg = 0x14; // 1 bit/pin, W1C
+  static constexpr uint32_t kEintDebReg = 0x18;
+
+  static constexpr uint32_t kEintPosEdge = 0;
+  static constexpr uint32_t kEintNegEdge = 1;
+  static constexpr uint32_t kEintDoubleEdge = 4;
+
+  // Debounce register: bit 0 selects HOSC (24MHz) over LOSC (32.768kHz),
+  // bits 6:4 pre-scale the selected clock by 2^n.
+  static constexpr uint32_t kDebHosc = 1u << 0;
+  static constexpr uint32_t kDebPrescaleShift = 4;
+  static constexpr uint32_t kDebMaxPrescale = 7;
+  static constexpr uint64_t kHoscHz = 24000000;
+  static constexpr uint64_t kLoscHz = 32768;
+
+  // Port keys 0..kBankCount-1 are the bank interrupts.
+  static constexpr uint64_t kPortKeyStop = kBankCount;
+
+  static constexpr uint32_t kPullNone = 0;
+  static constexpr uint32_t kPullUp = 1;
+  static constexpr uint32_t kPullDown = 2;
+
+  // Drive levels 0-3 select 10, 20, 30 and 40 mA.
+  static constexpr uint64_t kDriveStepUa = 10000;
+  static constexpr uint32_t kDriveMaxLevel = 3;
 };
 
 } // namespace soliloquy_gpio
@@ -0,0 +1,294 @@
+#include "../gpio.h"
+
+#include <lib/zx/interrupt.h>
+#include <lib/zx/port.h>
+#include <zxtest/zxtest.h>
+
+#include <vector>
+
+#include "../../../common/soliloquy_hal/testing/fake_mmio_region.h"
+#include "src/devices/testing/mock-ddk/mock-device.h"
+
+namespace soliloquy_gpio {
+namespace {
+
+using soliloquy_hal::testing::FakeMmioRegion;
+using soliloquy_hal::testing::MmioTiming;
+
+constexpr uint32_t kBankCount = SoliloquyGpio::kBankCount;
+constexpr uint32_t kPinsPerBank = SoliloquyGpio::kPinsPerBank;
+
+// The PIO register map, spelled out independently of the driver's helpers.
+constexpr size_t kRegCount = 0x400 / 4;
+constexpr uint32_t kBankStride = 0x24;
+constexpr uint32_t kCfgReg = 0x00;
+constexpr uint32_t kDataReg = 0x10;
+
+constexpr uint32_t DataReg(uint32_t bank) {
+  return bank * kBankStride + kDataReg;
+}
+constexpr uint32_t CfgReg(uint32_t bank, uint32_t pin) {
+  return bank * kBankStride + kCfgReg + (pin / 8) * 4;
+}
+constexpr uint32_t kEintBase = 0x200;
+constexpr uint32_t kEintStride = 0x20;
+constexpr uint32_t kEintCtlReg = 0x10;
+constexpr uint32_t kEintStatusReg = 0x14;
+constexpr uint32_t kEintDebReg = 0x18;
+
+constexpr uint32_t EintCtlReg(uint32_t bank) {
+  return kEintBase + bank * kEintStride + kEintCtlReg;
+}
+constexpr uint32_t EintStatusReg(uint32_t bank) {
+  return kEintBase + bank * kEintStride + kEintStatusReg;
+}
+constexpr uint32_t EintDebReg(uint32_t bank) {
+  return kEintBase + bank * kEintStride + kEintDebReg;
+}
+constexpr uint32_t CfgField(uint32_t value, uint32_t pin) {
+  return (value >> ((pin % 8) * 4)) & 0xF;
+}
+
+class GpioTest : public zxtest::Test {
+protected:
+  void SetUp() override {
+    fake_root_ = MockDevice::FakeRootParent();
+    region_ =
+        std::make_unique<FakeMmioRegion>(kRegCount, MmioTiming::Instant());
+    dev_ = new SoliloquyGpio(fake_root_.get(), region_->GetMmioBuffer());
+    ASSERT_OK(dev_->InitHwForTest());
+    region_->ResetStats();
+  }
+
+  void TearDown() override { dev_->DdkRelease(); }
+
+  std::shared_ptr<MockDevice> fake_root_;
+  std::unique_ptr<FakeMmioRegion> region_;
+  SoliloquyGpio *dev_ = nullptr;
+};
+
+TEST_F(GpioTest, WritePinsTargetsEachBanksDataRegister) {
+  for (uint32_t bank = 0; bank < kBankCount; bank++) {
+    ASSERT_OK(dev_->WritePins(bank, 0xFFFFFFFF, 0xA5000000 | bank));
+  }
+  for (uint32_t bank = 0; bank < kBankCount; bank++) {
+    EXPECT_EQ(region_->value(DataReg(bank)), 0xA5000000 | bank, "bank %u",
+              bank);
+    EXPECT_EQ(region_->writes(DataReg(bank)), 1u, "bank %u", bank);
+  }
+  EXPECT_EQ(region_->total_writes(), kBankCount);
+}
+
+TEST_F(GpioTest, WritePinsKeepsUnmaskedPins) {
+  // Data is volatile: inputs change under the driver, so every RMW has to
+  // start from what the pins read now.
+  region_->set_value(DataReg(2), 0x0000FF0F);
+  ASSERT_OK(dev_->WritePins(2, 0xF0, 0x50));
+  EXPECT_EQ(region_->value(DataReg(2)), 0x0000FF5F);
+  EXPECT_EQ(region_->reads(DataReg(2)), 1u);
+  EXPECT_EQ(region_->writes(DataReg(2)), 1u);
+
+  region_->set_value(DataReg(2), 0x80000000 | region_->value(DataReg(2)));
+  ASSERT_OK(dev_->ClearPins(2, 0x0F));
+  EXPECT_EQ(region_->value(DataReg(2)), 0x8000FF50);
+  ASSERT_OK(dev_->SetPins(2, 1u << 16));
+  EXPECT_EQ(region_->value(DataReg(2)), 0x8001FF50);
+  EXPECT_EQ(region_->reads(DataReg(2)), 3u);
+  EXPECT_EQ(region_->writes(DataReg(2)), 3u);
+
+  // Neighbouring banks are left alone.
+  EXPECT_EQ(region_->writes(DataReg(1)), 0u);
+  EXPECT_EQ(region_->writes(DataReg(3)), 0u);
+}
+
+TEST_F(GpioTest, SinglePinWriteUsesBankAndBit) {
+  // PB3 is bank 1, pin 3; PH31 is the last pin of the last bank.
+  ASSERT_OK(dev_->GpioImplWrite(35, 1));
+  EXPECT_EQ(region_->value(DataReg(1)), 1u << 3);
+  ASSERT_OK(dev_->GpioImplWrite(kBankCount * kPinsPerBank - 1, 1));
+  EXPECT_EQ(region_->value(DataReg(kBankCount - 1)), 1u << 31);
+  ASSERT_OK(dev_->GpioImplWrite(35, 0));
+  EXPECT_EQ(region_->value(DataReg(1)), 0u);
+}
+
+TEST_F(GpioTest, ReadPinsMasksTheBanksDataRegister) {
+  for (uint32_t bank = 0; bank < kBankCount; bank++) {
+    region_->set_value(DataReg(bank), 0x12345600 | bank);
+  }
+  for (uint32_t bank = 0; bank < kBankCount; bank++) {
+    uint32_t value = 0;
+    ASSERT_OK(dev_->ReadPins(bank, 0xFF0F, &value));
+    EXPECT_EQ(value, 0x5600u | bank, "bank %u", bank);
+    EXPECT_EQ(region_->reads(DataReg(bank)), 1u, "bank %u", bank);
+  }
+  EXPECT_EQ(region_->total_writes(), 0u);
+
+  uint8_t level = 0;
+  ASSERT_OK(dev_->GpioImplRead(4 * kPinsPerBank + 9, &level));
+  EXPECT_EQ(level, 1);
+  ASSERT_OK(dev_->GpioImplRead(4 * kPinsPerBank + 8, &level));
+  EXPECT_EQ(level, 0);
+}
+
+TEST_F(GpioTest, ConfigOutPinsLatchesDataBeforeDirection) {
+  std::vector<uint32_t> order;
+  for (uint32_t offset : {DataReg(1), CfgReg(1, 2), CfgReg(1, 9)}) {
+    region_->SetWriteHook(offset, [&order, offset](uint32_t, uint32_t written) {
+      order.push_back(offset);
+      return written;
+    });
+  }
+  region_->set_value(CfgReg(1, 2), 0x77777777);
+  region_->set_value(DataReg(1), 1u << 2);
+
+  ASSERT_OK(dev_->ConfigOutPins(1, (1u << 2) | (1u << 9), 1u << 9));
+
+  EXPECT_EQ(region_->value(DataReg(1)), 1u << 9);
+  uint32_t cfg0 = region_->value(CfgReg(1, 2));
+  EXPECT_EQ(CfgField(cfg0, 2), 1u);
+  // Pins sharing the config register keep their function.
+  EXPECT_EQ(CfgField(cfg0, 1), 7u);
+  EXPECT_EQ(CfgField(cfg0, 3), 7u);
+  EXPECT_EQ(CfgField(region_->value(CfgReg(1, 9)), 9), 1u);
+
+  ASSERT_EQ(order.size(), 3u);
+  EXPECT_EQ(order[0], DataReg(1));
+  EXPECT_EQ(region_->writes(DataReg(1)), 1u);
+  EXPECT_EQ(region_->writes(CfgReg(0, 2)), 0u);
+  EXPECT_EQ(region_->writes(CfgReg(2, 2)), 0u);
+}
+
+TEST_F(GpioTest, PinsPastTheLastBankAreRejected) {
+  uint32_t value = 0;
+  EXPECT_EQ(dev_->WritePins(kBankCount, 1, 1), ZX_ERR_OUT_OF_RANGE);
+  EXPECT_EQ(dev_->ReadPins(kBankCount, 1, &value), ZX_ERR_OUT_OF_RANGE);
+  EXPECT_EQ(dev_->ConfigOutPins(kBankCount, 1, 1), ZX_ERR_OUT_OF_RANGE);
+  EXPECT_EQ(dev_->SetPins(UINT32_MAX, 1), ZX_ERR_OUT_OF_RANGE);
+
+  uint8_t level = 0;
+  const uint32_t past_end = kBankCount * kPinsPerBank;
+  EXPECT_EQ(dev_->GpioImplWrite(past_end, 1), ZX_ERR_OUT_OF_RANGE);
+  EXPECT_EQ(dev_->GpioImplRead(past_end, &level), ZX_ERR_OUT_OF_RANGE);
+  EXPECT_EQ(dev_->GpioImplConfigOut(past_end, 1), ZX_ERR_OUT_OF_RANGE);
+  EXPECT_EQ(dev_->GpioImplConfigIn(past_end, 0), ZX_ERR_OUT_OF_RANGE);
+
+  EXPECT_EQ(region_->total_reads(), 0u);
+  EXPECT_EQ(region_->total_writes(), 0u);
+}
+
+class GpioIrqTest : public GpioTest {
+protected:
+  void SetUp() override {
+    GpioTest::SetUp();
+    ASSERT_OK(zx::port::create(ZX_PORT_BIND_TO_INTERRUPT, &port_));
+    for (uint32_t bank = 0; bank < kBankCount; bank++) {
+      dev_->ServeBankIrqForTest(bank);
+      // Status bits are write-1-to-clear.
+      region_->SetWriteHook(EintStatusReg(bank),
+                            [](uint32_t value, uint32_t written) {
+                              return value & ~written;
+                            });
+    }
+  }
+
+  // Takes the interrupt of pin |index| and routes its triggers to port_
+  // under key |index|.
+  void TakeInterrupt(uint32_t index) {
+    zx::interrupt irq;
+    ASSERT_OK(
+        dev_->GpioImplGetInterrupt(index, ZX_INTERRUPT_MODE_EDGE_HIGH, &irq));
+    ASSERT_OK(irq.bind(port_, index, 0));
+    irqs_.push_back(std::move(irq));
+  }
+
+  // Collects the keys of every pin interrupt triggered so far.
+  std::vector<uint64_t> Fired() {
+    std::vector<uint64_t> keys;
+    zx_port_packet_t packet;
+    while (port_.wait(zx::time::infinite_past(), &packet) == ZX_OK) {
+      keys.push_back(packet.key);
+    }
+    return keys;
+  }
+
+  zx::port port_;
+  std::vector<zx::interrupt> irqs_;
+};
+
+TEST_F(GpioIrqTest, PendingBitsTriggerTheirPins) {
+  const uint32_t pb3 = 1 * kPinsPerBank + 3;
+  const uint32_t pb5 = 1 * kPinsPerBank + 5;
+  const uint32_t pc3 = 2 * kPinsPerBank + 3;
+  ASSERT_NO_FATAL_FAILURE(TakeInterrupt(pb3));
+  ASSERT_NO_FATAL_FAILURE(TakeInterrupt(pb5));
+  ASSERT_NO_FATAL_FAILURE(TakeInterrupt(pc3));
+  EXPECT_EQ(region_->value(EintCtlReg(1)), (1u << 3) | (1u << 5));
+  EXPECT_EQ(region_->value(EintCtlReg(2)), 1u << 3);
+
+  // Bit 7 is latched but was never enabled; it is neither delivered nor
+  // cleared. The same pin number on bank 2 stays quiet.
+  uint64_t acks = region_->writes(EintStatusReg(1));
+  region_->set_value(EintStatusReg(1), (1u << 3) | (1u << 7));
+  dev_->HandleBankIrqForTest(1);
+  EXPECT_EQ(Fired(), std::vector<uint64_t>{pb3});
+  EXPECT_EQ(region_->value(EintStatusReg(1)), 1u << 7);
+
+  ASSERT_OK(irqs_[0].ack());
+  region_->set_value(EintStatusReg(1), (1u << 3) | (1u << 5));
+  dev_->HandleBankIrqForTest(1);
+  EXPECT_EQ(Fired(), (std::vector<uint64_t>{pb3, pb5}));
+  EXPECT_EQ(region_->value(EintStatusReg(1)), 0u);
+  // Everything pending is acknowledged in one write per bank interrupt.
+  EXPECT_EQ(region_->writes(EintStatusReg(1)), acks + 2);
+}
+
+TEST_F(GpioIrqTest, SpuriousBankIrqTouchesNothing) {
+  ASSERT_NO_FATAL_FAILURE(TakeInterrupt(4 * kPinsPerBank + 31));
+  region_->ResetStats();
+
+  dev_->HandleBankIrqForTest(4);
+  EXPECT_TRUE(Fired().empty());
+  EXPECT_EQ(region_->reads(EintStatusReg(4)), 1u);
+  EXPECT_EQ(region_->total_writes(), 0u);
+}
+
+TEST_F(GpioIrqTest, ReleasedPinIsNoLongerDelivered) {
+  const uint32_t pin = 3 * kPinsPerBank + 12;
+  ASSERT_NO_FATAL_FAILURE(TakeInterrupt(pin));
+  ASSERT_NO_FATAL_FAILURE(TakeInterrupt(pin + 1));
+  ASSERT_OK(dev_->GpioImplReleaseInterrupt(pin));
+  EXPECT_EQ(region_->value(EintCtlReg(3)), 1u << 13);
+
+  region_->set_value(EintStatusReg(3), (1u << 12) | (1u << 13));
+  dev_->HandleBankIrqForTest(3);
+  EXPECT_EQ(Fired(), std::vector<uint64_t>{pin + 1});
+  EXPECT_EQ(region_->value(EintStatusReg(3)), 1u << 12);
+}
+
+TEST_F(GpioTest, BankDebounceSelectsClockAndPrescale) {
+  // Zero turns filtering off: HOSC with no prescale.
+  ASSERT_OK(dev_->SetBankDebounce(0, zx::duration(0)));
+  EXPECT_EQ(region_->value(EintDebReg(0)), 0x01u);
+  // 100ns needs HOSC / 4 (166ns).
+  ASSERT_OK(dev_->SetBankDebounce(1, zx::nsec(100)));
+  EXPECT_EQ(region_->value(EintDebReg(1)), 0x21u);
+  // HOSC / 128 is 5.3us, so 10us moves to LOSC (30.5us).
+  ASSERT_OK(dev_->SetBankDebounce(2, zx::usec(10)));
+  EXPECT_EQ(region_->value(EintDebReg(2)), 0x00u);
+  // 1ms needs LOSC / 64 (1.95ms).
+  ASSERT_OK(dev_->SetBankDebounce(3, zx::msec(1)));
+  EXPECT_EQ(region_->value(EintDebReg(3)), 0x60u);
+  // Longer than the slowest setting clamps to LOSC / 128.
+  ASSERT_OK(dev_->SetBankDebounce(kBankCount - 1, zx::msec(10)));
+  EXPECT_EQ(region_->value(EintDebReg(kBankCount - 1)), 0x70u);
+
+  for (uint32_t bank = 4; bank < kBankCount - 1; bank++) {
+    EXPECT_EQ(region_->writes(EintDebReg(bank)), 0u, "bank %u", bank);
+  }
+  EXPECT_EQ(dev_->SetBankDebounce(kBankCount, zx::msec(1)),
+            ZX_ERR_OUT_OF_RANGE);
+  EXPECT_EQ(region_->total_writes(), 5u);
+}
+
+} // namespace
+} // namespace soliloquy_gpio
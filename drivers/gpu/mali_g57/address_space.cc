@@ -0,0 +1,456 @@
+#include "address_space.h"
+
+#include <fbl/auto_lock.h>
+#include <lib/ddk/debug.h>
+#include <lib/zx/vmar.h>
+#include <zircon/status.h>
+
+#include <algorithm>
+
+#include "../../common/soliloquy_hal/metrics.h"
+#include "../../common/soliloquy_hal/mmio.h"
+
+namespace mali_g57 {
+
+namespace {
+
+soliloquy_hal::Counter mmu_flushes("mali-g57.mmu_flushes");
+soliloquy_hal::Counter mmu_large_mappings("mali-g57.mmu_large_mappings");
+
+bool Contiguous(const zx_paddr_t* pages, size_t count) {
+  for (size_t i = 1; i < count; i++) {
+    if (pages[i] != pages[0] + i * AddressSpace::kPageSize) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool ValidRange(uint64_t va, uint64_t size) {
+  constexpr uint64_t kLimit = 1ull << AddressSpace::kVaBits;
+  return (va % AddressSpace::kPageSize) == 0 &&
+         (size % AddressSpace::kPageSize) == 0 && size != 0 && va < kLimit &&
+         size <= kLimit - va;
+}
+
+}  // namespace
+
+AddressSpace::Table::~Table() {
+  if (entries) {
+    zx::vmar::root_self()->unmap(reinterpret_cast<uintptr_t>(entries),
+                                 kPageSize);
+  }
+  if (pmt.is_valid()) {
+    pmt.unpin();
+  }
+}
+
+AddressSpace::~AddressSpace() {
+  fbl::AutoLock lock(&lock_);
+  if (!root_) {
+    return;
+  }
+  // Stop the MMU walking the tables before they go away.
+  mmio_->Write32(kAsTranscfgAdrmodeUnmapped, kAsTranscfgLo);
+  mmio_->Write32(0, kAsTranscfgHi);
+  AsCommandLocked(kAsCommandUpdate);
+  while (free_) {
+    Table* table = free_;
+    free_ = table->next_free;
+    delete table;
+  }
+  root_.reset();
+}
+
+zx_status_t AddressSpace::Init() {
+  fbl::AutoLock lock(&lock_);
+  if (root_) {
+    return ZX_ERR_BAD_STATE;
+  }
+
+  zx_status_t status = AllocTable(0, &root_);
+  if (status != ZX_OK) {
+    zxlogf(ERROR, "mali-g57: Failed to allocate page table root: %s",
+           zx_status_get_string(status));
+    return status;
+  }
+
+  mmio_->Write32(static_cast<uint32_t>(root_->paddr), kAsTranstabLo);
+  mmio_->Write32(static_cast<uint32_t>(root_->paddr >> 32), kAsTranstabHi);
+  mmio_->Write32((kMemattrWriteBack << (8 * kMemattrIndexCached)) |
+                     (kMemattrNonCacheable << (8 * kMemattrIndexUncached)),
+                 kAsMemattr);
+  mmio_->Write32(kAsTranscfgAdrmodeAarch64_4k, kAsTranscfgLo);
+  mmio_->Write32(0, kAsTranscfgHi);
+  return AsCommandLocked(kAsCommandUpdate);
+}
+
+zx_status_t AddressSpace::Map(const GpuMapping* mappings, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    const GpuMapping& m = mappings[i];
+    if (!m.pages || !ValidRange(m.gpu_va, m.page_count * kPageSize)) {
+      return ZX_ERR_INVALID_ARGS;
+    }
+    for (size_t j = 0; j < m.page_count; j++) {
+      if (m.pages[j] % kPageSize) {
+        return ZX_ERR_INVALID_ARGS;
+      }
+    }
+  }
+
+  fbl::AutoLock lock(&lock_);
+  if (!root_) {
+    return ZX_ERR_BAD_STATE;
+  }
+
+  zx_status_t status = ZX_OK;
+  size_t done = 0;
+  size_t mapped = 0;
+  for (; done < count; done++) {
+    status = MapOneLocked(mappings[done], &mapped);
+    if (status != ZX_OK) {
+      break;
+    }
+  }
+
+  if (status != ZX_OK) {
+    // Everything installed so far ends on a whole block or group, so the
+    // rollback never has to split anything.
+    uint64_t va = mappings[done].gpu_va;
+    UnmapLevelLocked(root_.get(), 0, va, va + mapped * kPageSize);
+    for (size_t i = 0; i < done; i++) {
+      va = mappings[i].gpu_va;
+      UnmapLevelLocked(root_.get(), 0, va,
+                       va + mappings[i].page_count * kPageSize);
+    }
+  }
+
+  zx_status_t commit = CommitLocked();
+  return status != ZX_OK ? status : commit;
+}
+
+zx_status_t AddressSpace::Unmap(const GpuRange* ranges, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    if (!ValidRange(ranges[i].gpu_va, ranges[i].size)) {
+      return ZX_ERR_INVALID_ARGS;
+    }
+  }
+
+  fbl::AutoLock lock(&lock_);
+  if (!root_) {
+    return ZX_ERR_BAD_STATE;
+  }
+
+  zx_status_t status = ZX_OK;
+  for (size_t i = 0; i < count && status == ZX_OK; i++) {
+    uint64_t end = ranges[i].gpu_va + ranges[i].size;
+    Touch(ranges[i].gpu_va, end);
+    status = UnmapLevelLocked(root_.get(), 0, ranges[i].gpu_va, end);
+  }
+
+  zx_status_t commit = CommitLocked();
+  return status != ZX_OK ? status : commit;
+}
+
+zx_status_t AddressSpace::AllocTable(int level, std::unique_ptr<Table>* out) {
+  auto table = std::make_unique<Table>();
+  if (level < kLeafLevel) {
+    table->children = std::make_unique<std::unique_ptr<Table>[]>(kEntries);
+  }
+
+  zx_status_t status =
+      zx::vmo::create_contiguous(bti_, kPageSize, 0, &table->vmo);
+  if (status != ZX_OK) {
+    return status;
+  }
+  zx_vaddr_t mapped;
+  status = zx::vmar::root_self()->map(ZX_VM_PERM_READ | ZX_VM_PERM_WRITE, 0,
+                                      table->vmo, 0, kPageSize, &mapped);
+  if (status != ZX_OK) {
+    return status;
+  }
+  table->entries = reinterpret_cast<uint64_t*>(mapped);
+  status = bti_.pin(ZX_BTI_PERM_READ | ZX_BTI_CONTIGUOUS, table->vmo, 0,
+                    kPageSize, &table->paddr, 1, &table->pmt);
+  if (status != ZX_OK) {
+    return status;
+  }
+
+  // The page arrives zeroed; make sure the MMU sees the zeroes too.
+  table->vmo.op_range(ZX_VMO_OP_CACHE_CLEAN, 0, kPageSize, nullptr, 0);
+  *out = std::move(table);
+  return ZX_OK;
+}
+
+uint64_t AddressSpace::EntryAttrs(uint32_t flags) {
+  uint64_t index = (flags & kGpuMapUncached) ? kMemattrIndexUncached
+                                             : kMemattrIndexCached;
+  uint64_t attrs = kPteAccess | kPteShareInner | (index << kPteAttrIndexShift);
+  if (flags & kGpuMapRead) {
+    attrs |= kPteRead;
+  }
+  if (flags & kGpuMapWrite) {
+    attrs |= kPteWrite;
+  }
+  if (!(flags & kGpuMapExecute)) {
+    attrs |= kPteNoExecute;
+  }
+  return attrs;
+}
+
+zx_status_t AddressSpace::MapOneLocked(const GpuMapping& m,
+                                       size_t* out_mapped) {
+  constexpr uint64_t kBlockSize = LevelSpan(kBlockLevel);
+  constexpr size_t kBlockPages = kBlockSize / kPageSize;
+  constexpr uint64_t kGroupSize = kContiguousPages * kPageSize;
+
+  uint64_t attrs = EntryAttrs(m.flags);
+  Touch(m.gpu_va, m.gpu_va + m.page_count * kPageSize);
+  *out_mapped = 0;
+
+  size_t i = 0;
+  while (i < m.page_count) {
+    uint64_t va = m.gpu_va + i * kPageSize;
+    zx_paddr_t pa = m.pages[i];
+    size_t left = m.page_count - i;
+    Table* table;
+    zx_status_t status;
+
+    if (left >= kBlockPages && va % kBlockSize == 0 && pa % kBlockSize == 0 &&
+        Contiguous(&m.pages[i], kBlockPages)) {
+      status = WalkLocked(va, kBlockLevel, &table);
+      if (status != ZX_OK) {
+        return status;
+      }
+      size_t index = Index(va, kBlockLevel);
+      if (table->entries[index] & kPteValid) {
+        return ZX_ERR_ALREADY_EXISTS;
+      }
+      SetEntryLocked(table, index, pa | attrs | kPteBlock);
+      table->live++;
+      mmu_large_mappings.Add();
+      i += kBlockPages;
+      *out_mapped = i;
+      continue;
+    }
+
+    status = WalkLocked(va, kLeafLevel, &table);
+    if (status != ZX_OK) {
+      return status;
+    }
+    size_t index = Index(va, kLeafLevel);
+    size_t run = 1;
+    uint64_t hint = 0;
+    if (left >= kContiguousPages && va % kGroupSize == 0 &&
+        pa % kGroupSize == 0 && Contiguous(&m.pages[i], kContiguousPages)) {
+      run = kContiguousPages;
+      hint = kPteContiguous;
+      mmu_large_mappings.Add();
+    }
+    // Check the whole group first so a failure leaves none of it behind.
+    for (size_t j = 0; j < run; j++) {
+      if (table->entries[index + j] & kPteValid) {
+        return ZX_ERR_ALREADY_EXISTS;
+      }
+    }
+    for (size_t j = 0; j < run; j++) {
+      SetEntryLocked(table, index + j,
+                     (m.pages[i + j]) | attrs | kPtePage | hint);
+    }
+    table->live += run;
+    i += run;
+    *out_mapped = i;
+  }
+  return ZX_OK;
+}
+
+zx_status_t AddressSpace::WalkLocked(uint64_t va, int level, Table** out) {
+  Table* table = root_.get();
+  for (int l = 0; l < level; l++) {
+    size_t index = Index(va, l);
+    uint64_t entry = table->entries[index];
+    if (!(entry & kPteValid)) {
+      std::unique_ptr<Table> child;
+      zx_status_t status = AllocTable(l + 1, &child);
+      if (status != ZX_OK) {
+        return status;
+      }
+      SetEntryLocked(table, index, child->paddr | kPteTable);
+      table->live++;
+      table->children[index] = std::move(child);
+    } else if ((entry & kPteTypeMask) != kPteTable) {
+      // Already covered by a block.
+      return ZX_ERR_ALREADY_EXISTS;
+    }
+    table = table->children[index].get();
+  }
+  *out = table;
+  return ZX_OK;
+}
+
+zx_status_t AddressSpace::UnmapLevelLocked(Table* table, int level,
+                                           uint64_t va, uint64_t end) {
+  const uint64_t span = LevelSpan(level);
+  while (va < end) {
+    size_t index = Index(va, level);
+    uint64_t entry_va = va & ~(span - 1);
+    uint64_t stop = std::min(end, entry_va + span);
+    uint64_t entry = table->entries[index];
+
+    if (!(entry & kPteValid)) {
+      va = stop;
+      continue;
+    }
+
+    if (level == kLeafLevel) {
+      if (entry & kPteContiguous) {
+        ClearContiguousLocked(table, index, entry_va);
+      }
+      SetEntryLocked(table, index, 0);
+      table->live--;
+    } else if ((entry & kPteTypeMask) == kPteBlock) {
+      if (va != entry_va || stop != entry_va + span) {
+        zx_status_t status = SplitBlockLocked(table, level, index, entry_va);
+        if (status != ZX_OK) {
+          return status;
+        }
+        // Go round again and descend into the new table.
+        continue;
+      }
+      SetEntryLocked(table, index, 0);
+      table->live--;
+    } else {
+      Table* child = table->children[index].get();
+      zx_status_t status = UnmapLevelLocked(child, level + 1, va, stop);
+      if (child->live == 0) {
+        // The MMU may still be walking it; free it after the flush.
+        SetEntryLocked(table, index, 0);
+        table->live--;
+        child->next_free = free_;
+        free_ = table->children[index].release();
+      }
+      if (status != ZX_OK) {
+        return status;
+      }
+    }
+    va = stop;
+  }
+  return ZX_OK;
+}
+
+zx_status_t AddressSpace::SplitBlockLocked(Table* table, int level,
+                                           size_t index, uint64_t block_va) {
+  std::unique_ptr<Table> child;
+  zx_status_t status = AllocTable(level + 1, &child);
+  if (status != ZX_OK) {
+    return status;
+  }
+
+  uint64_t entry = table->entries[index];
+  zx_paddr_t pa = entry & kPteAddrMask;
+  uint64_t attrs = entry & ~(kPteAddrMask | kPteTypeMask);
+  uint64_t type = level + 1 == kLeafLevel ? kPtePage : kPteBlock;
+  uint64_t child_span = LevelSpan(level + 1);
+  for (size_t i = 0; i < kEntries; i++) {
+    SetEntryLocked(child.get(), i, (pa + i * child_span) | attrs | type);
+  }
+  child->live = kEntries;
+
+  SetEntryLocked(table, index, child->paddr | kPteTable);
+  table->children[index] = std::move(child);
+  Touch(block_va, block_va + LevelSpan(level));
+  return ZX_OK;
+}
+
+void AddressSpace::ClearContiguousLocked(Table* table, size_t index,
+                                         uint64_t va) {
+  size_t first = index & ~(kContiguousPages - 1);
+  for (size_t i = first; i < first + kContiguousPages; i++) {
+    if (table->entries[i] & kPteContiguous) {
+      SetEntryLocked(table, i, table->entries[i] & ~kPteContiguous);
+    }
+  }
+  // The group may be cached as one TLB entry covering all of it.
+  uint64_t group_va = va & ~(kContiguousPages * kPageSize - 1);
+  Touch(group_va, group_va + kContiguousPages * kPageSize);
+}
+
+void AddressSpace::SetEntryLocked(Table* table, size_t index, uint64_t entry) {
+  table->entries[index] = entry;
+  if (table->dirty_lo == kEntries) {
+    table->next_dirty = dirty_;
+    dirty_ = table;
+  }
+  table->dirty_lo = std::min(table->dirty_lo, index);
+  table->dirty_hi = std::max(table->dirty_hi, index + 1);
+}
+
+void AddressSpace::Touch(uint64_t va, uint64_t end) {
+  touched_lo_ = std::min(touched_lo_, va);
+  touched_hi_ = std::max(touched_hi_, end);
+}
+
+zx_status_t AddressSpace::CommitLocked() {
+  while (dirty_) {
+    Table* table = dirty_;
+    dirty_ = table->next_dirty;
+    table->next_dirty = nullptr;
+    table->vmo.op_range(ZX_VMO_OP_CACHE_CLEAN,
+                        table->dirty_lo * sizeof(uint64_t),
+                        (table->dirty_hi - table->dirty_lo) * sizeof(uint64_t),
+                        nullptr, 0);
+    table->dirty_lo = kEntries;
+    table->dirty_hi = 0;
+  }
+
+  if (touched_lo_ >= touched_hi_) {
+    return ZX_OK;
+  }
+
+  // One lock region covering everything touched since the last commit.
+  uint64_t last = touched_hi_ - 1;
+  uint32_t bits = kAsLockRegionMinBits;
+  while (bits < kVaBits && (touched_lo_ >> bits) != (last >> bits)) {
+    bits++;
+  }
+  uint64_t region = (touched_lo_ & ~((1ull << bits) - 1)) | (bits - 1);
+  touched_lo_ = UINT64_MAX;
+  touched_hi_ = 0;
+
+  mmio_->Write32(static_cast<uint32_t>(region), kAsLockaddrLo);
+  mmio_->Write32(static_cast<uint32_t>(region >> 32), kAsLockaddrHi);
+  zx_status_t status = AsCommandLocked(kAsCommandLock);
+  if (status != ZX_OK) {
+    return status;
+  }
+  status = AsCommandLocked(kAsCommandFlushPt);
+  zx_status_t unlock = AsCommandLocked(kAsCommandUnlock);
+  if (status == ZX_OK) {
+    status = unlock;
+  }
+  if (status != ZX_OK) {
+    // Keep emptied tables until a flush is known to have completed.
+    return status;
+  }
+  mmu_flushes.Add();
+
+  while (free_) {
+    Table* table = free_;
+    free_ = table->next_free;
+    delete table;
+  }
+  return ZX_OK;
+}
+
+zx_status_t AddressSpace::AsCommandLocked(uint32_t command) {
+  mmio_->Write32(command, kAsCommandReg);
+  soliloquy_hal::MmioHelper helper(mmio_);
+  if (!helper.WaitForMask32(kAsStatusReg, kAsStatusActive, 0,
+                            kCommandTimeout)) {
+    zxlogf(ERROR, "mali-g57: AS command %u timed out", command);
+    return ZX_ERR_TIMED_OUT;
+  }
+  return ZX_OK;
+}
+
+}  // namespace mali_g57
@@ -0,0 +1,147 @@
+#ifndef DRIVERS_GPU_MALI_G57_ADDRESS_SPACE_H_
+#define DRIVERS_GPU_MALI_G57_ADDRESS_SPACE_H_
+
+#include <fbl/mutex.h>
+#include <lib/mmio/mmio.h>
+#include <lib/zx/bti.h>
+#include <lib/zx/pmt.h>
+#include <lib/zx/time.h>
+#include <lib/zx/vmo.h>
+#include <zircon/compiler.h>
+#include <zircon/types.h>
+
+#include <cstdint>
+#include <memory>
+
+#include "registers.h"
+
+namespace mali_g57 {
+
+// Pages to place at |gpu_va|, typically the address list returned by
+// zx::bti::pin() for a VMO. The caller keeps the pages pinned until the
+// range is unmapped.
+struct GpuMapping {
+  uint64_t gpu_va;
+  const zx_paddr_t* pages;  // One physical address per 4KB page.
+  size_t page_count;
+  uint32_t flags;  // kGpuMap* bits.
+};
+
+struct GpuRange {
+  uint64_t gpu_va;
+  uint64_t size;
+};
+
+constexpr uint32_t kGpuMapRead = 1u << 0;
+constexpr uint32_t kGpuMapWrite = 1u << 1;
+constexpr uint32_t kGpuMapExecute = 1u << 2;
+constexpr uint32_t kGpuMapUncached = 1u << 3;
+
+// GPU address space 0, walked by the MMU in AArch64 4KB-granule mode.
+//
+// Physically contiguous runs are mapped with the largest entry that fits:
+// a level-2 block for a 2MB-aligned run of 2MB, a 16-entry contiguous-hint
+// group (one TLB entry) for a 64KB-aligned run of 64KB, and plain pages
+// otherwise. Each call covers all of its ranges with a single
+// LOCK/FLUSH_PT/UNLOCK sequence, so mapping or unmapping a large buffer
+// costs one MMU round trip rather than one per page.
+//
+// Page-table updates are not atomic with respect to running jobs: callers
+// must not remap a range the GPU may be accessing.
+class AddressSpace {
+ public:
+  AddressSpace(ddk::MmioBuffer* mmio, zx::bti bti)
+      : mmio_(mmio), bti_(std::move(bti)) {}
+  ~AddressSpace();
+
+  AddressSpace(const AddressSpace&) = delete;
+  AddressSpace& operator=(const AddressSpace&) = delete;
+
+  // Allocates the root table and points AS0 at it.
+  zx_status_t Init();
+
+  // Either every mapping is installed or, on error, none is. Fails with
+  // ZX_ERR_ALREADY_EXISTS if any page is already mapped.
+  zx_status_t Map(const GpuMapping* mappings, size_t count);
+  zx_status_t Map(const GpuMapping& mapping) { return Map(&mapping, 1); }
+
+  // Unmapped holes inside the ranges are skipped. Blocks and contiguous
+  // groups that straddle a range edge are split first.
+  zx_status_t Unmap(const GpuRange* ranges, size_t count);
+  zx_status_t Unmap(const GpuRange& range) { return Unmap(&range, 1); }
+
+  static constexpr uint64_t kPageSize = 4096;
+  static constexpr uint64_t kVaBits = 48;
+
+ private:
+  struct Table {
+    ~Table();
+
+    zx::vmo vmo;
+    zx::pmt pmt;
+    uint64_t* entries = nullptr;
+    zx_paddr_t paddr = 0;
+    // Child tables of a non-leaf table, indexed like |entries|.
+    std::unique_ptr<std::unique_ptr<Table>[]> children;
+    size_t live = 0;
+    // Entries written since the last commit, cleaned to memory there.
+    size_t dirty_lo = kEntries;
+    size_t dirty_hi = 0;
+    Table* next_dirty = nullptr;
+    Table* next_free = nullptr;
+  };
+
+  zx_status_t AllocTable(int level, std::unique_ptr<Table>* out);
+
+  zx_status_t MapOneLocked(const GpuMapping& mapping, size_t* out_mapped)
+      __TA_REQUIRES(lock_);
+  // Returns the table at |level| covering |va|, creating tables on the way.
+  zx_status_t WalkLocked(uint64_t va, int level, Table** out)
+      __TA_REQUIRES(lock_);
+  zx_status_t UnmapLevelLocked(Table* table, int level, uint64_t va,
+                               uint64_t end) __TA_REQUIRES(lock_);
+  // Replaces the block at |index|, which maps |block_va|, with a table of
+  // next-level entries mapping the same pages.
+  zx_status_t SplitBlockLocked(Table* table, int level, size_t index,
+                               uint64_t block_va) __TA_REQUIRES(lock_);
+  // Drops the contiguous hint from the group holding leaf entry |index|.
+  void ClearContiguousLocked(Table* table, size_t index, uint64_t va)
+      __TA_REQUIRES(lock_);
+
+  void SetEntryLocked(Table* table, size_t index, uint64_t entry)
+      __TA_REQUIRES(lock_);
+  void Touch(uint64_t va, uint64_t end) __TA_REQUIRES(lock_);
+  // Writes back dirty tables, flushes the touched range from the MMU and
+  // frees tables emptied since the last commit.
+  zx_status_t CommitLocked() __TA_REQUIRES(lock_);
+  zx_status_t AsCommandLocked(uint32_t command) __TA_REQUIRES(lock_);
+
+  static uint64_t EntryAttrs(uint32_t flags);
+  static size_t Index(uint64_t va, int level) {
+    return (va >> LevelShift(level)) & (kEntries - 1);
+  }
+  static constexpr int LevelShift(int level) { return 39 - 9 * level; }
+  static constexpr uint64_t LevelSpan(int level) {
+    return 1ull << LevelShift(level);
+  }
+
+  ddk::MmioBuffer* mmio_;
+  zx::bti bti_;
+
+  fbl::Mutex lock_;
+  std::unique_ptr<Table> root_ __TA_GUARDED(lock_);
+  Table* dirty_ __TA_GUARDED(lock_) = nullptr;
+  Table* free_ __TA_GUARDED(lock_) = nullptr;
+  uint64_t touched_lo_ __TA_GUARDED(lock_) = UINT64_MAX;
+  uint64_t touched_hi_ __TA_GUARDED(lock_) = 0;
+
+  static constexpr size_t kEntries = 512;
+  static constexpr int kLeafLevel = 3;
+  static constexpr int kBlockLevel = 2;
+  static constexpr size_t kContiguousPages = 16;
+  static constexpr zx::duration kCommandTimeout = zx::msec(10);
+};
+
+}  // namespace mali_g57
+
+#endif  // DRIVERS_GPU_MALI_G57_ADDRESS_SPACE_H_
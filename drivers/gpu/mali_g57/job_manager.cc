@@ -0,0 +1,246 @@
+#include "job_manager.h"
+
+#include <fbl/auto_lock.h>
+#include <lib/ddk/debug.h>
+#include <lib/zx/clock.h>
+
+#include "../../common/soliloquy_hal/metrics.h"
+
+namespace mali_g57 {
+
+namespace {
+
+soliloquy_hal::Counter jobs_submitted("mali-g57.jobs_submitted");
+soliloquy_hal::Counter jobs_completed("mali-g57.jobs_completed");
+soliloquy_hal::Counter jobs_failed("mali-g57.jobs_failed");
+soliloquy_hal::Counter job_irqs_spurious("mali-g57.job_irqs_spurious");
+
+constexpr uint32_t AllSlotIrqs() {
+  uint32_t mask = 0;
+  for (uint32_t slot = 0; slot < kJobSlotCount; slot++) {
+    mask |= JobIrqDone(slot) | JobIrqFailed(slot);
+  }
+  return mask;
+}
+
+}  // namespace
+
+void JobManager::Init() {
+  mmio_->Write32(0xFFFFFFFF, kJobIrqClearReg);
+  mmio_->Write32(AllSlotIrqs(), kJobIrqMaskReg);
+}
+
+void JobManager::SetCompletionHandler(const JobCompletionHandler& handler) {
+  fbl::AutoLock lock(&lock_);
+  handler_ = handler;
+}
+
+zx_status_t JobManager::Submit(uint32_t slot, const JobChain* chains,
+                               size_t count, uint64_t* out_first_id) {
+  if (slot >= kJobSlotCount || !chains || count == 0 || !out_first_id) {
+    return ZX_ERR_INVALID_ARGS;
+  }
+  for (size_t i = 0; i < count; i++) {
+    if (chains[i].head_va == 0 || chains[i].affinity == 0) {
+      return ZX_ERR_INVALID_ARGS;
+    }
+  }
+
+  fbl::AutoLock lock(&lock_);
+  Slot& s = slots_[slot];
+  if (kRingSize - s.count < count) {
+    return ZX_ERR_SHOULD_WAIT;
+  }
+
+  *out_first_id = next_id_;
+  for (size_t i = 0; i < count; i++) {
+    Entry& e = s.ring[(s.head + s.count) % kRingSize];
+    e.chain = chains[i];
+    e.id = next_id_++;
+    s.count++;
+  }
+  jobs_submitted.Add(count);
+
+  KickLocked(slot);
+  return ZX_OK;
+}
+
+// Latches waiting chains into the _NEXT registers while there is room on
+// the hardware. On an idle slot the hardware promotes the first one to HEAD
+// and starts it at once, which frees _NEXT for a second.
+void JobManager::KickLocked(uint32_t slot) {
+  Slot& s = slots_[slot];
+  while (s.on_hw < s.count && s.on_hw < kHwDepth &&
+         ReadHeadNext(slot) == 0) {
+    const JobChain& chain = s.ring[(s.head + s.on_hw) % kRingSize].chain;
+    mmio_->Write32(static_cast<uint32_t>(chain.head_va),
+                   JobSlotReg(slot, kJsHeadNextLo));
+    mmio_->Write32(static_cast<uint32_t>(chain.head_va >> 32),
+                   JobSlotReg(slot, kJsHeadNextHi));
+    mmio_->Write32(static_cast<uint32_t>(chain.affinity),
+                   JobSlotReg(slot, kJsAffinityNextLo));
+    mmio_->Write32(static_cast<uint32_t>(chain.affinity >> 32),
+                   JobSlotReg(slot, kJsAffinityNextHi));
+    mmio_->Write32(chain.config, JobSlotReg(slot, kJsConfigNext));
+    mmio_->Write32(kJsCommandStart, JobSlotReg(slot, kJsCommandNext));
+    s.on_hw++;
+  }
+  UpdateBusyLocked();
+}
+
+void JobManager::RetireLocked(uint32_t slot, zx_status_t status,
+                              Completion* out) {
+  Slot& s = slots_[slot];
+  *out = {s.ring[s.head].id, status};
+  s.head = (s.head + 1) % kRingSize;
+  s.count--;
+  s.on_hw--;
+  if (status == ZX_OK) {
+    jobs_completed.Add();
+  } else {
+    jobs_failed.Add();
+  }
+}
+
+void JobManager::HandleIrq() {
+  Completion done[kJobSlotCount * kHwDepth];
+  size_t done_count = 0;
+
+  {
+    fbl::AutoLock lock(&lock_);
+    uint32_t pending = mmio_->Read32(kJobIrqRawstatReg) & AllSlotIrqs();
+    if (pending == 0) {
+      job_irqs_spurious.Add();
+      return;
+    }
+    // Clear first, so a chain finishing while we look at the slot state
+    // raises a fresh interrupt instead of being lost.
+    mmio_->Write32(pending, kJobIrqClearReg);
+
+    for (uint32_t slot = 0; slot < kJobSlotCount; slot++) {
+      Slot& s = slots_[slot];
+      if (s.on_hw == 0) {
+        continue;
+      }
+
+      if (pending & JobIrqFailed(slot)) {
+        // A done bit raised alongside the fault belongs to the chain ahead
+        // of the one that faulted: the hardware only promotes from _NEXT
+        // once the head has finished.
+        if ((pending & JobIrqDone(slot)) && s.on_hw == kHwDepth) {
+          RetireLocked(slot, ZX_OK, &done[done_count++]);
+        }
+        uint32_t code = mmio_->Read32(JobSlotReg(slot, kJsStatus));
+        zxlogf(WARNING, "mali-g57: Job %lu on slot %u failed (status 0x%02x)",
+               s.ring[s.head].id, slot, code);
+        RetireLocked(slot, ZX_ERR_IO, &done[done_count++]);
+        // A fault leaves any chain latched in _NEXT waiting; start it again.
+        if (s.on_hw > 0 && ReadHeadNext(slot) != 0) {
+          mmio_->Write32(kJsCommandStart, JobSlotReg(slot, kJsCommandNext));
+        }
+      } else if (pending & JobIrqDone(slot)) {
+        // One interrupt may cover both chains: if the queued one was
+        // promoted and has already finished too, retire it as well.
+        bool both = s.on_hw == kHwDepth && ReadHeadNext(slot) == 0 &&
+                    mmio_->Read32(JobSlotReg(slot, kJsStatus)) ==
+                        kJsStatusDone;
+        RetireLocked(slot, ZX_OK, &done[done_count++]);
+        if (both) {
+          RetireLocked(slot, ZX_OK, &done[done_count++]);
+          // The second chain may have finished after the clear above and
+          // latched DONE again. Nothing is on the slot until the kick below,
+          // so that bit can only be stale; drop it before it retires the
+          // next chain early.
+          mmio_->Write32(JobIrqDone(slot), kJobIrqClearReg);
+        }
+      }
+
+      KickLocked(slot);
+    }
+  }
+
+  Deliver(done, done_count);
+}
+
+void JobManager::Cancel() {
+  Completion done[kJobSlotCount * kRingSize];
+  size_t done_count = 0;
+
+  {
+    fbl::AutoLock lock(&lock_);
+    for (uint32_t slot = 0; slot < kJobSlotCount; slot++) {
+      Slot& s = slots_[slot];
+      mmio_->Write32(kJsCommandNop, JobSlotReg(slot, kJsCommandNext));
+      mmio_->Write32(kJsCommandHardStop, JobSlotReg(slot, kJsCommand));
+      while (s.count > 0) {
+        done[done_count++] = {s.ring[s.head].id, ZX_ERR_CANCELED};
+        s.head = (s.head + 1) % kRingSize;
+        s.count--;
+      }
+      s.on_hw = 0;
+    }
+    mmio_->Write32(0, kJobIrqMaskReg);
+    mmio_->Write32(0xFFFFFFFF, kJobIrqClearReg);
+    UpdateBusyLocked();
+  }
+
+  Deliver(done, done_count);
+}
+
+bool JobManager::Idle() {
+  fbl::AutoLock lock(&lock_);
+  return !busy_;
+}
+
+zx::duration JobManager::BusyTime() {
+  fbl::AutoLock lock(&lock_);
+  zx::duration total = busy_total_;
+  if (busy_) {
+    total += zx::clock::get_monotonic() - busy_since_;
+  }
+  return total;
+}
+
+void JobManager::UpdateBusyLocked() {
+  bool busy = false;
+  for (const Slot& s : slots_) {
+    busy |= s.on_hw > 0;
+  }
+  if (busy == busy_) {
+    return;
+  }
+
+  zx::time now = zx::clock::get_monotonic();
+  if (busy) {
+    busy_since_ = now;
+  } else {
+    busy_total_ += now - busy_since_;
+  }
+  busy_ = busy;
+}
+
+uint64_t JobManager::ReadHeadNext(uint32_t slot) {
+  return mmio_->Read32(JobSlotReg(slot, kJsHeadNextLo)) |
+         static_cast<uint64_t>(mmio_->Read32(JobSlotReg(slot, kJsHeadNextHi)))
+             << 32;
+}
+
+void JobManager::Deliver(const Completion* completions, size_t count) {
+  if (count == 0) {
+    return;
+  }
+
+  JobCompletionHandler handler;
+  {
+    fbl::AutoLock lock(&lock_);
+    handler = handler_;
+  }
+  if (!handler.complete) {
+    return;
+  }
+  for (size_t i = 0; i < count; i++) {
+    handler.complete(handler.ctx, completions[i].id, completions[i].status);
+  }
+}
+
+}  // namespace mali_g57
@@ -0,0 +1,114 @@
+#ifndef DRIVERS_GPU_MALI_G57_JOB_MANAGER_H_
+#define DRIVERS_GPU_MALI_G57_JOB_MANAGER_H_
+
+#include <fbl/mutex.h>
+#include <lib/mmio/mmio.h>
+#include <lib/zx/time.h>
+#include <zircon/compiler.h>
+#include <zircon/types.h>
+
+#include "registers.h"
+
+namespace mali_g57 {
+
+// A chain of job descriptors already written to GPU memory.
+struct JobChain {
+  // GPU virtual address of the first descriptor.
+  uint64_t head_va;
+  // Shader cores the chain may run on.
+  uint64_t affinity;
+  // JS_CONFIG value: address space, cache flush and barrier policy.
+  uint32_t config;
+};
+
+// Called once per submitted chain, from the IRQ thread, with ZX_OK or the
+// reason it did not complete.
+struct JobCompletionHandler {
+  void (*complete)(void* ctx, uint64_t job_id, zx_status_t status);
+  void* ctx;
+};
+
+// Feeds job chains to the hardware job slots. Each slot has a ring of
+// submitted chains; up to two of them are on the hardware at a time, the
+// running one and the one latched in the _NEXT registers, so the GPU moves
+// straight on to the next chain without waiting for the interrupt to be
+// serviced.
+class JobManager {
+ public:
+  explicit JobManager(ddk::MmioBuffer* mmio) : mmio_(mmio) {}
+
+  JobManager(const JobManager&) = delete;
+  JobManager& operator=(const JobManager&) = delete;
+
+  // Clears stale state and unmasks the job interrupts.
+  void Init();
+
+  void SetCompletionHandler(const JobCompletionHandler& handler);
+
+  // Queues |count| chains on |slot| under a single lock hold and kicks the
+  // slot once. IDs are assigned consecutively from |*out_first_id|. Either
+  // every chain is queued or, with ZX_ERR_SHOULD_WAIT, none is.
+  zx_status_t Submit(uint32_t slot, const JobChain* chains, size_t count,
+                     uint64_t* out_first_id);
+
+  // Services the job interrupt: retires finished chains, refills the
+  // hardware from the rings and runs the completion handler.
+  void HandleIrq();
+
+  // Hard-stops every slot and fails all outstanding chains with
+  // ZX_ERR_CANCELED.
+  void Cancel();
+
+  bool Idle();
+
+  // Total time at least one slot had work on the hardware. Used as the GPU
+  // utilization source for the DVFS governor.
+  zx::duration BusyTime();
+
+  static constexpr size_t kRingSize = 32;
+  // Hardware depth per slot: HEAD plus HEAD_NEXT.
+  static constexpr size_t kHwDepth = 2;
+
+ private:
+  struct Entry {
+    JobChain chain;
+    uint64_t id;
+  };
+
+  // Ring entries from |head| onwards: the first |on_hw| are on the hardware
+  // (running first), the rest are waiting.
+  struct Slot {
+    Entry ring[kRingSize];
+    size_t head = 0;
+    size_t count = 0;
+    size_t on_hw = 0;
+  };
+
+  struct Completion {
+    uint64_t id;
+    zx_status_t status;
+  };
+
+  void KickLocked(uint32_t slot) __TA_REQUIRES(lock_);
+  // Pops the oldest on-hardware chain of |slot| into |out|.
+  void RetireLocked(uint32_t slot, zx_status_t status, Completion* out)
+      __TA_REQUIRES(lock_);
+  void UpdateBusyLocked() __TA_REQUIRES(lock_);
+  uint64_t ReadHeadNext(uint32_t slot);
+  void Deliver(const Completion* completions, size_t count);
+
+  ddk::MmioBuffer* mmio_;
+
+  fbl::Mutex lock_;
+  Slot slots_[kJobSlotCount] __TA_GUARDED(lock_);
+  uint64_t next_id_ __TA_GUARDED(lock_) = 1;
+  JobCompletionHandler handler_ __TA_GUARDED(lock_) = {};
+
+  bool busy_ __TA_GUARDED(lock_) = false;
+  zx::time busy_since_ __TA_GUARDED(lock_);
+  zx::duration busy_total_ __TA_GUARDED(lock_);
+};
+
+}  // namespace mali_g57
+
+#endif  // DRIVERS_GPU_MALI_G57_JOB_MANAGER_H_
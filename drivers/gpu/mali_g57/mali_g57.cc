@@ -4,13 +4,28 @@
 #include <lib/ddk/device.h>
 #include <lib/ddk/driver.h>
 #include <lib/ddk/platform-defs.h>
+#include <lib/device-protocol/pdev.h>
 #include <zircon/status.h>
 #include <zircon/types.h>
 
+#include <iterator>
 #include <memory>
 
+#include "../../../boards/arm64/soliloquy/dts/sun55i-a527-ccu.h"
+
 namespace mali_g57 {
 
+namespace {
+
+soliloquy_hal::Histogram init_us("mali-g57.init_us");
+
+// GPU clock operating points, all exact divisions of PLL_PERIPH0_2X so
+// scaling never has to move a PLL.
+constexpr uint64_t kGpuOpps[] = {150'000'000, 200'000'000, 300'000'000,
+                                 400'000'000, 600'000'000};
+
+}  // namespace
+
 MaliG57::MaliG57(zx_device_t* parent) : MaliG57Type(parent) {}
 
 MaliG57::~MaliG57() {
@@ -21,7 +36,10 @@ MaliG57::~MaliG57() {
 
 zx_status_t MaliG57::Bind(void* ctx, zx_device_t* device) {
   auto dev = std::make_unique<MaliG57>(device);
-  zx_status_t status = dev->DdkAdd("mali-g57");
+  soliloquy_hal::PublishMetrics(dev->inspector_);
+  zx_status_t status = dev->DdkAdd(ddk::DeviceAddArgs("mali-g57")
+                                       .set_inspect_vmo(
+                                           dev->inspector_.DuplicateVmo()));
   if (status != ZX_OK) {
     zxlogf(ERROR, "mali-g57: Could not create device: %s",
            zx_status_get_string(status));
@@ -44,11 +62,82 @@ void MaliG57::DdkUnbind(ddk::UnbindTxn txn) {
 void MaliG57::DdkRelease() { delete this; }
 
 zx_status_t MaliG57::Init() {
+  SOLILOQUY_TIMED_SCOPE(init_us, "mali_init");
   zxlogf(INFO, "Mali-G57 Driver Loaded");
   zxlogf(INFO, "mali-g57: Initializing hardware...");
   zxlogf(INFO, "mali-g57: Vendor ID: 0x%04X, Device ID: 0x%04X", kVendorId,
          kDeviceId);
 
+  zx_status_t status =
+      ddk::MmioBuffer::Create(kMaliBaseAddr, kMaliMmioSize, zx::resource(),
+                              ZX_CACHE_POLICY_UNCACHED_DEVICE, &gpu_mmio_);
+  if (status != ZX_OK) {
+    zxlogf(ERROR, "mali-g57: Failed to map GPU MMIO: %s",
+           zx_status_get_string(status));
+    return status;
+  }
+
+  uint32_t gpu_id = gpu_mmio_->Read32(kGpuIdReg);
+  if ((gpu_id >> 16) != kMaliG57ProductId) {
+    zxlogf(WARNING, "mali-g57: Unexpected GPU_ID 0x%08x", gpu_id);
+  }
+  zxlogf(INFO, "mali-g57: GPU_ID 0x%08x", gpu_id);
+
+  ddk::PDevProtocolClient pdev(parent());
+  if (!pdev.is_valid()) {
+    zxlogf(ERROR, "mali-g57: No platform device");
+    return ZX_ERR_NOT_SUPPORTED;
+  }
+  zx::bti bti;
+  status = pdev.GetBti(0, &bti);
+  if (status != ZX_OK) {
+    zxlogf(ERROR, "mali-g57: Failed to get BTI: %s",
+           zx_status_get_string(status));
+    return status;
+  }
+  zx::bti perf_bti;
+  status = bti.duplicate(ZX_RIGHT_SAME_RIGHTS, &perf_bti);
+  if (status != ZX_OK) {
+    return status;
+  }
+  address_space_ =
+      std::make_unique<AddressSpace>(&gpu_mmio_.value(), std::move(bti));
+  status = address_space_->Init();
+  if (status != ZX_OK) {
+    return status;
+  }
+
+  jobs_ = std::make_unique<JobManager>(&gpu_mmio_.value());
+  jobs_->Init();
+
+  power_ = std::make_unique<PowerManager>(&gpu_mmio_.value(), jobs_.get());
+  status = power_->Init();
+  if (status != ZX_OK) {
+    return status;
+  }
+
+  perf_ = std::make_unique<PerfCounters>(&gpu_mmio_.value(),
+                                         std::move(perf_bti),
+                                         address_space_.get(), power_.get());
+  status = perf_->Init();
+  if (status != ZX_OK) {
+    zxlogf(WARNING, "mali-g57: Performance counters unavailable: %s",
+           zx_status_get_string(status));
+    perf_.reset();
+  }
+
+  status = StartIrqThread();
+  if (status != ZX_OK) {
+    return status;
+  }
+
+  status = StartDvfs();
+  if (status != ZX_OK) {
+    // The GPU still works, just at a fixed clock.
+    zxlogf(WARNING, "mali-g57: No DVFS: %s", zx_status_get_string(status));
+    dvfs_.reset();
+  }
+
   initialized_ = true;
   zxlogf(INFO, "mali-g57: Initialization complete");
   return ZX_OK;
@@ -61,6 +150,21 @@ zx_status_t MaliG57::Shutdown() {
 
   zxlogf(INFO, "mali-g57: Shutting down...");
 
+  // Before the job manager goes: it is the governor's utilization source.
+  dvfs_.reset();
+  StopIrqThread();
+  if (jobs_) {
+    jobs_->Cancel();
+  }
+  // Before power-down: sampling holds the GPU on.
+  perf_.reset();
+  if (power_) {
+    power_->PowerOff();
+    power_.reset();
+  }
+  jobs_.reset();
+  address_space_.reset();
+
   if (gpu_mmio_.has_value()) {
     gpu_mmio_.reset();
   }
@@ -70,6 +174,238 @@ zx_status_t MaliG57::Shutdown() {
   return ZX_OK;
 }
 
+zx_status_t MaliG57::StartDvfs() {
+  zx_status_t status =
+      ddk::MmioBuffer::Create(kCcuBaseAddr, kCcuMmioSize, zx::resource(),
+                              ZX_CACHE_POLICY_UNCACHED_DEVICE, &ccu_mmio_);
+  if (status != ZX_OK) {
+    return status;
+  }
+  clocks_ = std::make_unique<soliloquy_hal::ClockResetHelper>(&*ccu_mmio_);
+  dvfs_ = std::make_unique<soliloquy_hal::DvfsGovernor>(clocks_.get());
+
+  status = dvfs_->AddDomain({
+      .name = "gpu",
+      .clock_id = CLK_GPU0,
+      .opp_hz = kGpuOpps,
+      .opp_count = std::size(kGpuOpps),
+      .utilization = {[](void* ctx) {
+                        return static_cast<JobManager*>(ctx)->BusyTime();
+                      },
+                      jobs_.get()},
+  });
+  if (status != ZX_OK) {
+    return status;
+  }
+  return dvfs_->Start();
+}
+
+void MaliG57::PrepareForWork() {
+  if (initialized_) {
+    power_->Wake();
+  }
+}
+
+zx_status_t MaliG57::SubmitJobs(uint32_t slot, const JobChain* chains,
+                                size_t count, uint64_t* out_first_id) {
+  if (!initialized_) {
+    return ZX_ERR_BAD_STATE;
+  }
+  zx_status_t status = power_->Acquire();
+  if (status != ZX_OK) {
+    return status;
+  }
+  status = jobs_->Submit(slot, chains, count, out_first_id);
+  power_->Release();
+  return status;
+}
+
+void MaliG57::SetJobCompletionHandler(const JobCompletionHandler& handler) {
+  if (jobs_) {
+    jobs_->SetCompletionHandler(handler);
+  }
+}
+
+zx_status_t MaliG57::MapMemory(const GpuMapping* mappings, size_t count) {
+  if (!initialized_) {
+    return ZX_ERR_BAD_STATE;
+  }
+  return address_space_->Map(mappings, count);
+}
+
+zx_status_t MaliG57::UnmapMemory(const GpuRange* ranges, size_t count) {
+  if (!initialized_) {
+    return ZX_ERR_BAD_STATE;
+  }
+  return address_space_->Unmap(ranges, count);
+}
+
+zx_status_t MaliG57::CleanCaches(const CacheCleanCallback& callback) {
+  if (!initialized_) {
+    return ZX_ERR_BAD_STATE;
+  }
+  return power_->CleanCaches(callback);
+}
+
+zx_status_t MaliG57::StartCounterSampling(zx::duration period) {
+  if (!initialized_) {
+    return ZX_ERR_BAD_STATE;
+  }
+  if (!perf_) {
+    return ZX_ERR_NOT_SUPPORTED;
+  }
+  return perf_->Start(period);
+}
+
+void MaliG57::StopCounterSampling() {
+  if (initialized_ && perf_) {
+    perf_->Stop();
+  }
+}
+
+zx_status_t MaliG57::GetCounterLayout(CounterLayout* out_layout) {
+  if (!initialized_) {
+    return ZX_ERR_BAD_STATE;
+  }
+  if (!perf_) {
+    return ZX_ERR_NOT_SUPPORTED;
+  }
+  *out_layout = perf_->layout();
+  return ZX_OK;
+}
+
+zx_status_t MaliG57::ReadCounterSamples(CounterSample* out, size_t max,
+                                        size_t* out_actual) {
+  if (!initialized_) {
+    return ZX_ERR_BAD_STATE;
+  }
+  if (!perf_) {
+    return ZX_ERR_NOT_SUPPORTED;
+  }
+  *out_actual = perf_->ReadSamples(out, max);
+  return ZX_OK;
+}
+
+zx_status_t MaliG57::StartIrqThread() {
+  ddk::PDevProtocolClient pdev(parent());
+  if (!pdev.is_valid()) {
+    zxlogf(ERROR, "mali-g57: No platform device");
+    return ZX_ERR_NOT_SUPPORTED;
+  }
+
+  zx_status_t status = pdev.GetInterrupt(kIrqIndexJob, 0, &job_irq_);
+  if (status != ZX_OK) {
+    zxlogf(ERROR, "mali-g57: Failed to get job interrupt: %s",
+           zx_status_get_string(status));
+    return status;
+  }
+
+  status = pdev.GetInterrupt(kIrqIndexGpu, 0, &gpu_irq_);
+  if (status != ZX_OK) {
+    zxlogf(ERROR, "mali-g57: Failed to get GPU interrupt: %s",
+           zx_status_get_string(status));
+    return status;
+  }
+
+  status = zx::port::create(ZX_PORT_BIND_TO_INTERRUPT, &irq_port_);
+  if (status != ZX_OK) {
+    zxlogf(ERROR, "mali-g57: Failed to create IRQ port: %s",
+           zx_status_get_string(status));
+    return status;
+  }
+  status = job_irq_.bind(irq_port_, kPortKeyJobIrq, 0);
+  if (status != ZX_OK) {
+    zxlogf(ERROR, "mali-g57: Failed to bind job interrupt: %s",
+           zx_status_get_string(status));
+    return status;
+  }
+  status = gpu_irq_.bind(irq_port_, kPortKeyGpuIrq, 0);
+  if (status != ZX_OK) {
+    zxlogf(ERROR, "mali-g57: Failed to bind GPU interrupt: %s",
+           zx_status_get_string(status));
+    return status;
+  }
+  status = power_->BindIdleTimer(irq_port_, kPortKeyIdleTimer);
+  if (status != ZX_OK) {
+    zxlogf(ERROR, "mali-g57: Failed to bind idle timer: %s",
+           zx_status_get_string(status));
+    return status;
+  }
+  if (perf_) {
+    status = perf_->BindTimer(irq_port_, kPortKeyPerfTimer);
+    if (status != ZX_OK) {
+      zxlogf(ERROR, "mali-g57: Failed to bind counter timer: %s",
+             zx_status_get_string(status));
+      return status;
+    }
+  }
+
+  int rc = thrd_create_with_name(
+      &irq_thread_,
+      [](void* arg) { return static_cast<MaliG57*>(arg)->IrqThread(); }, this,
+      "mali-g57-irq");
+  if (rc != thrd_success) {
+    zxlogf(ERROR, "mali-g57: Failed to start IRQ thread");
+    return ZX_ERR_NO_RESOURCES;
+  }
+  irq_thread_started_ = true;
+  return ZX_OK;
+}
+
+void MaliG57::StopIrqThread() {
+  if (!irq_thread_started_) {
+    return;
+  }
+
+  zx_port_packet_t packet = {};
+  packet.key = kPortKeyStop;
+  packet.type = ZX_PKT_TYPE_USER;
+  irq_port_.queue(&packet);
+  thrd_join(irq_thread_, nullptr);
+  irq_thread_started_ = false;
+  job_irq_.destroy();
+  gpu_irq_.destroy();
+}
+
+int MaliG57::IrqThread() {
+  while (true) {
+    zx_port_packet_t packet;
+    zx_status_t status = irq_port_.wait(zx::time::infinite(), &packet);
+    if (status != ZX_OK) {
+      zxlogf(ERROR, "mali-g57: IRQ port wait failed: %s",
+             zx_status_get_string(status));
+      return status;
+    }
+
+    switch (packet.key) {
+      case kPortKeyStop:
+        return 0;
+      case kPortKeyJobIrq:
+        jobs_->HandleIrq();
+        if (jobs_->Idle()) {
+          power_->NotifyIdle();
+        }
+        job_irq_.ack();
+        break;
+      case kPortKeyGpuIrq:
+        power_->HandleIrq();
+        if (perf_) {
+          perf_->HandleIrq();
+        }
+        gpu_irq_.ack();
+        break;
+      case kPortKeyIdleTimer:
+        power_->HandleIdleTimeout();
+        power_->BindIdleTimer(irq_port_, kPortKeyIdleTimer);
+        break;
+      case kPortKeyPerfTimer:
+        perf_->HandleTimer();
+        perf_->BindTimer(irq_port_, kPortKeyPerfTimer);
+        break;
+    }
+  }
+}
+
 static constexpr zx_driver_ops_t mali_g57_driver_ops = []() {
   zx_driver_ops_t ops = {};
   ops.version = DRIVER_OPS_VERSION;
@@ -4,10 +4,22 @@
 #include <ddktl/device.h>
 #include <lib/ddk/device.h>
 #include <lib/ddk/driver.h>
+#include <lib/inspect/cpp/inspect.h>
 #include <lib/mmio/mmio.h>
+#include <lib/zx/interrupt.h>
+#include <lib/zx/port.h>
+#include <threads.h>
 
+#include <memory>
 #include <optional>
 
+#include "../../common/soliloquy_hal/clock_reset.h"
+#include "../../common/soliloquy_hal/dvfs.h"
+#include "../../common/soliloquy_hal/metrics.h"
+#include "address_space.h"
+#include "job_manager.h"
+#include "perf_counters.h"
+#include "power_manager.h"
 #include "registers.h"
 
 namespace mali_g57 {
@@ -26,15 +38,80 @@ class MaliG57 : public MaliG57Type {
   void DdkUnbind(ddk::UnbindTxn txn);
   void DdkRelease();
 
+  // Hint that jobs are about to be submitted. Starts powering the GPU up so
+  // the latency overlaps building the job chains.
+  void PrepareForWork();
+
+  // Queues job chains on |slot|, powering the GPU up first if it is gated;
+  // see JobManager::Submit.
+  zx_status_t SubmitJobs(uint32_t slot, const JobChain* chains, size_t count,
+                         uint64_t* out_first_id);
+  void SetJobCompletionHandler(const JobCompletionHandler& handler);
+
+  // Maps pinned pages into, or removes them from, the GPU address space that
+  // job chains run in; see AddressSpace.
+  zx_status_t MapMemory(const GpuMapping* mappings, size_t count);
+  zx_status_t UnmapMemory(const GpuRange* ranges, size_t count);
+
+  // Cleans the GPU caches asynchronously; see PowerManager::CleanCaches.
+  zx_status_t CleanCaches(const CacheCleanCallback& callback);
+
+  // Samples the hardware performance counters every |period| into a ring
+  // of kRingSize dumps, which ReadCounterSamples() drains oldest first; see
+  // PerfCounters. The GPU stays powered while sampling runs. These fail
+  // with ZX_ERR_NOT_SUPPORTED if the counters could not be set up.
+  zx_status_t StartCounterSampling(zx::duration period);
+  void StopCounterSampling();
+  zx_status_t GetCounterLayout(CounterLayout* out_layout);
+  zx_status_t ReadCounterSamples(CounterSample* out, size_t max,
+                                 size_t* out_actual);
+
  private:
   zx_status_t Init();
   zx_status_t Shutdown();
 
+  zx_status_t StartIrqThread();
+  void StopIrqThread();
+  int IrqThread();
+
+  // Scales the GPU clock with JobManager::BusyTime(). The GPU runs at
+  // whatever the bootloader set if the CCU cannot be mapped.
+  zx_status_t StartDvfs();
+
   std::optional<ddk::MmioBuffer> gpu_mmio_;
+  std::optional<ddk::MmioBuffer> ccu_mmio_;
+  std::unique_ptr<soliloquy_hal::ClockResetHelper> clocks_;
+  std::unique_ptr<soliloquy_hal::DvfsGovernor> dvfs_;
+  std::unique_ptr<AddressSpace> address_space_;
+  std::unique_ptr<JobManager> jobs_;
+  std::unique_ptr<PowerManager> power_;
+  // Null if the counters are unsupported; the GPU works without them.
+  std::unique_ptr<PerfCounters> perf_;
   bool initialized_ = false;
 
+  zx::interrupt job_irq_;
+  zx::interrupt gpu_irq_;
+  zx::port irq_port_;
+  thrd_t irq_thread_;
+  bool irq_thread_started_ = false;
+
+  inspect::Inspector inspector_;
+
   static constexpr uint32_t kVendorId = 0x13B5;
   static constexpr uint32_t kDeviceId = 0x0B57;
+
+  static constexpr uint64_t kCcuBaseAddr = 0x02001000;
+  static constexpr size_t kCcuMmioSize = 0x1000;
+
+  // Platform device interrupt order, as in the Arm device tree binding.
+  static constexpr uint32_t kIrqIndexJob = 0;
+  static constexpr uint32_t kIrqIndexGpu = 2;
+
+  static constexpr uint64_t kPortKeyJobIrq = 0;
+  static constexpr uint64_t kPortKeyStop = 1;
+  static constexpr uint64_t kPortKeyGpuIrq = 2;
+  static constexpr uint64_t kPortKeyIdleTimer = 3;
+  static constexpr uint64_t kPortKeyPerfTimer = 4;
 };
 
 }  // namespace mali_g57
@@ -0,0 +1,299 @@
+#include "perf_counters.h"
+
+#include <fbl/auto_lock.h>
+#include <lib/ddk/debug.h>
+#include <lib/ddk/trace/event.h>
+#include <lib/zx/clock.h>
+#include <lib/zx/vmar.h>
+#include <zircon/status.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include "../../common/soliloquy_hal/metrics.h"
+
+namespace mali_g57 {
+
+namespace {
+
+soliloquy_hal::Counter perf_samples("mali-g57.perf_samples");
+soliloquy_hal::Counter perf_samples_dropped("mali-g57.perf_samples_dropped");
+soliloquy_hal::Counter perf_overruns("mali-g57.perf_overruns");
+soliloquy_hal::Histogram perf_dump_us("mali-g57.perf_dump_us");
+
+// Dumps go through address space 0, alongside the job chains.
+constexpr uint32_t kDumpAddressSpace = 0;
+
+}  // namespace
+
+PerfCounters::~PerfCounters() {
+  Stop();
+  if (dump_mapped_) {
+    address_space_->Unmap(GpuRange{kDumpGpuVa, AddressSpace::kPageSize});
+  }
+  if (dump_pmt_.is_valid()) {
+    dump_pmt_.unpin();
+  }
+  if (dump_) {
+    zx::vmar::root_self()->unmap(reinterpret_cast<uintptr_t>(dump_),
+                                 AddressSpace::kPageSize);
+  }
+}
+
+zx_status_t PerfCounters::Init() {
+  uint64_t shader_present =
+      mmio_->Read32(kShaderPresentLoReg) |
+      (static_cast<uint64_t>(mmio_->Read32(kShaderPresentHiReg)) << 32);
+  uint32_t l2_present = mmio_->Read32(kL2PresentLoReg);
+  uint32_t cores = shader_present ? 64 - __builtin_clzll(shader_present) : 0;
+  uint32_t slices = __builtin_popcount(l2_present);
+  if (cores > kMaxShaderCores || slices > kMaxL2Slices) {
+    // The GPU would dump past the end of the page.
+    zxlogf(WARNING,
+           "mali-g57: No counter support for SHADER_PRESENT 0x%lx, "
+           "L2_PRESENT 0x%x",
+           shader_present, l2_present);
+    return ZX_ERR_NOT_SUPPORTED;
+  }
+  layout_ = {
+      .block_count = kCounterBlockL2 + slices + cores,
+      .l2_slices = slices,
+      .shader_cores = cores,
+      .shader_present = shader_present,
+  };
+
+  zx_status_t status = zx::vmo::create_contiguous(bti_, AddressSpace::kPageSize,
+                                                  0, &dump_vmo_);
+  if (status != ZX_OK) {
+    zxlogf(ERROR, "mali-g57: Failed to allocate counter dump page: %s",
+           zx_status_get_string(status));
+    return status;
+  }
+  zx_vaddr_t mapped;
+  status = zx::vmar::root_self()->map(ZX_VM_PERM_READ, 0, dump_vmo_, 0,
+                                      AddressSpace::kPageSize, &mapped);
+  if (status != ZX_OK) {
+    return status;
+  }
+  dump_ = reinterpret_cast<const uint32_t*>(mapped);
+  status = bti_.pin(ZX_BTI_PERM_WRITE | ZX_BTI_CONTIGUOUS, dump_vmo_, 0,
+                    AddressSpace::kPageSize, &dump_paddr_, 1, &dump_pmt_);
+  if (status != ZX_OK) {
+    return status;
+  }
+  // The mapping is read-only, so once the zeroed page is cleaned the CPU
+  // never holds a dirty line that could overwrite a dump.
+  dump_vmo_.op_range(ZX_VMO_OP_CACHE_CLEAN_INVALIDATE, 0,
+                     AddressSpace::kPageSize, nullptr, 0);
+
+  // Uncached on the GPU side, so the dump is in memory by the time the
+  // interrupt fires.
+  status = address_space_->Map(GpuMapping{kDumpGpuVa, &dump_paddr_, 1,
+                                          kGpuMapWrite | kGpuMapUncached});
+  if (status != ZX_OK) {
+    zxlogf(ERROR, "mali-g57: Failed to map counter dump page: %s",
+           zx_status_get_string(status));
+    return status;
+  }
+  dump_mapped_ = true;
+
+  status = zx::timer::create(0, ZX_CLOCK_MONOTONIC, &timer_);
+  if (status != ZX_OK) {
+    zxlogf(ERROR, "mali-g57: Failed to create counter timer: %s",
+           zx_status_get_string(status));
+    return status;
+  }
+
+  fbl::AutoLock lock(&lock_);
+  ring_ = std::make_unique<CounterSample[]>(kRingSize);
+  DisableLocked();
+  mmio_->Write32(kIrqMask, kGpuIrqClearReg);
+  mmio_->Write32(mmio_->Read32(kGpuIrqMaskReg) | kIrqMask, kGpuIrqMaskReg);
+  return ZX_OK;
+}
+
+zx_status_t PerfCounters::BindTimer(const zx::port& port, uint64_t key) {
+  return timer_.wait_async(port, key, ZX_TIMER_SIGNALED, 0);
+}
+
+zx_status_t PerfCounters::Start(zx::duration period) {
+  if (period < kMinPeriod) {
+    return ZX_ERR_INVALID_ARGS;
+  }
+
+  // Not under lock_: powering up waits for the GPU interrupt, which this
+  // class also services.
+  zx_status_t status = power_->Acquire();
+  if (status != ZX_OK) {
+    return status;
+  }
+
+  fbl::AutoLock lock(&lock_);
+  if (running_) {
+    power_->Release();
+    return ZX_ERR_BAD_STATE;
+  }
+  ProgramLocked();
+  running_ = true;
+  period_ = period;
+  dump_pending_ = false;
+  sequence_ = 0;
+  ring_head_ = 0;
+  ring_count_ = 0;
+  last_dump_ = zx::clock::get_monotonic();
+  next_deadline_ = last_dump_ + period;
+  timer_.set(next_deadline_, kTimerSlack);
+  return ZX_OK;
+}
+
+void PerfCounters::Stop() {
+  fbl::AutoLock lock(&lock_);
+  if (!running_) {
+    return;
+  }
+  timer_.cancel();
+  DisableLocked();
+  running_ = false;
+  dump_pending_ = false;
+  power_->Release();
+}
+
+size_t PerfCounters::ReadSamples(CounterSample* out, size_t max) {
+  fbl::AutoLock lock(&lock_);
+  size_t count = std::min(max, ring_count_);
+  for (size_t i = 0; i < count; i++) {
+    out[i] = ring_[ring_head_];
+    ring_head_ = (ring_head_ + 1) % kRingSize;
+  }
+  ring_count_ -= count;
+  return count;
+}
+
+void PerfCounters::HandleTimer() {
+  fbl::AutoLock lock(&lock_);
+  timer_.cancel();
+  if (!running_) {
+    return;
+  }
+
+  zx::time now = zx::clock::get_monotonic();
+  if (dump_pending_ && now - dump_started_ < kDumpTimeout) {
+    // The previous dump is still being written; fold this period into the
+    // next one.
+    perf_overruns.Add();
+  } else {
+    if (dump_pending_) {
+      zxlogf(WARNING, "mali-g57: Counter dump timed out");
+    }
+    mmio_->Write32(kGpuCmdPrfcntSample, kGpuCmdReg);
+    dump_pending_ = true;
+    dump_started_ = now;
+  }
+
+  // Stay on the period grid, skipping ticks that have already passed.
+  next_deadline_ += period_;
+  if (next_deadline_ <= now) {
+    next_deadline_ = now + period_;
+  }
+  timer_.set(next_deadline_, kTimerSlack);
+}
+
+void PerfCounters::HandleIrq() {
+  uint32_t pending = mmio_->Read32(kGpuIrqRawstatReg) & kIrqMask;
+  if (!pending) {
+    return;
+  }
+  mmio_->Write32(pending, kGpuIrqClearReg);
+
+  fbl::AutoLock lock(&lock_);
+  if (!running_ || !dump_pending_) {
+    return;
+  }
+  dump_pending_ = false;
+  zx::time now = zx::clock::get_monotonic();
+  perf_dump_us.Record((now - dump_started_).to_usecs());
+
+  size_t slot = (ring_head_ + ring_count_) % kRingSize;
+  if (ring_count_ == kRingSize) {
+    ring_head_ = (ring_head_ + 1) % kRingSize;
+    perf_samples_dropped.Add();
+  } else {
+    ring_count_++;
+  }
+
+  CounterSample& sample = ring_[slot];
+  sample.sequence = sequence_++;
+  sample.timestamp = now.get();
+  sample.elapsed = (now - last_dump_).get();
+  sample.block_count = layout_.block_count;
+  size_t size = layout_.block_count * kCountersPerBlock * sizeof(uint32_t);
+  dump_vmo_.op_range(ZX_VMO_OP_CACHE_CLEAN_INVALIDATE, 0, size, nullptr, 0);
+  memcpy(sample.counters, dump_, size);
+  last_dump_ = now;
+  perf_samples.Add();
+
+  TraceSample(sample);
+}
+
+void PerfCounters::ProgramLocked() {
+  mmio_->Write32(static_cast<uint32_t>(kDumpGpuVa), kPrfcntBaseLoReg);
+  mmio_->Write32(static_cast<uint32_t>(kDumpGpuVa >> 32), kPrfcntBaseHiReg);
+  mmio_->Write32(UINT32_MAX, kPrfcntJmEnReg);
+  mmio_->Write32(UINT32_MAX, kPrfcntShaderEnReg);
+  mmio_->Write32(UINT32_MAX, kPrfcntTilerEnReg);
+  mmio_->Write32(UINT32_MAX, kPrfcntMmuL2EnReg);
+  mmio_->Write32(
+      kPrfcntConfigModeManual | (kDumpAddressSpace << kPrfcntConfigAsShift),
+      kPrfcntConfigReg);
+  mmio_->Write32(kGpuCmdPrfcntClear, kGpuCmdReg);
+}
+
+void PerfCounters::DisableLocked() {
+  mmio_->Write32(kPrfcntConfigModeOff, kPrfcntConfigReg);
+  mmio_->Write32(0, kPrfcntJmEnReg);
+  mmio_->Write32(0, kPrfcntShaderEnReg);
+  mmio_->Write32(0, kPrfcntTilerEnReg);
+  mmio_->Write32(0, kPrfcntMmuL2EnReg);
+}
+
+// Summed over L2 slices and cores: enough to tell shader-, tiler- and
+// memory-bound frames apart on a trace timeline.
+void PerfCounters::TraceSample(const CounterSample& sample) {
+  if (!TRACE_CATEGORY_ENABLED("soliloquy")) {
+    return;
+  }
+
+  uint64_t read_beats = 0;
+  uint64_t write_beats = 0;
+  for (uint32_t i = 0; i < layout_.l2_slices; i++) {
+    const uint32_t* block = sample.counters[kCounterBlockL2 + i];
+    read_beats += block[kCounterL2ExtReadBeats];
+    write_beats += block[kCounterL2ExtWriteBeats];
+  }
+  uint64_t frag_active = 0;
+  uint64_t compute_active = 0;
+  uint64_t exec_active = 0;
+  for (uint32_t i = 0; i < layout_.shader_cores; i++) {
+    if (!(layout_.shader_present & (1ull << i))) {
+      continue;
+    }
+    const uint32_t* block =
+        sample.counters[kCounterBlockL2 + layout_.l2_slices + i];
+    frag_active += block[kCounterShaderFragActive];
+    compute_active += block[kCounterShaderComputeActive];
+    exec_active += block[kCounterShaderExecCoreActive];
+  }
+
+  TRACE_COUNTER(
+      "soliloquy", "mali_counters", 0, "gpu_active",
+      static_cast<uint64_t>(sample.counters[kCounterBlockJm]
+                                           [kCounterJmGpuActive]),
+      "tiler_active",
+      static_cast<uint64_t>(sample.counters[kCounterBlockTiler]
+                                           [kCounterTilerActive]),
+      "frag_active", frag_active, "compute_active", compute_active,
+      "exec_core_active", exec_active, "l2_ext_read_beats", read_beats,
+      "l2_ext_write_beats", write_beats);
+}
+
+}  // namespace mali_g57
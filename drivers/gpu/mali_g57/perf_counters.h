@@ -0,0 +1,160 @@
+#ifndef DRIVERS_GPU_MALI_G57_PERF_COUNTERS_H_
+#define DRIVERS_GPU_MALI_G57_PERF_COUNTERS_H_
+
+#include <fbl/mutex.h>
+#include <lib/mmio/mmio.h>
+#include <lib/zx/bti.h>
+#include <lib/zx/pmt.h>
+#include <lib/zx/port.h>
+#include <lib/zx/time.h>
+#include <lib/zx/timer.h>
+#include <lib/zx/vmo.h>
+#include <zircon/compiler.h>
+#include <zircon/types.h>
+
+#include <cstdint>
+#include <memory>
+
+#include "address_space.h"
+#include "power_manager.h"
+#include "registers.h"
+
+namespace mali_g57 {
+
+constexpr size_t kCountersPerBlock = 64;
+constexpr size_t kMaxL2Slices = 2;
+constexpr size_t kMaxShaderCores = 8;
+// Job manager, tiler, then each L2 slice, then each shader core.
+constexpr size_t kMaxCounterBlocks = 2 + kMaxL2Slices + kMaxShaderCores;
+
+// The blocks in each sample: the job manager and tiler blocks, then L2
+// slice n at kCounterBlockL2 + n, then shader core n at kCounterBlockL2 +
+// l2_slices + n. Cores are numbered by their bit in |shader_present|, with
+// blocks for any holes, as the hardware dumps them.
+struct CounterLayout {
+  uint32_t block_count;
+  uint32_t l2_slices;
+  uint32_t shader_cores;
+  uint64_t shader_present;
+};
+
+constexpr uint32_t kCounterBlockJm = 0;
+constexpr uint32_t kCounterBlockTiler = 1;
+constexpr uint32_t kCounterBlockL2 = 2;
+
+// Counter indices within a block, from the Valhall counter layout. The
+// first four counters of every block are a header, not counts.
+constexpr size_t kCounterJmGpuActive = 6;
+constexpr size_t kCounterTilerActive = 4;
+constexpr size_t kCounterShaderFragActive = 4;
+constexpr size_t kCounterShaderComputeActive = 22;
+constexpr size_t kCounterShaderExecCoreActive = 26;
+constexpr size_t kCounterL2ExtReadBeats = 32;
+constexpr size_t kCounterL2ExtWriteBeats = 47;
+
+// One dump of every counter block. Each block holds the counts accumulated
+// since the previous dump; the hardware clears the counters as it dumps.
+struct CounterSample {
+  // Consecutive while sampling runs; a gap means samples were dropped.
+  uint64_t sequence;
+  // When the dump completed, and the time since the previous one.
+  zx_time_t timestamp;
+  zx_duration_t elapsed;
+  uint32_t block_count;
+  uint32_t counters[kMaxCounterBlocks][kCountersPerBlock];
+};
+
+// Samples the hardware counter blocks into a ring.
+//
+// While sampling runs a timer on the IRQ port issues PRFCNT_SAMPLE every
+// period. The GPU writes the blocks to a pinned page mapped at
+// kDumpGpuVa and raises PRFCNT_SAMPLE_COMPLETED, which copies them into
+// the next ring slot and emits a trace counter summary. When the ring
+// fills, the oldest samples are overwritten. Sampling holds the GPU
+// powered, since gating it loses the counters.
+class PerfCounters {
+ public:
+  PerfCounters(ddk::MmioBuffer* mmio, zx::bti bti, AddressSpace* address_space,
+               PowerManager* power)
+      : mmio_(mmio),
+        bti_(std::move(bti)),
+        address_space_(address_space),
+        power_(power) {}
+  ~PerfCounters();
+
+  PerfCounters(const PerfCounters&) = delete;
+  PerfCounters& operator=(const PerfCounters&) = delete;
+
+  // Reads the block layout, allocates the dump page, maps it into the GPU
+  // address space and unmasks the sample interrupt.
+  zx_status_t Init();
+
+  // Arms the sample timer to signal |key| on |port|. Must be called again
+  // after each HandleTimer().
+  zx_status_t BindTimer(const zx::port& port, uint64_t key);
+
+  CounterLayout layout() const { return layout_; }
+
+  // Clears the counters and the ring and dumps every |period|. Fails with
+  // ZX_ERR_BAD_STATE if sampling is already running.
+  zx_status_t Start(zx::duration period);
+  // Stops the timer and disables the counters. Samples already in the
+  // ring stay readable.
+  void Stop();
+
+  // Moves up to |max| of the oldest samples to |out|.
+  size_t ReadSamples(CounterSample* out, size_t max);
+
+  // Sample timer: starts the next dump.
+  void HandleTimer();
+  // GPU interrupt: a dump has completed.
+  void HandleIrq();
+
+  // The last 1MB of the address space, reserved for the dump page.
+  static constexpr uint64_t kDumpGpuVa =
+      (1ull << AddressSpace::kVaBits) - 0x100000;
+  static constexpr size_t kRingSize = 32;
+  static constexpr zx::duration kMinPeriod = zx::msec(1);
+
+ private:
+  void ProgramLocked() __TA_REQUIRES(lock_);
+  void DisableLocked() __TA_REQUIRES(lock_);
+  void TraceSample(const CounterSample& sample);
+
+  ddk::MmioBuffer* mmio_;
+  zx::bti bti_;
+  AddressSpace* address_space_;
+  PowerManager* power_;
+  CounterLayout layout_ = {};
+
+  zx::vmo dump_vmo_;
+  zx::pmt dump_pmt_;
+  zx_paddr_t dump_paddr_ = 0;
+  const uint32_t* dump_ = nullptr;
+  bool dump_mapped_ = false;
+  zx::timer timer_;
+
+  fbl::Mutex lock_;
+  bool running_ __TA_GUARDED(lock_) = false;
+  zx::duration period_ __TA_GUARDED(lock_);
+  zx::time next_deadline_ __TA_GUARDED(lock_);
+  // A PRFCNT_SAMPLE has been issued and not completed.
+  bool dump_pending_ __TA_GUARDED(lock_) = false;
+  zx::time dump_started_ __TA_GUARDED(lock_);
+  zx::time last_dump_ __TA_GUARDED(lock_);
+  uint64_t sequence_ __TA_GUARDED(lock_) = 0;
+  std::unique_ptr<CounterSample[]> ring_ __TA_GUARDED(lock_);
+  size_t ring_head_ __TA_GUARDED(lock_) = 0;
+  size_t ring_count_ __TA_GUARDED(lock_) = 0;
+
+  static constexpr uint32_t kIrqMask = kGpuIrqPrfcntSample;
+  static constexpr size_t kDumpSize =
+      kMaxCounterBlocks * kCountersPerBlock * sizeof(uint32_t);
+  // A dump outstanding for this long lost its interrupt and is reissued.
+  static constexpr zx::duration kDumpTimeout = zx::msec(10);
+  static constexpr zx::duration kTimerSlack = zx::usec(100);
+};
+
+}  // namespace mali_g57
+
+#endif  // DRIVERS_GPU_MALI_G57_PERF_COUNTERS_H_
@@ -0,0 +1,290 @@
+#include "power_manager.h"
+
+#include <fbl/auto_lock.h>
+#include <lib/ddk/debug.h>
+#include <lib/zx/clock.h>
+#include <zircon/status.h>
+
+#include <algorithm>
+
+#include "../../common/soliloquy_hal/metrics.h"
+#include "../../common/soliloquy_hal/mmio.h"
+
+namespace mali_g57 {
+
+namespace {
+
+soliloquy_hal::Counter power_ups("mali-g57.power_ups");
+soliloquy_hal::Counter power_downs("mali-g57.power_downs");
+soliloquy_hal::Counter cache_cleans("mali-g57.cache_cleans");
+soliloquy_hal::Histogram power_up_us("mali-g57.power_up_us");
+
+}  // namespace
+
+zx_status_t PowerManager::Init() {
+  zx_status_t status = zx::timer::create(0, ZX_CLOCK_MONOTONIC, &idle_timer_);
+  if (status != ZX_OK) {
+    zxlogf(ERROR, "mali-g57: Failed to create idle timer: %s",
+           zx_status_get_string(status));
+    return status;
+  }
+
+  fbl::AutoLock lock(&lock_);
+  mmio_->Write32(kIrqMask, kGpuIrqClearReg);
+  mmio_->Write32(kIrqMask, kGpuIrqMaskReg);
+  if (PoweredLocked()) {
+    state_ = State::kOn;
+    ArmIdleTimerLocked();
+  } else {
+    state_ = State::kOff;
+    off_since_ = zx::clock::get_monotonic();
+  }
+  return ZX_OK;
+}
+
+zx_status_t PowerManager::BindIdleTimer(const zx::port& port, uint64_t key) {
+  return idle_timer_.wait_async(port, key, ZX_TIMER_SIGNALED, 0);
+}
+
+void PowerManager::Wake() {
+  fbl::AutoLock lock(&lock_);
+  WakeLocked();
+  if (active_ == 0) {
+    ArmIdleTimerLocked();
+  }
+}
+
+zx_status_t PowerManager::Acquire() {
+  fbl::AutoLock lock(&lock_);
+  active_++;
+  WakeLocked();
+
+  zx::time deadline = zx::deadline_after(kPowerUpTimeout);
+  while (state_ != State::kOn) {
+    zx::duration left = deadline - zx::clock::get_monotonic();
+    if (left <= zx::duration(0)) {
+      active_--;
+      zxlogf(ERROR, "mali-g57: GPU did not power up");
+      return ZX_ERR_TIMED_OUT;
+    }
+    cv_.Timedwait(&lock_, left.get());
+  }
+  return ZX_OK;
+}
+
+void PowerManager::Release() {
+  fbl::AutoLock lock(&lock_);
+  if (--active_ == 0) {
+    ArmIdleTimerLocked();
+  }
+}
+
+void PowerManager::NotifyIdle() {
+  fbl::AutoLock lock(&lock_);
+  if (state_ == State::kOn && active_ == 0) {
+    ArmIdleTimerLocked();
+  }
+}
+
+zx_status_t PowerManager::CleanCaches(const CacheCleanCallback& callback) {
+  if (!callback.done) {
+    return ZX_ERR_INVALID_ARGS;
+  }
+
+  {
+    fbl::AutoLock lock(&lock_);
+    if (state_ == State::kOn || state_ == State::kDraining) {
+      if (waiter_count_ == kMaxCleanWaiters) {
+        return ZX_ERR_SHOULD_WAIT;
+      }
+      waiters_[waiter_count_++] = {callback, RequestCleanLocked()};
+      return ZX_OK;
+    }
+  }
+
+  // Off or on the way up or down, after a clean: nothing is cached.
+  callback.done(callback.ctx, ZX_OK);
+  return ZX_OK;
+}
+
+void PowerManager::HandleIrq() {
+  uint32_t pending = mmio_->Read32(kGpuIrqRawstatReg) & kIrqMask;
+  mmio_->Write32(pending, kGpuIrqClearReg);
+
+  CleanWaiter done[kMaxCleanWaiters];
+  size_t done_count = 0;
+  {
+    fbl::AutoLock lock(&lock_);
+    if ((pending & kGpuIrqCacheClean) && clean_running_) {
+      done_count = CleanDoneLocked(done);
+    }
+    if (pending & kGpuIrqPowerChanged) {
+      PowerChangedLocked();
+    }
+  }
+
+  for (size_t i = 0; i < done_count; i++) {
+    done[i].callback.done(done[i].callback.ctx, ZX_OK);
+  }
+}
+
+void PowerManager::HandleIdleTimeout() {
+  fbl::AutoLock lock(&lock_);
+  idle_timer_.cancel();
+  if (state_ != State::kOn || active_ > 0 || !jobs_->Idle()) {
+    return;
+  }
+  state_ = State::kDraining;
+  drain_generation_ = RequestCleanLocked();
+}
+
+void PowerManager::PowerOff() {
+  CleanWaiter canceled[kMaxCleanWaiters];
+  size_t canceled_count;
+  {
+    fbl::AutoLock lock(&lock_);
+    idle_timer_.cancel();
+
+    soliloquy_hal::MmioHelper helper(mmio_);
+    if (PoweredLocked()) {
+      mmio_->Write32(kGpuIrqCacheClean, kGpuIrqClearReg);
+      mmio_->Write32(kGpuCmdCleanCaches, kGpuCmdReg);
+      if (!helper.WaitForMask32(kGpuIrqRawstatReg, kGpuIrqCacheClean,
+                                kGpuIrqCacheClean, kSyncTimeout)) {
+        zxlogf(WARNING, "mali-g57: Cache clean timed out");
+      }
+      mmio_->Write32(kGpuCmdPwrDown, kGpuCmdReg);
+      if (!helper.WaitForMask32(kGpuStatusReg, kGpuStatusPwrActive, 0,
+                                kSyncTimeout)) {
+        zxlogf(WARNING, "mali-g57: Power down timed out");
+      }
+      power_downs.Add();
+    }
+    mmio_->Write32(0, kGpuIrqMaskReg);
+
+    state_ = State::kOff;
+    clean_running_ = false;
+    wake_pending_ = false;
+    canceled_count = waiter_count_;
+    std::copy(waiters_, waiters_ + waiter_count_, canceled);
+    waiter_count_ = 0;
+    cv_.Broadcast();
+  }
+
+  for (size_t i = 0; i < canceled_count; i++) {
+    canceled[i].callback.done(canceled[i].callback.ctx, ZX_ERR_CANCELED);
+  }
+}
+
+void PowerManager::WakeLocked() {
+  switch (state_) {
+    case State::kOff: {
+      // Gated for less than the idle delay: powering down cost more than
+      // it saved, so wait longer next time. Long idle periods undo that.
+      zx::duration off = zx::clock::get_monotonic() - off_since_;
+      if (off < idle_delay_) {
+        idle_delay_ = std::min(idle_delay_ * 2, kMaxIdleDelay);
+      } else if (off > idle_delay_ * 8) {
+        idle_delay_ = std::max(idle_delay_ / 2, kMinIdleDelay);
+      }
+      PowerUpLocked();
+      break;
+    }
+    case State::kDraining:
+      // Still powered; the clean finishes harmlessly.
+      state_ = State::kOn;
+      idle_delay_ = std::min(idle_delay_ * 2, kMaxIdleDelay);
+      break;
+    case State::kPoweringDown:
+      wake_pending_ = true;
+      idle_delay_ = std::min(idle_delay_ * 2, kMaxIdleDelay);
+      break;
+    case State::kPoweringUp:
+    case State::kOn:
+      break;
+  }
+}
+
+void PowerManager::PowerUpLocked() {
+  mmio_->Write32(kGpuCmdPwrUp, kGpuCmdReg);
+  state_ = State::kPoweringUp;
+  power_up_started_ = zx::clock::get_monotonic();
+  power_ups.Add();
+}
+
+void PowerManager::ArmIdleTimerLocked() {
+  idle_timer_.set(zx::deadline_after(idle_delay_), kIdleTimerSlack);
+}
+
+uint64_t PowerManager::RequestCleanLocked() {
+  if (!clean_running_) {
+    StartCleanLocked();
+    return clean_started_;
+  }
+  // The running clean may have missed writes made before this request.
+  clean_wanted_ = clean_started_ + 1;
+  return clean_wanted_;
+}
+
+void PowerManager::StartCleanLocked() {
+  mmio_->Write32(kGpuCmdCleanCaches, kGpuCmdReg);
+  clean_running_ = true;
+  clean_started_++;
+  cache_cleans.Add();
+}
+
+size_t PowerManager::CleanDoneLocked(CleanWaiter* out) {
+  clean_running_ = false;
+  uint64_t done = clean_started_;
+
+  // The GPU has been idle since the drain clean started, so that clean
+  // covers every request made while it ran.
+  bool drained = state_ == State::kDraining && drain_generation_ <= done;
+
+  size_t count = 0;
+  size_t kept = 0;
+  for (size_t i = 0; i < waiter_count_; i++) {
+    if (drained || waiters_[i].generation <= done) {
+      out[count++] = waiters_[i];
+    } else {
+      waiters_[kept++] = waiters_[i];
+    }
+  }
+  waiter_count_ = kept;
+
+  if (drained) {
+    mmio_->Write32(kGpuCmdPwrDown, kGpuCmdReg);
+    state_ = State::kPoweringDown;
+    clean_wanted_ = done;
+    power_downs.Add();
+  } else if (clean_wanted_ > done) {
+    StartCleanLocked();
+  }
+  return count;
+}
+
+void PowerManager::PowerChangedLocked() {
+  bool powered = PoweredLocked();
+  if (state_ == State::kPoweringUp && powered) {
+    state_ = State::kOn;
+    power_up_us.Record(
+        (zx::clock::get_monotonic() - power_up_started_).to_usecs());
+    cv_.Broadcast();
+    if (active_ == 0) {
+      ArmIdleTimerLocked();
+    }
+  } else if (state_ == State::kPoweringDown && !powered) {
+    state_ = State::kOff;
+    off_since_ = zx::clock::get_monotonic();
+    if (wake_pending_) {
+      wake_pending_ = false;
+      PowerUpLocked();
+    }
+  }
+}
+
+bool PowerManager::PoweredLocked() {
+  return mmio_->Read32(kGpuStatusReg) & kGpuStatusPwrActive;
+}
+
+}  // namespace mali_g57
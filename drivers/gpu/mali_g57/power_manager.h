@@ -0,0 +1,137 @@
+#ifndef DRIVERS_GPU_MALI_G57_POWER_MANAGER_H_
+#define DRIVERS_GPU_MALI_G57_POWER_MANAGER_H_
+
+#include <fbl/condition_variable.h>
+#include <fbl/mutex.h>
+#include <lib/mmio/mmio.h>
+#include <lib/zx/port.h>
+#include <lib/zx/time.h>
+#include <lib/zx/timer.h>
+#include <zircon/compiler.h>
+#include <zircon/types.h>
+
+#include "job_manager.h"
+#include "registers.h"
+
+namespace mali_g57 {
+
+// Called from the IRQ thread once every write made before the matching
+// CleanCaches() call has reached memory.
+struct CacheCleanCallback {
+  void (*done)(void* ctx, zx_status_t status);
+  void* ctx;
+};
+
+// Powers the GPU down when it has been idle for a while and back up when
+// work arrives.
+//
+// Power-down is two asynchronous steps, both finished from the GPU
+// interrupt: a cache clean, then PWR_DOWN. Work that turns up during
+// either step cancels or reverses it. The idle delay adapts: it doubles
+// when the GPU is woken soon after being gated, so the power-up cost is
+// not paid between closely spaced frames, and halves after long idle
+// periods.
+class PowerManager {
+ public:
+  PowerManager(ddk::MmioBuffer* mmio, JobManager* jobs)
+      : mmio_(mmio), jobs_(jobs) {}
+
+  PowerManager(const PowerManager&) = delete;
+  PowerManager& operator=(const PowerManager&) = delete;
+
+  // Unmasks the power and cache interrupts. A GPU left powered by the
+  // bootloader starts its idle countdown; otherwise it stays off until the
+  // first Wake() or Acquire().
+  zx_status_t Init();
+
+  // Arms the idle timer to signal |key| on |port|. Must be called again
+  // after each HandleIdleTimeout().
+  zx_status_t BindIdleTimer(const zx::port& port, uint64_t key);
+
+  // Starts powering up without waiting. Called as soon as work is known to
+  // be coming, so the power-up overlaps building the job chains. If nothing
+  // is submitted the GPU goes back down after the idle delay.
+  void Wake();
+
+  // Wakes the GPU, waits until it is on and keeps it on until Release().
+  zx_status_t Acquire();
+  void Release();
+
+  // Restarts the idle countdown; called when the job slots drain.
+  void NotifyIdle();
+
+  // Starts a clean of the GPU caches, or joins one that has not yet
+  // started, and returns at once. |callback| runs when it is done. A
+  // powered-down GPU has nothing cached, so then it runs immediately.
+  zx_status_t CleanCaches(const CacheCleanCallback& callback);
+
+  // GPU interrupt: cache clean and power transitions.
+  void HandleIrq();
+  void HandleIdleTimeout();
+
+  // Cleans caches and powers down synchronously. Used on shutdown, once the
+  // IRQ thread has stopped; outstanding clean callbacks get
+  // ZX_ERR_CANCELED.
+  void PowerOff();
+
+  static constexpr size_t kMaxCleanWaiters = 8;
+  static constexpr zx::duration kMinIdleDelay = zx::msec(2);
+  static constexpr zx::duration kMaxIdleDelay = zx::msec(64);
+
+ private:
+  enum class State {
+    kOff,
+    kPoweringUp,
+    kOn,
+    kDraining,  // Cleaning caches on the way down.
+    kPoweringDown,
+  };
+
+  // Clean requests are numbered by the clean that will satisfy them: a
+  // request has to wait for a clean that started after it was made.
+  struct CleanWaiter {
+    CacheCleanCallback callback;
+    uint64_t generation;
+  };
+
+  void WakeLocked() __TA_REQUIRES(lock_);
+  void PowerUpLocked() __TA_REQUIRES(lock_);
+  void ArmIdleTimerLocked() __TA_REQUIRES(lock_);
+  uint64_t RequestCleanLocked() __TA_REQUIRES(lock_);
+  void StartCleanLocked() __TA_REQUIRES(lock_);
+  // Moves satisfied waiters to |out| and starts the next clean if needed.
+  size_t CleanDoneLocked(CleanWaiter* out) __TA_REQUIRES(lock_);
+  void PowerChangedLocked() __TA_REQUIRES(lock_);
+  bool PoweredLocked() __TA_REQUIRES(lock_);
+
+  ddk::MmioBuffer* mmio_;
+  JobManager* jobs_;
+  zx::timer idle_timer_;
+
+  fbl::Mutex lock_;
+  fbl::ConditionVariable cv_;
+  State state_ __TA_GUARDED(lock_) = State::kOff;
+  // Acquire() holders; the GPU is never gated while there are any.
+  size_t active_ __TA_GUARDED(lock_) = 0;
+  // A wake that arrived during power-down; applied once it is off.
+  bool wake_pending_ __TA_GUARDED(lock_) = false;
+  zx::duration idle_delay_ __TA_GUARDED(lock_) = kMinIdleDelay;
+  zx::time off_since_ __TA_GUARDED(lock_);
+  zx::time power_up_started_ __TA_GUARDED(lock_);
+
+  bool clean_running_ __TA_GUARDED(lock_) = false;
+  uint64_t clean_started_ __TA_GUARDED(lock_) = 0;
+  uint64_t clean_wanted_ __TA_GUARDED(lock_) = 0;
+  uint64_t drain_generation_ __TA_GUARDED(lock_) = 0;
+  CleanWaiter waiters_[kMaxCleanWaiters] __TA_GUARDED(lock_);
+  size_t waiter_count_ __TA_GUARDED(lock_) = 0;
+
+  static constexpr uint32_t kIrqMask = kGpuIrqPowerChanged | kGpuIrqCacheClean;
+  static constexpr zx::duration kPowerUpTimeout = zx::msec(10);
+  static constexpr zx::duration kSyncTimeout = zx::msec(10);
+  static constexpr zx::duration kIdleTimerSlack = zx::usec(500);
+};
+
+}  // namespace mali_g57
+
+#endif  // DRIVERS_GPU_MALI_G57_POWER_MANAGER_H_
@@ -21,12 +21,72 @@ constexpr uint32_t kGpuIrqMaskReg = kGpuControlBase + 0x028;
 constexpr uint32_t kGpuCmdReg = kGpuControlBase + 0x030;
 constexpr uint32_t kGpuPwrKeyReg = kGpuControlBase + 0x050;
 constexpr uint32_t kGpuPwrOverrideReg = kGpuControlBase + 0x054;
+constexpr uint32_t kShaderPresentLoReg = kGpuControlBase + 0x100;
+constexpr uint32_t kShaderPresentHiReg = kGpuControlBase + 0x104;
+constexpr uint32_t kL2PresentLoReg = kGpuControlBase + 0x120;
+
+// Performance counters. PRFCNT_BASE is the GPU virtual address, in the
+// address space selected by PRFCNT_CONFIG, that a dump is written to. Each
+// bit of a PRFCNT_*_EN register enables a group of four counters.
+constexpr uint32_t kPrfcntBaseLoReg = kGpuControlBase + 0x060;
+constexpr uint32_t kPrfcntBaseHiReg = kGpuControlBase + 0x064;
+constexpr uint32_t kPrfcntConfigReg = kGpuControlBase + 0x068;
+constexpr uint32_t kPrfcntJmEnReg = kGpuControlBase + 0x06C;
+constexpr uint32_t kPrfcntShaderEnReg = kGpuControlBase + 0x070;
+constexpr uint32_t kPrfcntTilerEnReg = kGpuControlBase + 0x074;
+constexpr uint32_t kPrfcntMmuL2EnReg = kGpuControlBase + 0x07C;
+
+constexpr uint32_t kPrfcntConfigModeOff = 0x0;
+constexpr uint32_t kPrfcntConfigModeManual = 0x1;
+constexpr uint32_t kPrfcntConfigAsShift = 4;
 
 constexpr uint32_t kJobIrqRawstatReg = kJobManagerBase + 0x1000;
 constexpr uint32_t kJobIrqClearReg = kJobManagerBase + 0x1004;
 constexpr uint32_t kJobIrqMaskReg = kJobManagerBase + 0x1008;
+constexpr uint32_t kJobIrqStatusReg = kJobManagerBase + 0x100C;
 constexpr uint32_t kJobControlReg = kJobManagerBase + 0x1010;
 
+// Job slots. Each slot has a running chain (HEAD) and one queued behind it
+// (HEAD_NEXT) that the hardware starts as soon as the running one finishes.
+constexpr uint32_t kJobSlotCount = 3;
+constexpr uint32_t kJobSlotBase = kJobManagerBase + 0x1800;
+constexpr uint32_t kJobSlotStride = 0x80;
+
+constexpr uint32_t kJsHeadLo = 0x00;
+constexpr uint32_t kJsHeadHi = 0x04;
+constexpr uint32_t kJsAffinityLo = 0x10;
+constexpr uint32_t kJsAffinityHi = 0x14;
+constexpr uint32_t kJsConfig = 0x18;
+constexpr uint32_t kJsCommand = 0x20;
+constexpr uint32_t kJsStatus = 0x24;
+constexpr uint32_t kJsHeadNextLo = 0x40;
+constexpr uint32_t kJsHeadNextHi = 0x44;
+constexpr uint32_t kJsAffinityNextLo = 0x50;
+constexpr uint32_t kJsAffinityNextHi = 0x54;
+constexpr uint32_t kJsConfigNext = 0x58;
+constexpr uint32_t kJsCommandNext = 0x60;
+
+constexpr uint32_t JobSlotReg(uint32_t slot, uint32_t reg) {
+  return kJobSlotBase + slot * kJobSlotStride + reg;
+}
+
+constexpr uint32_t kJsCommandNop = 0x00;
+constexpr uint32_t kJsCommandStart = 0x01;
+constexpr uint32_t kJsCommandSoftStop = 0x02;
+constexpr uint32_t kJsCommandHardStop = 0x03;
+
+// JS_STATUS exception codes; anything from kJsStatusFaultBase up is a fault.
+constexpr uint32_t kJsStatusNotStarted = 0x00;
+constexpr uint32_t kJsStatusDone = 0x01;
+constexpr uint32_t kJsStatusStopped = 0x03;
+constexpr uint32_t kJsStatusActive = 0x08;
+constexpr uint32_t kJsStatusFaultBase = 0x40;
+
+// JOB_IRQ_* bits: slot n raises bit n when a chain completes and bit 16 + n
+// when one fails.
+constexpr uint32_t JobIrqDone(uint32_t slot) { return 1u << slot; }
+constexpr uint32_t JobIrqFailed(uint32_t slot) { return 1u << (16 + slot); }
+
 constexpr uint32_t kAsCommandReg = kMmuBase + 0x000;
 constexpr uint32_t kAsStatusReg = kMmuBase + 0x004;
 constexpr uint32_t kAsFaultstatus = kMmuBase + 0x008;
@@ -35,11 +95,56 @@ constexpr uint32_t kAsFaultaddressHi = kMmuBase + 0x010;
 constexpr uint32_t kAsTranstabLo = kMmuBase + 0x014;
 constexpr uint32_t kAsTranstabHi = kMmuBase + 0x018;
 constexpr uint32_t kAsMemattr = kMmuBase + 0x01C;
+constexpr uint32_t kAsLockaddrLo = kMmuBase + 0x020;
+constexpr uint32_t kAsLockaddrHi = kMmuBase + 0x024;
+constexpr uint32_t kAsTranscfgLo = kMmuBase + 0x028;
+constexpr uint32_t kAsTranscfgHi = kMmuBase + 0x02C;
+
+constexpr uint32_t kAsCommandNop = 0x00;
+constexpr uint32_t kAsCommandUpdate = 0x01;
+constexpr uint32_t kAsCommandLock = 0x02;
+constexpr uint32_t kAsCommandUnlock = 0x03;
+constexpr uint32_t kAsCommandFlushPt = 0x04;
+constexpr uint32_t kAsCommandFlushMem = 0x05;
+
+constexpr uint32_t kAsStatusActive = 0x01;
+
+constexpr uint32_t kAsTranscfgAdrmodeUnmapped = 0x01;
+constexpr uint32_t kAsTranscfgAdrmodeAarch64_4k = 0x06;
+
+// AS_LOCKADDR: a naturally aligned region of 2^(n + 1) bytes, n in the low
+// six bits. The smallest lockable region is 32KB.
+constexpr uint32_t kAsLockRegionMinBits = 15;
+
+// MEMATTR holds one attribute byte per AttrIndx value used by the PTEs.
+constexpr uint32_t kMemattrIndexCached = 0;
+constexpr uint32_t kMemattrIndexUncached = 1;
+constexpr uint32_t kMemattrWriteBack = 0x88;
+constexpr uint32_t kMemattrNonCacheable = 0x4C;
+
+// AArch64 translation table descriptor bits.
+constexpr uint64_t kPteValid = 1ull << 0;
+constexpr uint64_t kPteTable = 3ull << 0;  // Levels 0-2: next-level table.
+constexpr uint64_t kPteBlock = 1ull << 0;  // Levels 1-2: block.
+constexpr uint64_t kPtePage = 3ull << 0;   // Level 3: page.
+constexpr uint64_t kPteTypeMask = 3ull << 0;
+constexpr uint64_t kPteAttrIndexShift = 2;
+constexpr uint64_t kPteRead = 1ull << 6;
+constexpr uint64_t kPteWrite = 1ull << 7;
+constexpr uint64_t kPteShareInner = 3ull << 8;
+constexpr uint64_t kPteAccess = 1ull << 10;
+constexpr uint64_t kPteContiguous = 1ull << 52;
+constexpr uint64_t kPteNoExecute = 1ull << 54;
+constexpr uint64_t kPteAddrMask = 0x0000FFFFFFFFF000ull;
 
 constexpr uint32_t kGpuCmdSoftReset = 0x01;
 constexpr uint32_t kGpuCmdHardReset = 0x02;
 constexpr uint32_t kGpuCmdPwrUp = 0x04;
 constexpr uint32_t kGpuCmdPwrDown = 0x08;
+constexpr uint32_t kGpuCmdCleanCaches = 0x10;
+constexpr uint32_t kGpuCmdCleanInvCaches = 0x20;
+constexpr uint32_t kGpuCmdPrfcntClear = 0x40;
+constexpr uint32_t kGpuCmdPrfcntSample = 0x80;
 
 constexpr uint32_t kGpuStatusActive = 0x01;
 constexpr uint32_t kGpuStatusIdle = 0x02;
@@ -49,6 +154,8 @@ constexpr uint32_t kGpuIrqGpuFault = (1 << 0);
 constexpr uint32_t kGpuIrqMmuFault = (1 << 2);
 constexpr uint32_t kGpuIrqJobFinished = (1 << 4);
 constexpr uint32_t kGpuIrqCacheClean = (1 << 5);
+constexpr uint32_t kGpuIrqPowerChanged = (1 << 6);
+constexpr uint32_t kGpuIrqPrfcntSample = (1 << 16);
 
 constexpr uint32_t kMaliG57ProductId = 0x9093;
 constexpr uint32_t kValhallArchVersion = 0x0A;
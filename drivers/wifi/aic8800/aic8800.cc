@@ -6,22 +6,364 @@
 #include <lib/ddk/platform-defs.h>
 #include <lib/zx/clock.h>
 #include <lib/zx/time.h>
+#include <lib/zx/vmar.h>
+#include <zircon/assert.h>
 #include <zircon/status.h>
 #include <zircon/types.h>
 
+#include <algorithm>
 #include <cstring>
+#include <iterator>
 #include <memory>
+#include <utility>
 
 namespace aic8800 {
 
+namespace {
+
+constexpr size_t AlignUp(size_t len, size_t align) {
+  return (len + align - 1) / align * align;
+}
+
+soliloquy_hal::Histogram init_us("aic8800.init_us");
+soliloquy_hal::Histogram init_prepare_us("aic8800.init_prepare_us");
+soliloquy_hal::Histogram init_download_us("aic8800.init_download_us");
+soliloquy_hal::Histogram init_patch_us("aic8800.init_patch_us");
+soliloquy_hal::Histogram init_fw_ready_us("aic8800.init_fw_ready_us");
+soliloquy_hal::Counter warm_starts("aic8800.warm_starts");
+
+// Per access category, indexed by WmmAc: frames accepted, frames refused
+// with ZX_ERR_SHOULD_WAIT, queue depth seen by each accepted frame, and how
+// long the oldest frame of each burst waited before it reached the bus.
+struct TxAcMetrics {
+  soliloquy_hal::Counter frames;
+  soliloquy_hal::Counter full;
+  soliloquy_hal::Histogram depth;
+  soliloquy_hal::Histogram latency_us;
+};
+TxAcMetrics tx_ac_metrics[] = {
+    {soliloquy_hal::Counter("aic8800.tx_be_frames"),
+     soliloquy_hal::Counter("aic8800.tx_be_full"),
+     soliloquy_hal::Histogram("aic8800.tx_be_depth"),
+     soliloquy_hal::Histogram("aic8800.tx_be_latency_us")},
+    {soliloquy_hal::Counter("aic8800.tx_bk_frames"),
+     soliloquy_hal::Counter("aic8800.tx_bk_full"),
+     soliloquy_hal::Histogram("aic8800.tx_bk_depth"),
+     soliloquy_hal::Histogram("aic8800.tx_bk_latency_us")},
+    {soliloquy_hal::Counter("aic8800.tx_vi_frames"),
+     soliloquy_hal::Counter("aic8800.tx_vi_full"),
+     soliloquy_hal::Histogram("aic8800.tx_vi_depth"),
+     soliloquy_hal::Histogram("aic8800.tx_vi_latency_us")},
+    {soliloquy_hal::Counter("aic8800.tx_vo_frames"),
+     soliloquy_hal::Counter("aic8800.tx_vo_full"),
+     soliloquy_hal::Histogram("aic8800.tx_vo_depth"),
+     soliloquy_hal::Histogram("aic8800.tx_vo_latency_us")},
+};
+static_assert(std::size(tx_ac_metrics) == kNumWmmAc);
+
+soliloquy_hal::Counter tx_amsdus("aic8800.tx_amsdus");
+soliloquy_hal::Counter tx_amsdu_subframes("aic8800.tx_amsdu_subframes");
+soliloquy_hal::Counter ba_sessions_started("aic8800.ba_sessions_started");
+
+// Power save: time spent asleep, and how long each wake took, for tuning the
+// idle window against wake latency.
+soliloquy_hal::Counter ps_sleeps("aic8800.ps_sleeps");
+soliloquy_hal::Counter ps_host_wakes("aic8800.ps_host_wakes");
+soliloquy_hal::Counter ps_asleep_us("aic8800.ps_asleep_us");
+soliloquy_hal::Histogram ps_wake_latency_us("aic8800.ps_wake_latency_us");
+
+// An A-MSDU subframe is the frame's addresses, a big-endian length, then the
+// payload behind an RFC 1042 LLC/SNAP header carrying the EtherType.
+constexpr size_t kEthHdrSize = 14;
+constexpr size_t kLlcSnapSize = 8;
+constexpr uint16_t kEtherTypeMin = 0x0600;
+
+bool IsAmsduCandidate(const uint8_t *eth, size_t len) {
+  return len >= kEthHdrSize && (eth[12] << 8 | eth[13]) >= kEtherTypeMin;
+}
+
+// Writes |eth| as a subframe of len + kLlcSnapSize bytes.
+void WriteAmsduSubframe(uint8_t *dst, const uint8_t *eth, size_t len) {
+  size_t msdu_len = kLlcSnapSize + len - kEthHdrSize;
+  memcpy(dst, eth, 12);
+  dst[12] = static_cast<uint8_t>(msdu_len >> 8);
+  dst[13] = static_cast<uint8_t>(msdu_len);
+  const uint8_t snap[] = {0xAA, 0xAA, 0x03, 0x00, 0x00, 0x00, eth[12], eth[13]};
+  memcpy(dst + kEthHdrSize, snap, sizeof(snap));
+  memcpy(dst + kEthHdrSize + kLlcSnapSize, eth + kEthHdrSize,
+         len - kEthHdrSize);
+}
+
+constexpr WmmAc kTxServiceOrder[] = {WmmAc::kVoice, WmmAc::kVideo,
+                                     WmmAc::kBestEffort, WmmAc::kBackground};
+
+constexpr bool IsBulkAc(WmmAc ac) {
+  return ac == WmmAc::kBestEffort || ac == WmmAc::kBackground;
+}
+
+// Capabilities of the single-stream radio. HT: 20/40 MHz, SM power save
+// disabled, short GI at 20 and 40 MHz, one RX STBC stream; max A-MPDU 64K
+// with 8 us spacing. VHT (5 GHz only): 80 MHz, RX LDPC, short GI at 80 MHz,
+// one RX STBC stream, max A-MPDU exponent 7.
+constexpr uint16_t kHtCapInfo = 0x016E;
+constexpr uint8_t kHtAmpduParams = 0x17;
+// RX MCS 0-7 and MCS 32, 150 Mbps highest rate, TX set equal to RX.
+constexpr uint8_t kHtMcsSet[16] = {0xFF, 0x00, 0x00, 0x00, 0x01, 0x00,
+                                   0x00, 0x00, 0x00, 0x00, 150,  0x00,
+                                   0x01, 0x00, 0x00, 0x00};
+constexpr uint32_t kVhtCapInfo = 0x03800130;
+// MCS 0-9 on one spatial stream, none on the rest; 433 Mbps at 80 MHz.
+constexpr uint16_t kVhtMcsMap = 0xFFFE;
+constexpr uint16_t kVhtHighestRate = 433;
+constexpr uint8_t kPhyBw80 = 2;
+constexpr uint16_t kTxLifetimeMs = 100;
+
+// LMAC message ids carry the destination task in their top six bits.
+constexpr uint16_t kTaskMe = 5;
+constexpr uint16_t kDrvTaskId = 100;
+constexpr uint16_t kMeConfigReq = kTaskMe << 10;
+constexpr uint16_t kMeChanConfigReq = (kTaskMe << 10) | 2;
+constexpr uint16_t kTaskMm = 0;
+constexpr uint16_t kMmAddIfReq = (kTaskMm << 10) | 6;
+constexpr uint16_t kMmRemoveIfReq = (kTaskMm << 10) | 8;
+constexpr uint16_t kMmBaAddReq = (kTaskMm << 10) | 40;
+constexpr uint16_t kMmBaDelReq = (kTaskMm << 10) | 42;
+constexpr uint8_t kVifTypeSta = 0;
+constexpr uint8_t kVifTypeAp = 2;
+
+constexpr uint8_t kBand2g = 0;
+constexpr uint8_t kBand5g = 1;
+constexpr uint8_t kChanNoIr = 1 << 0;
+constexpr uint8_t kChanDisabled = 1 << 1;
+constexpr uint8_t kChanRadar = 1 << 2;
+
+// What the radio tunes to; the regulatory domain decides which are usable.
+constexpr uint8_t kHwChannels2g[] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13};
+constexpr uint8_t kHwChannels5g[] = {36,  40,  44,  48,  52,  56,  60,
+                                     64,  100, 104, 108, 112, 116, 120,
+                                     124, 128, 132, 136, 140, 144, 149,
+                                     153, 157, 161, 165};
+// Entries in each band's ME_CHAN_CONFIG_REQ table.
+constexpr size_t kChanConfig2gSlots = 14;
+constexpr size_t kChanConfig5gSlots = 28;
+static_assert(std::size(kHwChannels2g) <= kChanConfig2gSlots);
+static_assert(std::size(kHwChannels5g) <= kChanConfig5gSlots);
+
+constexpr uint16_t ChannelFreq(uint8_t band, uint8_t chan) {
+  return band == kBand2g ? 2407 + 5 * chan : 5000 + 5 * chan;
+}
+
+// Channels |first| to |last| of |band| may be used at up to |max_dbm|.
+struct ChannelRule {
+  uint8_t band;
+  uint8_t first;
+  uint8_t last;
+  int8_t max_dbm;
+  uint8_t flags;
+};
+
+// Until a country is set only 2.4 GHz channels 1-11 may initiate radiation;
+// everything else is passive.
+constexpr ChannelRule kWorldRules[] = {
+    {kBand2g, 1, 11, 20, 0},
+    {kBand2g, 12, 13, 20, kChanNoIr},
+    {kBand5g, 36, 48, 20, kChanNoIr},
+    {kBand5g, 52, 144, 20, kChanNoIr | kChanRadar},
+    {kBand5g, 149, 165, 20, kChanNoIr},
+};
+constexpr ChannelRule kFccRules[] = {
+    {kBand2g, 1, 11, 30, 0},
+    {kBand5g, 36, 48, 23, 0},
+    {kBand5g, 52, 144, 23, kChanRadar},
+    {kBand5g, 149, 165, 30, 0},
+};
+constexpr ChannelRule kEtsiRules[] = {
+    {kBand2g, 1, 13, 20, 0},
+    {kBand5g, 36, 48, 23, 0},
+    {kBand5g, 52, 64, 20, kChanRadar},
+    {kBand5g, 100, 140, 27, kChanRadar},
+};
+constexpr ChannelRule kJpRules[] = {
+    {kBand2g, 1, 13, 20, 0},
+    {kBand5g, 36, 48, 20, 0},
+    {kBand5g, 52, 64, 20, kChanRadar},
+    {kBand5g, 100, 144, 23, kChanRadar},
+};
+constexpr ChannelRule kCnRules[] = {
+    {kBand2g, 1, 13, 20, 0},
+    {kBand5g, 36, 48, 20, 0},
+    {kBand5g, 52, 64, 20, kChanRadar},
+    {kBand5g, 149, 165, 30, 0},
+};
+constexpr ChannelRule kKrRules[] = {
+    {kBand2g, 1, 13, 23, 0},
+    {kBand5g, 36, 48, 23, 0},
+    {kBand5g, 52, 144, 23, kChanRadar},
+    {kBand5g, 149, 165, 23, 0},
+};
+
+struct RegDomain {
+  char alpha2[2];
+  const ChannelRule *rules;
+  size_t rule_count;
+};
+
+template <size_t N>
+constexpr RegDomain Domain(char a, char b, const ChannelRule (&rules)[N]) {
+  return {{a, b}, rules, N};
+}
+
+// Index 0 is the world domain the driver starts in.
+constexpr RegDomain kRegDomains[] = {
+    Domain('W', 'W', kWorldRules), Domain('U', 'S', kFccRules),
+    Domain('C', 'A', kFccRules),   Domain('A', 'T', kEtsiRules),
+    Domain('B', 'E', kEtsiRules),  Domain('C', 'H', kEtsiRules),
+    Domain('D', 'E', kEtsiRules),  Domain('D', 'K', kEtsiRules),
+    Domain('E', 'S', kEtsiRules),  Domain('F', 'I', kEtsiRules),
+    Domain('F', 'R', kEtsiRules),  Domain('G', 'B', kEtsiRules),
+    Domain('I', 'E', kEtsiRules),  Domain('I', 'T', kEtsiRules),
+    Domain('N', 'L', kEtsiRules),  Domain('N', 'O', kEtsiRules),
+    Domain('P', 'L', kEtsiRules),  Domain('P', 'T', kEtsiRules),
+    Domain('S', 'E', kEtsiRules),  Domain('J', 'P', kJpRules),
+    Domain('C', 'N', kCnRules),    Domain('K', 'R', kKrRules),
+};
+
+bool FindRegDomain(const uint8_t alpha2[2], size_t *out_index) {
+  for (size_t i = 0; i < std::size(kRegDomains); i++) {
+    if (kRegDomains[i].alpha2[0] == alpha2[0] &&
+        kRegDomains[i].alpha2[1] == alpha2[1]) {
+      *out_index = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+// The rule covering |chan| in |domain|, or null if it may not be used.
+const ChannelRule *FindChannelRule(size_t domain, uint8_t band, uint8_t chan) {
+  const RegDomain &reg = kRegDomains[domain];
+  for (size_t i = 0; i < reg.rule_count; i++) {
+    const ChannelRule &rule = reg.rules[i];
+    if (rule.band == band && chan >= rule.first && chan <= rule.last) {
+      return &rule;
+    }
+  }
+  return nullptr;
+}
+
+// Lists the channels of |band| usable in |domain|.
+void FillChannels(size_t domain, uint8_t band, const uint8_t *hw_channels,
+                  size_t hw_count, wlan_info_channel_list_t *out_list) {
+  out_list->base_freq = band == kBand2g ? 2407 : 5000;
+  out_list->channels_count = 0;
+  for (size_t i = 0; i < hw_count; i++) {
+    if (FindChannelRule(domain, band, hw_channels[i])) {
+      out_list->channels[out_list->channels_count++] = hw_channels[i];
+    }
+  }
+}
+
+// Serializes little-endian LMAC message parameters.
+class MsgWriter {
+public:
+  MsgWriter(uint8_t *buf, size_t size) : buf_(buf), size_(size) {}
+
+  void U8(uint8_t val) { Bytes(&val, 1); }
+  void U16(uint16_t val) {
+    const uint8_t bytes[] = {static_cast<uint8_t>(val),
+                             static_cast<uint8_t>(val >> 8)};
+    Bytes(bytes, sizeof(bytes));
+  }
+  void U32(uint32_t val) {
+    U16(static_cast<uint16_t>(val));
+    U16(static_cast<uint16_t>(val >> 16));
+  }
+  void Bytes(const uint8_t *data, size_t len) {
+    ZX_ASSERT(len <= size_ - len_);
+    memcpy(buf_ + len_, data, len);
+    len_ += len;
+  }
+
+  size_t len() const { return len_; }
+
+private:
+  uint8_t *const buf_;
+  const size_t size_;
+  size_t len_ = 0;
+};
+
+// The LZ4-compressed image is preferred when the package carries one.
+constexpr const char *kFwNames[] = {"fmacfw_8800d80.bin.lz4",
+                                    "fmacfw_8800d80.bin"};
+
+struct FirmwareFetch {
+  zx_device_t *parent;
+  const char *const *names;
+  size_t name_count;
+  const char *name = nullptr;
+  zx::vmo vmo;
+  size_t size = 0;
+  zx_status_t status = ZX_ERR_INTERNAL;
+};
+
+// Loads the first of |names| that exists.
+int FetchFirmware(void *arg) {
+  auto *fetch = static_cast<FirmwareFetch *>(arg);
+  for (size_t i = 0; i < fetch->name_count; i++) {
+    fetch->name = fetch->names[i];
+    fetch->status = soliloquy_hal::FirmwareLoader::LoadFirmware(
+        fetch->parent, fetch->name, &fetch->vmo, &fetch->size);
+    if (fetch->status != ZX_ERR_NOT_FOUND) {
+      break;
+    }
+  }
+  return 0;
+}
+
+} // namespace
+
 Aic8800::Aic8800(zx_device_t *parent)
-    : Aic8800Type(parent), sdio_(parent), sdio_helper_(&sdio_) {}
+    : Aic8800Type(parent), sdio_(parent), sdio_helper_(&sdio_) {
+  for (size_t ac = 0; ac < kNumWmmAc; ac++) {
+    TxQueue &queue = tx_queues_[ac];
+    queue.agg[0].base = ac * 2 * kTxAggMaxSize;
+    queue.agg[1].base = queue.agg[0].base + kTxAggMaxSize;
+    queue.flush_deadline = zx::usec(kTxFlushDeadlineUs[ac]);
+  }
+}
 
-Aic8800::~Aic8800() {}
+Aic8800::~Aic8800() {
+  StopIrqThread();
+  if (tx_buf_) {
+    zx::vmar::root_self()->unmap(reinterpret_cast<uintptr_t>(tx_buf_),
+                                 kTxBufferSize);
+  }
+  if (rx_buf_) {
+    zx::vmar::root_self()->unmap(reinterpret_cast<uintptr_t>(rx_buf_),
+                                 kDmaBufferSize);
+  }
+  if (cmd_buf_) {
+    zx::vmar::root_self()->unmap(reinterpret_cast<uintptr_t>(cmd_buf_),
+                                 kCmdBufferSize);
+  }
+}
 
 zx_status_t Aic8800::Bind(void *ctx, zx_device_t *device) {
+  // Start reading the image before the device is even added, so the package
+  // read overlaps DdkAdd and the start of init. The firmware cache is per
+  // driver host, so this has to happen here rather than in the board driver.
+  // Failure only costs time; InitHw loads it again.
+  zx_status_t status =
+      soliloquy_hal::FirmwareLoader::PrefetchFirmware(device, kFwNames[0]);
+  if (status != ZX_OK) {
+    zxlogf(WARNING, "aic8800: Firmware prefetch failed: %s",
+           zx_status_get_string(status));
+  }
+
   auto dev = std::make_unique<Aic8800>(device);
-  zx_status_t status = dev->DdkAdd("aic8800");
+  soliloquy_hal::PublishMetrics(dev->inspector_);
+  status = dev->DdkAdd(ddk::DeviceAddArgs("aic8800").set_inspect_vmo(
+      dev->inspector_.DuplicateVmo()));
   if (status != ZX_OK) {
     zxlogf(ERROR, "aic8800: Could not create device: %s",
            zx_status_get_string(status));
@@ -33,27 +375,49 @@ zx_status_t Aic8800::Bind(void *ctx, zx_device_t *device) {
 }
 
 void Aic8800::DdkInit(ddk::InitTxn txn) {
-  zx_status_t status = InitHw();
-  txn.Reply(status);
+  init_txn_.emplace(std::move(txn));
+  int rc = thrd_create_with_name(
+      &init_thread_,
+      [](void *arg) { return static_cast<Aic8800 *>(arg)->InitThread(); },
+      this, "aic8800-init");
+  if (rc != thrd_success) {
+    zxlogf(ERROR, "aic8800: Failed to start init thread");
+    init_txn_->Reply(ZX_ERR_NO_RESOURCES);
+    return;
+  }
+  init_thread_started_ = true;
 }
 
-void Aic8800::DdkUnbind(ddk::UnbindTxn txn) { txn.Reply(); }
+int Aic8800::InitThread() {
+  zx_status_t status;
+  {
+    SOLILOQUY_TIMED_SCOPE(init_us, "aic8800_init");
+    status = InitHw();
+  }
+  init_txn_->Reply(status);
+  return status;
+}
+
+void Aic8800::DdkUnbind(ddk::UnbindTxn txn) {
+  if (init_thread_started_) {
+    thrd_join(init_thread_, nullptr);
+    init_thread_started_ = false;
+  }
+  StopIrqThread();
+  ReleaseDmaBuffers();
+  txn.Reply();
+}
 
 void Aic8800::DdkRelease() { delete this; }
 
 zx_status_t Aic8800::ReadChipId(uint32_t *out_chip_id) {
-  uint8_t chip_id_bytes[4];
-  for (int i = 0; i < 4; i++) {
-    zx_status_t status = sdio_helper_.ReadByte(kRegChipId + i, &chip_id_bytes[i]);
-    if (status != ZX_OK) {
-      zxlogf(ERROR, "aic8800: Failed to read chip ID byte %d: %s", i,
-             zx_status_get_string(status));
-      return status;
-    }
+  zx_status_t status = sdio_helper_.Read32(kRegChipId, out_chip_id);
+  if (status != ZX_OK) {
+    zxlogf(ERROR, "aic8800: Failed to read chip ID: %s",
+           zx_status_get_string(status));
+    return status;
   }
   
-  *out_chip_id = *reinterpret_cast<uint32_t*>(chip_id_bytes);
-  
   const char* chip_name = "Unknown";
   if (*out_chip_id == kChipIdAic8800D) {
     chip_name = "AIC8800D";
@@ -92,92 +456,1013 @@ zx_status_t Aic8800::ResetChip() {
   return ZX_OK;
 }
 
-zx_status_t Aic8800::SdioFlowControl(uint8_t *out_available_buffers) {
-  if (!out_available_buffers) {
-    return ZX_ERR_INVALID_ARGS;
+zx_status_t Aic8800::ReadIntStatus(uint32_t *out_status) {
+  return sdio_helper_.Read32(kRegIntStatus, out_status);
+}
+
+// Status bits are write-one-to-clear, so writing back what was read only
+// clears the events being handled.
+zx_status_t Aic8800::AckIntStatus(uint32_t status) {
+  return sdio_helper_.Write32(kRegIntStatus, status);
+}
+
+zx_status_t Aic8800::RefreshTxCredits() {
+  ScopedAwake awake(this);
+  if (awake.status() != ZX_OK) {
+    return awake.status();
   }
-  
-  for (uint32_t retry = 0; retry < kFlowCtrlRetryCount; retry++) {
-    uint8_t fc_reg = 0;
-    zx_status_t status = sdio_helper_.ReadByte(kRegFlowCtrl, &fc_reg);
+  // The register still counts buffers taken by bursts that are not on the
+  // bus yet, so those are subtracted. The lock is held across the read so a
+  // burst cannot land and drop out of the in-flight count in between.
+  fbl::AutoLock lock(&credit_lock_);
+  uint8_t fc_reg = 0;
+  zx_status_t status = sdio_helper_.ReadByte(kRegFlowCtrl, &fc_reg);
+  if (status != ZX_OK) {
+    zxlogf(ERROR, "aic8800: Flow control register read failed: %s",
+           zx_status_get_string(status));
+    return status;
+  }
+
+  uint8_t free_buffers = fc_reg & kFlowCtrlMask;
+  tx_credits_ = free_buffers > tx_credits_in_flight_
+                    ? free_buffers - tx_credits_in_flight_
+                    : 0;
+  tx_credit_pool_ = std::max(tx_credit_pool_, free_buffers);
+  credit_cv_.Broadcast();
+  return ZX_OK;
+}
+
+// Blocks until the IRQ thread reports at least |required| free chip buffers,
+// then consumes them. The cached count is only re-read from the chip if no
+// TX-done arrives within kTxCreditTimeoutMs.
+zx_status_t Aic8800::AcquireTxCredits(uint8_t required) {
+  auto deadline = zx::deadline_after(zx::msec(kTxCreditTimeoutMs));
+  bool refreshed = false;
+
+  while (true) {
+    {
+      fbl::AutoLock lock(&credit_lock_);
+      while (!stopping_ && tx_credits_ < required &&
+             zx::clock::get_monotonic() < deadline) {
+        credit_cv_.Timedwait(&credit_lock_,
+                             (deadline - zx::clock::get_monotonic()).get());
+      }
+      if (stopping_) {
+        return ZX_ERR_CANCELED;
+      }
+      if (tx_credits_ >= required) {
+        tx_credits_ -= required;
+        tx_credits_in_flight_ += required;
+        return ZX_OK;
+      }
+    }
+
+    if (refreshed) {
+      break;
+    }
+    zx_status_t status = RefreshTxCredits();
     if (status != ZX_OK) {
-      zxlogf(ERROR, "aic8800: Flow control register read failed: %s",
+      return status;
+    }
+    refreshed = true;
+  }
+
+  zxlogf(ERROR, "aic8800: Flow control timeout - need %u buffers", required);
+  return ZX_ERR_TIMED_OUT;
+}
+
+bool Aic8800::TryAcquireTxCredits(uint8_t required, bool keep_reserve) {
+  fbl::AutoLock lock(&credit_lock_);
+  size_t reserve = keep_reserve ? TxReservedCreditsLocked() : 0;
+  if (tx_credits_ < required + reserve) {
+    return false;
+  }
+  tx_credits_ -= required;
+  tx_credits_in_flight_ += required;
+  return true;
+}
+
+void Aic8800::ReleaseTxCredits(uint8_t count) {
+  fbl::AutoLock lock(&credit_lock_);
+  tx_credits_in_flight_ -= std::min(count, tx_credits_in_flight_);
+}
+
+uint8_t Aic8800::TxReservedCreditsLocked() const {
+  return std::min<uint8_t>(kTxReservedCredits, tx_credit_pool_ / 4);
+}
+
+void Aic8800::KickIrqThread() {
+  if (!irq_port_.is_valid()) {
+    return;
+  }
+  zx_port_packet_t packet = {};
+  packet.key = kPortKeyTxKick;
+  packet.type = ZX_PKT_TYPE_USER;
+  irq_port_.queue(&packet);
+}
+
+// Waking takes up to kWakeTimeout of bus I/O, so it runs with power_lock_
+// dropped; asleep_ stays set meanwhile, which keeps MaybeSleep away.
+zx_status_t Aic8800::AcquireAwake() {
+  fbl::AutoLock lock(&power_lock_);
+  while (waking_) {
+    power_cv_.Wait(&power_lock_);
+  }
+  if (asleep_) {
+    waking_ = true;
+    zx::time woken = zx::clock::get_monotonic();
+    zx::duration latency;
+    power_lock_.Release();
+    zx_status_t status = WakeChip(kWakeTimeout, &latency);
+    power_lock_.Acquire();
+    waking_ = false;
+    power_cv_.Broadcast();
+    if (status != ZX_OK) {
+      zxlogf(ERROR, "aic8800: Failed to wake chip: %s",
              zx_status_get_string(status));
       return status;
     }
-    
-    uint8_t available = fc_reg & kFlowCtrlMask;
-    if (available != 0) {
-      *out_available_buffers = available;
-      return ZX_OK;
+    asleep_ = false;
+    ps_asleep_us.Add((woken - slept_at_).to_usecs());
+    ps_wake_latency_us.Record(latency.to_usecs());
+  }
+  awake_refs_++;
+  return ZX_OK;
+}
+
+void Aic8800::ReleaseAwake() {
+  fbl::AutoLock lock(&power_lock_);
+  awake_refs_--;
+  last_bus_use_ = zx::clock::get_monotonic();
+}
+
+// The sleep permission is dropped before the trigger so the firmware doesn't
+// go straight back to sleep.
+zx_status_t Aic8800::WakeChip(zx::duration timeout,
+                              zx::duration *out_latency) {
+  zx::time start = zx::clock::get_monotonic();
+  zx::time deadline = start + timeout;
+  zx_status_t status = sdio_helper_.WriteByte(kRegHostCtrl, kHostCtrlEnable);
+  if (status == ZX_OK) {
+    status = sdio_helper_.WriteByte(kRegWakeup, kWakeupTrigger);
+  }
+  while (status == ZX_OK) {
+    uint8_t state = 0;
+    status = sdio_helper_.ReadByte(kRegSleepCtrl, &state);
+    if (status != ZX_OK || (state & kSleepCtrlAwake)) {
+      break;
     }
-    
-    if (retry < 30) {
-      zx::nanosleep(zx::deadline_after(zx::usec(200)));
-    } else if (retry < 40) {
-      zx::nanosleep(zx::deadline_after(zx::msec(1)));
-    } else {
-      zx::nanosleep(zx::deadline_after(zx::msec(10)));
+    if (zx::clock::get_monotonic() >= deadline) {
+      status = ZX_ERR_TIMED_OUT;
+      break;
     }
+    zx::nanosleep(zx::deadline_after(kWakePollInterval));
   }
-  
-  zxlogf(ERROR, "aic8800: Flow control timeout - no buffers available");
-  return ZX_ERR_TIMED_OUT;
+  *out_latency = zx::clock::get_monotonic() - start;
+  return status;
 }
 
-zx_status_t Aic8800::SdioTx(const uint8_t *buf, size_t len, uint8_t func_num) {
-  if (!buf || len == 0) {
-    return ZX_ERR_INVALID_ARGS;
+void Aic8800::SetPowerSaveIdle(zx::duration idle) {
+  {
+    fbl::AutoLock lock(&power_lock_);
+    ps_idle_ = idle;
+  }
+  if (idle == zx::duration::infinite() && initialized_) {
+    // Wakes the chip now rather than at its next use.
+    ScopedAwake awake(this);
+  }
+}
+
+// The chip pulses the host-wake line when it has events pending while
+// asleep. Without the line it is never put to sleep.
+zx_status_t Aic8800::SetupHostWake() {
+  host_wake_ = ddk::GpioProtocolClient(parent(), "gpio-wake");
+  if (!host_wake_.is_valid()) {
+    zxlogf(INFO, "aic8800: No host-wake GPIO, power save disabled");
+    return ZX_OK;
+  }
+
+  zx_status_t status = host_wake_.ConfigIn(GPIO_NO_PULL);
+  if (status == ZX_OK) {
+    status = host_wake_.GetInterrupt(ZX_INTERRUPT_MODE_EDGE_HIGH,
+                                     &host_wake_irq_);
+  }
+  if (status == ZX_OK) {
+    status = host_wake_irq_.bind(irq_port_, kPortKeyHostWake, 0);
   }
-  
-  size_t aligned_len = (len + kBlockSize - 1) / kBlockSize * kBlockSize;
-  
-  uint8_t available_buffers = 0;
-  zx_status_t status = SdioFlowControl(&available_buffers);
   if (status != ZX_OK) {
+    zxlogf(ERROR, "aic8800: Failed to set up host-wake interrupt: %s",
+           zx_status_get_string(status));
     return status;
   }
-  
-  size_t required_buffers = (aligned_len + kBufferSize - 1) / kBufferSize;
-  if (available_buffers < required_buffers) {
-    zxlogf(ERROR, "aic8800: Insufficient buffers for TX: need %zu, have %u",
-           required_buffers, available_buffers);
+  return ZX_OK;
+}
+
+zx::time Aic8800::NextSleepDeadline() {
+  fbl::AutoLock lock(&power_lock_);
+  if (!ps_enabled_ || asleep_ || ps_idle_ == zx::duration::infinite()) {
+    return zx::time::infinite();
+  }
+  if (awake_refs_ > 0) {
+    // Another thread is on the bus; look again once it could have gone
+    // idle, without spinning on a zero window.
+    return zx::deadline_after(std::max(ps_idle_, zx::msec(1)));
+  }
+  return last_bus_use_ + ps_idle_;
+}
+
+void Aic8800::MaybeSleep() {
+  // A frame waiting in an aggregate is about to need the bus.
+  {
+    fbl::AutoLock lock(&tx_lock_);
+    for (const TxQueue &queue : tx_queues_) {
+      for (const TxAggregate &agg : queue.agg) {
+        if (agg.state != TxAggState::kIdle) {
+          return;
+        }
+      }
+    }
+  }
+
+  fbl::AutoLock lock(&power_lock_);
+  zx::time now = zx::clock::get_monotonic();
+  if (!ps_enabled_ || asleep_ || awake_refs_ > 0 ||
+      ps_idle_ == zx::duration::infinite() || now < last_bus_use_ + ps_idle_) {
+    return;
+  }
+  zx_status_t status =
+      sdio_helper_.WriteByte(kRegHostCtrl, kHostCtrlEnable | kHostCtrlSleep);
+  if (status != ZX_OK) {
+    zxlogf(WARNING, "aic8800: Failed to enter sleep: %s",
+           zx_status_get_string(status));
+    // Try again after another idle window rather than on every wakeup.
+    last_bus_use_ = now;
+    return;
+  }
+  asleep_ = true;
+  slept_at_ = now;
+  ps_sleeps.Add();
+}
+
+zx_status_t Aic8800::StartIrqThread() {
+  zx_status_t status = sdio_.GetInBandIntr(&sdio_irq_);
+  if (status != ZX_OK) {
+    zxlogf(ERROR, "aic8800: Failed to get SDIO interrupt: %s",
+           zx_status_get_string(status));
+    return status;
+  }
+
+  status = zx::port::create(ZX_PORT_BIND_TO_INTERRUPT, &irq_port_);
+  if (status != ZX_OK) {
+    zxlogf(ERROR, "aic8800: Failed to create IRQ port: %s",
+           zx_status_get_string(status));
+    return status;
+  }
+
+  status = sdio_irq_.bind(irq_port_, kPortKeyIrq, 0);
+  if (status != ZX_OK) {
+    zxlogf(ERROR, "aic8800: Failed to bind SDIO interrupt: %s",
+           zx_status_get_string(status));
+    return status;
+  }
+
+  status = SetupHostWake();
+  if (status != ZX_OK) {
+    return status;
+  }
+
+  status = RefreshTxCredits();
+  if (status != ZX_OK) {
+    return status;
+  }
+
+  status = sdio_helper_.WriteByte(kRegIntMask, kIntFwReady | kIntTxDone |
+                                                   kIntRxReady);
+  if (status == ZX_OK) {
+    status = sdio_helper_.WriteByte(kRegIntMask + 3, kIntError >> 24);
+  }
+  if (status != ZX_OK) {
+    zxlogf(ERROR, "aic8800: Failed to unmask interrupts: %s",
+           zx_status_get_string(status));
+    return status;
+  }
+
+  int rc = thrd_create_with_name(
+      &irq_thread_,
+      [](void *arg) { return static_cast<Aic8800 *>(arg)->IrqThread(); }, this,
+      "aic8800-irq");
+  if (rc != thrd_success) {
+    zxlogf(ERROR, "aic8800: Failed to start IRQ thread");
     return ZX_ERR_NO_RESOURCES;
   }
-  
-  status = sdio_helper_.WriteMultiBlock(func_num, buf, aligned_len);
+  irq_thread_started_ = true;
+  return ZX_OK;
+}
+
+void Aic8800::StopIrqThread() {
+  if (!irq_thread_started_) {
+    return;
+  }
+
+  {
+    fbl::AutoLock lock(&credit_lock_);
+    stopping_ = true;
+    credit_cv_.Broadcast();
+  }
+
+  zx_port_packet_t packet = {};
+  packet.key = kPortKeyStop;
+  packet.type = ZX_PKT_TYPE_USER;
+  irq_port_.queue(&packet);
+  thrd_join(irq_thread_, nullptr);
+  irq_thread_started_ = false;
+  if (host_wake_irq_.is_valid()) {
+    host_wake_.ReleaseInterrupt();
+    host_wake_irq_.reset();
+  }
+}
+
+int Aic8800::IrqThread() {
+  while (true) {
+    bool credit_stall = false;
+    zx::time deadline =
+        std::min(NextTxDeadline(&credit_stall), NextSleepDeadline());
+
+    zx_port_packet_t packet;
+    zx_status_t status = irq_port_.wait(deadline, &packet);
+    if (status == ZX_ERR_TIMED_OUT) {
+      // An aggregate hit its flush deadline, a ready aggregate has waited
+      // too long for a TX-done (re-read the credits in that case), or the
+      // bus has been idle for the power-save window.
+      if (credit_stall) {
+        RefreshTxCredits();
+      }
+      ServiceTx();
+      MaybeSleep();
+      continue;
+    }
+    if (status != ZX_OK) {
+      zxlogf(ERROR, "aic8800: IRQ port wait failed: %s",
+             zx_status_get_string(status));
+      return status;
+    }
+    if (packet.key == kPortKeyStop) {
+      return 0;
+    }
+
+    if (packet.key == kPortKeyIrq) {
+      status = HandleInterrupt();
+      if (status != ZX_OK) {
+        zxlogf(ERROR, "aic8800: Interrupt handling failed: %s",
+               zx_status_get_string(status));
+      }
+
+      sdio_irq_.ack();
+      sdio_.AckInBandIntr();
+    }
+
+    if (packet.key == kPortKeyHostWake) {
+      ps_host_wakes.Add();
+      host_wake_irq_.ack();
+      status = HandleInterrupt();
+      if (status != ZX_OK) {
+        zxlogf(ERROR, "aic8800: Host-wake handling failed: %s",
+               zx_status_get_string(status));
+      }
+    }
+
+    if (packet.key == kPortKeyTxKick) {
+      // Start waking a sleeping chip as soon as a frame is queued, so the
+      // wake overlaps the aggregate's flush deadline instead of adding to it.
+      ScopedAwake awake(this);
+    }
+
+    ServiceTx();
+    MaybeSleep();
+  }
+}
+
+zx::time Aic8800::NextTxDeadline(bool *out_credit_stall) {
+  fbl::AutoLock lock(&tx_lock_);
+  zx::time deadline = zx::time::infinite();
+  for (const TxQueue &queue : tx_queues_) {
+    for (const auto &agg : queue.agg) {
+      if (agg.state == TxAggState::kReady) {
+        *out_credit_stall = true;
+        return zx::deadline_after(zx::msec(kTxCreditTimeoutMs));
+      }
+    }
+    const TxAggregate &fill = queue.agg[queue.fill];
+    if (fill.state == TxAggState::kFilling) {
+      deadline = std::min(deadline, fill.first_queued + queue.flush_deadline);
+    }
+  }
+  return deadline;
+}
+
+zx_status_t Aic8800::QueueTxFrame(const uint8_t *frame, size_t len,
+                                  WmmAc ac) {
+  if (!initialized_) {
+    return ZX_ERR_BAD_STATE;
+  }
+  if (!frame || len == 0 || len > kBufferSize - kTxHdrSize ||
+      static_cast<size_t>(ac) >= kNumWmmAc) {
+    return ZX_ERR_INVALID_ARGS;
+  }
+
+  TxAcMetrics &metrics = tx_ac_metrics[static_cast<size_t>(ac)];
+  bool bulk = IsBulkAc(ac);
+  size_t credits;
+  {
+    fbl::AutoLock lock(&credit_lock_);
+    size_t usable = tx_credits_;
+    if (bulk) {
+      usable -= std::min<size_t>(usable, TxReservedCreditsLocked());
+    }
+    credits = std::max<size_t>(usable, 1);
+  }
+
+  bool kick = false;
+  zx_status_t status = ZX_OK;
+  size_t depth = 0;
+  bool amsdu = false;
+  bool join = false;
+  {
+    fbl::AutoLock lock(&tx_lock_);
+    TxQueue &queue = tx_queues_[static_cast<size_t>(ac)];
+    TxAggregate *agg = &queue.agg[queue.fill];
+
+    amsdu = tx_amsdu_ && ac != WmmAc::kVoice && len <= kAmsduMaxFrame &&
+            IsAmsduCandidate(frame, len);
+    size_t sub_len = amsdu ? len + kLlcSnapSize : len;
+    // Joining the closing A-MSDU grows its descriptor rather than adding
+    // one; the previous subframe's padding is already in the aggregate.
+    auto can_join = [&](const TxAggregate &a) {
+      return amsdu && a.state == TxAggState::kFilling &&
+             a.amsdu_off != kNoAmsdu &&
+             a.amsdu_subframes < kAmsduMaxSubframes &&
+             AlignUp(a.amsdu_len, kTxFrameAlign) + sub_len <=
+                 kBufferSize - kTxHdrSize &&
+             memcmp(a.amsdu_addrs, frame, sizeof(a.amsdu_addrs)) == 0;
+    };
+    auto grown_len = [&](const TxAggregate &a, bool join) {
+      if (join) {
+        return a.amsdu_off + kTxHdrSize +
+               AlignUp(AlignUp(a.amsdu_len, kTxFrameAlign) + sub_len,
+                       kTxFrameAlign);
+      }
+      return a.len + AlignUp(kTxHdrSize + sub_len, kTxFrameAlign);
+    };
+    join = can_join(*agg);
+
+    // Close the current aggregate if this frame would push it past the byte,
+    // descriptor or credit limit, and move on to the other buffer if it is
+    // free.
+    if (agg->state == TxAggState::kFilling) {
+      size_t burst = AlignUp(grown_len(*agg, join), kBlockSize);
+      size_t needed = AlignUp(burst, kBufferSize) / kBufferSize;
+      if (burst > kTxAggMaxSize || needed > credits ||
+          (!join && agg->descs == kTxAggMaxFrames)) {
+        agg->state = TxAggState::kReady;
+        kick = true;
+        TxAggregate *other = &queue.agg[queue.fill ^ 1];
+        if (other->state == TxAggState::kIdle) {
+          queue.fill ^= 1;
+          agg = other;
+        }
+        join = false;
+      }
+    }
+
+    if (agg->state != TxAggState::kIdle &&
+        agg->state != TxAggState::kFilling) {
+      status = ZX_ERR_SHOULD_WAIT;
+    } else {
+      size_t new_len = grown_len(*agg, join);
+      if (join) {
+        uint8_t *desc = tx_buf_ + agg->base + agg->amsdu_off;
+        uint8_t *dst =
+            desc + kTxHdrSize + AlignUp(agg->amsdu_len, kTxFrameAlign);
+        WriteAmsduSubframe(dst, frame, len);
+        agg->amsdu_len = AlignUp(agg->amsdu_len, kTxFrameAlign) + sub_len;
+        agg->amsdu_subframes++;
+        desc[0] = agg->amsdu_len & 0xFF;
+        desc[1] = (agg->amsdu_len >> 8) & 0xFF;
+        size_t end = static_cast<size_t>(dst - (tx_buf_ + agg->base)) + sub_len;
+        memset(tx_buf_ + agg->base + end, 0, new_len - end);
+      } else {
+        uint8_t *dst = tx_buf_ + agg->base + agg->len;
+        dst[0] = sub_len & 0xFF;
+        dst[1] = (sub_len >> 8) & 0xFF;
+        dst[2] = kTxTypeData;
+        dst[3] = amsdu ? kTxFlagAmsdu : 0;
+        if (amsdu) {
+          WriteAmsduSubframe(dst + kTxHdrSize, frame, len);
+        } else {
+          memcpy(dst + kTxHdrSize, frame, len);
+        }
+        memset(dst + kTxHdrSize + sub_len, 0,
+               new_len - agg->len - kTxHdrSize - sub_len);
+        agg->amsdu_off = amsdu ? agg->len : kNoAmsdu;
+        if (amsdu) {
+          agg->amsdu_len = sub_len;
+          agg->amsdu_subframes = 1;
+          memcpy(agg->amsdu_addrs, frame, sizeof(agg->amsdu_addrs));
+        }
+        agg->descs++;
+      }
+
+      agg->len = new_len;
+      if (agg->frames++ == 0) {
+        agg->first_queued = zx::clock::get_monotonic();
+        agg->state = TxAggState::kFilling;
+        kick = true;
+      }
+      depth = ++queue.depth;
+    }
+  }
+
+  if (status == ZX_OK) {
+    metrics.frames.Add();
+    metrics.depth.Record(depth);
+  } else {
+    metrics.full.Add();
+  }
+  if (status == ZX_OK && amsdu) {
+    tx_amsdu_subframes.Add();
+    if (!join) {
+      tx_amsdus.Add();
+    }
+  }
+  if (kick) {
+    KickIrqThread();
+  }
+  return status;
+}
+
+void Aic8800::SetTxAmsdu(bool enable) {
+  fbl::AutoLock lock(&tx_lock_);
+  tx_amsdu_ = enable;
+}
+
+void Aic8800::SetTxFlushDeadline(zx::duration deadline) {
+  {
+    fbl::AutoLock lock(&tx_lock_);
+    for (TxQueue &queue : tx_queues_) {
+      queue.flush_deadline = deadline;
+    }
+  }
+  KickIrqThread();
+}
+
+void Aic8800::SetTxFlushDeadline(WmmAc ac, zx::duration deadline) {
+  if (static_cast<size_t>(ac) >= kNumWmmAc) {
+    return;
+  }
+  {
+    fbl::AutoLock lock(&tx_lock_);
+    tx_queues_[static_cast<size_t>(ac)].flush_deadline = deadline;
+  }
+  KickIrqThread();
+}
+
+// Strict priority from voice down, except that an aggregate whose oldest
+// frame has waited kTxMaxStarve goes first, oldest first. Within a category
+// the buffer not being filled always holds the older frames.
+Aic8800::TxAggregate *Aic8800::NextTxAggregateLocked(zx::time now,
+                                                     WmmAc *out_ac) {
+  TxAggregate *best = nullptr;
+  TxAggregate *starved = nullptr;
+  WmmAc best_ac = WmmAc::kBestEffort;
+  WmmAc starved_ac = WmmAc::kBestEffort;
+  for (WmmAc ac : kTxServiceOrder) {
+    TxQueue &queue = tx_queues_[static_cast<size_t>(ac)];
+    for (size_t i : {queue.fill ^ 1, queue.fill}) {
+      TxAggregate *agg = &queue.agg[i];
+      if (agg->state != TxAggState::kReady) {
+        continue;
+      }
+      if (!best) {
+        best = agg;
+        best_ac = ac;
+      }
+      if (now - agg->first_queued >= kTxMaxStarve &&
+          (!starved || agg->first_queued < starved->first_queued)) {
+        starved = agg;
+        starved_ac = ac;
+      }
+      break;
+    }
+  }
+  if (starved) {
+    *out_ac = starved_ac;
+    return starved;
+  }
+  *out_ac = best_ac;
+  return best;
+}
+
+void Aic8800::ServiceTx() {
+  while (true) {
+    TxAggregate *send = nullptr;
+    WmmAc ac = WmmAc::kBestEffort;
+    size_t burst = 0;
+    size_t needed = 0;
+    zx::time first_queued;
+    {
+      fbl::AutoLock lock(&tx_lock_);
+      zx::time now = zx::clock::get_monotonic();
+      for (TxQueue &queue : tx_queues_) {
+        TxAggregate *fill = &queue.agg[queue.fill];
+        if (fill->state == TxAggState::kFilling &&
+            now >= fill->first_queued + queue.flush_deadline) {
+          fill->state = TxAggState::kReady;
+          if (queue.agg[queue.fill ^ 1].state == TxAggState::kIdle) {
+            queue.fill ^= 1;
+          }
+        }
+      }
+
+      send = NextTxAggregateLocked(now, &ac);
+      if (!send) {
+        return;
+      }
+
+      // The remainder of the last block is zero, which the chip reads as an
+      // empty descriptor terminating the aggregate.
+      burst = AlignUp(send->len, kBlockSize);
+      memset(tx_buf_ + send->base + send->len, 0, burst - send->len);
+      needed = AlignUp(burst, kBufferSize) / kBufferSize;
+      if (!TryAcquireTxCredits(static_cast<uint8_t>(needed), IsBulkAc(ac))) {
+        // Retried on the next TX-done.
+        return;
+      }
+      send->state = TxAggState::kSending;
+      first_queued = send->first_queued;
+    }
+
+    zx_status_t status;
+    {
+      ScopedAwake awake(this);
+      status = awake.status();
+      if (status == ZX_OK) {
+        status = sdio_helper_.TransferVmo(kDataFuncNum, kTxVmoId, send->base,
+                                          burst, true);
+      }
+    }
+    ReleaseTxCredits(static_cast<uint8_t>(needed));
+    tx_ac_metrics[static_cast<size_t>(ac)].latency_us.Record(
+        (zx::clock::get_monotonic() - first_queued).to_usecs());
+    size_t frames = 0;
+    {
+      fbl::AutoLock lock(&tx_lock_);
+      TxQueue &queue = tx_queues_[static_cast<size_t>(ac)];
+      frames = send->frames;
+      queue.depth -= frames;
+      send->len = 0;
+      send->frames = 0;
+      send->descs = 0;
+      send->amsdu_off = kNoAmsdu;
+      send->state = TxAggState::kIdle;
+      if (queue.agg[queue.fill].state == TxAggState::kReady) {
+        queue.fill = static_cast<size_t>(send - queue.agg);
+      }
+    }
+    if (status != ZX_OK) {
+      zxlogf(ERROR, "aic8800: TX burst of %zu frames (%zu bytes) failed: %s",
+             frames, burst, zx_status_get_string(status));
+    }
+  }
+}
+
+zx_status_t Aic8800::HandleInterrupt() {
+  ScopedAwake awake(this);
+  if (awake.status() != ZX_OK) {
+    return awake.status();
+  }
+  uint32_t int_status = 0;
+  zx_status_t status = ReadIntStatus(&int_status);
   if (status != ZX_OK) {
-    zxlogf(ERROR, "aic8800: SDIO TX failed (func %u, len %zu): %s",
-           func_num, aligned_len, zx_status_get_string(status));
     return status;
   }
-  
+  if (int_status == 0) {
+    return ZX_OK;
+  }
+
+  status = AckIntStatus(int_status);
+  if (status != ZX_OK) {
+    return status;
+  }
+
+  if (int_status & kIntError) {
+    zxlogf(ERROR, "aic8800: Chip reported error interrupt (status 0x%08x)",
+           int_status);
+  }
+
+  if (int_status & kIntTxDone) {
+    status = RefreshTxCredits();
+    if (status != ZX_OK) {
+      return status;
+    }
+  }
+
+  if (int_status & kIntRxReady) {
+    status = DrainRx();
+    if (status != ZX_OK) {
+      return status;
+    }
+  }
+
   return ZX_OK;
 }
 
-zx_status_t Aic8800::SdioRx(uint8_t *buf, size_t len, uint8_t func_num) {
-  if (!buf || len == 0) {
+void Aic8800::SetRxHandler(const RxBatchHandler &handler) {
+  fbl::AutoLock lock(&rx_lock_);
+  rx_handler_ = handler;
+}
+
+zx_status_t Aic8800::DrainRx() {
+  RxFrame batch[kRxPoolSlots];
+
+  while (true) {
+    uint8_t pending = 0;
+    zx_status_t status = sdio_helper_.ReadByte(kRegRxReady, &pending);
+    if (status != ZX_OK) {
+      zxlogf(ERROR, "aic8800: Failed to read RX pending count: %s",
+             zx_status_get_string(status));
+      return status;
+    }
+    if (pending == 0) {
+      return ZX_OK;
+    }
+
+    size_t count = std::min<size_t>(pending, kRxPoolSlots);
+    for (size_t i = 0; i < count; i++) {
+      uint8_t len_words = 0;
+      status = sdio_helper_.ReadByte(kRegByteModeLen, &len_words);
+      if (status != ZX_OK) {
+        zxlogf(ERROR, "aic8800: Failed to read RX frame length: %s",
+               zx_status_get_string(status));
+        return status;
+      }
+
+      size_t len = len_words * kRxLenUnit;
+      if (len == 0 || len > kRxSlotSize) {
+        zxlogf(ERROR, "aic8800: Bad RX frame length %zu", len);
+        return ZX_ERR_IO_DATA_INTEGRITY;
+      }
+
+      size_t offset = i * kRxSlotSize;
+      status = SdioRx(offset, len, kDataFuncNum);
+      if (status != ZX_OK) {
+        return status;
+      }
+      batch[i] = {rx_buf_ + offset, len};
+    }
+
+    fbl::AutoLock lock(&rx_lock_);
+    if (rx_handler_.deliver) {
+      rx_handler_.deliver(rx_handler_.ctx, batch, count);
+    }
+  }
+}
+
+zx_status_t Aic8800::SetupDmaBuffers() {
+  struct DmaBuffer {
+    uint32_t vmo_id;
+    uint32_t rights;
+    size_t size;
+    uint8_t **out_buf;
+  };
+  const DmaBuffer kBuffers[] = {
+      {kTxVmoId, SDMMC_VMO_RIGHT_READ, kTxBufferSize, &tx_buf_},
+      {kRxVmoId, SDMMC_VMO_RIGHT_WRITE, kDmaBufferSize, &rx_buf_},
+      {kCmdVmoId, SDMMC_VMO_RIGHT_READ, kCmdBufferSize, &cmd_buf_},
+  };
+
+  for (const auto &buffer : kBuffers) {
+    zx::vmo vmo;
+    zx_status_t status = zx::vmo::create(buffer.size, 0, &vmo);
+    if (status != ZX_OK) {
+      zxlogf(ERROR, "aic8800: Failed to create DMA VMO %u: %s", buffer.vmo_id,
+             zx_status_get_string(status));
+      return status;
+    }
+
+    zx_vaddr_t mapped = 0;
+    status = zx::vmar::root_self()->map(ZX_VM_PERM_READ | ZX_VM_PERM_WRITE, 0,
+                                        vmo, 0, buffer.size, &mapped);
+    if (status != ZX_OK) {
+      zxlogf(ERROR, "aic8800: Failed to map DMA VMO %u: %s", buffer.vmo_id,
+             zx_status_get_string(status));
+      return status;
+    }
+    *buffer.out_buf = reinterpret_cast<uint8_t *>(mapped);
+
+    status = sdio_helper_.RegisterVmo(buffer.vmo_id, std::move(vmo), 0,
+                                      buffer.size, buffer.rights);
+    if (status != ZX_OK) {
+      return status;
+    }
+    dma_registered_ = true;
+  }
+
+  return ZX_OK;
+}
+
+void Aic8800::ReleaseDmaBuffers() {
+  if (!dma_registered_) {
+    return;
+  }
+  sdio_helper_.UnregisterVmo(kTxVmoId);
+  sdio_helper_.UnregisterVmo(kRxVmoId);
+  sdio_helper_.UnregisterVmo(kCmdVmoId);
+  dma_registered_ = false;
+}
+
+// The message travels as a single config-type descriptor in its own burst;
+// the zeroed tail of the block terminates it, as for data aggregates.
+zx_status_t Aic8800::SendFwMsg(uint16_t id, uint16_t dest_task,
+                               const uint8_t *param, size_t param_len) {
+  size_t msg_len = kLmacHdrSize + param_len;
+  size_t burst = AlignUp(kTxHdrSize + msg_len, kBlockSize);
+  if (burst > kCmdBufferSize) {
+    return ZX_ERR_INVALID_ARGS;
+  }
+
+  MsgWriter msg(cmd_buf_, kCmdBufferSize);
+  msg.U16(static_cast<uint16_t>(msg_len));
+  msg.U8(kTxTypeCfg);
+  msg.U8(0);
+  msg.U16(id);
+  msg.U16(dest_task);
+  msg.U16(kDrvTaskId);
+  msg.U16(static_cast<uint16_t>(param_len));
+  msg.Bytes(param, param_len);
+  memset(cmd_buf_ + msg.len(), 0, burst - msg.len());
+
+  ScopedAwake awake(this);
+  if (awake.status() != ZX_OK) {
+    return awake.status();
+  }
+  size_t needed = AlignUp(burst, kBufferSize) / kBufferSize;
+  zx_status_t status = AcquireTxCredits(static_cast<uint8_t>(needed));
+  if (status != ZX_OK) {
+    return status;
+  }
+  status = sdio_helper_.TransferVmo(kDataFuncNum, kCmdVmoId, 0, burst, true);
+  ReleaseTxCredits(static_cast<uint8_t>(needed));
+  if (status != ZX_OK) {
+    zxlogf(ERROR, "aic8800: Firmware message 0x%04x failed: %s", id,
+           zx_status_get_string(status));
+  }
+  return status;
+}
+
+zx_status_t Aic8800::SendMeConfig() {
+  uint8_t param[64];
+  MsgWriter msg(param, sizeof(param));
+
+  // mac_htcapability
+  msg.U16(kHtCapInfo);
+  msg.U8(kHtAmpduParams);
+  msg.Bytes(kHtMcsSet, sizeof(kHtMcsSet));
+  msg.U16(0); // Extended capabilities
+  msg.U32(0); // TX beamforming
+  msg.U8(0);  // Antenna selection
+
+  // mac_vhtcapability
+  msg.U32(kVhtCapInfo);
+  msg.U16(kVhtMcsMap);
+  msg.U16(kVhtHighestRate);
+  msg.U16(kVhtMcsMap);
+  msg.U16(kVhtHighestRate);
+
+  msg.U16(kTxLifetimeMs);
+  msg.U8(kPhyBw80);
+  msg.U8(1); // HT supported
+  msg.U8(1); // VHT supported
+  msg.U8(0); // HE supported
+  msg.U8(0); // Power save
+
+  return SendFwMsg(kMeConfigReq, kTaskMe, param, msg.len());
+}
+
+// Every hardware channel is listed; those the domain forbids are marked
+// disabled rather than left out, so the firmware never falls back to its
+// built-in defaults for them.
+zx_status_t Aic8800::SendChanConfig(size_t domain) {
+  // mac_chan_def: LE16 frequency, band, max power, flags, padding.
+  uint8_t param[(kChanConfig2gSlots + kChanConfig5gSlots) * 6 + 2];
+  MsgWriter msg(param, sizeof(param));
+
+  auto write_band = [&](uint8_t band, const uint8_t *channels, size_t count,
+                        size_t slots) {
+    for (size_t i = 0; i < slots; i++) {
+      if (i >= count) {
+        // Unused slot.
+        msg.U16(0);
+        msg.U32(0);
+        continue;
+      }
+      const ChannelRule *rule = FindChannelRule(domain, band, channels[i]);
+      msg.U16(ChannelFreq(band, channels[i]));
+      msg.U8(band);
+      msg.U8(static_cast<uint8_t>(rule ? rule->max_dbm : 0));
+      msg.U8(rule ? rule->flags : kChanDisabled);
+      msg.U8(0);
+    }
+  };
+  write_band(kBand2g, kHwChannels2g, std::size(kHwChannels2g),
+             kChanConfig2gSlots);
+  write_band(kBand5g, kHwChannels5g, std::size(kHwChannels5g),
+             kChanConfig5gSlots);
+  msg.U8(static_cast<uint8_t>(std::size(kHwChannels2g)));
+  msg.U8(static_cast<uint8_t>(std::size(kHwChannels5g)));
+
+  return SendFwMsg(kMeChanConfigReq, kTaskMe, param, msg.len());
+}
+
+zx_status_t Aic8800::SdioRx(size_t offset, size_t len, uint8_t func_num) {
+  if (len == 0) {
     return ZX_ERR_INVALID_ARGS;
   }
   
   size_t aligned_len = (len + kBlockSize - 1) / kBlockSize * kBlockSize;
+  if (offset > kDmaBufferSize || aligned_len > kDmaBufferSize - offset) {
+    return ZX_ERR_OUT_OF_RANGE;
+  }
   
-  zx_status_t status = sdio_helper_.ReadMultiBlock(func_num, buf, aligned_len);
+  zx_status_t status = sdio_helper_.TransferVmo(func_num, kRxVmoId, offset,
+                                                aligned_len, false);
   if (status != ZX_OK) {
     zxlogf(ERROR, "aic8800: SDIO RX failed (func %u, len %zu): %s",
            func_num, aligned_len, zx_status_get_string(status));
     return status;
   }
-  
-  return ZX_OK;
+  
+  return ZX_OK;
+}
+
+zx_status_t Aic8800::DownloadFirmwareImage(const zx::vmo &fw_vmo,
+                                           size_t fw_size) {
+  uint32_t magic = 0;
+  if (fw_size >= sizeof(magic)) {
+    zx_status_t status = fw_vmo.read(&magic, 0, sizeof(magic));
+    if (status != ZX_OK) {
+      return status;
+    }
+  }
+
+  if (magic != soliloquy_hal::Lz4FrameDecoder::kMagic) {
+    if (fw_size > kFirmwareMaxSize) {
+      zxlogf(ERROR, "aic8800: Firmware too large: %zu bytes (max %zu)",
+             fw_size, kFirmwareMaxSize);
+      return ZX_ERR_BUFFER_TOO_SMALL;
+    }
+    return sdio_helper_.DownloadFirmware(fw_vmo, fw_size, kRamFmacFwAddrU02);
+  }
+
+  // Compressed: decode block by block straight into the SDIO staging ring,
+  // so only the compressed image and a few blocks are ever resident.
+  uint8_t *data;
+  zx_status_t status =
+      soliloquy_hal::FirmwareLoader::MapFirmware(fw_vmo, fw_size, &data);
+  if (status != ZX_OK) {
+    return status;
+  }
+
+  soliloquy_hal::Lz4FrameDecoder decoder;
+  status = decoder.Init(data, fw_size);
+  if (status == ZX_OK &&
+      decoder.block_max_size() > soliloquy_hal::SdioHelper::kMaxStreamChunk) {
+    zxlogf(ERROR,
+           "aic8800: LZ4 blocks of %zu bytes are too big to stream; "
+           "pack with lz4 -B4 or -B5",
+           decoder.block_max_size());
+    status = ZX_ERR_NOT_SUPPORTED;
+  }
+  if (status == ZX_OK) {
+    soliloquy_hal::FirmwareChunkSource source = {
+        soliloquy_hal::Lz4FrameDecoder::NextChunk, &decoder,
+        decoder.block_max_size()};
+    size_t written;
+    status = sdio_helper_.DownloadFirmwareStream(source, kRamFmacFwAddrU02,
+                                                 kFirmwareMaxSize, &written);
+  }
+
+  zx::vmar::root_self()->unmap(reinterpret_cast<uintptr_t>(data), fw_size);
+  return status;
 }
 
-zx_status_t Aic8800::WaitForFirmwareReady() {
+zx_status_t Aic8800::WaitForFirmwareReady(zx::duration timeout) {
   zxlogf(INFO, "aic8800: Waiting for firmware ready...");
-  
-  auto deadline = zx::deadline_after(zx::msec(kFwReadyTimeoutMs));
-  
-  while (zx::clock::get_monotonic() < deadline) {
+
+  zx::time start = zx::clock::get_monotonic();
+  zx::time deadline = start + timeout;
+  zx::duration poll = kFwReadyMinPoll;
+
+  while (true) {
     uint8_t fw_status;
     zx_status_t status = sdio_helper_.ReadByte(kRegFwStatus, &fw_status);
     if (status != ZX_OK) {
@@ -185,24 +1470,105 @@ zx_status_t Aic8800::WaitForFirmwareReady() {
              zx_status_get_string(status));
       return status;
     }
-    
+
     if (fw_status == kFwStatusReady) {
-      zxlogf(INFO, "aic8800: Firmware ready");
+      zxlogf(INFO, "aic8800: Firmware ready after %ld ms",
+             (zx::clock::get_monotonic() - start).to_msecs());
       return ZX_OK;
     }
-    
+
     if (fw_status == kFwStatusError) {
       zxlogf(ERROR, "aic8800: Firmware reported error status");
       return ZX_ERR_INTERNAL;
     }
-    
-    zx::nanosleep(zx::deadline_after(zx::msec(100)));
+
+    zx::time now = zx::clock::get_monotonic();
+    if (now >= deadline) {
+      break;
+    }
+    zx::nanosleep(std::min(now + poll, deadline));
+    poll = std::min(poll * 2, kFwReadyMaxPoll);
   }
-  
+
   zxlogf(ERROR, "aic8800: Timeout waiting for firmware ready");
   return ZX_ERR_TIMED_OUT;
 }
 
+// Read back the way WriteResidentMarker wrote it, with one
+// incrementing-address CMD53.
+zx_status_t Aic8800::ReadResidentMarker(ResidentMarker *out_marker) {
+  uint32_t words[4];
+  zx_status_t status =
+      sdio_helper_.ReadRegs(kResidentMarkerAddr, words, std::size(words));
+  if (status != ZX_OK) {
+    return status;
+  }
+  out_marker->magic = words[0];
+  out_marker->digest = words[1];
+  out_marker->size = words[2];
+  out_marker->check = words[3];
+  return ZX_OK;
+}
+
+zx_status_t Aic8800::WriteResidentMarker(const ResidentMarker &marker) {
+  // Merged into a single incrementing-address write.
+  const soliloquy_hal::SdioReg regs[] = {
+      {kResidentMarkerAddr + 0, marker.magic},
+      {kResidentMarkerAddr + 4, marker.digest},
+      {kResidentMarkerAddr + 8, marker.size},
+      {kResidentMarkerAddr + 12, marker.check},
+  };
+  return sdio_helper_.WriteRegs(regs, std::size(regs));
+}
+
+zx_status_t Aic8800::DigestFirmware(const zx::vmo &fw_vmo, size_t fw_size,
+                                    uint32_t *out_digest) {
+  uint8_t *data;
+  zx_status_t status =
+      soliloquy_hal::FirmwareLoader::MapFirmware(fw_vmo, fw_size, &data);
+  if (status != ZX_OK) {
+    return status;
+  }
+  *out_digest = soliloquy_hal::Xxh32::Hash(data, fw_size);
+  zx::vmar::root_self()->unmap(reinterpret_cast<uintptr_t>(data), fw_size);
+  return ZX_OK;
+}
+
+zx_status_t Aic8800::TryWarmStart(const ResidentMarker &resident,
+                                  const ResidentMarker &expected) {
+  if (!resident.Matches(expected.digest, expected.size)) {
+    zxlogf(INFO, "aic8800: Resident firmware differs from image");
+    return ZX_ERR_NOT_FOUND;
+  }
+
+  // The chip may have been left asleep by a suspend or by power save;
+  // waking an awake chip is harmless.
+  zx::duration latency;
+  zx_status_t status = WakeChip(kWarmReadyTimeout, &latency);
+  if (status == ZX_OK) {
+    status = WaitForFirmwareReady(kWarmReadyTimeout);
+  }
+  if (status != ZX_OK) {
+    zxlogf(WARNING, "aic8800: Resident firmware not responding: %s",
+           zx_status_get_string(status));
+    return ZX_ERR_NOT_FOUND;
+  }
+
+  // Events raised before the restart belong to the old instance; start the
+  // IRQ thread from a clean slate.
+  uint32_t pending = 0;
+  status = ReadIntStatus(&pending);
+  if (status == ZX_OK && pending) {
+    status = AckIntStatus(pending);
+  }
+  if (status != ZX_OK) {
+    return ZX_ERR_NOT_FOUND;
+  }
+
+  zxlogf(INFO, "aic8800: Resident firmware still running, skipping download");
+  return ZX_OK;
+}
+
 zx_status_t Aic8800::ConfigurePatchTables() {
   zxlogf(INFO, "aic8800: Configuring patch tables...");
   
@@ -215,107 +1581,67 @@ zx_status_t Aic8800::ConfigurePatchTables() {
   constexpr uint32_t kPatchStrBaseAddr = kRamFmacFwAddrU02 + 0x01A0;
   
   uint32_t config_base = 0;
-  uint8_t config_bytes[4];
-  for (int i = 0; i < 4; i++) {
-    zx_status_t status = sdio_helper_.ReadByte(kConfigBaseAddr + i, &config_bytes[i]);
-    if (status != ZX_OK) {
-      zxlogf(ERROR, "aic8800: Failed to read config base address: %s",
-             zx_status_get_string(status));
-      return status;
-    }
+  zx_status_t status = sdio_helper_.Read32(kConfigBaseAddr, &config_base);
+  if (status != ZX_OK) {
+    zxlogf(ERROR, "aic8800: Failed to read config base address: %s",
+           zx_status_get_string(status));
+    return status;
   }
-  config_base = *reinterpret_cast<uint32_t*>(config_bytes);
   
   uint32_t patch_str_base = 0;
-  uint8_t patch_str_bytes[4];
-  for (int i = 0; i < 4; i++) {
-    zx_status_t status = sdio_helper_.ReadByte(kPatchStrBaseAddr + i, &patch_str_bytes[i]);
-    if (status != ZX_OK) {
-      zxlogf(ERROR, "aic8800: Failed to read patch string base address: %s",
-             zx_status_get_string(status));
-      return status;
-    }
+  status = sdio_helper_.Read32(kPatchStrBaseAddr, &patch_str_base);
+  if (status != ZX_OK) {
+    zxlogf(ERROR, "aic8800: Failed to read patch string base address: %s",
+           zx_status_get_string(status));
+    return status;
   }
-  patch_str_base = *reinterpret_cast<uint32_t*>(patch_str_bytes);
   
   zxlogf(INFO, "aic8800: Config base: 0x%08x, Patch str base: 0x%08x",
          config_base, patch_str_base);
   
-  auto write_u32 = [this](uint32_t addr, uint32_t value) -> zx_status_t {
-    uint8_t bytes[4];
-    bytes[0] = value & 0xFF;
-    bytes[1] = (value >> 8) & 0xFF;
-    bytes[2] = (value >> 16) & 0xFF;
-    bytes[3] = (value >> 24) & 0xFF;
-    for (int i = 0; i < 4; i++) {
-      zx_status_t status = sdio_helper_.WriteByte(addr + i, bytes[i]);
-      if (status != ZX_OK) {
-        return status;
-      }
-    }
-    return ZX_OK;
-  };
-  
-  constexpr size_t kPatchOfstMagicNum = 0;
-  constexpr size_t kPatchOfstPairStart = 4;
-  constexpr size_t kPatchOfstMagicNum2 = 8;
-  constexpr size_t kPatchOfstPairCount = 12;
-  constexpr size_t kPatchOfstBlockSize = 32;
+  constexpr uint32_t kPatchOfstMagicNum = 0;
+  constexpr uint32_t kPatchOfstPairStart = 4;
+  constexpr uint32_t kPatchOfstMagicNum2 = 8;
+  constexpr uint32_t kPatchOfstPairCount = 12;
+  constexpr uint32_t kPatchOfstBlockSize = 32;
+  constexpr size_t kPatchBlockSizeCount = 4;
+  
+  constexpr size_t patch_count =
+      sizeof(kPatchTable8800D80) / sizeof(PatchEntry);
+  
+  // Laid out so that WriteRegs merges them into three incrementing-address
+  // writes: the patch header, the pair table and the block sizes.
+  soliloquy_hal::SdioReg regs[4 + patch_count * 2 + kPatchBlockSizeCount];
+  size_t n = 0;
+  regs[n++] = {patch_str_base + kPatchOfstMagicNum, kPatchMagicNum};
+  regs[n++] = {patch_str_base + kPatchOfstPairStart, kPatchStartAddr};
+  regs[n++] = {patch_str_base + kPatchOfstMagicNum2, kPatchMagicNum2};
+  regs[n++] = {patch_str_base + kPatchOfstPairCount,
+               static_cast<uint32_t>(patch_count)};
   
-  zx_status_t status = write_u32(patch_str_base + kPatchOfstMagicNum, kPatchMagicNum);
-  if (status != ZX_OK) {
-    zxlogf(ERROR, "aic8800: Failed to write patch magic number");
-    return status;
-  }
-  
-  status = write_u32(patch_str_base + kPatchOfstMagicNum2, kPatchMagicNum2);
-  if (status != ZX_OK) {
-    zxlogf(ERROR, "aic8800: Failed to write patch magic number 2");
-    return status;
+  for (size_t i = 0; i < patch_count; i++) {
+    uint32_t entry_addr = kPatchStartAddr + static_cast<uint32_t>(i * 8);
+    regs[n++] = {entry_addr, kPatchTable8800D80[i].offset + config_base};
+    regs[n++] = {entry_addr + 4, kPatchTable8800D80[i].value};
   }
   
-  status = write_u32(patch_str_base + kPatchOfstPairStart, kPatchStartAddr);
-  if (status != ZX_OK) {
-    zxlogf(ERROR, "aic8800: Failed to write patch pair start");
-    return status;
+  for (size_t i = 0; i < kPatchBlockSizeCount; i++) {
+    regs[n++] = {
+        patch_str_base + kPatchOfstBlockSize + static_cast<uint32_t>(i * 4), 0};
   }
   
-  size_t patch_count = sizeof(kPatchTable8800D80) / sizeof(PatchEntry);
-  status = write_u32(patch_str_base + kPatchOfstPairCount, patch_count);
+  status = sdio_helper_.WriteRegs(regs, n);
   if (status != ZX_OK) {
-    zxlogf(ERROR, "aic8800: Failed to write patch pair count");
+    zxlogf(ERROR, "aic8800: Failed to write patch tables: %s",
+           zx_status_get_string(status));
     return status;
   }
   
-  for (size_t i = 0; i < patch_count; i++) {
-    uint32_t entry_addr = kPatchStartAddr + (i * 8);
-    status = write_u32(entry_addr, kPatchTable8800D80[i].offset + config_base);
-    if (status != ZX_OK) {
-      zxlogf(ERROR, "aic8800: Failed to write patch entry %zu offset", i);
-      return status;
-    }
-    status = write_u32(entry_addr + 4, kPatchTable8800D80[i].value);
-    if (status != ZX_OK) {
-      zxlogf(ERROR, "aic8800: Failed to write patch entry %zu value", i);
-      return status;
-    }
-  }
-  
-  for (int i = 0; i < 4; i++) {
-    status = write_u32(patch_str_base + kPatchOfstBlockSize + (i * 4), 0);
-    if (status != ZX_OK) {
-      zxlogf(ERROR, "aic8800: Failed to write block size %d", i);
-      return status;
-    }
-  }
-  
   zxlogf(INFO, "aic8800: Patch configuration complete (%zu entries)", patch_count);
   return ZX_OK;
 }
 
-zx_status_t Aic8800::InitHw() {
-  zxlogf(INFO, "aic8800: Initializing hardware...");
-
+zx_status_t Aic8800::DetectChip() {
   zx_status_t status = ReadChipId(&chip_id_);
   if (status != ZX_OK) {
     zxlogf(ERROR, "aic8800: Failed to read chip ID: %s",
@@ -328,56 +1654,163 @@ zx_status_t Aic8800::InitHw() {
     zxlogf(ERROR, "aic8800: Unsupported chip ID: 0x%08x", chip_id_);
     return ZX_ERR_NOT_SUPPORTED;
   }
-  
-  status = ResetChip();
+  return ZX_OK;
+}
+
+zx_status_t Aic8800::PrepareChip(ResidentMarker *out_resident) {
+  zx_status_t status = DetectChip();
   if (status != ZX_OK) {
     return status;
   }
 
-  const char *kFwName = "fmacfw_8800d80.bin";
+  // A chip holding a marker may still be warm-started once the image digest
+  // is known. Anything else is reset now, while the image is being fetched.
+  if (ReadResidentMarker(out_resident) == ZX_OK &&
+      out_resident->magic == ResidentMarker::kMagic) {
+    return ZX_OK;
+  }
+  *out_resident = {};
+  return ResetChip();
+}
+
+zx_status_t Aic8800::InitHw() {
+  zxlogf(INFO, "aic8800: Initializing hardware...");
+
+  // Fetching the image doesn't touch the chip, so it overlaps chip detection
+  // and the reset settle delays. It is normally already cached, either from
+  // the prefetch in Bind() or from a previous bind.
+  FirmwareFetch fetch = {parent(), kFwNames, std::size(kFwNames)};
+  thrd_t fetch_thread;
+  bool fetch_async = thrd_create_with_name(&fetch_thread, FetchFirmware,
+                                           &fetch, "aic8800-fw-fetch") ==
+                     thrd_success;
+  if (!fetch_async) {
+    FetchFirmware(&fetch);
+  }
 
-  zx::vmo fw_vmo;
-  size_t fw_size;
-  status = soliloquy_hal::FirmwareLoader::LoadFirmware(
-      parent(), kFwName, &fw_vmo, &fw_size);
+  zx_status_t status;
+  ResidentMarker resident = {};
+  {
+    SOLILOQUY_TIMED_SCOPE(init_prepare_us, "aic8800_init_prepare");
+    status = PrepareChip(&resident);
+    if (fetch_async) {
+      thrd_join(fetch_thread, nullptr);
+    }
+  }
   if (status != ZX_OK) {
-    zxlogf(ERROR, "aic8800: Failed to load firmware '%s': %s", kFwName,
-           zx_status_get_string(status));
     return status;
   }
-  
-  if (fw_size > kFirmwareMaxSize) {
-    zxlogf(ERROR, "aic8800: Firmware too large: %zu bytes (max %zu)", 
-           fw_size, kFirmwareMaxSize);
-    return ZX_ERR_BUFFER_TOO_SMALL;
+
+  if (fetch.status != ZX_OK) {
+    zxlogf(ERROR, "aic8800: Failed to load firmware '%s': %s", fetch.name,
+           zx_status_get_string(fetch.status));
+    return fetch.status;
   }
 
-  status = sdio_helper_.DownloadFirmware(fw_vmo, fw_size, kRamFmacFwAddrU02);
+  uint32_t digest = 0;
+  status = DigestFirmware(fetch.vmo, fetch.size, &digest);
   if (status != ZX_OK) {
-    zxlogf(ERROR, "aic8800: Failed to download firmware: %s",
-           zx_status_get_string(status));
     return status;
   }
+  ResidentMarker expected =
+      ResidentMarker::For(digest, static_cast<uint32_t>(fetch.size));
+
+  bool warm = false;
+  if (resident.magic == ResidentMarker::kMagic) {
+    warm = TryWarmStart(resident, expected) == ZX_OK;
+    if (warm) {
+      warm_starts.Add();
+    } else {
+      status = ResetChip();
+      if (status != ZX_OK) {
+        return status;
+      }
+    }
+  }
+
+  if (!warm) {
+    // Never leave a marker behind for a download that might not finish.
+    status = WriteResidentMarker({});
+    if (status != ZX_OK) {
+      zxlogf(ERROR, "aic8800: Failed to clear resident marker: %s",
+             zx_status_get_string(status));
+      return status;
+    }
+
+    {
+      SOLILOQUY_TIMED_SCOPE(init_download_us, "aic8800_init_download");
+      status = DownloadFirmwareImage(fetch.vmo, fetch.size);
+    }
+    if (status != ZX_OK) {
+      zxlogf(ERROR, "aic8800: Failed to download firmware '%s': %s",
+             fetch.name, zx_status_get_string(status));
+      return status;
+    }
+
+    {
+      SOLILOQUY_TIMED_SCOPE(init_patch_us, "aic8800_init_patch");
+      status = ConfigurePatchTables();
+    }
+    if (status != ZX_OK) {
+      zxlogf(ERROR, "aic8800: Failed to configure patch tables: %s",
+             zx_status_get_string(status));
+      return status;
+    }
+
+    {
+      SOLILOQUY_TIMED_SCOPE(init_fw_ready_us, "aic8800_init_fw_ready");
+      status = WaitForFirmwareReady(zx::msec(kFwReadyTimeoutMs));
+    }
+    if (status != ZX_OK) {
+      return status;
+    }
+
+    // Only costs the next bind its fast path if it fails.
+    status = WriteResidentMarker(expected);
+    if (status != ZX_OK) {
+      zxlogf(WARNING, "aic8800: Failed to write resident marker: %s",
+             zx_status_get_string(status));
+    }
+  }
   
-  status = ConfigurePatchTables();
+  status = sdio_helper_.WriteByte(kRegHostCtrl, kHostCtrlEnable);
+  if (status != ZX_OK) {
+    zxlogf(ERROR, "aic8800: Failed to enable chip: %s",
+           zx_status_get_string(status));
+    return status;
+  }
+
+  status = SetupDmaBuffers();
   if (status != ZX_OK) {
-    zxlogf(ERROR, "aic8800: Failed to configure patch tables: %s",
+    zxlogf(ERROR, "aic8800: Failed to set up DMA buffers: %s",
            zx_status_get_string(status));
     return status;
   }
-  
-  status = WaitForFirmwareReady();
+
+  status = StartIrqThread();
   if (status != ZX_OK) {
     return status;
   }
-  
-  status = sdio_helper_.WriteByte(kRegHostCtrl, kHostCtrlEnable);
+
+  {
+    fbl::AutoLock lock(&cmd_lock_);
+    status = SendMeConfig();
+    if (status == ZX_OK) {
+      status = SendChanConfig(reg_domain_);
+    }
+  }
   if (status != ZX_OK) {
-    zxlogf(ERROR, "aic8800: Failed to enable chip: %s",
+    zxlogf(ERROR, "aic8800: Failed to configure firmware: %s",
            zx_status_get_string(status));
     return status;
   }
 
+  {
+    fbl::AutoLock lock(&power_lock_);
+    ps_enabled_ = host_wake_irq_.is_valid();
+    last_bus_use_ = zx::clock::get_monotonic();
+  }
+
   initialized_ = true;
   zxlogf(INFO, "aic8800: Hardware initialization complete");
   return ZX_OK;
@@ -396,7 +1829,8 @@ zx_status_t Aic8800::WlanphyImplQuery(wlanphy_info_t *out_info) {
   memset(out_info, 0, sizeof(*out_info));
   
   out_info->supported_phys = WLAN_INFO_PHY_TYPE_DSSS | WLAN_INFO_PHY_TYPE_CCK |
-                              WLAN_INFO_PHY_TYPE_OFDM | WLAN_INFO_PHY_TYPE_HT;
+                              WLAN_INFO_PHY_TYPE_OFDM | WLAN_INFO_PHY_TYPE_HT |
+                              WLAN_INFO_PHY_TYPE_VHT;
   
   out_info->driver_features = 0;
   
@@ -405,27 +1839,40 @@ zx_status_t Aic8800::WlanphyImplQuery(wlanphy_info_t *out_info) {
   out_info->caps = WLAN_INFO_HARDWARE_CAPABILITY_SHORT_PREAMBLE |
                    WLAN_INFO_HARDWARE_CAPABILITY_SHORT_SLOT_TIME;
   
-  out_info->bands_count = 1;
-  
-  auto &band = out_info->bands[0];
-  band.band = WLAN_INFO_BAND_2GHZ;
-  
-  band.ht_supported = true;
-  band.ht_caps.ht_capability_info = 0x016E;
-  band.ht_caps.ampdu_params = 0x17;
-  
-  static const uint8_t kSupportedMcs[] = {
-      0xFF, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-      0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-  };
-  memcpy(band.ht_caps.supported_mcs_set, kSupportedMcs, sizeof(kSupportedMcs));
-  
-  band.vht_supported = false;
-  
-  static const uint8_t kChannels2g[] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13};
-  band.supported_channels.base_freq = 2407;
-  band.supported_channels.channels_count = sizeof(kChannels2g);
-  memcpy(band.supported_channels.channels, kChannels2g, sizeof(kChannels2g));
+  size_t domain;
+  {
+    fbl::AutoLock lock(&cmd_lock_);
+    domain = reg_domain_;
+  }
+
+  out_info->bands_count = 2;
+  for (size_t i = 0; i < out_info->bands_count; i++) {
+    auto &band = out_info->bands[i];
+    band.ht_supported = true;
+    band.ht_caps.ht_capability_info = kHtCapInfo;
+    band.ht_caps.ampdu_params = kHtAmpduParams;
+    memcpy(band.ht_caps.supported_mcs_set, kHtMcsSet, sizeof(kHtMcsSet));
+  }
+
+  auto &band_2g = out_info->bands[0];
+  band_2g.band = WLAN_INFO_BAND_2GHZ;
+  band_2g.vht_supported = false;
+  FillChannels(domain, kBand2g, kHwChannels2g, std::size(kHwChannels2g),
+               &band_2g.supported_channels);
+
+  // The VHT MCS and NSS set is RX map, RX highest rate, TX map, TX highest
+  // rate, 16 bits each.
+  auto &band_5g = out_info->bands[1];
+  band_5g.band = WLAN_INFO_BAND_5GHZ;
+  band_5g.vht_supported = true;
+  band_5g.vht_caps.vht_capability_info = kVhtCapInfo;
+  band_5g.vht_caps.supported_vht_mcs_and_nss_set =
+      static_cast<uint64_t>(kVhtMcsMap) |
+      static_cast<uint64_t>(kVhtHighestRate) << 16 |
+      static_cast<uint64_t>(kVhtMcsMap) << 32 |
+      static_cast<uint64_t>(kVhtHighestRate) << 48;
+  FillChannels(domain, kBand5g, kHwChannels5g, std::size(kHwChannels5g),
+               &band_5g.supported_channels);
   
   zxlogf(INFO, "aic8800: WlanphyQuery - PHY: 0x%x, MAC modes: 0x%x, Bands: %u",
          out_info->supported_phys, out_info->mac_modes, out_info->bands_count);
@@ -433,6 +1880,9 @@ zx_status_t Aic8800::WlanphyImplQuery(wlanphy_info_t *out_info) {
   return ZX_OK;
 }
 
+// Nothing would serve the SME channel yet, so it is closed rather than
+// leaving the SME waiting on it. AddInterface does the firmware side once
+// an interface device can be published.
 zx_status_t
 Aic8800::WlanphyImplCreateIface(const wlanphy_create_iface_req_t *req,
                                 uint16_t *out_iface_id) {
@@ -444,6 +1894,7 @@ Aic8800::WlanphyImplCreateIface(const wlanphy_create_iface_req_t *req,
     return ZX_ERR_INVALID_ARGS;
   }
   
+  zx::channel sme(req->sme_channel);
   zxlogf(INFO, "aic8800: CreateIface requested - role: %u", req->role);
   
   return ZX_ERR_NOT_SUPPORTED;
@@ -459,6 +1910,173 @@ zx_status_t Aic8800::WlanphyImplDestroyIface(uint16_t iface_id) {
   return ZX_ERR_NOT_SUPPORTED;
 }
 
+zx_status_t Aic8800::AddInterface(uint16_t role, const uint8_t *mac,
+                                  uint16_t *out_iface_id) {
+  if (!initialized_) {
+    return ZX_ERR_BAD_STATE;
+  }
+  
+  if (!out_iface_id) {
+    return ZX_ERR_INVALID_ARGS;
+  }
+  
+  uint8_t vif_type;
+  switch (role) {
+  case WLAN_MAC_ROLE_CLIENT:
+    vif_type = kVifTypeSta;
+    break;
+  case WLAN_MAC_ROLE_AP:
+    vif_type = kVifTypeAp;
+    break;
+  default:
+    zxlogf(ERROR, "aic8800: AddInterface - unsupported role %u", role);
+    return ZX_ERR_NOT_SUPPORTED;
+  }
+
+  fbl::AutoLock lock(&cmd_lock_);
+  size_t id = 0;
+  while (id < kMaxIfaces && ifaces_[id].active) {
+    id++;
+  }
+  if (id == kMaxIfaces) {
+    return ZX_ERR_NO_RESOURCES;
+  }
+
+  // Without an address from the caller, derive a locally administered one
+  // from the chip ID and iface id.
+  Iface &iface = ifaces_[id];
+  if (mac) {
+    memcpy(iface.mac, mac, sizeof(iface.mac));
+  } else {
+    const uint8_t mac[] = {0x02,
+                           static_cast<uint8_t>(chip_id_ >> 24),
+                           static_cast<uint8_t>(chip_id_ >> 16),
+                           static_cast<uint8_t>(chip_id_ >> 8),
+                           static_cast<uint8_t>(chip_id_),
+                           static_cast<uint8_t>(id)};
+    memcpy(iface.mac, mac, sizeof(iface.mac));
+  }
+
+  // mm_add_if_req: VIF type, MAC address, P2P.
+  uint8_t param[8];
+  MsgWriter msg(param, sizeof(param));
+  msg.U8(vif_type);
+  msg.Bytes(iface.mac, sizeof(iface.mac));
+  msg.U8(0);
+  zx_status_t status = SendFwMsg(kMmAddIfReq, kTaskMm, param, msg.len());
+  if (status != ZX_OK) {
+    return status;
+  }
+
+  iface.active = true;
+  iface.role = role;
+  *out_iface_id = static_cast<uint16_t>(id);
+  zxlogf(INFO, "aic8800: Added iface %zu - role: %u", id, role);
+  
+  return ZX_OK;
+}
+
+zx_status_t Aic8800::RemoveInterface(uint16_t iface_id) {
+  if (!initialized_) {
+    return ZX_ERR_BAD_STATE;
+  }
+  
+  fbl::AutoLock lock(&cmd_lock_);
+  if (iface_id >= kMaxIfaces || !ifaces_[iface_id].active) {
+    return ZX_ERR_NOT_FOUND;
+  }
+
+  // mm_remove_if_req: VIF instance.
+  const uint8_t param[] = {static_cast<uint8_t>(iface_id)};
+  zx_status_t status =
+      SendFwMsg(kMmRemoveIfReq, kTaskMm, param, sizeof(param));
+  if (status != ZX_OK) {
+    return status;
+  }
+
+  ifaces_[iface_id] = Iface();
+  zxlogf(INFO, "aic8800: Removed iface %u", iface_id);
+  
+  return ZX_OK;
+}
+
+zx_status_t Aic8800::StartBaSession(uint8_t sta_idx, uint8_t tid,
+                                    BaDirection dir, uint16_t ssn,
+                                    uint16_t peer_buf_size,
+                                    uint16_t *out_buf_size) {
+  if (!initialized_) {
+    return ZX_ERR_BAD_STATE;
+  }
+  if (tid > 7 || !out_buf_size) {
+    return ZX_ERR_INVALID_ARGS;
+  }
+
+  fbl::AutoLock lock(&cmd_lock_);
+  BaSession *free_slot = nullptr;
+  for (BaSession &session : ba_sessions_) {
+    if (session.active && session.sta_idx == sta_idx && session.tid == tid &&
+        session.dir == dir) {
+      return ZX_ERR_ALREADY_EXISTS;
+    }
+    if (!session.active && !free_slot) {
+      free_slot = &session;
+    }
+  }
+  if (!free_slot) {
+    return ZX_ERR_NO_RESOURCES;
+  }
+
+  // A buffer size of zero in an ADDBA leaves the choice to the recipient.
+  uint16_t buf_size = peer_buf_size == 0
+                          ? kBaMaxBufSize
+                          : std::min(peer_buf_size, kBaMaxBufSize);
+
+  // mm_ba_add_req: direction, station, TID, buffer size, starting sequence.
+  uint8_t param[6];
+  MsgWriter msg(param, sizeof(param));
+  msg.U8(static_cast<uint8_t>(dir));
+  msg.U8(sta_idx);
+  msg.U8(tid);
+  msg.U8(static_cast<uint8_t>(buf_size));
+  msg.U16(ssn & 0x0FFF);
+  zx_status_t status = SendFwMsg(kMmBaAddReq, kTaskMm, param, msg.len());
+  if (status != ZX_OK) {
+    return status;
+  }
+
+  *free_slot = {true, sta_idx, tid, dir, buf_size};
+  *out_buf_size = buf_size;
+  ba_sessions_started.Add();
+  zxlogf(DEBUG, "aic8800: %s BA session sta %u tid %u, buffer %u",
+         dir == BaDirection::kTx ? "TX" : "RX", sta_idx, tid, buf_size);
+  return ZX_OK;
+}
+
+zx_status_t Aic8800::StopBaSession(uint8_t sta_idx, uint8_t tid,
+                                   BaDirection dir) {
+  if (!initialized_) {
+    return ZX_ERR_BAD_STATE;
+  }
+
+  fbl::AutoLock lock(&cmd_lock_);
+  for (BaSession &session : ba_sessions_) {
+    if (!session.active || session.sta_idx != sta_idx ||
+        session.tid != tid || session.dir != dir) {
+      continue;
+    }
+
+    // mm_ba_del_req: direction, station, TID.
+    const uint8_t param[] = {static_cast<uint8_t>(dir), sta_idx, tid};
+    zx_status_t status = SendFwMsg(kMmBaDelReq, kTaskMm, param, sizeof(param));
+    if (status != ZX_OK) {
+      return status;
+    }
+    session = BaSession();
+    return ZX_OK;
+  }
+  return ZX_ERR_NOT_FOUND;
+}
+
 zx_status_t Aic8800::WlanphyImplSetCountry(const wlanphy_country_t *country) {
   if (!initialized_) {
     return ZX_ERR_BAD_STATE;
@@ -468,9 +2086,23 @@ zx_status_t Aic8800::WlanphyImplSetCountry(const wlanphy_country_t *country) {
     return ZX_ERR_INVALID_ARGS;
   }
   
-  zxlogf(INFO, "aic8800: SetCountry requested - code: %.2s", country->alpha2);
+  size_t domain;
+  if (!FindRegDomain(country->alpha2, &domain)) {
+    zxlogf(WARNING, "aic8800: No regulatory rules for country %.2s",
+           reinterpret_cast<const char *>(country->alpha2));
+    return ZX_ERR_NOT_SUPPORTED;
+  }
+
+  fbl::AutoLock lock(&cmd_lock_);
+  zx_status_t status = SendChanConfig(domain);
+  if (status != ZX_OK) {
+    return status;
+  }
+  reg_domain_ = domain;
+  zxlogf(INFO, "aic8800: Country set to %.2s",
+         reinterpret_cast<const char *>(country->alpha2));
   
-  return ZX_ERR_NOT_SUPPORTED;
+  return ZX_OK;
 }
 
 zx_status_t Aic8800::WlanphyImplClearCountry() {
@@ -478,9 +2110,15 @@ zx_status_t Aic8800::WlanphyImplClearCountry() {
     return ZX_ERR_BAD_STATE;
   }
   
-  zxlogf(INFO, "aic8800: ClearCountry requested");
+  fbl::AutoLock lock(&cmd_lock_);
+  zx_status_t status = SendChanConfig(0);
+  if (status != ZX_OK) {
+    return status;
+  }
+  reg_domain_ = 0;
+  zxlogf(INFO, "aic8800: Country cleared, using world domain");
   
-  return ZX_ERR_NOT_SUPPORTED;
+  return ZX_OK;
 }
 
 zx_status_t Aic8800::WlanphyImplGetCountry(wlanphy_country_t *out_country) {
@@ -492,9 +2130,11 @@ zx_status_t Aic8800::WlanphyImplGetCountry(wlanphy_country_t *out_country) {
     return ZX_ERR_INVALID_ARGS;
   }
   
-  zxlogf(INFO, "aic8800: GetCountry requested");
+  fbl::AutoLock lock(&cmd_lock_);
+  memcpy(out_country->alpha2, kRegDomains[reg_domain_].alpha2,
+         sizeof(out_country->alpha2));
   
-  return ZX_ERR_NOT_SUPPORTED;
+  return ZX_OK;
 }
 
 static constexpr zx_driver_ops_t aic8800_driver_ops = []() {
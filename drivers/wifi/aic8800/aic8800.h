@@ -3,15 +3,87 @@
 
 #include <ddktl/device.h>
 #include <ddktl/protocol/wlanphyimpl.h>
+#include <fbl/condition_variable.h>
+#include <fbl/mutex.h>
+#include <fuchsia/hardware/gpio/cpp/banjo.h>
 #include <fuchsia/hardware/sdio/cpp/banjo.h>
 #include <lib/ddk/device.h>
 #include <lib/ddk/driver.h>
+#include <lib/inspect/cpp/inspect.h>
+#include <lib/zx/channel.h>
+#include <lib/zx/interrupt.h>
+#include <lib/zx/port.h>
+#include <lib/zx/time.h>
+#include <lib/zx/vmo.h>
+#include <threads.h>
+
+#include <atomic>
+#include <cstdint>
+#include <optional>
 
 #include "../../common/soliloquy_hal/firmware.h"
+#include "../../common/soliloquy_hal/lz4_frame.h"
+#include "../../common/soliloquy_hal/metrics.h"
 #include "../../common/soliloquy_hal/sdio.h"
 
 namespace aic8800 {
 
+// A received frame, pointing into the driver's RX buffer pool. Only valid for
+// the duration of the RxBatchHandler call that delivers it.
+struct RxFrame {
+  const uint8_t *data;
+  size_t len;
+};
+
+struct RxBatchHandler {
+  void (*deliver)(void *ctx, const RxFrame *frames, size_t count);
+  void *ctx;
+};
+
+// WMM access categories, numbered by ACI.
+enum class WmmAc : uint8_t { kBestEffort, kBackground, kVideo, kVoice };
+constexpr size_t kNumWmmAc = 4;
+
+// The 802.1D user priority (TID 0-7) to access category mapping of
+// IEEE 802.11-2016 Table 10-1.
+constexpr WmmAc WmmAcForPriority(uint8_t priority) {
+  switch (priority & 7) {
+  case 1:
+  case 2:
+    return WmmAc::kBackground;
+  case 4:
+  case 5:
+    return WmmAc::kVideo;
+  case 6:
+  case 7:
+    return WmmAc::kVoice;
+  default:
+    return WmmAc::kBestEffort;
+  }
+}
+
+enum class BaDirection : uint8_t { kTx, kRx };
+
+// Written to chip RAM once the firmware is up, so a later bind (driver
+// restart or resume) can tell that the same image is still running. |check|
+// guards against RAM that merely happens to hold the magic.
+struct ResidentMarker {
+  uint32_t magic;
+  uint32_t digest;
+  uint32_t size;
+  uint32_t check;
+
+  static constexpr uint32_t kMagic = 0x4D524157; // "WARM"
+
+  static ResidentMarker For(uint32_t digest, uint32_t size) {
+    return {kMagic, digest, size, ~(kMagic ^ digest ^ size)};
+  }
+  bool Matches(uint32_t digest, uint32_t size) const {
+    return magic == kMagic && this->digest == digest && this->size == size &&
+           check == ~(magic ^ digest ^ size);
+  }
+};
+
 class Aic8800;
 using Aic8800Type = ddk::Device<Aic8800, ddk::Initializable, ddk::Unbindable>;
 
@@ -37,22 +109,325 @@ public:
   zx_status_t WlanphyImplClearCountry();
   zx_status_t WlanphyImplGetCountry(wlanphy_country_t *out_country);
 
+  // Copies |frame| into the current TX aggregate of access category |ac|.
+  // The aggregate goes out as one SDIO burst when it fills (bytes, frame
+  // count or available credits), or once its oldest frame has waited the
+  // category's flush deadline. Returns ZX_ERR_SHOULD_WAIT while both of the
+  // category's aggregation buffers are busy.
+  zx_status_t QueueTxFrame(const uint8_t *frame, size_t len,
+                           WmmAc ac = WmmAc::kBestEffort);
+  // Sets the flush deadline of every access category, or of just |ac|.
+  void SetTxFlushDeadline(zx::duration deadline);
+  void SetTxFlushDeadline(WmmAc ac, zx::duration deadline);
+
+  // Packs small Ethernet frames queued back to back for the same source and
+  // destination into one A-MSDU. On by default; voice is never packed.
+  void SetTxAmsdu(bool enable);
+
+  // Registers a firmware VIF for |role| (WLAN_MAC_ROLE_CLIENT or _AP), up to
+  // two at a time, with |mac| or, if null, a locally administered address
+  // derived from the chip ID. WlanphyImplCreateIface does not use this yet:
+  // it needs an interface device serving the SME channel first.
+  zx_status_t AddInterface(uint16_t role, const uint8_t *mac,
+                           uint16_t *out_iface_id);
+  zx_status_t RemoveInterface(uint16_t iface_id);
+
+  // Block-ack sessions, which let the firmware aggregate TX into A-MPDUs
+  // (kTx) or reorder an incoming A-MPDU stream (kRx) for |tid| of station
+  // |sta_idx|. |peer_buf_size| is the buffer size from the peer's ADDBA;
+  // the session uses the smaller of it and the chip's, returned in
+  // |out_buf_size| for the ADDBA response. Nothing calls these yet: the
+  // driver has no association or ADDBA handling to call them from, so they
+  // wait on the same interface device as AddInterface().
+  zx_status_t StartBaSession(uint8_t sta_idx, uint8_t tid, BaDirection dir,
+                             uint16_t ssn, uint16_t peer_buf_size,
+                             uint16_t *out_buf_size);
+  zx_status_t StopBaSession(uint8_t sta_idx, uint8_t tid, BaDirection dir);
+
+  // Frames received on each RX interrupt are handed to |handler| in one call.
+  void SetRxHandler(const RxBatchHandler &handler);
+
+  // Lets the chip sleep once the bus has been idle for |idle|. It is woken
+  // for TX or firmware messages, and by the host-wake line when it has
+  // frames or events for the host. Power save needs a "gpio-wake" fragment,
+  // since a sleeping chip cannot raise the SDIO interrupt; without one, or
+  // with zx::duration::infinite(), the chip stays awake.
+  void SetPowerSaveIdle(zx::duration idle);
+
 private:
+  // DdkInit hands the InitTxn to an init thread so chip bring-up doesn't
+  // hold the driver host while other devices are still initializing.
+  int InitThread();
   zx_status_t InitHw();
   zx_status_t ReadChipId(uint32_t *out_chip_id);
-  zx_status_t WaitForFirmwareReady();
+  // Downloads a raw or LZ4-framed main firmware image.
+  zx_status_t DownloadFirmwareImage(const zx::vmo &fw_vmo, size_t fw_size);
+  // Polls the firmware status, starting at kFwReadyMinPoll and backing off
+  // to kFwReadyMaxPoll, so a quick boot is seen within a millisecond or two.
+  zx_status_t WaitForFirmwareReady(zx::duration timeout);
   zx_status_t ResetChip();
+  zx_status_t DetectChip();
+
+  // Reads the resident marker and resets the chip unless it holds one.
+  zx_status_t PrepareChip(ResidentMarker *out_resident);
+  // Warm restart: if |resident| matches the image about to be downloaded
+  // and the firmware still reports ready, wakes the chip and clears stale
+  // interrupt state instead of resetting it. Returns ZX_ERR_NOT_FOUND when a
+  // cold start is needed.
+  zx_status_t TryWarmStart(const ResidentMarker &resident,
+                           const ResidentMarker &expected);
+  zx_status_t ReadResidentMarker(ResidentMarker *out_marker);
+  zx_status_t WriteResidentMarker(const ResidentMarker &marker);
+  static zx_status_t DigestFirmware(const zx::vmo &fw_vmo, size_t fw_size,
+                                    uint32_t *out_digest);
   zx_status_t ConfigurePatchTables();
+  zx_status_t SetupDmaBuffers();
+  void ReleaseDmaBuffers();
+
+  // Sends one LMAC message to the firmware as a config frame on the data
+  // port. cmd_lock_ serializes use of the command buffer; messages take TX
+  // credits like data bursts. Confirmations come back on the RX path and
+  // are not waited for.
+  zx_status_t SendFwMsg(uint16_t id, uint16_t dest_task, const uint8_t *param,
+                        size_t param_len) __TA_REQUIRES(cmd_lock_);
+  // ME_CONFIG_REQ: the HT/VHT capabilities and widest channel the firmware
+  // may use, matching what WlanphyImplQuery reports.
+  zx_status_t SendMeConfig() __TA_REQUIRES(cmd_lock_);
+  // ME_CHAN_CONFIG_REQ: every channel the hardware supports, with its power
+  // limit and flags under regulatory domain |domain|.
+  zx_status_t SendChanConfig(size_t domain) __TA_REQUIRES(cmd_lock_);
+
+  // The IRQ thread services the SDIO card interrupt: TX-done events refresh
+  // the cached TX credit count, so senders never poll kRegFlowCtrl.
+  zx_status_t StartIrqThread();
+  void StopIrqThread();
+  int IrqThread();
+  zx_status_t HandleInterrupt();
+  zx_status_t ReadIntStatus(uint32_t *out_status);
+  zx_status_t AckIntStatus(uint32_t status);
+  zx_status_t RefreshTxCredits();
+  zx_status_t AcquireTxCredits(uint8_t required);
+  // With |keep_reserve|, fails rather than dip into the credits held back
+  // for voice and video.
+  bool TryAcquireTxCredits(uint8_t required, bool keep_reserve = false);
+  // Called once a burst that took |count| credits has left the bus.
+  void ReleaseTxCredits(uint8_t count);
+  uint8_t TxReservedCreditsLocked() const __TA_REQUIRES(credit_lock_);
+  void KickIrqThread();
+
+  // Every path that touches the bus once the driver is up holds a
+  // ScopedAwake, which wakes the chip first if it is asleep. The IRQ thread
+  // puts the chip to sleep after none has been held for ps_idle_.
+  class ScopedAwake {
+  public:
+    explicit ScopedAwake(Aic8800 *dev)
+        : dev_(dev), status_(dev->AcquireAwake()) {}
+    ~ScopedAwake() {
+      if (status_ == ZX_OK) {
+        dev_->ReleaseAwake();
+      }
+    }
+    zx_status_t status() const { return status_; }
+
+  private:
+    Aic8800 *const dev_;
+    const zx_status_t status_;
+  };
+  zx_status_t AcquireAwake();
+  void ReleaseAwake();
+  // Clears the sleep permission, triggers kRegWakeup and polls until the
+  // chip reports itself awake. Returns how long that took.
+  zx_status_t WakeChip(zx::duration timeout, zx::duration *out_latency);
+  zx_status_t SetupHostWake();
+  // Runs on the IRQ thread.
+  zx::time NextSleepDeadline();
+  void MaybeSleep();
+
+  // Runs on the IRQ thread: closes aggregates whose deadline has passed and
+  // sends ready aggregates that the cached credits can cover, voice first.
+  void ServiceTx();
+  zx::time NextTxDeadline(bool *out_credit_stall);
+
+  // Runs on the IRQ thread: reads every frame the chip has pending into the
+  // RX pool and delivers them as batches of up to kRxPoolSlots.
+  zx_status_t DrainRx();
   
-  zx_status_t SdioTx(const uint8_t *buf, size_t len, uint8_t func_num);
-  zx_status_t SdioRx(uint8_t *buf, size_t len, uint8_t func_num);
-  zx_status_t SdioFlowControl(uint8_t *out_available_buffers);
+  // Reads |len| bytes into rx_buf_ at |offset|.
+  zx_status_t SdioRx(size_t offset, size_t len, uint8_t func_num);
 
   ddk::SdioProtocolClient sdio_;
   soliloquy_hal::SdioHelper sdio_helper_;
   
   uint32_t chip_id_ = 0;
-  bool initialized_ = false;
+  // Read by the WLAN PHY, TX and IRQ paths; set once InitHw completes.
+  std::atomic<bool> initialized_ = false;
+
+  inspect::Inspector inspector_;
+
+  std::optional<ddk::InitTxn> init_txn_;
+  thrd_t init_thread_;
+  bool init_thread_started_ = false;
+
+  // TX/RX staging buffers. Both VMOs are registered with the SDIO controller
+  // (pinned against the SDIO BTI) and mapped once at init, so the data path
+  // never maps or copies per frame.
+  uint8_t *tx_buf_ = nullptr;
+  uint8_t *rx_buf_ = nullptr;
+  uint8_t *cmd_buf_ = nullptr;
+  bool dma_registered_ = false;
+
+  zx::interrupt sdio_irq_;
+  zx::port irq_port_;
+  thrd_t irq_thread_;
+  bool irq_thread_started_ = false;
+
+  fbl::Mutex credit_lock_;
+  fbl::ConditionVariable credit_cv_;
+  uint8_t tx_credits_ __TA_GUARDED(credit_lock_) = 0;
+  // Taken by bursts that have not finished crossing the bus, which the
+  // chip's flow control register does not account for yet.
+  uint8_t tx_credits_in_flight_ __TA_GUARDED(credit_lock_) = 0;
+  // The most credits ever reported, taken as the size of the chip's pool.
+  uint8_t tx_credit_pool_ __TA_GUARDED(credit_lock_) = 0;
+  bool stopping_ __TA_GUARDED(credit_lock_) = false;
+
+  // The TX VMO is split into two aggregation buffers per access category so
+  // producers can fill one while the IRQ thread sends the other, and a voice
+  // frame never queues behind a bulk aggregate that is still filling.
+  enum class TxAggState { kIdle, kFilling, kReady, kSending };
+  static constexpr size_t kNoAmsdu = SIZE_MAX;
+  struct TxAggregate {
+    size_t base;
+    size_t len = 0;
+    // Frames as queued, and the descriptors carrying them.
+    size_t frames = 0;
+    size_t descs = 0;
+    zx::time first_queued;
+    TxAggState state = TxAggState::kIdle;
+    // The A-MSDU that closes the aggregate, which later small frames with
+    // the same addresses can join: its descriptor's offset from |base|, or
+    // kNoAmsdu, and the length of its subframes.
+    size_t amsdu_off = kNoAmsdu;
+    size_t amsdu_len = 0;
+    size_t amsdu_subframes = 0;
+    uint8_t amsdu_addrs[12] = {};
+  };
+  struct TxQueue {
+    TxAggregate agg[2];
+    size_t fill = 0;
+    zx::duration flush_deadline;
+    // Frames in either aggregate that have not yet gone out.
+    size_t depth = 0;
+  };
+
+  // Picks the aggregate ServiceTx sends next, or null if none is ready.
+  TxAggregate *NextTxAggregateLocked(zx::time now, WmmAc *out_ac)
+      __TA_REQUIRES(tx_lock_);
+
+  fbl::Mutex tx_lock_;
+  TxQueue tx_queues_[kNumWmmAc] __TA_GUARDED(tx_lock_);
+  bool tx_amsdu_ __TA_GUARDED(tx_lock_) = true;
+
+  fbl::Mutex rx_lock_;
+  RxBatchHandler rx_handler_ __TA_GUARDED(rx_lock_) = {};
+
+  ddk::GpioProtocolClient host_wake_;
+  zx::interrupt host_wake_irq_;
+
+  fbl::Mutex power_lock_;
+  // Set once init completes with a host-wake line bound.
+  bool ps_enabled_ __TA_GUARDED(power_lock_) = false;
+  zx::duration ps_idle_ __TA_GUARDED(power_lock_) = kPsIdleDefault;
+  bool asleep_ __TA_GUARDED(power_lock_) = false;
+  // A thread is waking the chip with power_lock_ dropped; others wait on
+  // power_cv_ rather than start a second wake.
+  bool waking_ __TA_GUARDED(power_lock_) = false;
+  fbl::ConditionVariable power_cv_;
+  size_t awake_refs_ __TA_GUARDED(power_lock_) = 0;
+  zx::time last_bus_use_ __TA_GUARDED(power_lock_);
+  zx::time slept_at_ __TA_GUARDED(power_lock_);
+
+  fbl::Mutex cmd_lock_;
+  // Index into the regulatory table; 0 is the conservative world domain
+  // used until SetCountry.
+  size_t reg_domain_ __TA_GUARDED(cmd_lock_) = 0;
+
+  // Interfaces registered with the firmware by AddInterface. The index is the
+  // iface id and is taken to be the firmware's VIF instance too, since
+  // MM_ADD_IF_CFM is not parsed yet.
+  struct Iface {
+    bool active = false;
+    uint16_t role = 0;
+    uint8_t mac[6] = {};
+  };
+  static constexpr size_t kMaxIfaces = 2;
+  Iface ifaces_[kMaxIfaces] __TA_GUARDED(cmd_lock_);
+
+  struct BaSession {
+    bool active = false;
+    uint8_t sta_idx = 0;
+    uint8_t tid = 0;
+    BaDirection dir = BaDirection::kTx;
+    uint16_t buf_size = 0;
+  };
+  static constexpr size_t kMaxBaSessions = 16;
+  BaSession ba_sessions_[kMaxBaSessions] __TA_GUARDED(cmd_lock_);
+
+  static constexpr uint64_t kPortKeyIrq = 1;
+  static constexpr uint64_t kPortKeyStop = 2;
+  static constexpr uint64_t kPortKeyTxKick = 3;
+  static constexpr uint64_t kPortKeyHostWake = 4;
+
+  // SDIO function carrying TX and RX data frames.
+  static constexpr uint8_t kDataFuncNum = 1;
+
+  static constexpr uint32_t kTxVmoId = 1;
+  static constexpr uint32_t kRxVmoId = 2;
+  static constexpr uint32_t kCmdVmoId = 3;
+  static constexpr size_t kDmaBufferSize = 64 * 1024;
+  // Holds one LMAC message; the largest, ME_CHAN_CONFIG_REQ, fits in a
+  // single block.
+  static constexpr size_t kCmdBufferSize = 1024;
+
+  // Each aggregated frame is preceded by the chip's TX descriptor (LE16
+  // length, type, reserved) and padded to 4 bytes.
+  static constexpr size_t kTxHdrSize = 4;
+  static constexpr size_t kTxFrameAlign = 4;
+  static constexpr uint8_t kTxTypeData = 0x00;
+  static constexpr uint8_t kTxTypeCfg = 0x11;
+  // Descriptor flags, in the byte after the type.
+  static constexpr uint8_t kTxFlagAmsdu = 1 << 0;
+  // Ethernet frames up to this size are packed into A-MSDUs, up to
+  // kAmsduMaxSubframes of them within one chip buffer.
+  static constexpr size_t kAmsduMaxFrame = 256;
+  static constexpr size_t kAmsduMaxSubframes = 16;
+  // Reorder and aggregation window, matching the 64K maximum A-MPDU length
+  // advertised in the HT capabilities.
+  static constexpr uint16_t kBaMaxBufSize = 64;
+  // LMAC message header: LE16 id, destination task, source task, length.
+  static constexpr size_t kLmacHdrSize = 8;
+  static constexpr size_t kTxAggMaxSize = 16 * 1024;
+  static constexpr size_t kTxAggMaxFrames = 32;
+  static constexpr size_t kTxBufferSize = kNumWmmAc * 2 * kTxAggMaxSize;
+  // Default flush deadlines, indexed by WmmAc. Voice goes out as soon as
+  // the IRQ thread sees it.
+  static constexpr int64_t kTxFlushDeadlineUs[kNumWmmAc] = {500, 2000, 100,
+                                                             0};
+  // An aggregate whose oldest frame has waited this long is sent ahead of
+  // higher categories, so background traffic still drains under a constant
+  // voice load.
+  static constexpr zx::duration kTxMaxStarve = zx::msec(20);
+  // Best effort and background may not take the last credits of the pool,
+  // so a voice or video burst finds chip buffers free without waiting for a
+  // TX-done. Capped at a quarter of the pool for chips with few buffers.
+  static constexpr uint8_t kTxReservedCredits = 8;
+
+  // The RX VMO is carved into fixed, block-aligned slots that are posted
+  // once at init and reused for every batch.
+  static constexpr size_t kRxSlotSize = 2048;
+  static constexpr size_t kRxPoolSlots = kDmaBufferSize / kRxSlotSize;
+  // kRegByteModeLen reports the pending frame length in 4-byte words.
+  static constexpr size_t kRxLenUnit = 4;
 
   static constexpr uint32_t kVendorId = 0xA5C8;
   static constexpr uint32_t kDeviceId = 0x8800;
@@ -80,7 +455,9 @@ private:
   static constexpr uint8_t kRegFlowCtrl = 0x0A;
   
   static constexpr uint8_t kFlowCtrlMask = 0x7F;
-  static constexpr uint32_t kFlowCtrlRetryCount = 50;
+  // Upper bound on a TX waiting for credits before kRegFlowCtrl is re-read
+  // directly, in case a TX-done interrupt was lost.
+  static constexpr int kTxCreditTimeoutMs = 120;
   static constexpr uint32_t kBufferSize = 1536;
   
   static constexpr uint32_t kIntFwReady = 1 << 0;
@@ -106,11 +483,30 @@ private:
   
   static constexpr size_t kBlockSize = 512;
   static constexpr int kFwReadyTimeoutMs = 5000;
+  static constexpr zx::duration kFwReadyMinPoll = zx::msec(1);
+  static constexpr zx::duration kFwReadyMaxPoll = zx::msec(50);
+  // A resident firmware that is awake answers almost at once; one that was
+  // asleep needs a few milliseconds after kRegWakeup.
+  static constexpr zx::duration kWarmReadyTimeout = zx::msec(50);
+  static constexpr uint8_t kWakeupTrigger = 0x01;
+  // kRegSleepCtrl reads back the chip's power state.
+  static constexpr uint8_t kSleepCtrlAwake = 1 << 0;
+  // Long enough to ride out a burst of traffic with short gaps, short
+  // enough that an idle link spends nearly all its time asleep.
+  static constexpr zx::duration kPsIdleDefault = zx::msec(100);
+  // A sleeping chip is back within a couple of milliseconds; the awake bit
+  // is polled often so the TX that triggered the wake isn't held up.
+  static constexpr zx::duration kWakeTimeout = zx::msec(20);
+  static constexpr zx::duration kWakePollInterval = zx::usec(20);
   
   static constexpr uint32_t kRamFmacFwAddrU02 = 0x00120000;
   static constexpr uint32_t kPatchMagicNum = 0x48435450;
   static constexpr uint32_t kPatchMagicNum2 = 0x50544348;
   static constexpr uint32_t kPatchStartAddr = 0x001D7000;
+  // Spare words at the end of the patch area. The firmware never touches
+  // them and a chip reset clears them, so they outlive a driver restart or
+  // sleep but not a power cycle.
+  static constexpr uint32_t kResidentMarkerAddr = 0x001D7FF0;
   
   struct PatchEntry {
     uint32_t offset;
@@ -0,0 +1,564 @@
+#include "fake_aic8800_chip.h"
+
+#include <lib/zx/clock.h>
+
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+namespace aic8800 {
+namespace testing {
+
+namespace {
+
+// Byte-wide control registers, reached with CMD52.
+constexpr uint32_t kRegByteModeLen = 0x02;
+constexpr uint32_t kRegSleepCtrl = 0x05;
+constexpr uint32_t kRegFwStatus = 0x08;
+constexpr uint32_t kRegWakeup = 0x09;
+constexpr uint32_t kRegFlowCtrl = 0x0A;
+constexpr uint32_t kRegHostCtrl = 0x0C;
+constexpr uint32_t kRegIntStatus = 0x10;
+constexpr uint32_t kRegIntMask = 0x14;
+constexpr uint32_t kRegRxReady = 0x1C;
+
+// 32-bit register file, reached with CMD53.
+constexpr uint32_t kRegChipId = 0x00;
+constexpr uint32_t kRegChipRev = 0x04;
+constexpr uint32_t kChipRev = 0x03;
+
+constexpr uint8_t kHostCtrlReset = 1 << 0;
+constexpr uint8_t kHostCtrlSleep = 1 << 2;
+constexpr uint8_t kWakeupTrigger = 0x01;
+constexpr uint8_t kSleepCtrlAwake = 1 << 0;
+constexpr uint32_t kIntTxDone = 1 << 1;
+constexpr uint32_t kIntRxReady = 1 << 2;
+
+constexpr uint8_t kFwStatusIdle = 0;
+constexpr uint8_t kFwStatusDownloading = 1;
+constexpr uint8_t kFwStatusReady = 2;
+
+constexpr uint8_t kFlowCtrlMask = 0x7F;
+constexpr size_t kTxHdrSize = 4;
+constexpr uint8_t kTxTypeData = 0x00;
+constexpr uint8_t kTxTypeCfg = 0x11;
+constexpr uint8_t kTxFlagAmsdu = 1 << 0;
+// A-MSDU subframe header (DA, SA, BE16 length) and the LLC/SNAP header that
+// replaced the EtherType.
+constexpr size_t kAmsduSubHdrSize = 14;
+constexpr size_t kLlcSnapSize = 8;
+// LMAC message header: LE16 id, destination task, source task, length.
+constexpr size_t kLmacHdrSize = 8;
+constexpr size_t kRxLenUnit = 4;
+
+// Scratch RAM the generated image's config and patch pointers refer to,
+// clear of the fmac region and the patch area.
+constexpr uint32_t kImageConfigBase = 0x001E0000;
+constexpr uint32_t kImagePatchStrBase = 0x001E1000;
+
+void PutLe32(uint8_t *dst, uint32_t val) {
+  dst[0] = val & 0xFF;
+  dst[1] = (val >> 8) & 0xFF;
+  dst[2] = (val >> 16) & 0xFF;
+  dst[3] = (val >> 24) & 0xFF;
+}
+
+} // namespace
+
+FakeAic8800Chip::FakeAic8800Chip(soliloquy_hal::testing::FakeSdioBus *bus)
+    : bus_(bus), gpio_proto_{&gpio_protocol_ops_, this} {
+  bus_->set_device(this);
+}
+
+FakeAic8800Chip::~FakeAic8800Chip() { bus_->set_device(nullptr); }
+
+std::vector<uint8_t> FakeAic8800Chip::MakeFirmwareImage(size_t size) {
+  std::vector<uint8_t> image(std::max<size_t>(size, 0x1A4));
+  // Not all zeroes, so compressed and raw downloads cost what they would.
+  uint32_t x = 0x2545F491;
+  for (auto &b : image) {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    b = static_cast<uint8_t>(x);
+  }
+  PutLe32(&image[0x198], kImageConfigBase);
+  PutLe32(&image[0x1A0], kImagePatchStrBase);
+  return image;
+}
+
+void FakeAic8800Chip::set_boot_delay(zx::duration delay) {
+  fbl::AutoLock lock(&lock_);
+  boot_delay_ = delay;
+}
+
+void FakeAic8800Chip::set_wake_delay(zx::duration delay) {
+  fbl::AutoLock lock(&lock_);
+  wake_delay_ = delay;
+}
+
+void FakeAic8800Chip::set_tx_buffers(uint8_t count) {
+  fbl::AutoLock lock(&lock_);
+  tx_buffers_ = count & kFlowCtrlMask;
+}
+
+void FakeAic8800Chip::PowerCycle() {
+  fbl::AutoLock lock(&lock_);
+  ResetLocked();
+  host_ctrl_ = 0;
+}
+
+void FakeAic8800Chip::ResetLocked() {
+  ram_.Clear();
+  marker_incr_.reset();
+  fw_written_ = false;
+  asleep_ = false;
+  wake_at_ = zx::time::infinite();
+  int_status_ = 0;
+  int_mask_ = 0;
+  rx_queue_.clear();
+}
+
+bool FakeAic8800Chip::firmware_running() const {
+  fbl::AutoLock lock(&lock_);
+  return FwStatusLocked() == kFwStatusReady;
+}
+
+uint64_t FakeAic8800Chip::tx_frames() const {
+  fbl::AutoLock lock(&lock_);
+  return tx_frames_;
+}
+
+uint64_t FakeAic8800Chip::tx_bytes() const {
+  fbl::AutoLock lock(&lock_);
+  return tx_bytes_;
+}
+
+uint64_t FakeAic8800Chip::tx_bursts() const {
+  fbl::AutoLock lock(&lock_);
+  return tx_bursts_;
+}
+
+uint64_t FakeAic8800Chip::tx_amsdus() const {
+  fbl::AutoLock lock(&lock_);
+  return tx_amsdus_;
+}
+
+uint64_t FakeAic8800Chip::cfg_msgs() const {
+  fbl::AutoLock lock(&lock_);
+  return cfg_msgs_;
+}
+
+std::vector<uint8_t> FakeAic8800Chip::last_cfg_msg(uint16_t id) const {
+  fbl::AutoLock lock(&lock_);
+  auto it = cfg_params_.find(id);
+  return it == cfg_params_.end() ? std::vector<uint8_t>() : it->second;
+}
+
+bool FakeAic8800Chip::asleep() const {
+  fbl::AutoLock lock(&lock_);
+  return asleep_;
+}
+
+uint64_t FakeAic8800Chip::sleeps() const {
+  fbl::AutoLock lock(&lock_);
+  return sleeps_;
+}
+
+uint64_t FakeAic8800Chip::wakes() const {
+  fbl::AutoLock lock(&lock_);
+  return wakes_;
+}
+
+zx_status_t FakeAic8800Chip::WaitForSleeps(uint64_t count,
+                                           zx::duration timeout) {
+  zx::time deadline = zx::deadline_after(timeout);
+  fbl::AutoLock lock(&lock_);
+  while (sleeps_ < count) {
+    zx::time now = zx::clock::get_monotonic();
+    if (now >= deadline) {
+      return ZX_ERR_TIMED_OUT;
+    }
+    sleep_cv_.Timedwait(&lock_, (deadline - now).get());
+  }
+  return ZX_OK;
+}
+
+zx_status_t FakeAic8800Chip::WaitForTxFrames(uint64_t count,
+                                             zx::duration timeout) {
+  zx::time deadline = zx::deadline_after(timeout);
+  fbl::AutoLock lock(&lock_);
+  while (tx_frames_ < count) {
+    zx::time now = zx::clock::get_monotonic();
+    if (now >= deadline) {
+      return ZX_ERR_TIMED_OUT;
+    }
+    tx_cv_.Timedwait(&lock_, (deadline - now).get());
+  }
+  return ZX_OK;
+}
+
+zx_status_t FakeAic8800Chip::InjectRxFrame(const uint8_t *data, size_t len) {
+  if (!data || len == 0 || len > kMaxRxFrame) {
+    return ZX_ERR_INVALID_ARGS;
+  }
+  fbl::AutoLock lock(&lock_);
+  rx_queue_.emplace_back(data, data + len);
+  int_status_ |= kIntRxReady;
+  UpdateIrqLocked();
+  return ZX_OK;
+}
+
+size_t FakeAic8800Chip::rx_pending() const {
+  fbl::AutoLock lock(&lock_);
+  return rx_queue_.size();
+}
+
+uint8_t FakeAic8800Chip::FwStatusLocked() const {
+  if ((host_ctrl_ & kHostCtrlReset) || !fw_written_) {
+    return kFwStatusIdle;
+  }
+  if (zx::clock::get_monotonic() < fw_last_write_ + boot_delay_) {
+    return kFwStatusDownloading;
+  }
+  return kFwStatusReady;
+}
+
+bool FakeAic8800Chip::AwakeLocked() {
+  if (asleep_ && zx::clock::get_monotonic() >= wake_at_) {
+    asleep_ = false;
+    wake_at_ = zx::time::infinite();
+    wakes_++;
+  }
+  return !asleep_;
+}
+
+void FakeAic8800Chip::UpdateIrqLocked() {
+  if (!(int_status_ & int_mask_)) {
+    return;
+  }
+  if (AwakeLocked()) {
+    bus_->TriggerInterrupt();
+  } else if (wake_at_ == zx::time::infinite() && host_wake_irq_.is_valid()) {
+    host_wake_irq_.trigger(0, zx::clock::get_monotonic());
+  }
+}
+
+bool FakeAic8800Chip::InterruptAsserted() {
+  fbl::AutoLock lock(&lock_);
+  return AwakeLocked() && (int_status_ & int_mask_) != 0;
+}
+
+zx_status_t FakeAic8800Chip::ReadByte(uint32_t addr, uint8_t *out_val) {
+  fbl::AutoLock lock(&lock_);
+  if (addr >= kMemoryBase) {
+    return ram_.ReadByte(addr, out_val);
+  }
+
+  switch (addr) {
+  case kRegByteModeLen:
+    *out_val = rx_queue_.empty()
+                   ? 0
+                   : static_cast<uint8_t>(
+                         (rx_queue_.front().size() + kRxLenUnit - 1) /
+                         kRxLenUnit);
+    break;
+  case kRegFwStatus:
+    *out_val = FwStatusLocked();
+    break;
+  case kRegSleepCtrl:
+    *out_val = AwakeLocked() ? kSleepCtrlAwake : 0;
+    break;
+  case kRegFlowCtrl:
+    *out_val = tx_buffers_ & kFlowCtrlMask;
+    break;
+  case kRegHostCtrl:
+    *out_val = host_ctrl_;
+    break;
+  case kRegRxReady:
+    *out_val = static_cast<uint8_t>(std::min<size_t>(rx_queue_.size(), 255));
+    break;
+  case kRegIntStatus:
+  case kRegIntStatus + 1:
+  case kRegIntStatus + 2:
+  case kRegIntStatus + 3:
+    *out_val = static_cast<uint8_t>(int_status_ >> (8 * (addr & 3)));
+    break;
+  case kRegIntMask:
+  case kRegIntMask + 1:
+  case kRegIntMask + 2:
+  case kRegIntMask + 3:
+    *out_val = static_cast<uint8_t>(int_mask_ >> (8 * (addr & 3)));
+    break;
+  default:
+    *out_val = 0;
+    break;
+  }
+  return ZX_OK;
+}
+
+zx_status_t FakeAic8800Chip::WriteByte(uint32_t addr, uint8_t val) {
+  fbl::AutoLock lock(&lock_);
+  if (addr >= kMemoryBase) {
+    return ram_.WriteByte(addr, val);
+  }
+
+  uint32_t shift = 8 * (addr & 3);
+  switch (addr) {
+  case kRegHostCtrl:
+    // Reset holds while the bit is set and wipes RAM, marker included.
+    if (val & kHostCtrlReset) {
+      ResetLocked();
+    }
+    // Events already pending go out on host wake once asleep.
+    if ((val & kHostCtrlSleep) && !(host_ctrl_ & kHostCtrlSleep)) {
+      asleep_ = true;
+      wake_at_ = zx::time::infinite();
+      sleeps_++;
+      sleep_cv_.Broadcast();
+    }
+    host_ctrl_ = val;
+    UpdateIrqLocked();
+    break;
+  case kRegWakeup:
+    if ((val & kWakeupTrigger) && asleep_ && wake_at_ == zx::time::infinite()) {
+      wake_at_ = zx::deadline_after(wake_delay_);
+    }
+    break;
+  case kRegIntStatus:
+  case kRegIntStatus + 1:
+  case kRegIntStatus + 2:
+  case kRegIntStatus + 3:
+    int_status_ &= ~(static_cast<uint32_t>(val) << shift);
+    break;
+  case kRegIntMask:
+  case kRegIntMask + 1:
+  case kRegIntMask + 2:
+  case kRegIntMask + 3:
+    int_mask_ = (int_mask_ & ~(0xFFu << shift)) |
+                (static_cast<uint32_t>(val) << shift);
+    UpdateIrqLocked();
+    break;
+  default:
+    break;
+  }
+  return ZX_OK;
+}
+
+uint32_t FakeAic8800Chip::ReadRegLocked(uint32_t addr) const {
+  switch (addr) {
+  case kRegChipId:
+    return kChipId;
+  case kRegChipRev:
+    return kChipRev;
+  case kRegFwStatus:
+    return FwStatusLocked();
+  case kRegHostCtrl:
+    return host_ctrl_;
+  case kRegIntStatus:
+    return int_status_;
+  case kRegIntMask:
+    return int_mask_;
+  case kRegRxReady:
+    return static_cast<uint32_t>(rx_queue_.size());
+  default:
+    return 0;
+  }
+}
+
+void FakeAic8800Chip::WriteRegLocked(uint32_t addr, uint32_t val) {
+  switch (addr) {
+  case kRegIntStatus:
+    int_status_ &= ~val;
+    break;
+  case kRegIntMask:
+    int_mask_ = val;
+    UpdateIrqLocked();
+    break;
+  default:
+    break;
+  }
+}
+
+bool FakeAic8800Chip::OverlapsMarker(uint32_t addr, size_t len) {
+  uint64_t end = static_cast<uint64_t>(addr) + len;
+  return addr < kResidentMarkerAddr + kResidentMarkerSize &&
+         end > kResidentMarkerAddr;
+}
+
+zx_status_t FakeAic8800Chip::Read(uint32_t addr, uint8_t *buf, size_t len,
+                                  bool incr) {
+  fbl::AutoLock lock(&lock_);
+  if (addr == kDataPort && !incr) {
+    if (!AwakeLocked()) {
+      return ZX_ERR_IO_NOT_PRESENT;
+    }
+    // One frame per read, zero padded to the transfer length.
+    memset(buf, 0, len);
+    if (!rx_queue_.empty()) {
+      const std::vector<uint8_t> &frame = rx_queue_.front();
+      memcpy(buf, frame.data(), std::min(len, frame.size()));
+      rx_queue_.pop_front();
+    }
+    return ZX_OK;
+  }
+  if (addr >= kMemoryBase) {
+    // Read in the other mode, the marker comes back as the wrong bytes on
+    // real hardware; fail loudly instead.
+    if (OverlapsMarker(addr, len) && marker_incr_ && *marker_incr_ != incr) {
+      return ZX_ERR_IO;
+    }
+    return ram_.Read(addr, buf, len, incr);
+  }
+
+  for (size_t i = 0; i < len; i++) {
+    uint32_t a = incr ? addr + static_cast<uint32_t>(i) : addr;
+    buf[i] = static_cast<uint8_t>(ReadRegLocked(a & ~3u) >> (8 * (a & 3)));
+  }
+  return ZX_OK;
+}
+
+zx_status_t FakeAic8800Chip::Write(uint32_t addr, const uint8_t *buf,
+                                   size_t len, bool incr) {
+  fbl::AutoLock lock(&lock_);
+  if (addr == kDataPort && !incr) {
+    if (!AwakeLocked()) {
+      return ZX_ERR_IO_NOT_PRESENT;
+    }
+    ParseTxBurstLocked(buf, len);
+    return ZX_OK;
+  }
+  if (addr >= kMemoryBase) {
+    uint64_t end = static_cast<uint64_t>(addr) + len;
+    if (addr < kFmacBase + kFmacMaxSize && end > kFmacBase) {
+      fw_written_ = true;
+      fw_last_write_ = zx::clock::get_monotonic();
+    }
+    if (OverlapsMarker(addr, len)) {
+      marker_incr_ = incr;
+    }
+    return ram_.Write(addr, buf, len, incr);
+  }
+
+  // The register file only takes whole, aligned words.
+  if (!incr || (addr & 3) != 0 || (len & 3) != 0) {
+    return ZX_ERR_NOT_SUPPORTED;
+  }
+  for (size_t i = 0; i < len; i += 4) {
+    uint32_t val = buf[i] | (buf[i + 1] << 8) | (buf[i + 2] << 16) |
+                   (static_cast<uint32_t>(buf[i + 3]) << 24);
+    WriteRegLocked(addr + static_cast<uint32_t>(i), val);
+  }
+  return ZX_OK;
+}
+
+// An aggregate is a run of descriptors (LE16 length, type, reserved), each
+// followed by its frame padded to 4 bytes, ended by a zero length or the
+// end of the burst. Config descriptors carry an LMAC message instead of a
+// frame. The chip's buffers are all free again by the time the burst
+// completes, so the credit count is unchanged and only TX-done fires.
+void FakeAic8800Chip::ParseTxBurstLocked(const uint8_t *buf, size_t len) {
+  size_t pos = 0;
+  bool data = false;
+  while (pos + kTxHdrSize <= len) {
+    size_t frame_len = buf[pos] | (buf[pos + 1] << 8);
+    if (frame_len == 0 || pos + kTxHdrSize + frame_len > len) {
+      break;
+    }
+    const uint8_t *frame = buf + pos + kTxHdrSize;
+    if (buf[pos + 2] == kTxTypeData && (buf[pos + 3] & kTxFlagAmsdu)) {
+      ParseAmsduLocked(frame, frame_len);
+      data = true;
+    } else if (buf[pos + 2] == kTxTypeData) {
+      tx_frames_++;
+      tx_bytes_ += frame_len;
+      data = true;
+    } else if (buf[pos + 2] == kTxTypeCfg && frame_len >= kLmacHdrSize) {
+      uint16_t id = frame[0] | (frame[1] << 8);
+      size_t param_len = frame[6] | (frame[7] << 8);
+      param_len = std::min(param_len, frame_len - kLmacHdrSize);
+      cfg_msgs_++;
+      cfg_params_[id].assign(frame + kLmacHdrSize,
+                             frame + kLmacHdrSize + param_len);
+    }
+    pos += (kTxHdrSize + frame_len + 3) & ~static_cast<size_t>(3);
+  }
+  if (data) {
+    tx_bursts_++;
+  }
+  int_status_ |= kIntTxDone;
+  tx_cv_.Broadcast();
+  UpdateIrqLocked();
+}
+
+// Each subframe is counted as the Ethernet frame it was built from.
+void FakeAic8800Chip::ParseAmsduLocked(const uint8_t *buf, size_t len) {
+  tx_amsdus_++;
+  size_t pos = 0;
+  while (pos + kAmsduSubHdrSize <= len) {
+    size_t msdu_len = (buf[pos + 12] << 8) | buf[pos + 13];
+    if (msdu_len < kLlcSnapSize || pos + kAmsduSubHdrSize + msdu_len > len) {
+      break;
+    }
+    tx_frames_++;
+    tx_bytes_ += kAmsduSubHdrSize + msdu_len - kLlcSnapSize;
+    pos += (kAmsduSubHdrSize + msdu_len + 3) & ~static_cast<size_t>(3);
+  }
+}
+
+zx_status_t FakeAic8800Chip::GpioConfigIn(uint32_t flags) { return ZX_OK; }
+
+zx_status_t FakeAic8800Chip::GpioConfigOut(uint8_t initial_value) {
+  return ZX_ERR_NOT_SUPPORTED;
+}
+
+zx_status_t FakeAic8800Chip::GpioSetAltFunction(uint64_t function) {
+  return ZX_ERR_NOT_SUPPORTED;
+}
+
+zx_status_t FakeAic8800Chip::GpioRead(uint8_t *out_value) {
+  *out_value = 0;
+  return ZX_OK;
+}
+
+zx_status_t FakeAic8800Chip::GpioWrite(uint8_t value) {
+  return ZX_ERR_NOT_SUPPORTED;
+}
+
+zx_status_t FakeAic8800Chip::GpioGetInterrupt(uint32_t flags,
+                                              zx::interrupt *out_irq) {
+  zx::interrupt irq;
+  zx_status_t status =
+      zx::interrupt::create(zx::resource(), 0, ZX_INTERRUPT_VIRTUAL, &irq);
+  if (status == ZX_OK) {
+    status = irq.duplicate(ZX_RIGHT_SAME_RIGHTS, out_irq);
+  }
+  if (status != ZX_OK) {
+    return status;
+  }
+  fbl::AutoLock lock(&lock_);
+  host_wake_irq_ = std::move(irq);
+  return ZX_OK;
+}
+
+zx_status_t FakeAic8800Chip::GpioReleaseInterrupt() {
+  fbl::AutoLock lock(&lock_);
+  host_wake_irq_.reset();
+  return ZX_OK;
+}
+
+zx_status_t FakeAic8800Chip::GpioSetPolarity(gpio_polarity_t polarity) {
+  return ZX_ERR_NOT_SUPPORTED;
+}
+
+zx_status_t FakeAic8800Chip::GpioSetDriveStrength(uint64_t ds_ua,
+                                                  uint64_t *out_actual_ds_ua) {
+  return ZX_ERR_NOT_SUPPORTED;
+}
+
+zx_status_t FakeAic8800Chip::GpioGetDriveStrength(uint64_t *out_ds_ua) {
+  return ZX_ERR_NOT_SUPPORTED;
+}
+
+} // namespace testing
+} // namespace aic8800
@@ -0,0 +1,176 @@
+#ifndef DRIVERS_WIFI_AIC8800_TESTING_FAKE_AIC8800_CHIP_H_
+#define DRIVERS_WIFI_AIC8800_TESTING_FAKE_AIC8800_CHIP_H_
+
+#include <fbl/condition_variable.h>
+#include <fbl/mutex.h>
+#include <fuchsia/hardware/gpio/cpp/banjo.h>
+#include <lib/zx/interrupt.h>
+#include <lib/zx/time.h>
+
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <optional>
+#include <vector>
+
+#include "../../../common/soliloquy_hal/testing/fake_sdio_bus.h"
+
+namespace aic8800 {
+namespace testing {
+
+// Enough of an AIC8800D behind a FakeSdioBus for the driver's init and data
+// paths to run unmodified:
+//
+//  - CMD52 reaches the byte-wide control registers (firmware status, host
+//    control, interrupt mask, flow control, RX ready/length); CMD53 below
+//    kMemoryBase reaches the 32-bit register file (chip ID, revision,
+//    write-one-to-clear interrupt status).
+//  - Chip RAM from kMemoryBase up is SdioMemory. A firmware image written
+//    to the fmac region boots |boot_delay| after its last byte lands; a
+//    host-control reset wipes RAM, as a power cycle does.
+//  - Bursts written to the data port are parsed as TX aggregates and
+//    complete at once, returning their buffers and raising TX-done. Each
+//    A-MSDU subframe counts as a frame; config descriptors are recorded as
+//    LMAC messages instead.
+//  - Frames passed to InjectRxFrame queue behind kRegRxReady and are read
+//    back through the data port.
+//  - Setting the host-control sleep bit puts the chip to sleep. The data
+//    port fails while it sleeps, and pending events pulse the host-wake
+//    line (GetHostWakeProto(), a gpio banjo protocol) instead of the card
+//    interrupt. kRegWakeup wakes it |wake_delay| later.
+//
+// The card interrupt is level triggered: while an unmasked status bit is
+// set, every SdioAckInBandIntr raises it again.
+class FakeAic8800Chip : public soliloquy_hal::testing::SdioDevice,
+                        public ddk::GpioProtocol<FakeAic8800Chip> {
+public:
+  // Installs itself as |bus|'s device.
+  explicit FakeAic8800Chip(soliloquy_hal::testing::FakeSdioBus *bus);
+  ~FakeAic8800Chip() override;
+
+  // A raw firmware image of |size| bytes whose config and patch pointers
+  // (at +0x198 and +0x1A0) point at scratch RAM, as a real image's do.
+  static std::vector<uint8_t> MakeFirmwareImage(size_t size);
+
+  static constexpr uint32_t kChipId = 0x88000000;
+  static constexpr uint32_t kDataPort = 1;
+  static constexpr uint32_t kMemoryBase = 0x00100000;
+  static constexpr uint32_t kFmacBase = 0x00120000;
+  static constexpr size_t kFmacMaxSize = 512 * 1024;
+  // kRegByteModeLen counts 4-byte words in one byte.
+  static constexpr size_t kMaxRxFrame = 255 * 4;
+  static constexpr uint8_t kDefaultTxBuffers = 64;
+  // The warm-start marker the driver leaves in RAM. It reads back only in
+  // the address mode it was written in.
+  static constexpr uint32_t kResidentMarkerAddr = 0x001D7FF0;
+  static constexpr size_t kResidentMarkerSize = 16;
+
+  // The host-wake line, for a mock-ddk parent's "gpio-wake" fragment.
+  const gpio_protocol_t *GetHostWakeProto() const { return &gpio_proto_; }
+
+  void set_boot_delay(zx::duration delay);
+  void set_wake_delay(zx::duration delay);
+  void set_tx_buffers(uint8_t count);
+
+  // Loses RAM and firmware, as removing power does.
+  void PowerCycle();
+
+  bool firmware_running() const;
+  uint64_t tx_frames() const;
+  uint64_t tx_bytes() const;
+  // Bursts that carried at least one data frame.
+  uint64_t tx_bursts() const;
+  // A-MSDU descriptors; their subframes are in tx_frames().
+  uint64_t tx_amsdus() const;
+  // Waits until |count| TX frames have arrived in total.
+  zx_status_t WaitForTxFrames(uint64_t count, zx::duration timeout);
+
+  // LMAC messages received since construction, and the parameters of the
+  // last one with |id| (empty if there was none).
+  uint64_t cfg_msgs() const;
+  std::vector<uint8_t> last_cfg_msg(uint16_t id) const;
+
+  bool asleep() const;
+  // Times the chip went to sleep and woke up again.
+  uint64_t sleeps() const;
+  uint64_t wakes() const;
+  // Waits until the chip has gone to sleep |count| times in total.
+  zx_status_t WaitForSleeps(uint64_t count, zx::duration timeout);
+
+  // Queues a frame for the host and raises RX-ready. |len| is reported in
+  // whole words, so the host sees it rounded up to a multiple of 4.
+  zx_status_t InjectRxFrame(const uint8_t *data, size_t len);
+  size_t rx_pending() const;
+
+  // soliloquy_hal::testing::SdioDevice
+  zx_status_t ReadByte(uint32_t addr, uint8_t *out_val) override;
+  zx_status_t WriteByte(uint32_t addr, uint8_t val) override;
+  zx_status_t Read(uint32_t addr, uint8_t *buf, size_t len,
+                   bool incr) override;
+  zx_status_t Write(uint32_t addr, const uint8_t *buf, size_t len,
+                    bool incr) override;
+  bool InterruptAsserted() override;
+
+  // The gpio banjo protocol, for the host-wake line.
+  zx_status_t GpioConfigIn(uint32_t flags);
+  zx_status_t GpioConfigOut(uint8_t initial_value);
+  zx_status_t GpioSetAltFunction(uint64_t function);
+  zx_status_t GpioRead(uint8_t *out_value);
+  zx_status_t GpioWrite(uint8_t value);
+  zx_status_t GpioGetInterrupt(uint32_t flags, zx::interrupt *out_irq);
+  zx_status_t GpioReleaseInterrupt();
+  zx_status_t GpioSetPolarity(gpio_polarity_t polarity);
+  zx_status_t GpioSetDriveStrength(uint64_t ds_ua, uint64_t *out_actual_ds_ua);
+  zx_status_t GpioGetDriveStrength(uint64_t *out_ds_ua);
+
+private:
+  void ResetLocked() __TA_REQUIRES(lock_);
+  uint8_t FwStatusLocked() const __TA_REQUIRES(lock_);
+  uint32_t ReadRegLocked(uint32_t addr) const __TA_REQUIRES(lock_);
+  void WriteRegLocked(uint32_t addr, uint32_t val) __TA_REQUIRES(lock_);
+  void ParseTxBurstLocked(const uint8_t *buf, size_t len)
+      __TA_REQUIRES(lock_);
+  void ParseAmsduLocked(const uint8_t *buf, size_t len) __TA_REQUIRES(lock_);
+  // Completes a wake whose delay has passed; false while asleep.
+  bool AwakeLocked() __TA_REQUIRES(lock_);
+  // Raises the card interrupt, or pulses host wake while asleep, if an
+  // unmasked status bit is set.
+  void UpdateIrqLocked() __TA_REQUIRES(lock_);
+  static bool OverlapsMarker(uint32_t addr, size_t len);
+
+  soliloquy_hal::testing::FakeSdioBus *const bus_;
+  gpio_protocol_t gpio_proto_;
+
+  mutable fbl::Mutex lock_;
+  fbl::ConditionVariable tx_cv_;
+  fbl::ConditionVariable sleep_cv_;
+  soliloquy_hal::testing::SdioMemory ram_ __TA_GUARDED(lock_);
+  zx::duration boot_delay_ __TA_GUARDED(lock_) = zx::msec(5);
+  bool fw_written_ __TA_GUARDED(lock_) = false;
+  zx::time fw_last_write_ __TA_GUARDED(lock_);
+  // Address mode of the last write to the marker; unset until one lands.
+  std::optional<bool> marker_incr_ __TA_GUARDED(lock_);
+  uint8_t host_ctrl_ __TA_GUARDED(lock_) = 0;
+  zx::duration wake_delay_ __TA_GUARDED(lock_) = zx::msec(2);
+  bool asleep_ __TA_GUARDED(lock_) = false;
+  // When a requested wake completes; infinite if none is in progress.
+  zx::time wake_at_ __TA_GUARDED(lock_) = zx::time::infinite();
+  uint64_t sleeps_ __TA_GUARDED(lock_) = 0;
+  uint64_t wakes_ __TA_GUARDED(lock_) = 0;
+  zx::interrupt host_wake_irq_ __TA_GUARDED(lock_);
+  uint32_t int_status_ __TA_GUARDED(lock_) = 0;
+  uint32_t int_mask_ __TA_GUARDED(lock_) = 0;
+  uint8_t tx_buffers_ __TA_GUARDED(lock_) = kDefaultTxBuffers;
+  uint64_t tx_frames_ __TA_GUARDED(lock_) = 0;
+  uint64_t tx_bytes_ __TA_GUARDED(lock_) = 0;
+  uint64_t tx_bursts_ __TA_GUARDED(lock_) = 0;
+  uint64_t tx_amsdus_ __TA_GUARDED(lock_) = 0;
+  uint64_t cfg_msgs_ __TA_GUARDED(lock_) = 0;
+  std::map<uint16_t, std::vector<uint8_t>> cfg_params_ __TA_GUARDED(lock_);
+  std::deque<std::vector<uint8_t>> rx_queue_ __TA_GUARDED(lock_);
+};
+
+} // namespace testing
+} // namespace aic8800
+
+#endif // DRIVERS_WIFI_AIC8800_TESTING_FAKE_AIC8800_CHIP_H_
@@ -0,0 +1,192 @@
+// Driver-level benchmarks: the real Aic8800 under mock-ddk, talking to the
+// chip model over the latency-modeled SDIO bus.
+//
+//   aic8800_benchmark -p --quiet --out=/tmp/aic8800_benchmark.json
+
+#include <fbl/condition_variable.h>
+#include <fbl/mutex.h>
+#include <fbl/string_printf.h>
+#include <lib/zx/clock.h>
+#include <perftest/perftest.h>
+
+#include <vector>
+
+#include "../aic8800.h"
+#include "../testing/fake_aic8800_chip.h"
+#include "src/devices/testing/mock-ddk/mock-device.h"
+
+namespace aic8800 {
+namespace {
+
+constexpr size_t kFirmwareSize = 256 * 1024;
+constexpr zx::duration kWaitTimeout = zx::sec(5);
+
+struct DriverBench {
+  DriverBench() : root(MockDevice::FakeRootParent()), chip(&bus) {
+    const sdio_protocol_t *proto = bus.GetProto();
+    root->AddProtocol(ZX_PROTOCOL_SDIO, proto->ops, proto->ctx);
+    root->SetFirmware(testing::FakeAic8800Chip::MakeFirmwareImage(
+                          kFirmwareSize),
+                      "fmacfw_8800d80.bin");
+  }
+  ~DriverBench() { Unbind(); }
+
+  bool Bind() {
+    auto dev = std::make_unique<Aic8800>(root.get());
+    if (dev->DdkAdd(ddk::DeviceAddArgs("aic8800")) != ZX_OK) {
+      return false;
+    }
+    device = dev.release();
+    child = root->GetLatestChild();
+    child->InitOp();
+    return child->WaitUntilInitReplyCalled() == ZX_OK &&
+           child->InitReplyCallStatus() == ZX_OK;
+  }
+
+  void Unbind() {
+    if (child) {
+      device_async_remove(child->zxdev());
+      mock_ddk::ReleaseFlaggedDevices(root.get());
+      child = nullptr;
+      device = nullptr;
+    }
+  }
+
+  std::shared_ptr<MockDevice> root;
+  soliloquy_hal::testing::FakeSdioBus bus;
+  testing::FakeAic8800Chip chip;
+  Aic8800 *device = nullptr;
+  MockDevice *child = nullptr;
+};
+
+// Cold: reset, firmware download, patching and boot. Warm: the resident
+// marker matches and the download is skipped.
+bool InitHwTest(perftest::RepeatState *state, bool cold) {
+  state->DeclareStep("init");
+  state->DeclareStep("teardown");
+  DriverBench bench;
+  if (!cold) {
+    if (!bench.Bind()) {
+      return false;
+    }
+    bench.Unbind();
+  }
+
+  while (state->KeepRunning()) {
+    if (!bench.Bind()) {
+      return false;
+    }
+    state->NextStep();
+    bench.Unbind();
+    if (cold) {
+      bench.chip.PowerCycle();
+    }
+  }
+  return true;
+}
+
+bool TxThroughputTest(perftest::RepeatState *state, size_t frame_len) {
+  constexpr size_t kFramesPerRun = 64;
+  state->SetBytesProcessedPerRun(kFramesPerRun * frame_len);
+  DriverBench bench;
+  if (!bench.Bind()) {
+    return false;
+  }
+
+  std::vector<uint8_t> frame(frame_len, 0x5A);
+  uint64_t sent = 0;
+  while (state->KeepRunning()) {
+    for (size_t i = 0; i < kFramesPerRun;) {
+      zx_status_t status =
+          bench.device->QueueTxFrame(frame.data(), frame.size());
+      if (status == ZX_ERR_SHOULD_WAIT) {
+        // Both aggregation buffers are on their way to the chip.
+        zx::nanosleep(zx::deadline_after(zx::usec(20)));
+        continue;
+      }
+      if (status != ZX_OK) {
+        return false;
+      }
+      i++;
+    }
+    sent += kFramesPerRun;
+    if (bench.chip.WaitForTxFrames(sent, kWaitTimeout) != ZX_OK) {
+      return false;
+    }
+  }
+  return true;
+}
+
+struct RxCounter {
+  fbl::Mutex lock;
+  fbl::ConditionVariable cv;
+  uint64_t frames __TA_GUARDED(lock) = 0;
+
+  static void Deliver(void *ctx, const RxFrame *frames, size_t count) {
+    auto *c = static_cast<RxCounter *>(ctx);
+    fbl::AutoLock lock(&c->lock);
+    c->frames += count;
+    c->cv.Broadcast();
+  }
+
+  bool WaitFor(uint64_t target) {
+    zx::time deadline = zx::deadline_after(kWaitTimeout);
+    fbl::AutoLock lock(&this->lock);
+    while (frames < target) {
+      zx::time now = zx::clock::get_monotonic();
+      if (now >= deadline) {
+        return false;
+      }
+      cv.Timedwait(&this->lock, (deadline - now).get());
+    }
+    return true;
+  }
+};
+
+bool RxThroughputTest(perftest::RepeatState *state, size_t frame_len) {
+  constexpr size_t kFramesPerRun = 32;
+  state->SetBytesProcessedPerRun(kFramesPerRun * frame_len);
+  DriverBench bench;
+  if (!bench.Bind()) {
+    return false;
+  }
+  RxCounter counter;
+  bench.device->SetRxHandler({RxCounter::Deliver, &counter});
+
+  std::vector<uint8_t> frame(frame_len, 0xC3);
+  uint64_t injected = 0;
+  while (state->KeepRunning()) {
+    for (size_t i = 0; i < kFramesPerRun; i++) {
+      if (bench.chip.InjectRxFrame(frame.data(), frame.size()) != ZX_OK) {
+        return false;
+      }
+    }
+    injected += kFramesPerRun;
+    if (!counter.WaitFor(injected)) {
+      return false;
+    }
+  }
+  bench.Unbind();
+  return true;
+}
+
+void RegisterTests() {
+  perftest::RegisterTest("Aic8800/InitHw/Cold", InitHwTest, true);
+  perftest::RegisterTest("Aic8800/InitHw/Warm", InitHwTest, false);
+  for (size_t len : {64, 512, 1500}) {
+    perftest::RegisterTest(fbl::StringPrintf("Aic8800/Tx/%zu", len).c_str(),
+                           TxThroughputTest, len);
+  }
+  for (size_t len : {64, 512, 1020}) {
+    perftest::RegisterTest(fbl::StringPrintf("Aic8800/Rx/%zu", len).c_str(),
+                           RxThroughputTest, len);
+  }
+}
+PERFTEST_CTOR(RegisterTests)
+
+} // namespace
+} // namespace aic8800
+
+int main(int argc, char **argv) {
+  return perftest::PerfTestMain(argc, argv, "fuchsia.soliloquy.aic8800");
+}
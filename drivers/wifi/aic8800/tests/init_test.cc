@@ -6,8 +6,15 @@
 #include <lib/ddk/device.h>
 #include <lib/fake-bti/bti.h>
 #include <lib/fake-resource/resource.h>
+#include <lib/zx/clock.h>
 #include <zxtest/zxtest.h>
 
+#include <atomic>
+#include <vector>
+
+#include "../testing/fake_aic8800_chip.h"
+#include "src/devices/testing/mock-ddk/mock-device.h"
+
 namespace aic8800 {
 namespace {
 
@@ -66,54 +73,532 @@ TEST_F(Aic8800InitTest, WlanphyQueryNotSupported) {
   device->DdkRelease();
 }
 
-TEST_F(Aic8800InitTest, CreateIfaceNotSupported) {
+TEST_F(Aic8800InitTest, CreateIfaceBeforeInit) {
   auto device = new Aic8800(fake_root_.get());
 
   wlanphy_create_iface_req_t req = {};
   uint16_t iface_id = 0;
   zx_status_t status = device->WlanphyImplCreateIface(&req, &iface_id);
-  EXPECT_EQ(status, ZX_ERR_NOT_SUPPORTED);
+  EXPECT_EQ(status, ZX_ERR_BAD_STATE);
 
   device->DdkRelease();
 }
 
-TEST_F(Aic8800InitTest, DestroyIfaceNotSupported) {
+TEST_F(Aic8800InitTest, DestroyIfaceBeforeInit) {
   auto device = new Aic8800(fake_root_.get());
 
   zx_status_t status = device->WlanphyImplDestroyIface(0);
-  EXPECT_EQ(status, ZX_ERR_NOT_SUPPORTED);
+  EXPECT_EQ(status, ZX_ERR_BAD_STATE);
+
+  device->DdkRelease();
+}
+
+TEST_F(Aic8800InitTest, BaSessionBeforeInit) {
+  auto device = new Aic8800(fake_root_.get());
+
+  uint16_t buf_size = 0;
+  zx_status_t status =
+      device->StartBaSession(0, 0, BaDirection::kTx, 0, 0, &buf_size);
+  EXPECT_EQ(status, ZX_ERR_BAD_STATE);
 
   device->DdkRelease();
 }
 
-TEST_F(Aic8800InitTest, SetCountryNotSupported) {
+TEST_F(Aic8800InitTest, SetCountryBeforeInit) {
   auto device = new Aic8800(fake_root_.get());
 
   wlanphy_country_t country = {};
   zx_status_t status = device->WlanphyImplSetCountry(&country);
-  EXPECT_EQ(status, ZX_ERR_NOT_SUPPORTED);
+  EXPECT_EQ(status, ZX_ERR_BAD_STATE);
 
   device->DdkRelease();
 }
 
-TEST_F(Aic8800InitTest, ClearCountryNotSupported) {
+TEST_F(Aic8800InitTest, ClearCountryBeforeInit) {
   auto device = new Aic8800(fake_root_.get());
 
   zx_status_t status = device->WlanphyImplClearCountry();
-  EXPECT_EQ(status, ZX_ERR_NOT_SUPPORTED);
+  EXPECT_EQ(status, ZX_ERR_BAD_STATE);
 
   device->DdkRelease();
 }
 
-TEST_F(Aic8800InitTest, GetCountryNotSupported) {
+TEST_F(Aic8800InitTest, GetCountryBeforeInit) {
   auto device = new Aic8800(fake_root_.get());
 
   wlanphy_country_t country;
   zx_status_t status = device->WlanphyImplGetCountry(&country);
-  EXPECT_EQ(status, ZX_ERR_NOT_SUPPORTED);
+  EXPECT_EQ(status, ZX_ERR_BAD_STATE);
 
   device->DdkRelease();
 }
 
+TEST(ResidentMarkerTest, MatchesOnlySameImage) {
+  ResidentMarker marker = ResidentMarker::For(0x12345678, 4096);
+  EXPECT_TRUE(marker.Matches(0x12345678, 4096));
+  EXPECT_FALSE(marker.Matches(0x12345679, 4096));
+  EXPECT_FALSE(marker.Matches(0x12345678, 4100));
+}
+
+TEST(ResidentMarkerTest, RejectsClearedOrCorruptMarker) {
+  ResidentMarker cleared = {};
+  EXPECT_FALSE(cleared.Matches(0, 0));
+
+  ResidentMarker marker = ResidentMarker::For(0xCAFEF00D, 65536);
+  marker.check ^= 1;
+  EXPECT_FALSE(marker.Matches(0xCAFEF00D, 65536));
+}
+
+// Full bring-up and data path against the chip model instead of a scripted
+// mock, so the test does not have to track every register access.
+class Aic8800FakeChipTest : public zxtest::Test {
+protected:
+  void SetUp() override {
+    fake_root_ = MockDevice::FakeRootParent();
+    bus_.set_timing(soliloquy_hal::testing::SdioTiming::Instant());
+    chip_.set_boot_delay(zx::msec(1));
+    const sdio_protocol_t *proto = bus_.GetProto();
+    fake_root_->AddProtocol(ZX_PROTOCOL_SDIO, proto->ops, proto->ctx);
+    fake_root_->SetFirmware(
+        testing::FakeAic8800Chip::MakeFirmwareImage(64 * 1024),
+        "fmacfw_8800d80.bin");
+  }
+
+  void TearDown() override {
+    if (child_) {
+      device_async_remove(child_->zxdev());
+      mock_ddk::ReleaseFlaggedDevices(fake_root_.get());
+    }
+  }
+
+  // Wires the chip's host-wake line up as the "gpio-wake" fragment, which
+  // power save needs.
+  void AddHostWake() {
+    const gpio_protocol_t *proto = chip_.GetHostWakeProto();
+    fake_root_->AddProtocol(ZX_PROTOCOL_GPIO, proto->ops, proto->ctx,
+                            "gpio-wake");
+  }
+
+  void BindAndInit() {
+    auto device = std::make_unique<Aic8800>(fake_root_.get());
+    ASSERT_OK(device->DdkAdd(ddk::DeviceAddArgs("aic8800")));
+    device_ = device.release();
+    child_ = fake_root_->GetLatestChild();
+    child_->InitOp();
+    ASSERT_OK(child_->WaitUntilInitReplyCalled());
+    ASSERT_OK(child_->InitReplyCallStatus());
+  }
+
+  std::shared_ptr<MockDevice> fake_root_;
+  soliloquy_hal::testing::FakeSdioBus bus_;
+  testing::FakeAic8800Chip chip_{&bus_};
+  Aic8800 *device_ = nullptr;
+  MockDevice *child_ = nullptr;
+};
+
+TEST_F(Aic8800FakeChipTest, ColdInitBootsFirmware) {
+  ASSERT_NO_FATAL_FAILURE(BindAndInit());
+  EXPECT_TRUE(chip_.firmware_running());
+  // The image goes out as block-mode bursts, not byte by byte.
+  soliloquy_hal::testing::SdioBusStats stats = bus_.stats();
+  EXPECT_GE(stats.bytes_written, 64u * 1024);
+  EXPECT_LT(stats.cmd53_writes, 16u);
+}
+
+TEST_F(Aic8800FakeChipTest, TxFramesReachChip) {
+  ASSERT_NO_FATAL_FAILURE(BindAndInit());
+  device_->SetTxFlushDeadline(zx::usec(100));
+
+  uint8_t frame[1000];
+  memset(frame, 0xA5, sizeof(frame));
+  for (int i = 0; i < 8; i++) {
+    ASSERT_OK(device_->QueueTxFrame(frame, sizeof(frame)));
+  }
+  ASSERT_OK(chip_.WaitForTxFrames(8, zx::sec(5)));
+  EXPECT_EQ(chip_.tx_bytes(), 8u * sizeof(frame));
+  // Aggregation packs the frames into fewer bursts than frames.
+  EXPECT_LT(chip_.tx_bursts(), 8u);
+}
+
+TEST_F(Aic8800FakeChipTest, RxFramesAreDelivered) {
+  ASSERT_NO_FATAL_FAILURE(BindAndInit());
+
+  struct Received {
+    std::atomic<size_t> frames{0};
+    std::atomic<size_t> bytes{0};
+  } received;
+  device_->SetRxHandler({[](void *ctx, const RxFrame *frames, size_t count) {
+                           auto *r = static_cast<Received *>(ctx);
+                           for (size_t i = 0; i < count; i++) {
+                             r->bytes += frames[i].len;
+                           }
+                           r->frames += count;
+                         },
+                         &received});
+
+  uint8_t frame[600];
+  memset(frame, 0x3C, sizeof(frame));
+  for (int i = 0; i < 4; i++) {
+    ASSERT_OK(chip_.InjectRxFrame(frame, sizeof(frame)));
+  }
+  zx::time deadline = zx::deadline_after(zx::sec(5));
+  while (received.frames < 4 && zx::clock::get_monotonic() < deadline) {
+    zx::nanosleep(zx::deadline_after(zx::msec(1)));
+  }
+  EXPECT_EQ(received.frames.load(), 4u);
+  EXPECT_EQ(received.bytes.load(), 4u * sizeof(frame));
+  EXPECT_EQ(chip_.rx_pending(), 0u);
+}
+
+TEST_F(Aic8800FakeChipTest, RebindWarmStartsResidentFirmware) {
+  ASSERT_NO_FATAL_FAILURE(BindAndInit());
+  device_async_remove(child_->zxdev());
+  mock_ddk::ReleaseFlaggedDevices(fake_root_.get());
+  child_ = nullptr;
+
+  bus_.ResetStats();
+  ASSERT_NO_FATAL_FAILURE(BindAndInit());
+  // Nothing close to the image size crosses the bus the second time.
+  EXPECT_LT(bus_.stats().bytes_written, 4096u);
+}
+
+// Offsets into the ME_CHAN_CONFIG_REQ parameters: 14 2.4 GHz slots, then
+// the 5 GHz slots, six bytes each (LE16 frequency, band, power, flags, pad).
+constexpr uint16_t kMeChanConfigReq = 0x1402;
+constexpr size_t kChanDefSize = 6;
+constexpr size_t kChan149Offset = (14 + 20) * kChanDefSize;
+constexpr uint8_t kChanNoIr = 1 << 0;
+constexpr uint8_t kChanDisabled = 1 << 1;
+
+TEST_F(Aic8800FakeChipTest, QueryReportsBothBands) {
+  ASSERT_NO_FATAL_FAILURE(BindAndInit());
+
+  wlanphy_info_t info;
+  ASSERT_OK(device_->WlanphyImplQuery(&info));
+  EXPECT_TRUE(info.supported_phys & WLAN_INFO_PHY_TYPE_VHT);
+  ASSERT_EQ(info.bands_count, 2u);
+
+  const auto &band_2g = info.bands[0];
+  EXPECT_EQ(band_2g.band, WLAN_INFO_BAND_2GHZ);
+  EXPECT_TRUE(band_2g.ht_supported);
+  EXPECT_FALSE(band_2g.vht_supported);
+  EXPECT_EQ(band_2g.supported_channels.channels_count, 13u);
+
+  const auto &band_5g = info.bands[1];
+  EXPECT_EQ(band_5g.band, WLAN_INFO_BAND_5GHZ);
+  EXPECT_TRUE(band_5g.ht_supported);
+  // 20/40 MHz channel width.
+  EXPECT_TRUE(band_5g.ht_caps.ht_capability_info & (1 << 1));
+  EXPECT_TRUE(band_5g.vht_supported);
+  // Short GI at 80 MHz; one stream of MCS 0-9 each way.
+  EXPECT_TRUE(band_5g.vht_caps.vht_capability_info & (1 << 5));
+  EXPECT_EQ(band_5g.vht_caps.supported_vht_mcs_and_nss_set & 0xFFFF, 0xFFFEu);
+  EXPECT_EQ(band_5g.supported_channels.base_freq, 5000u);
+  EXPECT_EQ(band_5g.supported_channels.channels_count, 25u);
+}
+
+TEST_F(Aic8800FakeChipTest, InitConfiguresFirmware) {
+  ASSERT_NO_FATAL_FAILURE(BindAndInit());
+  EXPECT_EQ(chip_.cfg_msgs(), 2u);
+  EXPECT_FALSE(chip_.last_cfg_msg(0x1400).empty());
+
+  // The world domain keeps 5 GHz passive.
+  std::vector<uint8_t> chans = chip_.last_cfg_msg(kMeChanConfigReq);
+  ASSERT_GT(chans.size(), kChan149Offset + kChanDefSize);
+  EXPECT_EQ(chans[kChan149Offset] | (chans[kChan149Offset + 1] << 8), 5745);
+  EXPECT_EQ(chans[kChan149Offset + 4], kChanNoIr);
+  // Data frames are counted separately from firmware messages.
+  EXPECT_EQ(chip_.tx_frames(), 0u);
+
+  wlanphy_country_t country;
+  ASSERT_OK(device_->WlanphyImplGetCountry(&country));
+  EXPECT_BYTES_EQ(country.alpha2, "WW", 2);
+}
+
+TEST_F(Aic8800FakeChipTest, SetCountryEnablesChannels) {
+  ASSERT_NO_FATAL_FAILURE(BindAndInit());
+
+  wlanphy_country_t country = {{'U', 'S'}};
+  ASSERT_OK(device_->WlanphyImplSetCountry(&country));
+  std::vector<uint8_t> chans = chip_.last_cfg_msg(kMeChanConfigReq);
+  ASSERT_GT(chans.size(), kChan149Offset + kChanDefSize);
+  EXPECT_EQ(chans[kChan149Offset + 4], 0);
+
+  wlanphy_country_t current = {};
+  ASSERT_OK(device_->WlanphyImplGetCountry(&current));
+  EXPECT_BYTES_EQ(current.alpha2, "US", 2);
+
+  // Channel 149 is not usable in Germany.
+  country = {{'D', 'E'}};
+  ASSERT_OK(device_->WlanphyImplSetCountry(&country));
+  chans = chip_.last_cfg_msg(kMeChanConfigReq);
+  EXPECT_EQ(chans[kChan149Offset + 4], kChanDisabled);
+  wlanphy_info_t info;
+  ASSERT_OK(device_->WlanphyImplQuery(&info));
+  EXPECT_EQ(info.bands[1].supported_channels.channels_count, 19u);
+
+  ASSERT_OK(device_->WlanphyImplClearCountry());
+  chans = chip_.last_cfg_msg(kMeChanConfigReq);
+  EXPECT_EQ(chans[kChan149Offset + 4], kChanNoIr);
+  ASSERT_OK(device_->WlanphyImplGetCountry(&current));
+  EXPECT_BYTES_EQ(current.alpha2, "WW", 2);
+}
+
+TEST_F(Aic8800FakeChipTest, SetCountryRejectsUnknownCode) {
+  ASSERT_NO_FATAL_FAILURE(BindAndInit());
+  uint64_t sent = chip_.cfg_msgs();
+
+  wlanphy_country_t country = {{'Z', 'Z'}};
+  EXPECT_EQ(device_->WlanphyImplSetCountry(&country), ZX_ERR_NOT_SUPPORTED);
+  EXPECT_EQ(chip_.cfg_msgs(), sent);
+
+  wlanphy_country_t current = {};
+  ASSERT_OK(device_->WlanphyImplGetCountry(&current));
+  EXPECT_BYTES_EQ(current.alpha2, "WW", 2);
+}
+
+constexpr uint16_t kMmAddIfReq = 0x0006;
+constexpr uint16_t kMmRemoveIfReq = 0x0008;
+
+TEST_F(Aic8800FakeChipTest, CreateIfaceClosesSmeChannel) {
+  ASSERT_NO_FATAL_FAILURE(BindAndInit());
+
+  zx::channel sme, sme_peer;
+  ASSERT_OK(zx::channel::create(0, &sme, &sme_peer));
+  wlanphy_create_iface_req_t req = {};
+  req.role = WLAN_MAC_ROLE_CLIENT;
+  req.sme_channel = sme.release();
+  uint16_t id;
+  EXPECT_EQ(device_->WlanphyImplCreateIface(&req, &id), ZX_ERR_NOT_SUPPORTED);
+  EXPECT_OK(sme_peer.wait_one(ZX_CHANNEL_PEER_CLOSED, zx::time::infinite_past(),
+                              nullptr));
+  EXPECT_EQ(chip_.last_cfg_msg(kMmAddIfReq).size(), 0u);
+}
+
+TEST_F(Aic8800FakeChipTest, AddInterfaceRegistersWithFirmware) {
+  ASSERT_NO_FATAL_FAILURE(BindAndInit());
+
+  const uint8_t kMac[] = {0x02, 0x11, 0x22, 0x33, 0x44, 0x55};
+  uint16_t sta_id = 0xFFFF;
+  ASSERT_OK(device_->AddInterface(WLAN_MAC_ROLE_CLIENT, kMac, &sta_id));
+  EXPECT_EQ(sta_id, 0);
+  std::vector<uint8_t> add_if = chip_.last_cfg_msg(kMmAddIfReq);
+  ASSERT_EQ(add_if.size(), 8u);
+  EXPECT_EQ(add_if[0], 0); // STA
+  EXPECT_BYTES_EQ(&add_if[1], kMac, sizeof(kMac));
+
+  uint16_t ap_id = 0xFFFF;
+  ASSERT_OK(device_->AddInterface(WLAN_MAC_ROLE_AP, nullptr, &ap_id));
+  EXPECT_EQ(ap_id, 1);
+  EXPECT_EQ(chip_.last_cfg_msg(kMmAddIfReq)[0], 2); // AP
+
+  uint16_t extra_id;
+  EXPECT_EQ(device_->AddInterface(WLAN_MAC_ROLE_AP, nullptr, &extra_id),
+            ZX_ERR_NO_RESOURCES);
+
+  ASSERT_OK(device_->RemoveInterface(sta_id));
+  std::vector<uint8_t> remove_if = chip_.last_cfg_msg(kMmRemoveIfReq);
+  ASSERT_EQ(remove_if.size(), 1u);
+  EXPECT_EQ(remove_if[0], sta_id);
+  EXPECT_EQ(device_->RemoveInterface(sta_id), ZX_ERR_NOT_FOUND);
+
+  // The freed slot is reused.
+  ASSERT_OK(device_->AddInterface(WLAN_MAC_ROLE_CLIENT, nullptr, &extra_id));
+  EXPECT_EQ(extra_id, sta_id);
+}
+
+TEST_F(Aic8800FakeChipTest, AddInterfaceRejectsUnknownRole) {
+  ASSERT_NO_FATAL_FAILURE(BindAndInit());
+  uint16_t id;
+  EXPECT_EQ(device_->AddInterface(0, nullptr, &id), ZX_ERR_NOT_SUPPORTED);
+}
+
+TEST_F(Aic8800FakeChipTest, VoiceBypassesFillingBulkAggregate) {
+  ASSERT_NO_FATAL_FAILURE(BindAndInit());
+  // Bulk frames sit in their aggregate for a second; voice goes at once.
+  device_->SetTxFlushDeadline(zx::sec(1));
+  device_->SetTxFlushDeadline(WmmAc::kVoice, zx::duration(0));
+
+  uint8_t bulk[1000];
+  memset(bulk, 0xB0, sizeof(bulk));
+  for (int i = 0; i < 4; i++) {
+    ASSERT_OK(device_->QueueTxFrame(bulk, sizeof(bulk), WmmAc::kBackground));
+    ASSERT_OK(device_->QueueTxFrame(bulk, sizeof(bulk), WmmAc::kBestEffort));
+  }
+  uint8_t voice[200];
+  memset(voice, 0x70, sizeof(voice));
+  ASSERT_OK(device_->QueueTxFrame(voice, sizeof(voice), WmmAc::kVoice));
+
+  ASSERT_OK(chip_.WaitForTxFrames(1, zx::msec(500)));
+  EXPECT_EQ(chip_.tx_frames(), 1u);
+  EXPECT_EQ(chip_.tx_bytes(), sizeof(voice));
+
+  // The bulk aggregates still go out at their deadline.
+  ASSERT_OK(chip_.WaitForTxFrames(9, zx::sec(5)));
+  EXPECT_EQ(chip_.tx_bytes(), sizeof(voice) + 8 * sizeof(bulk));
+}
+
+// A small IPv4 Ethernet frame from |sa| to |da|.
+void MakeEthFrame(uint8_t *frame, size_t len, uint8_t da, uint8_t sa) {
+  memset(frame, 0x3C, len);
+  memset(frame, da, 6);
+  memset(frame + 6, sa, 6);
+  frame[12] = 0x08;
+  frame[13] = 0x00;
+}
+
+TEST_F(Aic8800FakeChipTest, SmallFramesArePackedIntoAmsdu) {
+  ASSERT_NO_FATAL_FAILURE(BindAndInit());
+  device_->SetTxFlushDeadline(zx::msec(50));
+
+  uint8_t frame[64];
+  MakeEthFrame(frame, sizeof(frame), 0xD0, 0x50);
+  for (int i = 0; i < 10; i++) {
+    ASSERT_OK(device_->QueueTxFrame(frame, sizeof(frame)));
+  }
+  ASSERT_OK(chip_.WaitForTxFrames(10, zx::sec(5)));
+  EXPECT_EQ(chip_.tx_bytes(), 10 * sizeof(frame));
+  EXPECT_EQ(chip_.tx_amsdus(), 1u);
+}
+
+TEST_F(Aic8800FakeChipTest, AmsduKeepsDestinationsApart) {
+  ASSERT_NO_FATAL_FAILURE(BindAndInit());
+  device_->SetTxFlushDeadline(zx::msec(50));
+
+  uint8_t to_a[64];
+  uint8_t to_b[64];
+  MakeEthFrame(to_a, sizeof(to_a), 0xA0, 0x50);
+  MakeEthFrame(to_b, sizeof(to_b), 0xB0, 0x50);
+  for (int i = 0; i < 3; i++) {
+    ASSERT_OK(device_->QueueTxFrame(to_a, sizeof(to_a)));
+  }
+  for (int i = 0; i < 3; i++) {
+    ASSERT_OK(device_->QueueTxFrame(to_b, sizeof(to_b)));
+  }
+  ASSERT_OK(chip_.WaitForTxFrames(6, zx::sec(5)));
+  EXPECT_EQ(chip_.tx_bytes(), 6 * sizeof(to_a));
+  EXPECT_EQ(chip_.tx_amsdus(), 2u);
+}
+
+TEST_F(Aic8800FakeChipTest, AmsduCanBeDisabled) {
+  ASSERT_NO_FATAL_FAILURE(BindAndInit());
+  device_->SetTxFlushDeadline(zx::usec(100));
+  device_->SetTxAmsdu(false);
+
+  uint8_t frame[64];
+  MakeEthFrame(frame, sizeof(frame), 0xD0, 0x50);
+  for (int i = 0; i < 4; i++) {
+    ASSERT_OK(device_->QueueTxFrame(frame, sizeof(frame)));
+  }
+  ASSERT_OK(chip_.WaitForTxFrames(4, zx::sec(5)));
+  EXPECT_EQ(chip_.tx_bytes(), 4 * sizeof(frame));
+  EXPECT_EQ(chip_.tx_amsdus(), 0u);
+}
+
+constexpr uint16_t kMmBaAddReq = 0x0028;
+constexpr uint16_t kMmBaDelReq = 0x002A;
+
+TEST_F(Aic8800FakeChipTest, BaSessionsAreOffloadedToFirmware) {
+  ASSERT_NO_FATAL_FAILURE(BindAndInit());
+
+  uint16_t buf_size = 0;
+  ASSERT_OK(device_->StartBaSession(1, 5, BaDirection::kTx, 0x1234, 256,
+                                    &buf_size));
+  EXPECT_EQ(buf_size, 64);
+  std::vector<uint8_t> add = chip_.last_cfg_msg(kMmBaAddReq);
+  ASSERT_EQ(add.size(), 6u);
+  EXPECT_EQ(add[0], 0); // TX
+  EXPECT_EQ(add[1], 1);
+  EXPECT_EQ(add[2], 5);
+  EXPECT_EQ(add[3], 64);
+  EXPECT_EQ(add[4] | (add[5] << 8), 0x0234);
+
+  EXPECT_EQ(device_->StartBaSession(1, 5, BaDirection::kTx, 0, 0, &buf_size),
+            ZX_ERR_ALREADY_EXISTS);
+  EXPECT_EQ(device_->StartBaSession(1, 8, BaDirection::kTx, 0, 0, &buf_size),
+            ZX_ERR_INVALID_ARGS);
+  // The same TID in the other direction is a separate session.
+  ASSERT_OK(device_->StartBaSession(1, 5, BaDirection::kRx, 0, 32, &buf_size));
+  EXPECT_EQ(buf_size, 32);
+
+  ASSERT_OK(device_->StopBaSession(1, 5, BaDirection::kTx));
+  std::vector<uint8_t> del = chip_.last_cfg_msg(kMmBaDelReq);
+  ASSERT_EQ(del.size(), 3u);
+  EXPECT_EQ(del[0], 0);
+  EXPECT_EQ(del[1], 1);
+  EXPECT_EQ(del[2], 5);
+  EXPECT_EQ(device_->StopBaSession(1, 5, BaDirection::kTx), ZX_ERR_NOT_FOUND);
+}
+
+TEST_F(Aic8800FakeChipTest, PowerSaveSleepsWhenIdleAndWakesForTx) {
+  AddHostWake();
+  ASSERT_NO_FATAL_FAILURE(BindAndInit());
+  device_->SetPowerSaveIdle(zx::msec(5));
+  ASSERT_OK(chip_.WaitForSleeps(1, zx::sec(5)));
+
+  device_->SetTxFlushDeadline(zx::usec(100));
+  uint8_t frame[1000];
+  memset(frame, 0xA5, sizeof(frame));
+  ASSERT_OK(device_->QueueTxFrame(frame, sizeof(frame)));
+  ASSERT_OK(chip_.WaitForTxFrames(1, zx::sec(5)));
+  EXPECT_EQ(chip_.tx_bytes(), sizeof(frame));
+  EXPECT_GE(chip_.wakes(), 1u);
+
+  // Back to sleep once the bus is idle again.
+  ASSERT_OK(chip_.WaitForSleeps(2, zx::sec(5)));
+
+  // Firmware messages wake it as well.
+  uint64_t msgs = chip_.cfg_msgs();
+  wlanphy_country_t country = {{'U', 'S'}};
+  ASSERT_OK(device_->WlanphyImplSetCountry(&country));
+  EXPECT_GT(chip_.cfg_msgs(), msgs);
+
+  // An infinite window wakes the chip and keeps it awake.
+  device_->SetPowerSaveIdle(zx::duration::infinite());
+  EXPECT_FALSE(chip_.asleep());
+  uint64_t sleeps = chip_.sleeps();
+  zx::nanosleep(zx::deadline_after(zx::msec(20)));
+  EXPECT_EQ(chip_.sleeps(), sleeps);
+}
+
+TEST_F(Aic8800FakeChipTest, HostWakeDeliversRxWhileAsleep) {
+  AddHostWake();
+  ASSERT_NO_FATAL_FAILURE(BindAndInit());
+  std::atomic<size_t> received{0};
+  device_->SetRxHandler({[](void *ctx, const RxFrame *frames, size_t count) {
+                           *static_cast<std::atomic<size_t> *>(ctx) += count;
+                         },
+                         &received});
+  device_->SetPowerSaveIdle(zx::msec(5));
+  ASSERT_OK(chip_.WaitForSleeps(1, zx::sec(5)));
+
+  uint8_t frame[200];
+  memset(frame, 0x3C, sizeof(frame));
+  ASSERT_OK(chip_.InjectRxFrame(frame, sizeof(frame)));
+  zx::time deadline = zx::deadline_after(zx::sec(5));
+  while (received < 1 && zx::clock::get_monotonic() < deadline) {
+    zx::nanosleep(zx::deadline_after(zx::msec(1)));
+  }
+  EXPECT_EQ(received.load(), 1u);
+  EXPECT_GE(chip_.wakes(), 1u);
+  EXPECT_EQ(chip_.rx_pending(), 0u);
+}
+
+TEST_F(Aic8800FakeChipTest, PowerSaveNeedsHostWake) {
+  ASSERT_NO_FATAL_FAILURE(BindAndInit());
+  device_->SetPowerSaveIdle(zx::msec(1));
+  EXPECT_EQ(chip_.WaitForSleeps(1, zx::msec(50)), ZX_ERR_TIMED_OUT);
+}
+
+TEST(WmmAcTest, MapsUserPriorities) {
+  EXPECT_EQ(WmmAcForPriority(0), WmmAc::kBestEffort);
+  EXPECT_EQ(WmmAcForPriority(1), WmmAc::kBackground);
+  EXPECT_EQ(WmmAcForPriority(2), WmmAc::kBackground);
+  EXPECT_EQ(WmmAcForPriority(3), WmmAc::kBestEffort);
+  EXPECT_EQ(WmmAcForPriority(5), WmmAc::kVideo);
+  EXPECT_EQ(WmmAcForPriority(6), WmmAc::kVoice);
+  EXPECT_EQ(WmmAcForPriority(7), WmmAc::kVoice);
+}
+
 } // namespace
 } // namespace aic8800
@@ -0,0 +1,72 @@
+#include "ipc_bench.h"
+
+#include <stdlib.h>
+
+#include "third_party/zircon_c/ipc/channel.h"
+
+struct ipc_bench_table {
+    handle_table_t table;
+    uint32_t num_handles;
+    zx_handle_t handles[];
+};
+
+/* The object every benchmark handle refers to; handle_get only needs it to be non-NULL. */
+static int g_object;
+
+ipc_bench_table_t* ipc_bench_table_create(uint32_t num_handles) {
+    ipc_bench_table_t* bench = malloc(sizeof(*bench) + num_handles * sizeof(zx_handle_t));
+    if (!bench) {
+        return NULL;
+    }
+    if (handle_table_init(&bench->table, num_handles) != ZX_OK) {
+        free(bench);
+        return NULL;
+    }
+
+    bench->num_handles = num_handles;
+    for (uint32_t i = 0; i < num_handles; i++) {
+        if (handle_alloc(&bench->table, &g_object, ZX_RIGHT_READ, &bench->handles[i]) != ZX_OK) {
+            ipc_bench_table_destroy(bench);
+            return NULL;
+        }
+    }
+    return bench;
+}
+
+void ipc_bench_table_destroy(ipc_bench_table_t* table) {
+    if (!table) {
+        return;
+    }
+    handle_table_destroy(&table->table);
+    free(table);
+}
+
+uint32_t ipc_bench_table_handle(const ipc_bench_table_t* table, uint32_t index) {
+    return table->handles[index];
+}
+
+int32_t ipc_bench_handle_get(ipc_bench_table_t* table, uint32_t handle) {
+    void* object;
+    return handle_get(&table->table, handle, ZX_RIGHT_READ, &object);
+}
+
+int32_t ipc_bench_channel_create(uint32_t* out_handle0, uint32_t* out_handle1) {
+    return channel_create(out_handle0, out_handle1);
+}
+
+int32_t ipc_bench_channel_write(uint32_t handle, const void* data, uint32_t size) {
+    return channel_write(handle, data, size, NULL, 0);
+}
+
+int32_t ipc_bench_channel_read(uint32_t handle, void* data, uint32_t size, uint32_t* actual_size) {
+    return channel_read(handle, data, size, actual_size, NULL, 0, NULL);
+}
+
+int32_t ipc_bench_channel_wait_readable(uint32_t handle) {
+    zx_signals_t observed;
+    return channel_wait(handle, ZX_CHANNEL_READABLE | ZX_CHANNEL_PEER_CLOSED, ZX_TIME_INFINITE, &observed);
+}
+
+int32_t ipc_bench_channel_close(uint32_t handle) {
+    return channel_close(handle);
+}
@@ -0,0 +1,43 @@
+#ifndef TEST_VM_IPC_BENCH_H_
+#define TEST_VM_IPC_BENCH_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Plain-C entry points into the IPC layer for vm_benchmark.cc. The IPC
+ * headers use C11 atomics, which C++ callers cannot include, so the
+ * benchmark reaches handle tables and channels through these wrappers.
+ * Each wrapper is one call into the real function, so the extra call is
+ * the only overhead they add.
+ */
+
+typedef struct ipc_bench_table ipc_bench_table_t;
+
+/* Creates a table and fills it with |num_handles| live handles. */
+ipc_bench_table_t* ipc_bench_table_create(uint32_t num_handles);
+void ipc_bench_table_destroy(ipc_bench_table_t* table);
+
+/* Returns the |index|th handle allocated by ipc_bench_table_create. */
+uint32_t ipc_bench_table_handle(const ipc_bench_table_t* table, uint32_t index);
+
+/* Looks up |handle| with handle_get and returns its status. */
+int32_t ipc_bench_handle_get(ipc_bench_table_t* table, uint32_t handle);
+
+/* Channels live in the process-wide table that get_current_handle_table returns. */
+int32_t ipc_bench_channel_create(uint32_t* out_handle0, uint32_t* out_handle1);
+int32_t ipc_bench_channel_write(uint32_t handle, const void* data, uint32_t size);
+int32_t ipc_bench_channel_read(uint32_t handle, void* data, uint32_t size, uint32_t* actual_size);
+
+/* Blocks until |handle| is readable or its peer has closed. */
+int32_t ipc_bench_channel_wait_readable(uint32_t handle);
+int32_t ipc_bench_channel_close(uint32_t handle);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
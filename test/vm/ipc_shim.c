@@ -0,0 +1,99 @@
+#include "ipc_shim.h"
+
+#include <stdlib.h>
+
+#include "third_party/zircon_c/ipc/channel.h"
+
+#define SHIM_BATCH_MAX 16
+
+struct ipc_shim_table {
+    handle_table_t table;
+};
+
+ipc_shim_table_t* ipc_shim_table_create(void) {
+    ipc_shim_table_t* shim = malloc(sizeof(*shim));
+    if (!shim) {
+        return NULL;
+    }
+    if (handle_table_init(&shim->table, 0) != ZX_OK) {
+        free(shim);
+        return NULL;
+    }
+    return shim;
+}
+
+void ipc_shim_table_destroy(ipc_shim_table_t* table) {
+    if (!table) {
+        return;
+    }
+    handle_table_destroy(&table->table);
+    free(table);
+}
+
+int32_t ipc_shim_handle_alloc(ipc_shim_table_t* table, void* object, uint32_t* out_handle) {
+    return handle_alloc(&table->table, object, ZX_RIGHT_READ, out_handle);
+}
+
+int32_t ipc_shim_handle_get(ipc_shim_table_t* table, uint32_t handle, void** out_object) {
+    return handle_get(&table->table, handle, ZX_RIGHT_READ, out_object);
+}
+
+int32_t ipc_shim_handle_close(ipc_shim_table_t* table, uint32_t handle) {
+    return handle_close(&table->table, handle);
+}
+
+uint32_t ipc_shim_handle_slot(uint32_t handle) {
+    return handle & HANDLE_SLOT_MASK;
+}
+
+int32_t ipc_shim_channel_create(uint32_t* out_handle0, uint32_t* out_handle1) {
+    return channel_create(out_handle0, out_handle1);
+}
+
+int32_t ipc_shim_channel_write(uint32_t handle, const void* data, uint32_t size) {
+    return channel_write(handle, data, size, NULL, 0);
+}
+
+int32_t ipc_shim_channel_read(uint32_t handle, void* data, uint32_t size, uint32_t* actual_size) {
+    return channel_read(handle, data, size, actual_size, NULL, 0, NULL);
+}
+
+int32_t ipc_shim_channel_close(uint32_t handle) {
+    return channel_close(handle);
+}
+
+int32_t ipc_shim_channel_wait(uint32_t handle, uint32_t signals, int64_t timeout_ns,
+                              uint32_t* observed) {
+    zx_time_t deadline = timeout_ns < 0 ? ZX_TIME_INFINITE : zx_deadline_after(timeout_ns);
+    return channel_wait(handle, signals, deadline, observed);
+}
+
+int32_t ipc_shim_channel_read_batch(uint32_t handle, ipc_shim_message_t* messages, uint32_t count,
+                                    uint32_t* actual_count) {
+    if (count > SHIM_BATCH_MAX) {
+        return ZX_ERR_INVALID_ARGS;
+    }
+
+    channel_message_t batch[SHIM_BATCH_MAX] = {0};
+    for (uint32_t i = 0; i < count; i++) {
+        batch[i].data = messages[i].data;
+        batch[i].data_size = messages[i].data_size;
+    }
+    uint32_t read = 0;
+    zx_status_t status = channel_read_batch(handle, batch, count, &read);
+    for (uint32_t i = 0; i < read; i++) {
+        messages[i].actual_data_size = batch[i].actual_data_size;
+    }
+    if (actual_count) {
+        *actual_count = read;
+    }
+    return status;
+}
+
+int32_t ipc_shim_channel_write_vmo(uint32_t handle, vmo_t* vmo, pmm_arena_t* arena, uint32_t options) {
+    return channel_write_vmo(handle, vmo, arena, options, NULL, 0);
+}
+
+int32_t ipc_shim_channel_read_vmo(uint32_t handle, vmo_t* out_vmo) {
+    return channel_read_vmo(handle, out_vmo, NULL, 0, NULL);
+}
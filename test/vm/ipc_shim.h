@@ -0,0 +1,74 @@
+#ifndef TEST_VM_IPC_SHIM_H_
+#define TEST_VM_IPC_SHIM_H_
+
+#include <stdint.h>
+
+#include "third_party/zircon_c/vm/pmm_arena.h"
+#include "third_party/zircon_c/vm/vmo_bootstrap.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Plain-C entry points into the IPC layer for ipc_test.cc, which cannot
+ * include the C11-atomic IPC headers any more than vm_benchmark.cc can.
+ * Each wrapper is one call into the real function.
+ *
+ * The constants repeat the IPC headers' definitions token for token, so
+ * ipc_shim.c can include both.
+ */
+#define ZX_ERR_BAD_HANDLE   (-11)
+#define ZX_ERR_WRONG_TYPE   (-12)
+#define ZX_ERR_TIMED_OUT    (-21)
+#define ZX_ERR_SHOULD_WAIT  (-22)
+#define ZX_ERR_CANCELED     (-23)
+#define ZX_ERR_PEER_CLOSED  (-24)
+
+#define ZX_CHANNEL_READABLE     (1u << 0)
+#define ZX_CHANNEL_PEER_CLOSED  (1u << 2)
+
+#define CHANNEL_VMO_SHARE   (1u << 0)
+
+/* A private handle table, separate from the one channels live in. */
+typedef struct ipc_shim_table ipc_shim_table_t;
+
+ipc_shim_table_t* ipc_shim_table_create(void);
+void ipc_shim_table_destroy(ipc_shim_table_t* table);
+
+int32_t ipc_shim_handle_alloc(ipc_shim_table_t* table, void* object, uint32_t* out_handle);
+int32_t ipc_shim_handle_get(ipc_shim_table_t* table, uint32_t handle, void** out_object);
+int32_t ipc_shim_handle_close(ipc_shim_table_t* table, uint32_t handle);
+
+/* The slot index a handle value encodes, without its generation. */
+uint32_t ipc_shim_handle_slot(uint32_t handle);
+
+/* Channels live in the process-wide table that get_current_handle_table returns. */
+int32_t ipc_shim_channel_create(uint32_t* out_handle0, uint32_t* out_handle1);
+int32_t ipc_shim_channel_write(uint32_t handle, const void* data, uint32_t size);
+int32_t ipc_shim_channel_read(uint32_t handle, void* data, uint32_t size, uint32_t* actual_size);
+int32_t ipc_shim_channel_close(uint32_t handle);
+
+/* Waits until |timeout_ns| from now; negative waits forever. */
+int32_t ipc_shim_channel_wait(uint32_t handle, uint32_t signals, int64_t timeout_ns,
+                              uint32_t* observed);
+
+/* Mirrors the byte fields of channel_message_t. */
+typedef struct ipc_shim_message {
+    void* data;
+    uint32_t data_size;
+    uint32_t actual_data_size;
+} ipc_shim_message_t;
+
+/* Reads at most 16 messages, through channel_read_batch. */
+int32_t ipc_shim_channel_read_batch(uint32_t handle, ipc_shim_message_t* messages, uint32_t count,
+                                    uint32_t* actual_count);
+
+int32_t ipc_shim_channel_write_vmo(uint32_t handle, vmo_t* vmo, pmm_arena_t* arena, uint32_t options);
+int32_t ipc_shim_channel_read_vmo(uint32_t handle, vmo_t* out_vmo);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,257 @@
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include "test/vm/ipc_shim.h"
+
+namespace {
+
+class ChannelTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    ASSERT_EQ(ipc_shim_channel_create(&h0_, &h1_), ZX_OK);
+  }
+
+  void TearDown() override {
+    ipc_shim_channel_close(h0_);
+    ipc_shim_channel_close(h1_);
+  }
+
+  uint32_t h0_ = 0;
+  uint32_t h1_ = 0;
+};
+
+class ChannelVmoTest : public ChannelTest {
+protected:
+  void SetUp() override {
+    ChannelTest::SetUp();
+    pmm_arena_init(&arena_, 0x1000000, 4096 * 64);
+    ASSERT_EQ(vmo_bootstrap_init(&vmo_, &arena_, 4 * 4096), ZX_OK);
+    ASSERT_EQ(vmo_bootstrap_commit_page(&vmo_, &arena_, 0), ZX_OK);
+    ASSERT_EQ(vmo_bootstrap_commit_page(&vmo_, &arena_, 2), ZX_OK);
+    page0_ = vmo_bootstrap_lookup(&vmo_, 0);
+    page2_ = vmo_bootstrap_lookup(&vmo_, 2);
+  }
+
+  void TearDown() override {
+    ChannelTest::TearDown();
+    vmo_bootstrap_destroy(&vmo_, &arena_);
+    EXPECT_EQ(pmm_arena_free_count(&arena_), 64u);
+    free(arena_.page_array);
+  }
+
+  pmm_arena_t arena_;
+  vmo_t vmo_;
+  vm_page_t* page0_ = nullptr;
+  vm_page_t* page2_ = nullptr;
+};
+
+TEST(HandleTest, StaleHandleRejectedAfterSlotReuse) {
+  ipc_shim_table_t* table = ipc_shim_table_create();
+  ASSERT_NE(table, nullptr);
+  int first_object, second_object;
+
+  uint32_t stale;
+  ASSERT_EQ(ipc_shim_handle_alloc(table, &first_object, &stale), ZX_OK);
+  ASSERT_EQ(ipc_shim_handle_close(table, stale), ZX_OK);
+
+  void* object = nullptr;
+  EXPECT_EQ(ipc_shim_handle_get(table, stale, &object), ZX_ERR_BAD_HANDLE);
+  EXPECT_EQ(ipc_shim_handle_close(table, stale), ZX_ERR_BAD_HANDLE);
+
+  // The freed slot is the next one handed out, under a new generation.
+  uint32_t fresh;
+  ASSERT_EQ(ipc_shim_handle_alloc(table, &second_object, &fresh), ZX_OK);
+  EXPECT_EQ(ipc_shim_handle_slot(fresh), ipc_shim_handle_slot(stale));
+  EXPECT_NE(fresh, stale);
+
+  EXPECT_EQ(ipc_shim_handle_get(table, stale, &object), ZX_ERR_BAD_HANDLE);
+  ASSERT_EQ(ipc_shim_handle_get(table, fresh, &object), ZX_OK);
+  EXPECT_EQ(object, &second_object);
+
+  ipc_shim_table_destroy(table);
+}
+
+TEST_F(ChannelTest, ConcurrentWritersKeepPerWriterOrder) {
+  constexpr uint32_t kWriters = 4;
+  constexpr uint32_t kMessages = 2000;
+
+  std::vector<std::thread> writers;
+  for (uint32_t w = 0; w < kWriters; w++) {
+    writers.emplace_back([this, w] {
+      for (uint32_t seq = 0; seq < kMessages; seq++) {
+        uint32_t message[2] = {w, seq};
+        ASSERT_EQ(ipc_shim_channel_write(h0_, message, sizeof(message)), ZX_OK);
+      }
+    });
+  }
+
+  std::vector<uint32_t> next(kWriters, 0);
+  for (uint32_t received = 0; received < kWriters * kMessages;) {
+    uint32_t message[2];
+    uint32_t actual = 0;
+    int32_t status = ipc_shim_channel_read(h1_, message, sizeof(message), &actual);
+    if (status == ZX_ERR_SHOULD_WAIT) {
+      uint32_t observed;
+      ASSERT_EQ(ipc_shim_channel_wait(h1_, ZX_CHANNEL_READABLE, -1, &observed), ZX_OK);
+      continue;
+    }
+    ASSERT_EQ(status, ZX_OK);
+    ASSERT_EQ(actual, sizeof(message));
+    ASSERT_LT(message[0], kWriters);
+    ASSERT_EQ(message[1], next[message[0]]);
+    next[message[0]]++;
+    received++;
+  }
+
+  for (auto& writer : writers) {
+    writer.join();
+  }
+  uint32_t extra;
+  EXPECT_EQ(ipc_shim_channel_read(h1_, &extra, sizeof(extra), nullptr), ZX_ERR_SHOULD_WAIT);
+}
+
+TEST_F(ChannelTest, WaitTimesOut) {
+  uint32_t observed = ~0u;
+  auto start = std::chrono::steady_clock::now();
+  EXPECT_EQ(ipc_shim_channel_wait(h1_, ZX_CHANNEL_READABLE, 20 * 1000 * 1000, &observed),
+            ZX_ERR_TIMED_OUT);
+  EXPECT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(20));
+  EXPECT_EQ(observed, 0u);
+}
+
+TEST_F(ChannelTest, WaitReturnsReadable) {
+  uint8_t byte = 7;
+  ASSERT_EQ(ipc_shim_channel_write(h0_, &byte, 1), ZX_OK);
+
+  uint32_t observed = 0;
+  EXPECT_EQ(ipc_shim_channel_wait(h1_, ZX_CHANNEL_READABLE, 0, &observed), ZX_OK);
+  EXPECT_EQ(observed, ZX_CHANNEL_READABLE);
+}
+
+TEST_F(ChannelTest, WaitWakesOnPeerClosed) {
+  std::thread closer([this] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    ipc_shim_channel_close(h0_);
+  });
+
+  uint32_t observed = 0;
+  EXPECT_EQ(ipc_shim_channel_wait(h1_, ZX_CHANNEL_READABLE | ZX_CHANNEL_PEER_CLOSED, -1,
+                                  &observed),
+            ZX_OK);
+  EXPECT_EQ(observed, ZX_CHANNEL_PEER_CLOSED);
+  closer.join();
+
+  uint8_t byte;
+  EXPECT_EQ(ipc_shim_channel_read(h1_, &byte, 1, nullptr), ZX_ERR_PEER_CLOSED);
+  EXPECT_EQ(ipc_shim_channel_write(h1_, &byte, 1), ZX_ERR_PEER_CLOSED);
+}
+
+TEST_F(ChannelTest, ReadBatchPartialAndEmpty) {
+  for (uint32_t i = 0; i < 3; i++) {
+    ASSERT_EQ(ipc_shim_channel_write(h0_, &i, sizeof(i)), ZX_OK);
+  }
+
+  uint32_t values[8] = {};
+  ipc_shim_message_t messages[8] = {};
+  for (uint32_t i = 0; i < 8; i++) {
+    messages[i].data = &values[i];
+    messages[i].data_size = sizeof(values[i]);
+  }
+
+  uint32_t count = 0;
+  ASSERT_EQ(ipc_shim_channel_read_batch(h1_, messages, 8, &count), ZX_OK);
+  ASSERT_EQ(count, 3u);
+  for (uint32_t i = 0; i < 3; i++) {
+    EXPECT_EQ(messages[i].actual_data_size, sizeof(uint32_t));
+    EXPECT_EQ(values[i], i);
+  }
+
+  count = 99;
+  EXPECT_EQ(ipc_shim_channel_read_batch(h1_, messages, 8, &count), ZX_ERR_SHOULD_WAIT);
+  EXPECT_EQ(count, 0u);
+}
+
+TEST_F(ChannelTest, ReadBatchStopsAtCount) {
+  for (uint32_t i = 0; i < 5; i++) {
+    ASSERT_EQ(ipc_shim_channel_write(h0_, &i, sizeof(i)), ZX_OK);
+  }
+
+  uint32_t values[2] = {};
+  ipc_shim_message_t messages[2] = {{&values[0], sizeof(uint32_t), 0},
+                                    {&values[1], sizeof(uint32_t), 0}};
+  uint32_t count = 0;
+  ASSERT_EQ(ipc_shim_channel_read_batch(h1_, messages, 2, &count), ZX_OK);
+  EXPECT_EQ(count, 2u);
+  EXPECT_EQ(values[1], 1u);
+
+  uint32_t value;
+  ASSERT_EQ(ipc_shim_channel_read(h1_, &value, sizeof(value), nullptr), ZX_OK);
+  EXPECT_EQ(value, 2u);
+}
+
+TEST_F(ChannelVmoTest, WriteVmoMovesPages) {
+  ASSERT_EQ(ipc_shim_channel_write_vmo(h0_, &vmo_, &arena_, 0), ZX_OK);
+  EXPECT_EQ(vmo_.committed, 0u);
+  EXPECT_EQ(vmo_bootstrap_lookup(&vmo_, 0), nullptr);
+
+  vmo_t received;
+  ASSERT_EQ(ipc_shim_channel_read_vmo(h1_, &received), ZX_OK);
+  EXPECT_EQ(received.page_count, 4u);
+  EXPECT_EQ(vmo_bootstrap_lookup(&received, 0), page0_);
+  EXPECT_EQ(vmo_bootstrap_lookup(&received, 1), nullptr);
+  EXPECT_EQ(vmo_bootstrap_lookup(&received, 2), page2_);
+  EXPECT_EQ(page0_->ref_count, 1u);
+
+  vmo_bootstrap_destroy(&received, &arena_);
+}
+
+TEST_F(ChannelVmoTest, WriteVmoSharesPages) {
+  ASSERT_EQ(ipc_shim_channel_write_vmo(h0_, &vmo_, &arena_, CHANNEL_VMO_SHARE), ZX_OK);
+  EXPECT_EQ(vmo_bootstrap_lookup(&vmo_, 0), page0_);
+  EXPECT_EQ(page0_->ref_count, 2u);
+
+  vmo_t received;
+  ASSERT_EQ(ipc_shim_channel_read_vmo(h1_, &received), ZX_OK);
+  EXPECT_EQ(vmo_bootstrap_lookup(&received, 0), page0_);
+  EXPECT_EQ(vmo_bootstrap_lookup(&received, 2), page2_);
+
+  vmo_bootstrap_destroy(&received, &arena_);
+  EXPECT_EQ(page0_->ref_count, 1u);
+  EXPECT_EQ(page2_->ref_count, 1u);
+}
+
+TEST_F(ChannelVmoTest, UnreadPageMessageReturnsPagesOnClose) {
+  ASSERT_EQ(ipc_shim_channel_write_vmo(h0_, &vmo_, &arena_, CHANNEL_VMO_SHARE), ZX_OK);
+  ASSERT_EQ(ipc_shim_channel_close(h1_), ZX_OK);
+  EXPECT_EQ(page0_->ref_count, 1u);
+}
+
+TEST_F(ChannelVmoTest, ReadsRefuseTheWrongMessageType) {
+  uint8_t byte = 42;
+  ASSERT_EQ(ipc_shim_channel_write(h0_, &byte, 1), ZX_OK);
+  ASSERT_EQ(ipc_shim_channel_write_vmo(h0_, &vmo_, &arena_, CHANNEL_VMO_SHARE), ZX_OK);
+
+  // The byte message stays queued for channel_read.
+  vmo_t received;
+  EXPECT_EQ(ipc_shim_channel_read_vmo(h1_, &received), ZX_ERR_WRONG_TYPE);
+
+  // A batch stops in front of the page message, then refuses it.
+  uint8_t value = 0;
+  ipc_shim_message_t message = {&value, 1, 0};
+  uint32_t count = 0;
+  ASSERT_EQ(ipc_shim_channel_read_batch(h1_, &message, 1, &count), ZX_OK);
+  EXPECT_EQ(count, 1u);
+  EXPECT_EQ(value, 42);
+  EXPECT_EQ(ipc_shim_channel_read_batch(h1_, &message, 1, &count), ZX_ERR_WRONG_TYPE);
+  EXPECT_EQ(ipc_shim_channel_read(h1_, &value, 1, nullptr), ZX_ERR_WRONG_TYPE);
+
+  ASSERT_EQ(ipc_shim_channel_read_vmo(h1_, &received), ZX_OK);
+  EXPECT_EQ(vmo_bootstrap_lookup(&received, 0), page0_);
+  vmo_bootstrap_destroy(&received, &arena_);
+}
+
+}  // namespace
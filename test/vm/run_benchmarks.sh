@@ -0,0 +1,37 @@
+#!/bin/bash
+set -e
+
+# Builds and runs vm_benchmark against the system Google Benchmark, writing
+# JSON results to $OUT (vm_benchmark.json by default). Extra arguments go
+# to the benchmark, e.g. --benchmark_filter=-Soak to skip the soak run.
+
+SCRIPT_DIR="$( cd "$( dirname "${BASH_SOURCE[0]}" )" && pwd )"
+PROJECT_ROOT="$( cd "$SCRIPT_DIR/../.." && pwd )"
+OUT="${OUT:-vm_benchmark.json}"
+BUILD_DIR="$(mktemp -d)"
+trap 'rm -rf "$BUILD_DIR"' EXIT
+
+echo "Building VM benchmarks..."
+cd "$PROJECT_ROOT"
+
+for src in \
+    third_party/zircon_c/vm/pmm_arena.c \
+    third_party/zircon_c/vm/vmo_bootstrap.c \
+    third_party/zircon_c/vm/page_fault.c \
+    third_party/zircon_c/vm/page_reclaim.c \
+    third_party/zircon_c/vm/lz4.c \
+    third_party/zircon_c/ipc/channel.c \
+    third_party/zircon_c/ipc/handle.c \
+    third_party/zircon_c/ipc/message_packet.c \
+    test/vm/ipc_bench.c; do
+    gcc -O2 -std=c11 -I. -c "$src" -o "$BUILD_DIR/$(basename "$src").o"
+done
+g++ -O2 -std=c++17 -I. test/vm/vm_benchmark.cc "$BUILD_DIR"/*.o \
+    -lbenchmark -lpthread -o "$BUILD_DIR/vm_benchmark"
+
+echo ""
+echo "Running VM benchmarks..."
+"$BUILD_DIR/vm_benchmark" --benchmark_out="$OUT" --benchmark_out_format=json "$@"
+
+echo ""
+echo "Results written to $OUT"
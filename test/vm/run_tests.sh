@@ -12,7 +12,9 @@ gcc -o test_vm \
     third_party/zircon_c/vm/pmm_arena.c \
     third_party/zircon_c/vm/vmo_bootstrap.c \
     third_party/zircon_c/vm/page_fault.c \
-    -I.
+    third_party/zircon_c/vm/page_reclaim.c \
+    third_party/zircon_c/vm/lz4.c \
+    -I. -lpthread
 
 echo ""
 echo "Running VM tests..."
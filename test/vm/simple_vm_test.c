@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include "third_party/zircon_c/vm/pmm_arena.h"
 #include "third_party/zircon_c/vm/vmo_bootstrap.h"
@@ -97,6 +98,44 @@ TEST(pmm_arena_exhaustion) {
     free(arena.page_array);
 }
 
+TEST(pmm_arena_bulk_alloc_free) {
+    pmm_arena_t arena;
+    pmm_arena_init(&arena, 0x1000000, 4096 * 100);
+    
+    vm_page_t* pages[40];
+    zx_status_t status = pmm_arena_alloc_pages(&arena, 40, pages);
+    EXPECT_EQ(status, ZX_OK);
+    EXPECT_EQ(pmm_arena_free_count(&arena), 60);
+    
+    status = pmm_arena_alloc_pages(&arena, 61, pages);
+    EXPECT_EQ(status, ZX_ERR_NO_MEMORY);
+    EXPECT_EQ(pmm_arena_free_count(&arena), 60);
+    
+    status = pmm_arena_free_pages(&arena, pages, 40);
+    EXPECT_EQ(status, ZX_OK);
+    EXPECT_EQ(pmm_arena_free_count(&arena), 100);
+    
+    free(arena.page_array);
+}
+
+TEST(pmm_arena_alloc_contiguous) {
+    pmm_arena_t arena;
+    pmm_arena_init(&arena, 0x1000000, 4096 * 100);
+    
+    vm_page_t* first = NULL;
+    zx_status_t status = pmm_arena_alloc_contiguous(&arena, 10, 64 * 1024, &first);
+    EXPECT_EQ(status, ZX_OK);
+    EXPECT_EQ(pmm_arena_page_paddr(&arena, first) % (64 * 1024), 0);
+    EXPECT_EQ(pmm_arena_page_paddr(&arena, &first[9]), pmm_arena_page_paddr(&arena, first) + 9 * 4096);
+    EXPECT_EQ(pmm_arena_free_count(&arena), 90);
+    
+    status = pmm_arena_free_contiguous(&arena, first, 10);
+    EXPECT_EQ(status, ZX_OK);
+    EXPECT_EQ(pmm_arena_free_count(&arena), 100);
+    
+    free(arena.page_array);
+}
+
 TEST(vmo_bootstrap_initialization) {
     pmm_arena_t arena;
     pmm_arena_init(&arena, 0x1000000, 4096 * 100);
@@ -107,7 +146,7 @@ TEST(vmo_bootstrap_initialization) {
     EXPECT_EQ(status, ZX_OK);
     EXPECT_EQ(vmo.size, 4096 * 10);
     EXPECT_EQ(vmo.page_count, 10);
-    EXPECT_NE((long)vmo.pages, 0);
+    EXPECT_EQ(vmo.committed, 0);
     
     vmo_bootstrap_destroy(&vmo, &arena);
     free(arena.page_array);
@@ -125,7 +164,7 @@ TEST(vmo_bootstrap_commit_page) {
     zx_status_t status = vmo_bootstrap_commit_page(&vmo, &arena, 0);
     EXPECT_EQ(status, ZX_OK);
     EXPECT_EQ(pmm_arena_free_count(&arena), initial_free - 1);
-    EXPECT_NE((long)vmo.pages[0], 0);
+    EXPECT_NE((long)vmo_bootstrap_lookup(&vmo, 0), 0);
     
     status = vmo_bootstrap_commit_page(&vmo, &arena, 0);
     EXPECT_EQ(status, ZX_OK);
@@ -148,11 +187,90 @@ TEST(page_fault_handler_commits_page) {
     vaddr_t fault_addr = 4096 * 3;
     uint32_t flags = PAGE_FAULT_FLAG_READ | PAGE_FAULT_FLAG_USER;
     
-    EXPECT_EQ((long)vmo.pages[3], 0);
+    EXPECT_EQ((long)vmo_bootstrap_lookup(&vmo, 3), 0);
     
     zx_status_t status = page_fault_handle(&handler, fault_addr, flags);
     EXPECT_EQ(status, ZX_OK);
-    EXPECT_NE((long)vmo.pages[3], 0);
+    EXPECT_NE((long)vmo_bootstrap_lookup(&vmo, 3), 0);
+    
+    vmo_bootstrap_destroy(&vmo, &arena);
+    free(arena.page_array);
+}
+
+TEST(page_fault_sequential_fault_around) {
+    pmm_arena_t arena;
+    pmm_arena_init(&arena, 0x1000000, 4096 * 100);
+    
+    vmo_t vmo;
+    vmo_bootstrap_init(&vmo, &arena, 4096 * 32);
+    
+    page_fault_handler_t handler;
+    page_fault_handler_init(&handler, &vmo, &arena);
+    
+    uint32_t flags = PAGE_FAULT_FLAG_WRITE | PAGE_FAULT_FLAG_USER;
+    EXPECT_EQ(page_fault_handle(&handler, 0, flags), ZX_OK);
+    EXPECT_EQ(pmm_arena_free_count(&arena), 99);
+    
+    /* The second sequential fault commits the whole aligned window. */
+    EXPECT_EQ(page_fault_handle(&handler, 4096, flags), ZX_OK);
+    EXPECT_EQ(pmm_arena_free_count(&arena), 100 - PAGE_FAULT_AROUND_PAGES);
+    EXPECT_NE((long)vmo_bootstrap_lookup(&vmo, PAGE_FAULT_AROUND_PAGES - 1), 0);
+    EXPECT_EQ((long)vmo_bootstrap_lookup(&vmo, PAGE_FAULT_AROUND_PAGES), 0);
+    
+    vmo_bootstrap_destroy(&vmo, &arena);
+    free(arena.page_array);
+}
+
+TEST(page_fault_read_maps_zero_page) {
+    pmm_arena_t arena;
+    pmm_arena_init(&arena, 0x1000000, 4096 * 100);
+    
+    vmo_t vmo;
+    vmo_bootstrap_init(&vmo, &arena, 4096 * 10);
+    
+    page_fault_handler_t handler;
+    page_fault_handler_init(&handler, &vmo, &arena);
+    
+    uint32_t read = PAGE_FAULT_FLAG_READ | PAGE_FAULT_FLAG_USER;
+    EXPECT_EQ(page_fault_handle(&handler, 4096 * 1, read), ZX_OK);
+    EXPECT_EQ(page_fault_handle(&handler, 4096 * 5, read), ZX_OK);
+    EXPECT_EQ((long)vmo_bootstrap_lookup(&vmo, 1), (long)vmo_bootstrap_lookup(&vmo, 5));
+    EXPECT_EQ(pmm_arena_free_count(&arena), 99);
+    
+    EXPECT_EQ(page_fault_handle(&handler, 4096 * 5, PAGE_FAULT_FLAG_WRITE | PAGE_FAULT_FLAG_USER), ZX_OK);
+    EXPECT_NE((long)vmo_bootstrap_lookup(&vmo, 1), (long)vmo_bootstrap_lookup(&vmo, 5));
+    EXPECT_EQ(pmm_arena_free_count(&arena), 98);
+    
+    vmo_bootstrap_destroy(&vmo, &arena);
+    free(arena.page_array);
+}
+
+TEST(vmo_compress_page_round_trip) {
+    static uint8_t physmap[4096 * 100];
+    pmm_arena_t arena;
+    pmm_arena_init(&arena, 0x1000000, 4096 * 100);
+    pmm_arena_set_physmap(&arena, physmap);
+    
+    vmo_t vmo;
+    vmo_bootstrap_init(&vmo, &arena, 4096 * 2);
+    EXPECT_EQ(vmo_bootstrap_commit_range(&vmo, &arena, 0, 2), ZX_OK);
+    uint8_t* data = pmm_arena_page_data(&arena, vmo_bootstrap_lookup(&vmo, 0));
+    memset(data, 'x', 4096);
+    EXPECT_EQ(pmm_arena_free_count(&arena), 98);
+    
+    size_t size;
+    EXPECT_EQ(vmo_bootstrap_compress_page(&vmo, &arena, 0, &size), ZX_OK);
+    EXPECT_EQ(vmo_bootstrap_is_compressed(&vmo, 0), 1);
+    EXPECT_EQ(vmo_bootstrap_compress_page(&vmo, &arena, 1, &size), ZX_OK);
+    EXPECT_EQ(size, 0);
+    EXPECT_EQ(pmm_arena_free_count(&arena), 100);
+    
+    page_fault_handler_t handler;
+    page_fault_handler_init(&handler, &vmo, &arena);
+    EXPECT_EQ(page_fault_handle(&handler, 0, PAGE_FAULT_FLAG_READ | PAGE_FAULT_FLAG_USER), ZX_OK);
+    data = pmm_arena_page_data(&arena, vmo_bootstrap_lookup(&vmo, 0));
+    EXPECT_EQ(data[0], 'x');
+    EXPECT_EQ(data[4095], 'x');
     
     vmo_bootstrap_destroy(&vmo, &arena);
     free(arena.page_array);
@@ -210,9 +328,14 @@ int main() {
     run_test_pmm_arena_allocate_page();
     run_test_pmm_arena_free_page();
     run_test_pmm_arena_exhaustion();
+    run_test_pmm_arena_bulk_alloc_free();
+    run_test_pmm_arena_alloc_contiguous();
     run_test_vmo_bootstrap_initialization();
     run_test_vmo_bootstrap_commit_page();
     run_test_page_fault_handler_commits_page();
+    run_test_page_fault_sequential_fault_around();
+    run_test_page_fault_read_maps_zero_page();
+    run_test_vmo_compress_page_round_trip();
     run_test_page_fault_out_of_bounds();
     run_test_reference_counting();
     
@@ -0,0 +1,464 @@
+// Microbenchmarks and a soak run for the zircon_c VM and IPC layers.
+//
+// Run with --benchmark_format=json, or --benchmark_out=<file>
+// --benchmark_out_format=json, to get machine-readable results.
+// run_benchmarks.sh does the latter.
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "third_party/zircon_c/vm/pmm_arena.h"
+#include "third_party/zircon_c/vm/vmo_bootstrap.h"
+#include "third_party/zircon_c/vm/page_fault.h"
+#include "third_party/zircon_c/vm/page_reclaim.h"
+#include "test/vm/ipc_bench.h"
+
+namespace {
+
+constexpr paddr_t kArenaBase = 0x1000000;
+
+// Owns an arena for the length of one benchmark run.
+class Arena {
+public:
+  explicit Arena(size_t pages) { pmm_arena_init(&arena_, kArenaBase, pages * PAGE_SIZE); }
+  ~Arena() { free(arena_.page_array); }
+
+  pmm_arena_t* get() { return &arena_; }
+
+private:
+  pmm_arena_t arena_;
+};
+
+// --- PMM ---------------------------------------------------------------
+
+// Shared by every thread of a multithreaded run. Setup and Teardown run
+// once per run, before the threads start and after they have all finished.
+Arena* g_shared_arena;
+
+void SetupSharedArena(const benchmark::State&) { g_shared_arena = new Arena(4096); }
+void TeardownSharedArena(const benchmark::State&) { delete g_shared_arena; }
+
+void BM_PmmAllocFree(benchmark::State& state) {
+  pmm_arena_t* arena = g_shared_arena->get();
+  for (auto _ : state) {
+    vm_page_t* page;
+    if (pmm_arena_alloc_page(arena, &page) != ZX_OK) {
+      state.SkipWithError("arena exhausted");
+      break;
+    }
+    pmm_arena_free_page(arena, page);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_PmmAllocFree)
+    ->Setup(SetupSharedArena)
+    ->Teardown(TeardownSharedArena)
+    ->ThreadRange(1, 8)
+    ->UseRealTime();
+
+// Holds a working set of pages so frees and allocations cross the
+// magazines into the buddy lists, rather than recycling one page.
+void BM_PmmAllocFreeWorkingSet(benchmark::State& state) {
+  pmm_arena_t* arena = g_shared_arena->get();
+  std::vector<vm_page_t*> pages(static_cast<size_t>(state.range(0)));
+  for (auto _ : state) {
+    size_t allocated = 0;
+    while (allocated < pages.size() && pmm_arena_alloc_page(arena, &pages[allocated]) == ZX_OK) {
+      allocated++;
+    }
+    for (size_t i = 0; i < allocated; i++) {
+      pmm_arena_free_page(arena, pages[i]);
+    }
+    if (allocated < pages.size()) {
+      state.SkipWithError("arena exhausted");
+      break;
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_PmmAllocFreeWorkingSet)
+    ->Setup(SetupSharedArena)
+    ->Teardown(TeardownSharedArena)
+    ->Arg(256)
+    ->ThreadRange(1, 8)
+    ->UseRealTime();
+
+void BM_PmmAllocPagesBulk(benchmark::State& state) {
+  Arena arena(4096);
+  std::vector<vm_page_t*> pages(static_cast<size_t>(state.range(0)));
+  for (auto _ : state) {
+    if (pmm_arena_alloc_pages(arena.get(), pages.size(), pages.data()) != ZX_OK) {
+      state.SkipWithError("arena exhausted");
+      break;
+    }
+    pmm_arena_free_pages(arena.get(), pages.data(), pages.size());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_PmmAllocPagesBulk)->RangeMultiplier(4)->Range(16, 1024);
+
+void BM_PmmAllocContiguous(benchmark::State& state) {
+  Arena arena(4096);
+  size_t count = static_cast<size_t>(state.range(0));
+  for (auto _ : state) {
+    vm_page_t* first;
+    if (pmm_arena_alloc_contiguous(arena.get(), count, 0, &first) != ZX_OK) {
+      state.SkipWithError("no contiguous run");
+      break;
+    }
+    pmm_arena_free_contiguous(arena.get(), first, count);
+  }
+}
+BENCHMARK(BM_PmmAllocContiguous)->RangeMultiplier(4)->Range(1, 1024);
+
+// --- Page faults ---------------------------------------------------------
+
+enum FaultPattern { kSequentialWrite, kRandomWrite, kSequentialRead };
+
+// Faults every page of a fresh VMO per iteration and reports the cost per
+// page. Setting up and tearing down the VMO is left out of the timing.
+void BM_PageFault(benchmark::State& state) {
+  constexpr size_t kPages = 1024;
+  Arena arena(kPages + 64);
+
+  auto pattern = static_cast<FaultPattern>(state.range(0));
+  std::vector<size_t> order(kPages);
+  for (size_t i = 0; i < kPages; i++) {
+    order[i] = i;
+  }
+  if (pattern == kRandomWrite) {
+    std::shuffle(order.begin(), order.end(), std::mt19937(42));
+  }
+  uint32_t flags = PAGE_FAULT_FLAG_USER |
+                   (pattern == kSequentialRead ? PAGE_FAULT_FLAG_READ : PAGE_FAULT_FLAG_WRITE);
+
+  for (auto _ : state) {
+    state.PauseTiming();
+    vmo_t vmo;
+    vmo_bootstrap_init(&vmo, arena.get(), kPages * PAGE_SIZE);
+    page_fault_handler_t handler;
+    page_fault_handler_init(&handler, &vmo, arena.get());
+    state.ResumeTiming();
+
+    for (size_t index : order) {
+      // Pages that fault-around already committed resolve without allocating.
+      if (page_fault_handle(&handler, index * PAGE_SIZE, flags) != ZX_OK) {
+        state.SkipWithError("fault failed");
+        break;
+      }
+    }
+
+    state.PauseTiming();
+    vmo_bootstrap_destroy(&vmo, arena.get());
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * kPages);
+}
+BENCHMARK(BM_PageFault)
+    ->Arg(kSequentialWrite)
+    ->Arg(kRandomWrite)
+    ->Arg(kSequentialRead)
+    ->ArgName("pattern");
+
+// The cost of a fault that only has to decompress: every page is compressed
+// before the timed faults bring it back.
+void BM_PageFaultDecompress(benchmark::State& state) {
+  constexpr size_t kPages = 256;
+  Arena arena(kPages + 64);
+  std::vector<uint8_t> physmap(arena.get()->page_count * PAGE_SIZE);
+  pmm_arena_set_physmap(arena.get(), physmap.data());
+
+  vmo_t vmo;
+  vmo_bootstrap_init(&vmo, arena.get(), kPages * PAGE_SIZE);
+  vmo_bootstrap_commit_range(&vmo, arena.get(), 0, kPages);
+  for (size_t i = 0; i < kPages; i++) {
+    auto* data = static_cast<uint8_t*>(pmm_arena_page_data(arena.get(), vmo_bootstrap_lookup(&vmo, i)));
+    for (size_t j = 0; j < PAGE_SIZE; j++) {
+      data[j] = static_cast<uint8_t>((j / 64 + i) & 0x7);
+    }
+  }
+  page_fault_handler_t handler;
+  page_fault_handler_init(&handler, &vmo, arena.get());
+
+  for (auto _ : state) {
+    state.PauseTiming();
+    for (size_t i = 0; i < kPages; i++) {
+      size_t size;
+      vmo_bootstrap_compress_page(&vmo, arena.get(), i, &size);
+    }
+    state.ResumeTiming();
+
+    for (size_t i = 0; i < kPages; i++) {
+      page_fault_handle(&handler, i * PAGE_SIZE, PAGE_FAULT_FLAG_READ | PAGE_FAULT_FLAG_USER);
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * kPages);
+  vmo_bootstrap_destroy(&vmo, arena.get());
+}
+BENCHMARK(BM_PageFaultDecompress);
+
+// --- VMOs ----------------------------------------------------------------
+
+// Init and destroy of an untouched VMO, from 1 MiB to 64 GiB.
+void BM_VmoBootstrapInit(benchmark::State& state) {
+  Arena arena(16);
+  uint64_t size = static_cast<uint64_t>(state.range(0)) << 20;
+  for (auto _ : state) {
+    vmo_t vmo;
+    if (vmo_bootstrap_init(&vmo, arena.get(), size) != ZX_OK) {
+      state.SkipWithError("init failed");
+      break;
+    }
+    benchmark::DoNotOptimize(vmo.root);
+    vmo_bootstrap_destroy(&vmo, arena.get());
+  }
+}
+BENCHMARK(BM_VmoBootstrapInit)->RangeMultiplier(16)->Range(1, 64 << 10)->ArgName("MiB");
+
+// --- Handles -------------------------------------------------------------
+
+void BM_HandleGet(benchmark::State& state) {
+  auto num_handles = static_cast<uint32_t>(state.range(0));
+  ipc_bench_table_t* table = ipc_bench_table_create(num_handles);
+  if (!table) {
+    state.SkipWithError("table setup failed");
+    return;
+  }
+
+  // Look handles up in a random order, so large tables miss in the cache
+  // the way a busy process's would.
+  std::vector<uint32_t> handles(4096);
+  std::mt19937 rng(42);
+  for (auto& handle : handles) {
+    handle = ipc_bench_table_handle(table, rng() % num_handles);
+  }
+
+  size_t next = 0;
+  for (auto _ : state) {
+    int32_t status = ipc_bench_handle_get(table, handles[next]);
+    benchmark::DoNotOptimize(status);
+    next = (next + 1) & (handles.size() - 1);
+  }
+  state.SetItemsProcessed(state.iterations());
+  ipc_bench_table_destroy(table);
+}
+BENCHMARK(BM_HandleGet)->Arg(10)->Arg(1000)->Arg(100000)->ArgName("handles");
+
+// --- Channels ------------------------------------------------------------
+
+constexpr int64_t kMessageSizes[] = {0, 64, 1024, 8192, 65536};
+
+// Write followed by read on one thread: the cost of the message path alone.
+void BM_ChannelWriteRead(benchmark::State& state) {
+  uint32_t h0, h1;
+  if (ipc_bench_channel_create(&h0, &h1) != ZX_OK) {
+    state.SkipWithError("channel setup failed");
+    return;
+  }
+
+  auto size = static_cast<uint32_t>(state.range(0));
+  std::vector<uint8_t> out(size, 0x5a), in(size);
+  for (auto _ : state) {
+    uint32_t actual;
+    if (ipc_bench_channel_write(h0, out.data(), size) != ZX_OK ||
+        ipc_bench_channel_read(h1, in.data(), size, &actual) != ZX_OK) {
+      state.SkipWithError("channel io failed");
+      break;
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * size);
+  ipc_bench_channel_close(h0);
+  ipc_bench_channel_close(h1);
+}
+BENCHMARK(BM_ChannelWriteRead)->ArgsProduct({std::vector<int64_t>(std::begin(kMessageSizes), std::end(kMessageSizes))});
+
+// A message to an echo thread and back, waking a blocked reader each way.
+void BM_ChannelRoundTrip(benchmark::State& state) {
+  uint32_t h0, h1;
+  if (ipc_bench_channel_create(&h0, &h1) != ZX_OK) {
+    state.SkipWithError("channel setup failed");
+    return;
+  }
+
+  auto size = static_cast<uint32_t>(state.range(0));
+  std::thread echo([h1, size] {
+    std::vector<uint8_t> buffer(size);
+    uint32_t actual;
+    while (ipc_bench_channel_wait_readable(h1) == ZX_OK &&
+           ipc_bench_channel_read(h1, buffer.data(), size, &actual) == ZX_OK) {
+      ipc_bench_channel_write(h1, buffer.data(), actual);
+    }
+  });
+
+  std::vector<uint8_t> out(size, 0x5a), in(size);
+  for (auto _ : state) {
+    uint32_t actual;
+    if (ipc_bench_channel_write(h0, out.data(), size) != ZX_OK ||
+        ipc_bench_channel_wait_readable(h0) != ZX_OK ||
+        ipc_bench_channel_read(h0, in.data(), size, &actual) != ZX_OK) {
+      state.SkipWithError("channel io failed");
+      break;
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * size * 2);
+
+  // Closing our end wakes the echo thread with PEER_CLOSED.
+  ipc_bench_channel_close(h0);
+  echo.join();
+  ipc_bench_channel_close(h1);
+}
+BENCHMARK(BM_ChannelRoundTrip)
+    ->ArgsProduct({std::vector<int64_t>(std::begin(kMessageSizes), std::end(kMessageSizes))})
+    ->UseRealTime();
+
+// --- Soak ----------------------------------------------------------------
+
+// Several threads fault, write and verify pages in their own VMOs on one
+// arena while the background reclaimer compresses them underneath. It is a
+// correctness run more than a measurement: any page that reads back wrong,
+// and any page left allocated at the end, fails the benchmark. It runs for
+// ten seconds; skip it with --benchmark_filter=-Soak.
+constexpr size_t kSoakThreads = 4;
+constexpr size_t kSoakPagesPerThread = 128;
+
+struct Soak {
+  Arena arena{kSoakThreads * kSoakPagesPerThread * 3 / 4 + 64};
+  std::vector<uint8_t> physmap;
+  vm_reclaimer_t reclaimer;
+  vmo_t vmos[kSoakThreads];
+  std::atomic<bool> failed{false};
+};
+Soak* g_soak;
+
+// Page |index| of thread |thread| always holds a pattern derived from its
+// stamp, so a page restored from the wrong data, or from nowhere, shows up.
+void FillSoakPage(uint8_t* data, uint32_t stamp) {
+  for (size_t i = 0; i < PAGE_SIZE; i += sizeof(stamp)) {
+    uint32_t word = stamp ^ static_cast<uint32_t>(i / 256);
+    memcpy(data + i, &word, sizeof(word));
+  }
+}
+
+bool CheckSoakPage(const uint8_t* data, uint32_t stamp) {
+  std::vector<uint8_t> expected(PAGE_SIZE);
+  FillSoakPage(expected.data(), stamp);
+  return memcmp(data, expected.data(), PAGE_SIZE) == 0;
+}
+
+// Faults |index| in for writing or reading and runs |fn| on its data under
+// the VMO lock. The reclaimer can take the page back between the fault and
+// the lock, so the fault is retried until the page is still there. A fault
+// that finds the arena empty waits for the reclaimer, which may need several
+// laps of the clock to age pages out, for up to ten seconds.
+template <typename Fn>
+bool WithPage(pmm_arena_t* arena, vmo_t* vmo, page_fault_handler_t* handler, size_t index,
+              uint32_t flags, Fn fn) {
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+  for (;;) {
+    zx_status_t status = page_fault_handle(handler, index * PAGE_SIZE, flags);
+    if (status == ZX_ERR_NO_MEMORY && std::chrono::steady_clock::now() < deadline) {
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+      continue;
+    }
+    if (status != ZX_OK) {
+      return false;
+    }
+    vm_spin_lock(&vmo->lock);
+    vm_page_t* page = vmo_bootstrap_lookup(vmo, index);
+    if (page != nullptr) {
+      fn(static_cast<uint8_t*>(pmm_arena_page_data(arena, page)));
+      vm_spin_unlock(&vmo->lock);
+      return true;
+    }
+    vm_spin_unlock(&vmo->lock);
+  }
+}
+
+void SetupSoak(const benchmark::State&) {
+  g_soak = new Soak;
+  pmm_arena_t* arena = g_soak->arena.get();
+  g_soak->physmap.resize(arena->page_count * PAGE_SIZE);
+  pmm_arena_set_physmap(arena, g_soak->physmap.data());
+  size_t low = arena->page_count / 8;
+  vm_reclaimer_init(&g_soak->reclaimer, arena, low, low * 2);
+  for (auto& vmo : g_soak->vmos) {
+    vmo_bootstrap_init(&vmo, arena, kSoakPagesPerThread * PAGE_SIZE);
+    vm_reclaimer_add_vmo(&g_soak->reclaimer, &vmo);
+  }
+  vm_reclaimer_start(&g_soak->reclaimer);
+}
+
+void TeardownSoak(const benchmark::State&) { delete g_soak; }
+
+void BM_SoakFaultReclaim(benchmark::State& state) {
+  size_t thread = static_cast<size_t>(state.thread_index());
+  pmm_arena_t* arena = g_soak->arena.get();
+  vmo_t* vmo = &g_soak->vmos[thread];
+  page_fault_handler_t handler;
+  page_fault_handler_init(&handler, vmo, arena);
+
+  // stamps[i] is 0 until page i is first written.
+  std::vector<uint32_t> stamps(kSoakPagesPerThread);
+  std::mt19937 rng(static_cast<uint32_t>(thread) + 1);
+  uint32_t next_stamp = static_cast<uint32_t>(thread) << 24;
+  for (auto _ : state) {
+    size_t index = rng() % kSoakPagesPerThread;
+    bool ok;
+    if (stamps[index] == 0 || rng() % 4 == 0) {
+      uint32_t stamp = ++next_stamp;
+      ok = WithPage(arena, vmo, &handler, index, PAGE_FAULT_FLAG_WRITE | PAGE_FAULT_FLAG_USER,
+                    [stamp](uint8_t* data) { FillSoakPage(data, stamp); });
+      stamps[index] = stamp;
+    } else {
+      uint32_t stamp = stamps[index];
+      bool match = false;
+      ok = WithPage(arena, vmo, &handler, index, PAGE_FAULT_FLAG_READ | PAGE_FAULT_FLAG_USER,
+                    [stamp, &match](uint8_t* data) { match = CheckSoakPage(data, stamp); });
+      ok = ok && match;
+    }
+    if (!ok) {
+      g_soak->failed = true;
+      state.SkipWithError("page lost or corrupted");
+      break;
+    }
+  }
+  state.SetItemsProcessed(state.iterations());
+
+  // Every thread has left the loop by now, so thread 0 can check the arena.
+  if (thread == 0) {
+    vm_reclaimer_stop(&g_soak->reclaimer);
+    vm_reclaim_stats_t stats;
+    vm_reclaimer_get_stats(&g_soak->reclaimer, &stats);
+    state.counters["compressed"] = static_cast<double>(stats.compressed);
+    state.counters["dropped"] = static_cast<double>(stats.dropped);
+
+    for (auto& vmo : g_soak->vmos) {
+      vmo_bootstrap_destroy(&vmo, arena);
+    }
+    vm_reclaimer_destroy(&g_soak->reclaimer);
+    pmm_arena_drain_magazines(arena);
+    // Everything but the zero page, which the arena keeps for good.
+    size_t expected = arena->page_count - (arena->zero_page != nullptr ? 1 : 0);
+    if (!g_soak->failed && pmm_arena_free_count(arena) != expected) {
+      state.SkipWithError("pages leaked");
+    }
+  }
+}
+BENCHMARK(BM_SoakFaultReclaim)
+    ->Setup(SetupSoak)
+    ->Teardown(TeardownSoak)
+    ->Threads(kSoakThreads)
+    ->MinTime(10.0)
+    ->UseRealTime();
+
+}  // namespace
+
+BENCHMARK_MAIN();
@@ -1,7 +1,15 @@
 #include <gtest/gtest.h>
+
+#include <chrono>
+#include <cstring>
+#include <thread>
+#include <vector>
+
 #include "third_party/zircon_c/vm/pmm_arena.h"
 #include "third_party/zircon_c/vm/vmo_bootstrap.h"
 #include "third_party/zircon_c/vm/page_fault.h"
+#include "third_party/zircon_c/vm/page_reclaim.h"
+#include "third_party/zircon_c/vm/lz4.h"
 
 class VmTest : public ::testing::Test {
 protected:
@@ -75,6 +83,134 @@ TEST_F(VmTest, PmmArenaExhaustion) {
   EXPECT_EQ(status, ZX_ERR_NO_MEMORY);
 }
 
+TEST_F(VmTest, PmmArenaBulkAllocFree) {
+  vm_page_t* pages[40];
+
+  ASSERT_EQ(pmm_arena_alloc_pages(&arena_, 40, pages), ZX_OK);
+  EXPECT_EQ(pmm_arena_free_count(&arena_), 60);
+  for (int i = 0; i < 40; i++) {
+    EXPECT_EQ(pages[i]->state, VM_PAGE_STATE_ALLOCATED);
+    EXPECT_EQ(pages[i]->ref_count, 1);
+  }
+
+  EXPECT_EQ(pmm_arena_free_pages(&arena_, pages, 40), ZX_OK);
+  EXPECT_EQ(pmm_arena_free_count(&arena_), 100);
+  EXPECT_EQ(pages[0]->state, VM_PAGE_STATE_FREE);
+}
+
+TEST_F(VmTest, PmmArenaBulkAllocAllOrNothing) {
+  vm_page_t* pages[101];
+
+  EXPECT_EQ(pmm_arena_alloc_pages(&arena_, 101, pages), ZX_ERR_NO_MEMORY);
+  EXPECT_EQ(pmm_arena_free_count(&arena_), 100);
+}
+
+TEST_F(VmTest, PmmArenaReclaimsOtherMagazines) {
+  // Pages freed on another thread sit in that thread's magazine, but must
+  // still reach allocations made here.
+  std::thread other([this] {
+    vm_page_t* page = nullptr;
+    for (int i = 0; i < 10; i++) {
+      ASSERT_EQ(pmm_arena_alloc_page(&arena_, &page), ZX_OK);
+      pmm_arena_free_page(&arena_, page);
+    }
+  });
+  other.join();
+
+  vm_page_t* pages[100];
+  ASSERT_EQ(pmm_arena_alloc_pages(&arena_, 100, pages), ZX_OK);
+  EXPECT_EQ(pmm_arena_free_count(&arena_), 0);
+  EXPECT_EQ(pmm_arena_free_pages(&arena_, pages, 100), ZX_OK);
+  EXPECT_EQ(pmm_arena_free_count(&arena_), 100);
+}
+
+TEST_F(VmTest, PmmArenaConcurrentAllocFree) {
+  std::thread threads[4];
+  for (auto& thread : threads) {
+    thread = std::thread([this] {
+      for (int i = 0; i < 10000; i++) {
+        vm_page_t* page = nullptr;
+        if (pmm_arena_alloc_page(&arena_, &page) == ZX_OK) {
+          pmm_arena_free_page(&arena_, page);
+        }
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  EXPECT_EQ(pmm_arena_free_count(&arena_), 100);
+}
+
+TEST_F(VmTest, PageMetadataLayout) {
+  EXPECT_EQ(sizeof(vm_page_t), 16u);
+
+  vm_page_t* page = &arena_.page_array[7];
+  EXPECT_EQ(pmm_arena_page_paddr(&arena_, page), 0x1000000u + 7 * 4096);
+  EXPECT_EQ(pmm_arena_paddr_to_page(&arena_, 0x1000000 + 7 * 4096 + 123), page);
+  EXPECT_EQ(pmm_arena_paddr_to_page(&arena_, 0xFFF000), nullptr);
+  EXPECT_EQ(pmm_arena_paddr_to_page(&arena_, 0x1000000 + 100 * 4096), nullptr);
+}
+
+TEST_F(VmTest, PmmArenaAllocContiguous) {
+  vm_page_t* first = nullptr;
+  ASSERT_EQ(pmm_arena_alloc_contiguous(&arena_, 10, 64 * 1024, &first), ZX_OK);
+  paddr_t paddr = pmm_arena_page_paddr(&arena_, first);
+  EXPECT_EQ(paddr % (64 * 1024), 0u);
+  for (int i = 0; i < 10; i++) {
+    EXPECT_EQ(pmm_arena_page_paddr(&arena_, &first[i]), paddr + i * 4096);
+    EXPECT_EQ(first[i].state, VM_PAGE_STATE_ALLOCATED);
+  }
+  // Only the pages asked for are taken, not the whole power-of-two block.
+  EXPECT_EQ(pmm_arena_free_count(&arena_), 90);
+
+  EXPECT_EQ(pmm_arena_free_contiguous(&arena_, first, 10), ZX_OK);
+  EXPECT_EQ(pmm_arena_free_count(&arena_), 100);
+}
+
+TEST_F(VmTest, PmmArenaAllocContiguousInvalidArgs) {
+  vm_page_t* first = nullptr;
+  EXPECT_EQ(pmm_arena_alloc_contiguous(&arena_, 0, 0, &first), ZX_ERR_INVALID_ARGS);
+  EXPECT_EQ(pmm_arena_alloc_contiguous(&arena_, 4, 3 * 4096, &first), ZX_ERR_INVALID_ARGS);
+  EXPECT_EQ(pmm_arena_alloc_contiguous(&arena_, 4, 1024, &first), ZX_ERR_INVALID_ARGS);
+  EXPECT_EQ(pmm_arena_alloc_contiguous(&arena_, 101, 0, &first), ZX_ERR_NO_MEMORY);
+}
+
+TEST_F(VmTest, PmmArenaBuddiesMergeAfterFree) {
+  vm_page_t* pages[100];
+  for (int i = 0; i < 100; i++) {
+    ASSERT_EQ(pmm_arena_alloc_page(&arena_, &pages[i]), ZX_OK);
+  }
+
+  // Every other page free: plenty of memory, but no two adjacent pages.
+  for (int i = 0; i < 100; i += 2) {
+    pmm_arena_free_page(&arena_, pages[i]);
+  }
+  vm_page_t* first = nullptr;
+  EXPECT_EQ(pmm_arena_alloc_contiguous(&arena_, 2, 0, &first), ZX_ERR_NO_MEMORY);
+
+  for (int i = 1; i < 100; i += 2) {
+    pmm_arena_free_page(&arena_, pages[i]);
+  }
+  ASSERT_EQ(pmm_arena_alloc_contiguous(&arena_, 64, 0, &first), ZX_OK);
+  EXPECT_EQ(pmm_arena_free_contiguous(&arena_, first, 64), ZX_OK);
+}
+
+TEST_F(VmTest, PmmArenaSinglePagesSpareLargeBlocks) {
+  vm_page_t* pages[20];
+  for (int i = 0; i < 20; i++) {
+    ASSERT_EQ(pmm_arena_alloc_page(&arena_, &pages[i]), ZX_OK);
+  }
+
+  // The 100-page arena holds blocks of 64, 32 and 4 pages; single pages
+  // must come out of the smaller ones.
+  vm_page_t* first = nullptr;
+  ASSERT_EQ(pmm_arena_alloc_contiguous(&arena_, 64, 0, &first), ZX_OK);
+  EXPECT_EQ(pmm_arena_free_contiguous(&arena_, first, 64), ZX_OK);
+  EXPECT_EQ(pmm_arena_free_pages(&arena_, pages, 20), ZX_OK);
+}
+
 TEST_F(VmTest, VmoBootstrapInitialization) {
   vmo_t vmo;
   zx_status_t status = vmo_bootstrap_init(&vmo, &arena_, 4096 * 10);
@@ -82,7 +218,8 @@ TEST_F(VmTest, VmoBootstrapInitialization) {
   ASSERT_EQ(status, ZX_OK);
   EXPECT_EQ(vmo.size, 4096 * 10);
   EXPECT_EQ(vmo.page_count, 10);
-  ASSERT_NE(vmo.pages, nullptr);
+  EXPECT_EQ(vmo.committed, 0u);
+  EXPECT_EQ(vmo.root, nullptr);
   
   vmo_bootstrap_destroy(&vmo, &arena_);
 }
@@ -96,7 +233,7 @@ TEST_F(VmTest, VmoBootstrapCommitPage) {
   zx_status_t status = vmo_bootstrap_commit_page(&vmo, &arena_, 0);
   EXPECT_EQ(status, ZX_OK);
   EXPECT_EQ(pmm_arena_free_count(&arena_), initial_free - 1);
-  EXPECT_NE(vmo.pages[0], nullptr);
+  EXPECT_NE(vmo_bootstrap_lookup(&vmo, 0), nullptr);
   
   status = vmo_bootstrap_commit_page(&vmo, &arena_, 0);
   EXPECT_EQ(status, ZX_OK);
@@ -115,13 +252,106 @@ TEST_F(VmTest, VmoBootstrapMultiplePages) {
   }
   
   for (size_t i = 0; i < 5; i++) {
-    EXPECT_NE(vmo.pages[i], nullptr);
+    EXPECT_NE(vmo_bootstrap_lookup(&vmo, i), nullptr);
   }
   
   vmo_bootstrap_destroy(&vmo, &arena_);
   EXPECT_EQ(pmm_arena_free_count(&arena_), 100);
 }
 
+TEST_F(VmTest, VmoBootstrapCommitRange) {
+  vmo_t vmo;
+  vmo_bootstrap_init(&vmo, &arena_, 4096 * 20);
+
+  ASSERT_EQ(vmo_bootstrap_commit_page(&vmo, &arena_, 6), ZX_OK);
+  vm_page_t* existing = vmo_bootstrap_lookup(&vmo, 6);
+
+  ASSERT_EQ(vmo_bootstrap_commit_range(&vmo, &arena_, 4, 8), ZX_OK);
+  for (size_t i = 0; i < 20; i++) {
+    if (i >= 4 && i < 12) {
+      EXPECT_NE(vmo_bootstrap_lookup(&vmo, i), nullptr);
+    } else {
+      EXPECT_EQ(vmo_bootstrap_lookup(&vmo, i), nullptr);
+    }
+  }
+  EXPECT_EQ(vmo_bootstrap_lookup(&vmo, 6), existing);
+  EXPECT_EQ(pmm_arena_free_count(&arena_), 92);
+
+  EXPECT_EQ(vmo_bootstrap_commit_range(&vmo, &arena_, 4, 8), ZX_OK);
+  EXPECT_EQ(pmm_arena_free_count(&arena_), 92);
+  EXPECT_EQ(vmo_bootstrap_commit_range(&vmo, &arena_, 16, 5), ZX_ERR_INVALID_ARGS);
+
+  vmo_bootstrap_destroy(&vmo, &arena_);
+  EXPECT_EQ(pmm_arena_free_count(&arena_), 100);
+}
+
+TEST_F(VmTest, VmoBootstrapCommitRangeAllOrNothing) {
+  vmo_t vmo;
+  vmo_bootstrap_init(&vmo, &arena_, 4096 * 200);
+
+  EXPECT_EQ(vmo_bootstrap_commit_range(&vmo, &arena_, 0, 150), ZX_ERR_NO_MEMORY);
+  for (size_t i = 0; i < 150; i++) {
+    EXPECT_EQ(vmo_bootstrap_lookup(&vmo, i), nullptr);
+  }
+  EXPECT_EQ(pmm_arena_free_count(&arena_), 100);
+
+  vmo_bootstrap_destroy(&vmo, &arena_);
+}
+
+TEST_F(VmTest, VmoBootstrapSparsePageMap) {
+  // A 4GB VMO costs nothing until pages are committed.
+  vmo_t vmo;
+  ASSERT_EQ(vmo_bootstrap_init(&vmo, &arena_, 1ull << 32), ZX_OK);
+  EXPECT_EQ(vmo.page_count, 1u << 20);
+  EXPECT_EQ(vmo.root, nullptr);
+
+  const size_t indices[] = {0, 63, 64, 4096, 777777, (1u << 20) - 1};
+  for (size_t index : indices) {
+    ASSERT_EQ(vmo_bootstrap_commit_page(&vmo, &arena_, index), ZX_OK);
+  }
+  EXPECT_EQ(vmo.committed, 6u);
+  EXPECT_EQ(vmo_bootstrap_lookup(&vmo, 1), nullptr);
+  EXPECT_EQ(vmo_bootstrap_lookup(&vmo, 777776), nullptr);
+
+  size_t visited = 0;
+  size_t index;
+  for (vm_page_t* page = vmo_bootstrap_next_page(&vmo, 0, &index); page != nullptr;
+       page = vmo_bootstrap_next_page(&vmo, index + 1, &index)) {
+    ASSERT_LT(visited, 6u);
+    EXPECT_EQ(index, indices[visited]);
+    EXPECT_EQ(page, vmo_bootstrap_lookup(&vmo, index));
+    visited++;
+  }
+  EXPECT_EQ(visited, 6u);
+
+  size_t found = 0;
+  EXPECT_NE(vmo_bootstrap_next_page(&vmo, 65, &found), nullptr);
+  EXPECT_EQ(found, 4096u);
+
+  vmo_bootstrap_destroy(&vmo, &arena_);
+  EXPECT_EQ(vmo.root, nullptr);
+  EXPECT_EQ(pmm_arena_free_count(&arena_), 100);
+}
+
+TEST_F(VmTest, VmoBootstrapSharePages) {
+  vmo_t vmo;
+  vmo_bootstrap_init(&vmo, &arena_, 4096 * 10);
+  ASSERT_EQ(vmo_bootstrap_commit_page(&vmo, &arena_, 2), ZX_OK);
+  ASSERT_EQ(vmo_bootstrap_commit_page(&vmo, &arena_, 7), ZX_OK);
+
+  vmo_t shared;
+  ASSERT_EQ(vmo_bootstrap_share_pages(&vmo, &shared), ZX_OK);
+  EXPECT_EQ(shared.size, vmo.size);
+  EXPECT_EQ(shared.committed, 2u);
+  EXPECT_EQ(vmo_bootstrap_lookup(&shared, 2), vmo_bootstrap_lookup(&vmo, 2));
+  EXPECT_EQ(vmo_bootstrap_lookup(&shared, 7)->ref_count, 2u);
+
+  vmo_bootstrap_destroy(&vmo, &arena_);
+  EXPECT_EQ(pmm_arena_free_count(&arena_), 98);
+  vmo_bootstrap_destroy(&shared, &arena_);
+  EXPECT_EQ(pmm_arena_free_count(&arena_), 100);
+}
+
 TEST_F(VmTest, PageFaultHandlerInitialization) {
   vmo_t vmo;
   vmo_bootstrap_init(&vmo, &arena_, 4096 * 10);
@@ -146,15 +376,131 @@ TEST_F(VmTest, PageFaultHandleCommitsPage) {
   vaddr_t fault_addr = 4096 * 3;
   uint32_t flags = PAGE_FAULT_FLAG_READ | PAGE_FAULT_FLAG_USER;
   
-  EXPECT_EQ(vmo.pages[3], nullptr);
+  EXPECT_EQ(vmo_bootstrap_lookup(&vmo, 3), nullptr);
   
   zx_status_t status = page_fault_handle(&handler, fault_addr, flags);
   EXPECT_EQ(status, ZX_OK);
-  EXPECT_NE(vmo.pages[3], nullptr);
+  EXPECT_NE(vmo_bootstrap_lookup(&vmo, 3), nullptr);
   
   vmo_bootstrap_destroy(&vmo, &arena_);
 }
 
+TEST_F(VmTest, PageFaultSequentialFaultAround) {
+  vmo_t vmo;
+  vmo_bootstrap_init(&vmo, &arena_, 4096 * 64);
+
+  page_fault_handler_t handler;
+  page_fault_handler_init(&handler, &vmo, &arena_);
+
+  // Touch every page in order, faulting only where nothing is mapped yet.
+  uint32_t flags = PAGE_FAULT_FLAG_WRITE | PAGE_FAULT_FLAG_USER;
+  size_t faults = 0;
+  for (size_t i = 0; i < 64; i++) {
+    if (vmo_bootstrap_lookup(&vmo, i) == nullptr) {
+      ASSERT_EQ(page_fault_handle(&handler, 4096 * i, flags), ZX_OK);
+      faults++;
+    }
+    ASSERT_NE(vmo_bootstrap_lookup(&vmo, i), nullptr);
+  }
+  EXPECT_EQ(faults, 5u);
+  EXPECT_EQ(pmm_arena_free_count(&arena_), 36);
+
+  vmo_bootstrap_destroy(&vmo, &arena_);
+}
+
+TEST_F(VmTest, PageFaultRandomAccessCommitsSinglePages) {
+  vmo_t vmo;
+  vmo_bootstrap_init(&vmo, &arena_, 4096 * 64);
+
+  page_fault_handler_t handler;
+  page_fault_handler_init(&handler, &vmo, &arena_);
+
+  uint32_t flags = PAGE_FAULT_FLAG_WRITE | PAGE_FAULT_FLAG_USER;
+  const size_t order[] = {40, 3, 17, 9, 60};
+  for (size_t index : order) {
+    ASSERT_EQ(page_fault_handle(&handler, 4096 * index, flags), ZX_OK);
+  }
+  EXPECT_EQ(pmm_arena_free_count(&arena_), 95);
+
+  vmo_bootstrap_destroy(&vmo, &arena_);
+}
+
+TEST_F(VmTest, PageFaultReadMapsZeroPage) {
+  vmo_t vmo;
+  vmo_bootstrap_init(&vmo, &arena_, 4096 * 10);
+
+  page_fault_handler_t handler;
+  page_fault_handler_init(&handler, &vmo, &arena_);
+
+  uint32_t read = PAGE_FAULT_FLAG_READ | PAGE_FAULT_FLAG_USER;
+  ASSERT_EQ(page_fault_handle(&handler, 4096 * 2, read), ZX_OK);
+  ASSERT_EQ(page_fault_handle(&handler, 4096 * 7, read), ZX_OK);
+  vm_page_t* zero = vmo_bootstrap_lookup(&vmo, 2);
+  ASSERT_NE(zero, nullptr);
+  EXPECT_EQ(zero, arena_.zero_page);
+  EXPECT_EQ(vmo_bootstrap_lookup(&vmo, 7), zero);
+  EXPECT_EQ(zero->ref_count, 3u);
+  EXPECT_EQ(pmm_arena_free_count(&arena_), 99);
+
+  // The first write swaps in a private page.
+  uint32_t write = PAGE_FAULT_FLAG_WRITE | PAGE_FAULT_FLAG_USER;
+  ASSERT_EQ(page_fault_handle(&handler, 4096 * 7, write), ZX_OK);
+  vm_page_t* page = vmo_bootstrap_lookup(&vmo, 7);
+  EXPECT_NE(page, zero);
+  EXPECT_EQ(page->ref_count, 1u);
+  EXPECT_EQ(zero->ref_count, 2u);
+  EXPECT_EQ(pmm_arena_free_count(&arena_), 98);
+
+  ASSERT_EQ(page_fault_handle(&handler, 4096 * 7, write), ZX_OK);
+  EXPECT_EQ(vmo_bootstrap_lookup(&vmo, 7), page);
+
+  vmo_bootstrap_destroy(&vmo, &arena_);
+  EXPECT_EQ(zero->ref_count, 1u);
+  EXPECT_EQ(pmm_arena_free_count(&arena_), 99);
+}
+
+TEST_F(VmTest, VmoCloneCopyOnWrite) {
+  vmo_t parent;
+  vmo_bootstrap_init(&parent, &arena_, 4096 * 4);
+  ASSERT_EQ(vmo_bootstrap_commit_range(&parent, &arena_, 0, 2), ZX_OK);
+  vm_page_t* first = vmo_bootstrap_lookup(&parent, 0);
+  vm_page_t* second = vmo_bootstrap_lookup(&parent, 1);
+
+  vmo_t child;
+  ASSERT_EQ(vmo_bootstrap_clone(&parent, &child), ZX_OK);
+  EXPECT_EQ(vmo_bootstrap_lookup(&child, 0), first);
+  EXPECT_EQ(first->ref_count, 2u);
+  EXPECT_EQ(pmm_arena_free_count(&arena_), 98);
+
+  page_fault_handler_t child_faults;
+  page_fault_handler_init(&child_faults, &child, &arena_);
+  page_fault_handler_t parent_faults;
+  page_fault_handler_init(&parent_faults, &parent, &arena_);
+  uint32_t write = PAGE_FAULT_FLAG_WRITE | PAGE_FAULT_FLAG_USER;
+
+  // Reads keep sharing; the child's write copies only the page it writes.
+  ASSERT_EQ(page_fault_handle(&child_faults, 0, PAGE_FAULT_FLAG_READ | PAGE_FAULT_FLAG_USER), ZX_OK);
+  EXPECT_EQ(vmo_bootstrap_lookup(&child, 0), first);
+  ASSERT_EQ(page_fault_handle(&child_faults, 0, write), ZX_OK);
+  EXPECT_NE(vmo_bootstrap_lookup(&child, 0), first);
+  EXPECT_EQ(vmo_bootstrap_lookup(&parent, 0), first);
+  EXPECT_EQ(first->ref_count, 1u);
+  EXPECT_EQ(vmo_bootstrap_lookup(&child, 1), second);
+
+  // The parent copies too, after which the child owns the original alone.
+  ASSERT_EQ(page_fault_handle(&parent_faults, 4096, write), ZX_OK);
+  EXPECT_NE(vmo_bootstrap_lookup(&parent, 1), second);
+  EXPECT_EQ(second->ref_count, 1u);
+  ASSERT_EQ(page_fault_handle(&child_faults, 4096 * 3, write), ZX_OK);
+  ASSERT_EQ(page_fault_handle(&child_faults, 4096, write), ZX_OK);
+  EXPECT_EQ(vmo_bootstrap_lookup(&child, 1), second);
+  EXPECT_EQ(pmm_arena_free_count(&arena_), 95);
+
+  vmo_bootstrap_destroy(&parent, &arena_);
+  vmo_bootstrap_destroy(&child, &arena_);
+  EXPECT_EQ(pmm_arena_free_count(&arena_), 100);
+}
+
 TEST_F(VmTest, PageFaultOutOfBounds) {
   vmo_t vmo;
   vmo_bootstrap_init(&vmo, &arena_, 4096 * 10);
@@ -187,6 +533,207 @@ TEST_F(VmTest, PageFaultInvalidFlags) {
   vmo_bootstrap_destroy(&vmo, &arena_);
 }
 
+// Fills a page with text that compresses well and differs per page.
+static void FillCompressible(uint8_t* data, size_t seed) {
+  for (size_t i = 0; i < PAGE_SIZE; i++) {
+    data[i] = static_cast<uint8_t>("page contents "[i % 14] + (i / 512 + seed) % 4);
+  }
+}
+
+TEST(Lz4Test, RoundTrip) {
+  std::vector<uint8_t> page(PAGE_SIZE);
+  FillCompressible(page.data(), 7);
+
+  std::vector<uint8_t> compressed(PAGE_SIZE);
+  size_t size = vm_lz4_compress(page.data(), page.size(), compressed.data(), compressed.size());
+  ASSERT_GT(size, 0u);
+  EXPECT_LT(size, PAGE_SIZE / 4u);
+
+  std::vector<uint8_t> out(PAGE_SIZE);
+  ASSERT_EQ(vm_lz4_decompress(compressed.data(), size, out.data(), out.size()), ZX_OK);
+  EXPECT_EQ(out, page);
+
+  EXPECT_EQ(vm_lz4_decompress(compressed.data(), size - 1, out.data(), out.size()),
+            ZX_ERR_IO_DATA_INTEGRITY);
+  EXPECT_EQ(vm_lz4_decompress(compressed.data(), size, out.data(), out.size() - 1),
+            ZX_ERR_IO_DATA_INTEGRITY);
+}
+
+TEST(Lz4Test, IncompressibleInputDoesNotFit) {
+  std::vector<uint8_t> page(PAGE_SIZE);
+  uint32_t state = 12345;
+  for (auto& byte : page) {
+    state = state * 1103515245 + 12345;
+    byte = static_cast<uint8_t>(state >> 24);
+  }
+
+  std::vector<uint8_t> compressed(VMO_COMPRESSED_MAX_BYTES);
+  EXPECT_EQ(vm_lz4_compress(page.data(), page.size(), compressed.data(), compressed.size()), 0u);
+}
+
+class VmReclaimTest : public VmTest {
+protected:
+  void SetUp() override {
+    VmTest::SetUp();
+    physmap_.resize(arena_.page_count * PAGE_SIZE);
+    pmm_arena_set_physmap(&arena_, physmap_.data());
+  }
+
+  uint8_t* Data(vmo_t* vmo, size_t index) {
+    return static_cast<uint8_t*>(pmm_arena_page_data(&arena_, vmo_bootstrap_lookup(vmo, index)));
+  }
+
+  std::vector<uint8_t> physmap_;
+};
+
+TEST_F(VmReclaimTest, CommitZeroesAndCopyOnWriteCopies) {
+  memset(physmap_.data(), 0xAA, physmap_.size());
+
+  vmo_t parent;
+  vmo_bootstrap_init(&parent, &arena_, 4096 * 2);
+  ASSERT_EQ(vmo_bootstrap_commit_page(&parent, &arena_, 0), ZX_OK);
+  EXPECT_EQ(Data(&parent, 0)[100], 0);
+  FillCompressible(Data(&parent, 0), 1);
+
+  vmo_t child;
+  ASSERT_EQ(vmo_bootstrap_clone(&parent, &child), ZX_OK);
+  ASSERT_EQ(vmo_bootstrap_commit_page(&child, &arena_, 0), ZX_OK);
+  EXPECT_NE(Data(&child, 0), Data(&parent, 0));
+  EXPECT_EQ(memcmp(Data(&child, 0), Data(&parent, 0), PAGE_SIZE), 0);
+
+  vmo_bootstrap_destroy(&parent, &arena_);
+  vmo_bootstrap_destroy(&child, &arena_);
+}
+
+TEST_F(VmReclaimTest, CompressAndFaultBack) {
+  vmo_t vmo;
+  vmo_bootstrap_init(&vmo, &arena_, 4096 * 3);
+  ASSERT_EQ(vmo_bootstrap_commit_range(&vmo, &arena_, 0, 3), ZX_OK);
+  FillCompressible(Data(&vmo, 0), 3);
+  std::vector<uint8_t> expected(Data(&vmo, 0), Data(&vmo, 0) + PAGE_SIZE);
+  uint32_t state = 99;
+  for (size_t i = 0; i < PAGE_SIZE; i++) {
+    state = state * 1103515245 + 12345;
+    Data(&vmo, 2)[i] = static_cast<uint8_t>(state >> 24);
+  }
+  EXPECT_EQ(pmm_arena_free_count(&arena_), 97);
+
+  size_t size;
+  ASSERT_EQ(vmo_bootstrap_compress_page(&vmo, &arena_, 0, &size), ZX_OK);
+  EXPECT_GT(size, 0u);
+  EXPECT_TRUE(vmo_bootstrap_is_compressed(&vmo, 0));
+  EXPECT_EQ(vmo_bootstrap_lookup(&vmo, 0), nullptr);
+  EXPECT_EQ(vmo.compressed, 1u);
+
+  // Page 1 is still all zeros, so it is dropped rather than stored.
+  ASSERT_EQ(vmo_bootstrap_compress_page(&vmo, &arena_, 1, &size), ZX_OK);
+  EXPECT_EQ(size, 0u);
+  EXPECT_FALSE(vmo_bootstrap_is_compressed(&vmo, 1));
+  EXPECT_EQ(vmo_bootstrap_compress_page(&vmo, &arena_, 2, &size), ZX_ERR_BUFFER_TOO_SMALL);
+  EXPECT_EQ(pmm_arena_free_count(&arena_), 99);
+
+  page_fault_handler_t handler;
+  page_fault_handler_init(&handler, &vmo, &arena_);
+  ASSERT_EQ(page_fault_handle(&handler, 0, PAGE_FAULT_FLAG_READ | PAGE_FAULT_FLAG_USER), ZX_OK);
+  EXPECT_FALSE(vmo_bootstrap_is_compressed(&vmo, 0));
+  EXPECT_EQ(memcmp(Data(&vmo, 0), expected.data(), PAGE_SIZE), 0);
+  ASSERT_EQ(page_fault_handle(&handler, 4096, PAGE_FAULT_FLAG_READ | PAGE_FAULT_FLAG_USER), ZX_OK);
+  EXPECT_EQ(vmo_bootstrap_lookup(&vmo, 1), arena_.zero_page);
+
+  vmo_bootstrap_destroy(&vmo, &arena_);
+}
+
+TEST_F(VmReclaimTest, ClonesShareCompressedPages) {
+  vmo_t parent;
+  vmo_bootstrap_init(&parent, &arena_, 4096);
+  ASSERT_EQ(vmo_bootstrap_commit_page(&parent, &arena_, 0), ZX_OK);
+  FillCompressible(Data(&parent, 0), 5);
+  size_t size;
+  ASSERT_EQ(vmo_bootstrap_compress_page(&parent, &arena_, 0, &size), ZX_OK);
+
+  vmo_t child;
+  ASSERT_EQ(vmo_bootstrap_clone(&parent, &child), ZX_OK);
+  EXPECT_TRUE(vmo_bootstrap_is_compressed(&child, 0));
+  ASSERT_EQ(vmo_bootstrap_decompress_page(&child, &arena_, 0), ZX_OK);
+  EXPECT_TRUE(vmo_bootstrap_is_compressed(&parent, 0));
+
+  vmo_bootstrap_destroy(&parent, &arena_);
+  vmo_bootstrap_destroy(&child, &arena_);
+  EXPECT_EQ(pmm_arena_free_count(&arena_), 100);
+}
+
+TEST_F(VmReclaimTest, ClockSparesTouchedPages) {
+  vmo_t vmo;
+  vmo_bootstrap_init(&vmo, &arena_, 4096 * 8);
+  ASSERT_EQ(vmo_bootstrap_commit_range(&vmo, &arena_, 0, 8), ZX_OK);
+  for (size_t i = 0; i < 8; i++) {
+    FillCompressible(Data(&vmo, i), i);
+  }
+
+  vm_reclaimer_t reclaimer;
+  ASSERT_EQ(vm_reclaimer_init(&reclaimer, &arena_, 0, 0), ZX_OK);
+  ASSERT_EQ(vm_reclaimer_add_vmo(&reclaimer, &vmo), ZX_OK);
+
+  // Pages age one step per sweep; page 3 keeps being touched.
+  vm_page_t* hot = vmo_bootstrap_lookup(&vmo, 3);
+  for (int sweep = 0; sweep < VM_PAGE_AGE_COLD; sweep++) {
+    EXPECT_EQ(vm_reclaim_pages(&reclaimer, 100), 0u);
+    vm_page_mark_accessed(hot);
+  }
+  EXPECT_EQ(vm_reclaim_pages(&reclaimer, 100), 7u);
+  EXPECT_EQ(vmo_bootstrap_lookup(&vmo, 3), hot);
+  EXPECT_TRUE(vmo_bootstrap_is_compressed(&vmo, 0));
+  EXPECT_EQ(pmm_arena_free_count(&arena_), 99);
+
+  vm_reclaim_stats_t stats;
+  vm_reclaimer_get_stats(&reclaimer, &stats);
+  EXPECT_EQ(stats.compressed, 7u);
+  EXPECT_GT(stats.compressed_bytes, 0u);
+
+  vm_reclaimer_remove_vmo(&reclaimer, &vmo);
+  vm_reclaimer_destroy(&reclaimer);
+  vmo_bootstrap_destroy(&vmo, &arena_);
+  EXPECT_EQ(pmm_arena_free_count(&arena_), 100);
+}
+
+TEST_F(VmReclaimTest, WatermarkWakesBackgroundReclaim) {
+  vm_reclaimer_t reclaimer;
+  ASSERT_EQ(vm_reclaimer_init(&reclaimer, &arena_, 20, 40), ZX_OK);
+
+  vmo_t vmo;
+  vmo_bootstrap_init(&vmo, &arena_, 4096 * 90);
+  ASSERT_EQ(vm_reclaimer_add_vmo(&reclaimer, &vmo), ZX_OK);
+  ASSERT_EQ(vm_reclaimer_start(&reclaimer), ZX_OK);
+
+  page_fault_handler_t handler;
+  page_fault_handler_init(&handler, &vmo, &arena_);
+  uint32_t write = PAGE_FAULT_FLAG_WRITE | PAGE_FAULT_FLAG_USER;
+  for (size_t i = 0; i < 90; i++) {
+    ASSERT_EQ(page_fault_handle(&handler, 4096 * i, write), ZX_OK);
+    vm_spin_lock(&vmo.lock);
+    FillCompressible(Data(&vmo, i), i);
+    vm_spin_unlock(&vmo.lock);
+  }
+
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  while (pmm_arena_free_count(&arena_) < 40 && std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  vm_reclaimer_stop(&reclaimer);
+  EXPECT_GE(pmm_arena_free_count(&arena_), 40u);
+
+  // Every page still reads back, resident or not.
+  for (size_t i = 0; i < 90; i++) {
+    ASSERT_EQ(page_fault_handle(&handler, 4096 * i, PAGE_FAULT_FLAG_READ | PAGE_FAULT_FLAG_USER), ZX_OK);
+    std::vector<uint8_t> expected(PAGE_SIZE);
+    FillCompressible(expected.data(), i);
+    ASSERT_EQ(memcmp(Data(&vmo, i), expected.data(), PAGE_SIZE), 0) << "page " << i;
+  }
+
+  vm_reclaimer_destroy(&reclaimer);
+  vmo_bootstrap_destroy(&vmo, &arena_);
+}
+
 TEST_F(VmTest, ReferenceCountingBasic) {
   vm_page_t* page = nullptr;
   pmm_arena_alloc_page(&arena_, &page);
@@ -1,23 +1,160 @@
+#define _POSIX_C_SOURCE 200809L  /* clock_gettime, pthread_condattr_setclock */
+
 #include "channel.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+/*
+ * |refs| counts notifiers that picked the waiter off a list and have yet to
+ * signal it; the waiter stays alive until they are done.
+ */
+typedef struct channel_waiter {
+    pthread_mutex_t lock;
+    pthread_cond_t cv;
+    bool woken;
+    atomic_uint refs;
+} channel_waiter_t;
+
+/* |notified| is the last notify_seq that woke this link, under wait_lock. */
+typedef struct channel_wait_link {
+    channel_waiter_t* waiter;
+    struct channel_wait_link* next;
+    struct channel_wait_link* prev;
+    uint64_t notified;
+} channel_wait_link_t;
+
+/* Waiters collected per wait_lock hold in endpoint_notify. */
+#define NOTIFY_BATCH 8
 
 static handle_table_t g_handle_table;
-static bool g_handle_table_initialized = false;
+static pthread_once_t g_handle_table_once = PTHREAD_ONCE_INIT;
+
+static void init_handle_table(void) {
+    handle_table_init(&g_handle_table, 64);
+}
 
 handle_table_t* get_current_handle_table(void) {
-    if (!g_handle_table_initialized) {
-        handle_table_init(&g_handle_table, 64);
-        g_handle_table_initialized = true;
-    }
+    pthread_once(&g_handle_table_once, init_handle_table);
     return &g_handle_table;
 }
 
+zx_time_t zx_clock_get_monotonic(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (zx_time_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+zx_time_t zx_deadline_after(zx_duration_t duration) {
+    zx_time_t now = zx_clock_get_monotonic();
+    return duration > ZX_TIME_INFINITE - now ? ZX_TIME_INFINITE : now + duration;
+}
+
 static void channel_endpoint_init(channel_endpoint_t* endpoint) {
     message_queue_init(&endpoint->message_queue);
+    message_pool_init(&endpoint->message_pool);
+    vm_spinlock_init(&endpoint->read_lock);
     endpoint->peer = NULL;
-    endpoint->is_closed = false;
+    atomic_init(&endpoint->is_closed, false);
+    atomic_init(&endpoint->peer_closed, false);
     endpoint->ref_count = 1;
+    vm_spinlock_init(&endpoint->wait_lock);
+    endpoint->waiters = NULL;
+    endpoint->notify_seq = 0;
+    atomic_init(&endpoint->num_waiters, 0);
+}
+
+static zx_status_t endpoint_write_status(channel_endpoint_t* endpoint) {
+    if (atomic_load_explicit(&endpoint->is_closed, memory_order_acquire)) {
+        return ZX_ERR_BAD_HANDLE;
+    }
+    if (atomic_load_explicit(&endpoint->peer_closed, memory_order_acquire)) {
+        return ZX_ERR_PEER_CLOSED;
+    }
+    return ZX_OK;
+}
+
+static zx_signals_t endpoint_signals(channel_endpoint_t* endpoint) {
+    zx_signals_t signals = 0;
+    if (!message_queue_is_empty(&endpoint->message_queue)) {
+        signals |= ZX_CHANNEL_READABLE;
+    }
+    if (atomic_load_explicit(&endpoint->peer_closed, memory_order_acquire)) {
+        signals |= ZX_CHANNEL_PEER_CLOSED;
+    }
+    return signals;
+}
+
+static void waiter_wake(channel_waiter_t* waiter) {
+    pthread_mutex_lock(&waiter->lock);
+    waiter->woken = true;
+    pthread_cond_signal(&waiter->cv);
+    pthread_mutex_unlock(&waiter->lock);
+    atomic_fetch_sub_explicit(&waiter->refs, 1, memory_order_release);
+}
+
+/*
+ * Wakes every thread waiting on |endpoint| to re-check its signals. The
+ * fence pairs with the one in channel_wait_many: either the waiter sees the
+ * new state, or this sees the waiter.
+ *
+ * The waiter mutexes can block, so they are never taken under the spinlock.
+ * Waiters are collected a batch at a time, each link marked with this
+ * notify's sequence number so a later batch skips it, and signaled after the
+ * lock is dropped. Links added meanwhile start marked: their waiters check
+ * the state themselves after taking the lock.
+ */
+static void endpoint_notify(channel_endpoint_t* endpoint) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&endpoint->num_waiters, memory_order_relaxed) == 0) {
+        return;
+    }
+    
+    channel_waiter_t* batch[NOTIFY_BATCH];
+    vm_spin_lock(&endpoint->wait_lock);
+    uint64_t seq = ++endpoint->notify_seq;
+    for (;;) {
+        size_t count = 0;
+        for (channel_wait_link_t* link = endpoint->waiters; link && count < NOTIFY_BATCH;
+             link = link->next) {
+            /* A newer notify has this one covered. */
+            if (link->notified >= seq) {
+                continue;
+            }
+            link->notified = seq;
+            atomic_fetch_add_explicit(&link->waiter->refs, 1, memory_order_relaxed);
+            batch[count++] = link->waiter;
+        }
+        vm_spin_unlock(&endpoint->wait_lock);
+        
+        for (size_t i = 0; i < count; i++) {
+            waiter_wake(batch[i]);
+        }
+        if (count < NOTIFY_BATCH) {
+            return;
+        }
+        vm_spin_lock(&endpoint->wait_lock);
+    }
+}
+
+/*
+ * Queues |packet| on |peer|. If the peer closed after the caller checked,
+ * its close may already have drained the queue, so whichever of the two
+ * runs last drains it again; the fences order the enqueue against the
+ * close flag on both sides.
+ */
+static void endpoint_deliver(channel_endpoint_t* peer, message_packet_t* packet) {
+    message_queue_enqueue(&peer->message_queue, packet);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&peer->is_closed, memory_order_relaxed)) {
+        vm_spin_lock(&peer->read_lock);
+        message_queue_destroy(&peer->message_queue);
+        vm_spin_unlock(&peer->read_lock);
+    }
+    endpoint_notify(peer);
 }
 
 zx_status_t channel_create(zx_handle_t* out_handle0, zx_handle_t* out_handle1) {
@@ -72,21 +209,62 @@ zx_status_t channel_write(zx_handle_t handle, const void* data, uint32_t data_si
         return status;
     }
     
-    if (endpoint->is_closed || !endpoint->peer || endpoint->peer->is_closed) {
-        return ZX_ERR_BAD_HANDLE;
+    status = endpoint_write_status(endpoint);
+    if (status != ZX_OK) {
+        return status;
     }
     
     message_packet_t* packet;
-    status = message_packet_create(data, data_size, handles, num_handles, &packet);
+    status = message_packet_create_pooled(&endpoint->peer->message_pool, data, data_size,
+                                          handles, num_handles, &packet);
     if (status != ZX_OK) {
         return status;
     }
     
-    message_queue_enqueue(&endpoint->peer->message_queue, packet);
+    endpoint_deliver(endpoint->peer, packet);
+    
+    return ZX_OK;
+}
+
+/* Called with |read_lock| held. */
+static zx_status_t next_packet(channel_endpoint_t* endpoint, bool want_pages, message_packet_t** out_packet) {
+    if (atomic_load_explicit(&endpoint->is_closed, memory_order_acquire)) {
+        return ZX_ERR_BAD_HANDLE;
+    }
+    
+    message_packet_t* packet = message_queue_peek(&endpoint->message_queue);
+    if (packet && (packet->arena != NULL) != want_pages) {
+        return ZX_ERR_WRONG_TYPE;
+    }
     
+    /* Dequeue can still miss a message whose writer has not linked it yet. */
+    *out_packet = packet ? message_queue_dequeue(&endpoint->message_queue) : NULL;
+    if (!*out_packet) {
+        return atomic_load_explicit(&endpoint->peer_closed, memory_order_acquire)
+            ? ZX_ERR_PEER_CLOSED : ZX_ERR_SHOULD_WAIT;
+    }
     return ZX_OK;
 }
 
+static void packet_copy_out(message_packet_t* packet, void* data, uint32_t data_size, uint32_t* actual_data_size,
+                            zx_handle_t* handles, uint32_t num_handles, uint32_t* actual_num_handles) {
+    if (actual_data_size) {
+        *actual_data_size = packet->data_size;
+    }
+    
+    if (data && data_size >= packet->data_size) {
+        memcpy(data, packet->data, packet->data_size);
+    }
+    
+    if (actual_num_handles) {
+        *actual_num_handles = packet->num_handles;
+    }
+    
+    if (handles && num_handles >= packet->num_handles) {
+        memcpy(handles, packet->handles, packet->num_handles * sizeof(zx_handle_t));
+    }
+}
+
 zx_status_t channel_read(zx_handle_t handle, void* data, uint32_t data_size, uint32_t* actual_data_size,
                          zx_handle_t* handles, uint32_t num_handles, uint32_t* actual_num_handles) {
     if (handle == ZX_HANDLE_INVALID) {
@@ -101,27 +279,128 @@ zx_status_t channel_read(zx_handle_t handle, void* data, uint32_t data_size, uin
         return status;
     }
     
-    if (endpoint->is_closed) {
-        return ZX_ERR_BAD_HANDLE;
+    vm_spin_lock(&endpoint->read_lock);
+    message_packet_t* packet = NULL;
+    status = next_packet(endpoint, false, &packet);
+    vm_spin_unlock(&endpoint->read_lock);
+    if (status != ZX_OK) {
+        return status;
     }
     
-    if (message_queue_is_empty(&endpoint->message_queue)) {
-        return ZX_ERR_BAD_HANDLE;
+    packet_copy_out(packet, data, data_size, actual_data_size, handles, num_handles, actual_num_handles);
+    message_packet_destroy(packet);
+    return ZX_OK;
+}
+
+zx_status_t channel_read_batch(zx_handle_t handle, channel_message_t* messages, uint32_t count,
+                               uint32_t* actual_count) {
+    if (handle == ZX_HANDLE_INVALID || !messages || count == 0) {
+        return ZX_ERR_INVALID_ARGS;
     }
     
-    message_packet_t* packet = message_queue_dequeue(&endpoint->message_queue);
-    if (!packet) {
-        return ZX_ERR_BAD_HANDLE;
+    handle_table_t* table = get_current_handle_table();
+    channel_endpoint_t* endpoint;
+    
+    zx_status_t status = handle_get(table, handle, ZX_RIGHT_READ, (void**)&endpoint);
+    if (status != ZX_OK) {
+        return status;
     }
     
-    if (actual_data_size) {
-        *actual_data_size = packet->data_size;
+    uint32_t read = 0;
+    vm_spin_lock(&endpoint->read_lock);
+    while (read < count) {
+        message_packet_t* packet;
+        status = next_packet(endpoint, false, &packet);
+        if (status != ZX_OK) {
+            break;
+        }
+        
+        channel_message_t* message = &messages[read++];
+        packet_copy_out(packet, message->data, message->data_size, &message->actual_data_size,
+                        message->handles, message->num_handles, &message->actual_num_handles);
+        message_packet_destroy(packet);
     }
+    vm_spin_unlock(&endpoint->read_lock);
     
-    if (data && data_size >= packet->data_size) {
-        memcpy(data, packet->data, packet->data_size);
+    if (actual_count) {
+        *actual_count = read;
+    }
+    return read > 0 ? ZX_OK : status;
+}
+
+zx_status_t channel_write_vmo(zx_handle_t handle, vmo_t* vmo, pmm_arena_t* arena, uint32_t options,
+                              const zx_handle_t* handles, uint32_t num_handles) {
+    if (handle == ZX_HANDLE_INVALID || !vmo || !arena || vmo->page_count == 0) {
+        return ZX_ERR_INVALID_ARGS;
+    }
+    
+    if (options & ~CHANNEL_VMO_SHARE) {
+        return ZX_ERR_INVALID_ARGS;
+    }
+    
+    handle_table_t* table = get_current_handle_table();
+    channel_endpoint_t* endpoint;
+    
+    zx_status_t status = handle_get(table, handle, ZX_RIGHT_WRITE, (void**)&endpoint);
+    if (status != ZX_OK) {
+        return status;
+    }
+    
+    status = endpoint_write_status(endpoint);
+    if (status != ZX_OK) {
+        return status;
+    }
+    
+    message_packet_t* packet;
+    status = message_packet_create_pooled(&endpoint->peer->message_pool, NULL, 0,
+                                          handles, num_handles, &packet);
+    if (status != ZX_OK) {
+        return status;
+    }
+    
+    if (options & CHANNEL_VMO_SHARE) {
+        vmo_t shared;
+        status = vmo_bootstrap_share_pages(vmo, &shared);
+        if (status != ZX_OK) {
+            message_packet_destroy(packet);
+            return status;
+        }
+        message_packet_attach_vmo(packet, arena, &shared);
+    } else {
+        message_packet_attach_vmo(packet, arena, vmo);
+    }
+    
+    endpoint_deliver(endpoint->peer, packet);
+    
+    return ZX_OK;
+}
+
+zx_status_t channel_read_vmo(zx_handle_t handle, vmo_t* out_vmo,
+                             zx_handle_t* handles, uint32_t num_handles, uint32_t* actual_num_handles) {
+    if (handle == ZX_HANDLE_INVALID || !out_vmo) {
+        return ZX_ERR_INVALID_ARGS;
+    }
+    
+    handle_table_t* table = get_current_handle_table();
+    channel_endpoint_t* endpoint;
+    
+    zx_status_t status = handle_get(table, handle, ZX_RIGHT_READ, (void**)&endpoint);
+    if (status != ZX_OK) {
+        return status;
+    }
+    
+    vm_spin_lock(&endpoint->read_lock);
+    message_packet_t* packet = NULL;
+    status = next_packet(endpoint, true, &packet);
+    vm_spin_unlock(&endpoint->read_lock);
+    if (status != ZX_OK) {
+        return status;
     }
     
+    *out_vmo = packet->vmo;
+    memset(&packet->vmo, 0, sizeof(packet->vmo));
+    packet->arena = NULL;
+    
     if (actual_num_handles) {
         *actual_num_handles = packet->num_handles;
     }
@@ -147,12 +426,146 @@ zx_status_t channel_close(zx_handle_t handle) {
         return status;
     }
     
-    endpoint->is_closed = true;
-    message_queue_destroy(&endpoint->message_queue);
-    
-    if (endpoint->peer) {
-        endpoint->peer->peer = NULL;
+    /* Only the first close of an endpoint, through any handle, tears it down. */
+    if (!atomic_exchange_explicit(&endpoint->is_closed, true, memory_order_acq_rel)) {
+        atomic_store_explicit(&endpoint->peer->peer_closed, true, memory_order_release);
+        atomic_thread_fence(memory_order_seq_cst);
+        
+        vm_spin_lock(&endpoint->read_lock);
+        message_queue_destroy(&endpoint->message_queue);
+        vm_spin_unlock(&endpoint->read_lock);
+        message_pool_destroy(&endpoint->message_pool);
+        
+        endpoint_notify(endpoint->peer);
+        endpoint_notify(endpoint);
     }
     
     return handle_close(table, handle);
 }
+
+static void waiter_add(channel_endpoint_t* endpoint, channel_wait_link_t* link) {
+    vm_spin_lock(&endpoint->wait_lock);
+    link->notified = endpoint->notify_seq;
+    link->prev = NULL;
+    link->next = endpoint->waiters;
+    if (link->next) {
+        link->next->prev = link;
+    }
+    endpoint->waiters = link;
+    atomic_fetch_add_explicit(&endpoint->num_waiters, 1, memory_order_relaxed);
+    vm_spin_unlock(&endpoint->wait_lock);
+}
+
+static void waiter_remove(channel_endpoint_t* endpoint, channel_wait_link_t* link) {
+    vm_spin_lock(&endpoint->wait_lock);
+    if (link->prev) {
+        link->prev->next = link->next;
+    } else {
+        endpoint->waiters = link->next;
+    }
+    if (link->next) {
+        link->next->prev = link->prev;
+    }
+    atomic_fetch_sub_explicit(&endpoint->num_waiters, 1, memory_order_relaxed);
+    vm_spin_unlock(&endpoint->wait_lock);
+}
+
+/* Fills in each item's pending signals; returns whether the wait is over. */
+static bool wait_check(channel_wait_item_t* items, channel_endpoint_t** endpoints, uint32_t count,
+                       zx_status_t* out_status) {
+    bool done = false;
+    *out_status = ZX_OK;
+    for (uint32_t i = 0; i < count; i++) {
+        if (atomic_load_explicit(&endpoints[i]->is_closed, memory_order_acquire)) {
+            *out_status = ZX_ERR_CANCELED;
+            done = true;
+        }
+        items[i].pending = endpoint_signals(endpoints[i]);
+        if (items[i].pending & items[i].waitfor) {
+            done = true;
+        }
+    }
+    return done;
+}
+
+zx_status_t channel_wait_many(channel_wait_item_t* items, uint32_t count, zx_time_t deadline) {
+    if (!items || count == 0 || count > CHANNEL_WAIT_MANY_MAX) {
+        return ZX_ERR_INVALID_ARGS;
+    }
+    
+    handle_table_t* table = get_current_handle_table();
+    channel_endpoint_t* endpoints[CHANNEL_WAIT_MANY_MAX];
+    for (uint32_t i = 0; i < count; i++) {
+        zx_status_t status = handle_get(table, items[i].handle, ZX_RIGHT_NONE, (void**)&endpoints[i]);
+        if (status != ZX_OK) {
+            return status;
+        }
+    }
+    
+    channel_waiter_t waiter;
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&waiter.cv, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&waiter.lock, NULL);
+    waiter.woken = false;
+    atomic_init(&waiter.refs, 0);
+    
+    channel_wait_link_t links[CHANNEL_WAIT_MANY_MAX];
+    for (uint32_t i = 0; i < count; i++) {
+        links[i].waiter = &waiter;
+        waiter_add(endpoints[i], &links[i]);
+    }
+    atomic_thread_fence(memory_order_seq_cst);
+    
+    struct timespec ts = {
+        .tv_sec = deadline / 1000000000,
+        .tv_nsec = deadline % 1000000000,
+    };
+    
+    zx_status_t status;
+    bool timed_out = false;
+    while (!wait_check(items, endpoints, count, &status)) {
+        if (timed_out) {
+            status = ZX_ERR_TIMED_OUT;
+            break;
+        }
+        
+        pthread_mutex_lock(&waiter.lock);
+        while (!waiter.woken && !timed_out) {
+            if (deadline == ZX_TIME_INFINITE) {
+                pthread_cond_wait(&waiter.cv, &waiter.lock);
+            } else if (pthread_cond_timedwait(&waiter.cv, &waiter.lock, &ts) == ETIMEDOUT) {
+                timed_out = true;
+            }
+        }
+        waiter.woken = false;
+        pthread_mutex_unlock(&waiter.lock);
+    }
+    
+    for (uint32_t i = 0; i < count; i++) {
+        waiter_remove(endpoints[i], &links[i]);
+    }
+    /* Off every list now; only notifiers already holding it are left. */
+    while (atomic_load_explicit(&waiter.refs, memory_order_acquire) != 0) {
+        sched_yield();
+    }
+    pthread_mutex_destroy(&waiter.lock);
+    pthread_cond_destroy(&waiter.cv);
+    return status;
+}
+
+zx_status_t channel_wait(zx_handle_t handle, zx_signals_t signals, zx_time_t deadline,
+                         zx_signals_t* observed) {
+    channel_wait_item_t item = {
+        .handle = handle,
+        .waitfor = signals,
+        .pending = 0,
+    };
+    zx_status_t status = channel_wait_many(&item, 1, deadline);
+    if (observed) {
+        *observed = item.pending;
+    }
+    return status;
+}
@@ -4,11 +4,41 @@
 #include "handle.h"
 #include "message_packet.h"
 
+typedef uint32_t zx_signals_t;
+typedef int64_t zx_time_t;          /* Monotonic clock, in nanoseconds */
+typedef int64_t zx_duration_t;
+
+#define ZX_TIME_INFINITE        INT64_MAX
+
+#define ZX_CHANNEL_READABLE     (1u << 0)
+#define ZX_CHANNEL_PEER_CLOSED  (1u << 2)
+
+#define CHANNEL_WAIT_MANY_MAX   16
+
+struct channel_wait_link;
+
+/*
+ * Any number of threads may write to an endpoint's peer at once; readers of
+ * one endpoint are serialized by |read_lock|, which writers never take
+ * except to clean up after a peer that closed under them. |peer| never
+ * changes once the channel is created.
+ *
+ * Threads blocked in channel_wait hang a link on |waiters|. Writers and
+ * closers only take |wait_lock| when |num_waiters| says someone is there.
+ */
 typedef struct channel_endpoint {
     message_queue_t message_queue;
+    message_pool_t message_pool;
+    vm_spinlock_t read_lock;
     struct channel_endpoint* peer;
-    bool is_closed;
+    atomic_bool is_closed;
+    atomic_bool peer_closed;
     uint32_t ref_count;
+    
+    vm_spinlock_t wait_lock;
+    struct channel_wait_link* waiters;
+    atomic_uint num_waiters;
+    uint64_t notify_seq;  /* Under wait_lock. */
 } channel_endpoint_t;
 
 typedef struct channel {
@@ -21,9 +51,72 @@ zx_status_t channel_create(zx_handle_t* out_handle0, zx_handle_t* out_handle1);
 zx_status_t channel_write(zx_handle_t handle, const void* data, uint32_t data_size,
                           const zx_handle_t* handles, uint32_t num_handles);
 
+/*
+ * Fails with ZX_ERR_SHOULD_WAIT if no message is queued, or with
+ * ZX_ERR_PEER_CLOSED once the queue is empty and the peer is gone.
+ */
 zx_status_t channel_read(zx_handle_t handle, void* data, uint32_t data_size, uint32_t* actual_data_size,
                          zx_handle_t* handles, uint32_t num_handles, uint32_t* actual_num_handles);
 
+typedef struct channel_message {
+    void* data;
+    uint32_t data_size;
+    uint32_t actual_data_size;
+    zx_handle_t* handles;
+    uint32_t num_handles;
+    uint32_t actual_num_handles;
+} channel_message_t;
+
+/*
+ * Reads up to |count| byte messages with one handle lookup, filling each
+ * entry as channel_read would. Stops early at an empty queue or a page
+ * message, and fails as channel_read does only if nothing was read.
+ */
+zx_status_t channel_read_batch(zx_handle_t handle, channel_message_t* messages, uint32_t count,
+                               uint32_t* actual_count);
+
+typedef struct channel_wait_item {
+    zx_handle_t handle;
+    zx_signals_t waitfor;
+    zx_signals_t pending;
+} channel_wait_item_t;
+
+/*
+ * Blocks until one of |signals| is asserted on the endpoint, or until the
+ * absolute |deadline| passes (ZX_ERR_TIMED_OUT). |observed| gets the
+ * signals asserted when the wait ended. A wait on an endpoint that is
+ * closed fails with ZX_ERR_CANCELED.
+ */
+zx_status_t channel_wait(zx_handle_t handle, zx_signals_t signals, zx_time_t deadline,
+                         zx_signals_t* observed);
+
+/* Waits on up to CHANNEL_WAIT_MANY_MAX endpoints at once, like zx_object_wait_many. */
+zx_status_t channel_wait_many(channel_wait_item_t* items, uint32_t count, zx_time_t deadline);
+
+zx_time_t zx_clock_get_monotonic(void);
+zx_time_t zx_deadline_after(zx_duration_t duration);
+
+/*
+ * Page messages carry a VMO's pages instead of bytes, so large payloads such
+ * as frame buffers cross the channel without being copied. By default the
+ * pages move: |vmo| is left empty and the reader's VMO adopts the page map.
+ * With CHANNEL_VMO_SHARE the sender keeps its pages and the reader gets
+ * another reference on each; the pages are shared, not copied, until both
+ * sides have freed them. Both ends must allocate from the same |arena|.
+ */
+#define CHANNEL_VMO_SHARE   (1u << 0)
+
+zx_status_t channel_write_vmo(zx_handle_t handle, vmo_t* vmo, pmm_arena_t* arena, uint32_t options,
+                              const zx_handle_t* handles, uint32_t num_handles);
+
+/*
+ * Reads a page message into |out_vmo|, which must not hold pages. The read
+ * fails with ZX_ERR_WRONG_TYPE, leaving the message queued, if the next
+ * message is a byte message; channel_read likewise refuses page messages.
+ */
+zx_status_t channel_read_vmo(zx_handle_t handle, vmo_t* out_vmo,
+                             zx_handle_t* handles, uint32_t num_handles, uint32_t* actual_num_handles);
+
 zx_status_t channel_close(zx_handle_t handle);
 
 extern handle_table_t* get_current_handle_table(void);
@@ -2,106 +2,221 @@
 #include <stdlib.h>
 #include <string.h>
 
-#define HANDLE_TABLE_INITIAL_BUCKETS 64
-#define HANDLE_HASH(h) ((h) % table->num_buckets)
+#define HANDLE_TABLE_INITIAL_SLOTS 64
+#define HANDLE_FREE_LIST_END UINT32_MAX
+#define HANDLE_STATE_LIVE 1u
 
-zx_status_t handle_table_init(handle_table_t* table, uint32_t initial_buckets) {
+static atomic_uint g_next_shard;
+static _Thread_local uint32_t t_shard = HANDLE_SHARDS;
+
+static inline uint32_t handle_slot(zx_handle_t handle) {
+    return (handle & HANDLE_SLOT_MASK) - 1;
+}
+
+static inline uint32_t handle_generation(zx_handle_t handle) {
+    return handle >> HANDLE_SLOT_BITS;
+}
+
+static inline uint32_t live_state(uint32_t generation) {
+    return (generation << 1) | HANDLE_STATE_LIVE;
+}
+
+static inline handle_shard_t* current_shard(handle_table_t* table) {
+    if (t_shard == HANDLE_SHARDS) {
+        t_shard = atomic_fetch_add_explicit(&g_next_shard, 1, memory_order_relaxed) % HANDLE_SHARDS;
+    }
+    return &table->shards[t_shard];
+}
+
+static inline handle_table_entry_t* slot_entry(handle_table_t* table, uint32_t slot) {
+    handle_table_entry_t* chunk =
+        atomic_load_explicit(&table->chunks[slot >> HANDLE_CHUNK_SHIFT], memory_order_acquire);
+    return chunk ? &chunk[slot & (HANDLE_CHUNK_SIZE - 1)] : NULL;
+}
+
+/*
+ * Adds one chunk of slots to |shard|'s free list. The caller holds the shard
+ * lock, or is initializing the table. Published chunks are never freed
+ * before the table is destroyed.
+ */
+static zx_status_t add_chunk(handle_table_t* table, uint32_t shard) {
+    vm_spin_lock(&table->grow_lock);
+
+    uint32_t index = atomic_load_explicit(&table->num_chunks, memory_order_relaxed);
+    if (index == HANDLE_MAX_CHUNKS) {
+        vm_spin_unlock(&table->grow_lock);
+        return ZX_ERR_NO_RESOURCES;
+    }
+
+    handle_table_entry_t* chunk =
+        (handle_table_entry_t*)calloc(HANDLE_CHUNK_SIZE, sizeof(handle_table_entry_t));
+    if (!chunk) {
+        vm_spin_unlock(&table->grow_lock);
+        return ZX_ERR_NO_MEMORY;
+    }
+
+    handle_shard_t* owner = &table->shards[shard];
+    uint32_t first = index << HANDLE_CHUNK_SHIFT;
+    for (uint32_t i = HANDLE_CHUNK_SIZE; i-- > 0;) {
+        chunk[i].shard = shard;
+        /* The last slot would encode as zero in the slot field. */
+        if (first + i >= HANDLE_MAX_SLOTS) {
+            continue;
+        }
+        chunk[i].next_free = owner->free_head;
+        owner->free_head = first + i;
+    }
+
+    atomic_store_explicit(&table->chunks[index], chunk, memory_order_release);
+    atomic_store_explicit(&table->num_chunks, index + 1, memory_order_relaxed);
+    vm_spin_unlock(&table->grow_lock);
+    return ZX_OK;
+}
+
+zx_status_t handle_table_init(handle_table_t* table, uint32_t initial_slots) {
     if (!table) {
         return ZX_ERR_INVALID_ARGS;
     }
-    
-    table->num_buckets = initial_buckets > 0 ? initial_buckets : HANDLE_TABLE_INITIAL_BUCKETS;
-    table->buckets = (handle_table_entry_t**)calloc(table->num_buckets, sizeof(handle_table_entry_t*));
-    if (!table->buckets) {
+
+    memset(table, 0, sizeof(*table));
+    table->chunks = (_Atomic(handle_table_entry_t*)*)calloc(HANDLE_MAX_CHUNKS, sizeof(*table->chunks));
+    if (!table->chunks) {
         return ZX_ERR_NO_MEMORY;
     }
-    
-    table->count = 0;
+
+    atomic_init(&table->num_chunks, 0);
+    vm_spinlock_init(&table->grow_lock);
+    for (uint32_t i = 0; i < HANDLE_SHARDS; i++) {
+        vm_spinlock_init(&table->shards[i].lock);
+        table->shards[i].free_head = HANDLE_FREE_LIST_END;
+        table->shards[i].count = 0;
+    }
+
+    uint32_t slots = initial_slots > 0 ? initial_slots : HANDLE_TABLE_INITIAL_SLOTS;
+    if (slots > HANDLE_MAX_SLOTS) {
+        slots = HANDLE_MAX_SLOTS;
+    }
+    for (uint32_t i = 0; i * HANDLE_CHUNK_SIZE < slots; i++) {
+        zx_status_t status = add_chunk(table, i % HANDLE_SHARDS);
+        if (status != ZX_OK) {
+            handle_table_destroy(table);
+            return status;
+        }
+    }
+
     return ZX_OK;
 }
 
 void handle_table_destroy(handle_table_t* table) {
-    if (!table || !table->buckets) {
+    if (!table || !table->chunks) {
         return;
     }
-    
-    for (uint32_t i = 0; i < table->num_buckets; i++) {
-        handle_table_entry_t* entry = table->buckets[i];
-        while (entry) {
-            handle_table_entry_t* next = entry->next;
-            free(entry);
-            entry = next;
-        }
+
+    uint32_t num_chunks = atomic_load_explicit(&table->num_chunks, memory_order_relaxed);
+    for (uint32_t i = 0; i < num_chunks; i++) {
+        free(atomic_load_explicit(&table->chunks[i], memory_order_relaxed));
+    }
+
+    free(table->chunks);
+    table->chunks = NULL;
+    atomic_store_explicit(&table->num_chunks, 0, memory_order_relaxed);
+    for (uint32_t i = 0; i < HANDLE_SHARDS; i++) {
+        table->shards[i].free_head = HANDLE_FREE_LIST_END;
+        table->shards[i].count = 0;
     }
-    
-    free(table->buckets);
-    table->buckets = NULL;
-    table->count = 0;
+}
+
+uint32_t handle_table_count(handle_table_t* table) {
+    if (!table) {
+        return 0;
+    }
+
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < HANDLE_SHARDS; i++) {
+        vm_spin_lock(&table->shards[i].lock);
+        count += table->shards[i].count;
+        vm_spin_unlock(&table->shards[i].lock);
+    }
+    return count;
 }
 
 zx_status_t handle_alloc(handle_table_t* table, void* object, zx_rights_t rights, zx_handle_t* out_handle) {
     if (!table || !object || !out_handle) {
         return ZX_ERR_INVALID_ARGS;
     }
-    
-    handle_table_entry_t* entry = (handle_table_entry_t*)malloc(sizeof(handle_table_entry_t));
-    if (!entry) {
-        return ZX_ERR_NO_MEMORY;
+
+    handle_shard_t* shard = current_shard(table);
+    vm_spin_lock(&shard->lock);
+
+    if (shard->free_head == HANDLE_FREE_LIST_END) {
+        zx_status_t status = add_chunk(table, (uint32_t)(shard - table->shards));
+        if (status != ZX_OK) {
+            vm_spin_unlock(&shard->lock);
+            return status;
+        }
     }
-    
-    entry->object = object;
-    entry->rights = rights;
+
+    uint32_t slot = shard->free_head;
+    handle_table_entry_t* entry = slot_entry(table, slot);
+    shard->free_head = entry->next_free;
+
+    uint32_t generation = atomic_load_explicit(&entry->state, memory_order_relaxed) >> 1;
+    atomic_store_explicit(&entry->object, object, memory_order_relaxed);
+    atomic_store_explicit(&entry->rights, rights, memory_order_relaxed);
     entry->ref_count = 1;
-    
-    zx_handle_t handle = (zx_handle_t)(table->count + 1);
-    uint32_t bucket = HANDLE_HASH(handle);
-    
-    entry->next = table->buckets[bucket];
-    table->buckets[bucket] = entry;
-    table->count++;
-    
-    *out_handle = handle;
+    entry->next_free = HANDLE_FREE_LIST_END;
+    atomic_store_explicit(&entry->state, live_state(generation), memory_order_release);
+    shard->count++;
+
+    vm_spin_unlock(&shard->lock);
+
+    *out_handle = (zx_handle_t)((generation << HANDLE_SLOT_BITS) | (slot + 1));
     return ZX_OK;
 }
 
-static handle_table_entry_t* find_entry(handle_table_t* table, zx_handle_t handle, handle_table_entry_t*** out_prev) {
-    uint32_t bucket = HANDLE_HASH(handle);
-    handle_table_entry_t** prev = &table->buckets[bucket];
-    handle_table_entry_t* entry = *prev;
-    
-    uint32_t target_index = handle - 1;
-    uint32_t current_index = 0;
-    
-    while (entry) {
-        if (current_index == target_index) {
-            if (out_prev) {
-                *out_prev = prev;
-            }
-            return entry;
-        }
-        prev = &entry->next;
-        entry = entry->next;
-        current_index++;
+static handle_table_entry_t* find_entry(handle_table_t* table, zx_handle_t handle) {
+    uint32_t slot = handle_slot(handle);
+    if (slot >= HANDLE_MAX_SLOTS) {
+        return NULL;
+    }
+    return slot_entry(table, slot);
+}
+
+/*
+ * Reads a live entry without locking: the state is checked before and after
+ * the fields, and a close in between makes the second check fail.
+ */
+static bool read_entry(handle_table_entry_t* entry, zx_handle_t handle,
+                       void** out_object, zx_rights_t* out_rights) {
+    uint32_t expected = live_state(handle_generation(handle));
+    if (atomic_load_explicit(&entry->state, memory_order_acquire) != expected) {
+        return false;
     }
-    
-    return NULL;
+
+    *out_object = atomic_load_explicit(&entry->object, memory_order_relaxed);
+    *out_rights = atomic_load_explicit(&entry->rights, memory_order_relaxed);
+
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&entry->state, memory_order_relaxed) == expected;
 }
 
 zx_status_t handle_get(handle_table_t* table, zx_handle_t handle, zx_rights_t required_rights, void** out_object) {
     if (!table || handle == ZX_HANDLE_INVALID || !out_object) {
         return ZX_ERR_INVALID_ARGS;
     }
-    
-    handle_table_entry_t* entry = find_entry(table, handle, NULL);
-    if (!entry) {
+
+    handle_table_entry_t* entry = find_entry(table, handle);
+    void* object;
+    zx_rights_t rights;
+    if (!entry || !read_entry(entry, handle, &object, &rights)) {
         return ZX_ERR_BAD_HANDLE;
     }
-    
-    if (!handle_has_rights(entry->rights, required_rights)) {
+
+    if (!handle_has_rights(rights, required_rights)) {
         return ZX_ERR_INVALID_ARGS;
     }
-    
-    *out_object = entry->object;
+
+    *out_object = object;
     return ZX_OK;
 }
 
@@ -109,20 +224,34 @@ zx_status_t handle_close(handle_table_t* table, zx_handle_t handle) {
     if (!table || handle == ZX_HANDLE_INVALID) {
         return ZX_ERR_INVALID_ARGS;
     }
-    
-    handle_table_entry_t** prev_ptr;
-    handle_table_entry_t* entry = find_entry(table, handle, &prev_ptr);
+
+    handle_table_entry_t* entry = find_entry(table, handle);
     if (!entry) {
         return ZX_ERR_BAD_HANDLE;
     }
-    
+
+    handle_shard_t* shard = &table->shards[entry->shard];
+    vm_spin_lock(&shard->lock);
+
+    uint32_t generation = handle_generation(handle);
+    if (atomic_load_explicit(&entry->state, memory_order_relaxed) != live_state(generation)) {
+        vm_spin_unlock(&shard->lock);
+        return ZX_ERR_BAD_HANDLE;
+    }
+
     entry->ref_count--;
     if (entry->ref_count == 0) {
-        *prev_ptr = entry->next;
-        free(entry);
-        table->count--;
+        uint32_t next = (generation + 1) & HANDLE_GENERATION_MASK;
+        atomic_store_explicit(&entry->state, next << 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        atomic_store_explicit(&entry->object, NULL, memory_order_relaxed);
+        atomic_store_explicit(&entry->rights, ZX_RIGHT_NONE, memory_order_relaxed);
+        entry->next_free = shard->free_head;
+        shard->free_head = handle_slot(handle);
+        shard->count--;
     }
-    
+
+    vm_spin_unlock(&shard->lock);
     return ZX_OK;
 }
 
@@ -130,18 +259,20 @@ zx_status_t handle_duplicate(handle_table_t* table, zx_handle_t handle, zx_right
     if (!table || handle == ZX_HANDLE_INVALID || !out_handle) {
         return ZX_ERR_INVALID_ARGS;
     }
-    
-    handle_table_entry_t* entry = find_entry(table, handle, NULL);
-    if (!entry) {
+
+    handle_table_entry_t* entry = find_entry(table, handle);
+    void* object;
+    zx_rights_t entry_rights;
+    if (!entry || !read_entry(entry, handle, &object, &entry_rights)) {
         return ZX_ERR_BAD_HANDLE;
     }
-    
-    if (!handle_has_rights(entry->rights, ZX_RIGHT_DUPLICATE)) {
+
+    if (!handle_has_rights(entry_rights, ZX_RIGHT_DUPLICATE)) {
         return ZX_ERR_INVALID_ARGS;
     }
-    
-    zx_rights_t new_rights = rights & entry->rights;
-    return handle_alloc(table, entry->object, new_rights, out_handle);
+
+    zx_rights_t new_rights = rights & entry_rights;
+    return handle_alloc(table, object, new_rights, out_handle);
 }
 
 bool handle_has_rights(zx_rights_t handle_rights, zx_rights_t required_rights) {
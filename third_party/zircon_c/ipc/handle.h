@@ -3,6 +3,9 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+
+#include "../vm/spinlock.h"
 
 typedef uint32_t zx_handle_t;
 typedef uint32_t zx_rights_t;
@@ -17,25 +20,67 @@ typedef int32_t zx_status_t;
 #define ZX_RIGHT_TRANSFER   (1u << 3)
 
 #define ZX_OK               0
-#define ZX_ERR_BAD_HANDLE   (-11)
-#define ZX_ERR_INVALID_ARGS (-10)
+#define ZX_ERR_NO_RESOURCES (-3)
 #define ZX_ERR_NO_MEMORY    (-4)
+#define ZX_ERR_INVALID_ARGS (-10)
+#define ZX_ERR_BAD_HANDLE   (-11)
+#define ZX_ERR_WRONG_TYPE   (-12)
+#define ZX_ERR_TIMED_OUT    (-21)
+#define ZX_ERR_SHOULD_WAIT  (-22)
+#define ZX_ERR_CANCELED     (-23)
+#define ZX_ERR_PEER_CLOSED  (-24)
+
+/*
+ * A handle value is a slot index plus one in the low HANDLE_SLOT_BITS and the
+ * slot's generation above it. Closing a handle bumps the generation, so a
+ * stale value no longer matches once its slot is reused.
+ */
+#define HANDLE_SLOT_BITS        20
+#define HANDLE_SLOT_MASK        ((1u << HANDLE_SLOT_BITS) - 1)
+#define HANDLE_GENERATION_MASK  ((1u << (32 - HANDLE_SLOT_BITS)) - 1)
+#define HANDLE_MAX_SLOTS        HANDLE_SLOT_MASK
+
+/*
+ * Slots live in fixed-size chunks that never move once allocated, found
+ * through a directory sized for HANDLE_MAX_SLOTS up front, so lookups never
+ * race a resize and take no lock.
+ */
+#define HANDLE_CHUNK_SHIFT      8
+#define HANDLE_CHUNK_SIZE       (1u << HANDLE_CHUNK_SHIFT)
+#define HANDLE_MAX_CHUNKS       ((HANDLE_MAX_SLOTS + HANDLE_CHUNK_SIZE - 1) / HANDLE_CHUNK_SIZE)
+
+/*
+ * Each chunk belongs to one shard, which keeps the free list for its slots
+ * under its own lock. Threads allocate from a shard picked on first use, so
+ * cores creating and closing handles rarely touch the same lock.
+ */
+#define HANDLE_SHARDS           8
 
 typedef struct handle_table_entry {
-    void* object;
-    zx_rights_t rights;
+    _Atomic(void*) object;      /* NULL while the slot is free */
+    _Atomic zx_rights_t rights;
+    atomic_uint state;          /* Generation << 1, plus 1 while live */
     uint32_t ref_count;
-    struct handle_table_entry* next;
+    uint32_t next_free;         /* Free-list link, a slot index */
+    uint32_t shard;
 } handle_table_entry_t;
 
-typedef struct handle_table {
-    handle_table_entry_t** buckets;
-    uint32_t num_buckets;
+typedef struct handle_shard {
+    _Alignas(64) vm_spinlock_t lock;
+    uint32_t free_head;
     uint32_t count;
+} handle_shard_t;
+
+typedef struct handle_table {
+    _Atomic(handle_table_entry_t*)* chunks;     /* HANDLE_MAX_CHUNKS entries */
+    atomic_uint num_chunks;
+    vm_spinlock_t grow_lock;
+    handle_shard_t shards[HANDLE_SHARDS];
 } handle_table_t;
 
-zx_status_t handle_table_init(handle_table_t* table, uint32_t initial_buckets);
+zx_status_t handle_table_init(handle_table_t* table, uint32_t initial_slots);
 void handle_table_destroy(handle_table_t* table);
+uint32_t handle_table_count(handle_table_t* table);
 
 zx_status_t handle_alloc(handle_table_t* table, void* object, zx_rights_t rights, zx_handle_t* out_handle);
 zx_status_t handle_get(handle_table_t* table, zx_handle_t handle, zx_rights_t required_rights, void** out_object);
@@ -2,9 +2,89 @@
 #include <stdlib.h>
 #include <string.h>
 
-zx_status_t message_packet_create(const void* data, uint32_t data_size,
-                                   const zx_handle_t* handles, uint32_t num_handles,
-                                   message_packet_t** out_packet) {
+static const uint32_t kSizeClasses[MESSAGE_SIZE_CLASSES] = {128, 512, 2048, MESSAGE_MAX_POOLED};
+
+/* Free packets of each class, carved from slabs that are never returned. */
+static message_packet_t* g_slab_free[MESSAGE_SIZE_CLASSES];
+static vm_spinlock_t g_slab_lock;
+
+static inline message_packet_t* free_next(message_packet_t* packet) {
+    return atomic_load_explicit(&packet->next, memory_order_relaxed);
+}
+
+static inline void set_free_next(message_packet_t* packet, message_packet_t* next) {
+    atomic_store_explicit(&packet->next, next, memory_order_relaxed);
+}
+
+static uint8_t size_class_for(size_t payload) {
+    for (uint8_t i = 0; i < MESSAGE_SIZE_CLASSES; i++) {
+        if (payload <= kSizeClasses[i]) {
+            return i;
+        }
+    }
+    return MESSAGE_CLASS_NONE;
+}
+
+/* Called with g_slab_lock held. */
+static bool slab_refill(uint8_t size_class) {
+    size_t object_size = sizeof(message_packet_t) + kSizeClasses[size_class];
+    size_t count = MESSAGE_SLAB_SIZE / object_size;
+    uint8_t* slab = (uint8_t*)malloc(count * object_size);
+    if (!slab) {
+        return false;
+    }
+    
+    for (size_t i = 0; i < count; i++) {
+        message_packet_t* packet = (message_packet_t*)(slab + i * object_size);
+        packet->size_class = size_class;
+        set_free_next(packet, g_slab_free[size_class]);
+        g_slab_free[size_class] = packet;
+    }
+    return true;
+}
+
+static message_packet_t* packet_alloc(message_pool_t* pool, size_t payload) {
+    uint8_t size_class = size_class_for(payload);
+    message_packet_t* packet;
+    
+    if (size_class == MESSAGE_CLASS_NONE) {
+        packet = (message_packet_t*)malloc(sizeof(message_packet_t) + payload);
+        if (!packet) {
+            return NULL;
+        }
+        packet->size_class = MESSAGE_CLASS_NONE;
+    } else {
+        packet = NULL;
+        if (pool) {
+            vm_spin_lock(&pool->lock);
+            packet = pool->free[size_class];
+            if (packet) {
+                pool->free[size_class] = free_next(packet);
+                pool->free_count[size_class]--;
+            }
+            vm_spin_unlock(&pool->lock);
+        }
+        if (!packet) {
+            vm_spin_lock(&g_slab_lock);
+            if (g_slab_free[size_class] || slab_refill(size_class)) {
+                packet = g_slab_free[size_class];
+                g_slab_free[size_class] = free_next(packet);
+            }
+            vm_spin_unlock(&g_slab_lock);
+            if (!packet) {
+                return NULL;
+            }
+        }
+    }
+    
+    packet->pool = pool;
+    return packet;
+}
+
+zx_status_t message_packet_create_pooled(message_pool_t* pool,
+                                          const void* data, uint32_t data_size,
+                                          const zx_handle_t* handles, uint32_t num_handles,
+                                          message_packet_t** out_packet) {
     if (!out_packet) {
         return ZX_ERR_INVALID_ARGS;
     }
@@ -17,51 +97,109 @@ zx_status_t message_packet_create(const void* data, uint32_t data_size,
         return ZX_ERR_INVALID_ARGS;
     }
     
-    message_packet_t* packet = (message_packet_t*)malloc(sizeof(message_packet_t));
+    size_t handles_size = (size_t)num_handles * sizeof(zx_handle_t);
+    message_packet_t* packet = packet_alloc(pool, handles_size + data_size);
     if (!packet) {
         return ZX_ERR_NO_MEMORY;
     }
     
-    packet->next = NULL;
-    packet->prev = NULL;
+    uint8_t* payload = (uint8_t*)(packet + 1);
+    atomic_store_explicit(&packet->next, NULL, memory_order_relaxed);
     packet->data_size = data_size;
     packet->num_handles = num_handles;
+    packet->handles = num_handles > 0 ? (zx_handle_t*)payload : NULL;
+    packet->data = data_size > 0 ? payload + handles_size : NULL;
+    memset(&packet->vmo, 0, sizeof(packet->vmo));
+    packet->arena = NULL;
     
+    if (num_handles > 0) {
+        memcpy(packet->handles, handles, handles_size);
+    }
     if (data_size > 0) {
-        packet->data = (uint8_t*)malloc(data_size);
-        if (!packet->data) {
-            free(packet);
-            return ZX_ERR_NO_MEMORY;
-        }
         memcpy(packet->data, data, data_size);
-    } else {
-        packet->data = NULL;
-    }
-    
-    if (num_handles > 0) {
-        packet->handles = (zx_handle_t*)malloc(num_handles * sizeof(zx_handle_t));
-        if (!packet->handles) {
-            free(packet->data);
-            free(packet);
-            return ZX_ERR_NO_MEMORY;
-        }
-        memcpy(packet->handles, handles, num_handles * sizeof(zx_handle_t));
-    } else {
-        packet->handles = NULL;
     }
     
     *out_packet = packet;
     return ZX_OK;
 }
 
+zx_status_t message_packet_create(const void* data, uint32_t data_size,
+                                   const zx_handle_t* handles, uint32_t num_handles,
+                                   message_packet_t** out_packet) {
+    return message_packet_create_pooled(NULL, data, data_size, handles, num_handles, out_packet);
+}
+
+void message_packet_attach_vmo(message_packet_t* packet, pmm_arena_t* arena, vmo_t* vmo) {
+    packet->vmo = *vmo;
+    packet->arena = arena;
+    memset(vmo, 0, sizeof(*vmo));
+}
+
 void message_packet_destroy(message_packet_t* packet) {
     if (!packet) {
         return;
     }
     
-    free(packet->data);
-    free(packet->handles);
-    free(packet);
+    if (packet->arena) {
+        vmo_bootstrap_destroy(&packet->vmo, packet->arena);
+        packet->arena = NULL;
+    }
+    
+    uint8_t size_class = packet->size_class;
+    if (size_class == MESSAGE_CLASS_NONE) {
+        free(packet);
+        return;
+    }
+    
+    message_pool_t* pool = packet->pool;
+    if (pool) {
+        vm_spin_lock(&pool->lock);
+        if (!pool->closed && pool->free_count[size_class] < MESSAGE_POOL_DEPTH) {
+            set_free_next(packet, pool->free[size_class]);
+            pool->free[size_class] = packet;
+            pool->free_count[size_class]++;
+            vm_spin_unlock(&pool->lock);
+            return;
+        }
+        vm_spin_unlock(&pool->lock);
+    }
+    
+    vm_spin_lock(&g_slab_lock);
+    set_free_next(packet, g_slab_free[size_class]);
+    g_slab_free[size_class] = packet;
+    vm_spin_unlock(&g_slab_lock);
+}
+
+void message_pool_init(message_pool_t* pool) {
+    if (!pool) {
+        return;
+    }
+    
+    memset(pool, 0, sizeof(*pool));
+    vm_spinlock_init(&pool->lock);
+}
+
+void message_pool_destroy(message_pool_t* pool) {
+    if (!pool) {
+        return;
+    }
+    
+    vm_spin_lock(&pool->lock);
+    pool->closed = true;
+    vm_spin_lock(&g_slab_lock);
+    for (uint32_t i = 0; i < MESSAGE_SIZE_CLASSES; i++) {
+        message_packet_t* packet = pool->free[i];
+        while (packet) {
+            message_packet_t* next = free_next(packet);
+            set_free_next(packet, g_slab_free[i]);
+            g_slab_free[i] = packet;
+            packet = next;
+        }
+        pool->free[i] = NULL;
+        pool->free_count[i] = 0;
+    }
+    vm_spin_unlock(&g_slab_lock);
+    vm_spin_unlock(&pool->lock);
 }
 
 void message_queue_init(message_queue_t* queue) {
@@ -69,9 +207,16 @@ void message_queue_init(message_queue_t* queue) {
         return;
     }
     
-    queue->head = NULL;
-    queue->tail = NULL;
-    queue->count = 0;
+    atomic_init(&queue->stub.next, NULL);
+    queue->head = &queue->stub;
+    atomic_init(&queue->tail, &queue->stub);
+    atomic_init(&queue->count, 0);
+}
+
+static void queue_push(message_queue_t* queue, message_packet_t* packet) {
+    atomic_store_explicit(&packet->next, NULL, memory_order_relaxed);
+    message_packet_t* prev = atomic_exchange_explicit(&queue->tail, packet, memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, packet, memory_order_release);
 }
 
 void message_queue_enqueue(message_queue_t* queue, message_packet_t* packet) {
@@ -79,42 +224,60 @@ void message_queue_enqueue(message_queue_t* queue, message_packet_t* packet) {
         return;
     }
     
-    packet->next = NULL;
-    packet->prev = queue->tail;
-    
-    if (queue->tail) {
-        queue->tail->next = packet;
-    } else {
-        queue->head = packet;
+    queue_push(queue, packet);
+    atomic_fetch_add_explicit(&queue->count, 1, memory_order_release);
+}
+
+/* Skips the stub if it is at the front; returns the oldest message or NULL. */
+static message_packet_t* queue_front(message_queue_t* queue) {
+    message_packet_t* head = queue->head;
+    if (head == &queue->stub) {
+        message_packet_t* next = atomic_load_explicit(&head->next, memory_order_acquire);
+        if (!next) {
+            return NULL;
+        }
+        queue->head = next;
+        head = next;
     }
-    
-    queue->tail = packet;
-    queue->count++;
+    return head;
 }
 
 message_packet_t* message_queue_dequeue(message_queue_t* queue) {
-    if (!queue || !queue->head) {
+    if (!queue) {
         return NULL;
     }
     
-    message_packet_t* packet = queue->head;
-    queue->head = packet->next;
-    
-    if (queue->head) {
-        queue->head->prev = NULL;
-    } else {
-        queue->tail = NULL;
+    message_packet_t* head = queue_front(queue);
+    if (!head) {
+        return NULL;
     }
     
-    packet->next = NULL;
-    packet->prev = NULL;
-    queue->count--;
+    message_packet_t* next = atomic_load_explicit(&head->next, memory_order_acquire);
+    if (!next) {
+        if (head != atomic_load_explicit(&queue->tail, memory_order_acquire)) {
+            /* A producer has swapped the tail but not linked it yet. */
+            return NULL;
+        }
+        /* Last message: put the stub behind it so the queue never empties. */
+        queue_push(queue, &queue->stub);
+        next = atomic_load_explicit(&head->next, memory_order_acquire);
+        if (!next) {
+            return NULL;
+        }
+    }
     
-    return packet;
+    queue->head = next;
+    atomic_store_explicit(&head->next, NULL, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&queue->count, 1, memory_order_relaxed);
+    return head;
+}
+
+message_packet_t* message_queue_peek(message_queue_t* queue) {
+    return queue ? queue_front(queue) : NULL;
 }
 
 bool message_queue_is_empty(message_queue_t* queue) {
-    return !queue || queue->count == 0;
+    return !queue || atomic_load_explicit(&queue->count, memory_order_acquire) == 0;
 }
 
 void message_queue_destroy(message_queue_t* queue) {
@@ -122,14 +285,8 @@ void message_queue_destroy(message_queue_t* queue) {
         return;
     }
     
-    message_packet_t* packet = queue->head;
-    while (packet) {
-        message_packet_t* next = packet->next;
+    message_packet_t* packet;
+    while ((packet = message_queue_dequeue(queue)) != NULL) {
         message_packet_destroy(packet);
-        packet = next;
     }
-    
-    queue->head = NULL;
-    queue->tail = NULL;
-    queue->count = 0;
 }
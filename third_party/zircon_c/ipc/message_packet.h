@@ -2,34 +2,96 @@
 #define ZIRCON_IPC_MESSAGE_PACKET_H_
 
 #include "handle.h"
+#include "../vm/spinlock.h"
+#include "../vm/vmo_bootstrap.h"
+#include <stdatomic.h>
 #include <stddef.h>
 
+/*
+ * Packets are a single allocation: this header, then the handles, then the
+ * data. Payloads up to the largest size class come from per-class slab
+ * caches, so steady-state traffic makes no heap calls; larger ones are
+ * allocated and freed directly.
+ */
+#define MESSAGE_SIZE_CLASSES    4
+#define MESSAGE_MAX_POOLED      8192u   /* Payload bytes of the largest class */
+#define MESSAGE_POOL_DEPTH      16      /* Packets an endpoint keeps per class */
+#define MESSAGE_SLAB_SIZE       (64u * 1024u)
+#define MESSAGE_CLASS_NONE      0xFFu
+
+struct message_pool;
+
 typedef struct message_packet {
-    struct message_packet* next;
-    struct message_packet* prev;
+    _Atomic(struct message_packet*) next;   /* Queue link, or free-list link */
     
     uint32_t data_size;
     uint32_t num_handles;
     
     uint8_t* data;
     zx_handle_t* handles;
+    
+    uint8_t size_class;
+    struct message_pool* pool;  /* Where the packet returns when destroyed */
+    
+    /*
+     * Lent pages of a page message, in place of byte data; |arena| is set
+     * only on page messages. The packet holds one reference on each of the
+     * VMO's committed pages and drops them back to |arena| if it is
+     * destroyed unread.
+     */
+    vmo_t vmo;
+    pmm_arena_t* arena;
 } message_packet_t;
 
+/*
+ * Intrusive multi-producer, single-consumer queue. Producers never lock:
+ * each swaps itself in as the tail and then links the old tail to it. The
+ * consumer owns |head| and must be serialized by the caller; the embedded
+ * stub keeps the list non-empty so producers never touch |head|. A dequeue
+ * can briefly see the queue as empty while a producer is between its two
+ * steps.
+ */
 typedef struct message_queue {
+    _Atomic(message_packet_t*) tail;
     message_packet_t* head;
-    message_packet_t* tail;
-    uint32_t count;
+    atomic_uint count;
+    message_packet_t stub;
 } message_queue_t;
 
+/*
+ * A small cache of free packets per size class, owned by the endpoint the
+ * packets are queued on. Writers allocate from the reader's pool and the
+ * reader returns packets to it, so chatty channels recycle the same few
+ * packets. Once destroyed, the pool passes returned packets to the slabs.
+ */
+typedef struct message_pool {
+    vm_spinlock_t lock;
+    bool closed;
+    message_packet_t* free[MESSAGE_SIZE_CLASSES];
+    uint32_t free_count[MESSAGE_SIZE_CLASSES];
+} message_pool_t;
+
 zx_status_t message_packet_create(const void* data, uint32_t data_size, 
                                    const zx_handle_t* handles, uint32_t num_handles,
                                    message_packet_t** out_packet);
 
+zx_status_t message_packet_create_pooled(message_pool_t* pool,
+                                          const void* data, uint32_t data_size,
+                                          const zx_handle_t* handles, uint32_t num_handles,
+                                          message_packet_t** out_packet);
+
 void message_packet_destroy(message_packet_t* packet);
 
+/* Moves |vmo|'s pages into |packet|, leaving |vmo| empty. */
+void message_packet_attach_vmo(message_packet_t* packet, pmm_arena_t* arena, vmo_t* vmo);
+
+void message_pool_init(message_pool_t* pool);
+void message_pool_destroy(message_pool_t* pool);
+
 void message_queue_init(message_queue_t* queue);
 void message_queue_enqueue(message_queue_t* queue, message_packet_t* packet);
 message_packet_t* message_queue_dequeue(message_queue_t* queue);
+message_packet_t* message_queue_peek(message_queue_t* queue);
 bool message_queue_is_empty(message_queue_t* queue);
 void message_queue_destroy(message_queue_t* queue);
 
@@ -0,0 +1,173 @@
+#include "lz4.h"
+#include <stdbool.h>
+#include <string.h>
+
+#define MIN_MATCH 4
+#define LAST_LITERALS 5     /* The block must end with this many literals */
+#define MATCH_GUARD 12      /* No match may start closer to the end than this */
+#define HASH_BITS 12
+#define NO_POSITION UINT16_MAX
+
+static inline uint32_t read32(const uint8_t* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint32_t hash_sequence(uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - HASH_BITS);
+}
+
+/* Bytes needed after the token nibble to encode |length|. */
+static inline size_t extra_length_bytes(size_t length) {
+    return length >= 15 ? (length - 15) / 255 + 1 : 0;
+}
+
+static uint8_t* write_extra_length(uint8_t* op, size_t length) {
+    if (length < 15) {
+        return op;
+    }
+    length -= 15;
+    while (length >= 255) {
+        *op++ = 255;
+        length -= 255;
+    }
+    *op++ = (uint8_t)length;
+    return op;
+}
+
+static bool read_extra_length(const uint8_t** ip, const uint8_t* end, size_t* length) {
+    if (*length != 15) {
+        return true;
+    }
+    uint8_t byte;
+    do {
+        if (*ip >= end) {
+            return false;
+        }
+        byte = *(*ip)++;
+        *length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+size_t vm_lz4_compress(const uint8_t* src, size_t src_len, uint8_t* dst, size_t dst_capacity) {
+    if (src == NULL || dst == NULL || src_len > VM_LZ4_MAX_INPUT) {
+        return 0;
+    }
+
+    uint16_t table[1u << HASH_BITS];
+    memset(table, 0xFF, sizeof(table));
+
+    const uint8_t* ip = src;
+    const uint8_t* anchor = src;
+    const uint8_t* end = src + src_len;
+    const uint8_t* match_limit = end - (src_len >= LAST_LITERALS ? LAST_LITERALS : src_len);
+    uint8_t* op = dst;
+    uint8_t* op_end = dst + dst_capacity;
+
+    while (src_len > MATCH_GUARD && ip < end - MATCH_GUARD) {
+        uint32_t sequence = read32(ip);
+        uint32_t h = hash_sequence(sequence);
+        uint16_t candidate = table[h];
+        table[h] = (uint16_t)(ip - src);
+
+        if (candidate == NO_POSITION || read32(src + candidate) != sequence) {
+            ip++;
+            continue;
+        }
+
+        const uint8_t* match = src + candidate;
+        const uint8_t* match_end = ip + MIN_MATCH;
+        while (match_end < match_limit && *match_end == match[match_end - ip]) {
+            match_end++;
+        }
+
+        size_t literals = (size_t)(ip - anchor);
+        size_t match_length = (size_t)(match_end - ip) - MIN_MATCH;
+        size_t needed = 1 + extra_length_bytes(literals) + literals + 2 + extra_length_bytes(match_length);
+        if (needed > (size_t)(op_end - op)) {
+            return 0;
+        }
+
+        uint8_t* token = op++;
+        *token = (uint8_t)(((literals < 15 ? literals : 15) << 4) | (match_length < 15 ? match_length : 15));
+        op = write_extra_length(op, literals);
+        memcpy(op, anchor, literals);
+        op += literals;
+
+        size_t offset = (size_t)(ip - match);
+        *op++ = (uint8_t)(offset & 0xFF);
+        *op++ = (uint8_t)(offset >> 8);
+        op = write_extra_length(op, match_length);
+
+        ip = match_end;
+        anchor = ip;
+    }
+
+    size_t literals = (size_t)(end - anchor);
+    if (1 + extra_length_bytes(literals) + literals > (size_t)(op_end - op)) {
+        return 0;
+    }
+    *op++ = (uint8_t)((literals < 15 ? literals : 15) << 4);
+    op = write_extra_length(op, literals);
+    memcpy(op, anchor, literals);
+    op += literals;
+
+    return (size_t)(op - dst);
+}
+
+zx_status_t vm_lz4_decompress(const uint8_t* src, size_t src_len, uint8_t* dst, size_t dst_len) {
+    if (src == NULL || dst == NULL) {
+        return ZX_ERR_INVALID_ARGS;
+    }
+
+    const uint8_t* ip = src;
+    const uint8_t* end = src + src_len;
+    uint8_t* op = dst;
+    uint8_t* op_end = dst + dst_len;
+
+    while (ip < end) {
+        uint8_t token = *ip++;
+
+        size_t literals = token >> 4;
+        if (!read_extra_length(&ip, end, &literals) ||
+            literals > (size_t)(end - ip) || literals > (size_t)(op_end - op)) {
+            return ZX_ERR_IO_DATA_INTEGRITY;
+        }
+        memcpy(op, ip, literals);
+        op += literals;
+        ip += literals;
+
+        /* The last sequence has literals only. */
+        if (ip == end) {
+            break;
+        }
+
+        if (end - ip < 2) {
+            return ZX_ERR_IO_DATA_INTEGRITY;
+        }
+        size_t offset = (size_t)ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst)) {
+            return ZX_ERR_IO_DATA_INTEGRITY;
+        }
+
+        size_t match_length = token & 0x0F;
+        if (!read_extra_length(&ip, end, &match_length)) {
+            return ZX_ERR_IO_DATA_INTEGRITY;
+        }
+        match_length += MIN_MATCH;
+        if (match_length > (size_t)(op_end - op)) {
+            return ZX_ERR_IO_DATA_INTEGRITY;
+        }
+
+        /* Byte by byte: the match may overlap what it is producing. */
+        const uint8_t* match = op - offset;
+        while (match_length-- > 0) {
+            *op++ = *match++;
+        }
+    }
+
+    return op == op_end ? ZX_OK : ZX_ERR_IO_DATA_INTEGRITY;
+}
@@ -0,0 +1,34 @@
+#ifndef THIRD_PARTY_ZIRCON_C_VM_LZ4_H_
+#define THIRD_PARTY_ZIRCON_C_VM_LZ4_H_
+
+#include "vm_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * LZ4 block format, without the frame header: what the compressed page
+ * tier stores. Inputs are at most VM_LZ4_MAX_INPUT bytes, which covers a
+ * page, so matches always fit the format's 16-bit offsets.
+ */
+#define VM_LZ4_MAX_INPUT 65535
+
+/*
+ * Compresses |src_len| bytes into |dst| and returns the compressed size, or
+ * 0 if the result would not fit in |dst_capacity| bytes.
+ */
+size_t vm_lz4_compress(const uint8_t* src, size_t src_len, uint8_t* dst, size_t dst_capacity);
+
+/*
+ * Decompresses |src_len| bytes of block data into exactly |dst_len| bytes.
+ * Returns ZX_ERR_IO_DATA_INTEGRITY if the block is malformed or does not
+ * expand to |dst_len| bytes.
+ */
+zx_status_t vm_lz4_decompress(const uint8_t* src, size_t src_len, uint8_t* dst, size_t dst_len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
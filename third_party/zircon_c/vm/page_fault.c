@@ -1,4 +1,5 @@
 #include "page_fault.h"
+#include <stdbool.h>
 
 zx_status_t page_fault_handler_init(page_fault_handler_t* handler, vmo_t* vmo, pmm_arena_t* arena) {
     if (handler == NULL || vmo == NULL || arena == NULL) {
@@ -7,9 +8,49 @@ zx_status_t page_fault_handler_init(page_fault_handler_t* handler, vmo_t* vmo, p
 
     handler->vmo = vmo;
     handler->arena = arena;
+    handler->next_index = PAGE_FAULT_NO_HISTORY;
     return ZX_OK;
 }
 
+static zx_status_t handle_locked(page_fault_handler_t* handler, size_t page_index, bool write) {
+    vmo_t* vmo = handler->vmo;
+    pmm_arena_t* arena = handler->arena;
+    bool sequential = page_index == handler->next_index;
+    handler->next_index = page_index + 1;
+
+    /* A page the reclaimer compressed comes back the same way for reads and writes. */
+    if (vmo_bootstrap_is_compressed(vmo, page_index)) {
+        return vmo_bootstrap_decompress_page(vmo, arena, page_index);
+    }
+
+    /*
+     * Reads of untouched memory map the shared zero page. Writes replace it,
+     * or copy a page a clone still shares, via vmo_bootstrap_commit_page.
+     */
+    vm_page_t* page = vmo_bootstrap_lookup(vmo, page_index);
+    if (page != NULL && !write) {
+        return ZX_OK;
+    }
+
+    if (sequential && (page == NULL || page == arena->zero_page)) {
+        size_t first = page_index & ~(size_t)(PAGE_FAULT_AROUND_PAGES - 1);
+        size_t count = PAGE_FAULT_AROUND_PAGES;
+        if (count > vmo->page_count - first) {
+            count = vmo->page_count - first;
+        }
+        zx_status_t status = write ? vmo_bootstrap_commit_range(vmo, arena, first, count)
+                                   : vmo_bootstrap_map_zero_pages(vmo, arena, first, count);
+        /* Under memory pressure fall back to the faulting page alone. */
+        if (status == ZX_OK) {
+            handler->next_index = first + count;
+            return ZX_OK;
+        }
+    }
+
+    return write ? vmo_bootstrap_commit_page(vmo, arena, page_index)
+                 : vmo_bootstrap_map_zero_pages(vmo, arena, page_index, 1);
+}
+
 zx_status_t page_fault_handle(page_fault_handler_t* handler, vaddr_t fault_addr, uint32_t flags) {
     if (handler == NULL) {
         return ZX_ERR_INVALID_ARGS;
@@ -25,12 +66,15 @@ zx_status_t page_fault_handle(page_fault_handler_t* handler, vaddr_t fault_addr,
         return ZX_ERR_NOT_FOUND;
     }
 
-    if (handler->vmo->pages[page_index] == NULL) {
-        zx_status_t status = vmo_bootstrap_commit_page(handler->vmo, handler->arena, page_index);
-        if (status != ZX_OK) {
-            return status;
+    vmo_t* vmo = handler->vmo;
+    vm_spin_lock(&vmo->lock);
+    zx_status_t status = handle_locked(handler, page_index, (flags & PAGE_FAULT_FLAG_WRITE) != 0);
+    if (status == ZX_OK) {
+        vm_page_t* page = vmo_bootstrap_lookup(vmo, page_index);
+        if (page != NULL && page != handler->arena->zero_page) {
+            vm_page_mark_accessed(page);
         }
     }
-
-    return ZX_OK;
+    vm_spin_unlock(&vmo->lock);
+    return status;
 }
@@ -5,6 +5,10 @@
 #include "vmo_bootstrap.h"
 #include "pmm_arena.h"
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 typedef enum page_fault_flags {
     PAGE_FAULT_FLAG_READ = (1 << 0),
     PAGE_FAULT_FLAG_WRITE = (1 << 1),
@@ -12,12 +16,25 @@ typedef enum page_fault_flags {
     PAGE_FAULT_FLAG_USER = (1 << 3),
 } page_fault_flags_t;
 
+/*
+ * A fault on the page right after the previous fault's range counts as
+ * sequential, and commits the whole aligned window of this many pages
+ * around it instead of the single faulting page.
+ */
+#define PAGE_FAULT_AROUND_PAGES 16
+#define PAGE_FAULT_NO_HISTORY SIZE_MAX
+
 typedef struct page_fault_handler {
     vmo_t* vmo;
     pmm_arena_t* arena;
+    size_t next_index;      /* Page a sequential fault would hit next */
 } page_fault_handler_t;
 
 zx_status_t page_fault_handler_init(page_fault_handler_t* handler, vmo_t* vmo, pmm_arena_t* arena);
 zx_status_t page_fault_handle(page_fault_handler_t* handler, vaddr_t fault_addr, uint32_t flags);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif
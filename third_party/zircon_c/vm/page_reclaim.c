@@ -0,0 +1,276 @@
+#include "page_reclaim.h"
+#include <string.h>
+
+static bool is_running(vm_reclaimer_t* reclaimer) {
+    pthread_mutex_lock(&reclaimer->wake_lock);
+    bool running = reclaimer->running;
+    pthread_mutex_unlock(&reclaimer->wake_lock);
+    return running;
+}
+
+zx_status_t vm_reclaimer_init(vm_reclaimer_t* reclaimer, pmm_arena_t* arena,
+                              size_t low_watermark, size_t high_watermark) {
+    if (reclaimer == NULL || arena == NULL || high_watermark < low_watermark) {
+        return ZX_ERR_INVALID_ARGS;
+    }
+
+    if (arena->physmap == NULL) {
+        return ZX_ERR_NOT_SUPPORTED;
+    }
+
+    memset(reclaimer, 0, sizeof(*reclaimer));
+    reclaimer->arena = arena;
+    reclaimer->low_watermark = low_watermark;
+    reclaimer->high_watermark = high_watermark;
+    pthread_mutex_init(&reclaimer->lock, NULL);
+    pthread_mutex_init(&reclaimer->wake_lock, NULL);
+    pthread_cond_init(&reclaimer->wake, NULL);
+    return ZX_OK;
+}
+
+void vm_reclaimer_destroy(vm_reclaimer_t* reclaimer) {
+    if (reclaimer == NULL) {
+        return;
+    }
+
+    vm_reclaimer_stop(reclaimer);
+    pthread_cond_destroy(&reclaimer->wake);
+    pthread_mutex_destroy(&reclaimer->wake_lock);
+    pthread_mutex_destroy(&reclaimer->lock);
+}
+
+zx_status_t vm_reclaimer_add_vmo(vm_reclaimer_t* reclaimer, vmo_t* vmo) {
+    if (reclaimer == NULL || vmo == NULL) {
+        return ZX_ERR_INVALID_ARGS;
+    }
+
+    pthread_mutex_lock(&reclaimer->lock);
+    for (size_t i = 0; i < reclaimer->num_vmos; i++) {
+        if (reclaimer->vmos[i] == vmo) {
+            pthread_mutex_unlock(&reclaimer->lock);
+            return ZX_OK;
+        }
+    }
+    if (reclaimer->num_vmos == VM_RECLAIM_MAX_VMOS) {
+        pthread_mutex_unlock(&reclaimer->lock);
+        return ZX_ERR_NO_RESOURCES;
+    }
+    reclaimer->vmos[reclaimer->num_vmos++] = vmo;
+    pthread_mutex_unlock(&reclaimer->lock);
+    return ZX_OK;
+}
+
+void vm_reclaimer_remove_vmo(vm_reclaimer_t* reclaimer, vmo_t* vmo) {
+    if (reclaimer == NULL || vmo == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&reclaimer->lock);
+    for (size_t i = 0; i < reclaimer->num_vmos; i++) {
+        if (reclaimer->vmos[i] != vmo) {
+            continue;
+        }
+        memmove(&reclaimer->vmos[i], &reclaimer->vmos[i + 1],
+                (reclaimer->num_vmos - i - 1) * sizeof(vmo_t*));
+        reclaimer->num_vmos--;
+        if (i < reclaimer->hand_vmo) {
+            reclaimer->hand_vmo--;
+        } else if (i == reclaimer->hand_vmo) {
+            reclaimer->hand_index = 0;
+        }
+        break;
+    }
+    pthread_mutex_unlock(&reclaimer->lock);
+}
+
+/*
+ * Advances the hand over up to VM_RECLAIM_BATCH of |vmo|'s resident pages
+ * under its lock. Returns true once the hand has passed the last one.
+ */
+static bool sweep_batch(vm_reclaimer_t* reclaimer, vmo_t* vmo, size_t budget, size_t target,
+                        size_t* examined, size_t* reclaimed) {
+    pmm_arena_t* arena = reclaimer->arena;
+    vm_reclaim_stats_t* stats = &reclaimer->stats;
+    bool finished = false;
+
+    vm_spin_lock(&vmo->lock);
+    size_t index = reclaimer->hand_index;
+    for (size_t n = 0; n < VM_RECLAIM_BATCH && *examined < budget && *reclaimed < target; n++) {
+        size_t found;
+        vm_page_t* page = vmo_bootstrap_next_page(vmo, index, &found);
+        if (page == NULL) {
+            finished = true;
+            break;
+        }
+        index = found + 1;
+        (*examined)++;
+        stats->scanned++;
+
+        if (page == arena->zero_page || __atomic_load_n(&page->ref_count, __ATOMIC_ACQUIRE) != 1) {
+            continue;
+        }
+
+        uint8_t age = __atomic_load_n(&page->age, __ATOMIC_RELAXED);
+        if (age < VM_PAGE_AGE_COLD) {
+            __atomic_store_n(&page->age, (uint8_t)(age + 1), __ATOMIC_RELAXED);
+            continue;
+        }
+
+        size_t size;
+        zx_status_t status = vmo_bootstrap_compress_page(vmo, arena, found, &size);
+        if (status == ZX_OK) {
+            (*reclaimed)++;
+            if (size == 0) {
+                stats->dropped++;
+            } else {
+                stats->compressed++;
+                stats->compressed_bytes += size;
+            }
+        } else {
+            /* Leave it for another VM_PAGE_AGE_COLD sweeps before retrying. */
+            if (status == ZX_ERR_BUFFER_TOO_SMALL) {
+                stats->incompressible++;
+            }
+            vm_page_mark_accessed(page);
+        }
+    }
+    vm_spin_unlock(&vmo->lock);
+
+    reclaimer->hand_index = index;
+    return finished;
+}
+
+size_t vm_reclaim_pages(vm_reclaimer_t* reclaimer, size_t target) {
+    if (reclaimer == NULL || target == 0) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&reclaimer->lock);
+
+    size_t budget = 0;
+    for (size_t i = 0; i < reclaimer->num_vmos; i++) {
+        vmo_t* vmo = reclaimer->vmos[i];
+        vm_spin_lock(&vmo->lock);
+        budget += vmo->committed - vmo->compressed;
+        vm_spin_unlock(&vmo->lock);
+    }
+
+    /* Faults can shrink the VMOs mid-sweep, so stop after one lap regardless. */
+    size_t examined = 0;
+    size_t reclaimed = 0;
+    size_t passed = 0;
+    while (examined < budget && reclaimed < target && passed <= reclaimer->num_vmos) {
+        if (reclaimer->hand_vmo >= reclaimer->num_vmos) {
+            reclaimer->hand_vmo = 0;
+            reclaimer->hand_index = 0;
+        }
+        vmo_t* vmo = reclaimer->vmos[reclaimer->hand_vmo];
+        if (sweep_batch(reclaimer, vmo, budget, target, &examined, &reclaimed)) {
+            reclaimer->hand_vmo++;
+            reclaimer->hand_index = 0;
+            passed++;
+        }
+    }
+
+    pthread_mutex_unlock(&reclaimer->lock);
+    return reclaimed;
+}
+
+/*
+ * Sweeps until the high watermark is met. A page needs VM_PAGE_AGE_COLD
+ * sweeps to age before the one that takes it, so give up only after that
+ * many sweeps in a row reclaim nothing.
+ */
+static void reclaim_to_high_watermark(vm_reclaimer_t* reclaimer) {
+    size_t idle_sweeps = 0;
+    while (idle_sweeps <= VM_PAGE_AGE_COLD && is_running(reclaimer)) {
+        size_t free_pages = pmm_arena_free_count(reclaimer->arena);
+        if (free_pages >= reclaimer->high_watermark) {
+            break;
+        }
+        if (vm_reclaim_pages(reclaimer, reclaimer->high_watermark - free_pages) == 0) {
+            idle_sweeps++;
+        } else {
+            idle_sweeps = 0;
+        }
+    }
+}
+
+static void* reclaim_thread(void* arg) {
+    vm_reclaimer_t* reclaimer = (vm_reclaimer_t*)arg;
+
+    pthread_mutex_lock(&reclaimer->wake_lock);
+    while (reclaimer->running) {
+        if (!reclaimer->kicked) {
+            pthread_cond_wait(&reclaimer->wake, &reclaimer->wake_lock);
+            continue;
+        }
+        reclaimer->kicked = false;
+        pthread_mutex_unlock(&reclaimer->wake_lock);
+        reclaim_to_high_watermark(reclaimer);
+        pthread_mutex_lock(&reclaimer->wake_lock);
+    }
+    pthread_mutex_unlock(&reclaimer->wake_lock);
+    return NULL;
+}
+
+static void on_pressure(void* ctx) {
+    vm_reclaimer_t* reclaimer = (vm_reclaimer_t*)ctx;
+    pthread_mutex_lock(&reclaimer->wake_lock);
+    reclaimer->kicked = true;
+    pthread_cond_signal(&reclaimer->wake);
+    pthread_mutex_unlock(&reclaimer->wake_lock);
+}
+
+zx_status_t vm_reclaimer_start(vm_reclaimer_t* reclaimer) {
+    if (reclaimer == NULL) {
+        return ZX_ERR_INVALID_ARGS;
+    }
+
+    pthread_mutex_lock(&reclaimer->wake_lock);
+    if (reclaimer->running) {
+        pthread_mutex_unlock(&reclaimer->wake_lock);
+        return ZX_ERR_BAD_STATE;
+    }
+    reclaimer->running = true;
+    reclaimer->kicked = false;
+    pthread_mutex_unlock(&reclaimer->wake_lock);
+
+    if (pthread_create(&reclaimer->thread, NULL, reclaim_thread, reclaimer) != 0) {
+        pthread_mutex_lock(&reclaimer->wake_lock);
+        reclaimer->running = false;
+        pthread_mutex_unlock(&reclaimer->wake_lock);
+        return ZX_ERR_NO_RESOURCES;
+    }
+
+    pmm_arena_set_pressure_callback(reclaimer->arena, reclaimer->low_watermark, on_pressure, reclaimer);
+    return ZX_OK;
+}
+
+void vm_reclaimer_stop(vm_reclaimer_t* reclaimer) {
+    if (reclaimer == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&reclaimer->wake_lock);
+    if (!reclaimer->running) {
+        pthread_mutex_unlock(&reclaimer->wake_lock);
+        return;
+    }
+    reclaimer->running = false;
+    pthread_cond_signal(&reclaimer->wake);
+    pthread_mutex_unlock(&reclaimer->wake_lock);
+
+    pmm_arena_set_pressure_callback(reclaimer->arena, 0, NULL, NULL);
+    pthread_join(reclaimer->thread, NULL);
+}
+
+void vm_reclaimer_get_stats(vm_reclaimer_t* reclaimer, vm_reclaim_stats_t* out_stats) {
+    if (reclaimer == NULL || out_stats == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&reclaimer->lock);
+    *out_stats = reclaimer->stats;
+    pthread_mutex_unlock(&reclaimer->lock);
+}
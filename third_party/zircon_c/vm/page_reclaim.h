@@ -0,0 +1,93 @@
+#ifndef THIRD_PARTY_ZIRCON_C_VM_PAGE_RECLAIM_H_
+#define THIRD_PARTY_ZIRCON_C_VM_PAGE_RECLAIM_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "vm_types.h"
+#include "pmm_arena.h"
+#include "vmo_bootstrap.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Clock reclaim over a set of VMOs. Each sweep ages every private resident
+ * page by one; a page that reaches VM_PAGE_AGE_COLD without being touched
+ * is moved out of the arena by vmo_bootstrap_compress_page, freed outright
+ * if it is all zeros or kept LZ4-compressed otherwise. A fault brings it
+ * back. Shared pages and the zero page are never reclaimed.
+ */
+#define VM_RECLAIM_MAX_VMOS 64
+#define VM_PAGE_AGE_COLD 3
+#define VM_RECLAIM_BATCH 32     /* Pages examined per hold of a VMO's lock */
+
+typedef struct vm_reclaim_stats {
+    uint64_t scanned;
+    uint64_t dropped;           /* Zero pages freed without storing anything */
+    uint64_t compressed;
+    uint64_t incompressible;
+    uint64_t compressed_bytes;  /* Stored by |compressed|, over the reclaimer's life */
+} vm_reclaim_stats_t;
+
+typedef struct vm_reclaimer {
+    pmm_arena_t* arena;
+    size_t low_watermark;
+    size_t high_watermark;
+
+    pthread_mutex_t lock;       /* Protects the fields below and serializes sweeps */
+    vmo_t* vmos[VM_RECLAIM_MAX_VMOS];
+    size_t num_vmos;
+    size_t hand_vmo;            /* Clock hand: where the next sweep resumes */
+    size_t hand_index;
+    vm_reclaim_stats_t stats;
+
+    pthread_t thread;
+    pthread_mutex_t wake_lock;  /* Protects running and kicked */
+    pthread_cond_t wake;
+    bool running;
+    bool kicked;
+} vm_reclaimer_t;
+
+/*
+ * Background reclaim starts when the arena's free pages drop below
+ * |low_watermark| and runs until |high_watermark| pages are free again, or
+ * nothing more can be reclaimed. The arena needs a physmap, since pages are
+ * reclaimed by compressing their contents.
+ */
+zx_status_t vm_reclaimer_init(vm_reclaimer_t* reclaimer, pmm_arena_t* arena,
+                              size_t low_watermark, size_t high_watermark);
+
+/* Stops the background thread if it is running. */
+void vm_reclaimer_destroy(vm_reclaimer_t* reclaimer);
+
+/*
+ * Registered VMOs must stay at the same address, and share the reclaimer's
+ * arena, until they are removed.
+ */
+zx_status_t vm_reclaimer_add_vmo(vm_reclaimer_t* reclaimer, vmo_t* vmo);
+void vm_reclaimer_remove_vmo(vm_reclaimer_t* reclaimer, vmo_t* vmo);
+
+/*
+ * One sweep of the clock from where the last one stopped: examines as many
+ * pages as the registered VMOs hold, or stops early once |target| pages
+ * have been reclaimed. Returns the number reclaimed.
+ */
+size_t vm_reclaim_pages(vm_reclaimer_t* reclaimer, size_t target);
+
+/*
+ * Starts the background thread and hooks it to the arena's watermark.
+ * Allocations on other threads must have stopped before the reclaimer is
+ * destroyed, since one may be about to wake it.
+ */
+zx_status_t vm_reclaimer_start(vm_reclaimer_t* reclaimer);
+void vm_reclaimer_stop(vm_reclaimer_t* reclaimer);
+
+void vm_reclaimer_get_stats(vm_reclaimer_t* reclaimer, vm_reclaim_stats_t* out_stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,7 +1,173 @@
 #include "pmm_arena.h"
 #include <string.h>
+#include <stdbool.h>
 #include <stdlib.h>
 
+static unsigned int g_next_cpu;
+static _Thread_local unsigned int t_cpu = PMM_MAX_CPUS;
+
+/*
+ * Stands in for the current CPU number: each thread is given a slot on first
+ * use. A thread can still migrate, so magazines keep a lock, but it is
+ * almost never contended.
+ */
+static pmm_magazine_t* current_magazine(pmm_arena_t* arena) {
+    if (t_cpu == PMM_MAX_CPUS) {
+        t_cpu = __atomic_fetch_add(&g_next_cpu, 1, __ATOMIC_RELAXED) % PMM_MAX_CPUS;
+    }
+    return &arena->magazines[t_cpu];
+}
+
+/*
+ * free_count and the magazine counts change only under their locks, but
+ * pmm_arena_free_count reads them without one, so every change is a relaxed
+ * atomic store.
+ */
+static inline void free_count_add(pmm_arena_t* arena, size_t pages) {
+    __atomic_store_n(&arena->free_count, arena->free_count + pages, __ATOMIC_RELAXED);
+}
+
+static inline void free_count_sub(pmm_arena_t* arena, size_t pages) {
+    __atomic_store_n(&arena->free_count, arena->free_count - pages, __ATOMIC_RELAXED);
+}
+
+static inline void magazine_push(pmm_magazine_t* magazine, vm_page_t* page) {
+    magazine->pages[magazine->count] = page;
+    __atomic_store_n(&magazine->count, magazine->count + 1, __ATOMIC_RELAXED);
+}
+
+static inline vm_page_t* magazine_pop(pmm_magazine_t* magazine) {
+    size_t count = magazine->count - 1;
+    __atomic_store_n(&magazine->count, count, __ATOMIC_RELAXED);
+    return magazine->pages[count];
+}
+
+static inline size_t page_index(pmm_arena_t* arena, vm_page_t* page) {
+    return (size_t)(page - arena->page_array);
+}
+
+static inline uint8_t block_group(pmm_arena_t* arena, size_t index) {
+    return arena->page_array[index & ~(((size_t)1 << PMM_TOP_ORDER) - 1)].group;
+}
+
+static inline uint32_t* free_list_for(pmm_arena_t* arena, size_t index, uint8_t order) {
+    uint8_t group = order == PMM_TOP_ORDER ? 0 : block_group(arena, index);
+    return &arena->free_lists[group][order];
+}
+
+/* The free-list helpers below are called with the arena lock held. */
+static void free_list_insert(pmm_arena_t* arena, vm_page_t* head, uint8_t order) {
+    uint32_t index = (uint32_t)page_index(arena, head);
+    uint32_t* list = free_list_for(arena, index, order);
+    head->state = VM_PAGE_STATE_FREE;
+    head->order = order;
+    head->prev = VM_PAGE_INDEX_NONE;
+    head->next = *list;
+    if (*list != VM_PAGE_INDEX_NONE) {
+        arena->page_array[*list].prev = index;
+    }
+    *list = index;
+}
+
+static void free_list_remove(pmm_arena_t* arena, vm_page_t* head) {
+    if (head->prev != VM_PAGE_INDEX_NONE) {
+        arena->page_array[head->prev].next = head->next;
+    } else {
+        *free_list_for(arena, page_index(arena, head), head->order) = head->next;
+    }
+    if (head->next != VM_PAGE_INDEX_NONE) {
+        arena->page_array[head->next].prev = head->prev;
+    }
+    head->next = VM_PAGE_INDEX_NONE;
+    head->prev = VM_PAGE_INDEX_NONE;
+    head->order = VM_PAGE_ORDER_NONE;
+}
+
+/*
+ * Returns the block of 2^|order| pages at |index| to the free lists, merging
+ * it with its buddy for as long as the buddy is free and whole.
+ */
+static void buddy_free(pmm_arena_t* arena, size_t index, uint8_t order) {
+    free_count_add(arena, (size_t)1 << order);
+    while (order < PMM_TOP_ORDER) {
+        size_t buddy_index = index ^ ((size_t)1 << order);
+        if (buddy_index + ((size_t)1 << order) > arena->page_count) {
+            break;
+        }
+        vm_page_t* buddy = &arena->page_array[buddy_index];
+        if (buddy->state != VM_PAGE_STATE_FREE || buddy->order != order) {
+            break;
+        }
+        free_list_remove(arena, buddy);
+        index &= ~((size_t)1 << order);
+        order++;
+    }
+    free_list_insert(arena, &arena->page_array[index], order);
+}
+
+/* Takes |head|, a free block of |from| pages, and returns its leading 2^|order| pages. */
+static vm_page_t* buddy_split(pmm_arena_t* arena, vm_page_t* head, uint8_t from, uint8_t order, uint8_t group) {
+    size_t index = page_index(arena, head);
+    free_list_remove(arena, head);
+    if (from == PMM_TOP_ORDER) {
+        head->group = group;
+    }
+    while (from > order) {
+        from--;
+        free_list_insert(arena, &arena->page_array[index + ((size_t)1 << from)], from);
+    }
+    free_count_sub(arena, (size_t)1 << order);
+    return head;
+}
+
+/*
+ * Finds a free block of at least 2^|order| pages, splitting the smallest
+ * one available: first the group's own blocks, then a whole pageblock,
+ * then the other group's blocks.
+ */
+static vm_page_t* buddy_alloc(pmm_arena_t* arena, uint8_t order, uint8_t group) {
+    for (uint8_t pass = 0; pass < 2; pass++) {
+        uint8_t g = pass == 0 ? group : (uint8_t)(group ^ 1);
+        for (uint8_t o = order; o < PMM_TOP_ORDER; o++) {
+            if (arena->free_lists[g][o] != VM_PAGE_INDEX_NONE) {
+                return buddy_split(arena, &arena->page_array[arena->free_lists[g][o]], o, order, group);
+            }
+        }
+        uint32_t top = arena->free_lists[0][PMM_TOP_ORDER];
+        if (pass == 0 && top != VM_PAGE_INDEX_NONE) {
+            return buddy_split(arena, &arena->page_array[top], PMM_TOP_ORDER, order, group);
+        }
+    }
+    return NULL;
+}
+
+static void mark_allocated(vm_page_t* page) {
+    page->state = VM_PAGE_STATE_ALLOCATED;
+    page->age = 0;
+    page->ref_count = 1;
+    page->next = VM_PAGE_INDEX_NONE;
+    page->prev = VM_PAGE_INDEX_NONE;
+}
+
+/*
+ * Drops one reference; returns true if that was the last one and the page
+ * is now free for the caller to put back.
+ */
+static bool release_page(vm_page_t* page, zx_status_t* out_status) {
+    if (page->state != VM_PAGE_STATE_ALLOCATED || __atomic_load_n(&page->ref_count, __ATOMIC_RELAXED) == 0) {
+        *out_status = ZX_ERR_INVALID_ARGS;
+        return false;
+    }
+
+    *out_status = ZX_OK;
+    if (__atomic_sub_fetch(&page->ref_count, 1, __ATOMIC_ACQ_REL) > 0) {
+        return false;
+    }
+
+    page->state = VM_PAGE_STATE_FREE;
+    return true;
+}
+
 zx_status_t pmm_arena_init(pmm_arena_t* arena, paddr_t base, size_t size) {
     if (arena == NULL || size == 0) {
         return ZX_ERR_INVALID_ARGS;
@@ -9,47 +175,121 @@ zx_status_t pmm_arena_init(pmm_arena_t* arena, paddr_t base, size_t size) {
 
     arena->base = base;
     arena->size = size;
-    
+
     size_t page_count = size / PAGE_SIZE;
+    if (page_count >= VM_PAGE_INDEX_NONE) {
+        return ZX_ERR_INVALID_ARGS;
+    }
     arena->page_array = (vm_page_t*)calloc(page_count, sizeof(vm_page_t));
     if (arena->page_array == NULL) {
         return ZX_ERR_NO_MEMORY;
     }
 
-    arena->free_list = NULL;
+    arena->page_count = page_count;
+    for (size_t g = 0; g < PMM_GROUPS; g++) {
+        for (size_t o = 0; o < PMM_ORDERS; o++) {
+            arena->free_lists[g][o] = VM_PAGE_INDEX_NONE;
+        }
+    }
     arena->free_count = 0;
+    vm_spinlock_init(&arena->lock);
+    for (size_t i = 0; i < PMM_MAX_CPUS; i++) {
+        vm_spinlock_init(&arena->magazines[i].lock);
+        arena->magazines[i].count = 0;
+    }
+    arena->zero_page = NULL;
+    arena->physmap = NULL;
+    arena->low_watermark = 0;
+    arena->pressure_fn = NULL;
+    arena->pressure_ctx = NULL;
 
     for (size_t i = 0; i < page_count; i++) {
         vm_page_t* page = &arena->page_array[i];
-        page->paddr = base + (i * PAGE_SIZE);
         page->state = VM_PAGE_STATE_FREE;
         page->ref_count = 0;
-        
-        page->next = arena->free_list;
-        arena->free_list = page;
-        arena->free_count++;
+        page->order = VM_PAGE_ORDER_NONE;
+        page->group = PMM_GROUP_SINGLE;
+        page->next = VM_PAGE_INDEX_NONE;
+        page->prev = VM_PAGE_INDEX_NONE;
+    }
+
+    /* Carve the arena into the largest aligned blocks that fit. */
+    for (size_t i = 0; i < page_count;) {
+        uint8_t order = PMM_TOP_ORDER;
+        while ((i & (((size_t)1 << order) - 1)) != 0 || i + ((size_t)1 << order) > page_count) {
+            order--;
+        }
+        free_count_add(arena, (size_t)1 << order);
+        free_list_insert(arena, &arena->page_array[i], order);
+        i += (size_t)1 << order;
     }
 
     return ZX_OK;
 }
 
+typedef struct pressure_call {
+    pmm_pressure_fn_t fn;
+    void* ctx;
+} pressure_call_t;
+
+/*
+ * Called with the arena lock held, when the buddy lists have just shrunk or
+ * an allocation has failed; the callback is copied out so it can run after
+ * the lock is dropped.
+ */
+static inline pressure_call_t check_watermark(const pmm_arena_t* arena, bool failed) {
+    pressure_call_t call = {NULL, NULL};
+    if (arena->pressure_fn != NULL && (failed || arena->free_count < arena->low_watermark)) {
+        call.fn = arena->pressure_fn;
+        call.ctx = arena->pressure_ctx;
+    }
+    return call;
+}
+
 zx_status_t pmm_arena_alloc_page(pmm_arena_t* arena, vm_page_t** out_page) {
     if (arena == NULL || out_page == NULL) {
         return ZX_ERR_INVALID_ARGS;
     }
 
-    if (arena->free_list == NULL) {
-        return ZX_ERR_NO_MEMORY;
+    pmm_magazine_t* magazine = current_magazine(arena);
+    vm_page_t* page = NULL;
+    pressure_call_t pressure = {NULL, NULL};
+
+    vm_spin_lock(&magazine->lock);
+    if (magazine->count == 0) {
+        vm_spin_lock(&arena->lock);
+        while (magazine->count < PMM_MAGAZINE_BATCH) {
+            vm_page_t* refill = buddy_alloc(arena, 0, PMM_GROUP_SINGLE);
+            if (refill == NULL) {
+                break;
+            }
+            magazine_push(magazine, refill);
+        }
+        pressure = check_watermark(arena, false);
+        vm_spin_unlock(&arena->lock);
     }
+    if (magazine->count > 0) {
+        page = magazine_pop(magazine);
+    }
+    vm_spin_unlock(&magazine->lock);
 
-    vm_page_t* page = arena->free_list;
-    arena->free_list = page->next;
-    arena->free_count--;
+    if (page == NULL) {
+        /* The last free pages may be sitting in other CPUs' magazines. */
+        pmm_arena_drain_magazines(arena);
+        vm_spin_lock(&arena->lock);
+        page = buddy_alloc(arena, 0, PMM_GROUP_SINGLE);
+        pressure = check_watermark(arena, page == NULL);
+        vm_spin_unlock(&arena->lock);
+    }
 
-    page->state = VM_PAGE_STATE_ALLOCATED;
-    page->ref_count = 1;
-    page->next = NULL;
+    if (pressure.fn != NULL) {
+        pressure.fn(pressure.ctx);
+    }
+    if (page == NULL) {
+        return ZX_ERR_NO_MEMORY;
+    }
 
+    mark_allocated(page);
     *out_page = page;
     return ZX_OK;
 }
@@ -59,30 +299,265 @@ zx_status_t pmm_arena_free_page(pmm_arena_t* arena, vm_page_t* page) {
         return ZX_ERR_INVALID_ARGS;
     }
 
-    if (page->state != VM_PAGE_STATE_ALLOCATED) {
+    zx_status_t status;
+    if (!release_page(page, &status)) {
+        return status;
+    }
+
+    pmm_magazine_t* magazine = current_magazine(arena);
+    vm_spin_lock(&magazine->lock);
+    if (magazine->count == PMM_MAGAZINE_SIZE) {
+        vm_spin_lock(&arena->lock);
+        while (magazine->count > PMM_MAGAZINE_SIZE - PMM_MAGAZINE_BATCH) {
+            buddy_free(arena, page_index(arena, magazine_pop(magazine)), 0);
+        }
+        vm_spin_unlock(&arena->lock);
+    }
+    magazine_push(magazine, page);
+    vm_spin_unlock(&magazine->lock);
+
+    return ZX_OK;
+}
+
+zx_status_t pmm_arena_alloc_pages(pmm_arena_t* arena, size_t count, vm_page_t** out_pages) {
+    if (arena == NULL || out_pages == NULL) {
+        return ZX_ERR_INVALID_ARGS;
+    }
+
+    vm_spin_lock(&arena->lock);
+    if (arena->free_count < count) {
+        vm_spin_unlock(&arena->lock);
+        pmm_arena_drain_magazines(arena);
+        vm_spin_lock(&arena->lock);
+        if (arena->free_count < count) {
+            pressure_call_t pressure = check_watermark(arena, true);
+            vm_spin_unlock(&arena->lock);
+            if (pressure.fn != NULL) {
+                pressure.fn(pressure.ctx);
+            }
+            return ZX_ERR_NO_MEMORY;
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        out_pages[i] = buddy_alloc(arena, 0, PMM_GROUP_SINGLE);
+    }
+    pressure_call_t pressure = check_watermark(arena, false);
+    vm_spin_unlock(&arena->lock);
+
+    if (pressure.fn != NULL) {
+        pressure.fn(pressure.ctx);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        mark_allocated(out_pages[i]);
+    }
+    return ZX_OK;
+}
+
+zx_status_t pmm_arena_free_pages(pmm_arena_t* arena, vm_page_t** pages, size_t count) {
+    if (arena == NULL || (pages == NULL && count > 0)) {
         return ZX_ERR_INVALID_ARGS;
     }
 
-    if (page->ref_count == 0) {
+    /* Chain the freed pages first so the arena lock is taken once. */
+    zx_status_t result = ZX_OK;
+    uint32_t freed = VM_PAGE_INDEX_NONE;
+    for (size_t i = 0; i < count; i++) {
+        zx_status_t status;
+        if (pages[i] == NULL) {
+            result = ZX_ERR_INVALID_ARGS;
+            continue;
+        }
+        if (!release_page(pages[i], &status)) {
+            if (status != ZX_OK) {
+                result = status;
+            }
+            continue;
+        }
+        pages[i]->next = freed;
+        freed = (uint32_t)page_index(arena, pages[i]);
+    }
+
+    if (freed != VM_PAGE_INDEX_NONE) {
+        vm_spin_lock(&arena->lock);
+        while (freed != VM_PAGE_INDEX_NONE) {
+            uint32_t next = arena->page_array[freed].next;
+            buddy_free(arena, freed, 0);
+            freed = next;
+        }
+        vm_spin_unlock(&arena->lock);
+    }
+    return result;
+}
+
+static uint8_t order_for(size_t pages) {
+    uint8_t order = 0;
+    while (((size_t)1 << order) < pages) {
+        order++;
+    }
+    return order;
+}
+
+zx_status_t pmm_arena_alloc_contiguous(pmm_arena_t* arena, size_t count, size_t alignment,
+                                       vm_page_t** out_first) {
+    if (arena == NULL || out_first == NULL || count == 0) {
+        return ZX_ERR_INVALID_ARGS;
+    }
+    if (alignment == 0) {
+        alignment = PAGE_SIZE;
+    }
+    if ((alignment & (alignment - 1)) != 0 || alignment < PAGE_SIZE) {
         return ZX_ERR_INVALID_ARGS;
     }
 
-    page->ref_count--;
-    if (page->ref_count > 0) {
-        return ZX_OK;
+    /* A block of 2^order pages is aligned to its size within the arena. */
+    uint8_t order = order_for(count);
+    uint8_t align_order = order_for(alignment / PAGE_SIZE);
+    if (order > PMM_TOP_ORDER || align_order > PMM_TOP_ORDER) {
+        return ZX_ERR_INVALID_ARGS;
+    }
+    if ((arena->base & (alignment - 1)) != 0) {
+        return ZX_ERR_NOT_SUPPORTED;
+    }
+    if (align_order > order) {
+        order = align_order;
     }
 
-    page->state = VM_PAGE_STATE_FREE;
-    page->next = arena->free_list;
-    arena->free_list = page;
-    arena->free_count++;
+    vm_spin_lock(&arena->lock);
+    vm_page_t* head = buddy_alloc(arena, order, PMM_GROUP_CONTIG);
+    vm_spin_unlock(&arena->lock);
+    if (head == NULL) {
+        /* Pages cached in magazines may be all that splits a free run. */
+        pmm_arena_drain_magazines(arena);
+        vm_spin_lock(&arena->lock);
+        head = buddy_alloc(arena, order, PMM_GROUP_CONTIG);
+        vm_spin_unlock(&arena->lock);
+        if (head == NULL) {
+            return ZX_ERR_NO_MEMORY;
+        }
+    }
+
+    /* Give back the tail of the block past |count|, in aligned pieces. */
+    size_t first = page_index(arena, head);
+    size_t block = (size_t)1 << order;
+    if (count < block) {
+        vm_spin_lock(&arena->lock);
+        for (size_t i = count; i < block;) {
+            uint8_t piece = 0;
+            while ((i & ((size_t)1 << piece)) == 0 && i + ((size_t)2 << piece) <= block) {
+                piece++;
+            }
+            buddy_free(arena, first + i, piece);
+            i += (size_t)1 << piece;
+        }
+        vm_spin_unlock(&arena->lock);
+    }
 
+    for (size_t i = 0; i < count; i++) {
+        mark_allocated(&arena->page_array[first + i]);
+    }
+    *out_first = head;
     return ZX_OK;
 }
 
+zx_status_t pmm_arena_free_contiguous(pmm_arena_t* arena, vm_page_t* first, size_t count) {
+    if (arena == NULL || first == NULL) {
+        return ZX_ERR_INVALID_ARGS;
+    }
+
+    size_t index = page_index(arena, first);
+    if (index >= arena->page_count || count > arena->page_count - index) {
+        return ZX_ERR_INVALID_ARGS;
+    }
+
+    zx_status_t result = ZX_OK;
+    vm_spin_lock(&arena->lock);
+    for (size_t i = 0; i < count; i++) {
+        zx_status_t status;
+        if (release_page(&arena->page_array[index + i], &status)) {
+            buddy_free(arena, index + i, 0);
+        } else if (status != ZX_OK) {
+            result = status;
+        }
+    }
+    vm_spin_unlock(&arena->lock);
+    return result;
+}
+
+zx_status_t pmm_arena_zero_page(pmm_arena_t* arena, vm_page_t** out_page) {
+    if (arena == NULL || out_page == NULL) {
+        return ZX_ERR_INVALID_ARGS;
+    }
+
+    vm_page_t* zero = __atomic_load_n(&arena->zero_page, __ATOMIC_ACQUIRE);
+    if (zero == NULL) {
+        vm_page_t* page;
+        zx_status_t status = pmm_arena_alloc_page(arena, &page);
+        if (status != ZX_OK) {
+            return status;
+        }
+        void* data = pmm_arena_page_data(arena, page);
+        if (data != NULL) {
+            memset(data, 0, PAGE_SIZE);
+        }
+        if (__atomic_compare_exchange_n(&arena->zero_page, &zero, page, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            zero = page;
+        } else {
+            pmm_arena_free_page(arena, page);
+        }
+    }
+
+    *out_page = zero;
+    return ZX_OK;
+}
+
+void pmm_arena_set_physmap(pmm_arena_t* arena, void* physmap) {
+    if (arena != NULL) {
+        arena->physmap = (uint8_t*)physmap;
+    }
+}
+
+void pmm_arena_set_pressure_callback(pmm_arena_t* arena, size_t low_watermark,
+                                     pmm_pressure_fn_t fn, void* ctx) {
+    if (arena == NULL) {
+        return;
+    }
+
+    vm_spin_lock(&arena->lock);
+    arena->low_watermark = low_watermark;
+    arena->pressure_fn = fn;
+    arena->pressure_ctx = ctx;
+    vm_spin_unlock(&arena->lock);
+}
+
+void pmm_arena_drain_magazines(pmm_arena_t* arena) {
+    if (arena == NULL) {
+        return;
+    }
+
+    for (size_t i = 0; i < PMM_MAX_CPUS; i++) {
+        pmm_magazine_t* magazine = &arena->magazines[i];
+        vm_spin_lock(&magazine->lock);
+        if (magazine->count > 0) {
+            vm_spin_lock(&arena->lock);
+            while (magazine->count > 0) {
+                buddy_free(arena, page_index(arena, magazine_pop(magazine)), 0);
+            }
+            vm_spin_unlock(&arena->lock);
+        }
+        vm_spin_unlock(&magazine->lock);
+    }
+}
+
 size_t pmm_arena_free_count(pmm_arena_t* arena) {
     if (arena == NULL) {
         return 0;
     }
-    return arena->free_count;
+
+    size_t count = __atomic_load_n(&arena->free_count, __ATOMIC_RELAXED);
+    for (size_t i = 0; i < PMM_MAX_CPUS; i++) {
+        count += __atomic_load_n(&arena->magazines[i].count, __ATOMIC_RELAXED);
+    }
+    return count;
 }
@@ -3,13 +3,57 @@
 
 #include "vm_types.h"
 #include "vm_page.h"
+#include "spinlock.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Free pages are kept in buddy blocks of 2^order pages, each aligned to its
+ * size relative to the arena base. Blocks of the top order are pageblocks.
+ * A pageblock that gets split is claimed by the group that split it, single
+ * pages or contiguous runs, and later splits prefer blocks of their own
+ * group, so scattered single pages do not break up every large block.
+ */
+#define PMM_ORDERS 12
+#define PMM_TOP_ORDER (PMM_ORDERS - 1)
+#define PMM_GROUP_SINGLE 0
+#define PMM_GROUP_CONTIG 1
+#define PMM_GROUPS 2
+
+/*
+ * Each CPU keeps a small magazine of free pages in front of the buddy lists.
+ * Single-page alloc and free stay on the local magazine, and only a
+ * refill or flush of PMM_MAGAZINE_BATCH pages takes the arena lock.
+ */
+#define PMM_MAX_CPUS 8
+#define PMM_MAGAZINE_SIZE 32
+#define PMM_MAGAZINE_BATCH (PMM_MAGAZINE_SIZE / 2)
+
+typedef struct pmm_magazine {
+    vm_spinlock_t lock;
+    size_t count;
+    vm_page_t* pages[PMM_MAGAZINE_SIZE];
+} pmm_magazine_t;
+
+/* Called, without arena locks held, when free pages drop below the watermark. */
+typedef void (*pmm_pressure_fn_t)(void* ctx);
 
 typedef struct pmm_arena {
     paddr_t base;
     size_t size;
     vm_page_t* page_array;
-    vm_page_t* free_list;
-    size_t free_count;
+    size_t page_count;
+    uint32_t free_lists[PMM_GROUPS][PMM_ORDERS];    /* Head page indices; top order uses group 0 */
+    size_t free_count;      /* Pages in buddy blocks, not counting magazines */
+    vm_spinlock_t lock;     /* Protects free_lists and free_count */
+    pmm_magazine_t magazines[PMM_MAX_CPUS];
+    vm_page_t* zero_page;   /* Set once by pmm_arena_zero_page */
+    uint8_t* physmap;       /* Where the arena's memory is mapped, or NULL */
+    size_t low_watermark;
+    pmm_pressure_fn_t pressure_fn;
+    void* pressure_ctx;
 } pmm_arena_t;
 
 zx_status_t pmm_arena_init(pmm_arena_t* arena, paddr_t base, size_t size);
@@ -17,4 +61,68 @@ zx_status_t pmm_arena_alloc_page(pmm_arena_t* arena, vm_page_t** out_page);
 zx_status_t pmm_arena_free_page(pmm_arena_t* arena, vm_page_t* page);
 size_t pmm_arena_free_count(pmm_arena_t* arena);
 
+static inline paddr_t pmm_arena_page_paddr(const pmm_arena_t* arena, const vm_page_t* page) {
+    return vm_page_to_paddr(page, arena->page_array, arena->base);
+}
+
+static inline vm_page_t* pmm_arena_paddr_to_page(pmm_arena_t* arena, paddr_t paddr) {
+    return paddr_to_vm_page(paddr, arena->base, arena->page_array, arena->page_count);
+}
+
+/* Returns the page's contents through the physmap, or NULL if there is none. */
+static inline void* pmm_arena_page_data(const pmm_arena_t* arena, const vm_page_t* page) {
+    if (arena->physmap == NULL) {
+        return NULL;
+    }
+    return arena->physmap + ((size_t)(page - arena->page_array) << PAGE_SHIFT);
+}
+
+/*
+ * Gives the arena a mapping of its memory, starting at |physmap|, so
+ * page contents can be zeroed, copied and compressed. Set it before the
+ * first allocation.
+ */
+void pmm_arena_set_physmap(pmm_arena_t* arena, void* physmap);
+
+/*
+ * Calls |fn| whenever an allocation leaves fewer than |low_watermark| pages
+ * in the buddy lists, or fails. The check runs only when an allocation
+ * reaches the buddy lists, so pages cached in magazines are not counted.
+ * Pass a NULL |fn| to stop.
+ */
+void pmm_arena_set_pressure_callback(pmm_arena_t* arena, size_t low_watermark,
+                                     pmm_pressure_fn_t fn, void* ctx);
+
+/*
+ * Allocates |count| pages into |out_pages| under one acquisition of the
+ * arena lock. Either all of them are allocated or none are.
+ */
+zx_status_t pmm_arena_alloc_pages(pmm_arena_t* arena, size_t count, vm_page_t** out_pages);
+
+/* Drops one reference on each page, as pmm_arena_free_page does. */
+zx_status_t pmm_arena_free_pages(pmm_arena_t* arena, vm_page_t** pages, size_t count);
+
+/*
+ * Allocates |count| physically contiguous pages whose first page is aligned
+ * to |alignment| bytes (a power of two; 0 means PAGE_SIZE). The run must fit
+ * in one pageblock. Free it with pmm_arena_free_contiguous.
+ */
+zx_status_t pmm_arena_alloc_contiguous(pmm_arena_t* arena, size_t count, size_t alignment,
+                                       vm_page_t** out_first);
+zx_status_t pmm_arena_free_contiguous(pmm_arena_t* arena, vm_page_t* first, size_t count);
+
+/*
+ * Returns the arena's shared zero page in |out_page|, allocating it on the
+ * first call. The arena keeps one reference on it for good, so mappings
+ * take and drop their own references like any other page's.
+ */
+zx_status_t pmm_arena_zero_page(pmm_arena_t* arena, vm_page_t** out_page);
+
+/* Returns every magazine's pages to the buddy lists. */
+void pmm_arena_drain_magazines(pmm_arena_t* arena);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
@@ -0,0 +1,38 @@
+#ifndef THIRD_PARTY_ZIRCON_C_VM_SPINLOCK_H_
+#define THIRD_PARTY_ZIRCON_C_VM_SPINLOCK_H_
+
+/*
+ * Test-and-test-and-set lock on compiler atomics, so the structures that
+ * embed it stay plain C that C++ callers can include. Shared by the VM and
+ * IPC layers; only for short critical sections that never block.
+ */
+typedef struct vm_spinlock {
+    int locked;
+} vm_spinlock_t;
+
+static inline void vm_spinlock_init(vm_spinlock_t* lock) {
+    __atomic_store_n(&lock->locked, 0, __ATOMIC_RELAXED);
+}
+
+/* Tells the core it is spinning, so an SMT sibling gets the pipeline. */
+static inline void vm_spin_pause(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ volatile("yield" ::: "memory");
+#endif
+}
+
+static inline void vm_spin_lock(vm_spinlock_t* lock) {
+    while (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE)) {
+        while (__atomic_load_n(&lock->locked, __ATOMIC_RELAXED)) {
+            vm_spin_pause();
+        }
+    }
+}
+
+static inline void vm_spin_unlock(vm_spinlock_t* lock) {
+    __atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+}
+
+#endif
@@ -3,23 +3,49 @@
 
 #include "vm_types.h"
 
+#define VM_PAGE_ORDER_NONE 0xFF
+#define VM_PAGE_INDEX_NONE UINT32_MAX
+
+/*
+ * 16 bytes per page. The physical address is implied by the page's index in
+ * its arena's page array, the small fields share one word with the
+ * reference count, and free-list links are 32-bit indices into the same
+ * array rather than pointers.
+ */
 typedef struct vm_page {
-    paddr_t paddr;
     vm_page_state_t state;
+    uint8_t order;      /* Block order while heading a free buddy block */
+    uint8_t group;      /* Allocation group, kept in a pageblock's first page */
+    uint8_t age;        /* Reclaim scans survived since the page was last touched */
     uint32_t ref_count;
-    struct vm_page* next;
+    uint32_t next;      /* Free-list links, as page indices */
+    uint32_t prev;
 } vm_page_t;
 
-static inline paddr_t vm_page_to_paddr(vm_page_t* page) {
-    return page->paddr;
+#define VM_PAGE_AGE_MAX UINT8_MAX
+
+/*
+ * Resets the page's age. The fault path calls this; code harvesting
+ * accessed bits from page tables should too, so the reclaimer does not see
+ * busy pages as cold.
+ */
+static inline void vm_page_mark_accessed(vm_page_t* page) {
+    __atomic_store_n(&page->age, 0, __ATOMIC_RELAXED);
+}
+
+static inline paddr_t vm_page_to_paddr(const vm_page_t* page, const vm_page_t* array, paddr_t array_base) {
+    return array_base + ((paddr_t)(page - array) << PAGE_SHIFT);
 }
 
-static inline vm_page_t* paddr_to_vm_page(paddr_t paddr, vm_page_t* base, size_t count) {
-    size_t index = paddr >> PAGE_SHIFT;
+static inline vm_page_t* paddr_to_vm_page(paddr_t paddr, paddr_t array_base, vm_page_t* array, size_t count) {
+    if (paddr < array_base) {
+        return NULL;
+    }
+    size_t index = (paddr - array_base) >> PAGE_SHIFT;
     if (index >= count) {
         return NULL;
     }
-    return &base[index];
+    return &array[index];
 }
 
 #endif
@@ -6,7 +6,7 @@
 
 typedef uint64_t paddr_t;
 typedef uint64_t vaddr_t;
-typedef uint64_t vm_page_state_t;
+typedef uint8_t vm_page_state_t;
 
 #define PAGE_SIZE 4096
 #define PAGE_SHIFT 12
@@ -18,9 +18,15 @@ typedef uint64_t vm_page_state_t;
 
 typedef int32_t zx_status_t;
 
+/* Same values as Zircon, and as ../ipc/handle.h, so both can be included. */
 #define ZX_OK 0
-#define ZX_ERR_NO_MEMORY -1
-#define ZX_ERR_INVALID_ARGS -2
-#define ZX_ERR_NOT_FOUND -3
+#define ZX_ERR_NOT_SUPPORTED (-2)
+#define ZX_ERR_NO_RESOURCES (-3)
+#define ZX_ERR_NO_MEMORY (-4)
+#define ZX_ERR_INVALID_ARGS (-10)
+#define ZX_ERR_BUFFER_TOO_SMALL (-15)
+#define ZX_ERR_BAD_STATE (-20)
+#define ZX_ERR_NOT_FOUND (-25)
+#define ZX_ERR_IO_DATA_INTEGRITY (-42)
 
 #endif
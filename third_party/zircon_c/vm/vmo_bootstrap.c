@@ -1,27 +1,246 @@
 #include "vmo_bootstrap.h"
+#include "lz4.h"
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 
-zx_status_t vmo_bootstrap_init(vmo_t* vmo, pmm_arena_t* arena, size_t size) {
-    if (vmo == NULL || arena == NULL || size == 0) {
-        return ZX_ERR_INVALID_ARGS;
+static inline size_t slot_of(size_t index, uint32_t level) {
+    return (index >> (level * VMO_PAGE_MAP_SHIFT)) & (VMO_PAGE_MAP_FANOUT - 1);
+}
+
+static inline bool slot_is_compressed(const void* entry) {
+    return ((uintptr_t)entry & VMO_SLOT_COMPRESSED) != 0;
+}
+
+static inline vmo_compressed_page_t* slot_compressed(const void* entry) {
+    return (vmo_compressed_page_t*)((uintptr_t)entry & ~VMO_SLOT_COMPRESSED);
+}
+
+static inline vm_page_t* slot_page(const void* entry) {
+    return slot_is_compressed(entry) ? NULL : (vm_page_t*)entry;
+}
+
+static void drop_compressed(vmo_compressed_page_t* compressed) {
+    if (__atomic_sub_fetch(&compressed->ref_count, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(compressed);
+    }
+}
+
+/* Zeroes |page|, or copies |from| into it, when the arena has a physmap. */
+static void fill_page(const pmm_arena_t* arena, vm_page_t* page, const vm_page_t* from) {
+    void* data = pmm_arena_page_data(arena, page);
+    if (data == NULL) {
+        return;
+    }
+    if (from != NULL) {
+        memcpy(data, pmm_arena_page_data(arena, from), PAGE_SIZE);
+    } else {
+        memset(data, 0, PAGE_SIZE);
+    }
+}
+
+static uint32_t map_levels(size_t page_count) {
+    uint32_t levels = 1;
+    while (levels < VMO_PAGE_MAP_MAX_LEVELS &&
+           ((page_count - 1) >> (levels * VMO_PAGE_MAP_SHIFT)) != 0) {
+        levels++;
     }
+    return levels;
+}
 
+static void map_init(vmo_t* vmo, uint64_t size) {
     vmo->size = size;
     vmo->page_count = (size + PAGE_SIZE - 1) / PAGE_SIZE;
-    
-    vmo->pages = (vm_page_t**)calloc(vmo->page_count, sizeof(vm_page_t*));
-    if (vmo->pages == NULL) {
-        return ZX_ERR_NO_MEMORY;
+    vmo->root = NULL;
+    vmo->levels = map_levels(vmo->page_count);
+    vmo->flags = 0;
+    vmo->committed = 0;
+    vmo->compressed = 0;
+    vm_spinlock_init(&vmo->lock);
+}
+
+/* Returns the leaf slot for |index|, or NULL if its leaf does not exist. */
+static void** map_find_slot(const vmo_t* vmo, size_t index) {
+    vmo_page_node_t* node = (vmo_page_node_t*)vmo->root;
+    for (uint32_t level = vmo->levels - 1; node != NULL && level > 0; level--) {
+        node = (vmo_page_node_t*)node->slots[slot_of(index, level)];
+    }
+    return node != NULL ? &node->slots[slot_of(index, 0)] : NULL;
+}
+
+static inline bool is_zero_page(const pmm_arena_t* arena, const vm_page_t* page) {
+    return page != NULL && page == __atomic_load_n(&arena->zero_page, __ATOMIC_ACQUIRE);
+}
+
+/* Frees the empty nodes on |index|'s path, bottom up. */
+static void map_prune(vmo_t* vmo, size_t index) {
+    void** links[VMO_PAGE_MAP_MAX_LEVELS];
+    uint32_t depth = 0;
+
+    void** link = &vmo->root;
+    for (uint32_t level = vmo->levels; level-- > 0 && *link != NULL;) {
+        links[depth++] = link;
+        link = &((vmo_page_node_t*)*link)->slots[slot_of(index, level)];
+    }
+
+    while (depth-- > 0) {
+        vmo_page_node_t* node = (vmo_page_node_t*)*links[depth];
+        if (node->used != 0) {
+            break;
+        }
+        free(node);
+        *links[depth] = NULL;
+        if (depth > 0) {
+            ((vmo_page_node_t*)*links[depth - 1])->used--;
+        }
+    }
+}
+
+/* Stores |entry| in the empty slot for |index|, creating nodes on the way. */
+static zx_status_t map_insert(vmo_t* vmo, size_t index, void* entry) {
+    vmo_page_node_t* parent = NULL;
+    void** link = &vmo->root;
+    for (uint32_t level = vmo->levels; level-- > 0;) {
+        vmo_page_node_t* node = (vmo_page_node_t*)*link;
+        if (node == NULL) {
+            node = (vmo_page_node_t*)calloc(1, sizeof(vmo_page_node_t));
+            if (node == NULL) {
+                map_prune(vmo, index);
+                return ZX_ERR_NO_MEMORY;
+            }
+            *link = node;
+            if (parent != NULL) {
+                parent->used++;
+            }
+        }
+        parent = node;
+        link = &node->slots[slot_of(index, level)];
+    }
+
+    *link = entry;
+    parent->used++;
+    vmo->committed++;
+    return ZX_OK;
+}
+
+/* Clears the slot for |index| and returns what was in it. */
+static void* map_remove(vmo_t* vmo, size_t index) {
+    vmo_page_node_t* node = (vmo_page_node_t*)vmo->root;
+    for (uint32_t level = vmo->levels - 1; node != NULL && level > 0; level--) {
+        node = (vmo_page_node_t*)node->slots[slot_of(index, level)];
+    }
+    if (node == NULL || node->slots[slot_of(index, 0)] == NULL) {
+        return NULL;
+    }
+
+    void* entry = node->slots[slot_of(index, 0)];
+    node->slots[slot_of(index, 0)] = NULL;
+    node->used--;
+    vmo->committed--;
+    map_prune(vmo, index);
+    return entry;
+}
+
+/* Returns the first non-empty slot's entry at or after |start|. */
+static void* map_next(const vmo_page_node_t* node, uint32_t level, size_t base,
+                      size_t start, size_t* out_index) {
+    size_t span = (size_t)1 << (level * VMO_PAGE_MAP_SHIFT);
+    size_t first = start > base ? (start - base) / span : 0;
+    for (size_t i = first; i < VMO_PAGE_MAP_FANOUT; i++) {
+        void* child = node->slots[i];
+        if (child == NULL) {
+            continue;
+        }
+        size_t child_base = base + i * span;
+        if (level == 0) {
+            *out_index = child_base;
+            return child;
+        }
+        void* entry = map_next((const vmo_page_node_t*)child, level - 1, child_base, start, out_index);
+        if (entry != NULL) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Frees |node| and everything below it. With an arena the pages are dropped
+ * too, a leaf at a time through the bulk free path, along with compressed
+ * pages; without one they are left alone.
+ */
+static void map_free(pmm_arena_t* arena, vmo_page_node_t* node, uint32_t level) {
+    if (level == 0) {
+        vm_page_t* pages[VMO_PAGE_MAP_FANOUT];
+        size_t count = 0;
+        for (size_t i = 0; i < VMO_PAGE_MAP_FANOUT && arena != NULL; i++) {
+            void* entry = node->slots[i];
+            if (entry == NULL) {
+                continue;
+            }
+            if (slot_is_compressed(entry)) {
+                drop_compressed(slot_compressed(entry));
+            } else {
+                pages[count++] = (vm_page_t*)entry;
+            }
+        }
+        if (arena != NULL) {
+            pmm_arena_free_pages(arena, pages, count);
+        }
+    } else {
+        for (size_t i = 0; i < VMO_PAGE_MAP_FANOUT; i++) {
+            if (node->slots[i] != NULL) {
+                map_free(arena, (vmo_page_node_t*)node->slots[i], level - 1);
+            }
+        }
     }
+    free(node);
+}
 
-    for (size_t i = 0; i < vmo->page_count; i++) {
-        vmo->pages[i] = NULL;
+zx_status_t vmo_bootstrap_init(vmo_t* vmo, pmm_arena_t* arena, size_t size) {
+    if (vmo == NULL || arena == NULL || size == 0) {
+        return ZX_ERR_INVALID_ARGS;
     }
 
+    map_init(vmo, size);
     return ZX_OK;
 }
 
+vm_page_t* vmo_bootstrap_lookup(const vmo_t* vmo, size_t page_index) {
+    if (vmo == NULL || page_index >= vmo->page_count) {
+        return NULL;
+    }
+
+    void** slot = map_find_slot(vmo, page_index);
+    return slot != NULL ? slot_page(*slot) : NULL;
+}
+
+bool vmo_bootstrap_is_compressed(const vmo_t* vmo, size_t page_index) {
+    if (vmo == NULL || page_index >= vmo->page_count) {
+        return false;
+    }
+
+    void** slot = map_find_slot(vmo, page_index);
+    return slot != NULL && slot_is_compressed(*slot);
+}
+
+vm_page_t* vmo_bootstrap_next_page(const vmo_t* vmo, size_t start, size_t* out_index) {
+    if (vmo == NULL || out_index == NULL || vmo->root == NULL || start >= vmo->page_count) {
+        return NULL;
+    }
+
+    for (size_t index = start; index < vmo->page_count; index = *out_index + 1) {
+        void* entry = map_next((const vmo_page_node_t*)vmo->root, vmo->levels - 1, 0, index, out_index);
+        if (entry == NULL) {
+            break;
+        }
+        if (!slot_is_compressed(entry)) {
+            return (vm_page_t*)entry;
+        }
+    }
+    return NULL;
+}
+
 zx_status_t vmo_bootstrap_commit_page(vmo_t* vmo, pmm_arena_t* arena, size_t page_index) {
     if (vmo == NULL || arena == NULL) {
         return ZX_ERR_INVALID_ARGS;
@@ -31,17 +250,288 @@ zx_status_t vmo_bootstrap_commit_page(vmo_t* vmo, pmm_arena_t* arena, size_t pag
         return ZX_ERR_INVALID_ARGS;
     }
 
-    if (vmo->pages[page_index] != NULL) {
+    void** slot = map_find_slot(vmo, page_index);
+    if (slot != NULL && slot_is_compressed(*slot)) {
+        return vmo_bootstrap_decompress_page(vmo, arena, page_index);
+    }
+
+    vm_page_t* old = slot != NULL ? (vm_page_t*)*slot : NULL;
+    if (old != NULL && !is_zero_page(arena, old)) {
+        bool shared = __atomic_load_n(&old->ref_count, __ATOMIC_ACQUIRE) > 1;
+        if (!(vmo->flags & VMO_FLAG_COPY_ON_WRITE) || !shared) {
+            return ZX_OK;
+        }
+    }
+
+    vm_page_t* page;
+    zx_status_t status = pmm_arena_alloc_page(arena, &page);
+    if (status != ZX_OK) {
+        return status;
+    }
+
+    fill_page(arena, page, old != NULL && !is_zero_page(arena, old) ? old : NULL);
+    if (old != NULL) {
+        *slot = page;
+        pmm_arena_free_page(arena, old);
+        return ZX_OK;
+    }
+
+    status = map_insert(vmo, page_index, page);
+    if (status != ZX_OK) {
+        pmm_arena_free_page(arena, page);
+    }
+    return status;
+}
+
+/* Ranges up to this many missing pages are staged on the stack. */
+#define COMMIT_RANGE_STACK_PAGES 64
+
+zx_status_t vmo_bootstrap_commit_range(vmo_t* vmo, pmm_arena_t* arena, size_t first_index, size_t count) {
+    if (vmo == NULL || arena == NULL) {
+        return ZX_ERR_INVALID_ARGS;
+    }
+
+    if (first_index > vmo->page_count || count > vmo->page_count - first_index) {
+        return ZX_ERR_INVALID_ARGS;
+    }
+
+    size_t end = first_index + count;
+    size_t holes = 0;
+    size_t zeros = 0;
+    for (size_t i = first_index; i < end; i++) {
+        void** slot = map_find_slot(vmo, i);
+        if (slot == NULL || *slot == NULL) {
+            holes++;
+        } else if (is_zero_page(arena, slot_page(*slot))) {
+            zeros++;
+        }
+    }
+
+    size_t missing = holes + zeros;
+    if (missing == 0) {
+        return ZX_OK;
+    }
+
+    vm_page_t* stack_pages[COMMIT_RANGE_STACK_PAGES];
+    vm_page_t** pages = stack_pages;
+    if (missing > COMMIT_RANGE_STACK_PAGES) {
+        pages = (vm_page_t**)malloc(missing * sizeof(vm_page_t*));
+        if (pages == NULL) {
+            return ZX_ERR_NO_MEMORY;
+        }
+    }
+
+    zx_status_t status = pmm_arena_alloc_pages(arena, missing, pages);
+    if (status == ZX_OK) {
+        for (size_t i = 0; i < missing; i++) {
+            fill_page(arena, pages[i], NULL);
+        }
+
+        size_t inserted = 0;
+        for (size_t i = first_index; i < end && inserted < holes && status == ZX_OK; i++) {
+            void** slot = map_find_slot(vmo, i);
+            if (slot == NULL || *slot == NULL) {
+                status = map_insert(vmo, i, pages[inserted]);
+                inserted += status == ZX_OK;
+            }
+        }
+
+        if (status != ZX_OK) {
+            /* Out of node memory: take back, in order, what was inserted. */
+            for (size_t i = first_index, undone = 0; undone < inserted; i++) {
+                if (vmo_bootstrap_lookup(vmo, i) == pages[undone]) {
+                    map_remove(vmo, i);
+                    undone++;
+                }
+            }
+            pmm_arena_free_pages(arena, pages, missing);
+        }
+    }
+
+    /* Inserts were the only step that could fail; now swap out zero pages. */
+    if (status == ZX_OK && zeros > 0) {
+        vm_page_t* zero = arena->zero_page;
+        size_t next = holes;
+        for (size_t i = first_index; i < end && next < missing; i++) {
+            void** slot = map_find_slot(vmo, i);
+            if (slot != NULL && *slot == zero) {
+                *slot = pages[next++];
+                pmm_arena_free_page(arena, zero);
+            }
+        }
+    }
+
+    if (pages != stack_pages) {
+        free(pages);
+    }
+    return status;
+}
+
+zx_status_t vmo_bootstrap_map_zero_pages(vmo_t* vmo, pmm_arena_t* arena, size_t first_index, size_t count) {
+    if (vmo == NULL || arena == NULL) {
+        return ZX_ERR_INVALID_ARGS;
+    }
+
+    if (first_index > vmo->page_count || count > vmo->page_count - first_index) {
+        return ZX_ERR_INVALID_ARGS;
+    }
+
+    vm_page_t* zero;
+    zx_status_t status = pmm_arena_zero_page(arena, &zero);
+    if (status != ZX_OK) {
+        return status;
+    }
+
+    for (size_t i = first_index; i < first_index + count; i++) {
+        void** slot = map_find_slot(vmo, i);
+        if (slot != NULL && *slot != NULL) {
+            continue;
+        }
+        status = map_insert(vmo, i, zero);
+        if (status != ZX_OK) {
+            return status;
+        }
+        __atomic_fetch_add(&zero->ref_count, 1, __ATOMIC_RELAXED);
+    }
+    return ZX_OK;
+}
+
+zx_status_t vmo_bootstrap_share_pages(const vmo_t* src, vmo_t* out) {
+    if (src == NULL || out == NULL || src->page_count == 0) {
+        return ZX_ERR_INVALID_ARGS;
+    }
+
+    map_init(out, src->size);
+
+    const vmo_page_node_t* root = (const vmo_page_node_t*)src->root;
+    size_t index = 0;
+    for (void* entry = root ? map_next(root, src->levels - 1, 0, 0, &index) : NULL; entry != NULL;
+         entry = index + 1 < src->page_count ? map_next(root, src->levels - 1, 0, index + 1, &index) : NULL) {
+        zx_status_t status = map_insert(out, index, entry);
+        if (status != ZX_OK) {
+            /* No references have been taken yet, so only the nodes go. */
+            if (out->root != NULL) {
+                map_free(NULL, (vmo_page_node_t*)out->root, out->levels - 1);
+            }
+            memset(out, 0, sizeof(*out));
+            return status;
+        }
+    }
+
+    root = (const vmo_page_node_t*)out->root;
+    for (void* entry = root ? map_next(root, out->levels - 1, 0, 0, &index) : NULL; entry != NULL;
+         entry = index + 1 < out->page_count ? map_next(root, out->levels - 1, 0, index + 1, &index) : NULL) {
+        if (slot_is_compressed(entry)) {
+            __atomic_fetch_add(&slot_compressed(entry)->ref_count, 1, __ATOMIC_RELAXED);
+        } else {
+            __atomic_fetch_add(&((vm_page_t*)entry)->ref_count, 1, __ATOMIC_RELAXED);
+        }
+    }
+    out->compressed = src->compressed;
+    return ZX_OK;
+}
+
+static bool page_is_zero(const uint8_t* data) {
+    for (size_t i = 0; i < PAGE_SIZE; i++) {
+        if (data[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+zx_status_t vmo_bootstrap_compress_page(vmo_t* vmo, pmm_arena_t* arena, size_t page_index,
+                                        size_t* out_size) {
+    if (vmo == NULL || arena == NULL || out_size == NULL || page_index >= vmo->page_count) {
+        return ZX_ERR_INVALID_ARGS;
+    }
+
+    if (arena->physmap == NULL) {
+        return ZX_ERR_NOT_SUPPORTED;
+    }
+
+    void** slot = map_find_slot(vmo, page_index);
+    vm_page_t* page = slot != NULL ? slot_page(*slot) : NULL;
+    if (page == NULL) {
+        return ZX_ERR_NOT_FOUND;
+    }
+
+    if (is_zero_page(arena, page) || __atomic_load_n(&page->ref_count, __ATOMIC_ACQUIRE) != 1) {
+        return ZX_ERR_BAD_STATE;
+    }
+
+    const uint8_t* data = (const uint8_t*)pmm_arena_page_data(arena, page);
+    if (page_is_zero(data)) {
+        map_remove(vmo, page_index);
+        pmm_arena_free_page(arena, page);
+        *out_size = 0;
         return ZX_OK;
     }
 
+    uint8_t buffer[VMO_COMPRESSED_MAX_BYTES];
+    size_t size = vm_lz4_compress(data, PAGE_SIZE, buffer, sizeof(buffer));
+    if (size == 0) {
+        return ZX_ERR_BUFFER_TOO_SMALL;
+    }
+
+    vmo_compressed_page_t* compressed =
+        (vmo_compressed_page_t*)malloc(sizeof(vmo_compressed_page_t) + size);
+    if (compressed == NULL) {
+        return ZX_ERR_NO_MEMORY;
+    }
+    compressed->ref_count = 1;
+    compressed->size = (uint32_t)size;
+    memcpy(compressed->data, buffer, size);
+
+    *slot = (void*)((uintptr_t)compressed | VMO_SLOT_COMPRESSED);
+    vmo->compressed++;
+    pmm_arena_free_page(arena, page);
+    *out_size = size;
+    return ZX_OK;
+}
+
+zx_status_t vmo_bootstrap_decompress_page(vmo_t* vmo, pmm_arena_t* arena, size_t page_index) {
+    if (vmo == NULL || arena == NULL || page_index >= vmo->page_count) {
+        return ZX_ERR_INVALID_ARGS;
+    }
+
+    void** slot = map_find_slot(vmo, page_index);
+    if (slot == NULL || !slot_is_compressed(*slot)) {
+        return ZX_ERR_NOT_FOUND;
+    }
+
+    if (arena->physmap == NULL) {
+        return ZX_ERR_NOT_SUPPORTED;
+    }
+
     vm_page_t* page;
     zx_status_t status = pmm_arena_alloc_page(arena, &page);
     if (status != ZX_OK) {
         return status;
     }
 
-    vmo->pages[page_index] = page;
+    vmo_compressed_page_t* compressed = slot_compressed(*slot);
+    status = vm_lz4_decompress(compressed->data, compressed->size,
+                               (uint8_t*)pmm_arena_page_data(arena, page), PAGE_SIZE);
+    if (status != ZX_OK) {
+        pmm_arena_free_page(arena, page);
+        return status;
+    }
+
+    *slot = page;
+    vmo->compressed--;
+    drop_compressed(compressed);
+    return ZX_OK;
+}
+
+zx_status_t vmo_bootstrap_clone(vmo_t* parent, vmo_t* out_child) {
+    zx_status_t status = vmo_bootstrap_share_pages(parent, out_child);
+    if (status != ZX_OK) {
+        return status;
+    }
+
+    parent->flags |= VMO_FLAG_COPY_ON_WRITE;
+    out_child->flags |= VMO_FLAG_COPY_ON_WRITE;
     return ZX_OK;
 }
 
@@ -50,15 +540,13 @@ void vmo_bootstrap_destroy(vmo_t* vmo, pmm_arena_t* arena) {
         return;
     }
 
-    for (size_t i = 0; i < vmo->page_count; i++) {
-        if (vmo->pages[i] != NULL) {
-            pmm_arena_free_page(arena, vmo->pages[i]);
-            vmo->pages[i] = NULL;
-        }
+    if (vmo->root != NULL) {
+        map_free(arena, (vmo_page_node_t*)vmo->root, vmo->levels - 1);
+        vmo->root = NULL;
     }
 
-    free(vmo->pages);
-    vmo->pages = NULL;
+    vmo->committed = 0;
+    vmo->compressed = 0;
     vmo->page_count = 0;
     vmo->size = 0;
 }
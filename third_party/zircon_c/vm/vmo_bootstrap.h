@@ -1,18 +1,136 @@
 #ifndef THIRD_PARTY_ZIRCON_C_VM_VMO_BOOTSTRAP_H_
 #define THIRD_PARTY_ZIRCON_C_VM_VMO_BOOTSTRAP_H_
 
+#include <stdbool.h>
+
 #include "vm_types.h"
 #include "vm_page.h"
 #include "pmm_arena.h"
+#include "spinlock.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Committed pages live in a radix tree of VMO_PAGE_MAP_FANOUT-way nodes,
+ * allocated as pages are committed and freed once they empty, so a sparse
+ * VMO costs memory only for the pages it holds. The tree has just enough
+ * levels to index page_count pages. A leaf slot holds a vm_page_t pointer
+ * or, tagged with VMO_SLOT_COMPRESSED in its low bit, a compressed page.
+ */
+#define VMO_PAGE_MAP_SHIFT 6
+#define VMO_PAGE_MAP_FANOUT (1u << VMO_PAGE_MAP_SHIFT)
+#define VMO_PAGE_MAP_MAX_LEVELS ((64 + VMO_PAGE_MAP_SHIFT - 1) / VMO_PAGE_MAP_SHIFT)
+
+#define VMO_SLOT_COMPRESSED ((uintptr_t)1)
+
+typedef struct vmo_page_node {
+    uint32_t used;                          /* Non-NULL slots */
+    void* slots[VMO_PAGE_MAP_FANOUT];       /* Child nodes, or pages in a leaf */
+} vmo_page_node_t;
 
+/*
+ * Set on both sides of a clone: a page held by more than one VMO is copied
+ * before it is written. Without it, as for CHANNEL_VMO_SHARE, shared pages
+ * stay shared when written.
+ */
+#define VMO_FLAG_COPY_ON_WRITE (1u << 0)
+
+/*
+ * A page the reclaimer compressed out of its arena. Clones share it by
+ * reference like a resident page; a fault expands it into a fresh page.
+ */
+typedef struct vmo_compressed_page {
+    uint32_t ref_count;
+    uint32_t size;          /* Bytes of LZ4 block data */
+    uint8_t data[];
+} vmo_compressed_page_t;
+
+/* Pages that do not compress below this many bytes stay resident. */
+#define VMO_COMPRESSED_MAX_BYTES (PAGE_SIZE * 3 / 4)
+
+/*
+ * The vmo_bootstrap calls do not lock. |lock| is for callers that share a
+ * VMO across threads: page_fault_handle and the reclaimer take it, and so
+ * must anyone else touching a VMO registered with a reclaimer.
+ */
 typedef struct vmo {
     uint64_t size;
-    vm_page_t** pages;
     size_t page_count;
+    void* root;             /* vmo_page_node_t*; NULL until a page is committed */
+    uint32_t levels;
+    uint32_t flags;
+    size_t committed;       /* Slots in use, zero page and compressed included */
+    size_t compressed;      /* Slots holding compressed pages */
+    vm_spinlock_t lock;
 } vmo_t;
 
 zx_status_t vmo_bootstrap_init(vmo_t* vmo, pmm_arena_t* arena, size_t size);
+
+/*
+ * Makes |page_index| hold a page this VMO can write: commits a fresh page
+ * into a hole or over the zero page, expands a compressed page, and copies
+ * a copy-on-write page that is still shared. Contents are zeroed or copied
+ * through the arena's physmap when it has one.
+ */
 zx_status_t vmo_bootstrap_commit_page(vmo_t* vmo, pmm_arena_t* arena, size_t page_index);
+
+/*
+ * Maps the arena's zero page into every hole in [first_index,
+ * first_index + count), so reads of untouched memory allocate nothing.
+ */
+zx_status_t vmo_bootstrap_map_zero_pages(vmo_t* vmo, pmm_arena_t* arena, size_t first_index, size_t count);
+
+/*
+ * Initializes |out_child| as a copy-on-write clone of |parent|: both share
+ * every page until one of them writes it.
+ */
+zx_status_t vmo_bootstrap_clone(vmo_t* parent, vmo_t* out_child);
+
+/* Returns the resident page at |page_index|, or NULL. */
+vm_page_t* vmo_bootstrap_lookup(const vmo_t* vmo, size_t page_index);
+
+/*
+ * Returns the first resident page at or after |start| and stores its index
+ * in |out_index|, or returns NULL if there is none. Empty subtrees are
+ * skipped whole, so walking a sparse VMO costs its committed pages only.
+ */
+vm_page_t* vmo_bootstrap_next_page(const vmo_t* vmo, size_t start, size_t* out_index);
+
+/*
+ * Initializes |out| as a VMO of |src|'s size whose pages are |src|'s, with
+ * one more reference taken on each, compressed pages included. Nothing is
+ * copied.
+ */
+zx_status_t vmo_bootstrap_share_pages(const vmo_t* src, vmo_t* out);
+
+/*
+ * Moves the resident page at |page_index| out of the arena. A page of zeros
+ * is simply dropped, since a later read maps the zero page again, and
+ * |out_size| is set to 0; anything else is stored LZ4-compressed and
+ * |out_size| is its compressed size. Fails with ZX_ERR_NOT_SUPPORTED
+ * without a physmap, ZX_ERR_BAD_STATE for the zero page or a shared page,
+ * and ZX_ERR_BUFFER_TOO_SMALL if the page does not compress well enough.
+ */
+zx_status_t vmo_bootstrap_compress_page(vmo_t* vmo, pmm_arena_t* arena, size_t page_index,
+                                        size_t* out_size);
+
+/* Expands the compressed page at |page_index| back into a fresh page. */
+zx_status_t vmo_bootstrap_decompress_page(vmo_t* vmo, pmm_arena_t* arena, size_t page_index);
+
+bool vmo_bootstrap_is_compressed(const vmo_t* vmo, size_t page_index);
+
+/*
+ * Commits every uncommitted or zero page in [first_index, first_index +
+ * count), taking the pages from the arena in bulk. Either the whole range
+ * ends up committed or nothing new is. Shared pages are left as they are.
+ */
+zx_status_t vmo_bootstrap_commit_range(vmo_t* vmo, pmm_arena_t* arena, size_t first_index, size_t count);
 void vmo_bootstrap_destroy(vmo_t* vmo, pmm_arena_t* arena);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif